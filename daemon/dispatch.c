@@ -140,7 +140,7 @@ remoteSerializeError(struct qemud_client *client,
           program, version, procedure, type, serial,
           rerr->message ? *rerr->message : "(none)");
 
-    if (VIR_ALLOC(msg) < 0)
+    if (!(msg = qemudClientMessageNew(0)))
         goto fatal_error;
 
     /* Return header. */
@@ -151,7 +151,7 @@ remoteSerializeError(struct qemud_client *client,
     msg->hdr.serial = serial;
     msg->hdr.status = REMOTE_ERROR;
 
-    msg->bufferLength = sizeof(msg->buffer);
+    msg->bufferLength = QEMUD_CLIENT_MESSAGE_SIZE;
 
     /* Serialise the return header. */
     xdrmem_create (&xdr,
@@ -197,7 +197,7 @@ xdr_error:
     VIR_WARN("Failed to serialize remote error '%s' as XDR",
              rerr->message ? *rerr->message : "<unknown>");
     xdr_destroy(&xdr);
-    VIR_FREE(msg);
+    qemudClientMessageFree(msg);
 fatal_error:
     xdr_free((xdrproc_t)xdr_remote_error,  (char *)rerr);
     return -1;
@@ -226,7 +226,9 @@ remoteSerializeReplyError(struct qemud_client *client,
                                 req->prog,
                                 req->vers,
                                 req->proc,
-                                req->type == REMOTE_STREAM ? REMOTE_STREAM : REMOTE_REPLY,
+                                (req->type == REMOTE_STREAM ||
+                                 req->type == REMOTE_STREAM_HOLE) ?
+                                REMOTE_STREAM : REMOTE_REPLY,
                                 req->serial);
 }
 
@@ -301,7 +303,9 @@ remoteEncodeClientMessageHeader (struct qemud_client_message *msg)
     int ret = -1;
     unsigned int len = 0;
 
-    msg->bufferLength = sizeof(msg->buffer);
+    /* Replies never exceed REMOTE_MESSAGE_MAX, even when written
+     * into a buffer grown to carry stream data */
+    msg->bufferLength = QEMUD_CLIENT_MESSAGE_SIZE;
     msg->bufferOffset = 0;
 
     /* Format the header. */
@@ -403,6 +407,7 @@ remoteDispatchClientRequest(struct qemud_server *server,
         return remoteDispatchClientCall(server, client, msg, qemu_call);
 
     case REMOTE_STREAM:
+    case REMOTE_STREAM_HOLE:
         /* Since stream data is non-acked, async, we may continue to received
          * stream packets after we closed down a stream. Just drop & ignore
          * these.
@@ -424,7 +429,7 @@ error:
     ret = remoteSerializeReplyError(client, &rerr, &msg->hdr);
 
     if (ret >= 0)
-        VIR_FREE(msg);
+        qemudClientMessageFree(msg);
 
     return ret;
 }
@@ -611,75 +616,94 @@ rpc_error:
     rv = remoteSerializeReplyError(client, &rerr, &msg->hdr);
 
     if (rv >= 0)
-        VIR_FREE(msg);
+        qemudClientMessageFree(msg);
 
     return rv;
 }
 
 
-int
-remoteSendStreamData(struct qemud_client *client,
-                     struct qemud_client_stream *stream,
-                     const char *data,
-                     unsigned int len)
+/*
+ * @stream: the stream the message belongs to
+ * @type: REMOTE_STREAM, or REMOTE_STREAM_HOLE for a hole
+ * @status: REMOTE_CONTINUE for data, REMOTE_OK for finish confirmation
+ * @len: the most payload the caller will put in the message
+ *
+ * Allocates an outgoing stream message with the header already
+ * encoded, so data can be read straight into the buffer at
+ * msg->bufferOffset rather than copied there. The caller then
+ * hands it to remoteSendStreamMessage.
+ *
+ * Returns the message, or NULL upon fatal error
+ */
+struct qemud_client_message *
+remoteNewStreamMessage(struct qemud_client_stream *stream,
+                       int type,
+                       int status,
+                       unsigned int len)
 {
     struct qemud_client_message *msg;
-    XDR xdr;
 
-    VIR_DEBUG("client=%p stream=%p data=%p len=%d", client, stream, data, len);
-
-    if (VIR_ALLOC(msg) < 0) {
-        return -1;
-    }
+    if (!(msg = qemudClientMessageNew(REMOTE_MESSAGE_HEADER_XDR_LEN +
+                                      REMOTE_MESSAGE_HEADER_MAX + len)))
+        return NULL;
 
-    /* Return header. We're re-using same message object, so
-     * only need to tweak type/status fields */
     msg->hdr.prog = REMOTE_PROGRAM;
     msg->hdr.vers = REMOTE_PROTOCOL_VERSION;
     msg->hdr.proc = stream->procedure;
-    msg->hdr.type = REMOTE_STREAM;
+    msg->hdr.type = type;
     msg->hdr.serial = stream->serial;
-    /*
-     * NB
-     *   data != NULL + len > 0    => REMOTE_CONTINUE   (Sending back data)
-     *   data != NULL + len == 0   => REMOTE_CONTINUE   (Sending read EOF)
-     *   data == NULL              => REMOTE_OK         (Sending finish handshake confirmation)
-     */
-    msg->hdr.status = data ? REMOTE_CONTINUE : REMOTE_OK;
+    msg->hdr.status = status;
 
-    if (remoteEncodeClientMessageHeader(msg) < 0)
-        goto fatal_error;
-
-    if (data && len) {
-        if ((msg->bufferLength - msg->bufferOffset) < len)
-            goto fatal_error;
+    if (remoteEncodeClientMessageHeader(msg) < 0) {
+        qemudClientMessageFree(msg);
+        VIR_WARN("Failed to serialize stream header for proc %d as XDR",
+                 stream->procedure);
+        return NULL;
+    }
 
-        /* Now for the payload */
-        xdrmem_create (&xdr,
-                       msg->buffer,
-                       msg->bufferLength,
-                       XDR_ENCODE);
+    return msg;
+}
 
-        /* Skip over existing header already written */
-        if (xdr_setpos(&xdr, msg->bufferOffset) == 0)
-            goto xdr_error;
 
-        memcpy(msg->buffer + msg->bufferOffset, data, len);
-        msg->bufferOffset += len;
+/*
+ * @client: a locked client object
+ * @msg: a message from remoteNewStreamMessage
+ * @len: the amount of payload filled in after the header
+ *
+ * Writes the final length word and queues the message for
+ * transmission. Data messages count against the stream's
+ * transmit window until they have been written out; holes
+ * are too small to bother.
+ *
+ * Returns 0 if queued, -1 upon fatal error
+ */
+int
+remoteSendStreamMessage(struct qemud_client *client,
+                        struct qemud_client_message *msg,
+                        unsigned int len)
+{
+    XDR xdr;
 
-        /* Update the length word. */
-        len = msg->bufferOffset;
-        if (xdr_setpos (&xdr, 0) == 0)
-            goto xdr_error;
+    if (len > msg->bufferSize - msg->bufferOffset)
+        goto error;
 
-        if (!xdr_u_int (&xdr, &len))
-            goto xdr_error;
+    msg->bufferOffset += len;
+    len = msg->bufferOffset;
 
+    xdrmem_create (&xdr,
+                   msg->buffer,
+                   REMOTE_MESSAGE_HEADER_XDR_LEN,
+                   XDR_ENCODE);
+    if (!xdr_u_int (&xdr, &len)) {
         xdr_destroy (&xdr);
-
-        VIR_DEBUG("Total %d", msg->bufferOffset);
+        goto error;
     }
-    if (data)
+    xdr_destroy (&xdr);
+
+    VIR_DEBUG("Total %d", msg->bufferOffset);
+
+    if (msg->hdr.type == REMOTE_STREAM &&
+        msg->hdr.status == REMOTE_CONTINUE)
         msg->streamTX = 1;
 
     /* Reset ready for I/O */
@@ -692,11 +716,89 @@ remoteSendStreamData(struct qemud_client *client,
 
     return 0;
 
-xdr_error:
-    xdr_destroy (&xdr);
-fatal_error:
-    VIR_FREE(msg);
+error:
     VIR_WARN("Failed to serialize stream data for proc %d as XDR",
-             stream->procedure);
+             msg->hdr.proc);
+    qemudClientMessageFree(msg);
     return -1;
 }
+
+
+int
+remoteSendStreamData(struct qemud_client *client,
+                     struct qemud_client_stream *stream,
+                     const char *data,
+                     unsigned int len)
+{
+    struct qemud_client_message *msg;
+
+    VIR_DEBUG("client=%p stream=%p data=%p len=%d", client, stream, data, len);
+
+    /*
+     * NB
+     *   data != NULL + len > 0    => REMOTE_CONTINUE   (Sending back data)
+     *   data != NULL + len == 0   => REMOTE_CONTINUE   (Sending read EOF)
+     *   data == NULL              => REMOTE_OK         (Sending finish handshake confirmation)
+     */
+    if (!data)
+        len = 0;
+
+    if (!(msg = remoteNewStreamMessage(stream,
+                                       REMOTE_STREAM,
+                                       data ? REMOTE_CONTINUE : REMOTE_OK,
+                                       len)))
+        return -1;
+
+    if (len)
+        memcpy(msg->buffer + msg->bufferOffset, data, len);
+
+    return remoteSendStreamMessage(client, msg, len);
+}
+
+
+/*
+ * @client: a locked client object
+ * @stream: the sparse stream the hole is in
+ * @length: size of the hole
+ *
+ * Queues a hole packet for transmission to the client
+ *
+ * Returns 0 if queued, -1 upon fatal error
+ */
+int
+remoteSendStreamHole(struct qemud_client *client,
+                     struct qemud_client_stream *stream,
+                     long long length)
+{
+    struct qemud_client_message *msg;
+    remote_stream_hole hole;
+    XDR xdr;
+    unsigned int len;
+
+    VIR_DEBUG("client=%p stream=%p length=%lld", client, stream, length);
+
+    if (!(msg = remoteNewStreamMessage(stream,
+                                       REMOTE_STREAM_HOLE,
+                                       REMOTE_CONTINUE,
+                                       sizeof(hole))))
+        return -1;
+
+    memset(&hole, 0, sizeof hole);
+    hole.length = length;
+
+    xdrmem_create (&xdr,
+                   msg->buffer + msg->bufferOffset,
+                   msg->bufferSize - msg->bufferOffset,
+                   XDR_ENCODE);
+    if (!xdr_remote_stream_hole (&xdr, &hole)) {
+        xdr_destroy (&xdr);
+        VIR_WARN("Failed to serialize stream hole for proc %d as XDR",
+                 stream->procedure);
+        qemudClientMessageFree(msg);
+        return -1;
+    }
+    len = xdr_getpos (&xdr);
+    xdr_destroy (&xdr);
+
+    return remoteSendStreamMessage(client, msg, len);
+}
@@ -61,10 +61,25 @@ remoteSerializeStreamError(struct qemud_client *client,
                            int serial);
 
 
+struct qemud_client_message *
+remoteNewStreamMessage(struct qemud_client_stream *stream,
+                       int type,
+                       int status,
+                       unsigned int len);
+int
+remoteSendStreamMessage(struct qemud_client *client,
+                        struct qemud_client_message *msg,
+                        unsigned int len);
+
 int
 remoteSendStreamData(struct qemud_client *client,
                      struct qemud_client_stream *stream,
                      const char *data,
                      unsigned int len);
 
+int
+remoteSendStreamHole(struct qemud_client *client,
+                     struct qemud_client_stream *stream,
+                     long long length);
+
 #endif /* __LIBVIRTD_DISPATCH_H__ */
@@ -26,6 +26,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -269,7 +270,60 @@ static void sig_fatal(int sig, siginfo_t * siginfo ATTRIBUTE_UNUSED,
 
 static void qemudDispatchClientEvent(int watch, int fd, int events, void *opaque);
 static void qemudDispatchServerEvent(int watch, int fd, int events, void *opaque);
-static int qemudStartWorker(struct qemud_server *server, struct qemud_worker *worker);
+
+/*
+ * Allocates a message able to hold a complete packet of @size
+ * bytes, including the length word. The buffer is never smaller
+ * than an ordinary RPC message, since replies are encoded into
+ * the buffer which carried the call.
+ */
+struct qemud_client_message *
+qemudClientMessageNew(unsigned int size)
+{
+    struct qemud_client_message *msg;
+
+    if (size < QEMUD_CLIENT_MESSAGE_SIZE)
+        size = QEMUD_CLIENT_MESSAGE_SIZE;
+
+    if (VIR_ALLOC(msg) < 0)
+        return NULL;
+
+    if (VIR_ALLOC_N(msg->buffer, size) < 0) {
+        VIR_FREE(msg);
+        return NULL;
+    }
+    msg->bufferSize = size;
+
+    return msg;
+}
+
+/*
+ * Grows the buffer of @msg to hold at least @size bytes, keeping
+ * whatever has been read into it so far
+ */
+int
+qemudClientMessageReserve(struct qemud_client_message *msg,
+                          unsigned int size)
+{
+    if (size <= msg->bufferSize)
+        return 0;
+
+    if (VIR_REALLOC_N(msg->buffer, size) < 0)
+        return -1;
+    msg->bufferSize = size;
+
+    return 0;
+}
+
+void
+qemudClientMessageFree(struct qemud_client_message *msg)
+{
+    if (!msg)
+        return;
+
+    VIR_FREE(msg->buffer);
+    VIR_FREE(msg);
+}
 
 void
 qemudClientMessageQueuePush(struct qemud_client_message **queue,
@@ -887,17 +941,9 @@ static struct qemud_server *qemudInitialize(void) {
         VIR_FREE(server);
         return NULL;
     }
-    if (virCondInit(&server->job) < 0) {
-        VIR_ERROR0(_("cannot initialize condition variable"));
-        virMutexDestroy(&server->lock);
-        VIR_FREE(server);
-        return NULL;
-    }
 
     if (virEventRegisterDefaultImpl() < 0) {
         virMutexDestroy(&server->lock);
-        if (virCondDestroy(&server->job) < 0)
-        {}
         VIR_FREE(server);
         return NULL;
     }
@@ -1298,7 +1344,7 @@ remoteCheckAccess (struct qemud_client *client)
         return -1;
     }
 
-    if (VIR_ALLOC(confirm) < 0)
+    if (!(confirm = qemudClientMessageNew(0)))
         return -1;
 
     /* Checks have succeeded.  Write a '\1' byte back to the client to
@@ -1411,6 +1457,10 @@ static int qemudDispatchServer(struct qemud_server *server, struct qemud_socket
         VIR_ERROR0(_("cannot initialize mutex"));
         goto error;
     }
+    if (virMutexInit(&client->eventLock) < 0) {
+        VIR_ERROR0(_("cannot initialize mutex"));
+        goto error;
+    }
 
     client->magic = QEMUD_CLIENT_MAGIC;
     client->fd = fd;
@@ -1426,7 +1476,7 @@ static int qemudDispatchServer(struct qemud_server *server, struct qemud_socket
     }
 
     /* Prepare one for packet receive */
-    if (VIR_ALLOC(client->rx) < 0)
+    if (!(client->rx = qemudClientMessageNew(0)))
         goto error;
     client->rx->bufferLength = REMOTE_MESSAGE_HEADER_XDR_LEN;
 
@@ -1494,19 +1544,6 @@ static int qemudDispatchServer(struct qemud_server *server, struct qemud_socket
 
     server->clients[server->nclients++] = client;
 
-    if (server->nclients > server->nactiveworkers &&
-        server->nactiveworkers < server->nworkers) {
-        for (i = 0 ; i < server->nworkers ; i++) {
-            if (!server->workers[i].hasThread) {
-                if (qemudStartWorker(server, &server->workers[i]) < 0)
-                    return -1;
-                server->nactiveworkers++;
-                break;
-            }
-        }
-    }
-
-
     return 0;
 
 error:
@@ -1514,7 +1551,7 @@ error:
         if (client->tlssession) gnutls_deinit (client->tlssession);
         if (client) {
             VIR_FREE(client->addrstr);
-            VIR_FREE(client->rx);
+            qemudClientMessageFree(client->rx);
         }
         VIR_FREE(client);
     }
@@ -1571,104 +1608,177 @@ void qemudDispatchClientFailure(struct qemud_client *client) {
 }
 
 
+static unsigned long long qemudTimeMs(void)
+{
+    struct timeval now;
+
+    if (gettimeofday(&now, NULL) < 0)
+        return 0;
+
+    return (now.tv_sec * 1000ull) + (now.tv_usec / 1000);
+}
+
+/*
+ * Append client to the tail of the ready queue, unless it is
+ * already on it, and queue a job on the worker pool to deal
+ * with it. Each job serves whichever client is at the head
+ * of the queue when it runs, so there is always at least one
+ * job queued per client on it.
+ *
+ * Caller must hold server lock and client lock
+ */
+static int qemudClientReadyPush(struct qemud_server *server,
+                                struct qemud_client *client)
+{
+    if (client->ready)
+        return 0;
+
+    /* Tell one of the workers to get on with it... */
+    if (virThreadPoolSendJob(server->workerPool, server) < 0)
+        return -1;
+
+    client->ready = 1;
+    client->readyNext = NULL;
+    client->readySince = qemudTimeMs();
+
+    if (server->readyTail)
+        server->readyTail->readyNext = client;
+    else
+        server->readyHead = client;
+    server->readyTail = client;
+
+    server->nready++;
+    if (server->nready > server->nreadyMax)
+        server->nreadyMax = server->nready;
+
+    return 0;
+}
+
 /* Caller must hold server lock */
-static struct qemud_client *qemudPendingJob(struct qemud_server *server)
+static struct qemud_client *qemudClientReadyPop(struct qemud_server *server)
 {
-    int i;
-    for (i = 0 ; i < server->nclients ; i++) {
-        virMutexLock(&server->clients[i]->lock);
-        if (server->clients[i]->dx) {
-            /* Delibrately don't unlock client - caller wants the lock */
-            return server->clients[i];
-        }
-        virMutexUnlock(&server->clients[i]->lock);
+    struct qemud_client *client = server->readyHead;
+
+    if (!client)
+        return NULL;
+
+    server->readyHead = client->readyNext;
+    if (!server->readyHead)
+        server->readyTail = NULL;
+
+    client->readyNext = NULL;
+    client->ready = 0;
+    server->nready--;
+
+    return client;
+}
+
+/* Caller must hold server lock */
+static void qemudClientReadyRemove(struct qemud_server *server,
+                                   struct qemud_client *client)
+{
+    struct qemud_client *tmp = server->readyHead;
+    struct qemud_client *prev = NULL;
+
+    if (!client->ready)
+        return;
+
+    while (tmp && tmp != client) {
+        prev = tmp;
+        tmp = tmp->readyNext;
     }
-    return NULL;
+    if (!tmp)
+        return;
+
+    if (prev)
+        prev->readyNext = client->readyNext;
+    else
+        server->readyHead = client->readyNext;
+    if (server->readyTail == client)
+        server->readyTail = prev;
+
+    client->readyNext = NULL;
+    client->ready = 0;
+    server->nready--;
 }
 
-static void *qemudWorker(void *data)
+/*
+ * Take the next client off the ready queue. A client only
+ * gets one message dispatched per turn: if it has more
+ * waiting, it goes back on the tail of the queue so one busy
+ * connection can't starve the others.
+ *
+ * Caller must hold server lock
+ */
+static struct qemud_client *qemudPendingJob(struct qemud_server *server)
 {
-    struct qemud_worker *worker = data;
-    struct qemud_server *server = worker->server;
+    struct qemud_client *client;
 
-    while (1) {
-        struct qemud_client *client = NULL;
-        struct qemud_client_message *msg;
+    while ((client = qemudClientReadyPop(server)) != NULL) {
+        unsigned long long wait;
 
-        virMutexLock(&server->lock);
-        while ((client = qemudPendingJob(server)) == NULL) {
-            if (worker->quitRequest ||
-                virCondWait(&server->job, &server->lock) < 0) {
-                virMutexUnlock(&server->lock);
-                return NULL;
-            }
-        }
-        if (worker->quitRequest) {
+        virMutexLock(&client->lock);
+        if (!client->dx) {
             virMutexUnlock(&client->lock);
-            virMutexUnlock(&server->lock);
-            return NULL;
+            continue;
         }
-        worker->processingCall = 1;
-        virMutexUnlock(&server->lock);
 
-        /* We own a locked client now... */
-        client->refs++;
+        wait = qemudTimeMs() - client->readySince;
+        server->njobs++;
+        server->jobWaitTotal += wait;
+        if (wait > server->jobWaitMax)
+            server->jobWaitMax = wait;
+        PROBE(CLIENT_JOB_DISPATCH, "fd=%d, queued=%zu, wait=%llu",
+              client->fd, server->nready, wait);
 
-        /* Remove our message from dispatch queue while we use it */
-        msg = qemudClientMessageQueueServe(&client->dx);
-
-        /* This function drops the lock during dispatch,
-         * and re-acquires it before returning */
-        if (remoteDispatchClientRequest (server, client, msg) < 0) {
-            VIR_FREE(msg);
+        if (client->dx->next &&
+            qemudClientReadyPush(server, client) < 0) {
+            VIR_ERROR0(_("Failed to queue client request"));
             qemudDispatchClientFailure(client);
-            client->refs--;
             virMutexUnlock(&client->lock);
             continue;
         }
 
-        client->refs--;
-        virMutexUnlock(&client->lock);
-
-        virMutexLock(&server->lock);
-        worker->processingCall = 0;
-        virMutexUnlock(&server->lock);
+        /* Delibrately don't unlock client - caller wants the lock */
+        return client;
     }
+    return NULL;
 }
 
-static int
-qemudStartWorker(struct qemud_server *server,
-                 struct qemud_worker *worker)
+/*
+ * Run by the thread pool to dispatch one message for the
+ * client at the head of the ready queue. A job may find the
+ * queue empty if the client it was queued for has since
+ * failed, or been served by an earlier job.
+ */
+static void qemudWorkerDispatch(void *jobdata ATTRIBUTE_UNUSED, void *opaque)
 {
-    pthread_attr_t attr;
-    int ret = -1;
+    struct qemud_server *server = opaque;
+    struct qemud_client *client;
+    struct qemud_client_message *msg;
 
-    if (pthread_attr_init(&attr) != 0)
-        return -1;
-    /* We want to join workers, so don't detach them */
-    /*pthread_attr_setdetachstate(&attr, 1);*/
+    virMutexLock(&server->lock);
+    if (!(client = qemudPendingJob(server))) {
+        virMutexUnlock(&server->lock);
+        return;
+    }
+    virMutexUnlock(&server->lock);
 
-    if (worker->hasThread)
-        goto cleanup;
+    /* We own a locked client now... */
+    client->refs++;
 
-    worker->server = server;
-    worker->hasThread = 1;
-    worker->quitRequest = 0;
-    worker->processingCall = 0;
+    /* Remove our message from dispatch queue while we use it */
+    msg = qemudClientMessageQueueServe(&client->dx);
 
-    if (pthread_create(&worker->thread,
-                       &attr,
-                       qemudWorker,
-                       worker) != 0) {
-        worker->hasThread = 0;
-        worker->server = NULL;
-        goto cleanup;
+    /* This function drops the lock during dispatch,
+     * and re-acquires it before returning */
+    if (remoteDispatchClientRequest(server, client, msg) < 0) {
+        qemudClientMessageFree(msg);
+        qemudDispatchClientFailure(client);
     }
 
-    ret = 0;
-cleanup:
-    pthread_attr_destroy(&attr);
-    return ret;
+    client->refs--;
+    virMutexUnlock(&client->lock);
 }
 
 
@@ -1860,7 +1970,10 @@ readmore:
         /* Length includes the size of the length word itself */
         len -= REMOTE_MESSAGE_HEADER_XDR_LEN;
 
-        if (len > REMOTE_MESSAGE_MAX) {
+        /* Only stream data may use the larger frames, which
+         * is checked once the header has been decoded */
+        if (len > REMOTE_MESSAGE_MAX &&
+            !(client->streamFrames && len <= REMOTE_STREAM_MESSAGE_MAX)) {
             VIR_DEBUG("Packet length %u too large", len);
             qemudDispatchClientFailure(client);
             return;
@@ -1868,6 +1981,11 @@ readmore:
 
         /* Prepare to read rest of message */
         client->rx->bufferLength += len;
+        if (qemudClientMessageReserve(client->rx,
+                                      client->rx->bufferLength) < 0) {
+            qemudDispatchClientFailure(client);
+            return;
+        }
 
         qemudUpdateClientEvent(client);
 
@@ -1881,9 +1999,12 @@ readmore:
         struct qemud_client_filter *filter;
 
         /* Decode the header so we can use it for routing decisions */
-        if (remoteDecodeClientMessageHeader(msg) < 0) {
-            VIR_FREE(msg);
+        if (remoteDecodeClientMessageHeader(msg) < 0 ||
+            (msg->bufferLength > QEMUD_CLIENT_MESSAGE_SIZE &&
+             msg->hdr.type != REMOTE_STREAM)) {
+            qemudClientMessageFree(msg);
             qemudDispatchClientFailure(client);
+            return;
         }
 
         /* Check if any filters match this message */
@@ -1895,7 +2016,7 @@ readmore:
                 msg = NULL;
                 break;
             } else if (ret == -1) {
-                VIR_FREE(msg);
+                qemudClientMessageFree(msg);
                 qemudDispatchClientFailure(client);
                 return;
             }
@@ -1909,16 +2030,13 @@ readmore:
 
         /* Possibly need to create another receive buffer */
         if ((client->nrequests < max_client_requests &&
-             VIR_ALLOC(client->rx) < 0)) {
+             !(client->rx = qemudClientMessageNew(0)))) {
             qemudDispatchClientFailure(client);
         } else {
             if (client->rx)
                 client->rx->bufferLength = REMOTE_MESSAGE_HEADER_XDR_LEN;
 
             qemudUpdateClientEvent(client);
-
-            /* Tell one of the workers to get on with it... */
-            virCondSignal(&server->job);
         }
     }
 }
@@ -2071,13 +2189,19 @@ qemudClientMessageRelease(struct qemud_client *client,
     /* See if the recv queue is currently throttled */
     if (!client->rx &&
         client->nrequests < max_client_requests) {
-        /* Reset message record for next RX attempt */
+        /* Reset message record for next RX attempt, keeping
+         * the buffer itself */
+        char *buffer = msg->buffer;
+        unsigned int bufferSize = msg->bufferSize;
+
         memset(msg, 0, sizeof(*msg));
+        msg->buffer = buffer;
+        msg->bufferSize = bufferSize;
         client->rx = msg;
         /* Get ready to receive next message */
         client->rx->bufferLength = REMOTE_MESSAGE_HEADER_XDR_LEN;
     } else {
-        VIR_FREE(msg);
+        qemudClientMessageFree(msg);
     }
 
     qemudUpdateClientEvent(client);
@@ -2189,7 +2313,24 @@ qemudDispatchClientEvent(int watch, int fd, int events, void *opaque) {
                   VIR_EVENT_HANDLE_HANGUP))
         qemudDispatchClientFailure(client);
 
+    if (!client->dx) {
+        virMutexUnlock(&client->lock);
+        return;
+    }
+
+    /* New work arrived, so queue the client for a worker. Lock
+     * ordering requires the server lock be taken first; the client
+     * can't go away meanwhile, since only this thread frees them */
+    virMutexUnlock(&client->lock);
+    virMutexLock(&server->lock);
+    virMutexLock(&client->lock);
+    if (client->dx &&
+        qemudClientReadyPush(server, client) < 0) {
+        VIR_ERROR0(_("Failed to queue client request"));
+        qemudDispatchClientFailure(client);
+    }
     virMutexUnlock(&client->lock);
+    virMutexUnlock(&server->lock);
 }
 
 
@@ -2306,21 +2447,43 @@ static void qemudInactiveTimer(int timerid, void *data) {
     }
 }
 
+/* How often to log the dispatch statistics, in milliseconds */
+#define QEMUD_DISPATCH_STATS_INTERVAL (10 * 60 * 1000)
+
+static void qemudDispatchStatsTimer(int timerid ATTRIBUTE_UNUSED,
+                                    void *data) {
+    struct qemud_server *server = (struct qemud_server *)data;
+    static unsigned long long lastJobs;
+
+    virMutexLock(&server->lock);
+    /* Stay quiet while no requests are coming in */
+    if (server->njobs != lastJobs) {
+        lastJobs = server->njobs;
+        VIR_INFO("Served %llu client messages, %zu clients queued, "
+                 "peak queue depth %zu, average wait %llu ms, "
+                 "max wait %llu ms",
+                 server->njobs, server->nready, server->nreadyMax,
+                 server->jobWaitTotal / server->njobs,
+                 server->jobWaitMax);
+    }
+    virMutexUnlock(&server->lock);
+}
+
 static void qemudFreeClient(struct qemud_client *client) {
     while (client->rx) {
         struct qemud_client_message *msg
             = qemudClientMessageQueueServe(&client->rx);
-        VIR_FREE(msg);
+        qemudClientMessageFree(msg);
     }
     while (client->dx) {
         struct qemud_client_message *msg
             = qemudClientMessageQueueServe(&client->dx);
-        VIR_FREE(msg);
+        qemudClientMessageFree(msg);
     }
     while (client->tx) {
         struct qemud_client_message *msg
             = qemudClientMessageQueueServe(&client->tx);
-        VIR_FREE(msg);
+        qemudClientMessageFree(msg);
     }
 
     while (client->streams)
@@ -2329,6 +2492,7 @@ static void qemudFreeClient(struct qemud_client *client) {
     if (client->conn)
         virConnectClose(client->conn);
     virMutexDestroy(&client->lock);
+    virMutexDestroy(&client->eventLock);
     VIR_FREE(client->addrstr);
     VIR_FREE(client);
 }
@@ -2336,8 +2500,10 @@ static void qemudFreeClient(struct qemud_client *client) {
 static void *qemudRunLoop(void *opaque) {
     struct qemud_server *server = opaque;
     int timerid = -1;
+    int statsTimer;
     int i;
     int timerActive = 0;
+    virThreadPoolStats stats;
 
     virMutexLock(&server->lock);
 
@@ -2352,17 +2518,20 @@ static void *qemudRunLoop(void *opaque) {
     if (min_workers > max_workers)
         max_workers = min_workers;
 
-    server->nworkers = max_workers;
-    if (VIR_ALLOC_N(server->workers, server->nworkers) < 0) {
-        VIR_ERROR0(_("Failed to allocate workers"));
+    /* Workers are started on demand up to max_workers,
+     * and retire again when idle down to min_workers */
+    if (!(server->workerPool = virThreadPoolNew(min_workers, max_workers,
+                                                qemudWorkerDispatch,
+                                                server))) {
+        VIR_ERROR0(_("Failed to create worker pool"));
+        virMutexUnlock(&server->lock);
         return NULL;
     }
 
-    for (i = 0 ; i < min_workers ; i++) {
-        if (qemudStartWorker(server, &server->workers[i]) < 0)
-            goto cleanup;
-        server->nactiveworkers++;
-    }
+    if ((statsTimer = virEventAddTimeout(QEMUD_DISPATCH_STATS_INTERVAL,
+                                         qemudDispatchStatsTimer,
+                                         server, NULL)) < 0)
+        VIR_WARN0("Failed to register dispatch statistics timer");
 
     for (;!server->quitEventThread;) {
         /* A shutdown timeout is specified, so check
@@ -2401,7 +2570,13 @@ static void *qemudRunLoop(void *opaque) {
             inactive = server->clients[i]->fd == -1
                 && server->clients[i]->refs == 0;
             virMutexUnlock(&server->clients[i]->lock);
+            /* Event callbacks may still be running after being
+             * deregistered, until their freecb says otherwise */
+            virMutexLock(&server->clients[i]->eventLock);
+            inactive = inactive && server->clients[i]->eventRefs == 0;
+            virMutexUnlock(&server->clients[i]->eventLock);
             if (inactive) {
+                qemudClientReadyRemove(server, server->clients[i]);
                 qemudFreeClient(server->clients[i]);
                 server->nclients--;
                 if (i < server->nclients)
@@ -2414,42 +2589,30 @@ static void *qemudRunLoop(void *opaque) {
                 goto reprocess;
             }
         }
-
-        /* If number of active workers exceeds both the min_workers
-         * threshold and the number of clients, then kill some
-         * off */
-        for (i = 0 ; (i < server->nworkers &&
-                      server->nactiveworkers > server->nclients &&
-                      server->nactiveworkers > min_workers) ; i++) {
-
-            if (server->workers[i].hasThread &&
-                !server->workers[i].processingCall) {
-                server->workers[i].quitRequest = 1;
-
-                virCondBroadcast(&server->job);
-                virMutexUnlock(&server->lock);
-                pthread_join(server->workers[i].thread, NULL);
-                virMutexLock(&server->lock);
-                server->workers[i].hasThread = 0;
-                server->nactiveworkers--;
-            }
-        }
     }
 
-cleanup:
-    for (i = 0 ; i < server->nworkers ; i++) {
-        if (!server->workers[i].hasThread)
-            continue;
+    if (statsTimer >= 0)
+        virEventRemoveTimeout(statsTimer);
 
-        server->workers[i].quitRequest = 1;
-        virCondBroadcast(&server->job);
+    /* Wait for jobs in progress to finish before
+     * freeing the clients they are running for */
+    virThreadPoolGetStats(server->workerPool, &stats);
+    VIR_DEBUG("Dispatched %llu jobs (%llu stolen) with %zu workers, "
+              "average wait %llu us, max wait %llu us",
+              stats.nJobs, stats.nSteals, stats.nWorkers,
+              stats.waitAvg, stats.waitMax);
+    VIR_DEBUG("Served %llu client messages, peak queue depth %zu, "
+              "average wait %llu ms, max wait %llu ms",
+              server->njobs, server->nreadyMax,
+              server->njobs ? server->jobWaitTotal / server->njobs : 0,
+              server->jobWaitMax);
+    virMutexUnlock(&server->lock);
+    virThreadPoolFree(server->workerPool);
+    virMutexLock(&server->lock);
+    server->workerPool = NULL;
+    server->readyHead = server->readyTail = NULL;
+    server->nready = 0;
 
-        virMutexUnlock(&server->lock);
-        pthread_join(server->workers[i].thread, NULL);
-        virMutexLock(&server->lock);
-        server->workers[i].hasThread = 0;
-    }
-    VIR_FREE(server->workers);
     for (i = 0; i < server->nclients; i++)
         qemudFreeClient(server->clients[i]);
     server->nclients = 0;
@@ -2530,9 +2693,6 @@ static void qemudCleanup(struct qemud_server *server) {
 
     virStateCleanup();
 
-    if (virCondDestroy(&server->job) < 0) {
-        ;
-    }
     virMutexDestroy(&server->lock);
 
     VIR_FREE(server);
@@ -2723,6 +2883,7 @@ qemudSetLogging(struct qemud_server *server, virConfPtr conf,
 {
     int log_level = 0;
     int log_buffer_size = 64;
+    int log_async = 0;
     char *log_filters = NULL;
     char *log_outputs = NULL;
     char *log_file = NULL;
@@ -2799,6 +2960,14 @@ qemudSetLogging(struct qemud_server *server, virConfPtr conf,
     if ((verbose) && (virLogGetDefaultPriority() > VIR_LOG_INFO))
         virLogSetDefaultPriority(VIR_LOG_INFO);
 
+    /*
+     * Optionally write the logs from a dedicated thread, so that workers
+     * don't serialize on the outputs when debugging is enabled
+     */
+    GET_CONF_INT (conf, filename, log_async);
+    if (log_async && virLogSetAsync(true) < 0)
+        VIR_INFO0(_("Asynchronous logging is not available"));
+
     ret = 0;
 
 free_and_fail:
@@ -48,6 +48,7 @@
 # include "qemu_protocol.h"
 # include "logging.h"
 # include "threads.h"
+# include "threadpool.h"
 # include "network.h"
 
 # if WITH_DTRACE
@@ -141,8 +142,15 @@ enum qemud_sock_type {
     QEMUD_SOCK_TYPE_TLS = 2,
 };
 
+/* Room for the length word plus the largest ordinary RPC message */
+# define QEMUD_CLIENT_MESSAGE_SIZE \
+    (REMOTE_MESSAGE_MAX + REMOTE_MESSAGE_HEADER_XDR_LEN)
+
 struct qemud_client_message {
-    char buffer [REMOTE_MESSAGE_MAX + REMOTE_MESSAGE_HEADER_XDR_LEN];
+    /* bufferSize bytes, never less than QEMUD_CLIENT_MESSAGE_SIZE.
+     * Only stream data messages are ever grown beyond that */
+    char *buffer;
+    unsigned int bufferSize;
     unsigned int bufferLength;
     unsigned int bufferOffset;
 
@@ -175,11 +183,12 @@ struct qemud_client_stream {
 
     unsigned int recvEOF : 1;
     unsigned int closed : 1;
+    unsigned int sparse : 1; /* Send holes to the client as such */
 
     struct qemud_client_filter filter;
 
     struct qemud_client_message *rx;
-    int tx;
+    int tx; /* Data messages that may still be queued for TX */
 
     struct qemud_client_stream *next;
 };
@@ -194,6 +203,7 @@ struct qemud_client {
     int watch;
     unsigned int readonly :1;
     unsigned int closing :1;
+    unsigned int streamFrames :1; /* REMOTE_STREAM_MESSAGE_MAX negotiated */
     int domainEventCallbackID[VIR_DOMAIN_EVENT_ID_LAST];
 
     virSocketAddr addr;
@@ -237,6 +247,12 @@ struct qemud_client {
     /* Data streams */
     struct qemud_client_stream *streams;
 
+    /* Link in the server's ready queue, used while the
+     * client has messages in 'dx' waiting for a worker.
+     * Protected by the server lock, not the client lock */
+    struct qemud_client *readyNext;
+    unsigned int ready :1;
+    unsigned long long readySince; /* ms since epoch when queued */
 
     /* This is only valid if a remote open call has been made on this
      * connection, otherwise it will be NULL.  Also if remote close is
@@ -245,6 +261,11 @@ struct qemud_client {
     virConnectPtr conn;
     int refs;
 
+    /* Domain event callbacks given this client as their opaque data
+     * whose freecb has yet to run. Guarded by eventLock rather than
+     * lock, since some drivers run the freecb with lock held */
+    virMutex eventLock;
+    int eventRefs;
 };
 
 # define QEMUD_CLIENT_MAGIC 0x7788aaee
@@ -265,32 +286,32 @@ struct qemud_socket {
     struct qemud_socket *next;
 };
 
-struct qemud_worker {
-    pthread_t thread;
-    unsigned int hasThread :1;
-    unsigned int processingCall :1;
-    unsigned int quitRequest :1;
-
-    /* back-pointer to our server */
-    struct qemud_server *server;
-};
-
 /* Main server state */
 struct qemud_server {
     virMutex lock;
-    virCond job;
 
     int privileged;
 
-    size_t nworkers;
-    size_t nactiveworkers;
-    struct qemud_worker *workers;
+    virThreadPoolPtr workerPool;
+
     size_t nsockets;
     struct qemud_socket *sockets;
     size_t nclients;
     size_t nclients_max;
     struct qemud_client **clients;
 
+    /* FIFO of clients with messages waiting in their 'dx'
+     * queue, so workers don't need to scan 'clients' */
+    struct qemud_client *readyHead;
+    struct qemud_client *readyTail;
+    size_t nready;
+
+    /* Dispatch statistics */
+    size_t nreadyMax;            /* Peak ready queue depth */
+    unsigned long long njobs;    /* Messages handed to workers */
+    unsigned long long jobWaitTotal; /* Total ms spent queued */
+    unsigned long long jobWaitMax;   /* Longest ms spent queued */
+
     int sigread;
     int sigwrite;
     char *logDir;
@@ -325,6 +346,14 @@ qemudClientMessageQueuePush(struct qemud_client_message **queue,
 struct qemud_client_message *
 qemudClientMessageQueueServe(struct qemud_client_message **queue);
 
+struct qemud_client_message *
+qemudClientMessageNew(unsigned int size);
+int
+qemudClientMessageReserve(struct qemud_client_message *msg,
+                          unsigned int size);
+void
+qemudClientMessageFree(struct qemud_client_message *msg);
+
 void
 qemudClientMessageRelease(struct qemud_client *client,
                           struct qemud_client_message *msg);
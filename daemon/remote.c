@@ -122,6 +122,28 @@ remoteDispatchDomainEventSend (struct qemud_client *client,
                                xdrproc_t proc,
                                void *data);
 
+/*
+ * Each relay callback holds a reference on its client, since it may
+ * still be running for a while after being deregistered
+ */
+static void
+remoteRelayDomainEventRef(struct qemud_client *client)
+{
+    virMutexLock(&client->eventLock);
+    client->eventRefs++;
+    virMutexUnlock(&client->eventLock);
+}
+
+static void
+remoteRelayDomainEventFree(void *opaque)
+{
+    struct qemud_client *client = opaque;
+
+    virMutexLock(&client->eventLock);
+    client->eventRefs--;
+    virMutexUnlock(&client->eventLock);
+}
+
 static int remoteRelayDomainEventLifecycle(virConnectPtr conn ATTRIBUTE_UNUSED,
                                            virDomainPtr dom,
                                            int event,
@@ -457,13 +479,31 @@ remoteDispatchClose (struct qemud_server *server ATTRIBUTE_UNUSED,
 }
 
 static int
-remoteDispatchSupportsFeature (struct qemud_server *server ATTRIBUTE_UNUSED,
-                               struct qemud_client *client ATTRIBUTE_UNUSED,
+remoteDispatchSupportsFeature (struct qemud_server *server,
+                               struct qemud_client *client,
                                virConnectPtr conn,
                                remote_message_header *hdr ATTRIBUTE_UNUSED,
                                remote_error *rerr,
                                remote_supports_feature_args *args, remote_supports_feature_ret *ret)
 {
+    /* Large stream frames are a property of this connection, not
+     * of the driver behind it. SASL layers encode whole messages
+     * in one go, so keep those on the ordinary message size. */
+    if (args->feature == VIR_DRV_FEATURE_REMOTE_STREAM_FRAMES) {
+        virMutexLock(&server->lock);
+        virMutexLock(&client->lock);
+        virMutexUnlock(&server->lock);
+
+        ret->supported = 1;
+#if HAVE_SASL
+        if (client->saslSSF != QEMUD_SASL_SSF_NONE)
+            ret->supported = 0;
+#endif
+        client->streamFrames = ret->supported;
+        virMutexUnlock(&client->lock);
+        return 0;
+    }
+
     ret->supported = virDrvSupportsFeature (conn, args->feature);
 
     if (ret->supported == -1) {
@@ -5917,6 +5957,9 @@ static int remoteDispatchStorageVolDownload(struct qemud_server *server ATTRIBUT
         goto cleanup;
     }
 
+    if (args->flags & VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM)
+        stream->sparse = 1;
+
     if (remoteAddClientStream(client, stream, 1) < 0) {
         remoteDispatchConnError(rerr, conn);
         virStreamAbort(stream->st);
@@ -5934,6 +5977,267 @@ cleanup:
 }
 
 
+static int
+remoteDomainStatsCompareUUID(const void *a, const void *b)
+{
+    virDomainPtr dom_a = *(virDomainPtr *)a;
+    virDomainPtr dom_b = *(virDomainPtr *)b;
+
+    return memcmp(dom_a->uuid, dom_b->uuid, VIR_UUID_BUFLEN);
+}
+
+/*
+ * Collect one page of the domains matching @flags, in order of UUID and
+ * starting after @after if it is non-NULL, into a NULL terminated array.
+ * Domains which go away while being listed are left out. Sets @more if
+ * further domains follow the page, and @last to the UUID to continue
+ * after. Returns the number of domains in the page, or -1 with the error
+ * set in @rerr.
+ */
+static int
+remoteDomainStatsListPage(virConnectPtr conn,
+                          remote_error *rerr,
+                          unsigned int flags,
+                          const unsigned char *after,
+                          virDomainPtr **page,
+                          int *more,
+                          unsigned char *last)
+{
+    virDomainPtr *doms = NULL;
+    int *ids = NULL;
+    char **names = NULL;
+    int nids = 0, nnames = 0;
+    int ndoms = 0;
+    int first, npage;
+    int i;
+    int ret = -1;
+
+    if (!(flags & (VIR_CONNECT_GET_ALL_DOMAINS_STATS_ACTIVE |
+                   VIR_CONNECT_GET_ALL_DOMAINS_STATS_INACTIVE)))
+        flags |= (VIR_CONNECT_GET_ALL_DOMAINS_STATS_ACTIVE |
+                  VIR_CONNECT_GET_ALL_DOMAINS_STATS_INACTIVE);
+
+    if (flags & VIR_CONNECT_GET_ALL_DOMAINS_STATS_ACTIVE) {
+        if ((nids = virConnectNumOfDomains(conn)) < 0)
+            goto error;
+        if (VIR_ALLOC_N(ids, nids) < 0)
+            goto oom;
+        if (nids &&
+            (nids = virConnectListDomains(conn, ids, nids)) < 0)
+            goto error;
+    }
+
+    if (flags & VIR_CONNECT_GET_ALL_DOMAINS_STATS_INACTIVE) {
+        if ((nnames = virConnectNumOfDefinedDomains(conn)) < 0)
+            goto error;
+        if (VIR_ALLOC_N(names, nnames) < 0)
+            goto oom;
+        if (nnames &&
+            (nnames = virConnectListDefinedDomains(conn, names, nnames)) < 0)
+            goto error;
+    }
+
+    if (VIR_ALLOC_N(doms, nids + nnames + 1) < 0)
+        goto oom;
+
+    for (i = 0 ; i < nids ; i++) {
+        if ((doms[ndoms] = virDomainLookupByID(conn, ids[i])))
+            ndoms++;
+    }
+    for (i = 0 ; i < nnames ; i++) {
+        if ((doms[ndoms] = virDomainLookupByName(conn, names[i])))
+            ndoms++;
+    }
+
+    qsort(doms, ndoms, sizeof(*doms), remoteDomainStatsCompareUUID);
+
+    for (first = 0 ; after && first < ndoms ; first++) {
+        if (memcmp(doms[first]->uuid, after, VIR_UUID_BUFLEN) > 0)
+            break;
+    }
+
+    npage = ndoms - first;
+    *more = npage > REMOTE_DOMAIN_STATS_RECORDS_MAX;
+    if (*more)
+        npage = REMOTE_DOMAIN_STATS_RECORDS_MAX;
+
+    /* Keep only the page, moved to the front of the array */
+    for (i = 0 ; i < ndoms ; i++) {
+        if (i < first || i >= first + npage)
+            virDomainFree(doms[i]);
+        else
+            doms[i - first] = doms[i];
+    }
+    for (i = npage ; i < ndoms ; i++)
+        doms[i] = NULL;
+    if (npage)
+        memcpy(last, doms[npage - 1]->uuid, VIR_UUID_BUFLEN);
+
+    *page = doms;
+    doms = NULL;
+    ret = npage;
+    goto cleanup;
+
+error:
+    remoteDispatchConnError(rerr, conn);
+    goto cleanup;
+oom:
+    remoteDispatchOOMError(rerr);
+cleanup:
+    VIR_FREE(doms);
+    VIR_FREE(ids);
+    for (i = 0 ; i < nnames ; i++)
+        VIR_FREE(names[i]);
+    VIR_FREE(names);
+    return ret;
+}
+
+static int
+remoteDispatchConnectGetAllDomainStats(struct qemud_server *server ATTRIBUTE_UNUSED,
+                                       struct qemud_client *client ATTRIBUTE_UNUSED,
+                                       virConnectPtr conn,
+                                       remote_message_header *hdr ATTRIBUTE_UNUSED,
+                                       remote_error *rerr,
+                                       remote_connect_get_all_domain_stats_args *args,
+                                       remote_connect_get_all_domain_stats_ret *ret)
+{
+    virDomainPtr *doms = NULL;
+    virDomainStatsRecordPtr *retStats = NULL;
+    int nrecords;
+    int ndoms;
+    int i, j;
+    int rv = -1;
+
+    if (args->doms.doms_len) {
+        if (VIR_ALLOC_N(doms, args->doms.doms_len + 1) < 0)
+            goto oom;
+
+        for (i = 0 ; i < args->doms.doms_len ; i++) {
+            if (!(doms[i] = get_nonnull_domain(conn, args->doms.doms_val[i]))) {
+                remoteDispatchConnError(rerr, conn);
+                goto cleanup;
+            }
+        }
+
+        nrecords = virDomainListGetStats(doms, args->stats,
+                                         &retStats, args->flags);
+    } else {
+        /* The stats for every domain may not fit in one reply, so the
+         * client pages through them in order of UUID */
+        if (args->flags & ~(VIR_CONNECT_GET_ALL_DOMAINS_STATS_ACTIVE |
+                            VIR_CONNECT_GET_ALL_DOMAINS_STATS_INACTIVE)) {
+            remoteDispatchFormatError(rerr, _("unsupported flags (0x%x)"),
+                                      args->flags);
+            goto cleanup;
+        }
+
+        ndoms = remoteDomainStatsListPage(conn, rerr, args->flags,
+                                          args->haveAfter ?
+                                          (unsigned char *) args->after : NULL,
+                                          &doms, &ret->more,
+                                          (unsigned char *) ret->last);
+        if (ndoms < 0)
+            goto cleanup;
+
+        if (ndoms == 0)
+            nrecords = 0;
+        else
+            nrecords = virDomainListGetStats(doms, args->stats,
+                                             &retStats, 0);
+    }
+
+    if (nrecords < 0) {
+        remoteDispatchConnError(rerr, conn);
+        goto cleanup;
+    }
+
+    if (nrecords > REMOTE_DOMAIN_STATS_RECORDS_MAX) {
+        remoteDispatchFormatError(rerr, "%s",
+                                  _("too many domain stats records"));
+        goto cleanup;
+    }
+
+    if (VIR_ALLOC_N(ret->retStats.retStats_val, nrecords) < 0)
+        goto oom;
+    ret->retStats.retStats_len = nrecords;
+
+    for (i = 0 ; i < nrecords ; i++) {
+        virDomainStatsRecordPtr rec = retStats[i];
+        remote_domain_stats_record *dst = &ret->retStats.retStats_val[i];
+
+        if (rec->nparams > REMOTE_DOMAIN_STATS_PARAMS_MAX) {
+            remoteDispatchFormatError(rerr, "%s",
+                                      _("too many domain statistics"));
+            goto cleanup;
+        }
+
+        make_nonnull_domain(&dst->dom, rec->dom);
+        if (!dst->dom.name)
+            goto oom;
+
+        if (VIR_ALLOC_N(dst->params.params_val, rec->nparams) < 0)
+            goto oom;
+        dst->params.params_len = rec->nparams;
+
+        for (j = 0 ; j < rec->nparams ; j++) {
+            virDomainStatsParamPtr param = &rec->params[j];
+            remote_domain_stats_param *val = &dst->params.params_val[j];
+
+            /* Set the type first, so xdr_free can always walk the union */
+            val->value.type = param->type;
+            switch (param->type) {
+            case VIR_DOMAIN_STATS_PARAM_INT:
+                val->value.remote_domain_stats_param_value_u.i = param->value.i;
+                break;
+            case VIR_DOMAIN_STATS_PARAM_UINT:
+                val->value.remote_domain_stats_param_value_u.ui = param->value.ui;
+                break;
+            case VIR_DOMAIN_STATS_PARAM_LLONG:
+                val->value.remote_domain_stats_param_value_u.l = param->value.l;
+                break;
+            case VIR_DOMAIN_STATS_PARAM_ULLONG:
+                val->value.remote_domain_stats_param_value_u.ul = param->value.ul;
+                break;
+            case VIR_DOMAIN_STATS_PARAM_DOUBLE:
+                val->value.remote_domain_stats_param_value_u.d = param->value.d;
+                break;
+            case VIR_DOMAIN_STATS_PARAM_BOOLEAN:
+                val->value.remote_domain_stats_param_value_u.b = param->value.b;
+                break;
+            case VIR_DOMAIN_STATS_PARAM_STRING:
+                if (!(val->value.remote_domain_stats_param_value_u.s =
+                      strdup(param->value.s)))
+                    goto oom;
+                break;
+            default:
+                remoteDispatchFormatError(rerr, "%s", _("unknown type"));
+                goto cleanup;
+            }
+
+            /* remoteDispatchClientRequest will free this: */
+            if (!(val->field = strdup(param->field)))
+                goto oom;
+        }
+    }
+
+    rv = 0;
+    goto cleanup;
+
+oom:
+    remoteDispatchOOMError(rerr);
+cleanup:
+    if (rv < 0)
+        xdr_free((xdrproc_t) xdr_remote_connect_get_all_domain_stats_ret,
+                 (char *) ret);
+    if (doms) {
+        for (i = 0 ; doms[i] ; i++)
+            virDomainFree(doms[i]);
+        VIR_FREE(doms);
+    }
+    virDomainStatsRecordListFree(retStats);
+    return rv;
+}
+
 /***************************
  * Register / deregister events
  ***************************/
@@ -5954,11 +6258,14 @@ remoteDispatchDomainEventsRegister (struct qemud_server *server ATTRIBUTE_UNUSED
         return -1;
     }
 
+    remoteRelayDomainEventRef(client);
     if ((callbackID = virConnectDomainEventRegisterAny(conn,
                                                        NULL,
                                                        VIR_DOMAIN_EVENT_ID_LIFECYCLE,
                                                        VIR_DOMAIN_EVENT_CALLBACK(remoteRelayDomainEventLifecycle),
-                                                       client, NULL)) < 0) {
+                                                       client,
+                                                       remoteRelayDomainEventFree)) < 0) {
+        remoteRelayDomainEventFree(client);
         remoteDispatchConnError(rerr, conn);
         return -1;
     }
@@ -6004,7 +6311,7 @@ remoteDispatchDomainEventSend (struct qemud_client *client,
     XDR xdr;
     unsigned int len;
 
-    if (VIR_ALLOC(msg) < 0)
+    if (!(msg = qemudClientMessageNew(0)))
         return;
 
     msg->hdr.prog = REMOTE_PROGRAM;
@@ -6055,7 +6362,7 @@ remoteDispatchDomainEventSend (struct qemud_client *client,
 xdr_error:
     xdr_destroy(&xdr);
 error:
-    VIR_FREE(msg);
+    qemudClientMessageFree(msg);
 }
 
 static int
@@ -7048,11 +7355,14 @@ remoteDispatchDomainEventsRegisterAny (struct qemud_server *server ATTRIBUTE_UNU
         return -1;
     }
 
+    remoteRelayDomainEventRef(client);
     if ((callbackID = virConnectDomainEventRegisterAny(conn,
                                                        NULL,
                                                        args->eventID,
                                                        domainEventCallbacks[args->eventID],
-                                                       client, NULL)) < 0) {
+                                                       client,
+                                                       remoteRelayDomainEventFree)) < 0) {
+        remoteRelayDomainEventFree(client);
         remoteDispatchConnError(rerr, conn);
         return -1;
     }
@@ -1052,3 +1052,8 @@
     .args_filter = (xdrproc_t) xdr_remote_storage_vol_download_args,
     .ret_filter = (xdrproc_t) xdr_void,
 },
+{   /* ConnectGetAllDomainStats => 210 */
+    .fn = (dispatch_fn) remoteDispatchConnectGetAllDomainStats,
+    .args_filter = (xdrproc_t) xdr_remote_connect_get_all_domain_stats_args,
+    .ret_filter = (xdrproc_t) xdr_remote_connect_get_all_domain_stats_ret,
+},
@@ -28,6 +28,11 @@
 #include "dispatch.h"
 #include "logging.h"
 
+/* Number of data messages a stream may have waiting for
+ * transmission to the client, so reading from the stream
+ * overlaps with writing out what was already read. */
+#define QEMUD_STREAM_TX_WINDOW 4
+
 static int
 remoteStreamHandleWrite(struct qemud_client *client,
                         struct qemud_client_stream *stream);
@@ -148,7 +153,8 @@ remoteStreamFilter(struct qemud_client *client,
 
     if (msg->hdr.serial == stream->serial &&
         msg->hdr.proc == stream->procedure &&
-        msg->hdr.type == REMOTE_STREAM) {
+        (msg->hdr.type == REMOTE_STREAM ||
+         msg->hdr.type == REMOTE_STREAM_HOLE)) {
         VIR_DEBUG("Incoming rx=%p serial=%d proc=%d status=%d",
               stream->rx, msg->hdr.proc, msg->hdr.serial, msg->hdr.status);
 
@@ -283,7 +289,7 @@ int remoteAddClientStream(struct qemud_client *client,
     client->filters = &stream->filter;
 
     if (transmit)
-        stream->tx = 1;
+        stream->tx = QEMUD_STREAM_TX_WINDOW;
 
     remoteStreamUpdateEvents(stream);
 
@@ -411,6 +417,57 @@ remoteStreamHandleWriteData(struct qemud_client *client,
 }
 
 
+/*
+ * Returns:
+ *   -1  if fatal error occurred
+ *    0  if hole was fully processed
+ *    1  if hole is still being processed
+ */
+static int
+remoteStreamHandleWriteHole(struct qemud_client *client,
+                            struct qemud_client_stream *stream,
+                            struct qemud_client_message *msg)
+{
+    remote_error rerr;
+    remote_stream_hole hole;
+    XDR xdr;
+    int ret;
+
+    VIR_DEBUG("stream=%p proc=%d serial=%d",
+              stream, msg->hdr.proc, msg->hdr.serial);
+
+    memset(&rerr, 0, sizeof rerr);
+    memset(&hole, 0, sizeof hole);
+
+    xdrmem_create(&xdr,
+                  msg->buffer + msg->bufferOffset,
+                  msg->bufferLength - msg->bufferOffset,
+                  XDR_DECODE);
+    if (!xdr_remote_stream_hole(&xdr, &hole)) {
+        xdr_destroy(&xdr);
+        stream->closed = 1;
+        remoteDispatchFormatError(&rerr, "%s",
+                                  _("cannot decode stream hole"));
+        return remoteSerializeReplyError(client, &rerr, &msg->hdr);
+    }
+    xdr_destroy(&xdr);
+
+    ret = virStreamSendHole(stream->st, hole.length, hole.flags);
+
+    if (ret == -2) {
+        /* Blocking, so indicate we have more todo later */
+        return 1;
+    } else if (ret < 0) {
+        VIR_INFO0("Stream send hole failed");
+        stream->closed = 1;
+        remoteDispatchConnError(&rerr, client->conn);
+        return remoteSerializeReplyError(client, &rerr, &msg->hdr);
+    }
+
+    return 0;
+}
+
+
 /*
  * Process an finish handshake from the client.
  *
@@ -507,7 +564,10 @@ remoteStreamHandleWrite(struct qemud_client *client,
             break;
 
         case REMOTE_CONTINUE:
-            ret = remoteStreamHandleWriteData(client, stream, msg);
+            if (msg->hdr.type == REMOTE_STREAM_HOLE)
+                ret = remoteStreamHandleWriteHole(client, stream, msg);
+            else
+                ret = remoteStreamHandleWriteData(client, stream, msg);
             break;
 
         case REMOTE_ERROR:
@@ -536,8 +596,10 @@ remoteStreamHandleWrite(struct qemud_client *client,
 /*
  * Invoked when a stream is signalled as having data
  * available to read. This reads upto one message
- * worth of data, and then queues that for transmission
- * to the client.
+ * worth of data, straight into the message buffer,
+ * and then queues that for transmission to the client.
+ * On a sparse stream, a hole found after the data is
+ * queued as well.
  *
  * Returns 0 if data was queued for TX, or a error RPC
  * was sent, or -1 on fatal error, indicating client should
@@ -547,9 +609,12 @@ static int
 remoteStreamHandleRead(struct qemud_client *client,
                        struct qemud_client_stream *stream)
 {
-    char *buffer;
+    struct qemud_client_message *msg;
     size_t bufferLen = REMOTE_MESSAGE_PAYLOAD_MAX;
-    int ret;
+    size_t got = 0;
+    unsigned int flags = 0;
+    long long hole = 0;
+    int ret = 0;
 
     VIR_DEBUG("stream=%p", stream);
 
@@ -558,35 +623,70 @@ remoteStreamHandleRead(struct qemud_client *client,
     if (!stream->tx)
         return 0;
 
-    if (VIR_ALLOC_N(buffer, bufferLen) < 0)
+    if (client->streamFrames)
+        bufferLen = REMOTE_STREAM_PAYLOAD_MAX;
+
+    if (stream->sparse)
+        flags |= VIR_STREAM_RECV_STOP_AT_HOLE;
+
+    if (!(msg = remoteNewStreamMessage(stream, REMOTE_STREAM,
+                                       REMOTE_CONTINUE, bufferLen)))
         return -1;
 
-    ret = virStreamRecv(stream->st, buffer, bufferLen);
+    /* Pipes and sockets hand over far less than a frame per read,
+     * so keep filling the message until the stream would block */
+    while (got < bufferLen) {
+        ret = virStreamRecvFlags(stream->st,
+                                 msg->buffer + msg->bufferOffset + got,
+                                 bufferLen - got,
+                                 flags);
+        if (ret <= 0)
+            break;
+        got += ret;
+    }
+
+    /* Stopping at a hole looks like the end of the stream, unless
+     * the stream says there is a hole here */
+    if (ret == 0 && stream->sparse &&
+        virStreamRecvHole(stream->st, &hole, 0) < 0)
+        ret = -1;
+
+    if (got > 0 && ret != -1)
+        ret = got;
+
     if (ret == -2) {
         /* Should never get this, since we're only called when we know
          * we're readable, but hey things change... */
+        qemudClientMessageFree(msg);
         ret = 0;
     } else if (ret < 0) {
         remote_error rerr;
+        qemudClientMessageFree(msg);
         memset(&rerr, 0, sizeof rerr);
         remoteDispatchConnError(&rerr, NULL);
 
         ret = remoteSerializeStreamError(client, &rerr, stream->procedure, stream->serial);
+    } else if (ret == 0 && hole > 0) {
+        qemudClientMessageFree(msg);
+        ret = remoteSendStreamHole(client, stream, hole);
     } else {
-        stream->tx = 0;
+        stream->tx--;
         if (ret == 0)
             stream->recvEOF = 1;
-        ret = remoteSendStreamData(client, stream, buffer, ret);
+        ret = remoteSendStreamMessage(client, msg, ret);
+        /* The fd won't signal the hole that stopped this read,
+         * since it has already been read from it */
+        if (ret == 0 && hole > 0)
+            ret = remoteSendStreamHole(client, stream, hole);
     }
 
-    VIR_FREE(buffer);
     return ret;
 }
 
 
 /*
  * Invoked when an outgoing data packet message has been fully sent.
- * This simply re-enables TX of further data.
+ * This re-opens the TX window by one message.
  *
  * The idea is to stop the daemon growing without bound due to
  * fast stream, but slow client
@@ -607,7 +707,7 @@ remoteStreamMessageFinished(struct qemud_client *client,
     VIR_DEBUG("Message client=%p stream=%p proc=%d serial=%d", client, stream, msg->hdr.proc, msg->hdr.serial);
 
     if (stream) {
-        stream->tx = 1;
+        stream->tx++;
         remoteStreamUpdateEvents(stream);
     }
 }
@@ -368,8 +368,16 @@ skip_function = (
     'virStreamEventAddCallback',
     'virStreamRecvAll',
     'virStreamSendAll',
+    'virStreamRecvFlags', # Needs a hand written override, like virStreamRecv
+    'virStreamSendHole', # Needs investigation...
+    'virStreamRecvHole', # Needs investigation...
+    'virStreamSparseRecvAll',
+    'virStreamSparseSendAll',
     'virStreamRef',
     'virStreamFree',
+    'virConnectGetAllDomainStats', # Needs a hand written override
+    'virDomainListGetStats', # Needs a hand written override
+    'virDomainStatsRecordListFree', # Not needed once the above are done
 
     # These have no use for bindings users.
     "virConnectRef",
@@ -391,53 +391,317 @@ VIR_ENUM_IMPL(virDomainTimerMode, VIR_DOMAIN_TIMER_MODE_LAST,
 #define VIR_DOMAIN_XML_WRITE_FLAGS  VIR_DOMAIN_XML_SECURE
 #define VIR_DOMAIN_XML_READ_FLAGS   VIR_DOMAIN_XML_INACTIVE
 
+/*
+ * The lookup functions take a reference on the domain they find
+ * while holding only the list lock, so the reference count is
+ * changed atomically rather than under the object lock.
+ */
+#if HAVE_SYNC_BUILTINS
+# define virDomainObjRefAdd(dom, n) __sync_add_and_fetch(&(dom)->refs, (n))
+
+static int virDomainObjRefInit(void)
+{
+    return 0;
+}
+#else
+static virMutex virDomainObjRefLock;
+static bool virDomainObjRefLockReady;
+static virOnceControl virDomainObjRefOnce = VIR_ONCE_CONTROL_INITIALIZER;
+
+static void virDomainObjRefLockInit(void)
+{
+    virDomainObjRefLockReady = virMutexInit(&virDomainObjRefLock) == 0;
+}
+
+static int virDomainObjRefInit(void)
+{
+    if (virOnce(&virDomainObjRefOnce, virDomainObjRefLockInit) < 0 ||
+        !virDomainObjRefLockReady) {
+        virDomainReportError(VIR_ERR_INTERNAL_ERROR,
+                             "%s", _("cannot initialize mutex"));
+        return -1;
+    }
+    return 0;
+}
+
+static int virDomainObjRefAdd(virDomainObjPtr dom, int n)
+{
+    int refs;
+
+    virMutexLock(&virDomainObjRefLock);
+    refs = dom->refs += n;
+    virMutexUnlock(&virDomainObjRefLock);
+    return refs;
+}
+#endif
+
+static void virDomainObjFree(virDomainObjPtr dom);
+
+/*
+ * Called with the list locked, so 'obj' must not be locked here.
+ * Once unlisted only the list's reference can be the last one, and
+ * then no one else is using the object.
+ */
 static void
 virDomainObjListDataFree(void *payload, const void *name ATTRIBUTE_UNUSED)
 {
     virDomainObjPtr obj = payload;
-    virDomainObjLock(obj);
-    if (virDomainObjUnref(obj) > 0)
-        virDomainObjUnlock(obj);
+    if (virDomainObjRefAdd(obj, -1) == 0)
+        virDomainObjFree(obj);
 }
 
 int virDomainObjListInit(virDomainObjListPtr doms)
 {
+    if (virDomainObjRefInit() < 0)
+        return -1;
+
+    if (virMutexInit(&doms->lock) < 0) {
+        virDomainReportError(VIR_ERR_INTERNAL_ERROR,
+                             "%s", _("cannot initialize mutex"));
+        return -1;
+    }
+
     doms->objs = virHashCreate(50, virDomainObjListDataFree);
-    if (!doms->objs)
+    doms->names = virHashCreate(50, NULL);
+    doms->ids = virHashCreate(50, NULL);
+    if (!doms->objs || !doms->names || !doms->ids) {
+        virHashFree(doms->ids);
+        virHashFree(doms->names);
+        virHashFree(doms->objs);
+        doms->objs = doms->names = doms->ids = NULL;
+        virMutexDestroy(&doms->lock);
         return -1;
+    }
     return 0;
 }
 
 
 void virDomainObjListDeinit(virDomainObjListPtr doms)
 {
+    /* The indexes hold no references, so drop them before
+     * the objects they point to go away */
+    virHashFree(doms->ids);
+    virHashFree(doms->names);
     virHashFree(doms->objs);
+    virMutexDestroy(&doms->lock);
 }
 
 
-static int virDomainObjListSearchID(const void *payload,
-                                    const void *name ATTRIBUTE_UNUSED,
-                                    const void *data)
+/* Enough for a sign, the digits of INT_MIN and the trailing NUL */
+#define VIR_DOMAIN_ID_STRING_BUFLEN (sizeof(int) * 3 + 2)
+
+static void virDomainObjListFormatID(int id, char *idstr)
 {
-    virDomainObjPtr obj = (virDomainObjPtr)payload;
-    const int *id = data;
-    int want = 0;
+    snprintf(idstr, VIR_DOMAIN_ID_STRING_BUFLEN, "%d", id);
+}
+
+static int virDomainObjListSearchObj(const void *payload,
+                                     const void *name ATTRIBUTE_UNUSED,
+                                     const void *data)
+{
+    return payload == data;
+}
+
+/*
+ * Drop any index entries pointing at 'dom'. Needed before the
+ * object is removed from the list, since the indexes do not hold
+ * a reference of their own.
+ */
+static void virDomainObjListUnindex(virDomainObjListPtr doms,
+                                    virDomainObjPtr dom)
+{
+    if (virHashLookup(doms->names, dom->def->name) == dom)
+        virHashRemoveEntry(doms->names, dom->def->name);
+    else
+        virHashRemoveSet(doms->names, virDomainObjListSearchObj, dom);
+
+    virHashRemoveSet(doms->ids, virDomainObjListSearchObj, dom);
+}
+
+
+/* As virDomainObjListClearID, with the list already locked */
+static void virDomainObjListClearIDLocked(virDomainObjListPtr doms,
+                                          virDomainObjPtr dom)
+{
+    char idstr[VIR_DOMAIN_ID_STRING_BUFLEN];
+
+    if (dom->def->id != -1) {
+        virDomainObjListFormatID(dom->def->id, idstr);
+        if (virHashLookup(doms->ids, idstr) == dom)
+            virHashRemoveEntry(doms->ids, idstr);
+    }
+
+    dom->def->id = -1;
+    virDomainObjInvalidateXML(dom);
+}
+
+
+/**
+ * virDomainObjListSetID:
+ * @doms: list owning @dom
+ * @dom: locked domain object being started
+ * @id: the new runtime id
+ *
+ * Assign @id to the running domain @dom and record it in the
+ * lookup-by-id index. Drivers must use this, rather than writing
+ * dom->def->id directly, whenever a domain becomes active.
+ *
+ * Returns 0 on success, -1 on OOM
+ */
+int virDomainObjListSetID(virDomainObjListPtr doms,
+                          virDomainObjPtr dom,
+                          int id)
+{
+    char idstr[VIR_DOMAIN_ID_STRING_BUFLEN];
+    int ret = 0;
+
+    virMutexLock(&doms->lock);
+
+    virDomainObjListClearIDLocked(doms, dom);
+
+    dom->def->id = id;
+    virDomainObjInvalidateXML(dom);
+    if (id != -1) {
+        virDomainObjListFormatID(id, idstr);
+        if (virHashUpdateEntry(doms->ids, idstr, dom) < 0) {
+            virReportOOMError();
+            ret = -1;
+        }
+    }
+
+    virMutexUnlock(&doms->lock);
+    return ret;
+}
+
+
+/**
+ * virDomainObjListClearID:
+ * @doms: list owning @dom
+ * @dom: locked domain object being stopped
+ *
+ * Mark @dom inactive by resetting its id to -1, dropping it
+ * from the lookup-by-id index.
+ */
+void virDomainObjListClearID(virDomainObjListPtr doms,
+                             virDomainObjPtr dom)
+{
+    virMutexLock(&doms->lock);
+    virDomainObjListClearIDLocked(doms, dom);
+    virMutexUnlock(&doms->lock);
+}
+
+
+/**
+ * virDomainObjListAdd:
+ * @doms: the list to add to
+ * @dom: locked domain object built by the caller
+ *
+ * Add @dom, which must not already be in any list, to @doms and
+ * index it by name and, if it is running, by ID. For drivers which
+ * build their domain objects by hand rather than via
+ * virDomainAssignDef. @doms takes over the caller's reference.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int virDomainObjListAdd(virDomainObjListPtr doms,
+                        virDomainObjPtr dom)
+{
+    char uuidstr[VIR_UUID_STRING_BUFLEN];
+    char idstr[VIR_DOMAIN_ID_STRING_BUFLEN];
+    int ret = -1;
+
+    virMutexLock(&doms->lock);
+
+    virUUIDFormat(dom->def->uuid, uuidstr);
+    if (virHashLookup(doms->objs, uuidstr)) {
+        virDomainReportError(VIR_ERR_OPERATION_FAILED,
+                             _("domain with uuid '%s' already exists"),
+                             uuidstr);
+        goto cleanup;
+    }
+
+    if (virHashAddEntry(doms->names, dom->def->name, dom) < 0)
+        goto no_memory;
+    if (dom->def->id != -1) {
+        virDomainObjListFormatID(dom->def->id, idstr);
+        if (virHashUpdateEntry(doms->ids, idstr, dom) < 0) {
+            virHashRemoveEntry(doms->names, dom->def->name);
+            goto no_memory;
+        }
+    }
+    if (virHashAddEntry(doms->objs, uuidstr, dom) < 0) {
+        virDomainObjListUnindex(doms, dom);
+        goto no_memory;
+    }
+
+    ret = 0;
+
+cleanup:
+    virMutexUnlock(&doms->lock);
+    return ret;
+
+no_memory:
+    virReportOOMError();
+    goto cleanup;
+}
+
+
+/*
+ * Return the domain filed under 'key' in 'table', one of the tables
+ * of 'doms', locked. The object is only locked once the list lock is
+ * released, with a reference keeping it alive meanwhile, so a domain
+ * busy in some long operation delays lookups of itself alone. Once
+ * locked, the entry is checked again in case the domain was removed,
+ * renamed or stopped while we waited.
+ */
+static virDomainObjPtr virDomainObjListFind(virDomainObjListPtr doms,
+                                            virHashTablePtr table,
+                                            const char *key)
+{
+    virDomainObjPtr obj;
+    bool listed;
+
+retry:
+    virMutexLock(&doms->lock);
+    if ((obj = virHashLookup(table, key)))
+        virDomainObjRef(obj);
+    virMutexUnlock(&doms->lock);
+
+    if (!obj)
+        return NULL;
 
     virDomainObjLock(obj);
-    if (virDomainObjIsActive(obj) &&
-        obj->def->id == *id)
-        want = 1;
-    virDomainObjUnlock(obj);
-    return want;
+    virMutexLock(&doms->lock);
+    listed = virHashLookup(table, key) == obj;
+    virMutexUnlock(&doms->lock);
+
+    if (virDomainObjUnref(obj) == 0)
+        goto retry;
+    if (!listed) {
+        virDomainObjUnlock(obj);
+        goto retry;
+    }
+    return obj;
 }
 
+
 virDomainObjPtr virDomainFindByID(const virDomainObjListPtr doms,
                                   int id)
 {
+    char idstr[VIR_DOMAIN_ID_STRING_BUFLEN];
     virDomainObjPtr obj;
-    obj = virHashSearch(doms->objs, virDomainObjListSearchID, &id);
-    if (obj)
-        virDomainObjLock(obj);
+
+    virDomainObjListFormatID(id, idstr);
+
+    obj = virDomainObjListFind(doms, doms->ids, idstr);
+    /* Guard against a driver having changed the id behind
+     * our back, eg by swapping in a new def */
+    if (obj &&
+        (!virDomainObjIsActive(obj) ||
+         obj->def->id != id)) {
+        virDomainObjUnlock(obj);
+        obj = NULL;
+    }
     return obj;
 }
 
@@ -446,38 +710,16 @@ virDomainObjPtr virDomainFindByUUID(const virDomainObjListPtr doms,
                                     const unsigned char *uuid)
 {
     char uuidstr[VIR_UUID_STRING_BUFLEN];
-    virDomainObjPtr obj;
 
     virUUIDFormat(uuid, uuidstr);
 
-    obj = virHashLookup(doms->objs, uuidstr);
-    if (obj)
-        virDomainObjLock(obj);
-    return obj;
-}
-
-static int virDomainObjListSearchName(const void *payload,
-                                      const void *name ATTRIBUTE_UNUSED,
-                                      const void *data)
-{
-    virDomainObjPtr obj = (virDomainObjPtr)payload;
-    int want = 0;
-
-    virDomainObjLock(obj);
-    if (STREQ(obj->def->name, (const char *)data))
-        want = 1;
-    virDomainObjUnlock(obj);
-    return want;
+    return virDomainObjListFind(doms, doms->objs, uuidstr);
 }
 
 virDomainObjPtr virDomainFindByName(const virDomainObjListPtr doms,
                                     const char *name)
 {
-    virDomainObjPtr obj;
-    obj = virHashSearch(doms->objs, virDomainObjListSearchName, name);
-    if (obj)
-        virDomainObjLock(obj);
-    return obj;
+    return virDomainObjListFind(doms, doms->names, name);
 }
 
 static void
@@ -969,6 +1211,7 @@ static void virDomainObjFree(virDomainObjPtr dom)
         return;
 
     VIR_DEBUG("obj=%p", dom);
+    virDomainObjInvalidateXML(dom);
     virDomainDefFree(dom->def);
     virDomainDefFree(dom->newDef);
 
@@ -984,27 +1227,30 @@ static void virDomainObjFree(virDomainObjPtr dom)
 
 void virDomainObjRef(virDomainObjPtr dom)
 {
-    dom->refs++;
-    VIR_DEBUG("obj=%p refs=%d", dom, dom->refs);
+    int refs ATTRIBUTE_UNUSED = virDomainObjRefAdd(dom, 1);
+    VIR_DEBUG("obj=%p refs=%d", dom, refs);
 }
 
 
 int virDomainObjUnref(virDomainObjPtr dom)
 {
-    dom->refs--;
-    VIR_DEBUG("obj=%p refs=%d", dom, dom->refs);
-    if (dom->refs == 0) {
+    int refs = virDomainObjRefAdd(dom, -1);
+    VIR_DEBUG("obj=%p refs=%d", dom, refs);
+    if (refs == 0) {
         virDomainObjUnlock(dom);
         virDomainObjFree(dom);
         return 0;
     }
-    return dom->refs;
+    return refs;
 }
 
 static virDomainObjPtr virDomainObjNew(virCapsPtr caps)
 {
     virDomainObjPtr domain;
 
+    if (virDomainObjRefInit() < 0)
+        return NULL;
+
     if (VIR_ALLOC(domain) < 0) {
         virReportOOMError();
         return NULL;
@@ -1041,6 +1287,8 @@ void virDomainObjAssignDef(virDomainObjPtr domain,
                            const virDomainDefPtr def,
                            bool live)
 {
+    virDomainObjInvalidateXML(domain);
+
     if (!virDomainObjIsActive(domain)) {
         if (live) {
             /* save current configuration to be restored on domain shutdown */
@@ -1065,21 +1313,59 @@ virDomainObjPtr virDomainAssignDef(virCapsPtr caps,
     virDomainObjPtr domain;
     char uuidstr[VIR_UUID_STRING_BUFLEN];
 
-    if ((domain = virDomainFindByUUID(doms, def->uuid))) {
+    virUUIDFormat(def->uuid, uuidstr);
+
+retry:
+    if ((domain = virDomainObjListFind(doms, doms->objs, uuidstr))) {
+        /* An inactive domain gets its def replaced outright, so
+         * keep the name index in step if it was renamed */
+        if (!virDomainObjIsActive(domain) &&
+            STRNEQ(domain->def->name, def->name)) {
+            virMutexLock(&doms->lock);
+            if (virHashUpdateEntry(doms->names, def->name, domain) < 0) {
+                virMutexUnlock(&doms->lock);
+                virReportOOMError();
+                virDomainObjUnlock(domain);
+                return NULL;
+            }
+            if (virHashLookup(doms->names, domain->def->name) == domain)
+                virHashRemoveEntry(doms->names, domain->def->name);
+            virMutexUnlock(&doms->lock);
+        }
         virDomainObjAssignDef(domain, def, live);
         return domain;
     }
 
     if (!(domain = virDomainObjNew(caps)))
         return NULL;
-    domain->def = def;
 
-    virUUIDFormat(def->uuid, uuidstr);
+    virMutexLock(&doms->lock);
+
+    /* Someone else may have added it since we looked */
+    if (virHashLookup(doms->objs, uuidstr)) {
+        virMutexUnlock(&doms->lock);
+        ignore_value(virDomainObjUnref(domain));
+        goto retry;
+    }
+
+    domain->def = def;
+    if (virHashAddEntry(doms->names, def->name, domain) < 0) {
+        virReportOOMError();
+        domain->def = NULL;
+        ignore_value(virDomainObjUnref(domain));
+        domain = NULL;
+        goto cleanup;
+    }
     if (virHashAddEntry(doms->objs, uuidstr, domain) < 0) {
-        VIR_FREE(domain);
-        return NULL;
+        virHashRemoveEntry(doms->names, def->name);
+        domain->def = NULL;
+        ignore_value(virDomainObjUnref(domain));
+        domain = NULL;
+        goto cleanup;
     }
 
+cleanup:
+    virMutexUnlock(&doms->lock);
     return domain;
 }
 
@@ -1121,6 +1407,7 @@ virDomainObjSetDefTransient(virCapsPtr caps,
         goto out;
 
     domain->newDef = newDef;
+    virDomainObjInvalidateXML(domain);
     ret = 0;
 out:
     VIR_FREE(xml);
@@ -1149,9 +1436,9 @@ virDomainObjGetPersistentDef(virCapsPtr caps,
 }
 
 /*
- * The caller must hold a lock  on the driver owning 'doms',
- * and must also have locked 'dom', to ensure no one else
- * is either waiting for 'dom' or still usingn it
+ * The caller must have locked 'dom', and must ensure no one else
+ * is either waiting for 'dom' or still using it. 'dom' is unlocked,
+ * and possibly freed, on return.
  */
 void virDomainRemoveInactive(virDomainObjListPtr doms,
                              virDomainObjPtr dom)
@@ -1159,9 +1446,17 @@ void virDomainRemoveInactive(virDomainObjListPtr doms,
     char uuidstr[VIR_UUID_STRING_BUFLEN];
     virUUIDFormat(dom->def->uuid, uuidstr);
 
+    virMutexLock(&doms->lock);
+
+    virDomainObjListUnindex(doms, dom);
+
+    /* Dropping the list's reference may free 'dom' */
     virDomainObjUnlock(dom);
 
-    virHashRemoveEntry(doms->objs, uuidstr);
+    if (virHashLookup(doms->objs, uuidstr) == dom)
+        virHashRemoveEntry(doms->objs, uuidstr);
+
+    virMutexUnlock(&doms->lock);
 }
 
 
@@ -8321,6 +8616,79 @@ error:
     return NULL;
 }
 
+static int virDomainObjXMLCacheSlot(int flags)
+{
+    return ((flags & VIR_DOMAIN_XML_SECURE) ? 1 : 0) |
+        ((flags & VIR_DOMAIN_XML_INACTIVE) ? 2 : 0);
+}
+
+/**
+ * virDomainObjGetXMLDesc:
+ * @dom: locked domain object
+ * @flags: bitwise-OR of virDomainXMLFlags
+ *
+ * Format the definition of @dom which virDomainGetXMLDesc would
+ * report for @flags, reusing the output of an earlier call with
+ * the same flags if neither definition has changed since.
+ *
+ * Returns the XML, to be freed by the caller, or NULL on error
+ */
+char *virDomainObjGetXMLDesc(virDomainObjPtr dom,
+                             int flags)
+{
+    virDomainDefPtr def;
+    char *xml;
+    int slot;
+
+    if ((flags & VIR_DOMAIN_XML_INACTIVE) && dom->newDef)
+        def = dom->newDef;
+    else
+        def = dom->def;
+
+    if (flags & ~VIR_DOMAIN_XML_CACHE_FLAGS)
+        return virDomainDefFormat(def, flags);
+
+    /* Checking the def catches drivers swapping in newDef at
+     * shutdown, on top of explicit invalidation */
+    slot = virDomainObjXMLCacheSlot(flags);
+    if (dom->xmlCache[slot] && dom->xmlCacheDef[slot] == def) {
+        dom->xmlCacheHits++;
+        if (!(xml = strdup(dom->xmlCache[slot])))
+            virReportOOMError();
+        return xml;
+    }
+
+    dom->xmlCacheMisses++;
+    if (!(xml = virDomainDefFormat(def, flags)))
+        return NULL;
+
+    /* Failing to keep a copy just means a miss next time */
+    VIR_FREE(dom->xmlCache[slot]);
+    if ((dom->xmlCache[slot] = strdup(xml)))
+        dom->xmlCacheDef[slot] = def;
+
+    return xml;
+}
+
+/**
+ * virDomainObjInvalidateXML:
+ * @dom: locked domain object
+ *
+ * Discard the XML cached by virDomainObjGetXMLDesc, after @dom->def
+ * or @dom->newDef has been changed.
+ */
+void virDomainObjInvalidateXML(virDomainObjPtr dom)
+{
+    int i;
+
+    for (i = 0 ; i < VIR_DOMAIN_XML_CACHE_SLOTS ; i++) {
+        if (dom->xmlCache[i])
+            dom->xmlCacheInvalidations++;
+        VIR_FREE(dom->xmlCache[i]);
+        dom->xmlCacheDef[i] = NULL;
+    }
+}
+
 int virDomainSaveXML(const char *configDir,
                      virDomainDefPtr def,
                      const char *xml)
@@ -8398,6 +8766,9 @@ int virDomainSaveStatus(virCapsPtr caps,
     int ret = -1;
     char *xml;
 
+    /* Drivers save the status after changing a running domain */
+    virDomainObjInvalidateXML(obj);
+
     if (!(xml = virDomainObjFormat(caps, obj, flags)))
         goto cleanup;
 
@@ -8484,15 +8855,36 @@ static virDomainObjPtr virDomainLoadStatus(virCapsPtr caps,
 
     virUUIDFormat(obj->def->uuid, uuidstr);
 
+    virMutexLock(&doms->lock);
+
     if (virHashLookup(doms->objs, uuidstr) != NULL) {
         virDomainReportError(VIR_ERR_INTERNAL_ERROR,
                              _("unexpected domain %s already exists"),
                              obj->def->name);
-        goto error;
+        goto error_unlock;
     }
 
-    if (virHashAddEntry(doms->objs, uuidstr, obj) < 0)
-        goto error;
+    if (virHashAddEntry(doms->names, obj->def->name, obj) < 0) {
+        virReportOOMError();
+        goto error_unlock;
+    }
+
+    if (virDomainObjIsActive(obj)) {
+        char idstr[VIR_DOMAIN_ID_STRING_BUFLEN];
+        virDomainObjListFormatID(obj->def->id, idstr);
+        if (virHashUpdateEntry(doms->ids, idstr, obj) < 0) {
+            virReportOOMError();
+            virHashRemoveEntry(doms->names, obj->def->name);
+            goto error_unlock;
+        }
+    }
+
+    if (virHashAddEntry(doms->objs, uuidstr, obj) < 0) {
+        virDomainObjListUnindex(doms, obj);
+        goto error_unlock;
+    }
+
+    virMutexUnlock(&doms->lock);
 
     if (notify)
         (*notify)(obj, 1, opaque);
@@ -8500,6 +8892,8 @@ static virDomainObjPtr virDomainLoadStatus(virCapsPtr caps,
     VIR_FREE(statusFile);
     return obj;
 
+error_unlock:
+    virMutexUnlock(&doms->lock);
 error:
     /* obj was never shared, so unref should return 0 */
     if (obj)
@@ -8764,10 +9158,12 @@ static void virDomainObjListCountInactive(void *payload, const void *name ATTRIB
 int virDomainObjListNumOfDomains(virDomainObjListPtr doms, int active)
 {
     int count = 0;
-    if (active)
-        virHashForEach(doms->objs, virDomainObjListCountActive, &count);
-    else
-        virHashForEach(doms->objs, virDomainObjListCountInactive, &count);
+    if (virDomainObjListForEach(doms,
+                                active ?
+                                virDomainObjListCountActive :
+                                virDomainObjListCountInactive,
+                                &count) < 0)
+        return -1;
     return count;
 }
 
@@ -8792,7 +9188,9 @@ int virDomainObjListGetActiveIDs(virDomainObjListPtr doms,
                                  int maxids)
 {
     struct virDomainIDData data = { 0, maxids, ids };
-    virHashForEach(doms->objs, virDomainObjListCopyActiveIDs, &data);
+    if (virDomainObjListForEach(doms, virDomainObjListCopyActiveIDs,
+                                &data) < 0)
+        return -1;
     return data.numids;
 }
 
@@ -8828,7 +9226,9 @@ int virDomainObjListGetInactiveNames(virDomainObjListPtr doms,
 {
     struct virDomainNameData data = { 0, 0, maxnames, names };
     int i;
-    virHashForEach(doms->objs, virDomainObjListCopyInactiveNames, &data);
+    if (virDomainObjListForEach(doms, virDomainObjListCopyInactiveNames,
+                                &data) < 0)
+        return -1;
     if (data.oom) {
         virReportOOMError();
         goto cleanup;
@@ -8842,6 +9242,128 @@ cleanup:
     return -1;
 }
 
+struct virDomainObjListSnapshot {
+    size_t nobjs;
+    virDomainObjPtr *objs;
+    char (*uuidstrs)[VIR_UUID_STRING_BUFLEN];
+};
+
+static void virDomainObjListSnapshotAdd(void *payload,
+                                        const void *name,
+                                        void *opaque)
+{
+    virDomainObjPtr obj = payload;
+    struct virDomainObjListSnapshot *snap = opaque;
+
+    virDomainObjRef(obj);
+
+    ignore_value(virStrcpyStatic(snap->uuidstrs[snap->nobjs], name));
+    snap->objs[snap->nobjs++] = obj;
+}
+
+/**
+ * virDomainObjListForEach:
+ * @doms: the list to walk
+ * @iter: called with each (unlocked) virDomainObjPtr as payload
+ * @opaque: passed through to @iter
+ *
+ * Call @iter on every domain in @doms. The domains are gathered,
+ * each with a reference held, under the list lock, and @iter is then
+ * called with the list unlocked; so @iter may lock the domain it is
+ * given and call other functions on @doms, but may be handed a domain
+ * which has been removed from @doms since the walk began.
+ *
+ * Returns 0 on success, -1 on OOM
+ */
+int virDomainObjListForEach(virDomainObjListPtr doms,
+                            virHashIterator iter,
+                            void *opaque)
+{
+    struct virDomainObjListSnapshot snap;
+    int count;
+    size_t i;
+
+    memset(&snap, 0, sizeof(snap));
+
+    virMutexLock(&doms->lock);
+    if ((count = virHashSize(doms->objs)) <= 0) {
+        virMutexUnlock(&doms->lock);
+        return 0;
+    }
+    if (VIR_ALLOC_N(snap.objs, count) < 0 ||
+        VIR_ALLOC_N(snap.uuidstrs, count) < 0) {
+        virMutexUnlock(&doms->lock);
+        VIR_FREE(snap.objs);
+        virReportOOMError();
+        return -1;
+    }
+    virHashForEach(doms->objs, virDomainObjListSnapshotAdd, &snap);
+    virMutexUnlock(&doms->lock);
+
+    for (i = 0 ; i < snap.nobjs ; i++) {
+        virDomainObjPtr obj = snap.objs[i];
+
+        (iter)(obj, snap.uuidstrs[i], opaque);
+
+        virDomainObjLock(obj);
+        if (virDomainObjUnref(obj) > 0)
+            virDomainObjUnlock(obj);
+    }
+
+    VIR_FREE(snap.uuidstrs);
+    VIR_FREE(snap.objs);
+    return 0;
+}
+
+struct virDomainXMLCacheStats {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long invalidations;
+};
+
+static void virDomainObjListSumXMLCacheStats(void *payload,
+                                             const void *name ATTRIBUTE_UNUSED,
+                                             void *opaque)
+{
+    virDomainObjPtr obj = payload;
+    struct virDomainXMLCacheStats *stats = opaque;
+
+    virDomainObjLock(obj);
+    stats->hits += obj->xmlCacheHits;
+    stats->misses += obj->xmlCacheMisses;
+    stats->invalidations += obj->xmlCacheInvalidations;
+    virDomainObjUnlock(obj);
+}
+
+/**
+ * virDomainObjListGetXMLCacheStats:
+ * @doms: the list to walk
+ * @hits: filled with the number of XML cache hits
+ * @misses: filled with the number of XML cache misses
+ * @invalidations: filled with the number of cached documents discarded
+ *
+ * Sum the virDomainObjGetXMLDesc cache counters of every domain
+ * currently in @doms.
+ *
+ * Returns 0 on success, -1 on OOM
+ */
+int virDomainObjListGetXMLCacheStats(virDomainObjListPtr doms,
+                                     unsigned long long *hits,
+                                     unsigned long long *misses,
+                                     unsigned long long *invalidations)
+{
+    struct virDomainXMLCacheStats stats = { 0, 0, 0 };
+
+    if (virDomainObjListForEach(doms, virDomainObjListSumXMLCacheStats,
+                                &stats) < 0)
+        return -1;
+
+    *hits = stats.hits;
+    *misses = stats.misses;
+    *invalidations = stats.invalidations;
+    return 0;
+}
+
 /* Snapshot Def functions */
 void virDomainSnapshotDefFree(virDomainSnapshotDefPtr def)
 {
@@ -46,6 +46,12 @@ typedef enum {
    VIR_DOMAIN_XML_INTERNAL_STATUS = (1<<16), /* dump internal domain status information */
 } virDomainXMLInternalFlags;
 
+/* Flags whose output virDomainObjGetXMLDesc caches, with one
+ * slot for each combination of them */
+# define VIR_DOMAIN_XML_CACHE_FLAGS \
+    (VIR_DOMAIN_XML_SECURE | VIR_DOMAIN_XML_INACTIVE)
+# define VIR_DOMAIN_XML_CACHE_SLOTS 4
+
 /* Different types of hypervisor */
 /* NB: Keep in sync with virDomainVirtTypeToString impl */
 enum virDomainVirtType {
@@ -1145,7 +1151,7 @@ typedef struct _virDomainObj virDomainObj;
 typedef virDomainObj *virDomainObjPtr;
 struct _virDomainObj {
     virMutex lock;
-    int refs;
+    int refs; /* Changed atomically, see virDomainObjRef */
 
     int pid;
     int state;
@@ -1157,6 +1163,15 @@ struct _virDomainObj {
     virDomainDefPtr def; /* The current definition */
     virDomainDefPtr newDef; /* New definition to activate at shutdown */
 
+    /* Formatted XML, and the definition it was formatted from, for
+     * virDomainObjGetXMLDesc. Drivers must call virDomainObjInvalidateXML
+     * after changing either definition in place */
+    char *xmlCache[VIR_DOMAIN_XML_CACHE_SLOTS];
+    virDomainDefPtr xmlCacheDef[VIR_DOMAIN_XML_CACHE_SLOTS];
+    unsigned long long xmlCacheHits;
+    unsigned long long xmlCacheMisses;
+    unsigned long long xmlCacheInvalidations;
+
     virDomainSnapshotObjList snapshots;
     virDomainSnapshotObjPtr current_snapshot;
 
@@ -1167,9 +1182,23 @@ struct _virDomainObj {
 typedef struct _virDomainObjList virDomainObjList;
 typedef virDomainObjList *virDomainObjListPtr;
 struct _virDomainObjList {
+    /* Guards the three tables below, so that drivers can look
+     * up objects without holding their driver lock. It is only
+     * held for the hash operations, and ranks after the driver
+     * lock and the object locks: never lock a virDomainObj while
+     * holding it */
+    virMutex lock;
+
     /* uuid string -> virDomainObj  mapping
-     * for O(1), lockless lookup-by-uuid */
+     * for O(1) lookup-by-uuid */
     virHashTable *objs;
+
+    /* name -> virDomainObj mapping for O(1) lookup-by-name,
+     * and id string -> virDomainObj mapping of active domains
+     * for O(1) lookup-by-id. Neither owns a reference, entries
+     * are dropped before the object leaves 'objs' */
+    virHashTable *names;
+    virHashTable *ids;
 };
 
 static inline bool
@@ -1189,6 +1218,14 @@ virDomainObjPtr virDomainFindByUUID(const virDomainObjListPtr doms,
 virDomainObjPtr virDomainFindByName(const virDomainObjListPtr doms,
                                     const char *name);
 
+int virDomainObjListSetID(virDomainObjListPtr doms,
+                          virDomainObjPtr dom,
+                          int id) ATTRIBUTE_RETURN_CHECK;
+int virDomainObjListAdd(virDomainObjListPtr doms,
+                        virDomainObjPtr dom);
+void virDomainObjListClearID(virDomainObjListPtr doms,
+                             virDomainObjPtr dom);
+
 
 void virDomainGraphicsDefFree(virDomainGraphicsDefPtr def);
 void virDomainInputDefFree(virDomainInputDefPtr def);
@@ -1270,6 +1307,10 @@ int virDomainDefAddImplicitControllers(virDomainDefPtr def);
 char *virDomainDefFormat(virDomainDefPtr def,
                          int flags);
 
+char *virDomainObjGetXMLDesc(virDomainObjPtr dom,
+                             int flags);
+void virDomainObjInvalidateXML(virDomainObjPtr dom);
+
 int virDomainCpuSetParse(const char **str,
                          char sep,
                          char *cpuset,
@@ -1348,6 +1389,15 @@ int virDomainObjListGetInactiveNames(virDomainObjListPtr doms,
                                      char **const names,
                                      int maxnames);
 
+int virDomainObjListForEach(virDomainObjListPtr doms,
+                            virHashIterator iter,
+                            void *opaque);
+
+int virDomainObjListGetXMLCacheStats(virDomainObjListPtr doms,
+                                     unsigned long long *hits,
+                                     unsigned long long *misses,
+                                     unsigned long long *invalidations);
+
 typedef int (*virDomainSmartcardDefIterator)(virDomainDefPtr def,
                                              virDomainSmartcardDefPtr dev,
                                              void *opaque);
@@ -27,6 +27,10 @@
 #include "logging.h"
 #include "datatypes.h"
 #include "memory.h"
+#include "threads.h"
+#include "intprops.h"
+#include "ignore-value.h"
+#include "uuid.h"
 #include "virterror_internal.h"
 
 #define VIR_FROM_THIS VIR_FROM_NONE
@@ -52,10 +56,17 @@ struct _virDomainEventCallback {
     void *opaque;
     virFreeCallback freecb;
     int deleted;
+
+    /* Events waiting for a virDomainEventDispatcher to run this
+     * callback, oldest first */
+    virDomainEventPtr *pending;
+    size_t npending;
+    bool overflowed;
 };
 
 struct _virDomainEvent {
     int eventID;
+    int refs;
 
     virDomainMeta dom;
 
@@ -86,6 +97,148 @@ struct _virDomainEvent {
     } data;
 };
 
+typedef struct _virDomainEventCallbackIndex virDomainEventCallbackIndex;
+typedef virDomainEventCallbackIndex *virDomainEventCallbackIndexPtr;
+struct _virDomainEventCallbackIndex {
+    size_t count;
+    virDomainEventCallbackPtr *callbacks;
+};
+
+/* Drop the events a dispatcher still had for @cb */
+static void
+virDomainEventCallbackClearPending(virDomainEventCallbackPtr cb)
+{
+    size_t i;
+
+    for (i = 0 ; i < cb->npending ; i++)
+        virDomainEventFree(cb->pending[i]);
+    VIR_FREE(cb->pending);
+    cb->npending = 0;
+}
+
+/* Free @cb itself; its freecb and connection are up to the caller */
+static void
+virDomainEventCallbackFree(virDomainEventCallbackPtr cb)
+{
+    if (!cb)
+        return;
+
+    virDomainEventCallbackClearPending(cb);
+    if (cb->dom)
+        VIR_FREE(cb->dom->name);
+    VIR_FREE(cb->dom);
+    VIR_FREE(cb);
+}
+
+static void
+virDomainEventCallbackIndexKey(char *key, size_t keylen,
+                               int eventID, const unsigned char *uuid)
+{
+    char uuidstr[VIR_UUID_STRING_BUFLEN];
+
+    if (uuid) {
+        virUUIDFormat(uuid, uuidstr);
+        snprintf(key, keylen, "%d:%s", eventID, uuidstr);
+    } else {
+        snprintf(key, keylen, "%d:*", eventID);
+    }
+}
+
+#define VIR_DOMAIN_EVENT_INDEX_KEYLEN \
+    (INT_BUFSIZE_BOUND(int) + VIR_UUID_STRING_BUFLEN + 1)
+
+static void
+virDomainEventCallbackIndexFree(void *payload,
+                                const void *name ATTRIBUTE_UNUSED)
+{
+    virDomainEventCallbackIndexPtr entry = payload;
+
+    VIR_FREE(entry->callbacks);
+    VIR_FREE(entry);
+}
+
+static virDomainEventCallbackIndexPtr
+virDomainEventCallbackListIndexLookup(virDomainEventCallbackListPtr cbList,
+                                      int eventID,
+                                      const unsigned char *uuid)
+{
+    char key[VIR_DOMAIN_EVENT_INDEX_KEYLEN];
+
+    if (!cbList->index)
+        return NULL;
+
+    virDomainEventCallbackIndexKey(key, sizeof(key), eventID, uuid);
+    return virHashLookup(cbList->index, key);
+}
+
+/* Returns -1, without reporting an error, when out of memory */
+static int
+virDomainEventCallbackListIndexAdd(virDomainEventCallbackListPtr cbList,
+                                   virDomainEventCallbackPtr cb)
+{
+    char key[VIR_DOMAIN_EVENT_INDEX_KEYLEN];
+    virDomainEventCallbackIndexPtr entry;
+
+    if (!cbList->index &&
+        !(cbList->index = virHashCreate(16, virDomainEventCallbackIndexFree)))
+        return -1;
+
+    virDomainEventCallbackIndexKey(key, sizeof(key), cb->eventID,
+                                   cb->dom ? cb->dom->uuid : NULL);
+
+    if (!(entry = virHashLookup(cbList->index, key))) {
+        if (VIR_ALLOC(entry) < 0)
+            return -1;
+        if (virHashAddEntry(cbList->index, key, entry) < 0) {
+            VIR_FREE(entry);
+            return -1;
+        }
+    }
+
+    if (VIR_REALLOC_N(entry->callbacks, entry->count + 1) < 0) {
+        if (entry->count == 0)
+            virHashRemoveEntry(cbList->index, key);
+        return -1;
+    }
+    entry->callbacks[entry->count++] = cb;
+
+    return 0;
+}
+
+static void
+virDomainEventCallbackListIndexRemove(virDomainEventCallbackListPtr cbList,
+                                      virDomainEventCallbackPtr cb)
+{
+    char key[VIR_DOMAIN_EVENT_INDEX_KEYLEN];
+    virDomainEventCallbackIndexPtr entry;
+    size_t i;
+
+    if (!cbList->index)
+        return;
+
+    virDomainEventCallbackIndexKey(key, sizeof(key), cb->eventID,
+                                   cb->dom ? cb->dom->uuid : NULL);
+    if (!(entry = virHashLookup(cbList->index, key)))
+        return;
+
+    for (i = 0 ; i < entry->count ; i++) {
+        if (entry->callbacks[i] != cb)
+            continue;
+
+        if (i < (entry->count - 1))
+            memmove(entry->callbacks + i,
+                    entry->callbacks + i + 1,
+                    sizeof(*(entry->callbacks)) *
+                            (entry->count - (i + 1)));
+        entry->count--;
+        break;
+    }
+
+    if (entry->count == 0)
+        virHashRemoveEntry(cbList->index, key);
+}
+
+
 /**
  * virDomainEventCallbackListFree:
  * @list: event callback list head
@@ -103,8 +256,10 @@ virDomainEventCallbackListFree(virDomainEventCallbackListPtr list)
         virFreeCallback freecb = list->callbacks[i]->freecb;
         if (freecb)
             (*freecb)(list->callbacks[i]->opaque);
-        VIR_FREE(list->callbacks[i]);
+        virDomainEventCallbackFree(list->callbacks[i]);
     }
+    VIR_FREE(list->callbacks);
+    virHashFree(list->index);
     VIR_FREE(list);
 }
 
@@ -128,10 +283,12 @@ virDomainEventCallbackListRemove(virConnectPtr conn,
             cbList->callbacks[i]->eventID == VIR_DOMAIN_EVENT_ID_LIFECYCLE &&
             cbList->callbacks[i]->conn == conn) {
             virFreeCallback freecb = cbList->callbacks[i]->freecb;
+            virDomainEventCallbackListIndexRemove(cbList,
+                                                  cbList->callbacks[i]);
             if (freecb)
                 (*freecb)(cbList->callbacks[i]->opaque);
             virUnrefConnect(cbList->callbacks[i]->conn);
-            VIR_FREE(cbList->callbacks[i]);
+            virDomainEventCallbackFree(cbList->callbacks[i]);
 
             if (i < (cbList->count - 1))
                 memmove(cbList->callbacks + i,
@@ -173,10 +330,12 @@ virDomainEventCallbackListRemoveID(virConnectPtr conn,
         if (cbList->callbacks[i]->callbackID == callbackID &&
             cbList->callbacks[i]->conn == conn) {
             virFreeCallback freecb = cbList->callbacks[i]->freecb;
+            virDomainEventCallbackListIndexRemove(cbList,
+                                                  cbList->callbacks[i]);
             if (freecb)
                 (*freecb)(cbList->callbacks[i]->opaque);
             virUnrefConnect(cbList->callbacks[i]->conn);
-            VIR_FREE(cbList->callbacks[i]);
+            virDomainEventCallbackFree(cbList->callbacks[i]);
 
             if (i < (cbList->count - 1))
                 memmove(cbList->callbacks + i,
@@ -217,10 +376,12 @@ virDomainEventCallbackListRemoveConn(virConnectPtr conn,
     for (i = 0 ; i < cbList->count ; i++) {
         if (cbList->callbacks[i]->conn == conn) {
             virFreeCallback freecb = cbList->callbacks[i]->freecb;
+            virDomainEventCallbackListIndexRemove(cbList,
+                                                  cbList->callbacks[i]);
             if (freecb)
                 (*freecb)(cbList->callbacks[i]->opaque);
             virUnrefConnect(cbList->callbacks[i]->conn);
-            VIR_FREE(cbList->callbacks[i]);
+            virDomainEventCallbackFree(cbList->callbacks[i]);
 
             if (i < (cbList->count - 1))
                 memmove(cbList->callbacks + i,
@@ -247,8 +408,10 @@ int virDomainEventCallbackListMarkDelete(virConnectPtr conn,
     for (i = 0 ; i < cbList->count ; i++) {
         if (cbList->callbacks[i]->cb == VIR_DOMAIN_EVENT_CALLBACK(callback) &&
             cbList->callbacks[i]->eventID == VIR_DOMAIN_EVENT_ID_LIFECYCLE &&
-            cbList->callbacks[i]->conn == conn) {
+            cbList->callbacks[i]->conn == conn &&
+            !cbList->callbacks[i]->deleted) {
             cbList->callbacks[i]->deleted = 1;
+            virDomainEventCallbackClearPending(cbList->callbacks[i]);
             return 0;
         }
     }
@@ -266,8 +429,10 @@ int virDomainEventCallbackListMarkDeleteID(virConnectPtr conn,
     int i;
     for (i = 0 ; i < cbList->count ; i++) {
         if (cbList->callbacks[i]->callbackID == callbackID &&
-            cbList->callbacks[i]->conn == conn) {
+            cbList->callbacks[i]->conn == conn &&
+            !cbList->callbacks[i]->deleted) {
             cbList->callbacks[i]->deleted = 1;
+            virDomainEventCallbackClearPending(cbList->callbacks[i]);
             return 0;
         }
     }
@@ -278,6 +443,20 @@ int virDomainEventCallbackListMarkDeleteID(virConnectPtr conn,
 }
 
 
+static void
+virDomainEventCallbackListMarkDeleteConn(virConnectPtr conn,
+                                         virDomainEventCallbackListPtr cbList)
+{
+    int i;
+    for (i = 0 ; i < cbList->count ; i++) {
+        if (cbList->callbacks[i]->conn == conn) {
+            cbList->callbacks[i]->deleted = 1;
+            virDomainEventCallbackClearPending(cbList->callbacks[i]);
+        }
+    }
+}
+
+
 int virDomainEventCallbackListPurgeMarked(virDomainEventCallbackListPtr cbList)
 {
     int old_count = cbList->count;
@@ -285,10 +464,12 @@ int virDomainEventCallbackListPurgeMarked(virDomainEventCallbackListPtr cbList)
     for (i = 0 ; i < cbList->count ; i++) {
         if (cbList->callbacks[i]->deleted) {
             virFreeCallback freecb = cbList->callbacks[i]->freecb;
+            virDomainEventCallbackListIndexRemove(cbList,
+                                                  cbList->callbacks[i]);
             if (freecb)
                 (*freecb)(cbList->callbacks[i]->opaque);
             virUnrefConnect(cbList->callbacks[i]->conn);
-            VIR_FREE(cbList->callbacks[i]);
+            virDomainEventCallbackFree(cbList->callbacks[i]);
 
             if (i < (cbList->count - 1))
                 memmove(cbList->callbacks + i,
@@ -389,6 +570,9 @@ virDomainEventCallbackListAddID(virConnectPtr conn,
     if (VIR_REALLOC_N(cbList->callbacks, cbList->count + 1) < 0)
         goto no_memory;
 
+    if (virDomainEventCallbackListIndexAdd(cbList, event) < 0)
+        goto no_memory;
+
     event->conn->refs++;
 
     cbList->callbacks[cbList->count] = event;
@@ -471,6 +655,10 @@ void virDomainEventFree(virDomainEventPtr event)
     if (!event)
         return;
 
+    /* Still queued for another callback of a dispatcher */
+    if (--event->refs > 0)
+        return;
+
     switch (event->eventID) {
     case VIR_DOMAIN_EVENT_ID_IO_ERROR_REASON:
     case VIR_DOMAIN_EVENT_ID_IO_ERROR:
@@ -531,6 +719,7 @@ static virDomainEventPtr virDomainEventNewInternal(int eventID,
     }
 
     event->eventID = eventID;
+    event->refs = 1;
     if (!(event->dom.name = strdup(name))) {
         virReportOOMError();
         VIR_FREE(event);
@@ -959,27 +1148,79 @@ static int virDomainEventDispatchMatchCallback(virDomainEventPtr event,
     }
 }
 
+typedef void (*virDomainEventMatchFunc)(virDomainEventCallbackPtr cb,
+                                        virDomainEventPtr event,
+                                        void *opaque);
+
+/*
+ * Run @func for every callback interested in @event, in the order
+ * they were registered. Only the index entries for the event's own
+ * ID are looked at, rather than every callback in the list.
+ */
+static void
+virDomainEventCallbackListForEachMatch(virDomainEventCallbackListPtr cbList,
+                                       virDomainEventPtr event,
+                                       virDomainEventMatchFunc func,
+                                       void *opaque)
+{
+    virDomainEventCallbackIndexPtr all;
+    virDomainEventCallbackIndexPtr one;
+    size_t nall, none;
+    size_t i = 0, j = 0;
+
+    all = virDomainEventCallbackListIndexLookup(cbList, event->eventID, NULL);
+    one = virDomainEventCallbackListIndexLookup(cbList, event->eventID,
+                                                event->dom.uuid);
+
+    /* Cache the counts now, since @func may be dropping the lock,
+       and have more callbacks added. We're guarenteed not to have
+       any removed, so the entries stay put */
+    nall = all ? all->count : 0;
+    none = one ? one->count : 0;
+
+    while (i < nall || j < none) {
+        virDomainEventCallbackPtr cb;
+
+        /* Callback IDs grow with each registration */
+        if (j == none ||
+            (i < nall &&
+             all->callbacks[i]->callbackID < one->callbacks[j]->callbackID))
+            cb = all->callbacks[i++];
+        else
+            cb = one->callbacks[j++];
+
+        if (!virDomainEventDispatchMatchCallback(event, cb))
+            continue;
+
+        (*func)(cb, event, opaque);
+    }
+}
+
+
+struct virDomainEventDispatchData {
+    virDomainEventDispatchFunc dispatch;
+    void *opaque;
+};
+
+static void
+virDomainEventDispatchOne(virDomainEventCallbackPtr cb,
+                          virDomainEventPtr event,
+                          void *opaque)
+{
+    struct virDomainEventDispatchData *data = opaque;
+
+    (*data->dispatch)(cb->conn, event, cb->cb, cb->opaque, data->opaque);
+}
+
 void virDomainEventDispatch(virDomainEventPtr event,
                             virDomainEventCallbackListPtr callbacks,
                             virDomainEventDispatchFunc dispatch,
                             void *opaque)
 {
-    int i;
-    /* Cache this now, since we may be dropping the lock,
-       and have more callbacks added. We're guarenteed not
-       to have any removed */
-    int cbCount = callbacks->count;
-
-    for (i = 0 ; i < cbCount ; i++) {
-        if (!virDomainEventDispatchMatchCallback(event, callbacks->callbacks[i]))
-            continue;
+    struct virDomainEventDispatchData data = { dispatch, opaque };
 
-        (*dispatch)(callbacks->callbacks[i]->conn,
-                    event,
-                    callbacks->callbacks[i]->cb,
-                    callbacks->callbacks[i]->opaque,
-                    opaque);
-    }
+    virDomainEventCallbackListForEachMatch(callbacks, event,
+                                           virDomainEventDispatchOne, &data);
 }
 
 
@@ -997,3 +1238,436 @@ void virDomainEventQueueDispatch(virDomainEventQueuePtr queue,
     VIR_FREE(queue->events);
     queue->count = 0;
 }
+
+
+struct _virDomainEventDispatcher {
+    virMutex lock;
+    virCond cond;           /* New events, or time to quit */
+    virThread thread;
+    bool quit;
+    bool queued;            /* Events or removed callbacks may be pending */
+
+    virDomainEventCallbackListPtr callbacks;
+
+    virDomainEventDispatchFunc dispatch;
+    void *opaque;
+};
+
+enum {
+    VIR_DOMAIN_EVENT_COALESCE_NONE,     /* Keep both */
+    VIR_DOMAIN_EVENT_COALESCE_DROP,     /* The new event adds nothing */
+    VIR_DOMAIN_EVENT_COALESCE_REPLACE,  /* The new event supersedes */
+};
+
+/*
+ * Decide what to do with @event given @last, the latest event of
+ * the same ID and domain still waiting for the same callback.
+ */
+static int
+virDomainEventCoalesce(virDomainEventPtr last,
+                       virDomainEventPtr event)
+{
+    switch (event->eventID) {
+    case VIR_DOMAIN_EVENT_ID_LIFECYCLE:
+        if (last->data.lifecycle.type == event->data.lifecycle.type &&
+            last->data.lifecycle.detail == event->data.lifecycle.detail)
+            return VIR_DOMAIN_EVENT_COALESCE_DROP;
+        break;
+
+    case VIR_DOMAIN_EVENT_ID_REBOOT:
+        return VIR_DOMAIN_EVENT_COALESCE_DROP;
+
+    case VIR_DOMAIN_EVENT_ID_RTC_CHANGE:
+        /* The offset is absolute, so only the latest one matters */
+        return VIR_DOMAIN_EVENT_COALESCE_REPLACE;
+
+    case VIR_DOMAIN_EVENT_ID_WATCHDOG:
+        if (last->data.watchdog.action == event->data.watchdog.action)
+            return VIR_DOMAIN_EVENT_COALESCE_DROP;
+        break;
+
+    case VIR_DOMAIN_EVENT_ID_IO_ERROR:
+    case VIR_DOMAIN_EVENT_ID_IO_ERROR_REASON:
+        if (last->data.ioError.action == event->data.ioError.action &&
+            STREQ_NULLABLE(last->data.ioError.srcPath,
+                           event->data.ioError.srcPath) &&
+            STREQ_NULLABLE(last->data.ioError.devAlias,
+                           event->data.ioError.devAlias) &&
+            STREQ_NULLABLE(last->data.ioError.reason,
+                           event->data.ioError.reason))
+            return VIR_DOMAIN_EVENT_COALESCE_DROP;
+        break;
+    }
+
+    return VIR_DOMAIN_EVENT_COALESCE_NONE;
+}
+
+/* Queue @event for @cb; dispatcher must be locked */
+static void
+virDomainEventDispatcherPush(virDomainEventCallbackPtr cb,
+                             virDomainEventPtr event,
+                             void *opaque ATTRIBUTE_UNUSED)
+{
+    size_t i;
+
+    for (i = cb->npending ; i > 0 ; i--) {
+        virDomainEventPtr last = cb->pending[i - 1];
+
+        if (last->eventID != event->eventID ||
+            memcmp(last->dom.uuid, event->dom.uuid, VIR_UUID_BUFLEN) != 0)
+            continue;
+
+        switch (virDomainEventCoalesce(last, event)) {
+        case VIR_DOMAIN_EVENT_COALESCE_DROP:
+            return;
+        case VIR_DOMAIN_EVENT_COALESCE_REPLACE:
+            virDomainEventFree(last);
+            event->refs++;
+            cb->pending[i - 1] = event;
+            return;
+        }
+        break;
+    }
+
+    /* A callback which cannot keep up loses its oldest events,
+     * rather than holding on to ever more memory */
+    if (cb->npending == VIR_DOMAIN_EVENT_PENDING_MAX) {
+        if (!cb->overflowed)
+            VIR_WARN("Dropping domain events for callback %d, which "
+                     "has %d pending", cb->callbackID,
+                     VIR_DOMAIN_EVENT_PENDING_MAX);
+        cb->overflowed = true;
+        virDomainEventFree(cb->pending[0]);
+        memmove(cb->pending, cb->pending + 1,
+                sizeof(*(cb->pending)) * (cb->npending - 1));
+        cb->npending--;
+    }
+
+    if (VIR_REALLOC_N(cb->pending, cb->npending + 1) < 0) {
+        virReportOOMError();
+        return;
+    }
+
+    event->refs++;
+    cb->pending[cb->npending++] = event;
+}
+
+/*
+ * Free the callbacks removed while the last pass ran, now that none
+ * of them is running. Their freecb may call back into the dispatcher,
+ * or take locks held by whoever removed them, so it runs unlocked.
+ */
+static void
+virDomainEventDispatcherPurge(virDomainEventDispatcherPtr dispatcher)
+{
+    virDomainEventCallbackListPtr cbList = dispatcher->callbacks;
+    virDomainEventCallbackPtr *purged = NULL;
+    size_t npurged = 0;
+    int i;
+
+    for (i = 0 ; i < cbList->count ; i++) {
+        if (cbList->callbacks[i]->deleted)
+            npurged++;
+    }
+    if (npurged == 0)
+        return;
+
+    if (VIR_ALLOC_N(purged, npurged) < 0) {
+        /* Free them in place instead */
+        virReportOOMError();
+        virDomainEventCallbackListPurgeMarked(cbList);
+        return;
+    }
+
+    npurged = 0;
+    for (i = 0 ; i < cbList->count ; i++) {
+        virDomainEventCallbackPtr cb = cbList->callbacks[i];
+
+        if (!cb->deleted) {
+            cbList->callbacks[i - npurged] = cb;
+            continue;
+        }
+        virDomainEventCallbackListIndexRemove(cbList, cb);
+        purged[npurged++] = cb;
+    }
+    cbList->count -= npurged;
+
+    virMutexUnlock(&dispatcher->lock);
+
+    for (i = 0 ; i < npurged ; i++) {
+        if (purged[i]->freecb)
+            (*purged[i]->freecb)(purged[i]->opaque);
+        virUnrefConnect(purged[i]->conn);
+        virDomainEventCallbackFree(purged[i]);
+    }
+    VIR_FREE(purged);
+
+    virMutexLock(&dispatcher->lock);
+}
+
+static void
+virDomainEventDispatcherWorker(void *opaque)
+{
+    virDomainEventDispatcherPtr dispatcher = opaque;
+
+    virMutexLock(&dispatcher->lock);
+
+    while (!dispatcher->quit) {
+        int i;
+
+        if (!dispatcher->queued) {
+            if (virCondWait(&dispatcher->cond, &dispatcher->lock) < 0) {
+                VIR_ERROR0(_("cannot wait for domain events"));
+                break;
+            }
+            continue;
+        }
+        dispatcher->queued = false;
+
+        /* Run at most one event per callback each time round, so a
+         * callback with a long backlog cannot hold up the others */
+        for (i = 0 ; i < dispatcher->callbacks->count ; i++) {
+            virDomainEventCallbackPtr cb = dispatcher->callbacks->callbacks[i];
+            virDomainEventPtr event;
+
+            if (cb->deleted || cb->npending == 0)
+                continue;
+
+            event = cb->pending[0];
+            memmove(cb->pending, cb->pending + 1,
+                    sizeof(*(cb->pending)) * (cb->npending - 1));
+            if (--cb->npending == 0) {
+                VIR_FREE(cb->pending);
+                cb->overflowed = false;
+            }
+
+            /* There may be more after this one */
+            dispatcher->queued = true;
+            virMutexUnlock(&dispatcher->lock);
+
+            (*dispatcher->dispatch)(cb->conn, event, cb->cb, cb->opaque,
+                                    dispatcher->opaque);
+
+            virMutexLock(&dispatcher->lock);
+            virDomainEventFree(event);
+        }
+
+        virDomainEventDispatcherPurge(dispatcher);
+    }
+
+    virMutexUnlock(&dispatcher->lock);
+}
+
+
+/**
+ * virDomainEventDispatcherNew:
+ * @dispatch: how to run a callback, or NULL for the default
+ * @opaque: data for @dispatch
+ *
+ * Start a thread which runs domain event callbacks, so that events
+ * can be queued with nothing but the dispatcher's own lock held.
+ *
+ * Returns the dispatcher, or NULL on error
+ */
+virDomainEventDispatcherPtr
+virDomainEventDispatcherNew(virDomainEventDispatchFunc dispatch,
+                            void *opaque)
+{
+    virDomainEventDispatcherPtr dispatcher;
+
+    if (VIR_ALLOC(dispatcher) < 0 ||
+        VIR_ALLOC(dispatcher->callbacks) < 0) {
+        virReportOOMError();
+        VIR_FREE(dispatcher);
+        return NULL;
+    }
+
+    dispatcher->dispatch = dispatch ? dispatch
+                                    : virDomainEventDispatchDefaultFunc;
+    dispatcher->opaque = opaque;
+
+    if (virMutexInit(&dispatcher->lock) < 0) {
+        eventReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                         _("cannot initialize mutex"));
+        goto error_lock;
+    }
+    if (virCondInit(&dispatcher->cond) < 0) {
+        eventReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                         _("cannot initialize condition variable"));
+        goto error_cond;
+    }
+
+    if (virThreadCreate(&dispatcher->thread, true,
+                        virDomainEventDispatcherWorker, dispatcher) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("cannot create domain event thread"));
+        goto error;
+    }
+
+    return dispatcher;
+
+error:
+    ignore_value(virCondDestroy(&dispatcher->cond));
+error_cond:
+    virMutexDestroy(&dispatcher->lock);
+error_lock:
+    virDomainEventCallbackListFree(dispatcher->callbacks);
+    VIR_FREE(dispatcher);
+    return NULL;
+}
+
+
+/**
+ * virDomainEventDispatcherFree:
+ * @dispatcher: the dispatcher
+ *
+ * Stop the dispatcher thread, dropping any events not yet delivered,
+ * and free the callbacks still registered
+ */
+void
+virDomainEventDispatcherFree(virDomainEventDispatcherPtr dispatcher)
+{
+    if (!dispatcher)
+        return;
+
+    virMutexLock(&dispatcher->lock);
+    dispatcher->quit = true;
+    virCondSignal(&dispatcher->cond);
+    virMutexUnlock(&dispatcher->lock);
+
+    virThreadJoin(&dispatcher->thread);
+
+    virDomainEventCallbackListFree(dispatcher->callbacks);
+    ignore_value(virCondDestroy(&dispatcher->cond));
+    virMutexDestroy(&dispatcher->lock);
+    VIR_FREE(dispatcher);
+}
+
+
+/**
+ * virDomainEventDispatcherQueue:
+ * @dispatcher: the dispatcher
+ * @event: the event, which the dispatcher now owns
+ *
+ * Queue @event for every callback interested in it. Where a callback
+ * already has a pending event which @event makes redundant, the two
+ * are merged.
+ */
+void
+virDomainEventDispatcherQueue(virDomainEventDispatcherPtr dispatcher,
+                              virDomainEventPtr event)
+{
+    if (!event)
+        return;
+
+    virMutexLock(&dispatcher->lock);
+
+    virDomainEventCallbackListForEachMatch(dispatcher->callbacks, event,
+                                           virDomainEventDispatcherPush,
+                                           NULL);
+    virDomainEventFree(event);
+
+    dispatcher->queued = true;
+    virCondSignal(&dispatcher->cond);
+
+    virMutexUnlock(&dispatcher->lock);
+}
+
+
+int
+virDomainEventDispatcherAdd(virDomainEventDispatcherPtr dispatcher,
+                            virConnectPtr conn,
+                            virConnectDomainEventCallback callback,
+                            void *opaque,
+                            virFreeCallback freecb)
+{
+    int ret;
+
+    virMutexLock(&dispatcher->lock);
+    ret = virDomainEventCallbackListAdd(conn, dispatcher->callbacks,
+                                        callback, opaque, freecb);
+    virMutexUnlock(&dispatcher->lock);
+
+    return ret;
+}
+
+
+int
+virDomainEventDispatcherAddID(virDomainEventDispatcherPtr dispatcher,
+                              virConnectPtr conn,
+                              virDomainPtr dom,
+                              int eventID,
+                              virConnectDomainEventGenericCallback cb,
+                              void *opaque,
+                              virFreeCallback freecb)
+{
+    int ret;
+
+    virMutexLock(&dispatcher->lock);
+    ret = virDomainEventCallbackListAddID(conn, dispatcher->callbacks,
+                                          dom, eventID, cb, opaque, freecb);
+    virMutexUnlock(&dispatcher->lock);
+
+    return ret;
+}
+
+
+/*
+ * Removing a callback never waits for it to return, since it may be
+ * running right now and need a lock the caller holds. It is only
+ * marked as deleted, and the dispatcher thread runs its freecb and
+ * drops its connection once it is sure not to be running it.
+ */
+static void
+virDomainEventDispatcherPurgeLater(virDomainEventDispatcherPtr dispatcher)
+{
+    dispatcher->queued = true;
+    virCondSignal(&dispatcher->cond);
+}
+
+
+int
+virDomainEventDispatcherRemove(virDomainEventDispatcherPtr dispatcher,
+                               virConnectPtr conn,
+                               virConnectDomainEventCallback callback)
+{
+    int ret;
+
+    virMutexLock(&dispatcher->lock);
+    ret = virDomainEventCallbackListMarkDelete(conn, dispatcher->callbacks,
+                                               callback);
+    virDomainEventDispatcherPurgeLater(dispatcher);
+    virMutexUnlock(&dispatcher->lock);
+
+    return ret;
+}
+
+
+int
+virDomainEventDispatcherRemoveID(virDomainEventDispatcherPtr dispatcher,
+                                 virConnectPtr conn,
+                                 int callbackID)
+{
+    int ret;
+
+    virMutexLock(&dispatcher->lock);
+    ret = virDomainEventCallbackListMarkDeleteID(conn, dispatcher->callbacks,
+                                                 callbackID);
+    virDomainEventDispatcherPurgeLater(dispatcher);
+    virMutexUnlock(&dispatcher->lock);
+
+    return ret;
+}
+
+
+int
+virDomainEventDispatcherRemoveConn(virDomainEventDispatcherPtr dispatcher,
+                                   virConnectPtr conn)
+{
+    virMutexLock(&dispatcher->lock);
+    virDomainEventCallbackListMarkDeleteConn(conn, dispatcher->callbacks);
+    virDomainEventDispatcherPurgeLater(dispatcher);
+    virMutexUnlock(&dispatcher->lock);
+
+    return 0;
+}
@@ -26,6 +26,7 @@
 # define __DOMAIN_EVENT_H__
 
 # include "domain_conf.h"
+# include "hash.h"
 
 typedef struct _virDomainEventCallback virDomainEventCallback;
 typedef virDomainEventCallback *virDomainEventCallbackPtr;
@@ -34,6 +35,10 @@ struct _virDomainEventCallbackList {
     unsigned int nextID;
     unsigned int count;
     virDomainEventCallbackPtr *callbacks;
+    /* Maps "eventID:UUID", or "eventID:*" for callbacks not tied to
+     * one domain, to the matching callbacks in registration order.
+     * Created with the first callback */
+    virHashTablePtr index;
 };
 typedef struct _virDomainEventCallbackList virDomainEventCallbackList;
 typedef virDomainEventCallbackList *virDomainEventCallbackListPtr;
@@ -184,4 +189,48 @@ void virDomainEventQueueDispatch(virDomainEventQueuePtr queue,
                                  virDomainEventDispatchFunc dispatch,
                                  void *opaque);
 
+/**
+ * Dispatching domain events from a thread of their own, so that
+ * neither the driver nor the event loop waits on the callbacks
+ */
+typedef struct _virDomainEventDispatcher virDomainEventDispatcher;
+typedef virDomainEventDispatcher *virDomainEventDispatcherPtr;
+
+/* Most events held back for any one callback which falls behind */
+# define VIR_DOMAIN_EVENT_PENDING_MAX 256
+
+virDomainEventDispatcherPtr
+virDomainEventDispatcherNew(virDomainEventDispatchFunc dispatch,
+                            void *opaque);
+void virDomainEventDispatcherFree(virDomainEventDispatcherPtr dispatcher);
+
+void virDomainEventDispatcherQueue(virDomainEventDispatcherPtr dispatcher,
+                                   virDomainEventPtr event);
+
+int virDomainEventDispatcherAdd(virDomainEventDispatcherPtr dispatcher,
+                                virConnectPtr conn,
+                                virConnectDomainEventCallback callback,
+                                void *opaque,
+                                virFreeCallback freecb)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
+int virDomainEventDispatcherAddID(virDomainEventDispatcherPtr dispatcher,
+                                  virConnectPtr conn,
+                                  virDomainPtr dom,
+                                  int eventID,
+                                  virConnectDomainEventGenericCallback cb,
+                                  void *opaque,
+                                  virFreeCallback freecb)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(5);
+int virDomainEventDispatcherRemove(virDomainEventDispatcherPtr dispatcher,
+                                   virConnectPtr conn,
+                                   virConnectDomainEventCallback callback)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
+int virDomainEventDispatcherRemoveID(virDomainEventDispatcherPtr dispatcher,
+                                     virConnectPtr conn,
+                                     int callbackID)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
+int virDomainEventDispatcherRemoveConn(virDomainEventDispatcherPtr dispatcher,
+                                       virConnectPtr conn)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
+
 #endif
@@ -32,6 +32,7 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stddef.h>
 
 #include "virterror_internal.h"
 #include "datatypes.h"
@@ -44,6 +45,7 @@
 #include "util.h"
 #include "memory.h"
 #include "files.h"
+#include "ignore-value.h"
 
 #define VIR_FROM_THIS VIR_FROM_STORAGE
 
@@ -316,6 +318,9 @@ virStoragePoolObjFree(virStoragePoolObjPtr obj) {
 
     virStoragePoolObjClearVols(obj);
 
+    if (obj->privateDataFreeFunc)
+        (obj->privateDataFreeFunc)(obj->privateData);
+
     virStoragePoolDefFree(obj->def);
     virStoragePoolDefFree(obj->newDef);
 
@@ -1329,42 +1334,159 @@ virStoragePoolObjClearVols(virStoragePoolObjPtr pool)
 
     VIR_FREE(pool->volumes.objs);
     pool->volumes.count = 0;
+
+    virHashFree(pool->volumes.names);
+    virHashFree(pool->volumes.keys);
+    virHashFree(pool->volumes.paths);
+    pool->volumes.names = NULL;
+    pool->volumes.keys = NULL;
+    pool->volumes.paths = NULL;
 }
 
-virStorageVolDefPtr
-virStorageVolDefFindByKey(virStoragePoolObjPtr pool,
-                          const char *key) {
+/* Index @vol under @name, unless an earlier volume already has
+ * that name, as the lookups have always returned the first match */
+static int
+virStorageVolDefListIndex(virHashTablePtr table,
+                          const char *name,
+                          virStorageVolDefPtr vol)
+{
+    if (!name || virHashLookup(table, name))
+        return 0;
+    return virHashAddEntry(table, name, vol);
+}
+
+/* Drop @vol from @table, where it is indexed by the string found at
+ * @offset within virStorageVolDef */
+static void
+virStorageVolDefListUnindex(virStorageVolDefListPtr list,
+                            virHashTablePtr table,
+                            const char *name,
+                            virStorageVolDefPtr vol,
+                            size_t offset)
+{
     unsigned int i;
 
-    for (i = 0 ; i < pool->volumes.count ; i++)
-        if (STREQ(pool->volumes.objs[i]->key, key))
-            return pool->volumes.objs[i];
+    if (!name || virHashLookup(table, name) != vol)
+        return;
 
-    return NULL;
+    virHashRemoveEntry(table, name);
+
+    /* Let the next volume with the same name take over */
+    for (i = 0 ; i < list->count ; i++) {
+        const char *other = *(char **)((char *)list->objs[i] + offset);
+
+        if (list->objs[i] != vol && other && STREQ(other, name)) {
+            ignore_value(virHashAddEntry(table, name, list->objs[i]));
+            break;
+        }
+    }
 }
 
-virStorageVolDefPtr
-virStorageVolDefFindByPath(virStoragePoolObjPtr pool,
-                           const char *path) {
+/**
+ * virStoragePoolObjAddVol:
+ * @pool: the pool, locked
+ * @vol: the volume to add, with its name, key and path filled in
+ *
+ * Append @vol to the pool's volumes and index it, so it can be
+ * found by name, key and path. The pool owns @vol on success.
+ *
+ * Returns 0 on success, -1 on failure with an error reported
+ */
+int
+virStoragePoolObjAddVol(virStoragePoolObjPtr pool,
+                        virStorageVolDefPtr vol)
+{
+    virStorageVolDefListPtr list = &pool->volumes;
+
+    if (!list->names &&
+        (!(list->names = virHashCreate(50, NULL)) ||
+         !(list->keys = virHashCreate(50, NULL)) ||
+         !(list->paths = virHashCreate(50, NULL))))
+        goto no_memory;
+
+    if (VIR_REALLOC_N(list->objs, list->count + 1) < 0)
+        goto no_memory;
+
+    if (virStorageVolDefListIndex(list->names, vol->name, vol) < 0 ||
+        virStorageVolDefListIndex(list->keys, vol->key, vol) < 0 ||
+        virStorageVolDefListIndex(list->paths, vol->target.path, vol) < 0) {
+        virStorageVolDefListUnindex(list, list->names, vol->name, vol,
+                                    offsetof(virStorageVolDef, name));
+        virStorageVolDefListUnindex(list, list->keys, vol->key, vol,
+                                    offsetof(virStorageVolDef, key));
+        virStorageVolDefListUnindex(list, list->paths, vol->target.path, vol,
+                                    offsetof(virStorageVolDef, target.path));
+        goto no_memory;
+    }
+
+    list->objs[list->count++] = vol;
+    return 0;
+
+no_memory:
+    virReportOOMError();
+    return -1;
+}
+
+/**
+ * virStoragePoolObjRemoveVol:
+ * @pool: the pool, locked
+ * @vol: the volume to remove
+ *
+ * Remove @vol from the pool's volumes and indexes. The caller
+ * becomes responsible for freeing @vol.
+ */
+void
+virStoragePoolObjRemoveVol(virStoragePoolObjPtr pool,
+                           virStorageVolDefPtr vol)
+{
+    virStorageVolDefListPtr list = &pool->volumes;
     unsigned int i;
 
-    for (i = 0 ; i < pool->volumes.count ; i++)
-        if (STREQ(pool->volumes.objs[i]->target.path, path))
-            return pool->volumes.objs[i];
+    for (i = 0 ; i < list->count ; i++) {
+        if (list->objs[i] == vol)
+            break;
+    }
+    if (i == list->count)
+        return;
 
-    return NULL;
+    if (i < (list->count - 1))
+        memmove(list->objs + i, list->objs + i + 1,
+                sizeof(*(list->objs)) * (list->count - (i + 1)));
+    list->count--;
+    if (VIR_REALLOC_N(list->objs, list->count) < 0) {
+        ; /* Failure to reduce memory allocation isn't fatal */
+    }
+
+    virStorageVolDefListUnindex(list, list->names, vol->name, vol,
+                                offsetof(virStorageVolDef, name));
+    virStorageVolDefListUnindex(list, list->keys, vol->key, vol,
+                                offsetof(virStorageVolDef, key));
+    virStorageVolDefListUnindex(list, list->paths, vol->target.path, vol,
+                                offsetof(virStorageVolDef, target.path));
 }
 
 virStorageVolDefPtr
-virStorageVolDefFindByName(virStoragePoolObjPtr pool,
-                           const char *name) {
-    unsigned int i;
+virStorageVolDefFindByKey(virStoragePoolObjPtr pool,
+                          const char *key) {
+    if (!pool->volumes.keys)
+        return NULL;
+    return virHashLookup(pool->volumes.keys, key);
+}
 
-    for (i = 0 ; i < pool->volumes.count ; i++)
-        if (STREQ(pool->volumes.objs[i]->name, name))
-            return pool->volumes.objs[i];
+virStorageVolDefPtr
+virStorageVolDefFindByPath(virStoragePoolObjPtr pool,
+                           const char *path) {
+    if (!pool->volumes.paths)
+        return NULL;
+    return virHashLookup(pool->volumes.paths, path);
+}
 
-    return NULL;
+virStorageVolDefPtr
+virStorageVolDefFindByName(virStoragePoolObjPtr pool,
+                           const char *name) {
+    if (!pool->volumes.names)
+        return NULL;
+    return virHashLookup(pool->volumes.names, name);
 }
 
 virStoragePoolObjPtr
@@ -28,8 +28,11 @@
 # include "util.h"
 # include "storage_encryption_conf.h"
 # include "threads.h"
+# include "hash.h"
 
 # include <libxml/tree.h>
+# include <sys/types.h>
+# include <time.h>
 
 /* Shared structs */
 
@@ -83,6 +86,23 @@ struct _virStorageVolTarget {
 };
 
 
+/*
+ * What a file backed target looked like when it was last probed,
+ * so a pool refresh can tell whether it needs probing again
+ */
+typedef struct _virStorageVolStamp virStorageVolStamp;
+typedef virStorageVolStamp *virStorageVolStampPtr;
+struct _virStorageVolStamp {
+    bool valid;
+    bool symlink;   /* Changes to the target aren't seen on the link */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+};
+
+
 typedef struct _virStorageVolDef virStorageVolDef;
 typedef virStorageVolDef *virStorageVolDefPtr;
 struct _virStorageVolDef {
@@ -91,6 +111,8 @@ struct _virStorageVolDef {
     int type; /* virStorageVolType enum */
 
     unsigned int building;
+    unsigned int wiping;
+    unsigned long long wiped; /* Bytes wiped so far, while 'wiping' */
 
     unsigned long long allocation;
     unsigned long long capacity;
@@ -98,6 +120,10 @@ struct _virStorageVolDef {
     virStorageVolSource source;
     virStorageVolTarget target;
     virStorageVolTarget backingStore;
+
+    /* Only filled in by backends which refresh incrementally */
+    virStorageVolStamp stamp;
+    virStorageVolStamp backingStamp;
 };
 
 typedef struct _virStorageVolDefList virStorageVolDefList;
@@ -105,6 +131,12 @@ typedef virStorageVolDefList *virStorageVolDefListPtr;
 struct _virStorageVolDefList {
     unsigned int count;
     virStorageVolDefPtr *objs;
+
+    /* Indexes into 'objs', kept in step by virStoragePoolObjAddVol
+     * and virStoragePoolObjRemoveVol. Entries are not owned. */
+    virHashTablePtr names;
+    virHashTablePtr keys;
+    virHashTablePtr paths;
 };
 
 
@@ -286,6 +318,10 @@ struct _virStoragePoolObj {
     virStoragePoolDefPtr newDef;
 
     virStorageVolDefList volumes;
+
+    /* State kept between refreshes by the pool's backend */
+    void *privateData;
+    void (*privateDataFreeFunc)(void *);
 };
 
 typedef struct _virStoragePoolObjList virStoragePoolObjList;
@@ -306,6 +342,12 @@ struct _virStorageDriverState {
 
     virStoragePoolObjList pools;
 
+    /* Volume key -> name of the pool holding it, for lookups across
+     * pools. Only a hint, checked against the pool on use. Guarded by
+     * its own lock, which may be taken with a pool locked. */
+    virMutex volKeysLock;
+    virHashTablePtr volKeys;
+
     char *configDir;
     char *autostartDir;
 };
@@ -343,6 +385,11 @@ virStorageVolDefPtr virStorageVolDefFindByPath(virStoragePoolObjPtr pool,
 virStorageVolDefPtr virStorageVolDefFindByName(virStoragePoolObjPtr pool,
                                                const char *name);
 
+int virStoragePoolObjAddVol(virStoragePoolObjPtr pool,
+                            virStorageVolDefPtr vol)
+    ATTRIBUTE_RETURN_CHECK;
+void virStoragePoolObjRemoveVol(virStoragePoolObjPtr pool,
+                                virStorageVolDefPtr vol);
 void virStoragePoolObjClearVols(virStoragePoolObjPtr pool);
 
 virStoragePoolDefPtr virStoragePoolDefParseString(const char *xml);
@@ -23,6 +23,8 @@
 
 #include <config.h>
 
+#include <sys/stat.h>
+
 #include "memory.h"
 #include "cpu.h"
 #include "cpu_map.h"
@@ -33,6 +35,7 @@
 #define CPUMAPFILE PKGDATADIR "/cpu_map.xml"
 
 static char *cpumap;
+static unsigned int cpumapGeneration;
 
 VIR_ENUM_IMPL(cpuMapElement, CPU_MAP_ELEMENT_LAST,
     "vendor",
@@ -154,5 +157,41 @@ cpuMapOverride(const char *path)
 
     VIR_FREE(cpumap);
     cpumap = map;
+    cpumapGeneration++;
     return 0;
 }
+
+
+int
+cpuMapGetStamp(struct cpuMapStamp *stamp)
+{
+    const char *mapfile = (cpumap ? cpumap : CPUMAPFILE);
+    struct stat sb;
+
+    if (stat(mapfile, &sb) < 0) {
+        virReportSystemError(errno,
+                             _("cannot stat CPU map file: %s"), mapfile);
+        return -1;
+    }
+
+    memset(stamp, 0, sizeof(*stamp));
+    stamp->generation = cpumapGeneration;
+    stamp->dev = sb.st_dev;
+    stamp->ino = sb.st_ino;
+    stamp->size = sb.st_size;
+    stamp->mtime = sb.st_mtime;
+
+    return 0;
+}
+
+
+bool
+cpuMapStampEqual(const struct cpuMapStamp *stamp1,
+                 const struct cpuMapStamp *stamp2)
+{
+    return (stamp1->generation == stamp2->generation &&
+            stamp1->dev == stamp2->dev &&
+            stamp1->ino == stamp2->ino &&
+            stamp1->size == stamp2->size &&
+            stamp1->mtime == stamp2->mtime);
+}
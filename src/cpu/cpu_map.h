@@ -24,6 +24,8 @@
 #ifndef __VIR_CPU_MAP_H__
 # define __VIR_CPU_MAP_H__
 
+# include <sys/types.h>
+
 # include "xml.h"
 
 
@@ -51,4 +53,22 @@ cpuMapLoad(const char *arch,
 extern int
 cpuMapOverride(const char *path);
 
+
+/* Identifies the version of the CPU map file which cpuMapLoad would
+ * parse, so that callers can keep the result around until it changes */
+struct cpuMapStamp {
+    unsigned int generation;    /* bumped by cpuMapOverride */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+};
+
+extern int
+cpuMapGetStamp(struct cpuMapStamp *stamp);
+
+extern bool
+cpuMapStampEqual(const struct cpuMapStamp *stamp1,
+                 const struct cpuMapStamp *stamp2);
+
 #endif /* __VIR_CPU_MAP_H__ */
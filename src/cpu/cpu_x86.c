@@ -28,6 +28,8 @@
 #include "logging.h"
 #include "memory.h"
 #include "util.h"
+#include "threads.h"
+#include "count-one-bits.h"
 #include "cpu.h"
 #include "cpu_map.h"
 #include "cpu_x86.h"
@@ -37,6 +39,8 @@
 
 #define VENDOR_STRING_LENGTH    12
 
+#define X86_BITS_PER_WORD       (sizeof(unsigned long) * CHAR_BIT)
+
 static const struct cpuX86cpuid cpuidNull = { 0, 0, 0, 0, 0 };
 
 static const char *archs[] = { "i686", "x86_64" };
@@ -51,6 +55,7 @@ struct x86_vendor {
 struct x86_feature {
     char *name;
     union cpuData *data;
+    unsigned int index;         /* bit representing the feature in bitsets */
 
     struct x86_feature *next;
 };
@@ -59,16 +64,34 @@ struct x86_model {
     char *name;
     const struct x86_vendor *vendor;
     union cpuData *data;
+    unsigned long *features;    /* bitset of features included in data */
 
     struct x86_model *next;
 };
 
+/* Once loaded, a map is shared by all users and never modified */
 struct x86_map {
+    int refs;                   /* protected by x86MapLock */
+    struct cpuMapStamp stamp;
+
     struct x86_vendor *vendors;
     struct x86_feature *features;
     struct x86_model *models;
+
+    unsigned int nfeatures;
+    size_t nwords;              /* length of feature bitsets */
+    /* Features use disjoint, non-empty sets of CPUID bits which do not
+     * overlap with vendor strings and every model is exactly the union
+     * of its features. Models can only be compared using bitsets if
+     * this is true. */
+    bool compact;
 };
 
+static virOnceControl x86MapOnce = VIR_ONCE_CONTROL_INITIALIZER;
+static virMutex x86MapLock;
+static bool x86MapLockReady;
+static struct x86_map *x86MapCache;
+
 
 enum compare_result {
     SUBSET,
@@ -415,6 +438,24 @@ x86DataIsSubset(const union cpuData *data,
 }
 
 
+static bool
+x86DataIntersects(const union cpuData *data1,
+                  const union cpuData *data2)
+{
+    struct data_iterator iter = DATA_ITERATOR_INIT((union cpuData *) data2);
+    const struct cpuX86cpuid *cpuid1;
+    const struct cpuX86cpuid *cpuid2;
+
+    while ((cpuid2 = x86DataCpuidNext(&iter))) {
+        if ((cpuid1 = x86DataCpuid(data1, cpuid2->function)) &&
+            x86cpuidMatchAny(cpuid1, cpuid2))
+            return true;
+    }
+
+    return false;
+}
+
+
 /* also removes all detected features from data */
 static int
 x86DataToCPUFeatures(virCPUDefPtr cpu,
@@ -437,20 +478,17 @@ x86DataToCPUFeatures(virCPUDefPtr cpu,
 }
 
 
-/* also removes bits corresponding to vendor string from data */
 static const struct x86_vendor *
-x86DataToVendor(union cpuData *data,
-                const struct x86_map *map)
+x86DataFindVendor(const union cpuData *data,
+                  const struct x86_map *map)
 {
     const struct x86_vendor *vendor = map->vendors;
     struct cpuX86cpuid *cpuid;
 
     while (vendor) {
         if ((cpuid = x86DataCpuid(data, vendor->cpuid.function)) &&
-            x86cpuidMatchMasked(cpuid, &vendor->cpuid)) {
-            x86cpuidClearBits(cpuid, &vendor->cpuid);
+            x86cpuidMatchMasked(cpuid, &vendor->cpuid))
             return vendor;
-        }
         vendor = vendor->next;
     }
 
@@ -458,6 +496,43 @@ x86DataToVendor(union cpuData *data,
 }
 
 
+/* also removes bits corresponding to vendor string from data */
+static const struct x86_vendor *
+x86DataToVendor(union cpuData *data,
+                const struct x86_map *map)
+{
+    const struct x86_vendor *vendor;
+
+    if ((vendor = x86DataFindVendor(data, map)))
+        x86cpuidClearBits(x86DataCpuid(data, vendor->cpuid.function),
+                          &vendor->cpuid);
+
+    return vendor;
+}
+
+
+/* Sets bits of features fully contained in data in @present and bits of
+ * features which have nothing in common with data in @missing */
+static void
+x86DataToBitsets(const union cpuData *data,
+                 const struct x86_map *map,
+                 unsigned long *present,
+                 unsigned long *missing)
+{
+    const struct x86_feature *feature;
+
+    for (feature = map->features; feature; feature = feature->next) {
+        unsigned long bit = 1UL << (feature->index % X86_BITS_PER_WORD);
+        size_t word = feature->index / X86_BITS_PER_WORD;
+
+        if (x86DataIsSubset(data, feature->data))
+            present[word] |= bit;
+        else if (!x86DataIntersects(data, feature->data))
+            missing[word] |= bit;
+    }
+}
+
+
 static virCPUDefPtr
 x86DataToCPU(const union cpuData *data,
              const struct x86_model *model,
@@ -758,6 +833,7 @@ x86ModelFree(struct x86_model *model)
 
     VIR_FREE(model->name);
     x86DataFree(model->data);
+    VIR_FREE(model->features);
     VIR_FREE(model);
 }
 
@@ -1115,6 +1191,152 @@ error:
 }
 
 
+/* Numbers features and computes feature bitsets of all models */
+static int
+x86MapCompile(struct x86_map *map)
+{
+    struct x86_feature *feature;
+    struct x86_model *model;
+    const struct x86_vendor *vendor;
+    union cpuData *used = NULL;
+    union cpuData *rest = NULL;
+    int ret = -1;
+
+    map->nfeatures = 0;
+    for (feature = map->features; feature; feature = feature->next)
+        feature->index = map->nfeatures++;
+
+    map->nwords = (map->nfeatures + X86_BITS_PER_WORD - 1) / X86_BITS_PER_WORD;
+    map->compact = map->nfeatures > 0;
+    if (!map->compact)
+        return 0;
+
+    if (VIR_ALLOC(used) < 0)
+        goto no_memory;
+
+    for (vendor = map->vendors; vendor; vendor = vendor->next) {
+        if (x86DataAddCpuid(used, &vendor->cpuid) < 0)
+            goto cleanup;
+    }
+
+    for (feature = map->features; feature; feature = feature->next) {
+        if (x86DataIsEmpty(feature->data) ||
+            x86DataIntersects(used, feature->data)) {
+            VIR_DEBUG("CPU feature %s overlaps with other CPUID bits",
+                      feature->name);
+            map->compact = false;
+            break;
+        }
+
+        if (x86DataAdd(used, feature->data) < 0)
+            goto cleanup;
+    }
+
+    for (model = map->models; model; model = model->next) {
+        if (VIR_ALLOC_N(model->features, map->nwords) < 0 ||
+            !(rest = x86DataCopy(model->data)))
+            goto no_memory;
+
+        for (feature = map->features; feature; feature = feature->next) {
+            if (x86DataIsSubset(model->data, feature->data)) {
+                model->features[feature->index / X86_BITS_PER_WORD] |=
+                    1UL << (feature->index % X86_BITS_PER_WORD);
+                x86DataSubtract(rest, feature->data);
+            }
+        }
+
+        if (!x86DataIsEmpty(rest)) {
+            VIR_DEBUG("CPU model %s is not a union of features",
+                      model->name);
+            map->compact = false;
+        }
+
+        x86DataFree(rest);
+        rest = NULL;
+    }
+
+    ret = 0;
+
+cleanup:
+    x86DataFree(used);
+    x86DataFree(rest);
+    return ret;
+
+no_memory:
+    virReportOOMError();
+    goto cleanup;
+}
+
+
+static void
+x86MapLockInit(void)
+{
+    if (virMutexInit(&x86MapLock) == 0)
+        x86MapLockReady = true;
+}
+
+
+/* Returns a reference to the shared CPU map, parsing the map file only
+ * when it changed since the last call */
+static struct x86_map *
+x86GetMap(void)
+{
+    struct x86_map *map = NULL;
+    struct cpuMapStamp stamp;
+
+    if (virOnce(&x86MapOnce, x86MapLockInit) < 0 || !x86MapLockReady) {
+        virCPUReportError(VIR_ERR_INTERNAL_ERROR,
+                "%s", _("cannot initialize CPU map lock"));
+        return NULL;
+    }
+
+    virMutexLock(&x86MapLock);
+
+    if (cpuMapGetStamp(&stamp) < 0)
+        goto cleanup;
+
+    if (x86MapCache && cpuMapStampEqual(&x86MapCache->stamp, &stamp)) {
+        map = x86MapCache;
+        map->refs++;
+        goto cleanup;
+    }
+
+    if (!(map = x86LoadMap()))
+        goto cleanup;
+
+    if (x86MapCompile(map) < 0) {
+        x86MapFree(map);
+        map = NULL;
+        goto cleanup;
+    }
+
+    map->stamp = stamp;
+    /* one reference for the cache and one for the caller */
+    map->refs = 2;
+
+    if (x86MapCache && --x86MapCache->refs == 0)
+        x86MapFree(x86MapCache);
+    x86MapCache = map;
+
+cleanup:
+    virMutexUnlock(&x86MapLock);
+    return map;
+}
+
+
+static void
+x86MapUnref(struct x86_map *map)
+{
+    if (map == NULL)
+        return;
+
+    virMutexLock(&x86MapLock);
+    if (--map->refs == 0)
+        x86MapFree(map);
+    virMutexUnlock(&x86MapLock);
+}
+
+
 static virCPUCompareResult
 x86Compute(virCPUDefPtr host,
            virCPUDefPtr cpu,
@@ -1158,7 +1380,7 @@ x86Compute(virCPUDefPtr host,
         return VIR_CPU_COMPARE_INCOMPATIBLE;
     }
 
-    if (!(map = x86LoadMap()) ||
+    if (!(map = x86GetMap()) ||
         !(host_model = x86ModelFromCPU(host, map, VIR_CPU_FEATURE_REQUIRE)) ||
         !(cpu_force = x86ModelFromCPU(cpu, map, VIR_CPU_FEATURE_FORCE)) ||
         !(cpu_require = x86ModelFromCPU(cpu, map, VIR_CPU_FEATURE_REQUIRE)) ||
@@ -1227,7 +1449,7 @@ x86Compute(virCPUDefPtr host,
     }
 
 out:
-    x86MapFree(map);
+    x86MapUnref(map);
     x86ModelFree(host_model);
     x86ModelFree(diff);
     x86ModelFree(cpu_force);
@@ -1265,6 +1487,46 @@ x86GuestData(virCPUDefPtr host,
 }
 
 
+/* Host CPU definitions carry no feature policies; returns false if the
+ * CPU cannot be described as a host CPU since it has features disabled */
+static bool
+x86CPUToHost(virCPUDefPtr cpu)
+{
+    unsigned int i;
+
+    cpu->type = VIR_CPU_TYPE_HOST;
+    for (i = 0; i < cpu->nfeatures; i++) {
+        if (cpu->features[i].policy == VIR_CPU_FEATURE_DISABLE)
+            return false;
+        cpu->features[i].policy = -1;
+    }
+
+    return true;
+}
+
+
+/* Counts features which x86DataToCPU would list for @model given the
+ * feature bitsets computed by x86DataToBitsets; only valid for compact
+ * maps */
+static void
+x86ModelCountFeatures(const struct x86_model *model,
+                      const struct x86_map *map,
+                      const unsigned long *present,
+                      const unsigned long *missing,
+                      unsigned int *required,
+                      unsigned int *disabled)
+{
+    size_t i;
+
+    *required = 0;
+    *disabled = 0;
+    for (i = 0; i < map->nwords; i++) {
+        *required += count_one_bits_l(present[i] & ~model->features[i]);
+        *disabled += count_one_bits_l(missing[i] & model->features[i]);
+    }
+}
+
+
 static int
 x86Decode(virCPUDefPtr cpu,
           const union cpuData *data,
@@ -1275,13 +1537,33 @@ x86Decode(virCPUDefPtr cpu,
     int ret = -1;
     struct x86_map *map;
     const struct x86_model *candidate;
+    const struct x86_model *best = NULL;
+    const struct x86_vendor *vendor = NULL;
+    unsigned long *present = NULL;
+    unsigned long *missing = NULL;
+    unsigned int bestFeatures = 0;
     virCPUDefPtr cpuCandidate;
     virCPUDefPtr cpuModel = NULL;
     unsigned int i;
 
-    if (data == NULL || (map = x86LoadMap()) == NULL)
+    if (data == NULL || (map = x86GetMap()) == NULL)
         return -1;
 
+    /* With a compact map, the features x86DataToCPU would find for each
+     * model follow from a single pass over the features, which makes it
+     * possible to score all models using plain bitset operations and
+     * only build CPU definition for the winner. */
+    if (map->compact) {
+        if (VIR_ALLOC_N(present, map->nwords) < 0 ||
+            VIR_ALLOC_N(missing, map->nwords) < 0) {
+            virReportOOMError();
+            goto out;
+        }
+
+        x86DataToBitsets(data, map, present, missing);
+        vendor = x86DataFindVendor(data, map);
+    }
+
     candidate = map->models;
     while (candidate != NULL) {
         bool allowed = (models == NULL);
@@ -1299,6 +1581,37 @@ x86Decode(virCPUDefPtr cpu,
             goto next;
         }
 
+        if (map->compact) {
+            unsigned int required;
+            unsigned int disabled;
+
+            if (candidate->vendor && vendor &&
+                STRNEQ(candidate->vendor->name, vendor->name)) {
+                VIR_DEBUG("CPU vendor %s of model %s differs from %s; ignoring",
+                          candidate->vendor->name, candidate->name,
+                          vendor->name);
+                goto next;
+            }
+
+            x86ModelCountFeatures(candidate, map, present, missing,
+                                  &required, &disabled);
+
+            if (cpu->type == VIR_CPU_TYPE_HOST && disabled > 0)
+                goto next;
+
+            if (preferred && STREQ(candidate->name, preferred)) {
+                best = candidate;
+                break;
+            }
+
+            if (best == NULL || bestFeatures > required + disabled) {
+                best = candidate;
+                bestFeatures = required + disabled;
+            }
+
+            goto next;
+        }
+
         if (!(cpuCandidate = x86DataToCPU(data, candidate, map)))
             goto out;
 
@@ -1311,17 +1624,10 @@ x86Decode(virCPUDefPtr cpu,
             goto next;
         }
 
-        if (cpu->type == VIR_CPU_TYPE_HOST) {
-            cpuCandidate->type = VIR_CPU_TYPE_HOST;
-            for (i = 0; i < cpuCandidate->nfeatures; i++) {
-                switch (cpuCandidate->features[i].policy) {
-                case VIR_CPU_FEATURE_DISABLE:
-                    virCPUDefFree(cpuCandidate);
-                    goto next;
-                default:
-                    cpuCandidate->features[i].policy = -1;
-                }
-            }
+        if (cpu->type == VIR_CPU_TYPE_HOST &&
+            !x86CPUToHost(cpuCandidate)) {
+            virCPUDefFree(cpuCandidate);
+            goto next;
         }
 
         if (preferred && STREQ(cpuCandidate->model, preferred)) {
@@ -1341,6 +1647,15 @@ x86Decode(virCPUDefPtr cpu,
         candidate = candidate->next;
     }
 
+    if (best) {
+        if (!(cpuModel = x86DataToCPU(data, best, map)))
+            goto out;
+
+        /* cannot fail, models with disabled features were skipped */
+        if (cpu->type == VIR_CPU_TYPE_HOST)
+            x86CPUToHost(cpuModel);
+    }
+
     if (cpuModel == NULL) {
         virCPUReportError(VIR_ERR_INTERNAL_ERROR,
                 "%s", _("Cannot find suitable CPU model for given data"));
@@ -1356,8 +1671,10 @@ x86Decode(virCPUDefPtr cpu,
     ret = 0;
 
 out:
-    x86MapFree(map);
+    x86MapUnref(map);
     virCPUDefFree(cpuModel);
+    VIR_FREE(present);
+    VIR_FREE(missing);
 
     return ret;
 }
@@ -1400,7 +1717,7 @@ x86Encode(const virCPUDefPtr cpu,
     union cpuData *data_vendor = NULL;
     int ret = -1;
 
-    if ((map = x86LoadMap()) == NULL)
+    if ((map = x86GetMap()) == NULL)
         goto error;
 
     if (forced) {
@@ -1466,7 +1783,7 @@ x86Encode(const virCPUDefPtr cpu,
     ret = 0;
 
 cleanup:
-    x86MapFree(map);
+    x86MapUnref(map);
 
     return ret;
 
@@ -1578,7 +1895,7 @@ x86Baseline(virCPUDefPtr *cpus,
     struct x86_model *model = NULL;
     bool outputVendor = true;
 
-    if (!(map = x86LoadMap()))
+    if (!(map = x86GetMap()))
         goto error;
 
     if (!(base_model = x86ModelFromCPU(cpus[0], map, VIR_CPU_FEATURE_REQUIRE)))
@@ -1658,7 +1975,7 @@ x86Baseline(virCPUDefPtr *cpus,
 
 cleanup:
     x86ModelFree(base_model);
-    x86MapFree(map);
+    x86MapUnref(map);
 
     return cpu;
 
@@ -1681,7 +1998,7 @@ x86Update(virCPUDefPtr guest,
     struct x86_map *map;
     struct x86_model *host_model = NULL;
 
-    if (!(map = x86LoadMap()) ||
+    if (!(map = x86GetMap()) ||
         !(host_model = x86ModelFromCPU(host, map, VIR_CPU_FEATURE_REQUIRE)))
         goto cleanup;
 
@@ -1713,7 +2030,7 @@ x86Update(virCPUDefPtr guest,
     ret = 0;
 
 cleanup:
-    x86MapFree(map);
+    x86MapUnref(map);
     x86ModelFree(host_model);
     return ret;
 }
@@ -1725,7 +2042,7 @@ static int x86HasFeature(const union cpuData *data,
     struct x86_feature *feature;
     int ret = -1;
 
-    if (!(map = x86LoadMap()))
+    if (!(map = x86GetMap()))
         return -1;
 
     if (!(feature = x86FeatureFind(map, name)))
@@ -1734,7 +2051,7 @@ static int x86HasFeature(const union cpuData *data,
     ret = x86DataIsSubset(data, feature->data) ? 1 : 0;
 
 cleanup:
-    x86MapFree(map);
+    x86MapUnref(map);
     return ret;
 }
 
@@ -515,6 +515,15 @@ typedef int
                                virStreamPtr st,
                                unsigned int flags);
 
+/* @doms is NULL to request stats for every domain matching @flags */
+typedef int
+    (*virDrvConnectGetAllDomainStats)(virConnectPtr conn,
+                                      virDomainPtr *doms,
+                                      unsigned int ndoms,
+                                      unsigned int stats,
+                                      virDomainStatsRecordPtr **retStats,
+                                      unsigned int flags);
+
 
 /**
  * _virDriver:
@@ -639,6 +648,7 @@ struct _virDriver {
     virDrvDomainSnapshotDelete domainSnapshotDelete;
     virDrvQemuDomainMonitorCommand qemuDomainMonitorCommand;
     virDrvDomainOpenConsole domainOpenConsole;
+    virDrvConnectGetAllDomainStats connectGetAllDomainStats;
 };
 
 typedef int
@@ -1138,6 +1148,16 @@ typedef int (*virDrvStreamSend)(virStreamPtr st,
 typedef int (*virDrvStreamRecv)(virStreamPtr st,
                                 char *data,
                                 size_t nbytes);
+typedef int (*virDrvStreamRecvFlags)(virStreamPtr st,
+                                     char *data,
+                                     size_t nbytes,
+                                     unsigned int flags);
+typedef int (*virDrvStreamSendHole)(virStreamPtr st,
+                                    long long length,
+                                    unsigned int flags);
+typedef int (*virDrvStreamRecvHole)(virStreamPtr st,
+                                    long long *length,
+                                    unsigned int flags);
 
 typedef int (*virDrvStreamEventAddCallback)(virStreamPtr stream,
                                             int events,
@@ -1155,6 +1175,9 @@ typedef int (*virDrvStreamAbort)(virStreamPtr st);
 struct _virStreamDriver {
     virDrvStreamSend streamSend;
     virDrvStreamRecv streamRecv;
+    virDrvStreamRecvFlags streamRecvFlags;
+    virDrvStreamSendHole streamSendHole;
+    virDrvStreamRecvHole streamRecvHole;
     virDrvStreamEventAddCallback streamAddCallback;
     virDrvStreamEventUpdateCallback streamUpdateCallback;
     virDrvStreamEventRemoveCallback streamRemoveCallback;
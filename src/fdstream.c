@@ -42,6 +42,7 @@
 #include "util.h"
 #include "files.h"
 #include "configmake.h"
+#include "iohelper.h"
 
 #define VIR_FROM_THIS VIR_FROM_STREAMS
 #define streamsReportError(code, ...)                                \
@@ -56,6 +57,13 @@ struct virFDStreamData {
     unsigned long long offset;
     unsigned long long length;
 
+    /* Sparse mode, exchanging records with the I/O helper */
+    bool sparse;
+    virIOHelperRecord rec;         /* Header being read */
+    size_t recOffset;              /* Amount of it read so far */
+    unsigned long long dataLeft;   /* Of the current data record */
+    unsigned long long holeLeft;   /* Of the current hole record */
+
     int watch;
     unsigned int cbRemoved;
     unsigned int dispatching;
@@ -270,6 +278,97 @@ virFDStreamClose(virStreamPtr st)
     return ret;
 }
 
+/*
+ * Returns 0 once the whole record header is written, -2 if it
+ * would block, or -1 on error. Headers are smaller than PIPE_BUF,
+ * so they are never written in part.
+ */
+static int virFDStreamWriteRecord(struct virFDStreamData *fdst,
+                                  int type,
+                                  unsigned long long length)
+{
+    virIOHelperRecord rec;
+    ssize_t ret;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = type;
+    rec.length = length;
+
+retry:
+    ret = write(fdst->fd, &rec, sizeof(rec));
+    if (ret < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return -2;
+        if (errno == EINTR)
+            goto retry;
+        virReportSystemError(errno, "%s",
+                             _("cannot write to stream"));
+        return -1;
+    }
+    if (ret != sizeof(rec)) {
+        streamsReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("short write of stream record"));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Makes sure a record is in progress on a sparse stream, reading
+ * the next header from the I/O helper if need be.
+ *
+ * Returns 1 if there is a record, 0 at the end of the stream, -2
+ * if the header is still incomplete on a non-blocking stream, or
+ * -1 on error
+ */
+static int virFDStreamReadRecord(struct virFDStreamData *fdst)
+{
+    char *hdr = (char *)&fdst->rec;
+    ssize_t got;
+
+    while (fdst->dataLeft == 0 && fdst->holeLeft == 0) {
+        got = read(fdst->fd, hdr + fdst->recOffset,
+                   sizeof(fdst->rec) - fdst->recOffset);
+        if (got < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return -2;
+            if (errno == EINTR)
+                continue;
+            virReportSystemError(errno, "%s",
+                                 _("cannot read from stream"));
+            return -1;
+        }
+        if (got == 0) {
+            if (fdst->recOffset == 0)
+                return 0;
+            streamsReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                               _("stream ended in the middle of a record"));
+            return -1;
+        }
+
+        fdst->recOffset += got;
+        if (fdst->recOffset < sizeof(fdst->rec))
+            continue;
+        fdst->recOffset = 0;
+
+        switch (fdst->rec.type) {
+        case VIR_IOHELPER_RECORD_DATA:
+            fdst->dataLeft = fdst->rec.length;
+            break;
+        case VIR_IOHELPER_RECORD_HOLE:
+            fdst->holeLeft = fdst->rec.length;
+            break;
+        default:
+            streamsReportError(VIR_ERR_INTERNAL_ERROR,
+                               _("unexpected stream record type %u"),
+                               fdst->rec.type);
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
 static int virFDStreamWrite(virStreamPtr st, const char *bytes, size_t nbytes)
 {
     struct virFDStreamData *fdst = st->privateData;
@@ -301,6 +400,23 @@ static int virFDStreamWrite(virStreamPtr st, const char *bytes, size_t nbytes)
             nbytes = fdst->length - fdst->offset;
     }
 
+    /* A short write leaves the rest of the record to be
+     * completed by the next call */
+    if (fdst->sparse) {
+        if (fdst->dataLeft == 0) {
+            if (nbytes == 0) {
+                ret = 0;
+                goto cleanup;
+            }
+            if ((ret = virFDStreamWriteRecord(fdst, VIR_IOHELPER_RECORD_DATA,
+                                              nbytes)) < 0)
+                goto cleanup;
+            fdst->dataLeft = nbytes;
+        }
+        if (fdst->dataLeft < nbytes)
+            nbytes = fdst->dataLeft;
+    }
+
 retry:
     ret = write(fdst->fd, bytes, nbytes);
     if (ret < 0) {
@@ -313,20 +429,80 @@ retry:
             virReportSystemError(errno, "%s",
                                  _("cannot write to stream"));
         }
-    } else if (fdst->length) {
-        fdst->offset += ret;
+    } else {
+        if (fdst->length)
+            fdst->offset += ret;
+        if (fdst->sparse)
+            fdst->dataLeft -= ret;
     }
 
+cleanup:
     virMutexUnlock(&fdst->lock);
     return ret;
 }
 
 
-static int virFDStreamRead(virStreamPtr st, char *bytes, size_t nbytes)
+static int virFDStreamSendHole(virStreamPtr st,
+                               long long length,
+                               unsigned int flags)
+{
+    struct virFDStreamData *fdst = st->privateData;
+    int ret = -1;
+
+    virCheckFlags(0, -1);
+
+    if (!fdst) {
+        streamsReportError(VIR_ERR_INTERNAL_ERROR,
+                           "%s", _("stream is not open"));
+        return -1;
+    }
+
+    virMutexLock(&fdst->lock);
+
+    if (!fdst->sparse) {
+        streamsReportError(VIR_ERR_OPERATION_INVALID, "%s",
+                           _("stream does not support holes"));
+        goto cleanup;
+    }
+
+    if (fdst->dataLeft) {
+        streamsReportError(VIR_ERR_OPERATION_INVALID, "%s",
+                           _("cannot send a hole before the pending data"));
+        goto cleanup;
+    }
+
+    if (fdst->length &&
+        (fdst->length - fdst->offset) < (unsigned long long)length) {
+        virReportSystemError(ENOSPC, "%s",
+                             _("cannot write to stream"));
+        goto cleanup;
+    }
+
+    if (length &&
+        (ret = virFDStreamWriteRecord(fdst, VIR_IOHELPER_RECORD_HOLE,
+                                      length)) < 0)
+        goto cleanup;
+
+    if (fdst->length)
+        fdst->offset += length;
+    ret = 0;
+
+cleanup:
+    virMutexUnlock(&fdst->lock);
+    return ret;
+}
+
+
+static int virFDStreamReadFlags(virStreamPtr st,
+                                char *bytes,
+                                size_t nbytes,
+                                unsigned int flags)
 {
     struct virFDStreamData *fdst = st->privateData;
     int ret;
 
+    virCheckFlags(VIR_STREAM_RECV_STOP_AT_HOLE, -1);
+
     if (nbytes > INT_MAX) {
         virReportSystemError(ERANGE, "%s",
                              _("Too many bytes to read from stream"));
@@ -351,6 +527,30 @@ static int virFDStreamRead(virStreamPtr st, char *bytes, size_t nbytes)
             nbytes = fdst->length - fdst->offset;
     }
 
+    if (fdst->sparse) {
+        if ((ret = virFDStreamReadRecord(fdst)) <= 0)
+            goto cleanup;
+
+        if (fdst->holeLeft) {
+            if (flags & VIR_STREAM_RECV_STOP_AT_HOLE) {
+                ret = 0;
+                goto cleanup;
+            }
+            /* The caller wants the hole as zeros */
+            if (fdst->holeLeft < nbytes)
+                nbytes = fdst->holeLeft;
+            memset(bytes, 0, nbytes);
+            fdst->holeLeft -= nbytes;
+            ret = nbytes;
+            if (fdst->length)
+                fdst->offset += ret;
+            goto cleanup;
+        }
+
+        if (fdst->dataLeft < nbytes)
+            nbytes = fdst->dataLeft;
+    }
+
 retry:
     ret = read(fdst->fd, bytes, nbytes);
     if (ret < 0) {
@@ -363,18 +563,65 @@ retry:
             virReportSystemError(errno, "%s",
                                  _("cannot read from stream"));
         }
-    } else if (fdst->length) {
-        fdst->offset += ret;
+    } else {
+        if (fdst->length)
+            fdst->offset += ret;
+        if (fdst->sparse) {
+            if (ret == 0 && nbytes) {
+                streamsReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                                   _("stream ended in the middle of a record"));
+                ret = -1;
+            } else {
+                fdst->dataLeft -= ret;
+            }
+        }
     }
 
+cleanup:
     virMutexUnlock(&fdst->lock);
     return ret;
 }
 
 
+static int virFDStreamRead(virStreamPtr st, char *bytes, size_t nbytes)
+{
+    return virFDStreamReadFlags(st, bytes, nbytes, 0);
+}
+
+
+static int virFDStreamRecvHole(virStreamPtr st,
+                               long long *length,
+                               unsigned int flags)
+{
+    struct virFDStreamData *fdst = st->privateData;
+
+    virCheckFlags(0, -1);
+
+    if (!fdst) {
+        streamsReportError(VIR_ERR_INTERNAL_ERROR,
+                           "%s", _("stream is not open"));
+        return -1;
+    }
+
+    /* virFDStreamReadFlags has already read the header of any
+     * hole we're stopped at; without one, there's no hole here */
+    virMutexLock(&fdst->lock);
+    *length = fdst->holeLeft;
+    if (fdst->length)
+        fdst->offset += fdst->holeLeft;
+    fdst->holeLeft = 0;
+    virMutexUnlock(&fdst->lock);
+
+    return 0;
+}
+
+
 static virStreamDriver virFDStreamDrv = {
     .streamSend = virFDStreamWrite,
     .streamRecv = virFDStreamRead,
+    .streamRecvFlags = virFDStreamReadFlags,
+    .streamSendHole = virFDStreamSendHole,
+    .streamRecvHole = virFDStreamRecvHole,
     .streamFinish = virFDStreamClose,
     .streamAbort = virFDStreamClose,
     .streamAddCallback = virFDStreamAddCallback,
@@ -386,12 +633,13 @@ static int virFDStreamOpenInternal(virStreamPtr st,
                                    int fd,
                                    virCommandPtr cmd,
                                    int errfd,
-                                   unsigned long long length)
+                                   unsigned long long length,
+                                   bool sparse)
 {
     struct virFDStreamData *fdst;
 
-    VIR_DEBUG("st=%p fd=%d cmd=%p errfd=%d length=%llu",
-              st, fd, cmd, errfd, length);
+    VIR_DEBUG("st=%p fd=%d cmd=%p errfd=%d length=%llu sparse=%d",
+              st, fd, cmd, errfd, length, sparse);
 
     if ((st->flags & VIR_STREAM_NONBLOCK) &&
         virSetNonBlock(fd) < 0)
@@ -406,6 +654,7 @@ static int virFDStreamOpenInternal(virStreamPtr st,
     fdst->cmd = cmd;
     fdst->errfd = errfd;
     fdst->length = length;
+    fdst->sparse = sparse;
     if (virMutexInit(&fdst->lock) < 0) {
         VIR_FREE(fdst);
         streamsReportError(VIR_ERR_INTERNAL_ERROR, "%s",
@@ -423,7 +672,7 @@ static int virFDStreamOpenInternal(virStreamPtr st,
 int virFDStreamOpen(virStreamPtr st,
                     int fd)
 {
-    return virFDStreamOpenInternal(st, fd, NULL, -1, 0);
+    return virFDStreamOpenInternal(st, fd, NULL, -1, 0, false);
 }
 
 
@@ -468,7 +717,7 @@ int virFDStreamConnectUNIX(virStreamPtr st,
         goto error;
     } while ((++i <= timeout*5) && (usleep(.2 * 1000000) <= 0));
 
-    if (virFDStreamOpenInternal(st, fd, NULL, -1, 0) < 0)
+    if (virFDStreamOpenInternal(st, fd, NULL, -1, 0, false) < 0)
         goto error;
     return 0;
 
@@ -493,7 +742,8 @@ virFDStreamOpenFileInternal(virStreamPtr st,
                             unsigned long long offset,
                             unsigned long long length,
                             int flags,
-                            int mode)
+                            int mode,
+                            bool sparse)
 {
     int fd = -1;
     int fds[2] = { -1, -1 };
@@ -502,13 +752,15 @@ virFDStreamOpenFileInternal(virStreamPtr st,
     int errfd = -1;
     pid_t pid = 0;
 
-    VIR_DEBUG("st=%p path=%s flags=%d offset=%llu length=%llu mode=%d",
-              st, path, flags, offset, length, mode);
+    VIR_DEBUG("st=%p path=%s flags=%d offset=%llu length=%llu mode=%d sparse=%d",
+              st, path, flags, offset, length, mode, sparse);
 
+    /* O_DIRECT is only honoured by the I/O helper, which
+     * knows how to align its buffers, or to do without */
     if (flags & O_CREAT)
-        fd = open(path, flags, mode);
+        fd = open(path, flags & ~O_DIRECT, mode);
     else
-        fd = open(path, flags);
+        fd = open(path, flags & ~O_DIRECT);
     if (fd < 0) {
         virReportSystemError(errno,
                              _("Unable to open stream for '%s'"),
@@ -527,10 +779,14 @@ virFDStreamOpenFileInternal(virStreamPtr st,
      * non-blocking I/O on block devs/regular files. To
      * support those we need to fork a helper process todo
      * the I/O so we just have a fifo. Or use AIO :-(
+     *
+     * Sparse streams always go through the helper, which
+     * turns the file into data and hole records, or back.
      */
-    if ((st->flags & VIR_STREAM_NONBLOCK) &&
-        (!S_ISCHR(sb.st_mode) &&
-         !S_ISFIFO(sb.st_mode))) {
+    if (sparse ||
+        ((st->flags & VIR_STREAM_NONBLOCK) &&
+         (!S_ISCHR(sb.st_mode) &&
+          !S_ISFIFO(sb.st_mode)))) {
         int childfd;
 
         if ((flags & O_RDWR) == O_RDWR) {
@@ -554,8 +810,10 @@ virFDStreamOpenFileInternal(virStreamPtr st,
         virCommandAddArgFormat(cmd, "%d", mode);
         virCommandAddArgFormat(cmd, "%llu", offset);
         virCommandAddArgFormat(cmd, "%llu", length);
+        if (sparse)
+            virCommandAddArg(cmd, VIR_IOHELPER_SPARSE);
 
-        if (flags == O_RDONLY) {
+        if ((flags & O_ACCMODE) == O_RDONLY) {
             childfd = fds[1];
             fd = fds[0];
             virCommandSetOutputFD(cmd, &childfd);
@@ -580,7 +838,7 @@ virFDStreamOpenFileInternal(virStreamPtr st,
         }
     }
 
-    if (virFDStreamOpenInternal(st, fd, cmd, errfd, length) < 0)
+    if (virFDStreamOpenInternal(st, fd, cmd, errfd, length, sparse) < 0)
         goto error;
 
     return 0;
@@ -611,7 +869,24 @@ int virFDStreamOpenFile(virStreamPtr st,
     }
     return virFDStreamOpenFileInternal(st, path,
                                        offset, length,
-                                       flags, 0);
+                                       flags, 0, false);
+}
+
+int virFDStreamOpenFileSparse(virStreamPtr st,
+                              const char *path,
+                              unsigned long long offset,
+                              unsigned long long length,
+                              int flags)
+{
+    if (flags & O_CREAT) {
+        streamsReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("Attempt to create %s without specifying mode"),
+                           path);
+        return -1;
+    }
+    return virFDStreamOpenFileInternal(st, path,
+                                       offset, length,
+                                       flags, 0, true);
 }
 
 int virFDStreamCreateFile(virStreamPtr st,
@@ -623,5 +898,5 @@ int virFDStreamCreateFile(virStreamPtr st,
 {
     return virFDStreamOpenFileInternal(st, path,
                                        offset, length,
-                                       flags | O_CREAT, mode);
+                                       flags | O_CREAT, mode, false);
 }
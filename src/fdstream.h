@@ -38,6 +38,11 @@ int virFDStreamOpenFile(virStreamPtr st,
                         unsigned long long offset,
                         unsigned long long length,
                         int flags);
+int virFDStreamOpenFileSparse(virStreamPtr st,
+                              const char *path,
+                              unsigned long long offset,
+                              unsigned long long length,
+                              int flags);
 int virFDStreamCreateFile(virStreamPtr st,
                           const char *path,
                           unsigned long long offset,
@@ -4594,6 +4594,197 @@ error:
     return -1;
 }
 
+/**
+ * virConnectGetAllDomainStats:
+ * @conn: pointer to the hypervisor connection
+ * @stats: bitwise-OR of virDomainStatsTypes, or 0 for every group
+ * @retStats: pointer filled in with a NULL terminated array of records
+ * @flags: bitwise-OR of virConnectGetAllDomainStatsFlags
+ *
+ * Query statistics for every domain on @conn in a single call. This
+ * is much cheaper than calling virDomainGetInfo, virDomainBlockStats
+ * and virDomainInterfaceStats for each domain and device in turn,
+ * both in round trips and in hypervisor lock contention.
+ *
+ * @flags selects whether active, inactive or (when neither flag or
+ * both flags are given) all domains are reported. Each record holds
+ * the domain and a list of typed, named fields. The fields of a group
+ * are only present when the driver and domain can supply them, for
+ * example inactive domains have no block or interface statistics.
+ *
+ * VIR_DOMAIN_STATS_STATE:
+ *     "state.state" - int, the virDomainState of the domain
+ * VIR_DOMAIN_STATS_CPU:
+ *     "cpu.time" - ullong, total CPU time used, in nanoseconds
+ * VIR_DOMAIN_STATS_BALLOON:
+ *     "balloon.current" - ullong, current memory allocation in kb
+ *     "balloon.maximum" - ullong, maximum memory allocation in kb
+ * VIR_DOMAIN_STATS_VCPU:
+ *     "vcpu.current" - uint, number of virtual CPUs online
+ *     "vcpu.maximum" - uint, maximum number of virtual CPUs
+ *     "vcpu.<num>.time" - ullong, CPU time used by virtual CPU <num>
+ * VIR_DOMAIN_STATS_BLOCK:
+ *     "block.count" - uint, number of block devices reported
+ *     "block.<num>.name" - string, target name of block device <num>
+ *     "block.<num>.rd.reqs", "block.<num>.rd.bytes",
+ *     "block.<num>.wr.reqs", "block.<num>.wr.bytes",
+ *     "block.<num>.errs" - llong, as in virDomainBlockStatsStruct
+ * VIR_DOMAIN_STATS_NET:
+ *     "net.count" - uint, number of network interfaces reported
+ *     "net.<num>.name" - string, host side name of interface <num>
+ *     "net.<num>.rx.bytes", "net.<num>.rx.pkts", "net.<num>.rx.errs",
+ *     "net.<num>.rx.drop", "net.<num>.tx.bytes", "net.<num>.tx.pkts",
+ *     "net.<num>.tx.errs", "net.<num>.tx.drop" - llong, as in
+ *     virDomainInterfaceStatsStruct
+ *
+ * The returned list must be released with virDomainStatsRecordListFree.
+ *
+ * Returns the number of records in @retStats, or -1 in case of failure.
+ */
+int
+virConnectGetAllDomainStats(virConnectPtr conn,
+                            unsigned int stats,
+                            virDomainStatsRecordPtr **retStats,
+                            unsigned int flags)
+{
+    VIR_DEBUG("conn=%p, stats=%x, retStats=%p, flags=%x",
+              conn, stats, retStats, flags);
+
+    virResetLastError();
+
+    if (!VIR_IS_CONNECT(conn)) {
+        virLibConnError(VIR_ERR_INVALID_CONN, __FUNCTION__);
+        virDispatchError(NULL);
+        return -1;
+    }
+
+    if (!retStats) {
+        virLibConnError(VIR_ERR_INVALID_ARG, __FUNCTION__);
+        goto error;
+    }
+    *retStats = NULL;
+
+    if (conn->driver->connectGetAllDomainStats) {
+        int ret;
+        ret = conn->driver->connectGetAllDomainStats(conn, NULL, 0, stats,
+                                                      retStats, flags);
+        if (ret < 0)
+            goto error;
+        return ret;
+    }
+
+    virLibConnError(VIR_ERR_NO_SUPPORT, __FUNCTION__);
+
+error:
+    virDispatchError(conn);
+    return -1;
+}
+
+/**
+ * virDomainListGetStats:
+ * @doms: NULL terminated array of domains, all on the same connection
+ * @stats: bitwise-OR of virDomainStatsTypes, or 0 for every group
+ * @retStats: pointer filled in with a NULL terminated array of records
+ * @flags: unused, always pass 0
+ *
+ * Query statistics for the domains in @doms in a single call. The
+ * records and fields are as described for virConnectGetAllDomainStats.
+ * Domains which no longer exist are left out of the result.
+ *
+ * The returned list must be released with virDomainStatsRecordListFree.
+ *
+ * Returns the number of records in @retStats, or -1 in case of failure.
+ */
+int
+virDomainListGetStats(virDomainPtr *doms,
+                      unsigned int stats,
+                      virDomainStatsRecordPtr **retStats,
+                      unsigned int flags)
+{
+    virConnectPtr conn = NULL;
+    unsigned int ndoms = 0;
+
+    VIR_DEBUG("doms=%p, stats=%x, retStats=%p, flags=%x",
+              doms, stats, retStats, flags);
+
+    virResetLastError();
+
+    if (!doms || !doms[0] || !VIR_IS_CONNECTED_DOMAIN(doms[0])) {
+        virLibDomainError(VIR_ERR_INVALID_DOMAIN, __FUNCTION__);
+        virDispatchError(NULL);
+        return -1;
+    }
+    conn = doms[0]->conn;
+
+    for (ndoms = 0 ; doms[ndoms] ; ndoms++) {
+        if (!VIR_IS_CONNECTED_DOMAIN(doms[ndoms]) ||
+            doms[ndoms]->conn != conn) {
+            virLibDomainError(VIR_ERR_INVALID_ARG,
+                              _("domains must all be on the same connection"));
+            goto error;
+        }
+    }
+
+    if (!retStats) {
+        virLibDomainError(VIR_ERR_INVALID_ARG, __FUNCTION__);
+        goto error;
+    }
+    *retStats = NULL;
+
+    if (flags != 0) {
+        virLibDomainError(VIR_ERR_INVALID_ARG,
+                          _("flags must be zero"));
+        goto error;
+    }
+
+    if (conn->driver->connectGetAllDomainStats) {
+        int ret;
+        ret = conn->driver->connectGetAllDomainStats(conn, doms, ndoms, stats,
+                                                      retStats, flags);
+        if (ret < 0)
+            goto error;
+        return ret;
+    }
+
+    virLibConnError(VIR_ERR_NO_SUPPORT, __FUNCTION__);
+
+error:
+    virDispatchError(conn);
+    return -1;
+}
+
+/**
+ * virDomainStatsRecordListFree:
+ * @stats: NULL terminated array of records to free
+ *
+ * Release a list of records returned by virConnectGetAllDomainStats
+ * or virDomainListGetStats, including the domain references they hold.
+ */
+void
+virDomainStatsRecordListFree(virDomainStatsRecordPtr *stats)
+{
+    virDomainStatsRecordPtr *next;
+    int i;
+
+    if (!stats)
+        return;
+
+    for (next = stats ; *next ; next++) {
+        virDomainStatsRecordPtr rec = *next;
+
+        for (i = 0 ; i < rec->nparams ; i++) {
+            if (rec->params[i].type == VIR_DOMAIN_STATS_PARAM_STRING)
+                VIR_FREE(rec->params[i].value.s);
+        }
+        VIR_FREE(rec->params);
+        if (rec->dom)
+            virUnrefDomain(rec->dom);
+        VIR_FREE(rec);
+    }
+
+    VIR_FREE(stats);
+}
+
 /**
  * virDomainBlockPeek:
  * @dom: pointer to the domain object
@@ -9040,12 +9231,19 @@ error:
  * @stream: stream to use as output
  * @offset: position in @vol to start reading from
  * @length: limit on amount of data to download
- * @flags: future flags (unused, pass 0)
+ * @flags: bitwise-OR of virStorageVolDownloadFlags
  *
  * Download the content of the volume as a stream. If @length
  * is zero, then the remaining contents of the volume after
  * @offset will be downloaded.
  *
+ * If VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM is set in @flags,
+ * holes in the volume are not transferred as zeros. The caller
+ * should use virStreamRecvFlags with VIR_STREAM_RECV_STOP_AT_HOLE
+ * and virStreamRecvHole, or simply virStreamSparseRecvAll, to
+ * learn about them. Drivers which don't know about this flag
+ * fail the call, so the caller can retry without it.
+ *
  * This call sets up an asynchronous stream; subsequent use of
  * stream APIs is necessary to transfer the actual data,
  * determine how much data is successfully transferred, and
@@ -9109,7 +9307,7 @@ error:
  * @stream: stream to use as input
  * @offset: position to start writing to
  * @length: limit on amount of data to upload
- * @flags: flags for creation (unused, pass 0)
+ * @flags: bitwise-OR of virStorageVolUploadFlags
  *
  * Upload new content to the volume from a stream. This call
  * will fail if @offset + @length exceeds the size of the
@@ -9117,6 +9315,12 @@ error:
  * will be raised if an attempt is made to upload greater
  * than @length bytes of data.
  *
+ * If VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM is set in @flags,
+ * the caller may send holes with virStreamSendHole, or use
+ * virStreamSparseSendAll, instead of sending zeros. Holes are
+ * recreated in the volume where it supports them, and are
+ * written out as zeros otherwise.
+ *
  * This call sets up an asynchronous stream; subsequent use of
  * stream APIs is necessary to transfer the actual data,
  * determine how much data is successfully transferred, and
@@ -9225,7 +9429,9 @@ error:
  * @vol: pointer to storage volume
  * @flags: future flags, use 0 for now
  *
- * Ensure data previously on a volume is not accessible to future reads
+ * Ensure data previously on a volume is not accessible to future reads.
+ * While the wipe is in progress, virStorageVolGetInfo reports the
+ * number of bytes wiped so far as the volume's allocation.
  *
  * Returns 0 on success, or -1 on error
  */
@@ -11130,6 +11336,179 @@ error:
 }
 
 
+/**
+ * virStreamRecvFlags:
+ * @stream: pointer to the stream object
+ * @data: buffer to read into from stream
+ * @nbytes: size of @data buffer
+ * @flags: bitwise-OR of virStreamRecvFlagsValues
+ *
+ * Read a series of bytes from the stream, like virStreamRecv.
+ *
+ * On a sparse stream a hole is normally read as zeros. If
+ * VIR_STREAM_RECV_STOP_AT_HOLE is set in @flags, this instead
+ * returns 0 when a hole is reached, and the caller should use
+ * virStreamRecvHole to learn its size and skip it. If that
+ * reports no hole, the end of the stream has been reached.
+ *
+ * Returns the number of bytes read, 0 at a hole or at the end
+ * of the stream, -1 upon error, or -2 if there is no data pending
+ * to be read & the stream is marked as non-blocking.
+ */
+int virStreamRecvFlags(virStreamPtr stream,
+                       char *data,
+                       size_t nbytes,
+                       unsigned int flags)
+{
+    VIR_DEBUG("stream=%p, data=%p, nbytes=%zi, flags=%x",
+              stream, data, nbytes, flags);
+
+    virResetLastError();
+
+    if (!VIR_IS_CONNECTED_STREAM(stream)) {
+        virLibConnError(VIR_ERR_INVALID_CONN, __FUNCTION__);
+        virDispatchError(NULL);
+        return -1;
+    }
+
+    if (stream->driver &&
+        stream->driver->streamRecvFlags) {
+        int ret;
+        ret = (stream->driver->streamRecvFlags)(stream, data, nbytes, flags);
+        if (ret == -2)
+            return -2;
+        if (ret < 0)
+            goto error;
+        return ret;
+    }
+
+    /* Streams which can't hold holes never have to stop at one */
+    if (stream->driver &&
+        stream->driver->streamRecv &&
+        (flags & ~VIR_STREAM_RECV_STOP_AT_HOLE) == 0)
+        return virStreamRecv(stream, data, nbytes);
+
+    virLibConnError(VIR_ERR_NO_SUPPORT, __FUNCTION__);
+
+error:
+    virDispatchError(stream->conn);
+    return -1;
+}
+
+
+/**
+ * virStreamSendHole:
+ * @stream: pointer to the stream object
+ * @length: number of bytes of the hole
+ * @flags: extra flags; not used yet, so callers should always pass 0
+ *
+ * Send a hole of @length bytes, which the receiving end reads
+ * back as zeros without them having been transferred. This is
+ * only allowed on streams set up for sparse transfers, such as
+ * with VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM.
+ *
+ * Returns 0 on success, -1 upon error, or -2 if the outgoing
+ * transmit buffers are full & the stream is marked as
+ * non-blocking.
+ */
+int virStreamSendHole(virStreamPtr stream,
+                      long long length,
+                      unsigned int flags)
+{
+    VIR_DEBUG("stream=%p, length=%lld, flags=%x", stream, length, flags);
+
+    virResetLastError();
+
+    if (!VIR_IS_CONNECTED_STREAM(stream)) {
+        virLibConnError(VIR_ERR_INVALID_CONN, __FUNCTION__);
+        virDispatchError(NULL);
+        return -1;
+    }
+
+    if (length < 0) {
+        virLibConnError(VIR_ERR_INVALID_ARG, __FUNCTION__);
+        goto error;
+    }
+
+    if (stream->driver &&
+        stream->driver->streamSendHole) {
+        int ret;
+        ret = (stream->driver->streamSendHole)(stream, length, flags);
+        if (ret == -2)
+            return -2;
+        if (ret < 0)
+            goto error;
+        return ret;
+    }
+
+    virLibConnError(VIR_ERR_NO_SUPPORT, __FUNCTION__);
+
+error:
+    virDispatchError(stream->conn);
+    return -1;
+}
+
+
+/**
+ * virStreamRecvHole:
+ * @stream: pointer to the stream object
+ * @length: filled in with the number of bytes of the hole
+ * @flags: extra flags; not used yet, so callers should always pass 0
+ *
+ * After virStreamRecvFlags with VIR_STREAM_RECV_STOP_AT_HOLE
+ * returned 0, this reports the size of the hole the stream is
+ * positioned at, and moves past it. @length is set to 0 if there
+ * is no hole, which means the end of the stream was reached.
+ *
+ * Returns 0 on success, or -1 upon error
+ */
+int virStreamRecvHole(virStreamPtr stream,
+                      long long *length,
+                      unsigned int flags)
+{
+    VIR_DEBUG("stream=%p, length=%p, flags=%x", stream, length, flags);
+
+    virResetLastError();
+
+    if (!VIR_IS_CONNECTED_STREAM(stream)) {
+        virLibConnError(VIR_ERR_INVALID_CONN, __FUNCTION__);
+        virDispatchError(NULL);
+        return -1;
+    }
+
+    if (!length) {
+        virLibConnError(VIR_ERR_INVALID_ARG, __FUNCTION__);
+        goto error;
+    }
+
+    if (stream->driver &&
+        stream->driver->streamRecvHole) {
+        int ret;
+        ret = (stream->driver->streamRecvHole)(stream, length, flags);
+        if (ret < 0)
+            goto error;
+        return ret;
+    }
+
+    /* Nor can they be positioned at one */
+    if (stream->driver &&
+        stream->driver->streamRecv &&
+        flags == 0) {
+        *length = 0;
+        return 0;
+    }
+
+    virLibConnError(VIR_ERR_NO_SUPPORT, __FUNCTION__);
+
+error:
+    virDispatchError(stream->conn);
+    return -1;
+}
+
+
+/* Big enough to fill the largest remote stream data packet */
+#define VIR_STREAM_BUFFER_SIZE (1024 * 1024)
+
 /**
  * virStreamSendAll:
  * @stream: pointer to the stream object
@@ -11175,7 +11554,7 @@ int virStreamSendAll(virStreamPtr stream,
                      void *opaque)
 {
     char *bytes = NULL;
-    int want = 1024*64;
+    int want = VIR_STREAM_BUFFER_SIZE;
     int ret = -1;
     VIR_DEBUG("stream=%p, handler=%p, opaque=%p", stream, handler, opaque);
 
@@ -11272,7 +11651,7 @@ int virStreamRecvAll(virStreamPtr stream,
                      void *opaque)
 {
     char *bytes = NULL;
-    int want = 1024*64;
+    int want = VIR_STREAM_BUFFER_SIZE;
     int ret = -1;
     VIR_DEBUG("stream=%p, handler=%p, opaque=%p", stream, handler, opaque);
 
@@ -11325,6 +11704,221 @@ cleanup:
 }
 
 
+/**
+ * virStreamSparseSendAll:
+ * @stream: pointer to the stream object
+ * @handler: source callback for reading data from application
+ * @holeHandler: source callback for finding holes in application data
+ * @skipHandler: source callback for skipping holes in application data
+ * @opaque: application defined data
+ *
+ * Send the entire data stream like virStreamSendAll, except
+ * that holes reported by @holeHandler are sent as holes with
+ * virStreamSendHole, and skipped in the source with @skipHandler,
+ * instead of being read and sent as zeros. The stream must have
+ * been set up for sparse transfers.
+ *
+ * Returns 0 if all the data was successfully sent. The caller
+ * should invoke virStreamFinish(st) to flush the stream upon
+ * success and then virStreamFree
+ *
+ * Returns -1 upon any error, with virStreamAbort() already
+ * having been called,  so the caller need only call
+ * virStreamFree()
+ */
+int virStreamSparseSendAll(virStreamPtr stream,
+                           virStreamSourceFunc handler,
+                           virStreamSourceHoleFunc holeHandler,
+                           virStreamSourceSkipFunc skipHandler,
+                           void *opaque)
+{
+    char *bytes = NULL;
+    int want = VIR_STREAM_BUFFER_SIZE;
+    int ret = -1;
+    VIR_DEBUG("stream=%p, handler=%p, holeHandler=%p, skipHandler=%p, opaque=%p",
+              stream, handler, holeHandler, skipHandler, opaque);
+
+    virResetLastError();
+
+    if (!VIR_IS_CONNECTED_STREAM(stream)) {
+        virLibConnError(VIR_ERR_INVALID_CONN, __FUNCTION__);
+        virDispatchError(NULL);
+        return -1;
+    }
+
+    if (stream->flags & VIR_STREAM_NONBLOCK) {
+        virLibConnError(VIR_ERR_OPERATION_INVALID,
+                        _("data sources cannot be used for non-blocking streams"));
+        goto cleanup;
+    }
+
+    if (!handler || !holeHandler || !skipHandler) {
+        virLibConnError(VIR_ERR_INVALID_ARG, __FUNCTION__);
+        goto cleanup;
+    }
+
+    if (VIR_ALLOC_N(bytes, want) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    for (;;) {
+        int inData = 0;
+        long long sectionLen = 0;
+
+        if ((holeHandler)(stream, &inData, &sectionLen, opaque) < 0) {
+            virStreamAbort(stream);
+            goto cleanup;
+        }
+
+        if (sectionLen <= 0)
+            break; /* End of the source */
+
+        if (!inData) {
+            if (virStreamSendHole(stream, sectionLen, 0) < 0)
+                goto cleanup;
+            if ((skipHandler)(stream, sectionLen, opaque) < 0) {
+                virStreamAbort(stream);
+                goto cleanup;
+            }
+            continue;
+        }
+
+        /* Don't read past the end of the data section, so the
+         * next hole is found before any of it is read */
+        while (sectionLen > 0) {
+            int got, offset = 0;
+            int len = want;
+
+            if (sectionLen < len)
+                len = sectionLen;
+
+            got = (handler)(stream, bytes, len, opaque);
+            if (got < 0) {
+                virStreamAbort(stream);
+                goto cleanup;
+            }
+            if (got == 0)
+                goto eof;
+            while (offset < got) {
+                int done;
+                done = virStreamSend(stream, bytes + offset, got - offset);
+                if (done < 0)
+                    goto cleanup;
+                offset += done;
+            }
+            sectionLen -= got;
+        }
+    }
+
+eof:
+    ret = 0;
+
+cleanup:
+    VIR_FREE(bytes);
+
+    if (ret != 0)
+        virDispatchError(stream->conn);
+
+    return ret;
+}
+
+
+/**
+ * virStreamSparseRecvAll:
+ * @stream: pointer to the stream object
+ * @handler: sink callback for writing data to application
+ * @holeHandler: sink callback for creating holes in application data
+ * @opaque: application defined data
+ *
+ * Receive the entire data stream like virStreamRecvAll, except
+ * that holes are handed to @holeHandler instead of being passed
+ * to @handler as zeros.
+ *
+ * Returns 0 if all the data was successfully received. The caller
+ * should invoke virStreamFinish(st) to flush the stream upon
+ * success and then virStreamFree
+ *
+ * Returns -1 upon any error, with virStreamAbort() already
+ * having been called,  so the caller need only call
+ * virStreamFree()
+ */
+int virStreamSparseRecvAll(virStreamPtr stream,
+                           virStreamSinkFunc handler,
+                           virStreamSinkHoleFunc holeHandler,
+                           void *opaque)
+{
+    char *bytes = NULL;
+    int want = VIR_STREAM_BUFFER_SIZE;
+    int ret = -1;
+    VIR_DEBUG("stream=%p, handler=%p, holeHandler=%p, opaque=%p",
+              stream, handler, holeHandler, opaque);
+
+    virResetLastError();
+
+    if (!VIR_IS_CONNECTED_STREAM(stream)) {
+        virLibConnError(VIR_ERR_INVALID_CONN, __FUNCTION__);
+        virDispatchError(NULL);
+        return -1;
+    }
+
+    if (stream->flags & VIR_STREAM_NONBLOCK) {
+        virLibConnError(VIR_ERR_OPERATION_INVALID,
+                        _("data sinks cannot be used for non-blocking streams"));
+        goto cleanup;
+    }
+
+    if (!handler || !holeHandler) {
+        virLibConnError(VIR_ERR_INVALID_ARG, __FUNCTION__);
+        goto cleanup;
+    }
+
+    if (VIR_ALLOC_N(bytes, want) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    for (;;) {
+        int got, offset = 0;
+        got = virStreamRecvFlags(stream, bytes, want,
+                                 VIR_STREAM_RECV_STOP_AT_HOLE);
+        if (got < 0)
+            goto cleanup;
+        if (got == 0) {
+            long long holeLen;
+
+            if (virStreamRecvHole(stream, &holeLen, 0) < 0)
+                goto cleanup;
+            if (holeLen == 0)
+                break;
+            if ((holeHandler)(stream, holeLen, opaque) < 0) {
+                virStreamAbort(stream);
+                goto cleanup;
+            }
+            continue;
+        }
+        while (offset < got) {
+            int done;
+            done = (handler)(stream, bytes + offset, got - offset, opaque);
+            if (done < 0) {
+                virStreamAbort(stream);
+                goto cleanup;
+            }
+            offset += done;
+        }
+    }
+    ret = 0;
+
+cleanup:
+    VIR_FREE(bytes);
+
+    if (ret != 0)
+        virDispatchError(stream->conn);
+
+    return ret;
+}
+
+
 /**
  * virStreamEventAddCallback:
  * @stream: pointer to the stream object
@@ -12530,6 +13124,13 @@ error:
  * Extract information about progress of a background job on a domain.
  * Will return an error if the domain is not active.
  *
+ * Only the latest progress is reported. Drivers which sample the
+ * progress of a job over time, such as QEMU during migration, do not
+ * expose those samples; the transfer rate they give is only reflected
+ * in @info->timeRemaining, as an estimate for a
+ * VIR_DOMAIN_JOB_UNBOUNDED job, which is left at 0 when no estimate
+ * is available yet.
+ *
  * Returns 0 in case of success and -1 in case of failure.
  */
 int
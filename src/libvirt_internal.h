@@ -66,6 +66,13 @@ enum {
      * perform step is used.
      */
     VIR_DRV_FEATURE_MIGRATION_DIRECT = 5,
+
+    /* Remote end accepts and sends stream data messages of up to
+     * REMOTE_STREAM_MESSAGE_MAX bytes. This is answered by libvirtd
+     * itself rather than the real driver, and querying it is what
+     * switches the client connection over to the larger frames.
+     */
+    VIR_DRV_FEATURE_REMOTE_STREAM_FRAMES = 6,
 };
 
 
@@ -223,7 +223,7 @@ libxlVmCleanup(libxlDriverPrivatePtr driver, virDomainObjPtr vm)
     }
 
     if (vm->persistent) {
-        vm->def->id = -1;
+        virDomainObjListClearID(&driver->domains, vm);
         vm->state = VIR_DOMAIN_SHUTOFF;
     }
 
@@ -426,7 +426,8 @@ libxlVmStart(libxlDriverPrivatePtr driver,
         goto error;
     }
 
-    def->id = domid;
+    if (virDomainObjListSetID(&driver->domains, vm, domid) < 0)
+        goto error;
     if ((dom_xml = virDomainDefFormat(def, 0)) == NULL)
         goto error;
 
@@ -462,7 +463,7 @@ libxlVmStart(libxlDriverPrivatePtr driver,
 error:
     if (domid > 0) {
         libxl_domain_destroy(&priv->ctx, domid, 0);
-        def->id = -1;
+        virDomainObjListClearID(&driver->domains, vm);
         vm->state = VIR_DOMAIN_SHUTOFF;
     }
     libxl_domain_config_destroy(&d_config);
@@ -507,7 +508,8 @@ libxlReconnectDomain(void *payload,
     }
 
     /* Update domid in case it changed (e.g. reboot) while we were gone? */
-    vm->def->id = d_info.domid;
+    if (virDomainObjListSetID(&driver->domains, vm, d_info.domid) < 0)
+        goto out;
     vm->state = VIR_DOMAIN_RUNNING;
 
     /* Recreate domain death et. al. events */
@@ -526,7 +528,7 @@ out:
 static void
 libxlReconnectDomains(libxlDriverPrivatePtr driver)
 {
-    virHashForEach(driver->domains.objs, libxlReconnectDomain, driver);
+    virDomainObjListForEach(&driver->domains, libxlReconnectDomain, driver);
 }
 
 static int
@@ -726,8 +728,8 @@ libxlStartup(int privileged) {
                                 0, NULL, NULL) < 0)
         goto error;
 
-    virHashForEach(libxl_driver->domains.objs, libxlAutostartDomain,
-                   libxl_driver);
+    virDomainObjListForEach(&libxl_driver->domains, libxlAutostartDomain,
+                            libxl_driver);
 
     libxlDriverUnlock(libxl_driver);
 
@@ -758,8 +760,8 @@ libxlReload(void)
                             libxl_driver->autostartDir,
                             0, NULL, libxl_driver);
 
-    virHashForEach(libxl_driver->domains.objs, libxlAutostartDomain,
-                   libxl_driver);
+    virDomainObjListForEach(&libxl_driver->domains, libxlAutostartDomain,
+                            libxl_driver);
 
     libxlDriverUnlock(libxl_driver);
 
@@ -2663,6 +2665,7 @@ static virDriver libxlDriver = {
     NULL,                       /* domainSnapshotDelete */
     NULL,                       /* qemuDomainMonitorCommand */
     NULL,                       /* domainOpenConsole */
+    NULL,                       /* connectGetAllDomainStats */
 };
 
 static virStateDriver libxlStateDriver = {
@@ -32,6 +32,7 @@
 # include "domain_event.h"
 # include "capabilities.h"
 # include "threads.h"
+# include "threadpool.h"
 # include "cgroup.h"
 # include "configmake.h"
 
@@ -55,6 +56,9 @@ struct __lxc_driver {
     int log_libvirtd;
     int have_netns;
 
+    /* Runs the slow cleanup once a container's controller exits */
+    virThreadPoolPtr workerPool;
+
     /* An array of callbacks */
     virDomainEventCallbackListPtr domainEventCallbacks;
     virDomainEventQueuePtr domainEventQueue;
@@ -52,6 +52,7 @@
 #include "hooks.h"
 #include "files.h"
 #include "fdstream.h"
+#include "ignore-value.h"
 
 
 #define VIR_FROM_THIS VIR_FROM_LXC
@@ -980,7 +981,7 @@ static void lxcVmCleanup(lxc_driver_t *driver,
 
     vm->state = VIR_DOMAIN_SHUTOFF;
     vm->pid = -1;
-    vm->def->id = -1;
+    virDomainObjListClearID(&driver->domains, vm);
     priv->monitor = -1;
     priv->monitorWatch = -1;
 
@@ -1199,13 +1200,21 @@ cleanup:
     return rc;
 }
 
-static void lxcMonitorEvent(int watch,
-                            int fd,
-                            int events ATTRIBUTE_UNUSED,
-                            void *data)
+struct lxcMonitorEOFJob {
+    virDomainObjPtr vm;
+    int watch;
+};
+
+/*
+ * Tear down a container whose controller has gone away. Killing
+ * off what is left of it can take seconds, so this runs in the
+ * driver's worker pool rather than in the event loop.
+ */
+static void lxcProcessMonitorEOF(void *jobdata, void *opaque)
 {
-    lxc_driver_t *driver = lxc_driver;
-    virDomainObjPtr vm = data;
+    struct lxcMonitorEOFJob *job = jobdata;
+    lxc_driver_t *driver = opaque;
+    virDomainObjPtr vm = job->vm;
     virDomainEventPtr event = NULL;
     lxcDomainObjPrivatePtr priv;
 
@@ -1213,15 +1222,18 @@ static void lxcMonitorEvent(int watch,
     virDomainObjLock(vm);
     lxcDriverUnlock(driver);
 
-    priv = vm->privateData;
-
-    if (priv->monitor != fd || priv->monitorWatch != watch) {
-        virEventRemoveHandle(watch);
+    if (virDomainObjUnref(vm) == 0) {
+        vm = NULL;
         goto cleanup;
     }
 
+    /* Someone else cleaned up after it while we were queued */
+    priv = vm->privateData;
+    if (priv->monitorWatch != job->watch)
+        goto cleanup;
+
     if (lxcVmTerminate(driver, vm) < 0) {
-        virEventRemoveHandle(watch);
+        virEventRemoveHandle(job->watch);
     } else {
         event = virDomainEventNewFromObj(vm,
                                          VIR_DOMAIN_EVENT_STOPPED,
@@ -1240,6 +1252,52 @@ cleanup:
         lxcDomainEventQueue(driver, event);
         lxcDriverUnlock(driver);
     }
+    VIR_FREE(job);
+}
+
+static void lxcMonitorEvent(int watch,
+                            int fd,
+                            int events ATTRIBUTE_UNUSED,
+                            void *data)
+{
+    lxc_driver_t *driver = lxc_driver;
+    virDomainObjPtr vm = data;
+    lxcDomainObjPrivatePtr priv;
+    struct lxcMonitorEOFJob *job;
+
+    lxcDriverLock(driver);
+    virDomainObjLock(vm);
+    lxcDriverUnlock(driver);
+
+    priv = vm->privateData;
+
+    if (priv->monitor != fd || priv->monitorWatch != watch) {
+        virEventRemoveHandle(watch);
+        goto cleanup;
+    }
+
+    /* No more events until the job has dealt with this one */
+    virEventUpdateHandle(watch, 0);
+
+    if (VIR_ALLOC(job) < 0) {
+        virReportOOMError();
+        virEventRemoveHandle(watch);
+        goto cleanup;
+    }
+    job->vm = vm;
+    job->watch = watch;
+
+    virDomainObjRef(vm);
+    if (virThreadPoolSendJob(driver->workerPool, job) < 0) {
+        VIR_ERROR(_("Failed to queue cleanup of container '%s'"),
+                  vm->def->name);
+        ignore_value(virDomainObjUnref(vm));
+        VIR_FREE(job);
+        virEventRemoveHandle(watch);
+    }
+
+cleanup:
+    virDomainObjUnlock(vm);
 }
 
 
@@ -1552,8 +1610,11 @@ static int lxcVmStart(virConnectPtr conn,
         goto cleanup;
     }
 
-    vm->def->id = vm->pid;
     vm->state = VIR_DOMAIN_RUNNING;
+    if (virDomainObjListSetID(&driver->domains, vm, vm->pid) < 0) {
+        lxcVmTerminate(driver, vm);
+        goto cleanup;
+    }
 
     if ((priv->monitorWatch = virEventAddHandle(
              priv->monitor,
@@ -1974,7 +2035,7 @@ lxcAutostartConfigs(lxc_driver_t *driver) {
     struct lxcAutostartData data = { driver, conn };
 
     lxcDriverLock(driver);
-    virHashForEach(driver->domains.objs, lxcAutostartDomain, &data);
+    virDomainObjListForEach(&driver->domains, lxcAutostartDomain, &data);
     lxcDriverUnlock(driver);
 
     if (conn)
@@ -2016,8 +2077,11 @@ lxcReconnectVM(void *payload, const void *name ATTRIBUTE_UNUSED, void *opaque)
     }
 
     if (vm->pid != 0) {
-        vm->def->id = vm->pid;
         vm->state = VIR_DOMAIN_RUNNING;
+        if (virDomainObjListSetID(&driver->domains, vm, vm->pid) < 0) {
+            lxcVmTerminate(driver, vm);
+            goto cleanup;
+        }
 
         if ((priv->monitorWatch = virEventAddHandle(
                  priv->monitor,
@@ -2028,7 +2092,7 @@ lxcReconnectVM(void *payload, const void *name ATTRIBUTE_UNUSED, void *opaque)
             goto cleanup;
         }
     } else {
-        vm->def->id = -1;
+        virDomainObjListClearID(&driver->domains, vm);
         VIR_FORCE_CLOSE(priv->monitor);
     }
 
@@ -2085,6 +2149,11 @@ static int lxcStartup(int privileged)
          virEventAddTimeout(-1, lxcDomainEventFlush, lxc_driver, NULL)) < 0)
         goto cleanup;
 
+    if (!(lxc_driver->workerPool = virThreadPoolNew(0, 1,
+                                                    lxcProcessMonitorEOF,
+                                                    lxc_driver)))
+        goto cleanup;
+
     lxc_driver->log_libvirtd = 0; /* by default log to container logfile */
     lxc_driver->have_netns = lxcCheckNetNsSupport();
 
@@ -2115,7 +2184,7 @@ static int lxcStartup(int privileged)
                                 0, NULL, NULL) < 0)
         goto cleanup;
 
-    virHashForEach(lxc_driver->domains.objs, lxcReconnectVM, lxc_driver);
+    virDomainObjListForEach(&lxc_driver->domains, lxcReconnectVM, lxc_driver);
 
     lxcDriverUnlock(lxc_driver);
 
@@ -2172,6 +2241,9 @@ static int lxcShutdown(void)
     if (lxc_driver == NULL)
         return(-1);
 
+    /* Jobs still queued are run, and need the driver lock */
+    virThreadPoolFree(lxc_driver->workerPool);
+
     lxcDriverLock(lxc_driver);
     virDomainObjListDeinit(&lxc_driver->domains);
 
@@ -2906,6 +2978,7 @@ static virDriver lxcDriver = {
     NULL, /* domainSnapshotDelete */
     NULL, /* qemuDomainMonitorCommand */
     lxcDomainOpenConsole, /* domainOpenConsole */
+    NULL, /* connectGetAllDomainStats */
 };
 
 static virStateDriver lxcStateDriver = {
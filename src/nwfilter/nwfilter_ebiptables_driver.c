@@ -39,6 +39,7 @@
 #include "nwfilter_gentech_driver.h"
 #include "nwfilter_ebiptables_driver.h"
 #include "files.h"
+#include "command.h"
 
 
 #define VIR_FROM_THIS VIR_FROM_NWFILTER
@@ -81,6 +82,9 @@
 static char *ebtables_cmd_path;
 static char *iptables_cmd_path;
 static char *ip6tables_cmd_path;
+static char *ebtables_restore_cmd_path;
+static char *iptables_restore_cmd_path;
+static char *ip6tables_restore_cmd_path;
 static char *grep_cmd_path;
 static char *gawk_cmd_path;
 
@@ -318,6 +322,7 @@ ebiptablesRuleInstFree(ebiptablesRuleInstPtr inst)
         return;
 
     VIR_FREE(inst->commandTemplate);
+    VIR_FREE(inst->restoreRule);
     VIR_FREE(inst);
 }
 
@@ -325,6 +330,7 @@ ebiptablesRuleInstFree(ebiptablesRuleInstPtr inst)
 static int
 ebiptablesAddRuleInst(virNWFilterRuleInstPtr res,
                       char *commandTemplate,
+                      char *restoreRule,
                       enum virNWFilterChainSuffixType neededChain,
                       char chainprefix,
                       unsigned int priority,
@@ -334,10 +340,13 @@ ebiptablesAddRuleInst(virNWFilterRuleInstPtr res,
 
     if (VIR_ALLOC(inst) < 0) {
         virReportOOMError();
+        VIR_FREE(commandTemplate);
+        VIR_FREE(restoreRule);
         return 1;
     }
 
     inst->commandTemplate = commandTemplate;
+    inst->restoreRule = restoreRule;
     inst->neededProtocolChain = neededChain;
     inst->chainprefix = chainprefix;
     inst->priority = priority;
@@ -347,6 +356,97 @@ ebiptablesAddRuleInst(virNWFilterRuleInstPtr res,
 }
 
 
+/**
+ * ebiptablesRestoreRule:
+ * @templ : the rule's command template, up to and including its target
+ * @cmd : the tool the template invokes
+ * @table : the ebtables table the template names, NULL for iptables
+ * @chain : the chain the rule goes into
+ * @comment : the shell assignment of the rule's comment, or NULL
+ *
+ * Returns the rule as a line of input for the *-restore tools, or NULL
+ * if it can only be applied through the shell. No error is reported.
+ */
+char *
+ebiptablesRestoreRule(const char *templ,
+                      const char *cmd,
+                      const char *table,
+                      const char *chain,
+                      const char *comment)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    char *header;
+    const char *args, *var;
+    size_t i;
+    int rc;
+
+    if (table)
+        rc = virAsprintf(&header, CMD_DEF_PRE "%s -t %s -%%c %s %%s",
+                         cmd, table, chain);
+    else
+        rc = virAsprintf(&header, CMD_DEF_PRE "%s -%%c %s %%s",
+                         cmd, chain);
+    if (rc < 0)
+        return NULL;
+
+    if (!STRPREFIX(templ, header)) {
+        VIR_FREE(header);
+        return NULL;
+    }
+    args = templ + strlen(header);
+    VIR_FREE(header);
+
+    /* Anything quoted other than the comment would need the shell */
+    var = strstr(args, "\"$" COMMENT_VARNAME "\"");
+    for (i = 0; args[i]; i++) {
+        if (var && args + i == var)
+            i += strlen("\"$" COMMENT_VARNAME "\"") - 1;
+        else if (strchr("'\"\\$`", args[i]))
+            return NULL;
+    }
+
+    virBufferVSprintf(&buf, "-A %s", chain);
+
+    /* Undo the quoting of printCommentVar and quote the comment
+       the way the *-restore tools expect instead */
+    if (var) {
+        if (!comment || !STRPREFIX(comment, COMMENT_VARNAME "='"))
+            goto error;
+
+        virBufferAdd(&buf, args, var - args);
+        virBufferAddChar(&buf, '"');
+        for (i = strlen(COMMENT_VARNAME "='"); ; i++) {
+            if (comment[i] == '\'') {
+                if (!STRPREFIX(comment + i, "'\\''"))
+                    break;
+                i += 3;
+            } else if (comment[i] == '\0' ||
+                       comment[i] == '\n' || comment[i] == '\r') {
+                goto error;
+            } else if (comment[i] == '\\' || comment[i] == '"') {
+                virBufferAddChar(&buf, '\\');
+            }
+            virBufferAddChar(&buf, comment[i]);
+        }
+        virBufferAddChar(&buf, '"');
+
+        args = var + strlen("\"$" COMMENT_VARNAME "\"");
+    }
+
+    virBufferAdd(&buf, args, -1);
+    virBufferAddChar(&buf, '\n');
+
+    if (virBufferError(&buf))
+        goto error;
+
+    return virBufferContentAndReset(&buf);
+
+error:
+    virBufferFreeAndReset(&buf);
+    return NULL;
+}
+
+
 static int
 ebtablesHandleEthHdr(virBufferPtr buf,
                      virNWFilterHashTablePtr vars,
@@ -1156,7 +1256,7 @@ _iptablesCreateRuleInstance(int directionIn,
     virBuffer prefix = VIR_BUFFER_INITIALIZER;
     virBuffer buf = VIR_BUFFER_INITIALIZER;
     virBuffer afterStateMatch = VIR_BUFFER_INITIALIZER;
-    virBufferPtr final = NULL;
+    char *templ, *comment, *restoreRule;
     const char *target;
     const char *iptables_cmd = (isIPv6) ? ip6tables_cmd_path
                                         : iptables_cmd_path;
@@ -1554,10 +1654,7 @@ _iptablesCreateRuleInstance(int directionIn,
         VIR_FREE(s);
     }
 
-    virBufferVSprintf(&buf,
-                      " -j %s" CMD_DEF_POST CMD_SEPARATOR
-                      CMD_EXEC,
-                      target);
+    virBufferVSprintf(&buf, " -j %s", target);
 
     if (virBufferError(&buf) || virBufferError(&prefix)) {
         virBufferFreeAndReset(&buf);
@@ -1566,26 +1663,32 @@ _iptablesCreateRuleInstance(int directionIn,
         return -1;
     }
 
-    if (virBufferUse(&prefix)) {
-        char *s = virBufferContentAndReset(&buf);
+    templ = virBufferContentAndReset(&buf);
+    comment = virBufferContentAndReset(&prefix);
 
-        virBufferAdd(&prefix, s, -1);
+    restoreRule = ebiptablesRestoreRule(templ, iptables_cmd, NULL,
+                                        chain, comment);
 
-        VIR_FREE(s);
-
-        final = &prefix;
+    if (comment)
+        virBufferAdd(&buf, comment, -1);
+    virBufferVSprintf(&buf,
+                      "%s" CMD_DEF_POST CMD_SEPARATOR
+                      CMD_EXEC,
+                      templ);
 
-        if (virBufferError(&prefix)) {
-            virBufferFreeAndReset(&prefix);
-            virReportOOMError();
-            return -1;
-        }
-    } else
-        final = &buf;
+    VIR_FREE(templ);
+    VIR_FREE(comment);
 
+    if (virBufferError(&buf)) {
+        virBufferFreeAndReset(&buf);
+        VIR_FREE(restoreRule);
+        virReportOOMError();
+        return -1;
+    }
 
     return ebiptablesAddRuleInst(res,
-                                 virBufferContentAndReset(final),
+                                 virBufferContentAndReset(&buf),
+                                 restoreRule,
                                  nwfilter->chainsuffix,
                                  '\0',
                                  rule->priority,
@@ -1890,6 +1993,7 @@ ebtablesCreateRuleInstance(char chainPrefix,
          number[20];
     char chain[MAX_CHAINNAME_LENGTH];
     virBuffer buf = VIR_BUFFER_INITIALIZER;
+    char *templ, *restoreRule;
     const char *target;
 
     if (!ebtables_cmd_path) {
@@ -2316,19 +2420,34 @@ ebtablesCreateRuleInstance(char chainPrefix,
         target = virNWFilterJumpTargetTypeToString(rule->action);
     }
 
+    virBufferVSprintf(&buf, " -j %s", target);
+
+    if (virBufferError(&buf)) {
+        virBufferFreeAndReset(&buf);
+        virReportOOMError();
+        return -1;
+    }
+
+    templ = virBufferContentAndReset(&buf);
+    restoreRule = ebiptablesRestoreRule(templ, ebtables_cmd_path,
+                                        EBTABLES_DEFAULT_TABLE, chain, NULL);
+
     virBufferVSprintf(&buf,
-                      " -j %s" CMD_DEF_POST CMD_SEPARATOR
+                      "%s" CMD_DEF_POST CMD_SEPARATOR
                       CMD_EXEC,
-                      target);
+                      templ);
+    VIR_FREE(templ);
 
     if (virBufferError(&buf)) {
         virBufferFreeAndReset(&buf);
+        VIR_FREE(restoreRule);
         virReportOOMError();
         return -1;
     }
 
     return ebiptablesAddRuleInst(res,
                                  virBufferContentAndReset(&buf),
+                                 restoreRule,
                                  nwfilter->chainsuffix,
                                  chainPrefix,
                                  rule->priority,
@@ -2635,6 +2754,66 @@ ebiptablesExecCLI(virBufferPtr buf,
 }
 
 
+/**
+ * ebiptablesExecRestore:
+ * @restore_cmd : path of the ebtables-, iptables- or ip6tables-restore tool
+ * @buf : pointer to virBuffer containing the tables to restore
+ *
+ * Returns 0 in case of success, -1 if the tool failed or could not
+ * be run, in which case the caller is expected to fall back to
+ * applying the same rules through ebiptablesExecCLI. No error is
+ * reported.
+ *
+ * Feed the tables to the restore tool, which commits each of them
+ * to the kernel in a single transaction. Chains not mentioned in
+ * the input are left alone.
+ */
+static int
+ebiptablesExecRestore(const char *restore_cmd,
+                      virBufferPtr buf)
+{
+    virCommandPtr cmd;
+    char *input;
+    char *errbuf = NULL;
+    int status;
+    int rc = -1;
+
+    if (virBufferError(buf)) {
+        virBufferFreeAndReset(buf);
+        return -1;
+    }
+
+    input = virBufferContentAndReset(buf);
+
+    VIR_DEBUG("%s --noflush <<EOF\n%sEOF", restore_cmd, NULLSTR(input));
+
+    if (!input)
+        return 0;
+
+    cmd = virCommandNewArgList(restore_cmd, "--noflush", NULL);
+    virCommandSetInputBuffer(cmd, input);
+    virCommandSetErrorBuffer(cmd, &errbuf);
+
+    virMutexLock(&execCLIMutex);
+
+    if (virCommandRun(cmd, &status) == 0 && status == 0)
+        rc = 0;
+
+    virMutexUnlock(&execCLIMutex);
+
+    if (rc < 0) {
+        VIR_DEBUG("%s failed: %s", restore_cmd, NULLSTR(errbuf));
+        virResetLastError();
+    }
+
+    virCommandFree(cmd);
+    VIR_FREE(errbuf);
+    VIR_FREE(input);
+
+    return rc;
+}
+
+
 static int
 ebtablesCreateTmpRootChain(virBufferPtr buf,
                            int incoming, const char *ifname,
@@ -3331,6 +3510,183 @@ iptablesCheckBridgeNFCallEnabled(bool isIPv6)
 }
 
 
+/**
+ * iptablesRestoreTmpRootChains:
+ * @restore_cmd : path of the iptables- or ip6tables-restore tool, or NULL
+ * @ifname : the name of the interface to which the rules apply
+ * @nruleInstances : the number of given rules
+ * @inst : array of rule instantiation data, sorted by priority
+ * @ruleType : RT_IPTABLES or RT_IP6TABLES
+ *
+ * Returns 0 if the temporary root chains were created, linked and
+ * filled with the rules of type @ruleType in a single transaction,
+ * -1 if nothing was changed and the shell has to do it instead.
+ */
+static int
+iptablesRestoreTmpRootChains(const char *restore_cmd,
+                             const char *ifname,
+                             int nruleInstances,
+                             ebiptablesRuleInstPtr *inst,
+                             enum RuleType ruleType)
+{
+    static const struct {
+        const char *basechain;
+        char prefix;
+        int incoming;
+    } roots[] = {
+        { VIRT_OUT_CHAIN, 'F', 0 },
+        { VIRT_IN_CHAIN , 'F', 1 },
+        { HOST_IN_CHAIN , 'H', 1 },
+    };
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    char chain[MAX_CHAINNAME_LENGTH];
+    int i;
+
+    if (!restore_cmd)
+        return -1;
+
+    virBufferAddLit(&buf, "*filter\n");
+
+    for (i = 0; i < ARRAY_CARDINALITY(roots); i++) {
+        char chainPrefix[2] = {
+            roots[i].prefix,
+            (roots[i].incoming) ? CHAINPREFIX_HOST_IN_TEMP
+                                : CHAINPREFIX_HOST_OUT_TEMP
+        };
+
+        PRINT_IPT_ROOT_CHAIN(chain, chainPrefix, ifname);
+        virBufferVSprintf(&buf, ":%s - [0:0]\n", chain);
+    }
+
+    for (i = 0; i < ARRAY_CARDINALITY(roots); i++) {
+        char chainPrefix[2] = {
+            roots[i].prefix,
+            (roots[i].incoming) ? CHAINPREFIX_HOST_IN_TEMP
+                                : CHAINPREFIX_HOST_OUT_TEMP
+        };
+
+        PRINT_IPT_ROOT_CHAIN(chain, chainPrefix, ifname);
+        virBufferVSprintf(&buf, "-A %s %s %s -g %s\n",
+                          roots[i].basechain,
+                          (roots[i].incoming) ? MATCH_PHYSDEV_IN
+                                              : MATCH_PHYSDEV_OUT,
+                          ifname, chain);
+    }
+
+    for (i = 0; i < nruleInstances; i++) {
+        if (inst[i]->ruleType != ruleType)
+            continue;
+        if (!inst[i]->restoreRule) {
+            virBufferFreeAndReset(&buf);
+            return -1;
+        }
+        virBufferAdd(&buf, inst[i]->restoreRule, -1);
+    }
+
+    virBufferAddLit(&buf, "COMMIT\n");
+
+    return ebiptablesExecRestore(restore_cmd, &buf);
+}
+
+
+/**
+ * ebtablesRestoreTmpChains:
+ * @ifname : the name of the interface to which the rules apply
+ * @chains_in : bitmap of the protocol chains needed for incoming traffic
+ * @chains_out : bitmap of the protocol chains needed for outgoing traffic
+ * @nruleInstances : the number of given rules
+ * @inst : array of rule instantiation data, sorted by priority
+ *
+ * Returns 0 if the temporary root and protocol chains were created
+ * and filled with the ebtables rules in a single transaction, -1 if
+ * nothing was changed and the shell has to do it instead.
+ */
+static int
+ebtablesRestoreTmpChains(const char *ifname,
+                         int chains_in, int chains_out,
+                         int nruleInstances,
+                         ebiptablesRuleInstPtr *inst)
+{
+    /* keep arp,rarp as last */
+    static const enum l3_proto_idx protos[] = {
+        L3_PROTO_IPV4_IDX,
+        L3_PROTO_IPV6_IDX,
+        L3_PROTO_ARP_IDX,
+        L3_PROTO_RARP_IDX,
+    };
+    static const enum virNWFilterChainSuffixType suffixes[] = {
+        VIR_NWFILTER_CHAINSUFFIX_IPv4,
+        VIR_NWFILTER_CHAINSUFFIX_IPv6,
+        VIR_NWFILTER_CHAINSUFFIX_ARP,
+        VIR_NWFILTER_CHAINSUFFIX_RARP,
+    };
+    virBuffer decls = VIR_BUFFER_INITIALIZER;
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    char rootchain[MAX_CHAINNAME_LENGTH], chain[MAX_CHAINNAME_LENGTH];
+    char *s;
+    int i, incoming;
+
+    if (!ebtables_restore_cmd_path)
+        return -1;
+
+    virBufferVSprintf(&decls, "*%s\n", EBTABLES_DEFAULT_TABLE);
+
+    for (incoming = 1; incoming >= 0; incoming--) {
+        char chainPrefix = (incoming) ? CHAINPREFIX_HOST_IN_TEMP
+                                      : CHAINPREFIX_HOST_OUT_TEMP;
+
+        if ((incoming ? chains_in : chains_out) == 0)
+            continue;
+
+        PRINT_ROOT_CHAIN(rootchain, chainPrefix, ifname);
+        virBufferVSprintf(&decls, ":%s ACCEPT\n", rootchain);
+    }
+
+    for (i = 0; i < ARRAY_CARDINALITY(protos); i++) {
+        for (incoming = 1; incoming >= 0; incoming--) {
+            char chainPrefix = (incoming) ? CHAINPREFIX_HOST_IN_TEMP
+                                          : CHAINPREFIX_HOST_OUT_TEMP;
+
+            if (!((incoming ? chains_in : chains_out) & (1 << suffixes[i])))
+                continue;
+
+            PRINT_ROOT_CHAIN(rootchain, chainPrefix, ifname);
+            PRINT_CHAIN(chain, chainPrefix, ifname,
+                        l3_protocols[protos[i]].val);
+            virBufferVSprintf(&decls, ":%s ACCEPT\n", chain);
+            virBufferVSprintf(&buf, "-A %s -p 0x%x -j %s\n",
+                              rootchain, l3_protocols[protos[i]].attr,
+                              chain);
+        }
+    }
+
+    for (i = 0; i < nruleInstances; i++) {
+        if (inst[i]->ruleType != RT_EBTABLES)
+            continue;
+        if (!inst[i]->restoreRule) {
+            virBufferFreeAndReset(&decls);
+            virBufferFreeAndReset(&buf);
+            return -1;
+        }
+        virBufferAdd(&buf, inst[i]->restoreRule, -1);
+    }
+
+    virBufferAddLit(&buf, "COMMIT\n");
+
+    if (virBufferError(&buf)) {
+        virBufferFreeAndReset(&decls);
+        virBufferFreeAndReset(&buf);
+        return -1;
+    }
+
+    s = virBufferContentAndReset(&buf);
+    virBufferAdd(&decls, s, -1);
+    VIR_FREE(s);
+
+    return ebiptablesExecRestore(ebtables_restore_cmd_path, &decls);
+}
+
+
 static int
 ebiptablesApplyNewRules(virConnectPtr conn ATTRIBUTE_UNUSED,
                         const char *ifname,
@@ -3344,6 +3700,7 @@ ebiptablesApplyNewRules(virConnectPtr conn ATTRIBUTE_UNUSED,
     virBuffer buf = VIR_BUFFER_INITIALIZER;
     bool haveIptables = false;
     bool haveIp6tables = false;
+    bool restored;
 
     if (nruleInstances > 1 && inst)
         qsort(inst, nruleInstances, sizeof(inst[0]), ebiptablesRuleOrderSort);
@@ -3367,41 +3724,47 @@ ebiptablesApplyNewRules(virConnectPtr conn ATTRIBUTE_UNUSED,
         ebiptablesExecCLI(&buf, &cli_status);
     }
 
-    if (chains_in != 0)
-        ebtablesCreateTmpRootChain(&buf, 1, ifname, 1);
-    if (chains_out != 0)
-        ebtablesCreateTmpRootChain(&buf, 0, ifname, 1);
+    restored = (ebtablesRestoreTmpChains(ifname, chains_in, chains_out,
+                                         nruleInstances, inst) == 0);
+
+    if (!restored) {
+        if (chains_in != 0)
+            ebtablesCreateTmpRootChain(&buf, 1, ifname, 1);
+        if (chains_out != 0)
+            ebtablesCreateTmpRootChain(&buf, 0, ifname, 1);
+
+        if (chains_in  & (1 << VIR_NWFILTER_CHAINSUFFIX_IPv4))
+            ebtablesCreateTmpSubChain(&buf, 1, ifname, L3_PROTO_IPV4_IDX, 1);
+        if (chains_out & (1 << VIR_NWFILTER_CHAINSUFFIX_IPv4))
+            ebtablesCreateTmpSubChain(&buf, 0, ifname, L3_PROTO_IPV4_IDX, 1);
+
+        if (chains_in  & (1 << VIR_NWFILTER_CHAINSUFFIX_IPv6))
+            ebtablesCreateTmpSubChain(&buf, 1, ifname, L3_PROTO_IPV6_IDX, 1);
+        if (chains_out & (1 << VIR_NWFILTER_CHAINSUFFIX_IPv6))
+            ebtablesCreateTmpSubChain(&buf, 0, ifname, L3_PROTO_IPV6_IDX, 1);
+
+        /* keep arp,rarp as last */
+        if (chains_in  & (1 << VIR_NWFILTER_CHAINSUFFIX_ARP))
+            ebtablesCreateTmpSubChain(&buf, 1, ifname, L3_PROTO_ARP_IDX, 1);
+        if (chains_out & (1 << VIR_NWFILTER_CHAINSUFFIX_ARP))
+            ebtablesCreateTmpSubChain(&buf, 0, ifname, L3_PROTO_ARP_IDX, 1);
+        if (chains_in  & (1 << VIR_NWFILTER_CHAINSUFFIX_RARP))
+            ebtablesCreateTmpSubChain(&buf, 1, ifname, L3_PROTO_RARP_IDX, 1);
+        if (chains_out & (1 << VIR_NWFILTER_CHAINSUFFIX_RARP))
+            ebtablesCreateTmpSubChain(&buf, 0, ifname, L3_PROTO_RARP_IDX, 1);
 
-    if (chains_in  & (1 << VIR_NWFILTER_CHAINSUFFIX_IPv4))
-        ebtablesCreateTmpSubChain(&buf, 1, ifname, L3_PROTO_IPV4_IDX, 1);
-    if (chains_out & (1 << VIR_NWFILTER_CHAINSUFFIX_IPv4))
-        ebtablesCreateTmpSubChain(&buf, 0, ifname, L3_PROTO_IPV4_IDX, 1);
-
-    if (chains_in  & (1 << VIR_NWFILTER_CHAINSUFFIX_IPv6))
-        ebtablesCreateTmpSubChain(&buf, 1, ifname, L3_PROTO_IPV6_IDX, 1);
-    if (chains_out & (1 << VIR_NWFILTER_CHAINSUFFIX_IPv6))
-        ebtablesCreateTmpSubChain(&buf, 0, ifname, L3_PROTO_IPV6_IDX, 1);
-
-    /* keep arp,rarp as last */
-    if (chains_in  & (1 << VIR_NWFILTER_CHAINSUFFIX_ARP))
-        ebtablesCreateTmpSubChain(&buf, 1, ifname, L3_PROTO_ARP_IDX, 1);
-    if (chains_out & (1 << VIR_NWFILTER_CHAINSUFFIX_ARP))
-        ebtablesCreateTmpSubChain(&buf, 0, ifname, L3_PROTO_ARP_IDX, 1);
-    if (chains_in  & (1 << VIR_NWFILTER_CHAINSUFFIX_RARP))
-        ebtablesCreateTmpSubChain(&buf, 1, ifname, L3_PROTO_RARP_IDX, 1);
-    if (chains_out & (1 << VIR_NWFILTER_CHAINSUFFIX_RARP))
-        ebtablesCreateTmpSubChain(&buf, 0, ifname, L3_PROTO_RARP_IDX, 1);
-
-    if (ebiptablesExecCLI(&buf, &cli_status) || cli_status != 0)
-        goto tear_down_tmpebchains;
+        if (ebiptablesExecCLI(&buf, &cli_status) || cli_status != 0)
+            goto tear_down_tmpebchains;
+    }
 
     for (i = 0; i < nruleInstances; i++) {
         sa_assert (inst);
         switch (inst[i]->ruleType) {
         case RT_EBTABLES:
-            ebiptablesInstCommand(&buf,
-                                  inst[i]->commandTemplate,
-                                  'A', -1, 1);
+            if (!restored)
+                ebiptablesInstCommand(&buf,
+                                      inst[i]->commandTemplate,
+                                      'A', -1, 1);
         break;
         case RT_IPTABLES:
             haveIptables = true;
@@ -3424,17 +3787,23 @@ ebiptablesApplyNewRules(virConnectPtr conn ATTRIBUTE_UNUSED,
         if (ebiptablesExecCLI(&buf, &cli_status) || cli_status != 0)
             goto tear_down_tmpebchains;
 
-        iptablesCreateTmpRootChains(iptables_cmd_path, &buf, ifname);
+        restored = (iptablesRestoreTmpRootChains(iptables_restore_cmd_path,
+                                                 ifname, nruleInstances,
+                                                 inst, RT_IPTABLES) == 0);
 
-        if (ebiptablesExecCLI(&buf, &cli_status) || cli_status != 0)
-           goto tear_down_tmpiptchains;
+        if (!restored) {
+            iptablesCreateTmpRootChains(iptables_cmd_path, &buf, ifname);
 
-        iptablesLinkTmpRootChains(iptables_cmd_path, &buf, ifname);
+            if (ebiptablesExecCLI(&buf, &cli_status) || cli_status != 0)
+               goto tear_down_tmpiptchains;
+
+            iptablesLinkTmpRootChains(iptables_cmd_path, &buf, ifname);
+        }
         iptablesSetupVirtInPost(iptables_cmd_path, &buf, ifname);
         if (ebiptablesExecCLI(&buf, &cli_status) || cli_status != 0)
            goto tear_down_tmpiptchains;
 
-        for (i = 0; i < nruleInstances; i++) {
+        for (i = 0; !restored && i < nruleInstances; i++) {
             sa_assert (inst);
             if (inst[i]->ruleType == RT_IPTABLES)
                 iptablesInstCommand(&buf,
@@ -3457,17 +3826,23 @@ ebiptablesApplyNewRules(virConnectPtr conn ATTRIBUTE_UNUSED,
         if (ebiptablesExecCLI(&buf, &cli_status) || cli_status != 0)
             goto tear_down_tmpiptchains;
 
-        iptablesCreateTmpRootChains(ip6tables_cmd_path, &buf, ifname);
+        restored = (iptablesRestoreTmpRootChains(ip6tables_restore_cmd_path,
+                                                 ifname, nruleInstances,
+                                                 inst, RT_IP6TABLES) == 0);
 
-        if (ebiptablesExecCLI(&buf, &cli_status) || cli_status != 0)
-           goto tear_down_tmpip6tchains;
+        if (!restored) {
+            iptablesCreateTmpRootChains(ip6tables_cmd_path, &buf, ifname);
+
+            if (ebiptablesExecCLI(&buf, &cli_status) || cli_status != 0)
+               goto tear_down_tmpip6tchains;
 
-        iptablesLinkTmpRootChains(ip6tables_cmd_path, &buf, ifname);
+            iptablesLinkTmpRootChains(ip6tables_cmd_path, &buf, ifname);
+        }
         iptablesSetupVirtInPost(ip6tables_cmd_path, &buf, ifname);
         if (ebiptablesExecCLI(&buf, &cli_status) || cli_status != 0)
            goto tear_down_tmpip6tchains;
 
-        for (i = 0; i < nruleInstances; i++) {
+        for (i = 0; !restored && i < nruleInstances; i++) {
             if (inst[i]->ruleType == RT_IP6TABLES)
                 iptablesInstCommand(&buf,
                                     inst[i]->commandTemplate,
@@ -3714,6 +4089,33 @@ virNWFilterTechDriver ebiptables_driver = {
 };
 
 
+/**
+ * ebiptablesProbeRestore:
+ * @name : name of the restore tool to look for
+ * @table : a table the tool must be able to restore
+ *
+ * Returns the path of the tool if it is installed and can update
+ * @table without flushing it, NULL otherwise.
+ */
+static char *
+ebiptablesProbeRestore(const char *name,
+                       const char *table)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    char *path;
+
+    if (!(path = virFindFileInPath(name)))
+        return NULL;
+
+    virBufferVSprintf(&buf, "*%s\nCOMMIT\n", table);
+
+    if (ebiptablesExecRestore(path, &buf) < 0)
+        VIR_FREE(path);
+
+    return path;
+}
+
+
 static int
 ebiptablesDriverInit(bool privileged)
 {
@@ -3743,6 +4145,13 @@ ebiptablesDriverInit(bool privileged)
              VIR_FREE(ebtables_cmd_path);
     }
 
+    /* Older ebtables-restore only reads ebtables-save's binary
+       format and rejects --noflush, so it fails this probe */
+    if (ebtables_cmd_path)
+        ebtables_restore_cmd_path =
+            ebiptablesProbeRestore("ebtables-restore",
+                                   EBTABLES_DEFAULT_TABLE);
+
     iptables_cmd_path = virFindFileInPath("iptables");
     if (iptables_cmd_path) {
         virBufferVSprintf(&buf,
@@ -3756,6 +4165,10 @@ ebiptablesDriverInit(bool privileged)
              VIR_FREE(iptables_cmd_path);
     }
 
+    if (iptables_cmd_path)
+        iptables_restore_cmd_path =
+            ebiptablesProbeRestore("iptables-restore", "filter");
+
     ip6tables_cmd_path = virFindFileInPath("ip6tables");
     if (ip6tables_cmd_path) {
         virBufferVSprintf(&buf,
@@ -3769,6 +4182,10 @@ ebiptablesDriverInit(bool privileged)
              VIR_FREE(ip6tables_cmd_path);
     }
 
+    if (ip6tables_cmd_path)
+        ip6tables_restore_cmd_path =
+            ebiptablesProbeRestore("ip6tables-restore", "filter");
+
     /* ip(6)tables support needs gawk & grep, ebtables doesn't */
     if ((iptables_cmd_path != NULL || ip6tables_cmd_path != NULL) &&
         (!grep_cmd_path || !gawk_cmd_path)) {
@@ -3777,6 +4194,8 @@ ebiptablesDriverInit(bool privileged)
                                  "firewalls could not be located"));
         VIR_FREE(iptables_cmd_path);
         VIR_FREE(ip6tables_cmd_path);
+        VIR_FREE(iptables_restore_cmd_path);
+        VIR_FREE(ip6tables_restore_cmd_path);
     }
 
 
@@ -3802,5 +4221,8 @@ ebiptablesDriverShutdown(void)
     VIR_FREE(ebtables_cmd_path);
     VIR_FREE(iptables_cmd_path);
     VIR_FREE(ip6tables_cmd_path);
+    VIR_FREE(ebtables_restore_cmd_path);
+    VIR_FREE(iptables_restore_cmd_path);
+    VIR_FREE(ip6tables_restore_cmd_path);
     ebiptables_driver.flags = 0;
 }
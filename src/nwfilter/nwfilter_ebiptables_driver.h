@@ -35,6 +35,7 @@ typedef struct _ebiptablesRuleInst ebiptablesRuleInst;
 typedef ebiptablesRuleInst *ebiptablesRuleInstPtr;
 struct _ebiptablesRuleInst {
     char *commandTemplate;
+    char *restoreRule;   /* input for *-restore, NULL if shell only */
     enum virNWFilterChainSuffixType neededProtocolChain;
     char chainprefix;    /* I for incoming, O for outgoing */
     unsigned int priority;
@@ -47,4 +48,10 @@ extern virNWFilterTechDriver ebiptables_driver;
 
 # define IPTABLES_MAX_COMMENT_LENGTH  256
 
+char *ebiptablesRestoreRule(const char *templ,
+                            const char *cmd,
+                            const char *table,
+                            const char *chain,
+                            const char *comment);
+
 #endif
@@ -570,7 +570,7 @@ static int openvzDomainShutdown(virDomainPtr dom) {
     if (virRun(prog, NULL) < 0)
         goto cleanup;
 
-    vm->def->id = -1;
+    virDomainObjListClearID(&driver->domains, vm);
     vm->state = VIR_DOMAIN_SHUTOFF;
     dom->id = -1;
     ret = 0;
@@ -986,7 +986,8 @@ openvzDomainCreateXML(virConnectPtr conn, const char *xml,
     }
 
     vm->pid = strtoI(vm->def->name);
-    vm->def->id = vm->pid;
+    if (virDomainObjListSetID(&driver->domains, vm, vm->pid) < 0)
+        goto cleanup;
     vm->state = VIR_DOMAIN_RUNNING;
 
     if (vm->def->maxvcpus > 0) {
@@ -1041,7 +1042,8 @@ openvzDomainCreateWithFlags(virDomainPtr dom, unsigned int flags)
     }
 
     vm->pid = strtoI(vm->def->name);
-    vm->def->id = vm->pid;
+    if (virDomainObjListSetID(&driver->domains, vm, vm->pid) < 0)
+        goto cleanup;
     dom->id = vm->pid;
     vm->state = VIR_DOMAIN_RUNNING;
     ret = 0;
@@ -1667,6 +1669,7 @@ static virDriver openvzDriver = {
     NULL, /* domainSnapshotDelete */
     NULL, /* qemuDomainMonitorCommand */
     NULL, /* domainOpenConsole */
+    NULL, /* connectGetAllDomainStats */
 };
 
 int openvzRegister(void) {
@@ -4072,6 +4072,7 @@ static virDriver phypDriver = {
     NULL,                       /* domainSnapshotDelete */
     NULL,                       /* qemuMonitorCommand */
     NULL, /* domainOpenConsole */
+    NULL, /* connectGetAllDomainStats */
 };
 
 static virStorageDriver phypStorageDriver = {
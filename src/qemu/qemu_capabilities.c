@@ -34,6 +34,9 @@
 #include "domain_conf.h"
 #include "qemu_conf.h"
 #include "command.h"
+#include "hash.h"
+#include "threads.h"
+#include "xml.h"
 
 #include <sys/stat.h>
 #include <unistd.h>
@@ -41,6 +44,8 @@
 #include <sys/utsname.h>
 #include <stdarg.h>
 
+#include "stat-time.h"
+
 #define VIR_FROM_THIS VIR_FROM_QEMU
 
 struct qemu_feature_flags {
@@ -1128,9 +1133,12 @@ qemuCapsParseDeviceStr(const char *str, virBitmapPtr flags)
     return 0;
 }
 
-int qemuCapsExtractVersionInfo(const char *qemu, const char *arch,
-                               unsigned int *retversion,
-                               virBitmapPtr *retflags)
+/* Probes the version and flags of @qemu by running it.  The flags
+ * which depend on the guest arch are left for the caller to set. */
+static int
+qemuCapsProbeVersionInfo(const char *qemu,
+                         unsigned int *retversion,
+                         virBitmapPtr *retflags)
 {
     int ret = -1;
     unsigned int version, is_kvm, kvm_version;
@@ -1138,20 +1146,6 @@ int qemuCapsExtractVersionInfo(const char *qemu, const char *arch,
     char *help = NULL;
     virCommandPtr cmd;
 
-    if (retflags)
-        *retflags = NULL;
-    if (retversion)
-        *retversion = 0;
-
-    /* Make sure the binary we are about to try exec'ing exists.
-     * Technically we could catch the exec() failure, but that's
-     * in a sub-process so it's hard to feed back a useful error.
-     */
-    if (!virFileIsExecutable(qemu)) {
-        virReportSystemError(errno, _("Cannot find QEMU binary %s"), qemu);
-        return -1;
-    }
-
     cmd = virCommandNewArgList(qemu, "-help", NULL);
     virCommandAddEnvPassCommon(cmd);
     virCommandSetOutputBuffer(cmd, &help);
@@ -1165,12 +1159,6 @@ int qemuCapsExtractVersionInfo(const char *qemu, const char *arch,
                              &version, &is_kvm, &kvm_version) == -1)
         goto cleanup;
 
-    /* Currently only x86_64 and i686 support PCI-multibus. */
-    if (STREQLEN(arch, "x86_64", 6) ||
-        STREQLEN(arch, "i686", 4)) {
-        qemuCapsSet(flags, QEMU_CAPS_PCI_MULTIBUS);
-    }
-
     /* qemuCapsExtractDeviceStr will only set additional flags if qemu
      * understands the 0.13.0+ notion of "-device driver,".  */
     if (qemuCapsGet(flags, QEMU_CAPS_DEVICE) &&
@@ -1178,12 +1166,9 @@ int qemuCapsExtractVersionInfo(const char *qemu, const char *arch,
         qemuCapsExtractDeviceStr(qemu, flags) < 0)
         goto cleanup;
 
-    if (retversion)
-        *retversion = version;
-    if (retflags) {
-        *retflags = flags;
-        flags = NULL;
-    }
+    *retversion = version;
+    *retflags = flags;
+    flags = NULL;
 
     ret = 0;
 
@@ -1195,6 +1180,470 @@ cleanup:
     return ret;
 }
 
+
+/*
+ * Probing a binary costs a fork and exec of -help, and often of
+ * -device ? as well, so the results are remembered for each binary,
+ * keyed by its path with symlinks resolved, until the file there
+ * changes.  Both times are compared to the nanosecond, and the ctime
+ * also catches a binary replaced with its old mtime preserved.  The
+ * cache is saved in the driver state dir, so restarting libvirtd does
+ * not probe again.
+ */
+typedef struct _qemuCapsCacheEntry qemuCapsCacheEntry;
+typedef qemuCapsCacheEntry *qemuCapsCacheEntryPtr;
+struct _qemuCapsCacheEntry {
+    unsigned long long dev;
+    unsigned long long ino;
+    unsigned long long size;
+    long long mtime;    /* nanoseconds */
+    long long ctime;    /* nanoseconds */
+
+    unsigned int version;
+    virBitmapPtr flags;
+};
+
+/* qemuCapsCacheLock only guards the table itself, and is never held
+ * while running a binary or writing the file, so a slow probe does
+ * not hold up lookups of binaries already known.  Saving is
+ * serialized by qemuCapsCacheSaveLock instead, and skipped if a more
+ * recent version of the table has already been written. */
+static virMutex qemuCapsCacheLock;
+static virHashTablePtr qemuCapsCache;   /* binary path -> entry */
+static unsigned long long qemuCapsCacheGen; /* bumped on every change */
+static char *qemuCapsCacheFile;
+
+static virMutex qemuCapsCacheSaveLock;
+static unsigned long long qemuCapsCacheSavedGen;
+
+static void
+qemuCapsCacheEntryFree(void *payload, const void *name ATTRIBUTE_UNUSED)
+{
+    qemuCapsCacheEntryPtr entry = payload;
+
+    if (!entry)
+        return;
+
+    qemuCapsFree(entry->flags);
+    VIR_FREE(entry);
+}
+
+static long long
+qemuCapsCacheTime(struct timespec ts)
+{
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static bool
+qemuCapsCacheEntryMatches(qemuCapsCacheEntryPtr entry,
+                          const struct stat *sb)
+{
+    return entry->dev == sb->st_dev &&
+        entry->ino == sb->st_ino &&
+        entry->size == sb->st_size &&
+        entry->mtime == qemuCapsCacheTime(get_stat_mtime(sb)) &&
+        entry->ctime == qemuCapsCacheTime(get_stat_ctime(sb));
+}
+
+static virBitmapPtr
+qemuCapsCopy(virBitmapPtr flags)
+{
+    virBitmapPtr copy;
+    int i;
+
+    if (!(copy = qemuCapsNew()))
+        return NULL;
+
+    for (i = 0 ; i < QEMU_CAPS_LAST ; i++) {
+        if (qemuCapsGet(flags, i))
+            qemuCapsSet(copy, i);
+    }
+
+    return copy;
+}
+
+static int
+qemuCapsCacheLoadEntry(xmlNodePtr node)
+{
+    qemuCapsCacheEntryPtr entry = NULL;
+    char *path = NULL;
+    char *dev = NULL, *ino = NULL, *size = NULL;
+    char *mtime = NULL, *ctime = NULL;
+    char *version = NULL;
+    xmlNodePtr cur;
+    int ret = -1;
+
+    path = virXMLPropString(node, "path");
+    dev = virXMLPropString(node, "dev");
+    ino = virXMLPropString(node, "inode");
+    size = virXMLPropString(node, "size");
+    mtime = virXMLPropString(node, "mtime");
+    ctime = virXMLPropString(node, "ctime");
+    version = virXMLPropString(node, "version");
+
+    if (VIR_ALLOC(entry) < 0 ||
+        !(entry->flags = qemuCapsNew()))
+        goto cleanup;
+
+    if (!path || !dev || !ino || !size || !mtime || !ctime || !version ||
+        virStrToLong_ull(dev, NULL, 10, &entry->dev) < 0 ||
+        virStrToLong_ull(ino, NULL, 10, &entry->ino) < 0 ||
+        virStrToLong_ull(size, NULL, 10, &entry->size) < 0 ||
+        virStrToLong_ll(mtime, NULL, 10, &entry->mtime) < 0 ||
+        virStrToLong_ll(ctime, NULL, 10, &entry->ctime) < 0 ||
+        virStrToLong_ui(version, NULL, 10, &entry->version) < 0)
+        goto cleanup;
+
+    for (cur = node->children; cur != NULL; cur = cur->next) {
+        char *bit;
+        unsigned int flag;
+
+        if (cur->type != XML_ELEMENT_NODE ||
+            !xmlStrEqual(cur->name, BAD_CAST "flag"))
+            continue;
+
+        bit = virXMLPropString(cur, "bit");
+        if (!bit ||
+            virStrToLong_ui(bit, NULL, 10, &flag) < 0 ||
+            flag >= QEMU_CAPS_LAST) {
+            VIR_FREE(bit);
+            goto cleanup;
+        }
+        VIR_FREE(bit);
+
+        qemuCapsSet(entry->flags, flag);
+    }
+
+    if (virHashUpdateEntry(qemuCapsCache, path, entry) < 0)
+        goto cleanup;
+    entry = NULL;
+
+    ret = 0;
+
+cleanup:
+    qemuCapsCacheEntryFree(entry, NULL);
+    VIR_FREE(path);
+    VIR_FREE(dev);
+    VIR_FREE(ino);
+    VIR_FREE(size);
+    VIR_FREE(mtime);
+    VIR_FREE(ctime);
+    VIR_FREE(version);
+    return ret;
+}
+
+/* Entries saved by a different libvirt are dropped, since the
+ * flags it knew about, or how it parsed them, may have changed */
+static void
+qemuCapsCacheLoad(void)
+{
+    xmlDocPtr xml = NULL;
+    xmlXPathContextPtr ctxt = NULL;
+    xmlNodePtr *nodes = NULL;
+    unsigned long libvirtVersion;
+    unsigned int ncaps;
+    int n, i;
+
+    if (access(qemuCapsCacheFile, F_OK) < 0)
+        return;
+
+    if (!(xml = virXMLParseFile(qemuCapsCacheFile)) ||
+        !(ctxt = xmlXPathNewContext(xml)))
+        goto error;
+
+    ctxt->node = xmlDocGetRootElement(xml);
+    if (!xmlStrEqual(ctxt->node->name, BAD_CAST "qemuCapsCache"))
+        goto error;
+
+    if (virXPathULong("string(./@libvirt)", ctxt, &libvirtVersion) < 0 ||
+        virXPathUInt("string(./@flags)", ctxt, &ncaps) < 0 ||
+        libvirtVersion != LIBVIR_VERSION_NUMBER ||
+        ncaps != QEMU_CAPS_LAST) {
+        VIR_DEBUG("Ignoring QEMU capabilities cache %s from another build",
+                  qemuCapsCacheFile);
+        goto cleanup;
+    }
+
+    if ((n = virXPathNodeSet("./emulator", ctxt, &nodes)) < 0)
+        goto error;
+
+    for (i = 0 ; i < n ; i++) {
+        if (qemuCapsCacheLoadEntry(nodes[i]) < 0)
+            goto error;
+    }
+
+    VIR_DEBUG("Loaded capabilities of %d QEMU binaries from %s",
+              n, qemuCapsCacheFile);
+
+cleanup:
+    VIR_FREE(nodes);
+    xmlXPathFreeContext(ctxt);
+    xmlFreeDoc(xml);
+    return;
+
+error:
+    /* Not fatal, everything will just be probed again */
+    VIR_WARN("Discarding unreadable QEMU capabilities cache %s",
+             qemuCapsCacheFile);
+    virResetLastError();
+    virHashFree(qemuCapsCache);
+    qemuCapsCache = virHashCreate(10, qemuCapsCacheEntryFree);
+    goto cleanup;
+}
+
+static void
+qemuCapsCacheFormatEntry(void *payload, const void *name, void *data)
+{
+    qemuCapsCacheEntryPtr entry = payload;
+    virBufferPtr buf = data;
+    int i;
+
+    virBufferEscapeString(buf, "  <emulator path='%s'", name);
+    virBufferVSprintf(buf, " dev='%llu' inode='%llu' size='%llu'"
+                      " mtime='%lld' ctime='%lld' version='%u'>\n",
+                      entry->dev, entry->ino, entry->size,
+                      entry->mtime, entry->ctime, entry->version);
+    for (i = 0 ; i < QEMU_CAPS_LAST ; i++) {
+        if (qemuCapsGet(entry->flags, i))
+            virBufferVSprintf(buf, "    <flag bit='%d'/>\n", i);
+    }
+    virBufferAddLit(buf, "  </emulator>\n");
+}
+
+/* Formats the whole cache, which only happens when a binary
+ * was probed, so rarely.  Caller must hold qemuCapsCacheLock */
+static char *
+qemuCapsCacheFormat(void)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+
+    virBufferVSprintf(&buf, "<qemuCapsCache libvirt='%lu' flags='%d'>\n",
+                      (unsigned long)LIBVIR_VERSION_NUMBER, QEMU_CAPS_LAST);
+    virHashForEach(qemuCapsCache, qemuCapsCacheFormatEntry, &buf);
+    virBufferAddLit(&buf, "</qemuCapsCache>\n");
+
+    if (virBufferError(&buf)) {
+        virBufferFreeAndReset(&buf);
+        virReportOOMError();
+        return NULL;
+    }
+
+    return virBufferContentAndReset(&buf);
+}
+
+/* Writes @xml, formatted from version @gen of the cache, unless a
+ * later version has been written meanwhile */
+static void
+qemuCapsCacheSave(const char *xml, unsigned long long gen)
+{
+    char *tmp = NULL;
+
+    virMutexLock(&qemuCapsCacheSaveLock);
+
+    if (gen <= qemuCapsCacheSavedGen)
+        goto cleanup;
+
+    /* Written aside and renamed, so a crash can't leave half a file */
+    if (virAsprintf(&tmp, "%s.new", qemuCapsCacheFile) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    if (virFileWriteStr(tmp, xml, S_IRUSR | S_IWUSR) < 0 ||
+        rename(tmp, qemuCapsCacheFile) < 0) {
+        char ebuf[1024];
+        VIR_WARN("Failed to save QEMU capabilities cache %s: %s",
+                 qemuCapsCacheFile, virStrerror(errno, ebuf, sizeof(ebuf)));
+        unlink(tmp);
+        goto cleanup;
+    }
+    qemuCapsCacheSavedGen = gen;
+
+cleanup:
+    virMutexUnlock(&qemuCapsCacheSaveLock);
+    VIR_FREE(tmp);
+}
+
+/**
+ * qemuCapsCacheInit:
+ * @stateDir: directory to keep the cache in
+ *
+ * Sets up the cache of binary probes, loading the results saved
+ * by an earlier run.  Until this is called, every lookup probes.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int
+qemuCapsCacheInit(const char *stateDir)
+{
+    if (virMutexInit(&qemuCapsCacheLock) < 0) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("cannot initialize mutex"));
+        return -1;
+    }
+    if (virMutexInit(&qemuCapsCacheSaveLock) < 0) {
+        virMutexDestroy(&qemuCapsCacheLock);
+        qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("cannot initialize mutex"));
+        return -1;
+    }
+
+    if (virAsprintf(&qemuCapsCacheFile, "%s/capabilities.cache",
+                    stateDir) < 0 ||
+        !(qemuCapsCache = virHashCreate(10, qemuCapsCacheEntryFree))) {
+        VIR_FREE(qemuCapsCacheFile);
+        virMutexDestroy(&qemuCapsCacheSaveLock);
+        virMutexDestroy(&qemuCapsCacheLock);
+        virReportOOMError();
+        return -1;
+    }
+    qemuCapsCacheGen = qemuCapsCacheSavedGen = 0;
+
+    qemuCapsCacheLoad();
+    return 0;
+}
+
+void
+qemuCapsCacheShutdown(void)
+{
+    if (!qemuCapsCacheFile)
+        return;
+
+    virHashFree(qemuCapsCache);
+    qemuCapsCache = NULL;
+    VIR_FREE(qemuCapsCacheFile);
+    virMutexDestroy(&qemuCapsCacheSaveLock);
+    virMutexDestroy(&qemuCapsCacheLock);
+}
+
+/* Looks up @qemu in the cache, probing it if it is missing or has
+ * changed since.  @flags is a copy owned by the caller. */
+static int
+qemuCapsCacheLookup(const char *qemu,
+                    const struct stat *sb,
+                    unsigned int *version,
+                    virBitmapPtr *flags)
+{
+    qemuCapsCacheEntryPtr entry;
+    qemuCapsCacheEntryPtr probed = NULL;
+    char *binary = NULL;
+    char *xml = NULL;
+    unsigned long long gen = 0;
+    int ret = -1;
+
+    /* Names linking to the same binary share its entry, and
+     * retargeting a link looks up the new binary's entry */
+    if (virFileResolveLink(qemu, &binary) < 0) {
+        virReportSystemError(errno, _("Cannot resolve QEMU binary %s"),
+                             qemu);
+        return -1;
+    }
+
+    virMutexLock(&qemuCapsCacheLock);
+    entry = virHashLookup(qemuCapsCache, binary);
+    if (entry && qemuCapsCacheEntryMatches(entry, sb))
+        goto found;
+    virMutexUnlock(&qemuCapsCacheLock);
+
+    VIR_DEBUG("Probing capabilities of %s", binary);
+
+    if (VIR_ALLOC(probed) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+    probed->dev = sb->st_dev;
+    probed->ino = sb->st_ino;
+    probed->size = sb->st_size;
+    probed->mtime = qemuCapsCacheTime(get_stat_mtime(sb));
+    probed->ctime = qemuCapsCacheTime(get_stat_ctime(sb));
+
+    if (qemuCapsProbeVersionInfo(qemu, &probed->version,
+                                 &probed->flags) < 0)
+        goto cleanup;
+
+    /* Someone else may have probed the same binary meanwhile */
+    virMutexLock(&qemuCapsCacheLock);
+    entry = virHashLookup(qemuCapsCache, binary);
+    if (entry && qemuCapsCacheEntryMatches(entry, sb))
+        goto found;
+
+    if (entry)
+        virHashRemoveEntry(qemuCapsCache, binary);
+    if (virHashAddEntry(qemuCapsCache, binary, probed) < 0) {
+        virMutexUnlock(&qemuCapsCacheLock);
+        virReportOOMError();
+        goto cleanup;
+    }
+    entry = probed;
+    probed = NULL;
+
+    gen = ++qemuCapsCacheGen;
+    xml = qemuCapsCacheFormat();
+
+found:
+    if ((*flags = qemuCapsCopy(entry->flags))) {
+        *version = entry->version;
+        ret = 0;
+    }
+    virMutexUnlock(&qemuCapsCacheLock);
+
+    if (xml)
+        qemuCapsCacheSave(xml, gen);
+
+cleanup:
+    qemuCapsCacheEntryFree(probed, NULL);
+    VIR_FREE(xml);
+    VIR_FREE(binary);
+    return ret;
+}
+
+
+int qemuCapsExtractVersionInfo(const char *qemu, const char *arch,
+                               unsigned int *retversion,
+                               virBitmapPtr *retflags)
+{
+    unsigned int version;
+    virBitmapPtr flags = NULL;
+    struct stat sb;
+
+    if (retflags)
+        *retflags = NULL;
+    if (retversion)
+        *retversion = 0;
+
+    /* Make sure the binary we are about to try exec'ing exists.
+     * Technically we could catch the exec() failure, but that's
+     * in a sub-process so it's hard to feed back a useful error.
+     */
+    if (!virFileIsExecutable(qemu) || stat(qemu, &sb) < 0) {
+        virReportSystemError(errno, _("Cannot find QEMU binary %s"), qemu);
+        return -1;
+    }
+
+    if (qemuCapsCache) {
+        if (qemuCapsCacheLookup(qemu, &sb, &version, &flags) < 0)
+            return -1;
+    } else {
+        if (qemuCapsProbeVersionInfo(qemu, &version, &flags) < 0)
+            return -1;
+    }
+
+    /* Currently only x86_64 and i686 support PCI-multibus. */
+    if (STREQLEN(arch, "x86_64", 6) ||
+        STREQLEN(arch, "i686", 4)) {
+        qemuCapsSet(flags, QEMU_CAPS_PCI_MULTIBUS);
+    }
+
+    if (retversion)
+        *retversion = version;
+    if (retflags)
+        *retflags = flags;
+    else
+        qemuCapsFree(flags);
+
+    return 0;
+}
+
 static void
 uname_normalize (struct utsname *ut)
 {
@@ -126,6 +126,9 @@ int qemuCapsProbeCPUModels(const char *qemu,
                            unsigned int *count,
                            const char ***cpus);
 
+int qemuCapsCacheInit(const char *stateDir);
+void qemuCapsCacheShutdown(void);
+
 int qemuCapsExtractVersion(virCapsPtr caps,
                            unsigned int *version);
 int qemuCapsExtractVersionInfo(const char *qemu, const char *arch,
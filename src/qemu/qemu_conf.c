@@ -81,6 +81,7 @@ int qemudLoadDriverConfig(struct qemud_driver *driver,
     /* Setup critical defaults */
     driver->dynamicOwnership = 1;
     driver->clearEmulatorCapabilities = 1;
+    driver->maxAutostartJobs = 4;
 
     if (!(driver->vncListen = strdup("127.0.0.1"))) {
         virReportOOMError();
@@ -428,6 +429,10 @@ int qemudLoadDriverConfig(struct qemud_driver *driver,
     CHECK_TYPE("max_processes", VIR_CONF_LONG);
     if (p) driver->maxProcesses = p->l;
 
+    p = virConfGetValue(conf, "max_autostart_jobs");
+    CHECK_TYPE("max_autostart_jobs", VIR_CONF_LONG);
+    if (p) driver->maxAutostartJobs = p->l > 0 ? p->l : 1;
+
     virConfFree (conf);
     return 0;
 }
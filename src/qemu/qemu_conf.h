@@ -106,14 +106,12 @@ struct qemud_driver {
     unsigned int setProcessName : 1;
 
     int maxProcesses;
+    int maxAutostartJobs;
 
     virCapsPtr caps;
 
-    /* An array of callbacks */
-    virDomainEventCallbackListPtr domainEventCallbacks;
-    virDomainEventQueuePtr domainEventQueue;
-    int domainEventTimer;
-    int domainEventDispatching;
+    /* Runs domain event callbacks, without the driver lock */
+    virDomainEventDispatcherPtr domainEventDispatcher;
 
     char *securityDriverName;
     virSecurityManagerPtr securityManager;
@@ -128,6 +126,9 @@ struct qemud_driver {
     virBitmapPtr reservedVNCPorts;
 
     virSysinfoDefPtr hostsysinfo;
+
+    /* Logs the domain XML cache counters now and then */
+    int xmlCacheStatsTimer;
 };
 
 typedef struct _qemuDomainCmdlineDef qemuDomainCmdlineDef;
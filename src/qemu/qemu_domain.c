@@ -32,6 +32,7 @@
 #include "event.h"
 #include "cpu/cpu.h"
 #include "ignore-value.h"
+#include "threadpool.h"
 
 #include <sys/time.h>
 
@@ -44,58 +45,12 @@
 #define timeval_to_ms(tv)       (((tv).tv_sec * 1000ull) + ((tv).tv_usec / 1000))
 
 
-static void qemuDomainEventDispatchFunc(virConnectPtr conn,
-                                        virDomainEventPtr event,
-                                        virConnectDomainEventGenericCallback cb,
-                                        void *cbopaque,
-                                        void *opaque)
-{
-    struct qemud_driver *driver = opaque;
-
-    /* Drop the lock whle dispatching, for sake of re-entrancy */
-    qemuDriverUnlock(driver);
-    virDomainEventDispatchDefaultFunc(conn, event, cb, cbopaque, NULL);
-    qemuDriverLock(driver);
-}
-
-void qemuDomainEventFlush(int timer ATTRIBUTE_UNUSED, void *opaque)
-{
-    struct qemud_driver *driver = opaque;
-    virDomainEventQueue tempQueue;
-
-    qemuDriverLock(driver);
-
-    driver->domainEventDispatching = 1;
-
-    /* Copy the queue, so we're reentrant safe */
-    tempQueue.count = driver->domainEventQueue->count;
-    tempQueue.events = driver->domainEventQueue->events;
-    driver->domainEventQueue->count = 0;
-    driver->domainEventQueue->events = NULL;
-
-    virEventUpdateTimeout(driver->domainEventTimer, -1);
-    virDomainEventQueueDispatch(&tempQueue,
-                                driver->domainEventCallbacks,
-                                qemuDomainEventDispatchFunc,
-                                driver);
-
-    /* Purge any deleted callbacks */
-    virDomainEventCallbackListPurgeMarked(driver->domainEventCallbacks);
-
-    driver->domainEventDispatching = 0;
-    qemuDriverUnlock(driver);
-}
-
-
-/* driver must be locked before calling */
+/* The event dispatcher has a lock of its own, so the driver need
+ * not be locked */
 void qemuDomainEventQueue(struct qemud_driver *driver,
                           virDomainEventPtr event)
 {
-    if (virDomainEventQueuePush(driver->domainEventQueue,
-                                event) < 0)
-        virDomainEventFree(event);
-    if (driver->domainEventQueue->count == 1)
-        virEventUpdateTimeout(driver->domainEventTimer, 0);
+    virDomainEventDispatcherQueue(driver->domainEventDispatcher, event);
 }
 
 
@@ -106,6 +61,11 @@ static void *qemuDomainObjPrivateAlloc(void)
     if (VIR_ALLOC(priv) < 0)
         return NULL;
 
+    if (virCondInit(&priv->jobProgress.cond) < 0) {
+        VIR_FREE(priv);
+        return NULL;
+    }
+
     return priv;
 }
 
@@ -116,6 +76,7 @@ static void qemuDomainObjPrivateFree(void *data)
     qemuDomainPCIAddressSetFree(priv->pciaddrs);
     virDomainChrSourceDefFree(priv->monConfig);
     VIR_FREE(priv->vcpupids);
+    ignore_value(virCondDestroy(&priv->jobProgress.cond));
 
     /* This should never be non-NULL if we get here, but just in case... */
     if (priv->mon) {
@@ -431,20 +392,42 @@ void qemuDomainSetNamespaceHooks(virCapsPtr caps)
     caps->ns.href = qemuDomainDefNamespaceHref;
 }
 
+/* Give up waiting for mutex after 30 seconds */
+#define QEMU_JOB_WAIT_TIME (1000ull * 30)
+
 /*
- * obj must be locked before calling, qemud_driver must NOT be locked
- *
- * This must be called by anything that will change the VM state
- * in any way, or anything that will use the QEMU monitor.
- *
- * Upon successful return, the object will have its ref count increased,
- * successful calls must be followed by EndJob eventually
+ * Whether a query job may run while @job is active. Migration,
+ * save and dump only touch the monitor to start the transfer and
+ * poll its progress, and the monitor lock keeps their commands
+ * apart from those issued by the query.
  */
+bool qemuDomainJobAllowsQuery(enum qemuDomainJob job)
+{
+    switch (job) {
+    case QEMU_JOB_MIGRATION_OUT:
+    case QEMU_JOB_SAVE:
+    case QEMU_JOB_DUMP:
+        return true;
 
-/* Give up waiting for mutex after 30 seconds */
-#define QEMU_JOB_WAIT_TIME (1000ull * 30)
+    default:
+        return false;
+    }
+}
 
-int qemuDomainObjBeginJob(virDomainObjPtr obj)
+static bool
+qemuDomainObjJobBusy(qemuDomainObjPrivatePtr priv, bool query)
+{
+    if (priv->jobQuery)
+        return true;
+    if (query)
+        return priv->jobActive && !qemuDomainJobAllowsQuery(priv->jobActive);
+    return priv->jobActive != QEMU_JOB_NONE;
+}
+
+static int
+qemuDomainObjBeginJobInternal(struct qemud_driver *driver,
+                              virDomainObjPtr obj,
+                              bool query)
 {
     qemuDomainObjPrivatePtr priv = obj->privateData;
     struct timeval now;
@@ -458,8 +441,10 @@ int qemuDomainObjBeginJob(virDomainObjPtr obj)
     then = timeval_to_ms(now) + QEMU_JOB_WAIT_TIME;
 
     virDomainObjRef(obj);
+    if (driver)
+        qemuDriverUnlock(driver);
 
-    while (priv->jobActive) {
+    while (qemuDomainObjJobBusy(priv, query)) {
         if (virCondWaitUntil(&priv->jobCond, &obj->lock, then) < 0) {
             /* Safe to ignore value since ref count was incremented above */
             ignore_value(virDomainObjUnref(obj));
@@ -469,18 +454,49 @@ int qemuDomainObjBeginJob(virDomainObjPtr obj)
             else
                 virReportSystemError(errno,
                                      "%s", _("cannot acquire job mutex"));
+            if (driver)
+                qemuDriverLock(driver);
             return -1;
         }
     }
-    priv->jobActive = QEMU_JOB_UNSPECIFIED;
-    priv->jobSignals = 0;
-    memset(&priv->jobSignalsData, 0, sizeof(priv->jobSignalsData));
-    priv->jobStart = timeval_to_ms(now);
-    memset(&priv->jobInfo, 0, sizeof(priv->jobInfo));
+
+    if (query) {
+        /* Leave the signals & info of any async job alone */
+        priv->jobQuery = true;
+    } else {
+        priv->jobActive = QEMU_JOB_UNSPECIFIED;
+        priv->jobSignals = 0;
+        memset(&priv->jobSignalsData, 0, sizeof(priv->jobSignalsData));
+        priv->jobStart = timeval_to_ms(now);
+        memset(&priv->jobInfo, 0, sizeof(priv->jobInfo));
+        priv->jobProgress.wakeup = false;
+        priv->jobProgress.first = 0;
+        priv->jobProgress.nsamples = 0;
+    }
+
+    if (driver) {
+        virDomainObjUnlock(obj);
+        qemuDriverLock(driver);
+        virDomainObjLock(obj);
+    }
 
     return 0;
 }
 
+/*
+ * obj must be locked before calling, qemud_driver must NOT be locked
+ *
+ * This must be called by anything that will change the VM state
+ * in any way, or anything that will use the QEMU monitor.
+ *
+ * Upon successful return, the object will have its ref count increased,
+ * successful calls must be followed by EndJob eventually
+ */
+int qemuDomainObjBeginJob(virDomainObjPtr obj)
+{
+    return qemuDomainObjBeginJobInternal(NULL, obj, false);
+}
+
 /*
  * obj must be locked before calling, qemud_driver must be locked
  *
@@ -490,45 +506,7 @@ int qemuDomainObjBeginJob(virDomainObjPtr obj)
 int qemuDomainObjBeginJobWithDriver(struct qemud_driver *driver,
                                     virDomainObjPtr obj)
 {
-    qemuDomainObjPrivatePtr priv = obj->privateData;
-    struct timeval now;
-    unsigned long long then;
-
-    if (gettimeofday(&now, NULL) < 0) {
-        virReportSystemError(errno, "%s",
-                             _("cannot get time of day"));
-        return -1;
-    }
-    then = timeval_to_ms(now) + QEMU_JOB_WAIT_TIME;
-
-    virDomainObjRef(obj);
-    qemuDriverUnlock(driver);
-
-    while (priv->jobActive) {
-        if (virCondWaitUntil(&priv->jobCond, &obj->lock, then) < 0) {
-            /* Safe to ignore value since ref count was incremented above */
-            ignore_value(virDomainObjUnref(obj));
-            if (errno == ETIMEDOUT)
-                qemuReportError(VIR_ERR_OPERATION_TIMEOUT,
-                                "%s", _("cannot acquire state change lock"));
-            else
-                virReportSystemError(errno,
-                                     "%s", _("cannot acquire job mutex"));
-            qemuDriverLock(driver);
-            return -1;
-        }
-    }
-    priv->jobActive = QEMU_JOB_UNSPECIFIED;
-    priv->jobSignals = 0;
-    memset(&priv->jobSignalsData, 0, sizeof(priv->jobSignalsData));
-    priv->jobStart = timeval_to_ms(now);
-    memset(&priv->jobInfo, 0, sizeof(priv->jobInfo));
-
-    virDomainObjUnlock(obj);
-    qemuDriverLock(driver);
-    virDomainObjLock(obj);
-
-    return 0;
+    return qemuDomainObjBeginJobInternal(driver, obj, false);
 }
 
 /*
@@ -544,16 +522,144 @@ int qemuDomainObjEndJob(virDomainObjPtr obj)
 {
     qemuDomainObjPrivatePtr priv = obj->privateData;
 
+    /* Any job may have changed the domain definition */
+    virDomainObjInvalidateXML(obj);
+
     priv->jobActive = QEMU_JOB_NONE;
     priv->jobSignals = 0;
     memset(&priv->jobSignalsData, 0, sizeof(priv->jobSignalsData));
     priv->jobStart = 0;
     memset(&priv->jobInfo, 0, sizeof(priv->jobInfo));
-    virCondSignal(&priv->jobCond);
+    /* Waiters for query and regular jobs want different things */
+    virCondBroadcast(&priv->jobCond);
 
     return virDomainObjUnref(obj);
 }
 
+/*
+ * obj must be locked before calling, qemud_driver must NOT be locked
+ *
+ * For APIs which only read state from the QEMU monitor, such as
+ * block or memory statistics. Unlike qemuDomainObjBeginJob this
+ * does not wait for a migration, save or dump to finish, so the
+ * caller must not change the VM state in any way, and must check
+ * the VM is still active after the job has been acquired.
+ *
+ * Nor does it keep qemuProcessStop away, which the job it runs
+ * alongside or the monitor EOF handler may call at any time the
+ * domain lock is dropped. qemuDomainObjEnterMonitor holds a ref on
+ * priv->mon until qemuDomainObjExitMonitor, so closing the monitor
+ * only makes the command fail, and priv->mon is not cleared nor
+ * replaced by a new domain start (which waits for this job) before
+ * then. The domain may be shut off on return from ExitMonitor
+ * though, so the caller must check it is still active again before
+ * entering the monitor once more or trusting vm->def.
+ *
+ * Successful calls must be followed by EndQueryJob eventually
+ */
+int qemuDomainObjBeginQueryJob(virDomainObjPtr obj)
+{
+    return qemuDomainObjBeginJobInternal(NULL, obj, true);
+}
+
+/*
+ * obj must be locked before calling
+ *
+ * Whether qemuDomainObjBeginQueryJob would have to wait, for callers
+ * which would rather make do without the monitor than be delayed
+ */
+bool qemuDomainObjQueryJobBusy(virDomainObjPtr obj)
+{
+    return qemuDomainObjJobBusy(obj->privateData, true);
+}
+
+/*
+ * obj must be locked before calling, qemud_driver does not matter
+ *
+ * Returns remaining refcount on 'obj', maybe 0 to indicated it
+ * was deleted
+ */
+int qemuDomainObjEndQueryJob(virDomainObjPtr obj)
+{
+    qemuDomainObjPrivatePtr priv = obj->privateData;
+
+    priv->jobQuery = false;
+    virCondBroadcast(&priv->jobCond);
+
+    return virDomainObjUnref(obj);
+}
+
+/*
+ * obj must be locked before calling
+ *
+ * Records how far a migration, save or dump has got, @time
+ * being milliseconds since the job started
+ */
+void qemuDomainJobProgressAdd(qemuDomainObjPrivatePtr priv,
+                              unsigned long long time,
+                              unsigned long long processed,
+                              unsigned long long remaining)
+{
+    struct qemuDomainJobProgress *progress = &priv->jobProgress;
+    struct qemuDomainJobProgressSample *sample;
+
+    if (progress->nsamples < QEMU_JOB_PROGRESS_SAMPLES) {
+        sample = &progress->samples[(progress->first + progress->nsamples) %
+                                    QEMU_JOB_PROGRESS_SAMPLES];
+        progress->nsamples++;
+    } else {
+        sample = &progress->samples[progress->first];
+        progress->first = (progress->first + 1) % QEMU_JOB_PROGRESS_SAMPLES;
+    }
+
+    sample->time = time;
+    sample->processed = processed;
+    sample->remaining = remaining;
+}
+
+/*
+ * obj must be locked before calling
+ *
+ * Works out the transfer rate in bytes per second across the
+ * recorded samples.
+ *
+ * Returns 0 on success, -1 if there is too little to go on yet
+ */
+int qemuDomainJobProgressRate(qemuDomainObjPrivatePtr priv,
+                              unsigned long long *rate)
+{
+    struct qemuDomainJobProgress *progress = &priv->jobProgress;
+    struct qemuDomainJobProgressSample *oldest;
+    struct qemuDomainJobProgressSample *newest;
+
+    if (progress->nsamples < 2)
+        return -1;
+
+    oldest = &progress->samples[progress->first];
+    newest = &progress->samples[(progress->first + progress->nsamples - 1) %
+                                QEMU_JOB_PROGRESS_SAMPLES];
+
+    if (newest->time <= oldest->time ||
+        newest->processed < oldest->processed)
+        return -1;
+
+    *rate = (newest->processed - oldest->processed) * 1000ull /
+        (newest->time - oldest->time);
+    return 0;
+}
+
+/*
+ * obj must be locked before calling
+ *
+ * Has a migration, save or dump waiting for QEMU look at its
+ * progress again now, rather than at its next scheduled poll
+ */
+void qemuDomainJobProgressWakeup(qemuDomainObjPrivatePtr priv)
+{
+    priv->jobProgress.wakeup = true;
+    virCondSignal(&priv->jobProgress.cond);
+}
+
 
 /*
  * obj must be locked before calling, qemud_driver must be unlocked
@@ -659,10 +765,163 @@ void qemuDomainObjExitRemoteWithDriver(struct qemud_driver *driver,
 }
 
 
-char *qemuDomainFormatXML(struct qemud_driver *driver,
-                          virDomainObjPtr vm,
-                          int flags)
+struct qemuDomainObjParallelData {
+    struct qemud_driver *driver;
+    virHashIterator func;
+    void *opaque;
+
+    virDomainObjPtr *vms;
+    size_t nvms;
+    size_t maxvms;
+
+    size_t pending;     /* jobs not finished yet, guarded by the driver lock */
+    virCond done;
+};
+
+static void
+qemuDomainObjParallelCollect(void *payload,
+                             const void *name ATTRIBUTE_UNUSED,
+                             void *opaque)
+{
+    virDomainObjPtr vm = payload;
+    struct qemuDomainObjParallelData *data = opaque;
+
+    /* Can't happen while the driver lock stops domains being added */
+    if (data->nvms == data->maxvms)
+        return;
+
+    virDomainObjLock(vm);
+    virDomainObjRef(vm);
+    virDomainObjUnlock(vm);
+    data->vms[data->nvms++] = vm;
+}
+
+/* Called with the driver locked, like a virHashForEach callback */
+static void
+qemuDomainObjParallelRun(struct qemuDomainObjParallelData *data,
+                         virDomainObjPtr vm)
 {
+    virDomainObjLock(vm);
+    if (virDomainObjUnref(vm) > 0) {
+        virDomainObjUnlock(vm);
+        (data->func)(vm, NULL, data->opaque);
+    }
+}
+
+static void
+qemuDomainObjParallelWorker(void *jobdata, void *opaque)
+{
+    virDomainObjPtr vm = jobdata;
+    struct qemuDomainObjParallelData *data = opaque;
+
+    qemuDriverLock(data->driver);
+    qemuDomainObjParallelRun(data, vm);
+    if (--data->pending == 0)
+        virCondSignal(&data->done);
+    qemuDriverUnlock(data->driver);
+}
+
+/*
+ * qemud_driver must be locked before calling, and is still locked
+ * on return.
+ *
+ * Calls @func on every domain, with the same locking as the
+ * virHashForEach callbacks walking driver->domains: the driver is
+ * locked and the domain isn't.  Up to @maxWorkers domains are
+ * handled at once, by threads which each take the driver lock for
+ * themselves, so @func only runs concurrently with others where it
+ * drops the driver lock, as when waiting on a monitor.  Any error
+ * must be dealt with by @func, so one domain failing does not
+ * affect the others.  Returns once @func has been called for all.
+ */
+void qemuDomainObjForEachParallel(struct qemud_driver *driver,
+                                  size_t maxWorkers,
+                                  virHashIterator func,
+                                  void *opaque)
+{
+    struct qemuDomainObjParallelData data;
+    virThreadPoolPtr pool = NULL;
+    size_t i;
+
+    memset(&data, 0, sizeof(data));
+    data.driver = driver;
+    data.func = func;
+    data.opaque = opaque;
+
+    data.maxvms = virDomainObjListNumOfDomains(&driver->domains, 1) +
+                  virDomainObjListNumOfDomains(&driver->domains, 0);
+    if (data.maxvms == 0)
+        return;
+    if (VIR_ALLOC_N(data.vms, data.maxvms) < 0) {
+        virReportOOMError();
+        return;
+    }
+
+    virDomainObjListForEach(&driver->domains,
+                            qemuDomainObjParallelCollect, &data);
+
+    if (maxWorkers > data.nvms)
+        maxWorkers = data.nvms;
+
+    if (maxWorkers > 1) {
+        if (virCondInit(&data.done) < 0) {
+            VIR_WARN0("Cannot initialize condition, running sequentially");
+            maxWorkers = 1;
+        } else if (!(pool = virThreadPoolNew(maxWorkers, maxWorkers,
+                                             qemuDomainObjParallelWorker,
+                                             &data))) {
+            VIR_WARN0("Cannot create worker pool, running sequentially");
+            ignore_value(virCondDestroy(&data.done));
+            maxWorkers = 1;
+        }
+    }
+
+    VIR_DEBUG("Running on %zu domains with %zu workers",
+              data.nvms, maxWorkers > 0 ? maxWorkers : 1);
+
+    for (i = 0 ; i < data.nvms ; i++) {
+        if (pool) {
+            data.pending++;
+            if (virThreadPoolSendJob(pool, data.vms[i]) == 0)
+                continue;
+            data.pending--;
+        }
+        qemuDomainObjParallelRun(&data, data.vms[i]);
+    }
+
+    if (pool) {
+        /* Workers need the driver lock, which this releases */
+        while (data.pending > 0) {
+            if (virCondWait(&data.done, &driver->lock) < 0) {
+                VIR_ERROR0(_("Failed to wait for domain workers"));
+                break;
+            }
+        }
+
+        /* Freeing the pool runs any jobs still queued and waits for
+         * all of them, which need the driver lock too. Only then is
+         * nothing left using 'data' */
+        qemuDriverUnlock(driver);
+        virThreadPoolFree(pool);
+        qemuDriverLock(driver);
+        ignore_value(virCondDestroy(&data.done));
+    }
+
+    VIR_FREE(data.vms);
+}
+
+
+/*
+ * Format the XML of vm, which must be locked. host_cpu is only
+ * needed with VIR_DOMAIN_XML_UPDATE_CPU, and lets callers which do
+ * not hold the driver lock pass in a copy of the host CPU taken
+ * beforehand, since driver->caps may be replaced at any time.
+ */
+char *qemuDomainFormatXMLHostCPU(virCPUDefPtr host_cpu,
+                                 virDomainObjPtr vm,
+                                 int flags)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
     char *ret = NULL;
     virCPUDefPtr cpu = NULL;
     virDomainDefPtr def;
@@ -674,16 +933,26 @@ char *qemuDomainFormatXML(struct qemud_driver *driver,
         def = vm->def;
     def_cpu = def->cpu;
 
+    /* Without a guest CPU model to update, the output is the same
+     * as without the flag, and so may come from the XML cache. A
+     * job in progress may be half way through changing the def, so
+     * leave the cache alone until qemuDomainObjEndJob resets it */
+    if (!def_cpu || !def_cpu->model) {
+        flags &= ~VIR_DOMAIN_XML_UPDATE_CPU;
+        if (priv->jobActive == QEMU_JOB_NONE)
+            return virDomainObjGetXMLDesc(vm, flags);
+    }
+
     /* Update guest CPU requirements according to host CPU */
     if ((flags & VIR_DOMAIN_XML_UPDATE_CPU) && def_cpu && def_cpu->model) {
-        if (!driver->caps || !driver->caps->host.cpu) {
+        if (!host_cpu) {
             qemuReportError(VIR_ERR_OPERATION_FAILED,
                             "%s", _("cannot get host CPU capabilities"));
             goto cleanup;
         }
 
         if (!(cpu = virCPUDefCopy(def_cpu))
-            || cpuUpdate(cpu, driver->caps->host.cpu))
+            || cpuUpdate(cpu, host_cpu))
             goto cleanup;
         def->cpu = cpu;
     }
@@ -695,3 +964,12 @@ cleanup:
     virCPUDefFree(cpu);
     return ret;
 }
+
+/* As above, but the caller must hold the driver lock */
+char *qemuDomainFormatXML(struct qemud_driver *driver,
+                          virDomainObjPtr vm,
+                          int flags)
+{
+    return qemuDomainFormatXMLHostCPU(driver->caps ? driver->caps->host.cpu : NULL,
+                                      vm, flags);
+}
@@ -31,7 +31,10 @@
 
 /* Only 1 job is allowed at any time
  * A job includes *all* monitor commands, even those just querying
- * information, not merely actions */
+ * information, not merely actions. The one exception is a query
+ * job, which may run alongside the long running jobs accepted by
+ * qemuDomainJobAllowsQuery, since they spend most of their time
+ * waiting for QEMU with the domain unlocked. */
 enum qemuDomainJob {
     QEMU_JOB_NONE = 0,  /* Always set to 0 for easy if (jobActive) conditions */
     QEMU_JOB_UNSPECIFIED,
@@ -53,6 +56,25 @@ struct qemuDomainJobSignalsData {
     unsigned long migrateBandwidth; /* Data for QEMU_JOB_SIGNAL_MIGRATE_SPEED */
 };
 
+/* How many progress samples of a migration, save or dump are kept */
+# define QEMU_JOB_PROGRESS_SAMPLES 16
+
+struct qemuDomainJobProgressSample {
+    unsigned long long time;        /* ms since the job started */
+    unsigned long long processed;   /* bytes */
+    unsigned long long remaining;   /* bytes */
+};
+
+struct qemuDomainJobProgress {
+    virCond cond;   /* Use in conjunction with main virDomainObjPtr lock */
+    bool wakeup;    /* Set when the job should check on QEMU right away */
+
+    /* Ring of the most recent samples, oldest at 'first' */
+    size_t first;
+    size_t nsamples;
+    struct qemuDomainJobProgressSample samples[QEMU_JOB_PROGRESS_SAMPLES];
+};
+
 typedef struct _qemuDomainPCIAddressSet qemuDomainPCIAddressSet;
 typedef qemuDomainPCIAddressSet *qemuDomainPCIAddressSetPtr;
 
@@ -61,10 +83,12 @@ typedef qemuDomainObjPrivate *qemuDomainObjPrivatePtr;
 struct _qemuDomainObjPrivate {
     virCond jobCond; /* Use in conjunction with main virDomainObjPtr lock */
     enum qemuDomainJob jobActive;   /* Currently running job */
+    bool jobQuery;                  /* Query job running, maybe alongside jobActive */
     unsigned int jobSignals;        /* Signals for running job */
     struct qemuDomainJobSignalsData jobSignalsData; /* Signal specific data */
     virDomainJobInfo jobInfo;
     unsigned long long jobStart;
+    struct qemuDomainJobProgress jobProgress;
 
     qemuMonitorPtr mon;
     virDomainChrSourceDefPtr monConfig;
@@ -85,9 +109,6 @@ struct qemuDomainWatchdogEvent
     int action;
 };
 
-void qemuDomainEventFlush(int timer ATTRIBUTE_UNUSED, void *opaque);
-
-/* driver must be locked before calling */
 void qemuDomainEventQueue(struct qemud_driver *driver,
                           virDomainEventPtr event);
 
@@ -98,6 +119,10 @@ int qemuDomainObjBeginJob(virDomainObjPtr obj) ATTRIBUTE_RETURN_CHECK;
 int qemuDomainObjBeginJobWithDriver(struct qemud_driver *driver,
                                     virDomainObjPtr obj) ATTRIBUTE_RETURN_CHECK;
 int qemuDomainObjEndJob(virDomainObjPtr obj) ATTRIBUTE_RETURN_CHECK;
+bool qemuDomainJobAllowsQuery(enum qemuDomainJob job);
+int qemuDomainObjBeginQueryJob(virDomainObjPtr obj) ATTRIBUTE_RETURN_CHECK;
+bool qemuDomainObjQueryJobBusy(virDomainObjPtr obj);
+int qemuDomainObjEndQueryJob(virDomainObjPtr obj) ATTRIBUTE_RETURN_CHECK;
 void qemuDomainObjEnterMonitor(virDomainObjPtr obj);
 void qemuDomainObjExitMonitor(virDomainObjPtr obj);
 void qemuDomainObjEnterMonitorWithDriver(struct qemud_driver *driver,
@@ -109,6 +134,22 @@ void qemuDomainObjEnterRemoteWithDriver(struct qemud_driver *driver,
 void qemuDomainObjExitRemoteWithDriver(struct qemud_driver *driver,
                                        virDomainObjPtr obj);
 
+void qemuDomainJobProgressAdd(qemuDomainObjPrivatePtr priv,
+                              unsigned long long time,
+                              unsigned long long processed,
+                              unsigned long long remaining);
+int qemuDomainJobProgressRate(qemuDomainObjPrivatePtr priv,
+                              unsigned long long *rate);
+void qemuDomainJobProgressWakeup(qemuDomainObjPrivatePtr priv);
+
+void qemuDomainObjForEachParallel(struct qemud_driver *driver,
+                                  size_t maxWorkers,
+                                  virHashIterator func,
+                                  void *opaque);
+
+char *qemuDomainFormatXMLHostCPU(virCPUDefPtr host_cpu,
+                                 virDomainObjPtr vm,
+                                 int flags);
 char *qemuDomainFormatXML(struct qemud_driver *driver,
                           virDomainObjPtr vm,
                           int flags);
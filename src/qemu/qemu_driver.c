@@ -84,6 +84,7 @@
 #include "storage_file.h"
 #include "files.h"
 #include "fdstream.h"
+#include "iohelper.h"
 #include "configmake.h"
 #include "threadpool.h"
 
@@ -180,7 +181,8 @@ qemuAutostartDomains(struct qemud_driver *driver)
     struct qemuAutostartData data = { driver, conn };
 
     qemuDriverLock(driver);
-    virHashForEach(driver->domains.objs, qemuAutostartDomain, &data);
+    qemuDomainObjForEachParallel(driver, driver->maxAutostartJobs,
+                                 qemuAutostartDomain, &data);
     qemuDriverUnlock(driver);
 
     if (conn)
@@ -363,6 +365,30 @@ cleanup:
     virDomainObjUnlock(vm);
 }
 
+/* How often to log the domain XML cache counters, in ms */
+#define QEMU_XML_CACHE_STATS_INTERVAL (10 * 60 * 1000)
+
+static void
+qemuDomainXMLCacheStatsTimer(int timer ATTRIBUTE_UNUSED, void *opaque)
+{
+    struct qemud_driver *driver = opaque;
+    static unsigned long long lastHits, lastMisses;
+    unsigned long long hits, misses, invalidations;
+
+    if (virDomainObjListGetXMLCacheStats(&driver->domains, &hits, &misses,
+                                         &invalidations) < 0)
+        return;
+
+    /* Stay quiet while nobody is asking for XML */
+    if (hits == lastHits && misses == lastMisses)
+        return;
+    lastHits = hits;
+    lastMisses = misses;
+
+    VIR_INFO("Domain XML cache: %llu hits, %llu misses, %llu invalidations",
+             hits, misses, invalidations);
+}
+
 /**
  * qemudStartup:
  *
@@ -385,6 +411,7 @@ qemudStartup(int privileged) {
     }
     qemuDriverLock(qemu_driver);
     qemu_driver->privileged = privileged;
+    qemu_driver->xmlCacheStatsTimer = -1;
 
     /* Don't have a dom0 so start from 1 */
     qemu_driver->nextvmid = 1;
@@ -392,14 +419,8 @@ qemudStartup(int privileged) {
     if (virDomainObjListInit(&qemu_driver->domains) < 0)
         goto out_of_memory;
 
-    /* Init callback list */
-    if (VIR_ALLOC(qemu_driver->domainEventCallbacks) < 0)
-        goto out_of_memory;
-    if (!(qemu_driver->domainEventQueue = virDomainEventQueueNew()))
-        goto out_of_memory;
-
-    if ((qemu_driver->domainEventTimer =
-         virEventAddTimeout(-1, qemuDomainEventFlush, qemu_driver, NULL)) < 0)
+    if (!(qemu_driver->domainEventDispatcher =
+          virDomainEventDispatcherNew(NULL, NULL)))
         goto error;
 
     /* Allocate bitmap for vnc port reservation */
@@ -533,6 +554,9 @@ qemudStartup(int privileged) {
     if (qemuSecurityInit(qemu_driver) < 0)
         goto error;
 
+    if (qemuCapsCacheInit(qemu_driver->stateDir) < 0)
+        goto error;
+
     if ((qemu_driver->caps = qemuCreateCapabilities(NULL,
                                                     qemu_driver)) == NULL)
         goto error;
@@ -621,8 +645,8 @@ qemudStartup(int privileged) {
         goto error;
 
 
-    virHashForEach(qemu_driver->domains.objs, qemuDomainSnapshotLoad,
-                   qemu_driver->snapshotDir);
+    virDomainObjListForEach(&qemu_driver->domains, qemuDomainSnapshotLoad,
+                            qemu_driver->snapshotDir);
 
     qemuDriverUnlock(qemu_driver);
 
@@ -632,6 +656,11 @@ qemudStartup(int privileged) {
     if (!qemu_driver->workerPool)
         goto error;
 
+    /* Without an event loop the counters just go unreported */
+    qemu_driver->xmlCacheStatsTimer =
+        virEventAddTimeout(QEMU_XML_CACHE_STATS_INTERVAL,
+                           qemuDomainXMLCacheStatsTimer, qemu_driver, NULL);
+
     if (conn)
         virConnectClose(conn);
 
@@ -722,9 +751,16 @@ qemudShutdown(void) {
     if (!qemu_driver)
         return -1;
 
+    /* Jobs still queued are run, and need the driver lock */
+    virThreadPoolFree(qemu_driver->workerPool);
+
+    if (qemu_driver->xmlCacheStatsTimer != -1)
+        virEventRemoveTimeout(qemu_driver->xmlCacheStatsTimer);
+
     qemuDriverLock(qemu_driver);
     pciDeviceListFree(qemu_driver->activePciHostdevs);
     virCapabilitiesFree(qemu_driver->caps);
+    qemuCapsCacheShutdown();
 
     virDomainObjListDeinit(&qemu_driver->domains);
     virBitmapFree(qemu_driver->reservedVNCPorts);
@@ -762,12 +798,8 @@ qemudShutdown(void) {
         VIR_FREE(qemu_driver->cgroupDeviceACL);
     }
 
-    /* Free domain callback list */
-    virDomainEventCallbackListFree(qemu_driver->domainEventCallbacks);
-    virDomainEventQueueFree(qemu_driver->domainEventQueue);
-
-    if (qemu_driver->domainEventTimer != -1)
-        virEventRemoveTimeout(qemu_driver->domainEventTimer);
+    /* Stop dispatching events and free the callbacks */
+    virDomainEventDispatcherFree(qemu_driver->domainEventDispatcher);
 
     if (qemu_driver->brctl)
         brShutdown(qemu_driver->brctl);
@@ -776,7 +808,6 @@ qemudShutdown(void) {
 
     qemuDriverUnlock(qemu_driver);
     virMutexDestroy(&qemu_driver->lock);
-    virThreadPoolFree(qemu_driver->workerPool);
     VIR_FREE(qemu_driver);
 
     return 0;
@@ -854,9 +885,7 @@ static int qemudClose(virConnectPtr conn) {
     struct qemud_driver *driver = conn->privateData;
 
     /* Get rid of callbacks registered for this conn */
-    qemuDriverLock(driver);
-    virDomainEventCallbackListRemoveConn(conn, driver->domainEventCallbacks);
-    qemuDriverUnlock(driver);
+    virDomainEventDispatcherRemoveConn(driver->domainEventDispatcher, conn);
 
     conn->privateData = NULL;
 
@@ -1045,9 +1074,7 @@ static virDomainPtr qemudDomainLookupByID(virConnectPtr conn,
     virDomainObjPtr vm;
     virDomainPtr dom = NULL;
 
-    qemuDriverLock(driver);
-    vm  = virDomainFindByID(&driver->domains, id);
-    qemuDriverUnlock(driver);
+    vm = virDomainFindByID(&driver->domains, id);
 
     if (!vm) {
         qemuReportError(VIR_ERR_NO_DOMAIN,
@@ -1070,9 +1097,7 @@ static virDomainPtr qemudDomainLookupByUUID(virConnectPtr conn,
     virDomainObjPtr vm;
     virDomainPtr dom = NULL;
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, uuid);
-    qemuDriverUnlock(driver);
 
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
@@ -1097,9 +1122,7 @@ static virDomainPtr qemudDomainLookupByName(virConnectPtr conn,
     virDomainObjPtr vm;
     virDomainPtr dom = NULL;
 
-    qemuDriverLock(driver);
     vm = virDomainFindByName(&driver->domains, name);
-    qemuDriverUnlock(driver);
 
     if (!vm) {
         qemuReportError(VIR_ERR_NO_DOMAIN,
@@ -1123,9 +1146,7 @@ static int qemuDomainIsActive(virDomainPtr dom)
     virDomainObjPtr obj;
     int ret = -1;
 
-    qemuDriverLock(driver);
     obj = virDomainFindByUUID(&driver->domains, dom->uuid);
-    qemuDriverUnlock(driver);
     if (!obj) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
         virUUIDFormat(dom->uuid, uuidstr);
@@ -1147,9 +1168,7 @@ static int qemuDomainIsPersistent(virDomainPtr dom)
     virDomainObjPtr obj;
     int ret = -1;
 
-    qemuDriverLock(driver);
     obj = virDomainFindByUUID(&driver->domains, dom->uuid);
-    qemuDriverUnlock(driver);
     if (!obj) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
         virUUIDFormat(dom->uuid, uuidstr);
@@ -1171,9 +1190,7 @@ static int qemuDomainIsUpdated(virDomainPtr dom)
     virDomainObjPtr obj;
     int ret = -1;
 
-    qemuDriverLock(driver);
     obj = virDomainFindByUUID(&driver->domains, dom->uuid);
-    qemuDriverUnlock(driver);
     if (!obj) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
         virUUIDFormat(dom->uuid, uuidstr);
@@ -1209,9 +1226,7 @@ static int qemudListDomains(virConnectPtr conn, int *ids, int nids) {
     struct qemud_driver *driver = conn->privateData;
     int n;
 
-    qemuDriverLock(driver);
     n = virDomainObjListGetActiveIDs(&driver->domains, ids, nids);
-    qemuDriverUnlock(driver);
 
     return n;
 }
@@ -1220,9 +1235,7 @@ static int qemudNumDomains(virConnectPtr conn) {
     struct qemud_driver *driver = conn->privateData;
     int n;
 
-    qemuDriverLock(driver);
     n = virDomainObjListNumOfDomains(&driver->domains, 1);
-    qemuDriverUnlock(driver);
 
     return n;
 }
@@ -1328,6 +1341,7 @@ static int qemudDomainSuspend(virDomainPtr dom) {
             VIR_DEBUG("Requesting domain pause on %s",
                       vm->def->name);
             priv->jobSignals |= QEMU_JOB_SIGNAL_SUSPEND;
+            qemuDomainJobProgressWakeup(priv);
         }
         ret = 0;
         goto cleanup;
@@ -1428,9 +1442,7 @@ static int qemudDomainShutdown(virDomainPtr dom) {
     int ret = -1;
     qemuDomainObjPrivatePtr priv;
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
-    qemuDriverUnlock(driver);
 
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
@@ -1524,9 +1536,7 @@ static char *qemudDomainGetOSType(virDomainPtr dom) {
     virDomainObjPtr vm;
     char *type = NULL;
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
-    qemuDriverUnlock(driver);
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
         virUUIDFormat(dom->uuid, uuidstr);
@@ -1550,9 +1560,7 @@ static unsigned long qemudDomainGetMaxMemory(virDomainPtr dom) {
     virDomainObjPtr vm;
     unsigned long ret = 0;
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
-    qemuDriverUnlock(driver);
 
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
@@ -1583,9 +1591,7 @@ static int qemudDomainSetMemoryFlags(virDomainPtr dom, unsigned long newmem,
                   VIR_DOMAIN_MEM_CONFIG |
                   VIR_DOMAIN_MEM_MAXIMUM, -1);
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
-    qemuDriverUnlock(driver);
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
         virUUIDFormat(dom->uuid, uuidstr);
@@ -1710,9 +1716,7 @@ static int qemudDomainGetInfo(virDomainPtr dom,
     int err;
     unsigned long balloon;
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
-    qemuDriverUnlock(driver);
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
         virUUIDFormat(dom->uuid, uuidstr);
@@ -1741,8 +1745,8 @@ static int qemudDomainGetInfo(virDomainPtr dom,
         if ((vm->def->memballoon != NULL) &&
             (vm->def->memballoon->model == VIR_DOMAIN_MEMBALLOON_MODEL_NONE)) {
             info->memory = vm->def->mem.max_balloon;
-        } else if (!priv->jobActive) {
-            if (qemuDomainObjBeginJob(vm) < 0)
+        } else if (!qemuDomainObjQueryJobBusy(vm)) {
+            if (qemuDomainObjBeginQueryJob(vm) < 0)
                 goto cleanup;
             if (!virDomainObjIsActive(vm))
                 err = 0;
@@ -1751,7 +1755,7 @@ static int qemudDomainGetInfo(virDomainPtr dom,
                 err = qemuMonitorGetBalloonInfo(priv->mon, &balloon);
                 qemuDomainObjExitMonitor(vm);
             }
-            if (qemuDomainObjEndJob(vm) == 0) {
+            if (qemuDomainObjEndQueryJob(vm) == 0) {
                 vm = NULL;
                 goto cleanup;
             }
@@ -1793,6 +1797,8 @@ enum qemud_save_formats {
      */
     QEMUD_SAVE_FORMAT_XZ = 3,
     QEMUD_SAVE_FORMAT_LZOP = 4,
+    /* Compressed in parallel by libvirt_iohelper, not a program */
+    QEMUD_SAVE_FORMAT_ZLIB = 5,
     /* Note: add new members only at the end.
        These values are used in the on-disk format.
        Do not change or re-use numbers. */
@@ -1806,7 +1812,8 @@ VIR_ENUM_IMPL(qemudSaveCompression, QEMUD_SAVE_FORMAT_LAST,
               "gzip",
               "bzip2",
               "xz",
-              "lzop")
+              "lzop",
+              VIR_IOHELPER_ZLIB)
 
 struct qemud_save_header {
     char magic[sizeof(QEMUD_SAVE_MAGIC)-1];
@@ -2086,6 +2093,13 @@ static bool qemudCompressProgramAvailable(enum qemud_save_formats compress)
 
     if (compress == QEMUD_SAVE_FORMAT_RAW)
         return true;
+    if (compress == QEMUD_SAVE_FORMAT_ZLIB) {
+#ifdef HAVE_ZLIB
+        return virFileIsExecutable(LIBEXECDIR "/libvirt_iohelper");
+#else
+        return false;
+#endif
+    }
     prog = qemudSaveCompressionTypeToString(compress);
     c = virFindFileInPath(prog);
     if (!c)
@@ -2213,7 +2227,6 @@ qemuDomainHasManagedSaveImage(virDomainPtr dom, unsigned int flags)
 
     virCheckFlags(0, -1);
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
@@ -2233,7 +2246,6 @@ cleanup:
     VIR_FREE(name);
     if (vm)
         virDomainObjUnlock(vm);
-    qemuDriverUnlock(driver);
     return ret;
 }
 
@@ -2278,6 +2290,12 @@ static int doCoreDump(struct qemud_driver *driver,
 {
     int fd = -1;
     int ret = -1;
+    virBitmapPtr qemuCaps = NULL;
+
+    if (qemuCapsExtractVersionInfo(vm->def->emulator, vm->def->os.arch,
+                                   NULL,
+                                   &qemuCaps) < 0)
+        goto cleanup;
 
     /* Create an empty file with appropriate ownership.  */
     if ((fd = open(path, O_CREAT|O_TRUNC|O_WRONLY, S_IRUSR|S_IWUSR)) < 0) {
@@ -2286,7 +2304,7 @@ static int doCoreDump(struct qemud_driver *driver,
         goto cleanup;
     }
 
-    if (qemuMigrationToFile(driver, vm, NULL, fd, 0, path,
+    if (qemuMigrationToFile(driver, vm, qemuCaps, fd, 0, path,
                             qemuCompressProgramName(compress), true, false) < 0)
         goto cleanup;
 
@@ -2300,8 +2318,10 @@ static int doCoreDump(struct qemud_driver *driver,
     ret = 0;
 
 cleanup:
+    VIR_FORCE_CLOSE(fd);
     if (ret != 0)
         unlink(path);
+    qemuCapsFree(qemuCaps);
     return ret;
 }
 
@@ -2566,9 +2586,7 @@ qemudDomainSetVcpusFlags(virDomainPtr dom, unsigned int nvcpus,
         return -1;
     }
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
-    qemuDriverUnlock(driver);
 
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
@@ -2678,9 +2696,7 @@ qemudDomainPinVcpu(virDomainPtr dom,
     int ret = -1;
     qemuDomainObjPrivatePtr priv;
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
-    qemuDriverUnlock(driver);
 
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
@@ -2723,6 +2739,7 @@ qemudDomainPinVcpu(virDomainPtr dom,
         goto cleanup;
     }
 
+    virDomainObjInvalidateXML(vm);
     if (virDomainVcpupinAdd(vm->def, cpumap, maplen, vcpu) < 0) {
         qemuReportError(VIR_ERR_INTERNAL_ERROR,
                         "%s", _("failed to update or add vcpupin xml"));
@@ -2750,9 +2767,7 @@ qemudDomainGetVcpus(virDomainPtr dom,
     int ret = -1;
     qemuDomainObjPrivatePtr priv;
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
-    qemuDriverUnlock(driver);
 
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
@@ -2847,9 +2862,7 @@ qemudDomainGetVcpusFlags(virDomainPtr dom, unsigned int flags)
         return -1;
     }
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
-    qemuDriverUnlock(driver);
 
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
@@ -2891,7 +2904,6 @@ static int qemudDomainGetSecurityLabel(virDomainPtr dom, virSecurityLabelPtr sec
     virDomainObjPtr vm;
     int ret = -1;
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
 
     memset(seclabel, 0, sizeof(*seclabel));
@@ -2939,7 +2951,6 @@ static int qemudDomainGetSecurityLabel(virDomainPtr dom, virSecurityLabelPtr sec
 cleanup:
     if (vm)
         virDomainObjUnlock(vm);
-    qemuDriverUnlock(driver);
     return ret;
 }
 
@@ -3084,7 +3095,7 @@ qemuDomainSaveImageStartVM(virConnectPtr conn,
     int childstat;
 
     if (header->version == 2) {
-        const char *intermediate_argv[3] = { NULL, "-dc", NULL };
+        const char *intermediate_argv[4] = { NULL, "-dc", NULL, NULL };
         const char *prog = qemudSaveCompressionTypeToString(header->compressed);
         if (prog == NULL) {
             qemuReportError(VIR_ERR_OPERATION_FAILED,
@@ -3093,6 +3104,12 @@ qemuDomainSaveImageStartVM(virConnectPtr conn,
             goto out;
         }
 
+        if (header->compressed == QEMUD_SAVE_FORMAT_ZLIB) {
+            prog = LIBEXECDIR "/libvirt_iohelper";
+            intermediate_argv[1] = VIR_IOHELPER_ZLIB;
+            intermediate_argv[2] = "-dc";
+        }
+
         if (header->compressed != QEMUD_SAVE_FORMAT_RAW) {
             intermediate_argv[0] = prog;
             intermediatefd = *fd;
@@ -3267,11 +3284,23 @@ static char *qemudDomainDumpXML(virDomainPtr dom,
                                 int flags) {
     struct qemud_driver *driver = dom->conn->privateData;
     virDomainObjPtr vm;
+    virCPUDefPtr hostcpu = NULL;
     char *ret = NULL;
     unsigned long balloon;
     int err;
 
-    qemuDriverLock(driver);
+    /* driver->caps may be replaced under the driver lock, so copy
+     * what we need rather than holding that lock for the whole call */
+    if (flags & VIR_DOMAIN_XML_UPDATE_CPU) {
+        qemuDriverLock(driver);
+        if (driver->caps && driver->caps->host.cpu &&
+            !(hostcpu = virCPUDefCopy(driver->caps->host.cpu))) {
+            qemuDriverUnlock(driver);
+            return NULL;
+        }
+        qemuDriverUnlock(driver);
+    }
+
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
 
     if (!vm) {
@@ -3289,31 +3318,41 @@ static char *qemudDomainDumpXML(virDomainPtr dom,
         qemuDomainObjPrivatePtr priv = vm->privateData;
         /* Don't delay if someone's using the monitor, just use
          * existing most recent data instead */
-        if (!priv->jobActive) {
-            if (qemuDomainObjBeginJobWithDriver(driver, vm) < 0)
+        if (!priv->jobActive && !priv->jobQuery) {
+            if (qemuDomainObjBeginQueryJob(vm) < 0)
                 goto cleanup;
 
-            qemuDomainObjEnterMonitorWithDriver(driver, vm);
-            err = qemuMonitorGetBalloonInfo(priv->mon, &balloon);
-            qemuDomainObjExitMonitorWithDriver(driver, vm);
-            if (qemuDomainObjEndJob(vm) == 0) {
+            if (!virDomainObjIsActive(vm)) {
+                err = 0;
+            } else {
+                qemuDomainObjEnterMonitor(vm);
+                err = qemuMonitorGetBalloonInfo(priv->mon, &balloon);
+                qemuDomainObjExitMonitor(vm);
+            }
+            /* No job was running when the query job began, and none
+             * can begin until it ends, so nothing but a shutdown is
+             * changing the definition. err == 0 indicates no balloon
+             * support, so ignore it */
+            if (err > 0 && virDomainObjIsActive(vm) &&
+                vm->def->mem.cur_balloon != balloon) {
+                vm->def->mem.cur_balloon = balloon;
+                virDomainObjInvalidateXML(vm);
+            }
+            if (qemuDomainObjEndQueryJob(vm) == 0) {
                 vm = NULL;
                 goto cleanup;
             }
             if (err < 0)
                 goto cleanup;
-            if (err > 0)
-                vm->def->mem.cur_balloon = balloon;
-            /* err == 0 indicates no balloon support, so ignore it */
         }
     }
 
-    ret = qemuDomainFormatXML(driver, vm, flags);
+    ret = qemuDomainFormatXMLHostCPU(hostcpu, vm, flags);
 
 cleanup:
     if (vm)
         virDomainObjUnlock(vm);
-    qemuDriverUnlock(driver);
+    virCPUDefFree(hostcpu);
     return ret;
 }
 
@@ -3437,9 +3476,7 @@ static int qemudListDefinedDomains(virConnectPtr conn,
     struct qemud_driver *driver = conn->privateData;
     int n;
 
-    qemuDriverLock(driver);
     n = virDomainObjListGetInactiveNames(&driver->domains, names, nnames);
-    qemuDriverUnlock(driver);
     return n;
 }
 
@@ -3447,9 +3484,7 @@ static int qemudNumDefinedDomains(virConnectPtr conn) {
     struct qemud_driver *driver = conn->privateData;
     int n;
 
-    qemuDriverLock(driver);
     n = virDomainObjListNumOfDomains(&driver->domains, 0);
-    qemuDriverUnlock(driver);
 
     return n;
 }
@@ -4157,9 +4192,7 @@ static int qemudDomainGetAutostart(virDomainPtr dom,
     virDomainObjPtr vm;
     int ret = -1;
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
-    qemuDriverUnlock(driver);
 
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
@@ -4255,7 +4288,6 @@ static char *qemuGetSchedulerType(virDomainPtr dom,
     struct qemud_driver *driver = dom->conn->privateData;
     char *ret = NULL;
 
-    qemuDriverLock(driver);
     if (!qemuCgroupControllerActive(driver, VIR_CGROUP_CONTROLLER_CPU)) {
         qemuReportError(VIR_ERR_OPERATION_INVALID,
                         "%s", _("cgroup CPU controller is not mounted"));
@@ -4270,7 +4302,6 @@ static char *qemuGetSchedulerType(virDomainPtr dom,
         virReportOOMError();
 
 cleanup:
-    qemuDriverUnlock(driver);
     return ret;
 }
 
@@ -4361,7 +4392,6 @@ static int qemuDomainGetBlkioParameters(virDomainPtr dom,
     int rc;
 
     virCheckFlags(0, -1);
-    qemuDriverLock(driver);
 
     if (!qemuCgroupControllerActive(driver, VIR_CGROUP_CONTROLLER_BLKIO)) {
         qemuReportError(VIR_ERR_NO_SUPPORT, _("blkio cgroup isn't mounted"));
@@ -4430,7 +4460,6 @@ cleanup:
         virCgroupFree(&group);
     if (vm)
         virDomainObjUnlock(vm);
-    qemuDriverUnlock(driver);
     return ret;
 }
 
@@ -4547,7 +4576,6 @@ static int qemuDomainGetMemoryParameters(virDomainPtr dom,
     int ret = -1;
     int rc;
 
-    qemuDriverLock(driver);
 
     if (!qemuCgroupControllerActive(driver, VIR_CGROUP_CONTROLLER_MEMORY)) {
         qemuReportError(VIR_ERR_OPERATION_INVALID,
@@ -4647,7 +4675,6 @@ cleanup:
         virCgroupFree(&group);
     if (vm)
         virDomainObjUnlock(vm);
-    qemuDriverUnlock(driver);
     return ret;
 }
 
@@ -4701,6 +4728,7 @@ static int qemuSetSchedulerParameters(virDomainPtr dom,
             }
 
             vm->def->cputune.shares = params[i].value.ul;
+            virDomainObjInvalidateXML(vm);
         } else {
             qemuReportError(VIR_ERR_INVALID_ARG,
                             _("Invalid parameter `%s'"), param->field);
@@ -4728,7 +4756,6 @@ static int qemuGetSchedulerParameters(virDomainPtr dom,
     int ret = -1;
     int rc;
 
-    qemuDriverLock(driver);
     if (!qemuCgroupControllerActive(driver, VIR_CGROUP_CONTROLLER_CPU)) {
         qemuReportError(VIR_ERR_OPERATION_INVALID,
                         "%s", _("cgroup CPU controller is not mounted"));
@@ -4775,7 +4802,6 @@ cleanup:
     virCgroupFree(&group);
     if (vm)
         virDomainObjUnlock(vm);
-    qemuDriverUnlock(driver);
     return ret;
 }
 
@@ -4795,9 +4821,7 @@ qemudDomainBlockStats (virDomainPtr dom,
     virDomainDiskDefPtr disk = NULL;
     qemuDomainObjPrivatePtr priv;
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
-    qemuDriverUnlock(driver);
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
         virUUIDFormat(dom->uuid, uuidstr);
@@ -4806,7 +4830,7 @@ qemudDomainBlockStats (virDomainPtr dom,
         goto cleanup;
     }
 
-    if (qemuDomainObjBeginJob(vm) < 0)
+    if (qemuDomainObjBeginQueryJob(vm) < 0)
         goto cleanup;
 
     if (!virDomainObjIsActive (vm)) {
@@ -4846,7 +4870,7 @@ qemudDomainBlockStats (virDomainPtr dom,
     qemuDomainObjExitMonitor(vm);
 
 endjob:
-    if (qemuDomainObjEndJob(vm) == 0)
+    if (qemuDomainObjEndQueryJob(vm) == 0)
         vm = NULL;
 
 cleanup:
@@ -4866,9 +4890,7 @@ qemudDomainInterfaceStats (virDomainPtr dom,
     int i;
     int ret = -1;
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
-    qemuDriverUnlock(driver);
 
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
@@ -4925,9 +4947,7 @@ qemudDomainMemoryStats (virDomainPtr dom,
     virDomainObjPtr vm;
     unsigned int ret = -1;
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
-    qemuDriverUnlock(driver);
 
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
@@ -4937,7 +4957,7 @@ qemudDomainMemoryStats (virDomainPtr dom,
         goto cleanup;
     }
 
-    if (qemuDomainObjBeginJob(vm) < 0)
+    if (qemuDomainObjBeginQueryJob(vm) < 0)
         goto cleanup;
 
     if (virDomainObjIsActive(vm)) {
@@ -4950,7 +4970,7 @@ qemudDomainMemoryStats (virDomainPtr dom,
                         "%s", _("domain is not running"));
     }
 
-    if (qemuDomainObjEndJob(vm) == 0)
+    if (qemuDomainObjEndQueryJob(vm) == 0)
         vm = NULL;
 
 cleanup:
@@ -4970,9 +4990,7 @@ qemudDomainBlockPeek (virDomainPtr dom,
     virDomainObjPtr vm;
     int fd = -1, ret = -1, i;
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
-    qemuDriverUnlock(driver);
 
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
@@ -5043,9 +5061,7 @@ qemudDomainMemoryPeek (virDomainPtr dom,
     int fd = -1, ret = -1;
     qemuDomainObjPrivatePtr priv;
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
-    qemuDriverUnlock(driver);
 
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
@@ -5138,9 +5154,7 @@ static int qemuDomainGetBlockInfo(virDomainPtr dom,
 
     virCheckFlags(0, -1);
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
-    qemuDriverUnlock(driver);
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
         virUUIDFormat(dom->uuid, uuidstr);
@@ -5250,7 +5264,7 @@ static int qemuDomainGetBlockInfo(virDomainPtr dom,
         format != VIR_STORAGE_FILE_RAW &&
         S_ISBLK(sb.st_mode)) {
         qemuDomainObjPrivatePtr priv = vm->privateData;
-        if (qemuDomainObjBeginJob(vm) < 0)
+        if (qemuDomainObjBeginQueryJob(vm) < 0)
             goto cleanup;
         if (!virDomainObjIsActive(vm))
             ret = 0;
@@ -5262,7 +5276,7 @@ static int qemuDomainGetBlockInfo(virDomainPtr dom,
             qemuDomainObjExitMonitor(vm);
         }
 
-        if (qemuDomainObjEndJob(vm) == 0)
+        if (qemuDomainObjEndQueryJob(vm) == 0)
             vm = NULL;
     } else {
         ret = 0;
@@ -5285,10 +5299,8 @@ qemuDomainEventRegister(virConnectPtr conn,
     struct qemud_driver *driver = conn->privateData;
     int ret;
 
-    qemuDriverLock(driver);
-    ret = virDomainEventCallbackListAdd(conn, driver->domainEventCallbacks,
-                                        callback, opaque, freecb);
-    qemuDriverUnlock(driver);
+    ret = virDomainEventDispatcherAdd(driver->domainEventDispatcher, conn,
+                                      callback, opaque, freecb);
 
     return ret;
 }
@@ -5301,14 +5313,8 @@ qemuDomainEventDeregister(virConnectPtr conn,
     struct qemud_driver *driver = conn->privateData;
     int ret;
 
-    qemuDriverLock(driver);
-    if (driver->domainEventDispatching)
-        ret = virDomainEventCallbackListMarkDelete(conn, driver->domainEventCallbacks,
-                                                   callback);
-    else
-        ret = virDomainEventCallbackListRemove(conn, driver->domainEventCallbacks,
-                                               callback);
-    qemuDriverUnlock(driver);
+    ret = virDomainEventDispatcherRemove(driver->domainEventDispatcher, conn,
+                                         callback);
 
     return ret;
 }
@@ -5325,12 +5331,9 @@ qemuDomainEventRegisterAny(virConnectPtr conn,
     struct qemud_driver *driver = conn->privateData;
     int ret;
 
-    qemuDriverLock(driver);
-    ret = virDomainEventCallbackListAddID(conn,
-                                          driver->domainEventCallbacks,
-                                          dom, eventID,
-                                          callback, opaque, freecb);
-    qemuDriverUnlock(driver);
+    ret = virDomainEventDispatcherAddID(driver->domainEventDispatcher, conn,
+                                        dom, eventID,
+                                        callback, opaque, freecb);
 
     return ret;
 }
@@ -5343,14 +5346,8 @@ qemuDomainEventDeregisterAny(virConnectPtr conn,
     struct qemud_driver *driver = conn->privateData;
     int ret;
 
-    qemuDriverLock(driver);
-    if (driver->domainEventDispatching)
-        ret = virDomainEventCallbackListMarkDeleteID(conn, driver->domainEventCallbacks,
-                                                     callbackID);
-    else
-        ret = virDomainEventCallbackListRemoveID(conn, driver->domainEventCallbacks,
-                                                 callbackID);
-    qemuDriverUnlock(driver);
+    ret = virDomainEventDispatcherRemoveID(driver->domainEventDispatcher, conn,
+                                           callbackID);
 
     return ret;
 }
@@ -5713,9 +5710,7 @@ static int qemuDomainGetJobInfo(virDomainPtr dom,
     int ret = -1;
     qemuDomainObjPrivatePtr priv;
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
-    qemuDriverUnlock(driver);
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
         virUUIDFormat(dom->uuid, uuidstr);
@@ -5768,9 +5763,7 @@ static int qemuDomainAbortJob(virDomainPtr dom) {
     int ret = -1;
     qemuDomainObjPrivatePtr priv;
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
-    qemuDriverUnlock(driver);
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
         virUUIDFormat(dom->uuid, uuidstr);
@@ -5785,6 +5778,7 @@ static int qemuDomainAbortJob(virDomainPtr dom) {
         if (priv->jobActive) {
             VIR_DEBUG("Requesting cancellation of job on vm %s", vm->def->name);
             priv->jobSignals |= QEMU_JOB_SIGNAL_CANCEL;
+            qemuDomainJobProgressWakeup(priv);
         } else {
             qemuReportError(VIR_ERR_OPERATION_INVALID,
                             "%s", _("no job is active on the domain"));
@@ -5817,7 +5811,6 @@ qemuDomainMigrateSetMaxDowntime(virDomainPtr dom,
 
     virCheckFlags(0, -1);
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
 
     if (!vm) {
@@ -5845,12 +5838,12 @@ qemuDomainMigrateSetMaxDowntime(virDomainPtr dom,
     VIR_DEBUG("Requesting migration downtime change to %llums", downtime);
     priv->jobSignals |= QEMU_JOB_SIGNAL_MIGRATE_DOWNTIME;
     priv->jobSignalsData.migrateDowntime = downtime;
+    qemuDomainJobProgressWakeup(priv);
     ret = 0;
 
 cleanup:
     if (vm)
         virDomainObjUnlock(vm);
-    qemuDriverUnlock(driver);
     return ret;
 }
 
@@ -5866,7 +5859,6 @@ qemuDomainMigrateSetMaxSpeed(virDomainPtr dom,
 
     virCheckFlags(0, -1);
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
 
     if (!vm) {
@@ -5894,12 +5886,12 @@ qemuDomainMigrateSetMaxSpeed(virDomainPtr dom,
     VIR_DEBUG("Requesting migration speed change to %luMbs", bandwidth);
     priv->jobSignals |= QEMU_JOB_SIGNAL_MIGRATE_SPEED;
     priv->jobSignalsData.migrateBandwidth = bandwidth;
+    qemuDomainJobProgressWakeup(priv);
     ret = 0;
 
 cleanup:
     if (vm)
         virDomainObjUnlock(vm);
-    qemuDriverUnlock(driver);
     return ret;
 }
 
@@ -6208,7 +6200,6 @@ static int qemuDomainSnapshotListNames(virDomainPtr domain, char **names,
 
     virCheckFlags(0, -1);
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, domain->uuid);
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
@@ -6223,7 +6214,6 @@ static int qemuDomainSnapshotListNames(virDomainPtr domain, char **names,
 cleanup:
     if (vm)
         virDomainObjUnlock(vm);
-    qemuDriverUnlock(driver);
     return n;
 }
 
@@ -6236,7 +6226,6 @@ static int qemuDomainSnapshotNum(virDomainPtr domain,
 
     virCheckFlags(0, -1);
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, domain->uuid);
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
@@ -6251,7 +6240,6 @@ static int qemuDomainSnapshotNum(virDomainPtr domain,
 cleanup:
     if (vm)
         virDomainObjUnlock(vm);
-    qemuDriverUnlock(driver);
     return n;
 }
 
@@ -6266,7 +6254,6 @@ static virDomainSnapshotPtr qemuDomainSnapshotLookupByName(virDomainPtr domain,
 
     virCheckFlags(0, NULL);
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, domain->uuid);
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
@@ -6288,7 +6275,6 @@ static virDomainSnapshotPtr qemuDomainSnapshotLookupByName(virDomainPtr domain,
 cleanup:
     if (vm)
         virDomainObjUnlock(vm);
-    qemuDriverUnlock(driver);
     return snapshot;
 }
 
@@ -6301,7 +6287,6 @@ static int qemuDomainHasCurrentSnapshot(virDomainPtr domain,
 
     virCheckFlags(0, -1);
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, domain->uuid);
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
@@ -6316,7 +6301,6 @@ static int qemuDomainHasCurrentSnapshot(virDomainPtr domain,
 cleanup:
     if (vm)
         virDomainObjUnlock(vm);
-    qemuDriverUnlock(driver);
     return ret;
 }
 
@@ -6329,7 +6313,6 @@ static virDomainSnapshotPtr qemuDomainSnapshotCurrent(virDomainPtr domain,
 
     virCheckFlags(0, NULL);
 
-    qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, domain->uuid);
     if (!vm) {
         char uuidstr[VIR_UUID_STRING_BUFLEN];
@@ -6350,7 +6333,6 @@ static virDomainSnapshotPtr qemuDomainSnapshotCurrent(virDomainPtr domain,
 cleanup:
     if (vm)
         virDomainObjUnlock(vm);
-    qemuDriverUnlock(driver);
     return snapshot;
 }
 
@@ -6365,7 +6347,6 @@ static char *qemuDomainSnapshotDumpXML(virDomainSnapshotPtr snapshot,
 
     virCheckFlags(0, NULL);
 
-    qemuDriverLock(driver);
     virUUIDFormat(snapshot->domain->uuid, uuidstr);
     vm = virDomainFindByUUID(&driver->domains, snapshot->domain->uuid);
     if (!vm) {
@@ -6387,7 +6368,6 @@ static char *qemuDomainSnapshotDumpXML(virDomainSnapshotPtr snapshot,
 cleanup:
     if (vm)
         virDomainObjUnlock(vm);
-    qemuDriverUnlock(driver);
     return xml;
 }
 
@@ -6799,7 +6779,6 @@ qemuDomainOpenConsole(virDomainPtr dom,
 
     virCheckFlags(0, -1);
 
-    qemuDriverLock(driver);
     virUUIDFormat(dom->uuid, uuidstr);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
     if (!vm) {
@@ -6854,7 +6833,492 @@ qemuDomainOpenConsole(virDomainPtr dom,
 cleanup:
     if (vm)
         virDomainObjUnlock(vm);
-    qemuDriverUnlock(driver);
+    return ret;
+}
+
+
+/* Domains picked for a bulk stats query, each holding a reference */
+struct qemuDomainStatsList {
+    virDomainObjPtr *objs;
+    size_t nobjs;
+    size_t nalloc;
+    unsigned int flags;
+    bool oom;
+};
+
+static void
+qemuDomainStatsListAdd(void *payload,
+                       const void *name ATTRIBUTE_UNUSED,
+                       void *opaque)
+{
+    virDomainObjPtr vm = payload;
+    struct qemuDomainStatsList *list = opaque;
+    unsigned int want = list->flags;
+
+    if (!want)
+        want = (VIR_CONNECT_GET_ALL_DOMAINS_STATS_ACTIVE |
+                VIR_CONNECT_GET_ALL_DOMAINS_STATS_INACTIVE);
+
+    if (list->oom)
+        return;
+
+    virDomainObjLock(vm);
+    if (virDomainObjIsActive(vm) ?
+        (want & VIR_CONNECT_GET_ALL_DOMAINS_STATS_ACTIVE) :
+        (want & VIR_CONNECT_GET_ALL_DOMAINS_STATS_INACTIVE)) {
+        if (VIR_RESIZE_N(list->objs, list->nalloc, list->nobjs, 1) < 0) {
+            list->oom = true;
+        } else {
+            virDomainObjRef(vm);
+            list->objs[list->nobjs++] = vm;
+        }
+    }
+    virDomainObjUnlock(vm);
+}
+
+/* A record under construction, growing its params geometrically */
+struct qemuDomainStatsBuilder {
+    virDomainStatsRecordPtr rec;
+    size_t nalloc;
+};
+
+static virDomainStatsParamPtr
+qemuDomainStatsAddParam(struct qemuDomainStatsBuilder *builder,
+                        int type, const char *fmt, ...)
+    ATTRIBUTE_FMT_PRINTF(3, 4);
+
+static virDomainStatsParamPtr
+qemuDomainStatsAddParam(struct qemuDomainStatsBuilder *builder,
+                        int type, const char *fmt, ...)
+{
+    virDomainStatsRecordPtr rec = builder->rec;
+    virDomainStatsParamPtr param;
+    va_list args;
+    int len;
+
+    if (VIR_RESIZE_N(rec->params, builder->nalloc, rec->nparams, 1) < 0) {
+        virReportOOMError();
+        return NULL;
+    }
+    param = &rec->params[rec->nparams];
+    memset(param, 0, sizeof(*param));
+
+    va_start(args, fmt);
+    len = vsnprintf(param->field, sizeof(param->field), fmt, args);
+    va_end(args);
+    if (len < 0 || len >= sizeof(param->field)) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR,
+                        _("statistic name '%s' too long"), param->field);
+        return NULL;
+    }
+
+    param->type = type;
+    rec->nparams++;
+    return param;
+}
+
+static int
+qemuDomainStatsAddULLong(struct qemuDomainStatsBuilder *builder,
+                         const char *field, unsigned long long val)
+{
+    virDomainStatsParamPtr param;
+
+    if (!(param = qemuDomainStatsAddParam(builder,
+                                          VIR_DOMAIN_STATS_PARAM_ULLONG,
+                                          "%s", field)))
+        return -1;
+    param->value.ul = val;
+    return 0;
+}
+
+static int
+qemuDomainStatsAddUInt(struct qemuDomainStatsBuilder *builder,
+                       const char *field, unsigned int val)
+{
+    virDomainStatsParamPtr param;
+
+    if (!(param = qemuDomainStatsAddParam(builder,
+                                          VIR_DOMAIN_STATS_PARAM_UINT,
+                                          "%s", field)))
+        return -1;
+    param->value.ui = val;
+    return 0;
+}
+
+static int
+qemuDomainStatsAddString(struct qemuDomainStatsBuilder *builder,
+                         const char *group, int n, const char *val)
+{
+    virDomainStatsParamPtr param;
+
+    if (!(param = qemuDomainStatsAddParam(builder,
+                                          VIR_DOMAIN_STATS_PARAM_STRING,
+                                          "%s.%d.name", group, n)))
+        return -1;
+    if (!(param->value.s = strdup(val))) {
+        virReportOOMError();
+        return -1;
+    }
+    return 0;
+}
+
+static int
+qemuDomainStatsAddCounter(struct qemuDomainStatsBuilder *builder,
+                          const char *group, int n, const char *name,
+                          long long val)
+{
+    virDomainStatsParamPtr param;
+
+    /* Drivers use -1 for counters they cannot provide */
+    if (val < 0)
+        return 0;
+
+    if (!(param = qemuDomainStatsAddParam(builder,
+                                          VIR_DOMAIN_STATS_PARAM_LLONG,
+                                          "%s.%d.%s", group, n, name)))
+        return -1;
+    param->value.l = val;
+    return 0;
+}
+
+static int
+qemuDomainStatsGetCpu(struct qemud_driver *driver,
+                      virDomainObjPtr vm,
+                      struct qemuDomainStatsBuilder *builder)
+{
+    virCgroupPtr group = NULL;
+    unsigned long long cpuTime;
+    bool found = false;
+
+    if (!virDomainObjIsActive(vm))
+        return 0;
+
+    /* cpuacct includes any helper threads, and is cheaper than /proc */
+    if (driver->cgroup &&
+        qemuCgroupControllerActive(driver, VIR_CGROUP_CONTROLLER_CPUACCT) &&
+        virCgroupForDomain(driver->cgroup, vm->def->name, &group, 0) == 0) {
+        if (virCgroupGetCpuacctUsage(group, &cpuTime) == 0)
+            found = true;
+        virCgroupFree(&group);
+    }
+
+    if (!found &&
+        qemudGetProcessInfo(&cpuTime, NULL, vm->pid, 0) == 0)
+        found = true;
+
+    if (!found)
+        return 0;
+
+    return qemuDomainStatsAddULLong(builder, "cpu.time", cpuTime);
+}
+
+static int
+qemuDomainStatsGetVcpu(virDomainObjPtr vm,
+                       struct qemuDomainStatsBuilder *builder)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    unsigned long long cpuTime;
+    virDomainStatsParamPtr param;
+    int i;
+
+    if (qemuDomainStatsAddUInt(builder, "vcpu.current", vm->def->vcpus) < 0 ||
+        qemuDomainStatsAddUInt(builder, "vcpu.maximum", vm->def->maxvcpus) < 0)
+        return -1;
+
+    if (!virDomainObjIsActive(vm))
+        return 0;
+
+    for (i = 0 ; i < priv->nvcpupids ; i++) {
+        if (qemudGetProcessInfo(&cpuTime, NULL,
+                                vm->pid, priv->vcpupids[i]) < 0)
+            continue;
+        if (!(param = qemuDomainStatsAddParam(builder,
+                                              VIR_DOMAIN_STATS_PARAM_ULLONG,
+                                              "vcpu.%d.time", i)))
+            return -1;
+        param->value.ul = cpuTime;
+    }
+
+    return 0;
+}
+
+/*
+ * Block statistics are the only group needing the monitor. A query
+ * job lets them run alongside migration, but rather than wait for a
+ * job that would block us, the group is left out for that domain.
+ */
+static int
+qemuDomainStatsGetBlock(virDomainObjPtr vm,
+                        struct qemuDomainStatsBuilder *builder)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    int countIdx;
+    int i, n = 0;
+    int ret = -1;
+
+    if (!virDomainObjIsActive(vm) || vm->def->ndisks == 0)
+        return 0;
+
+    if (qemuDomainObjQueryJobBusy(vm))
+        return 0;
+
+    if (qemuDomainObjBeginQueryJob(vm) < 0) {
+        virResetLastError();
+        return 0;
+    }
+
+    if (!virDomainObjIsActive(vm)) {
+        ret = 0;
+        goto endjob;
+    }
+
+    countIdx = builder->rec->nparams;
+    if (qemuDomainStatsAddUInt(builder, "block.count", 0) < 0)
+        goto endjob;
+
+    for (i = 0 ; i < vm->def->ndisks ; i++) {
+        virDomainDiskDefPtr disk = vm->def->disks[i];
+        long long rd_req, rd_bytes, wr_req, wr_bytes, errs;
+        int rc;
+
+        if (!disk->info.alias)
+            continue;
+
+        qemuDomainObjEnterMonitor(vm);
+        rc = qemuMonitorGetBlockStatsInfo(priv->mon, disk->info.alias,
+                                          &rd_req, &rd_bytes,
+                                          &wr_req, &wr_bytes, &errs);
+        qemuDomainObjExitMonitor(vm);
+
+        /* The domain may have shut off while unlocked, taking
+         * priv->mon and vm->def->disks with it */
+        if (!virDomainObjIsActive(vm)) {
+            virResetLastError();
+            break;
+        }
+
+        if (rc < 0) {
+            /* Old QEMU, or the disk went away: skip it */
+            virResetLastError();
+            continue;
+        }
+
+        if (qemuDomainStatsAddString(builder, "block", n, disk->dst) < 0 ||
+            qemuDomainStatsAddCounter(builder, "block", n, "rd.reqs", rd_req) < 0 ||
+            qemuDomainStatsAddCounter(builder, "block", n, "rd.bytes", rd_bytes) < 0 ||
+            qemuDomainStatsAddCounter(builder, "block", n, "wr.reqs", wr_req) < 0 ||
+            qemuDomainStatsAddCounter(builder, "block", n, "wr.bytes", wr_bytes) < 0 ||
+            qemuDomainStatsAddCounter(builder, "block", n, "errs", errs) < 0)
+            goto endjob;
+        n++;
+    }
+
+    builder->rec->params[countIdx].value.ui = n;
+    ret = 0;
+
+endjob:
+    /* The caller holds its own reference, so vm cannot go away here */
+    ignore_value(qemuDomainObjEndQueryJob(vm));
+    return ret;
+}
+
+#ifdef __linux__
+static int
+qemuDomainStatsGetNet(virDomainObjPtr vm,
+                      struct qemuDomainStatsBuilder *builder)
+{
+    int countIdx;
+    int i, n = 0;
+
+    if (!virDomainObjIsActive(vm) || vm->def->nnets == 0)
+        return 0;
+
+    countIdx = builder->rec->nparams;
+    if (qemuDomainStatsAddUInt(builder, "net.count", 0) < 0)
+        return -1;
+
+    for (i = 0 ; i < vm->def->nnets ; i++) {
+        virDomainNetDefPtr net = vm->def->nets[i];
+        struct _virDomainInterfaceStats stats;
+
+        if (!net->ifname)
+            continue;
+
+        if (linuxDomainInterfaceStats(net->ifname, &stats) < 0) {
+            virResetLastError();
+            continue;
+        }
+
+        if (qemuDomainStatsAddString(builder, "net", n, net->ifname) < 0 ||
+            qemuDomainStatsAddCounter(builder, "net", n, "rx.bytes", stats.rx_bytes) < 0 ||
+            qemuDomainStatsAddCounter(builder, "net", n, "rx.pkts", stats.rx_packets) < 0 ||
+            qemuDomainStatsAddCounter(builder, "net", n, "rx.errs", stats.rx_errs) < 0 ||
+            qemuDomainStatsAddCounter(builder, "net", n, "rx.drop", stats.rx_drop) < 0 ||
+            qemuDomainStatsAddCounter(builder, "net", n, "tx.bytes", stats.tx_bytes) < 0 ||
+            qemuDomainStatsAddCounter(builder, "net", n, "tx.pkts", stats.tx_packets) < 0 ||
+            qemuDomainStatsAddCounter(builder, "net", n, "tx.errs", stats.tx_errs) < 0 ||
+            qemuDomainStatsAddCounter(builder, "net", n, "tx.drop", stats.tx_drop) < 0)
+            return -1;
+        n++;
+    }
+
+    builder->rec->params[countIdx].value.ui = n;
+    return 0;
+}
+#else
+static int
+qemuDomainStatsGetNet(virDomainObjPtr vm ATTRIBUTE_UNUSED,
+                      struct qemuDomainStatsBuilder *builder ATTRIBUTE_UNUSED)
+{
+    return 0;
+}
+#endif
+
+/*
+ * vm must be locked, and referenced by the caller. The record is
+ * stored in *rec as soon as it is allocated, so that on failure the
+ * caller can release it along with the rest of its list.
+ */
+static int
+qemuDomainStatsGetRecord(virConnectPtr conn,
+                         struct qemud_driver *driver,
+                         virDomainObjPtr vm,
+                         unsigned int stats,
+                         virDomainStatsRecordPtr *rec)
+{
+    struct qemuDomainStatsBuilder builder = { NULL, 0 };
+    virDomainStatsParamPtr param;
+
+    if (VIR_ALLOC(builder.rec) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+    *rec = builder.rec;
+
+    if (!(builder.rec->dom = virGetDomain(conn, vm->def->name, vm->def->uuid)))
+        return -1;
+    builder.rec->dom->id = vm->def->id;
+
+    if (stats & VIR_DOMAIN_STATS_STATE) {
+        if (!(param = qemuDomainStatsAddParam(&builder,
+                                              VIR_DOMAIN_STATS_PARAM_INT,
+                                              "%s", "state.state")))
+            return -1;
+        param->value.i = vm->state;
+    }
+
+    if ((stats & VIR_DOMAIN_STATS_CPU) &&
+        qemuDomainStatsGetCpu(driver, vm, &builder) < 0)
+        return -1;
+
+    /* The live balloon size would need the monitor, so report the
+     * allocation last requested, as virDomainGetInfo does while a
+     * job is running */
+    if ((stats & VIR_DOMAIN_STATS_BALLOON) &&
+        (qemuDomainStatsAddULLong(&builder, "balloon.current",
+                                  vm->def->mem.cur_balloon) < 0 ||
+         qemuDomainStatsAddULLong(&builder, "balloon.maximum",
+                                  vm->def->mem.max_balloon) < 0))
+        return -1;
+
+    if ((stats & VIR_DOMAIN_STATS_VCPU) &&
+        qemuDomainStatsGetVcpu(vm, &builder) < 0)
+        return -1;
+
+    if ((stats & VIR_DOMAIN_STATS_BLOCK) &&
+        qemuDomainStatsGetBlock(vm, &builder) < 0)
+        return -1;
+
+    if ((stats & VIR_DOMAIN_STATS_NET) &&
+        qemuDomainStatsGetNet(vm, &builder) < 0)
+        return -1;
+
+    return 0;
+}
+
+static int
+qemuConnectGetAllDomainStats(virConnectPtr conn,
+                             virDomainPtr *doms,
+                             unsigned int ndoms,
+                             unsigned int stats,
+                             virDomainStatsRecordPtr **retStats,
+                             unsigned int flags)
+{
+    struct qemud_driver *driver = conn->privateData;
+    struct qemuDomainStatsList list = { NULL, 0, 0, flags, false };
+    virDomainStatsRecordPtr *records = NULL;
+    size_t i;
+    int ret = -1;
+
+    virCheckFlags(VIR_CONNECT_GET_ALL_DOMAINS_STATS_ACTIVE |
+                  VIR_CONNECT_GET_ALL_DOMAINS_STATS_INACTIVE, -1);
+
+    if (!stats)
+        stats = (VIR_DOMAIN_STATS_STATE | VIR_DOMAIN_STATS_CPU |
+                 VIR_DOMAIN_STATS_BALLOON | VIR_DOMAIN_STATS_VCPU |
+                 VIR_DOMAIN_STATS_BLOCK | VIR_DOMAIN_STATS_NET);
+
+    /* Pick the domains first; the stats are then gathered one
+     * domain lock at a time */
+    if (doms) {
+        if (VIR_ALLOC_N(list.objs, ndoms) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+        for (i = 0 ; i < ndoms ; i++) {
+            virDomainObjPtr vm;
+
+            /* Domains which have since gone are left out */
+            if (!(vm = virDomainFindByUUID(&driver->domains, doms[i]->uuid)))
+                continue;
+            virDomainObjRef(vm);
+            list.objs[list.nobjs++] = vm;
+            virDomainObjUnlock(vm);
+        }
+    } else {
+        virDomainObjListForEach(&driver->domains,
+                                qemuDomainStatsListAdd, &list);
+        if (list.oom) {
+            virReportOOMError();
+            goto cleanup;
+        }
+    }
+
+    /* NULL terminated, so a partial list can be freed on error */
+    if (VIR_ALLOC_N(records, list.nobjs + 1) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    for (i = 0 ; i < list.nobjs ; i++) {
+        virDomainObjPtr vm = list.objs[i];
+        int rc;
+
+        virDomainObjLock(vm);
+        rc = qemuDomainStatsGetRecord(conn, driver, vm, stats, &records[i]);
+        if (virDomainObjUnref(vm) > 0)
+            virDomainObjUnlock(vm);
+        list.objs[i] = NULL;
+
+        if (rc < 0)
+            goto cleanup;
+    }
+
+    *retStats = records;
+    records = NULL;
+    ret = list.nobjs;
+
+cleanup:
+    for (i = 0 ; i < list.nobjs ; i++) {
+        virDomainObjPtr vm = list.objs[i];
+        if (!vm)
+            continue;
+        virDomainObjLock(vm);
+        if (virDomainObjUnref(vm) > 0)
+            virDomainObjUnlock(vm);
+    }
+    VIR_FREE(list.objs);
+    virDomainStatsRecordListFree(records);
     return ret;
 }
 
@@ -6970,6 +7434,7 @@ static virDriver qemuDriver = {
     qemuDomainSnapshotDelete, /* domainSnapshotDelete */
     qemuDomainMonitorCommand, /* qemuDomainMonitorCommand */
     qemuDomainOpenConsole, /* domainOpenConsole */
+    qemuConnectGetAllDomainStats, /* connectGetAllDomainStats */
 };
 
 
@@ -6997,7 +7462,7 @@ static int
 qemuVMFilterRebuild(virConnectPtr conn ATTRIBUTE_UNUSED,
                     virHashIterator iter, void *data)
 {
-    virHashForEach(qemu_driver->domains.objs, iter, data);
+    virDomainObjListForEach(&qemu_driver->domains, iter, data);
 
     return 0;
 }
@@ -38,11 +38,19 @@
 #include "files.h"
 #include "datatypes.h"
 #include "fdstream.h"
+#include "iohelper.h"
+#include "configmake.h"
 
 #define VIR_FROM_THIS VIR_FROM_QEMU
 
 #define timeval_to_ms(tv)       (((tv).tv_sec * 1000ull) + ((tv).tv_usec / 1000))
 
+/* Bounds, in ms, on how often a migration, save or dump job asks
+ * QEMU for its progress. Job signals and monitor events cut the
+ * wait short, so the upper bound only delays the progress figures */
+#define QEMU_MIGRATION_POLL_MIN 50
+#define QEMU_MIGRATION_POLL_MAX 1000
+
 
 bool
 qemuMigrationIsAllowed(virDomainDefPtr def)
@@ -80,6 +88,64 @@ qemuMigrationSetOffline(struct qemud_driver *driver,
 }
 
 
+/*
+ * Picks the time until the next progress poll. While most of the
+ * memory is still to be copied there is nothing to watch for, so
+ * poll rarely, and tighten up as the estimated time to completion
+ * shrinks, so the switch-over is noticed promptly.
+ */
+static unsigned long long
+qemuMigrationNextPoll(qemuDomainObjPrivatePtr priv)
+{
+    unsigned long long rate;
+    unsigned long long interval;
+
+    /* Too early to tell, or about to converge */
+    if (qemuDomainJobProgressRate(priv, &rate) < 0 ||
+        priv->jobInfo.dataRemaining == 0)
+        return QEMU_MIGRATION_POLL_MIN;
+
+    /* Stalled, so nothing will happen soon either */
+    if (rate == 0)
+        return QEMU_MIGRATION_POLL_MAX;
+
+    interval = priv->jobInfo.dataRemaining * 1000ull / rate / 4;
+    if (interval < QEMU_MIGRATION_POLL_MIN)
+        interval = QEMU_MIGRATION_POLL_MIN;
+    if (interval > QEMU_MIGRATION_POLL_MAX)
+        interval = QEMU_MIGRATION_POLL_MAX;
+
+    return interval;
+}
+
+/*
+ * Waits with the driver unlocked until time @then, in ms since
+ * the epoch, or until qemuDomainJobProgressWakeup is called.
+ */
+static void
+qemuMigrationWaitForProgress(struct qemud_driver *driver,
+                             virDomainObjPtr vm,
+                             unsigned long long then)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+
+    qemuDriverUnlock(driver);
+
+    while (!priv->jobProgress.wakeup) {
+        if (virCondWaitUntil(&priv->jobProgress.cond, &vm->lock, then) < 0) {
+            if (errno != ETIMEDOUT)
+                VIR_WARN0("Unable to wait for job progress");
+            break;
+        }
+    }
+    priv->jobProgress.wakeup = false;
+
+    virDomainObjUnlock(vm);
+    qemuDriverLock(driver);
+    virDomainObjLock(vm);
+}
+
+
 int
 qemuMigrationWaitForCompletion(struct qemud_driver *driver, virDomainObjPtr vm)
 {
@@ -93,9 +159,9 @@ qemuMigrationWaitForCompletion(struct qemud_driver *driver, virDomainObjPtr vm)
     priv->jobInfo.type = VIR_DOMAIN_JOB_UNBOUNDED;
 
     while (priv->jobInfo.type == VIR_DOMAIN_JOB_UNBOUNDED) {
-        /* Poll every 50ms for progress & to allow cancellation */
-        struct timespec ts = { .tv_sec = 0, .tv_nsec = 50 * 1000 * 1000ull };
         struct timeval now;
+        unsigned long long rate;
+        unsigned long long interval;
         int rc;
         const char *job;
 
@@ -203,6 +269,11 @@ qemuMigrationWaitForCompletion(struct qemud_driver *driver, virDomainObjPtr vm)
             priv->jobInfo.memTotal = memTotal;
             priv->jobInfo.memRemaining = memRemaining;
             priv->jobInfo.memProcessed = memProcessed;
+
+            qemuDomainJobProgressAdd(priv, priv->jobInfo.timeElapsed,
+                                     memProcessed, memRemaining);
+            if (qemuDomainJobProgressRate(priv, &rate) == 0 && rate > 0)
+                priv->jobInfo.timeRemaining = memRemaining * 1000ull / rate;
             break;
 
         case QEMU_MONITOR_MIGRATION_STATUS_COMPLETED:
@@ -223,13 +294,13 @@ qemuMigrationWaitForCompletion(struct qemud_driver *driver, virDomainObjPtr vm)
             break;
         }
 
-        virDomainObjUnlock(vm);
-        qemuDriverUnlock(driver);
-
-        nanosleep(&ts, NULL);
+        if (priv->jobInfo.type != VIR_DOMAIN_JOB_UNBOUNDED)
+            break;
 
-        qemuDriverLock(driver);
-        virDomainObjLock(vm);
+        interval = qemuMigrationNextPoll(priv);
+        VIR_DEBUG("Checking %s progress again in %llums", job, interval);
+        qemuMigrationWaitForProgress(driver, vm,
+                                     timeval_to_ms(now) + interval);
     }
 
 cleanup:
@@ -298,7 +369,7 @@ qemuMigrationPrepareTunnel(struct qemud_driver *driver,
     priv->jobActive = QEMU_JOB_MIGRATION_OUT;
 
     /* Domain starts inactive, even if the domain XML had an id field. */
-    vm->def->id = -1;
+    virDomainObjListClearID(&driver->domains, vm);
 
     if (pipe(dataFD) < 0 ||
         virSetCloseExec(dataFD[0]) < 0) {
@@ -517,7 +588,7 @@ qemuMigrationPrepareDirect(struct qemud_driver *driver,
     priv->jobActive = QEMU_JOB_MIGRATION_OUT;
 
     /* Domain starts inactive, even if the domain XML had an id field. */
-    vm->def->id = -1;
+    virDomainObjListClearID(&driver->domains, vm);
 
     /* Start the QEMU daemon, with the same command-line arguments plus
      * -incoming tcp:0.0.0.0:port
@@ -639,48 +710,327 @@ cleanup:
 
 
 #define TUNNEL_SEND_BUF_SIZE 65536
+/* Buffers in flight between reading from QEMU and sending to the
+ * destination, so neither side waits on the other's round trip */
+#define TUNNEL_SEND_BUF_COUNT 8
+/* How often, in ms, the job progress is published */
+#define TUNNEL_UPDATE_INTERVAL 50
+
+struct qemuMigrationTunnelBuf {
+    char *data;
+    size_t len;
+    bool full;
+};
+
+typedef struct _qemuMigrationTunnel qemuMigrationTunnel;
+typedef qemuMigrationTunnel *qemuMigrationTunnelPtr;
+struct _qemuMigrationTunnel {
+    virMutex lock;
+    virCond cond;   /* Signalled whenever a buffer fills or empties */
+    int sock;
+    struct qemuMigrationTunnelBuf bufs[TUNNEL_SEND_BUF_COUNT];
+    bool quit;      /* Sender gave up, reader must stop */
+    bool eof;       /* QEMU closed its end */
+    int err;        /* errno of a failed read, if any */
+
+    /* Token bucket, in bytes, enforcing the bandwidth limit */
+    unsigned long long rate;    /* Per second, 0 for no limit */
+    unsigned long long burst;
+    unsigned long long tokens;
+    unsigned long long refilled;
+
+    /* Throughput counters, times in ms */
+    unsigned long long start;
+    unsigned long long bytes;
+    unsigned long long throttled;   /* Waiting for the bucket to refill */
+    unsigned long long starved;     /* Waiting for QEMU to send more */
+    unsigned long long updated;     /* Last published to the job */
+};
+
+static unsigned long long
+qemuMigrationTunnelNow(void)
+{
+    struct timeval now;
+
+    if (gettimeofday(&now, NULL) < 0)
+        return 0;
+    return timeval_to_ms(now);
+}
 
-static int doTunnelSendAll(virStreamPtr st,
-                           int sock)
+/* Like QEMU's own migrate_set_speed, the limit is in MiB/s */
+static void
+qemuMigrationTunnelSetRate(qemuMigrationTunnelPtr tunnel,
+                           unsigned long bandwidth)
 {
-    char *buffer;
-    int nbytes = TUNNEL_SEND_BUF_SIZE;
+    tunnel->rate = bandwidth * 1024ull * 1024ull;
+
+    /* Allow bursts of 100ms, but never less than a whole buffer
+     * or a single send could wait forever */
+    tunnel->burst = tunnel->rate / 10;
+    if (tunnel->burst < TUNNEL_SEND_BUF_SIZE)
+        tunnel->burst = TUNNEL_SEND_BUF_SIZE;
+    tunnel->tokens = tunnel->burst;
+    tunnel->refilled = qemuMigrationTunnelNow();
+}
 
-    if (VIR_ALLOC_N(buffer, TUNNEL_SEND_BUF_SIZE) < 0) {
-        virReportOOMError();
-        virStreamAbort(st);
-        return -1;
+static void
+qemuMigrationTunnelThrottle(qemuMigrationTunnelPtr tunnel,
+                            size_t len)
+{
+    while (tunnel->rate) {
+        unsigned long long now = qemuMigrationTunnelNow();
+        unsigned long long wait;
+
+        if (now > tunnel->refilled) {
+            tunnel->tokens += (now - tunnel->refilled) * tunnel->rate / 1000;
+            if (tunnel->tokens > tunnel->burst)
+                tunnel->tokens = tunnel->burst;
+            tunnel->refilled = now;
+        }
+
+        if (tunnel->tokens >= len) {
+            tunnel->tokens -= len;
+            return;
+        }
+
+        wait = (len - tunnel->tokens) * 1000 / tunnel->rate + 1;
+        usleep(wait * 1000);
+        tunnel->throttled += wait;
     }
+}
+
+static void
+qemuMigrationTunnelReader(void *opaque)
+{
+    qemuMigrationTunnelPtr tunnel = opaque;
+    int i = 0;
 
-    /* XXX should honour the 'resource' parameter here */
     for (;;) {
-        nbytes = saferead(sock, buffer, nbytes);
-        if (nbytes < 0) {
-            virReportSystemError(errno, "%s",
-                                 _("tunnelled migration failed to read from qemu"));
-            virStreamAbort(st);
-            VIR_FREE(buffer);
-            return -1;
+        struct qemuMigrationTunnelBuf *buf = &tunnel->bufs[i];
+        ssize_t got;
+
+        virMutexLock(&tunnel->lock);
+        while (buf->full && !tunnel->quit)
+            ignore_value(virCondWait(&tunnel->cond, &tunnel->lock));
+        if (tunnel->quit) {
+            virMutexUnlock(&tunnel->lock);
+            return;
         }
-        else if (nbytes == 0)
+        virMutexUnlock(&tunnel->lock);
+
+        got = saferead(tunnel->sock, buf->data, TUNNEL_SEND_BUF_SIZE);
+
+        virMutexLock(&tunnel->lock);
+        if (got <= 0) {
+            if (got < 0)
+                tunnel->err = errno;
+            tunnel->eof = true;
+            virCondSignal(&tunnel->cond);
+            virMutexUnlock(&tunnel->lock);
+            return;
+        }
+        buf->len = got;
+        buf->full = true;
+        virCondSignal(&tunnel->cond);
+        virMutexUnlock(&tunnel->lock);
+
+        i = (i + 1) % TUNNEL_SEND_BUF_COUNT;
+    }
+}
+
+/*
+ * Publishes the progress of the tunnel as the job's progress, and
+ * picks up any request to cancel the job or change its bandwidth.
+ *
+ * Returns 0 to carry on, -1 if the job was cancelled
+ */
+static int
+qemuMigrationTunnelUpdateJob(virDomainObjPtr vm,
+                             qemuMigrationTunnelPtr tunnel)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    unsigned long long now = qemuMigrationTunnelNow();
+    int ret = 0;
+
+    /* Spare the domain lock a visit for every buffer */
+    if (now - tunnel->updated < TUNNEL_UPDATE_INTERVAL)
+        return 0;
+    tunnel->updated = now;
+
+    virDomainObjLock(vm);
+
+    priv->jobInfo.dataProcessed = tunnel->bytes;
+    priv->jobInfo.memProcessed = tunnel->bytes;
+    priv->jobInfo.timeElapsed = now - priv->jobStart;
+
+    if (priv->jobSignals & QEMU_JOB_SIGNAL_CANCEL) {
+        priv->jobSignals ^= QEMU_JOB_SIGNAL_CANCEL;
+        VIR_DEBUG0("Cancelling tunnelled migration at client request");
+        qemuReportError(VIR_ERR_OPERATION_FAILED, "%s",
+                        _("migration job: canceled by client"));
+        ret = -1;
+    } else if (priv->jobSignals & QEMU_JOB_SIGNAL_MIGRATE_SPEED) {
+        unsigned long bandwidth = priv->jobSignalsData.migrateBandwidth;
+
+        priv->jobSignals ^= QEMU_JOB_SIGNAL_MIGRATE_SPEED;
+        priv->jobSignalsData.migrateBandwidth = 0;
+        VIR_DEBUG("Setting tunnelled migration bandwidth to %luMbs",
+                  bandwidth);
+        qemuMigrationTunnelSetRate(tunnel, bandwidth);
+    }
+
+    virDomainObjUnlock(vm);
+
+    return ret;
+}
+
+/*
+ * Copies the migration data from QEMU to the destination. A
+ * separate thread keeps reading from QEMU while data is being
+ * sent, and sending is held to the 'resource' bandwidth limit.
+ *
+ * Must be called with the driver and domain unlocked, holding
+ * a reference on the domain.
+ */
+static int doTunnelSendAll(virDomainObjPtr vm,
+                           virStreamPtr st,
+                           int sock,
+                           unsigned long resource)
+{
+    qemuMigrationTunnel tunnel;
+    virThread reader;
+    bool haveLock = false, haveCond = false, haveReader = false;
+    bool streamFailed = false;
+    virErrorPtr orig_err;
+    unsigned long long elapsed;
+    int i = 0;
+    int ret = -1;
+
+    memset(&tunnel, 0, sizeof(tunnel));
+    tunnel.sock = sock;
+    tunnel.start = qemuMigrationTunnelNow();
+    if (resource > 0)
+        qemuMigrationTunnelSetRate(&tunnel, resource);
+
+    for (i = 0 ; i < TUNNEL_SEND_BUF_COUNT ; i++) {
+        if (VIR_ALLOC_N(tunnel.bufs[i].data, TUNNEL_SEND_BUF_SIZE) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+    }
+    i = 0;
+
+    if (virMutexInit(&tunnel.lock) < 0) {
+        virReportSystemError(errno, "%s", _("Unable to initialize mutex"));
+        goto cleanup;
+    }
+    haveLock = true;
+    if (virCondInit(&tunnel.cond) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to initialize condition variable"));
+        goto cleanup;
+    }
+    haveCond = true;
+
+    if (virThreadCreate(&reader, true, qemuMigrationTunnelReader,
+                        &tunnel) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to create tunnelled migration thread"));
+        goto cleanup;
+    }
+    haveReader = true;
+
+    for (;;) {
+        struct qemuMigrationTunnelBuf *buf = &tunnel.bufs[i];
+
+        virMutexLock(&tunnel.lock);
+        if (!buf->full && !tunnel.eof) {
+            unsigned long long then = qemuMigrationTunnelNow();
+
+            while (!buf->full && !tunnel.eof)
+                ignore_value(virCondWait(&tunnel.cond, &tunnel.lock));
+            tunnel.starved += qemuMigrationTunnelNow() - then;
+        }
+        if (!buf->full) {
+            int err = tunnel.err;
+
+            virMutexUnlock(&tunnel.lock);
+            if (err) {
+                virReportSystemError(err, "%s",
+                                     _("tunnelled migration failed to read from qemu"));
+                goto cleanup;
+            }
             /* EOF; get out of here */
             break;
+        }
+        virMutexUnlock(&tunnel.lock);
+
+        qemuMigrationTunnelThrottle(&tunnel, buf->len);
 
-        if (virStreamSend(st, buffer, nbytes) < 0) {
+        if (virStreamSend(st, buf->data, buf->len) < 0) {
             qemuReportError(VIR_ERR_OPERATION_FAILED, "%s",
                             _("Failed to write migration data to remote libvirtd"));
-            VIR_FREE(buffer);
-            return -1;
+            streamFailed = true;
+            goto cleanup;
         }
-    }
+        tunnel.bytes += buf->len;
 
-    VIR_FREE(buffer);
+        virMutexLock(&tunnel.lock);
+        buf->full = false;
+        virCondSignal(&tunnel.cond);
+        virMutexUnlock(&tunnel.lock);
 
-    if (virStreamFinish(st) < 0)
+        i = (i + 1) % TUNNEL_SEND_BUF_COUNT;
+
+        if (qemuMigrationTunnelUpdateJob(vm, &tunnel) < 0)
+            goto cleanup;
+    }
+
+    if (virStreamFinish(st) < 0) {
         /* virStreamFinish set the error for us */
-        return -1;
+        streamFailed = true;
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    if (haveReader) {
+        /* Unblock a reader still waiting for QEMU */
+        virMutexLock(&tunnel.lock);
+        tunnel.quit = true;
+        virCondSignal(&tunnel.cond);
+        virMutexUnlock(&tunnel.lock);
+        shutdown(sock, SHUT_RDWR);
+        virThreadJoin(&reader);
+    }
+    /* A stream that failed to send or finish is already finished
+     * with; only abort one we are giving up on ourselves, keeping
+     * the error that made us give up */
+    if (ret < 0 && !streamFailed) {
+        orig_err = virSaveLastError();
+        virStreamAbort(st);
+        if (orig_err) {
+            virSetError(orig_err);
+            virFreeError(orig_err);
+        }
+    }
+
+    elapsed = qemuMigrationTunnelNow() - tunnel.start;
+    VIR_INFO("Tunnelled %llu bytes in %llums (%llu KiB/s), "
+              "%llums throttled, %llums waiting for qemu",
+              tunnel.bytes, elapsed,
+              elapsed ? tunnel.bytes * 1000 / elapsed / 1024 : 0,
+              tunnel.throttled, tunnel.starved);
 
-    return 0;
+    if (haveCond)
+        ignore_value(virCondDestroy(&tunnel.cond));
+    if (haveLock)
+        virMutexDestroy(&tunnel.lock);
+    for (i = 0 ; i < TUNNEL_SEND_BUF_COUNT ; i++)
+        VIR_FREE(tunnel.bufs[i].data);
+
+    return ret;
 }
 
 static int doTunnelMigrate(struct qemud_driver *driver,
@@ -869,7 +1219,9 @@ static int doTunnelMigrate(struct qemud_driver *driver,
         goto cancel;
     }
 
-    retval = doTunnelSendAll(st, client_sock);
+    qemuDomainObjEnterRemoteWithDriver(driver, vm);
+    retval = doTunnelSendAll(vm, st, client_sock, resource);
+    qemuDomainObjExitRemoteWithDriver(driver, vm);
 
 cancel:
     if (retval != 0 && virDomainObjIsActive(vm)) {
@@ -1317,6 +1669,20 @@ qemuMigrationToFile(struct qemud_driver *driver, virDomainObjPtr vm,
          * has to popen() the file by name.  We might also stumble on
          * a race present in some qemu versions where it does a wait()
          * that botches pclose.  */
+        if (compressor && STREQ(compressor, VIR_IOHELPER_ZLIB)) {
+            /* libvirt_iohelper must run as a child of libvirtd; letting
+             * qemu exec it would run it under the domain's security
+             * label, which is not allowed to execute it.  */
+            if (qemuCaps && qemuCapsGet(qemuCaps, QEMU_CAPS_MIGRATE_QEMU_FD))
+                virReportSystemError(errno, "%s",
+                                     _("Unable to create pipe"));
+            else
+                qemuReportError(VIR_ERR_OPERATION_INVALID, "%s",
+                                _("zlib compression requires a QEMU binary "
+                                  "capable of migrating to a file "
+                                  "descriptor"));
+            goto cleanup;
+        }
         if (!is_reg &&
             qemuCgroupControllerActive(driver,
                                        VIR_CGROUP_CONTROLLER_DEVICES)) {
@@ -1363,8 +1729,14 @@ qemuMigrationToFile(struct qemud_driver *driver, virDomainObjPtr vm,
         const char *args[] = {
             prog,
             "-c",
+            NULL,
             NULL
         };
+        if (STREQ(compressor, VIR_IOHELPER_ZLIB)) {
+            args[0] = LIBEXECDIR "/libvirt_iohelper";
+            args[1] = VIR_IOHELPER_ZLIB;
+            args[2] = "-c";
+        }
         if (pipeFD[0] != -1) {
             cmd = virCommandNewArgs(args);
             virCommandSetInputFD(cmd, pipeFD[0]);
@@ -894,6 +894,16 @@ int qemuMonitorEmitGraphics(qemuMonitorPtr mon,
 }
 
 
+int qemuMonitorEmitMigrationStatus(qemuMonitorPtr mon, int status)
+{
+    int ret = -1;
+    VIR_DEBUG("mon=%p status=%d", mon, status);
+
+    QEMU_MONITOR_CALLBACK(mon, ret, domainMigrationStatus, mon->vm, status);
+    return ret;
+}
+
+
 
 int qemuMonitorSetCapabilities(qemuMonitorPtr mon)
 {
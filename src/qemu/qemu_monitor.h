@@ -112,6 +112,10 @@ struct _qemuMonitorCallbacks {
                           const char *authScheme,
                           const char *x509dname,
                           const char *saslUsername);
+    /* @status is a qemuMonitorMigrationStatus, or -1 if unknown */
+    int (*domainMigrationStatus)(qemuMonitorPtr mon,
+                                 virDomainObjPtr vm,
+                                 int status);
 };
 
 
@@ -173,6 +177,7 @@ int qemuMonitorEmitGraphics(qemuMonitorPtr mon,
                             const char *authScheme,
                             const char *x509dname,
                             const char *saslUsername);
+int qemuMonitorEmitMigrationStatus(qemuMonitorPtr mon, int status);
 
 
 int qemuMonitorStartCPUs(qemuMonitorPtr mon,
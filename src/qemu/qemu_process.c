@@ -135,6 +135,10 @@ qemuProcessHandleMonitorEOF(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
     qemuProcessStop(driver, vm, 0);
     qemuAuditDomainStop(vm, hasError ? "failed" : "shutdown");
 
+    /* A migration, save or dump has no need to wait for its next
+     * poll to notice */
+    qemuDomainJobProgressWakeup(priv);
+
     if (!vm->persistent)
         virDomainRemoveInactive(&driver->domains, vm);
     else
@@ -340,6 +344,10 @@ qemuProcessHandleStop(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
     virDomainEventPtr event = NULL;
 
     virDomainObjLock(vm);
+    /* QEMU stops the guest for the final stage of a migration,
+     * which should complete shortly */
+    qemuDomainJobProgressWakeup(vm->privateData);
+
     if (vm->state == VIR_DOMAIN_RUNNING) {
         VIR_DEBUG("Transitioned guest %s to paused state due to unknown event",
                   vm->def->name);
@@ -428,7 +436,8 @@ qemuProcessHandleWatchdog(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
         if (VIR_ALLOC(wdEvent) == 0) {
             wdEvent->action = VIR_DOMAIN_WATCHDOG_ACTION_DUMP;
             wdEvent->vm = vm;
-            ignore_value(virThreadPoolSendJob(driver->workerPool, wdEvent));
+            if (virThreadPoolSendJob(driver->workerPool, wdEvent) < 0)
+                VIR_FREE(wdEvent);
         } else
             virReportOOMError();
     }
@@ -610,6 +619,23 @@ static void qemuProcessHandleMonitorDestroy(qemuMonitorPtr mon,
         virDomainObjUnlock(vm);
 }
 
+static int
+qemuProcessHandleMigrationStatus(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
+                                 virDomainObjPtr vm,
+                                 int status)
+{
+    VIR_DEBUG("Migration of domain %s changed state to %s", vm->def->name,
+              status >= 0 ? qemuMonitorMigrationStatusTypeToString(status)
+                          : "unknown");
+
+    virDomainObjLock(vm);
+    qemuDomainJobProgressWakeup(vm->privateData);
+    virDomainObjUnlock(vm);
+
+    return 0;
+}
+
+
 static qemuMonitorCallbacks monitorCallbacks = {
     .destroy = qemuProcessHandleMonitorDestroy,
     .eofNotify = qemuProcessHandleMonitorEOF,
@@ -621,12 +647,14 @@ static qemuMonitorCallbacks monitorCallbacks = {
     .domainWatchdog = qemuProcessHandleWatchdog,
     .domainIOError = qemuProcessHandleIOError,
     .domainGraphics = qemuProcessHandleGraphics,
+    .domainMigrationStatus = qemuProcessHandleMigrationStatus,
 };
 
 static int
 qemuConnectMonitor(struct qemud_driver *driver, virDomainObjPtr vm)
 {
     qemuDomainObjPrivatePtr priv = vm->privateData;
+    qemuMonitorPtr mon;
     int ret = -1;
 
     if (virSecurityManagerSetSocketLabel(driver->securityManager, vm) < 0) {
@@ -639,14 +667,29 @@ qemuConnectMonitor(struct qemud_driver *driver, virDomainObjPtr vm)
      * deleted while the monitor is active */
     virDomainObjRef(vm);
 
-    priv->mon = qemuMonitorOpen(vm,
-                                priv->monConfig,
-                                priv->monJSON,
-                                &monitorCallbacks);
+    /* Opening the monitor may wait seconds for QEMU to create its
+     * socket, so don't hold up other domains meanwhile; reconnecting
+     * at startup relies on this to handle guests in parallel */
+    virDomainObjUnlock(vm);
+    qemuDriverUnlock(driver);
+
+    mon = qemuMonitorOpen(vm,
+                          priv->monConfig,
+                          priv->monJSON,
+                          &monitorCallbacks);
+
+    qemuDriverLock(driver);
+    virDomainObjLock(vm);
 
     /* Safe to ignore value since ref count was incremented above */
-    if (priv->mon == NULL)
+    if (mon == NULL) {
         ignore_value(virDomainObjUnref(vm));
+    } else if (!virDomainObjIsActive(vm)) {
+        /* The guest went away while we were unlocked */
+        qemuMonitorClose(mon);
+        mon = NULL;
+    }
+    priv->mon = mon;
 
     if (virSecurityManagerClearSocketLabel(driver->securityManager, vm) < 0) {
         VIR_ERROR(_("Failed to clear security context for monitor for %s"),
@@ -753,7 +796,8 @@ typedef int qemuProcessLogHandleOutput(virDomainObjPtr vm,
  * Returns -1 for error, 0 on success
  */
 static int
-qemuProcessReadLogOutput(virDomainObjPtr vm,
+qemuProcessReadLogOutput(struct qemud_driver *driver,
+                         virDomainObjPtr vm,
                          int fd,
                          char *buf,
                          size_t buflen,
@@ -830,7 +874,10 @@ qemuProcessReadLogOutput(virDomainObjPtr vm,
             goto cleanup;
         }
 
+        /* Let other guests start meanwhile; the job keeps vm safe */
+        qemuDomainObjEnterRemoteWithDriver(driver, vm);
         usleep(100*1000);
+        qemuDomainObjExitRemoteWithDriver(driver, vm);
         retries--;
     }
 
@@ -1049,7 +1096,7 @@ qemuProcessWaitForMonitor(struct qemud_driver* driver,
         return -1;
     }
 
-    if (qemuProcessReadLogOutput(vm, logfd, buf, buf_size,
+    if (qemuProcessReadLogOutput(driver, vm, logfd, buf, buf_size,
                                  qemuProcessFindCharDevicePTYs,
                                  "console", 30) < 0)
         goto closelog;
@@ -2025,6 +2072,10 @@ error:
     }
 }
 
+/* Most of the time reconnecting is spent waiting on monitors, so
+ * guests are handled a few at a time */
+#define QEMU_RECONNECT_MAX_WORKERS 16
+
 /**
  * qemuProcessReconnectAll
  *
@@ -2035,7 +2086,8 @@ void
 qemuProcessReconnectAll(virConnectPtr conn, struct qemud_driver *driver)
 {
     struct qemuProcessReconnectData data = {conn, driver};
-    virHashForEach(driver->domains.objs, qemuProcessReconnect, &data);
+    qemuDomainObjForEachParallel(driver, QEMU_RECONNECT_MAX_WORKERS,
+                                 qemuProcessReconnect, &data);
 }
 
 int qemuProcessStart(virConnectPtr conn,
@@ -2079,7 +2131,8 @@ int qemuProcessStart(virConnectPtr conn,
     if (virDomainObjSetDefTransient(driver->caps, vm, true) < 0)
         goto cleanup;
 
-    vm->def->id = driver->nextvmid++;
+    if (virDomainObjListSetID(&driver->domains, vm, driver->nextvmid++) < 0)
+        goto cleanup;
 
     /* Run an early hook to set-up missing devices */
     if (virHookPresent(VIR_HOOK_DRIVER_QEMU)) {
@@ -2588,7 +2641,7 @@ retry:
     }
 
     vm->pid = -1;
-    vm->def->id = -1;
+    virDomainObjListClearID(&driver->domains, vm);
     vm->state = VIR_DOMAIN_SHUTOFF;
     VIR_FREE(priv->vcpupids);
     priv->nvcpupids = 0;
@@ -2609,6 +2662,7 @@ retry:
         vm->def->id = -1;
         vm->newDef = NULL;
     }
+    virDomainObjInvalidateXML(vm);
 
     if (orig_err) {
         virSetError(orig_err);
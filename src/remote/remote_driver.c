@@ -44,6 +44,7 @@
 # include <net/if.h>
 # include <netinet/in.h>
 # include <netinet/tcp.h>
+# include <sys/uio.h>
 #endif
 
 #ifdef HAVE_PWD_H
@@ -107,6 +108,12 @@ struct remote_thread_call {
     unsigned int bufferLength;
     unsigned int bufferOffset;
 
+    /* Stream data written out after the packet above, straight
+     * from the caller's buffer. Already counted in the length word */
+    const char *payload;
+    unsigned int payloadLength;
+    unsigned int payloadOffset;
+
     unsigned int serial;
     unsigned int proc_nr;
 
@@ -121,8 +128,16 @@ struct remote_thread_call {
     struct remote_thread_call *next;
 };
 
+/* A hole in a sparse stream, which comes before the data
+ * at 'offset' in the stream's incoming buffer */
+struct private_stream_hole {
+    unsigned int offset;
+    long long length;
+};
+
 struct private_stream_data {
     unsigned int has_error : 1;
+    unsigned int sparse : 1;
     remote_error err;
 
     unsigned int serial;
@@ -142,9 +157,14 @@ struct private_stream_data {
      * time....
      */
     char *incoming;
+    unsigned int incomingStart;  /* Data already handed to the app */
     unsigned int incomingOffset;
     unsigned int incomingLength;
 
+    /* Holes not yet handed to the app, in stream order */
+    struct private_stream_hole *holes;
+    size_t nholes;
+
     struct private_stream_data *next;
 };
 
@@ -179,11 +199,16 @@ struct private_data {
 #endif
 
     /* Buffer for incoming data packets
-     * 4 byte length, followed by RPC message header+body */
-    char buffer[4 + REMOTE_MESSAGE_MAX];
+     * 4 byte length, followed by RPC message header+body.
+     * Grown on demand up to 4 + REMOTE_STREAM_MESSAGE_MAX */
+    char *buffer;
+    unsigned int bufferSize;
     unsigned int bufferLength;
     unsigned int bufferOffset;
 
+    /* Whether the server takes REMOTE_STREAM_MESSAGE_MAX frames */
+    int streamFrames;
+
     /* The list of domain event callbacks */
     virDomainEventCallbackListPtr callbackList;
     /* The queue of domain events generated
@@ -352,6 +377,37 @@ enum virDrvOpenRemoteFlags {
 };
 
 
+static void
+remoteNegotiateStreamFrames(virConnectPtr conn, struct private_data *priv)
+{
+    remote_supports_feature_args args;
+    remote_supports_feature_ret ret;
+
+    /* SASL layers encode each message in one go, so keep those
+     * connections on the ordinary message size */
+#if HAVE_SASL
+    if (priv->saslconn)
+        return;
+#endif
+
+    args.feature = VIR_DRV_FEATURE_REMOTE_STREAM_FRAMES;
+
+    /* Older daemons pass this on to the hypervisor driver, which
+     * will either deny all knowledge of it, or fail outright */
+    memset (&ret, 0, sizeof ret);
+    if (call (conn, priv, REMOTE_CALL_IN_OPEN, REMOTE_PROC_SUPPORTS_FEATURE,
+              (xdrproc_t) xdr_remote_supports_feature_args, (char *) &args,
+              (xdrproc_t) xdr_remote_supports_feature_ret, (char *) &ret) == -1) {
+        virResetLastError();
+        return;
+    }
+
+    priv->streamFrames = ret.supported > 0;
+    VIR_DEBUG("Large stream frames %s",
+              priv->streamFrames ? "enabled" : "not supported");
+}
+
+
 /*
  * URIs that this driver needs to handle:
  *
@@ -913,6 +969,8 @@ doRemoteOpen (virConnectPtr conn,
         }
     }
 
+    remoteNegotiateStreamFrames(conn, priv);
+
     if(VIR_ALLOC(priv->callbackList)<0) {
         virReportOOMError();
         goto failed;
@@ -998,6 +1056,9 @@ retry:
     VIR_FORCE_CLOSE(wakeupFD[0]);
     VIR_FORCE_CLOSE(wakeupFD[1]);
 
+    VIR_FREE(priv->buffer);
+    priv->bufferSize = priv->bufferLength = priv->bufferOffset = 0;
+
     VIR_FREE(priv->hostname);
     goto cleanup;
 }
@@ -1600,6 +1661,8 @@ retry:
     /* See comment for remoteType. */
     VIR_FREE(priv->type);
 
+    VIR_FREE(priv->buffer);
+
     /* Free callback list */
     virDomainEventCallbackListFree(priv->callbackList);
 
@@ -1645,6 +1708,10 @@ remoteSupportsFeature (virConnectPtr conn, int feature)
         rv = 1;
         goto done;
     }
+    if (feature == VIR_DRV_FEATURE_REMOTE_STREAM_FRAMES) {
+        rv = priv->streamFrames;
+        goto done;
+    }
 
     args.feature = feature;
 
@@ -8526,8 +8593,9 @@ remoteStreamEventTimerUpdate(struct private_stream_data *privst)
     if (!privst->cb)
         return;
 
-    VIR_DEBUG("Check timer offset=%d %d", privst->incomingOffset, privst->cbEvents);
-    if ((privst->incomingOffset &&
+    VIR_DEBUG("Check timer offset=%d holes=%zu %d",
+              privst->incomingOffset, privst->nholes, privst->cbEvents);
+    if (((privst->incomingOffset || privst->nholes) &&
          (privst->cbEvents & VIR_STREAM_EVENT_READABLE)) ||
         (privst->cbEvents & VIR_STREAM_EVENT_WRITABLE)) {
         VIR_DEBUG0("Enabling event timer");
@@ -8539,18 +8607,25 @@ remoteStreamEventTimerUpdate(struct private_stream_data *privst)
 }
 
 
+/*
+ * Sends a stream packet with @status. Data packets carry @data,
+ * or a hole if @hole is non-NULL.
+ */
 static int
 remoteStreamPacket(virStreamPtr st,
                    int status,
                    const char *data,
-                   size_t nbytes)
+                   size_t nbytes,
+                   remote_stream_hole *hole)
 {
-    VIR_DEBUG("st=%p status=%d data=%p nbytes=%zu", st, status, data, nbytes);
+    VIR_DEBUG("st=%p status=%d data=%p nbytes=%zu hole=%p",
+              st, status, data, nbytes, hole);
     struct private_data *priv = st->conn->privateData;
     struct private_stream_data *privst = st->privateData;
     XDR xdr;
     struct remote_thread_call *thiscall;
     remote_message_header hdr;
+    unsigned int len;
     int ret;
 
     memset(&hdr, 0, sizeof hdr);
@@ -8580,7 +8655,7 @@ remoteStreamPacket(virStreamPtr st,
     hdr.prog = REMOTE_PROGRAM;
     hdr.vers = REMOTE_PROTOCOL_VERSION;
     hdr.proc = privst->proc_nr;
-    hdr.type = REMOTE_STREAM;
+    hdr.type = hole ? REMOTE_STREAM_HOLE : REMOTE_STREAM;
     hdr.serial = privst->serial;
     hdr.status = status;
 
@@ -8599,23 +8674,34 @@ remoteStreamPacket(virStreamPtr st,
         goto error;
     }
 
+    if (hole &&
+        !xdr_remote_stream_hole (&xdr, hole)) {
+        remoteError(VIR_ERR_RPC, "%s", _("marshalling remote_stream_hole"));
+        goto error;
+    }
+
     thiscall->bufferLength += xdr_getpos (&xdr);
     xdr_destroy (&xdr);
 
-    if (status == REMOTE_CONTINUE) {
-        if (((4 + REMOTE_MESSAGE_MAX) - thiscall->bufferLength) < nbytes) {
-            remoteError(VIR_ERR_RPC, _("data size %zu too large for payload %d"),
-                        nbytes, ((4 + REMOTE_MESSAGE_MAX) - thiscall->bufferLength));
-            goto error;
-        }
+    /* The data itself is written out straight from the caller's
+     * buffer after the header. Anything which does not fit in one
+     * packet is left for the caller to send again, as with any
+     * short write. */
+    if (status == REMOTE_CONTINUE && !hole) {
+        unsigned int max = 4 + (priv->streamFrames ?
+                                REMOTE_STREAM_MESSAGE_MAX : REMOTE_MESSAGE_MAX);
+
+        if (nbytes > max - thiscall->bufferLength)
+            nbytes = max - thiscall->bufferLength;
 
-        memcpy(thiscall->buffer + thiscall->bufferLength, data, nbytes);
-        thiscall->bufferLength += nbytes;
+        thiscall->payload = data;
+        thiscall->payloadLength = nbytes;
     }
 
     /* Go back to packet start and encode the length word. */
+    len = thiscall->bufferLength + thiscall->payloadLength;
     xdrmem_create (&xdr, thiscall->buffer, REMOTE_MESSAGE_HEADER_XDR_LEN, XDR_ENCODE);
-    if (!xdr_u_int (&xdr, &thiscall->bufferLength)) {
+    if (!xdr_u_int (&xdr, &len)) {
         remoteError(VIR_ERR_RPC, "%s", _("xdr_u_int (length word)"));
         goto error;
     }
@@ -8680,6 +8766,8 @@ remoteStreamRelease(virStreamPtr st)
     if (privst->has_error)
         xdr_free((xdrproc_t)xdr_remote_error,  (char *)&privst->err);
 
+    VIR_FREE(privst->incoming);
+    VIR_FREE(privst->holes);
     VIR_FREE(privst);
 
     st->driver = NULL;
@@ -8704,7 +8792,8 @@ remoteStreamSend(virStreamPtr st,
     rv = remoteStreamPacket(st,
                             REMOTE_CONTINUE,
                             data,
-                            nbytes);
+                            nbytes,
+                            NULL);
 
 cleanup:
     if (rv == -1)
@@ -8717,21 +8806,116 @@ cleanup:
 
 
 static int
-remoteStreamRecv(virStreamPtr st,
-                 char *data,
-                 size_t nbytes)
+remoteStreamSendHole(virStreamPtr st,
+                     long long length,
+                     unsigned int flags)
 {
-    VIR_DEBUG("st=%p data=%p nbytes=%zu", st, data, nbytes);
+    VIR_DEBUG("st=%p length=%lld flags=%x", st, length, flags);
     struct private_data *priv = st->conn->privateData;
     struct private_stream_data *privst = st->privateData;
+    remote_stream_hole hole;
     int rv = -1;
 
+    virCheckFlags(0, -1);
+
     remoteDriverLock(priv);
 
     if (remoteStreamHasError(st))
         goto cleanup;
 
-    if (!privst->incomingOffset) {
+    if (!privst->sparse) {
+        remoteError(VIR_ERR_OPERATION_INVALID, "%s",
+                    _("stream does not support holes"));
+        goto cleanup;
+    }
+
+    hole.length = length;
+    hole.flags = flags;
+
+    if (remoteStreamPacket(st,
+                           REMOTE_CONTINUE,
+                           NULL,
+                           0,
+                           &hole) < 0)
+        goto cleanup;
+
+    rv = 0;
+
+cleanup:
+    if (rv == -1)
+        remoteStreamRelease(st);
+
+    remoteDriverUnlock(priv);
+
+    return rv;
+}
+
+
+/*
+ * Drops the data the app has already read from the incoming
+ * buffer, keeping the holes in step with what is left.
+ */
+static void
+remoteStreamCompactIncoming(struct private_stream_data *privst)
+{
+    size_t i;
+
+    if (!privst->incomingStart)
+        return;
+
+    memmove(privst->incoming,
+            privst->incoming + privst->incomingStart,
+            privst->incomingOffset - privst->incomingStart);
+    privst->incomingOffset -= privst->incomingStart;
+    for (i = 0 ; i < privst->nholes ; i++)
+        privst->holes[i].offset -= privst->incomingStart;
+    privst->incomingStart = 0;
+}
+
+
+/*
+ * Returns true if the app has read all the data before the
+ * first hole, so the stream is positioned at it
+ */
+static bool
+remoteStreamAtHole(struct private_stream_data *privst)
+{
+    return privst->nholes &&
+        privst->holes[0].offset == privst->incomingStart;
+}
+
+
+static void
+remoteStreamDropHole(struct private_stream_data *privst)
+{
+    privst->nholes--;
+    if (privst->nholes)
+        memmove(privst->holes, privst->holes + 1,
+                sizeof(*privst->holes) * privst->nholes);
+    else
+        VIR_FREE(privst->holes);
+}
+
+
+static int
+remoteStreamRecvFlags(virStreamPtr st,
+                      char *data,
+                      size_t nbytes,
+                      unsigned int flags)
+{
+    VIR_DEBUG("st=%p data=%p nbytes=%zu flags=%x", st, data, nbytes, flags);
+    struct private_data *priv = st->conn->privateData;
+    struct private_stream_data *privst = st->privateData;
+    int rv = -1;
+
+    virCheckFlags(VIR_STREAM_RECV_STOP_AT_HOLE, -1);
+
+    remoteDriverLock(priv);
+
+    if (remoteStreamHasError(st))
+        goto cleanup;
+
+    if (!privst->incomingOffset && !privst->nholes) {
         struct remote_thread_call *thiscall;
         int ret;
 
@@ -8767,19 +8951,33 @@ remoteStreamRecv(virStreamPtr st,
             goto cleanup;
     }
 
-    VIR_DEBUG("After IO %d", privst->incomingOffset);
-    if (privst->incomingOffset) {
-        int want = privst->incomingOffset;
-        if (want > nbytes)
-            want = nbytes;
-        memcpy(data, privst->incoming, want);
-        if (want < privst->incomingOffset) {
-            memmove(privst->incoming, privst->incoming + want, privst->incomingOffset - want);
-            privst->incomingOffset -= want;
+    VIR_DEBUG("After IO %d holes=%zu", privst->incomingOffset, privst->nholes);
+    if (remoteStreamAtHole(privst)) {
+        if (flags & VIR_STREAM_RECV_STOP_AT_HOLE) {
+            rv = 0;
         } else {
-            VIR_FREE(privst->incoming);
-            privst->incomingOffset = privst->incomingLength = 0;
+            /* The app wants the hole as zeros */
+            struct private_stream_hole *hole = &privst->holes[0];
+            int want = nbytes;
+            if (want > hole->length)
+                want = hole->length;
+            memset(data, 0, want);
+            hole->length -= want;
+            if (hole->length == 0)
+                remoteStreamDropHole(privst);
+            rv = want;
         }
+    } else if (privst->incomingOffset) {
+        int want = privst->incomingOffset - privst->incomingStart;
+        if (privst->nholes)
+            want = privst->holes[0].offset - privst->incomingStart;
+        if (want > nbytes)
+            want = nbytes;
+        memcpy(data, privst->incoming + privst->incomingStart, want);
+        privst->incomingStart += want;
+        /* Keep the buffer around for the next packet */
+        if (privst->incomingStart == privst->incomingOffset)
+            remoteStreamCompactIncoming(privst);
         rv = want;
     } else {
         rv = 0;
@@ -8798,6 +8996,53 @@ cleanup:
 }
 
 
+static int
+remoteStreamRecv(virStreamPtr st,
+                 char *data,
+                 size_t nbytes)
+{
+    return remoteStreamRecvFlags(st, data, nbytes, 0);
+}
+
+
+static int
+remoteStreamRecvHole(virStreamPtr st,
+                     long long *length,
+                     unsigned int flags)
+{
+    VIR_DEBUG("st=%p length=%p flags=%x", st, length, flags);
+    struct private_data *priv = st->conn->privateData;
+    struct private_stream_data *privst = st->privateData;
+    int rv = -1;
+
+    virCheckFlags(0, -1);
+
+    remoteDriverLock(priv);
+
+    if (remoteStreamHasError(st))
+        goto cleanup;
+
+    /* remoteStreamRecvFlags has already waited for whatever
+     * comes next, so there's nothing to read here */
+    *length = 0;
+    if (remoteStreamAtHole(privst)) {
+        *length = privst->holes[0].length;
+        remoteStreamDropHole(privst);
+    }
+
+    remoteStreamEventTimerUpdate(privst);
+
+    rv = 0;
+
+cleanup:
+    if (rv == -1)
+        remoteStreamRelease(st);
+    remoteDriverUnlock(priv);
+
+    return rv;
+}
+
+
 static void
 remoteStreamEventTimer(int timer ATTRIBUTE_UNUSED, void *opaque)
 {
@@ -8959,7 +9204,8 @@ remoteStreamFinish(virStreamPtr st)
     ret = remoteStreamPacket(st,
                              REMOTE_OK,
                              NULL,
-                             0);
+                             0,
+                             NULL);
 
 cleanup:
     remoteStreamRelease(st);
@@ -8982,7 +9228,8 @@ remoteStreamAbort(virStreamPtr st)
     ret = remoteStreamPacket(st,
                              REMOTE_ERROR,
                              NULL,
-                             0);
+                             0,
+                             NULL);
 
 cleanup:
     remoteStreamRelease(st);
@@ -8995,7 +9242,10 @@ cleanup:
 
 static virStreamDriver remoteStreamDrv = {
     .streamRecv = remoteStreamRecv,
+    .streamRecvFlags = remoteStreamRecvFlags,
+    .streamRecvHole = remoteStreamRecvHole,
     .streamSend = remoteStreamSend,
+    .streamSendHole = remoteStreamSendHole,
     .streamFinish = remoteStreamFinish,
     .streamAbort = remoteStreamAbort,
     .streamAddCallback = remoteStreamEventAddCallback,
@@ -9624,6 +9874,9 @@ remoteStorageVolUpload(virStorageVolPtr vol,
                                     priv->counter)))
         goto done;
 
+    if (flags & VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM)
+        privst->sparse = 1;
+
     st->driver = &remoteStreamDrv;
     st->privateData = privst;
 
@@ -9667,6 +9920,9 @@ remoteStorageVolDownload(virStorageVolPtr vol,
                                     priv->counter)))
         goto done;
 
+    if (flags & VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM)
+        privst->sparse = 1;
+
     st->driver = &remoteStreamDrv;
     st->privateData = privst;
 
@@ -9730,6 +9986,198 @@ done:
 
 }
 
+/*
+ * Make one REMOTE_PROC_CONNECT_GET_ALL_DOMAIN_STATS call and append the
+ * records it returns to @records, which is kept NULL terminated so that
+ * it can be freed at any point. Sets @more and @last from the reply.
+ */
+static int
+remoteConnectGetDomainStatsPage(virConnectPtr conn,
+                                struct private_data *priv,
+                                remote_connect_get_all_domain_stats_args *args,
+                                virDomainStatsRecordPtr **records,
+                                size_t *nrecords,
+                                int *more,
+                                unsigned char *last)
+{
+    int rv = -1;
+    remote_connect_get_all_domain_stats_ret ret;
+    int i, j;
+
+    memset(&ret, 0, sizeof ret);
+
+    if (call (conn, priv, 0, REMOTE_PROC_CONNECT_GET_ALL_DOMAIN_STATS,
+              (xdrproc_t) xdr_remote_connect_get_all_domain_stats_args, (char *) args,
+              (xdrproc_t) xdr_remote_connect_get_all_domain_stats_ret, (char *) &ret) == -1)
+        return -1;
+
+    if (ret.retStats.retStats_len > REMOTE_DOMAIN_STATS_RECORDS_MAX) {
+        remoteError(VIR_ERR_RPC, "%s",
+                    _("remoteConnectGetAllDomainStats: "
+                      "returned number of records exceeds limit"));
+        goto cleanup;
+    }
+
+    if (VIR_REALLOC_N(*records, *nrecords + ret.retStats.retStats_len + 1) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+    memset(*records + *nrecords, 0,
+           sizeof(**records) * (ret.retStats.retStats_len + 1));
+
+    for (i = 0 ; i < ret.retStats.retStats_len ; i++) {
+        remote_domain_stats_record *src = &ret.retStats.retStats_val[i];
+        virDomainStatsRecordPtr rec;
+
+        if (src->params.params_len > REMOTE_DOMAIN_STATS_PARAMS_MAX) {
+            remoteError(VIR_ERR_RPC, "%s",
+                        _("remoteConnectGetAllDomainStats: "
+                          "returned number of parameters exceeds limit"));
+            goto cleanup;
+        }
+
+        if (VIR_ALLOC(rec) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+        (*records)[(*nrecords)++] = rec;
+
+        if (!(rec->dom = get_nonnull_domain(conn, src->dom)))
+            goto cleanup;
+
+        if (VIR_ALLOC_N(rec->params, src->params.params_len) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+
+        for (j = 0 ; j < src->params.params_len ; j++) {
+            remote_domain_stats_param *val = &src->params.params_val[j];
+            virDomainStatsParamPtr param = &rec->params[j];
+
+            if (virStrcpyStatic(param->field, val->field) == NULL) {
+                remoteError(VIR_ERR_INTERNAL_ERROR,
+                            _("Parameter %s too big for destination"),
+                            val->field);
+                goto cleanup;
+            }
+            param->type = val->value.type;
+            switch (param->type) {
+            case VIR_DOMAIN_STATS_PARAM_INT:
+                param->value.i = val->value.remote_domain_stats_param_value_u.i;
+                break;
+            case VIR_DOMAIN_STATS_PARAM_UINT:
+                param->value.ui = val->value.remote_domain_stats_param_value_u.ui;
+                break;
+            case VIR_DOMAIN_STATS_PARAM_LLONG:
+                param->value.l = val->value.remote_domain_stats_param_value_u.l;
+                break;
+            case VIR_DOMAIN_STATS_PARAM_ULLONG:
+                param->value.ul = val->value.remote_domain_stats_param_value_u.ul;
+                break;
+            case VIR_DOMAIN_STATS_PARAM_DOUBLE:
+                param->value.d = val->value.remote_domain_stats_param_value_u.d;
+                break;
+            case VIR_DOMAIN_STATS_PARAM_BOOLEAN:
+                param->value.b = val->value.remote_domain_stats_param_value_u.b;
+                break;
+            case VIR_DOMAIN_STATS_PARAM_STRING:
+                /* Steal the string, xdr_free skips it once NULL */
+                param->value.s = val->value.remote_domain_stats_param_value_u.s;
+                val->value.remote_domain_stats_param_value_u.s = NULL;
+                break;
+            default:
+                remoteError(VIR_ERR_RPC, "%s",
+                            _("remoteConnectGetAllDomainStats: "
+                              "unknown parameter type"));
+                goto cleanup;
+            }
+            rec->nparams++;
+        }
+    }
+
+    *more = ret.more;
+    memcpy(last, ret.last, VIR_UUID_BUFLEN);
+    rv = 0;
+
+cleanup:
+    xdr_free ((xdrproc_t) xdr_remote_connect_get_all_domain_stats_ret,
+              (char *) &ret);
+    return rv;
+}
+
+static int
+remoteConnectGetAllDomainStats(virConnectPtr conn,
+                               virDomainPtr *doms,
+                               unsigned int ndoms,
+                               unsigned int stats,
+                               virDomainStatsRecordPtr **retStats,
+                               unsigned int flags)
+{
+    int rv = -1;
+    remote_connect_get_all_domain_stats_args args;
+    virDomainStatsRecordPtr *records = NULL;
+    size_t nrecords = 0;
+    int more = 0;
+    unsigned int i, n;
+    struct private_data *priv = conn->privateData;
+
+    memset(&args, 0, sizeof args);
+
+    remoteDriverLock(priv);
+
+    args.stats = stats;
+    args.flags = flags;
+
+    /* Neither the domain list nor the records need fit in one message,
+     * so send long lists in chunks and page through all domains */
+    if (ndoms) {
+        if (VIR_ALLOC_N(args.doms.doms_val,
+                        MIN(ndoms, REMOTE_DOMAIN_STATS_DOMAINS_MAX)) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+
+        for (i = 0 ; i < ndoms ; i += n) {
+            n = MIN(ndoms - i, REMOTE_DOMAIN_STATS_DOMAINS_MAX);
+            for (args.doms.doms_len = 0 ; args.doms.doms_len < n ;
+                 args.doms.doms_len++)
+                make_nonnull_domain(&args.doms.doms_val[args.doms.doms_len],
+                                    doms[i + args.doms.doms_len]);
+
+            if (remoteConnectGetDomainStatsPage(conn, priv, &args,
+                                                &records, &nrecords,
+                                                &more,
+                                                (unsigned char *) args.after) < 0)
+                goto cleanup;
+        }
+    } else {
+        do {
+            if (remoteConnectGetDomainStatsPage(conn, priv, &args,
+                                                &records, &nrecords,
+                                                &more,
+                                                (unsigned char *) args.after) < 0)
+                goto cleanup;
+            args.haveAfter = 1;
+        } while (more);
+    }
+
+    /* Callers always get a list, even an empty one */
+    if (!records && VIR_ALLOC_N(records, 1) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    *retStats = records;
+    records = NULL;
+    rv = nrecords;
+
+cleanup:
+    virDomainStatsRecordListFree(records);
+    VIR_FREE(args.doms.doms_val);
+    remoteDriverUnlock(priv);
+    return rv;
+}
+
 
 /*----------------------------------------------------------------------*/
 
@@ -9962,20 +10410,87 @@ remoteIOReadBuffer(struct private_data *priv,
 }
 
 
+/*
+ * Sends the header and payload of a message in one writev(),
+ * which is only possible when the bytes go straight onto
+ * the socket.
+ */
+static int
+remoteIOWriteVector(struct private_data *priv,
+                    struct remote_thread_call *thecall)
+{
+#ifndef HAVE_WINSOCK2_H
+    struct iovec iov[2];
+    int ret;
+
+    iov[0].iov_base = thecall->buffer + thecall->bufferOffset;
+    iov[0].iov_len = thecall->bufferLength - thecall->bufferOffset;
+    iov[1].iov_base = (char *)thecall->payload + thecall->payloadOffset;
+    iov[1].iov_len = thecall->payloadLength - thecall->payloadOffset;
+
+resend:
+    ret = writev(priv->sock, iov, 2);
+    if (ret == -1) {
+        if (errno == EINTR)
+            goto resend;
+        if (errno == EWOULDBLOCK)
+            return 0;
+
+        virReportSystemError(errno, "%s", _("cannot send data"));
+        return -1;
+    }
+
+    return ret;
+#else
+    return remoteIOWriteBuffer(priv,
+                               thecall->buffer + thecall->bufferOffset,
+                               thecall->bufferLength - thecall->bufferOffset);
+#endif
+}
+
+
+/*
+ * Advances through the header, then the payload, of a
+ * message by @len bytes that have been written out
+ */
+static void
+remoteIOConsumeMessage(struct remote_thread_call *thecall,
+                       unsigned int len)
+{
+    unsigned int want = thecall->bufferLength - thecall->bufferOffset;
+
+    if (want > len)
+        want = len;
+    thecall->bufferOffset += want;
+    thecall->payloadOffset += len - want;
+}
+
+
 static int
 remoteIOWriteMessage(struct private_data *priv,
                      struct remote_thread_call *thecall)
 {
+    const char *bytes;
+    unsigned int len;
+    int ret;
+
+    if (thecall->bufferOffset < thecall->bufferLength) {
+        bytes = thecall->buffer + thecall->bufferOffset;
+        len = thecall->bufferLength - thecall->bufferOffset;
+    } else {
+        bytes = thecall->payload + thecall->payloadOffset;
+        len = thecall->payloadLength - thecall->payloadOffset;
+    }
+
 #if HAVE_SASL
     if (priv->saslconn) {
         const char *output;
         unsigned int outputlen;
-        int err, ret;
+        int err;
 
         if (!priv->saslEncoded) {
             err = sasl_encode(priv->saslconn,
-                              thecall->buffer + thecall->bufferOffset,
-                              thecall->bufferLength - thecall->bufferOffset,
+                              bytes, len,
                               &output, &outputlen);
             if (err != SASL_OK) {
                 remoteError(VIR_ERR_INTERNAL_ERROR,
@@ -9987,7 +10502,7 @@ remoteIOWriteMessage(struct private_data *priv,
             priv->saslEncodedLength = outputlen;
             priv->saslEncodedOffset = 0;
 
-            thecall->bufferOffset = thecall->bufferLength;
+            remoteIOConsumeMessage(thecall, len);
         }
 
         ret = remoteIOWriteBuffer(priv,
@@ -9997,34 +10512,36 @@ remoteIOWriteMessage(struct private_data *priv,
             return ret;
         priv->saslEncodedOffset += ret;
 
-        if (priv->saslEncodedOffset == priv->saslEncodedLength) {
-            priv->saslEncoded = NULL;
-            priv->saslEncodedOffset = priv->saslEncodedLength = 0;
-            if (thecall->want_reply)
-                thecall->mode = REMOTE_MODE_WAIT_RX;
-            else
-                thecall->mode = REMOTE_MODE_COMPLETE;
-        }
+        if (priv->saslEncodedOffset < priv->saslEncodedLength)
+            return 0;
+
+        priv->saslEncoded = NULL;
+        priv->saslEncodedOffset = priv->saslEncodedLength = 0;
     } else {
 #endif
-        int ret;
-        ret = remoteIOWriteBuffer(priv,
-                                  thecall->buffer + thecall->bufferOffset,
-                                  thecall->bufferLength - thecall->bufferOffset);
+        if (!priv->uses_tls &&
+            thecall->bufferOffset < thecall->bufferLength &&
+            thecall->payloadOffset < thecall->payloadLength)
+            ret = remoteIOWriteVector(priv, thecall);
+        else
+            ret = remoteIOWriteBuffer(priv, bytes, len);
         if (ret < 0)
             return ret;
-        thecall->bufferOffset += ret;
-
-        if (thecall->bufferOffset == thecall->bufferLength) {
-            thecall->bufferOffset = thecall->bufferLength = 0;
-            if (thecall->want_reply)
-                thecall->mode = REMOTE_MODE_WAIT_RX;
-            else
-                thecall->mode = REMOTE_MODE_COMPLETE;
-        }
+        remoteIOConsumeMessage(thecall, ret);
 #if HAVE_SASL
     }
 #endif
+
+    if (thecall->bufferOffset == thecall->bufferLength &&
+        thecall->payloadOffset == thecall->payloadLength) {
+        thecall->bufferOffset = thecall->bufferLength = 0;
+        thecall->payload = NULL;
+        thecall->payloadOffset = thecall->payloadLength = 0;
+        if (thecall->want_reply)
+            thecall->mode = REMOTE_MODE_WAIT_RX;
+        else
+            thecall->mode = REMOTE_MODE_COMPLETE;
+    }
     return 0;
 }
 
@@ -10062,6 +10579,14 @@ remoteIOReadMessage(struct private_data *priv) {
     if (priv->bufferLength == 0)
         priv->bufferLength = 4;
 
+    if (!priv->buffer) {
+        if (VIR_ALLOC_N(priv->buffer, 4 + REMOTE_MESSAGE_MAX) < 0) {
+            virReportOOMError();
+            return -1;
+        }
+        priv->bufferSize = 4 + REMOTE_MESSAGE_MAX;
+    }
+
     wantData = priv->bufferLength - priv->bufferOffset;
 
 #if HAVE_SASL
@@ -10142,7 +10667,8 @@ remoteIODecodeMessageLength(struct private_data *priv) {
     /* Length includes length word - adjust to real length to read. */
     len -= REMOTE_MESSAGE_HEADER_XDR_LEN;
 
-    if (len > REMOTE_MESSAGE_MAX) {
+    if (len > (priv->streamFrames ?
+               REMOTE_STREAM_MESSAGE_MAX : REMOTE_MESSAGE_MAX)) {
         remoteError(VIR_ERR_RPC, "%s",
                     _("packet received from server too large"));
         return -1;
@@ -10151,6 +10677,13 @@ remoteIODecodeMessageLength(struct private_data *priv) {
     /* Extend our declared buffer length and carry
        on reading the header + payload */
     priv->bufferLength += len;
+    if (priv->bufferLength > priv->bufferSize) {
+        if (VIR_REALLOC_N(priv->buffer, priv->bufferLength) < 0) {
+            virReportOOMError();
+            return -1;
+        }
+        priv->bufferSize = priv->bufferLength;
+    }
     VIR_DEBUG("Got length, now need %d total (%d more)", priv->bufferLength, len);
     return 0;
 }
@@ -10229,6 +10762,7 @@ processCallDispatch(virConnectPtr conn, struct private_data *priv,
         break;
 
     case REMOTE_STREAM: /* Stream protocol */
+    case REMOTE_STREAM_HOLE:
         rv = processCallDispatchStream(conn, priv, &hdr, &xdr);
         break;
 
@@ -10392,18 +10926,65 @@ processCallDispatchStream(virConnectPtr conn ATTRIBUTE_UNUSED,
         thecall = thecall->next;
 
 
+    if (hdr->type == REMOTE_STREAM_HOLE) {
+        remote_stream_hole hole;
+
+        if (!privst->sparse || hdr->status != REMOTE_CONTINUE) {
+            VIR_WARN("Unexpected hole in stream serial=%d, proc=%d, status=%d",
+                     hdr->serial, hdr->proc, hdr->status);
+            return -1;
+        }
+
+        memset(&hole, 0, sizeof hole);
+        if (!xdr_remote_stream_hole(xdr, &hole)) {
+            remoteError(VIR_ERR_RPC, "%s", _("unmarshalling remote_stream_hole"));
+            return -1;
+        }
+        VIR_DEBUG("Got a stream hole of %lld bytes", (long long)hole.length);
+
+        if (hole.length < 0) {
+            VIR_WARN("Stream hole with negative length %lld",
+                     (long long)hole.length);
+            return -1;
+        }
+
+        /* It comes after everything already in the incoming buffer */
+        if (privst->nholes &&
+            privst->holes[privst->nholes - 1].offset == privst->incomingOffset) {
+            privst->holes[privst->nholes - 1].length += hole.length;
+        } else {
+            if (VIR_REALLOC_N(privst->holes, privst->nholes + 1) < 0) {
+                VIR_DEBUG0("Out of memory handling stream hole");
+                return -1;
+            }
+            privst->holes[privst->nholes].offset = privst->incomingOffset;
+            privst->holes[privst->nholes].length = hole.length;
+            privst->nholes++;
+        }
+
+        if (thecall && thecall->want_reply)
+            thecall->mode = REMOTE_MODE_COMPLETE;
+        else
+            remoteStreamEventTimerUpdate(privst);
+        return 0;
+    }
+
     /* Status is either REMOTE_OK (meaning that what follows is a ret
      * structure), or REMOTE_ERROR (and what follows is a remote_error
      * structure).
      */
     switch (hdr->status) {
     case REMOTE_CONTINUE: {
-        int avail = privst->incomingLength - privst->incomingOffset;
-        int need = priv->bufferLength - priv->bufferOffset;
+        int avail, need;
         VIR_DEBUG0("Got a stream data packet");
 
         /* XXX flag stream as complete somwhere if need==0 */
 
+        /* Drop what the app has already read before appending */
+        remoteStreamCompactIncoming(privst);
+        avail = privst->incomingLength - privst->incomingOffset;
+        need = priv->bufferLength - priv->bufferOffset;
+
         if (need > avail) {
             int extra = need - avail;
             if (VIR_REALLOC_N(privst->incoming,
@@ -10471,9 +11052,15 @@ processCallDispatchStream(virConnectPtr conn ATTRIBUTE_UNUSED,
     }
 }
 
+/*
+ * Read and dispatch incoming messages until 'thiscall' has its
+ * reply, or until we get EAGAIN. Replies to other pipelined calls
+ * are matched up by serial as they go past. With a NULL 'thiscall'
+ * everything available is consumed.
+ */
 static int
 remoteIOHandleInput(virConnectPtr conn, struct private_data *priv,
-                    int flags)
+                    int flags, struct remote_thread_call *thiscall)
 {
     /* Read as much data as is available, until we get
      * EAGAIN
@@ -10502,34 +11089,59 @@ remoteIOHandleInput(virConnectPtr conn, struct private_data *priv,
             } else {
                 ret = processCallDispatch(conn, priv, flags);
                 priv->bufferOffset = priv->bufferLength = 0;
+                if (ret < 0)
+                    return -1;
                 /*
-                 * We've completed one call, but we don't want to
-                 * spin around the loop forever if there are many
-                 * incoming async events, or replies for other
-                 * thread's RPC calls. We want to get out & let
-                 * any other thread take over as soon as we've
-                 * got our reply. When SASL is active though, we
-                 * may have read more data off the wire than we
-                 * initially wanted & cached it in memory. In this
-                 * case, poll() would not detect that there is more
-                 * ready todo.
-                 *
-                 * So if SASL is active *and* some SASL data is
-                 * already cached, then we'll process that now,
-                 * before returning.
+                 * With several calls in flight the replies tend to
+                 * arrive back-to-back, so keep going while there is
+                 * data rather than paying a poll() per message. We
+                 * still want to get out & let any other thread take
+                 * over as soon as we've got our own reply.
                  */
-#if HAVE_SASL
-                if (ret == 0 &&
-                    priv->saslconn &&
-                    priv->saslDecoded)
-                    continue;
-#endif
-                return ret;
+                if (thiscall &&
+                    (thiscall->mode == REMOTE_MODE_COMPLETE ||
+                     thiscall->mode == REMOTE_MODE_ERROR))
+                    return 0;
             }
         }
     }
 }
 
+/*
+ * Whether a new request can be written to the socket straight
+ * away, ie no queued request is still waiting to be (fully) sent
+ */
+static bool
+remoteIOCanSendNow(struct private_data *priv)
+{
+    struct remote_thread_call *tmp;
+
+    for (tmp = priv->waitDispatch ; tmp ; tmp = tmp->next) {
+        if (tmp->mode == REMOTE_MODE_WAIT_TX)
+            return false;
+    }
+    return true;
+}
+
+static void
+remoteIOUnqueueCall(struct private_data *priv,
+                    struct remote_thread_call *thiscall)
+{
+    struct remote_thread_call *tmp;
+
+    if (priv->waitDispatch == thiscall) {
+        priv->waitDispatch = thiscall->next;
+    } else {
+        tmp = priv->waitDispatch;
+        while (tmp && tmp->next &&
+               tmp->next != thiscall) {
+            tmp = tmp->next;
+        }
+        if (tmp && tmp->next == thiscall)
+            tmp->next = thiscall->next;
+    }
+}
+
 /*
  * Process all calls pending dispatch/receive until we
  * get a reply to our own call. Then quit and pass the buck
@@ -10646,7 +11258,7 @@ remoteIOEventLoop(virConnectPtr conn,
         }
 
         if (fds[0].revents & POLLIN) {
-            if (remoteIOHandleInput(conn, priv, flags) < 0)
+            if (remoteIOHandleInput(conn, priv, flags, thiscall) < 0)
                 goto error;
         }
 
@@ -10746,7 +11358,13 @@ error:
  *    a strategy in power politics when the actions of one country/
  *    nation are blamed on another, providing an opportunity for war."
  *
- * NB(5) Don't Panic!
+ * NB(5) Calls are pipelined. Whoever holds the lock may write its
+ * own request to the socket immediately, as long as no earlier
+ * request is still part way out, so N threads sharing a connection
+ * have N requests in flight while one of them sits in poll() for
+ * the replies, which are matched back up by serial number.
+ *
+ * NB(6) Don't Panic!
  */
 static int
 remoteIO(virConnectPtr conn,
@@ -10760,12 +11378,22 @@ remoteIO(virConnectPtr conn,
           thiscall->proc_nr, thiscall->serial,
           thiscall->bufferLength, priv->waitDispatch);
 
+    /* Put our request on the wire now if nothing queued ahead
+     * of it is still being sent, rather than waiting for the
+     * dispatching thread to come round and do it for us */
+    if (remoteIOCanSendNow(priv)) {
+        if (remoteIOWriteMessage(priv, thiscall) < 0)
+            return -1;
+
+        /* Nothing more to do for a call wanting no reply */
+        if (thiscall->mode == REMOTE_MODE_COMPLETE)
+            goto cleanup;
+    }
+
     /* Check to see if another thread is dispatching */
     if (priv->waitDispatch) {
         /* Stick ourselves on the end of the wait queue */
         struct remote_thread_call *tmp = priv->waitDispatch;
-        char ignore = 1;
-        ssize_t s;
         while (tmp && tmp->next)
             tmp = tmp->next;
         if (tmp)
@@ -10773,34 +11401,33 @@ remoteIO(virConnectPtr conn,
         else
             priv->waitDispatch = thiscall;
 
-        /* Force other thread to wakeup from poll */
-        s = safewrite(priv->wakeupSendFD, &ignore, sizeof(ignore));
-        if (s < 0) {
-            char errout[1024];
-            remoteError(VIR_ERR_INTERNAL_ERROR,
-                        _("failed to wake up polling thread: %s"),
-                        virStrerror(errno, errout, sizeof errout));
-            return -1;
-        } else if (s != sizeof(ignore)) {
-            remoteError(VIR_ERR_INTERNAL_ERROR, "%s",
-                        _("failed to wake up polling thread"));
-            return -1;
+        /* The dispatcher is already polling for input, so it only
+         * needs waking if it has to finish sending our request */
+        if (thiscall->mode == REMOTE_MODE_WAIT_TX) {
+            char ignore = 1;
+            ssize_t s;
+
+            /* Force other thread to wakeup from poll */
+            s = safewrite(priv->wakeupSendFD, &ignore, sizeof(ignore));
+            if (s < 0) {
+                char errout[1024];
+                remoteError(VIR_ERR_INTERNAL_ERROR,
+                            _("failed to wake up polling thread: %s"),
+                            virStrerror(errno, errout, sizeof errout));
+                remoteIOUnqueueCall(priv, thiscall);
+                return -1;
+            } else if (s != sizeof(ignore)) {
+                remoteError(VIR_ERR_INTERNAL_ERROR, "%s",
+                            _("failed to wake up polling thread"));
+                remoteIOUnqueueCall(priv, thiscall);
+                return -1;
+            }
         }
 
         VIR_DEBUG("Going to sleep %d %p %p", thiscall->proc_nr, priv->waitDispatch, thiscall);
         /* Go to sleep while other thread is working... */
         if (virCondWait(&thiscall->cond, &priv->lock) < 0) {
-            if (priv->waitDispatch == thiscall) {
-                priv->waitDispatch = thiscall->next;
-            } else {
-                tmp = priv->waitDispatch;
-                while (tmp && tmp->next &&
-                       tmp->next != thiscall) {
-                    tmp = tmp->next;
-                }
-                if (tmp && tmp->next == thiscall)
-                    tmp->next = thiscall->next;
-            }
+            remoteIOUnqueueCall(priv, thiscall);
             remoteError(VIR_ERR_INTERNAL_ERROR, "%s",
                         _("failed to wait on condition"));
             return -1;
@@ -11005,7 +11632,7 @@ remoteDomainEventFired(int watch,
         goto done;
     }
 
-    if (remoteIOHandleInput(conn, priv, 0) < 0)
+    if (remoteIOHandleInput(conn, priv, 0, NULL) < 0)
         VIR_DEBUG0("Something went wrong during async message processing");
 
 done:
@@ -11300,6 +11927,7 @@ static virDriver remote_driver = {
     remoteDomainSnapshotDelete, /* domainSnapshotDelete */
     remoteQemuDomainMonitorCommand, /* qemuDomainMonitorCommand */
     remoteDomainOpenConsole, /* domainOpenConsole */
+    remoteConnectGetAllDomainStats, /* connectGetAllDomainStats */
 };
 
 static virNetworkDriver network_driver = {
@@ -401,6 +401,70 @@ xdr_remote_memory_param (XDR *xdrs, remote_memory_param *objp)
         return TRUE;
 }
 
+bool_t
+xdr_remote_domain_stats_param_value (XDR *xdrs, remote_domain_stats_param_value *objp)
+{
+
+         if (!xdr_int (xdrs, &objp->type))
+                 return FALSE;
+        switch (objp->type) {
+        case VIR_DOMAIN_STATS_PARAM_INT:
+                         return FALSE;
+                break;
+        case VIR_DOMAIN_STATS_PARAM_UINT:
+                 if (!xdr_u_int (xdrs, &objp->remote_domain_stats_param_value_u.ui))
+                         return FALSE;
+                break;
+        case VIR_DOMAIN_STATS_PARAM_LLONG:
+                 if (!xdr_int64_t (xdrs, &objp->remote_domain_stats_param_value_u.l))
+                         return FALSE;
+                break;
+        case VIR_DOMAIN_STATS_PARAM_ULLONG:
+                 if (!xdr_uint64_t (xdrs, &objp->remote_domain_stats_param_value_u.ul))
+                         return FALSE;
+                break;
+        case VIR_DOMAIN_STATS_PARAM_DOUBLE:
+                 if (!xdr_double (xdrs, &objp->remote_domain_stats_param_value_u.d))
+                         return FALSE;
+                break;
+        case VIR_DOMAIN_STATS_PARAM_BOOLEAN:
+                 if (!xdr_int (xdrs, &objp->remote_domain_stats_param_value_u.b))
+                         return FALSE;
+                break;
+        case VIR_DOMAIN_STATS_PARAM_STRING:
+                 if (!xdr_remote_nonnull_string (xdrs, &objp->remote_domain_stats_param_value_u.s))
+                         return FALSE;
+                break;
+        default:
+                return FALSE;
+        }
+        return TRUE;
+}
+
+bool_t
+xdr_remote_domain_stats_param (XDR *xdrs, remote_domain_stats_param *objp)
+{
+
+         if (!xdr_remote_nonnull_string (xdrs, &objp->field))
+                 return FALSE;
+         if (!xdr_remote_domain_stats_param_value (xdrs, &objp->value))
+                 return FALSE;
+        return TRUE;
+}
+
+bool_t
+xdr_remote_domain_stats_record (XDR *xdrs, remote_domain_stats_record *objp)
+{
+        char **objp_cpp0 = (char **) (void *) &objp->params.params_val;
+
+         if (!xdr_remote_nonnull_domain (xdrs, &objp->dom))
+                 return FALSE;
+         if (!xdr_array (xdrs, objp_cpp0, (u_int *) &objp->params.params_len, REMOTE_DOMAIN_STATS_PARAMS_MAX,
+                sizeof (remote_domain_stats_param), (xdrproc_t) xdr_remote_domain_stats_param))
+                 return FALSE;
+        return TRUE;
+}
+
 bool_t
 xdr_remote_open_args (XDR *xdrs, remote_open_args *objp)
 {
@@ -3901,6 +3965,51 @@ xdr_remote_storage_vol_download_args (XDR *xdrs, remote_storage_vol_download_arg
         return TRUE;
 }
 
+bool_t
+xdr_remote_stream_hole (XDR *xdrs, remote_stream_hole *objp)
+{
+
+         if (!xdr_int64_t (xdrs, &objp->length))
+                 return FALSE;
+         if (!xdr_u_int (xdrs, &objp->flags))
+                 return FALSE;
+        return TRUE;
+}
+
+bool_t
+xdr_remote_connect_get_all_domain_stats_args (XDR *xdrs, remote_connect_get_all_domain_stats_args *objp)
+{
+        char **objp_cpp0 = (char **) (void *) &objp->doms.doms_val;
+
+         if (!xdr_array (xdrs, objp_cpp0, (u_int *) &objp->doms.doms_len, REMOTE_DOMAIN_STATS_DOMAINS_MAX,
+                sizeof (remote_nonnull_domain), (xdrproc_t) xdr_remote_nonnull_domain))
+                 return FALSE;
+         if (!xdr_u_int (xdrs, &objp->stats))
+                 return FALSE;
+         if (!xdr_u_int (xdrs, &objp->flags))
+                 return FALSE;
+         if (!xdr_int (xdrs, &objp->haveAfter))
+                 return FALSE;
+         if (!xdr_remote_uuid (xdrs, objp->after))
+                 return FALSE;
+        return TRUE;
+}
+
+bool_t
+xdr_remote_connect_get_all_domain_stats_ret (XDR *xdrs, remote_connect_get_all_domain_stats_ret *objp)
+{
+        char **objp_cpp0 = (char **) (void *) &objp->retStats.retStats_val;
+
+         if (!xdr_array (xdrs, objp_cpp0, (u_int *) &objp->retStats.retStats_len, REMOTE_DOMAIN_STATS_RECORDS_MAX,
+                sizeof (remote_domain_stats_record), (xdrproc_t) xdr_remote_domain_stats_record))
+                 return FALSE;
+         if (!xdr_int (xdrs, &objp->more))
+                 return FALSE;
+         if (!xdr_remote_uuid (xdrs, objp->last))
+                 return FALSE;
+        return TRUE;
+}
+
 bool_t
 xdr_remote_procedure (XDR *xdrs, remote_procedure *objp)
 {
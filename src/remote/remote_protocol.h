@@ -33,6 +33,8 @@ extern "C" {
 #define REMOTE_MESSAGE_MAX 262144
 #define REMOTE_MESSAGE_HEADER_MAX 24
 #define REMOTE_MESSAGE_PAYLOAD_MAX 262120
+#define REMOTE_STREAM_MESSAGE_MAX 1048576
+#define REMOTE_STREAM_PAYLOAD_MAX 1048552
 #define REMOTE_STRING_MAX 65536
 
 typedef char *remote_nonnull_string;
@@ -55,6 +57,9 @@ typedef remote_nonnull_string *remote_string;
 #define REMOTE_DOMAIN_SCHEDULER_PARAMETERS_MAX 16
 #define REMOTE_DOMAIN_BLKIO_PARAMETERS_MAX 16
 #define REMOTE_DOMAIN_MEMORY_PARAMETERS_MAX 16
+#define REMOTE_DOMAIN_STATS_DOMAINS_MAX 128
+#define REMOTE_DOMAIN_STATS_RECORDS_MAX 128
+#define REMOTE_DOMAIN_STATS_PARAMS_MAX 4096
 #define REMOTE_NODE_MAX_CELLS 1024
 #define REMOTE_AUTH_SASL_DATA_MAX 65536
 #define REMOTE_AUTH_TYPE_LIST_MAX 20
@@ -226,6 +231,35 @@ struct remote_memory_param {
 };
 typedef struct remote_memory_param remote_memory_param;
 
+struct remote_domain_stats_param_value {
+        int type;
+        union {
+                int i;
+                u_int ui;
+                int64_t l;
+                uint64_t ul;
+                double d;
+                int b;
+                remote_nonnull_string s;
+        } remote_domain_stats_param_value_u;
+};
+typedef struct remote_domain_stats_param_value remote_domain_stats_param_value;
+
+struct remote_domain_stats_param {
+        remote_nonnull_string field;
+        remote_domain_stats_param_value value;
+};
+typedef struct remote_domain_stats_param remote_domain_stats_param;
+
+struct remote_domain_stats_record {
+        remote_nonnull_domain dom;
+        struct {
+                u_int params_len;
+                remote_domain_stats_param *params_val;
+        } params;
+};
+typedef struct remote_domain_stats_record remote_domain_stats_record;
+
 struct remote_open_args {
         remote_string name;
         int flags;
@@ -2200,6 +2234,34 @@ struct remote_storage_vol_download_args {
         u_int flags;
 };
 typedef struct remote_storage_vol_download_args remote_storage_vol_download_args;
+
+struct remote_stream_hole {
+        int64_t length;
+        u_int flags;
+};
+typedef struct remote_stream_hole remote_stream_hole;
+
+struct remote_connect_get_all_domain_stats_args {
+        struct {
+                u_int doms_len;
+                remote_nonnull_domain *doms_val;
+        } doms;
+        u_int stats;
+        u_int flags;
+        int haveAfter;
+        remote_uuid after;
+};
+typedef struct remote_connect_get_all_domain_stats_args remote_connect_get_all_domain_stats_args;
+
+struct remote_connect_get_all_domain_stats_ret {
+        struct {
+                u_int retStats_len;
+                remote_domain_stats_record *retStats_val;
+        } retStats;
+        int more;
+        remote_uuid last;
+};
+typedef struct remote_connect_get_all_domain_stats_ret remote_connect_get_all_domain_stats_ret;
 #define REMOTE_PROGRAM 0x20008086
 #define REMOTE_PROTOCOL_VERSION 1
 
@@ -2413,6 +2475,7 @@ enum remote_procedure {
         REMOTE_PROC_DOMAIN_MIGRATE_SET_MAX_SPEED = 207,
         REMOTE_PROC_STORAGE_VOL_UPLOAD = 208,
         REMOTE_PROC_STORAGE_VOL_DOWNLOAD = 209,
+        REMOTE_PROC_CONNECT_GET_ALL_DOMAIN_STATS = 210,
 };
 typedef enum remote_procedure remote_procedure;
 
@@ -2421,6 +2484,7 @@ enum remote_message_type {
         REMOTE_REPLY = 1,
         REMOTE_MESSAGE = 2,
         REMOTE_STREAM = 3,
+        REMOTE_STREAM_HOLE = 4,
 };
 typedef enum remote_message_type remote_message_type;
 
@@ -2472,6 +2536,9 @@ extern  bool_t xdr_remote_blkio_param_value (XDR *, remote_blkio_param_value*);
 extern  bool_t xdr_remote_blkio_param (XDR *, remote_blkio_param*);
 extern  bool_t xdr_remote_memory_param_value (XDR *, remote_memory_param_value*);
 extern  bool_t xdr_remote_memory_param (XDR *, remote_memory_param*);
+extern  bool_t xdr_remote_domain_stats_param_value (XDR *, remote_domain_stats_param_value*);
+extern  bool_t xdr_remote_domain_stats_param (XDR *, remote_domain_stats_param*);
+extern  bool_t xdr_remote_domain_stats_record (XDR *, remote_domain_stats_record*);
 extern  bool_t xdr_remote_open_args (XDR *, remote_open_args*);
 extern  bool_t xdr_remote_supports_feature_args (XDR *, remote_supports_feature_args*);
 extern  bool_t xdr_remote_supports_feature_ret (XDR *, remote_supports_feature_ret*);
@@ -2796,6 +2863,9 @@ extern  bool_t xdr_remote_domain_snapshot_delete_args (XDR *, remote_domain_snap
 extern  bool_t xdr_remote_domain_open_console_args (XDR *, remote_domain_open_console_args*);
 extern  bool_t xdr_remote_storage_vol_upload_args (XDR *, remote_storage_vol_upload_args*);
 extern  bool_t xdr_remote_storage_vol_download_args (XDR *, remote_storage_vol_download_args*);
+extern  bool_t xdr_remote_stream_hole (XDR *, remote_stream_hole*);
+extern  bool_t xdr_remote_connect_get_all_domain_stats_args (XDR *, remote_connect_get_all_domain_stats_args*);
+extern  bool_t xdr_remote_connect_get_all_domain_stats_ret (XDR *, remote_connect_get_all_domain_stats_ret*);
 extern  bool_t xdr_remote_procedure (XDR *, remote_procedure*);
 extern  bool_t xdr_remote_message_type (XDR *, remote_message_type*);
 extern  bool_t xdr_remote_message_status (XDR *, remote_message_status*);
@@ -2829,6 +2899,9 @@ extern bool_t xdr_remote_blkio_param_value ();
 extern bool_t xdr_remote_blkio_param ();
 extern bool_t xdr_remote_memory_param_value ();
 extern bool_t xdr_remote_memory_param ();
+extern bool_t xdr_remote_domain_stats_param_value ();
+extern bool_t xdr_remote_domain_stats_param ();
+extern bool_t xdr_remote_domain_stats_record ();
 extern bool_t xdr_remote_open_args ();
 extern bool_t xdr_remote_supports_feature_args ();
 extern bool_t xdr_remote_supports_feature_ret ();
@@ -3153,6 +3226,9 @@ extern bool_t xdr_remote_domain_snapshot_delete_args ();
 extern bool_t xdr_remote_domain_open_console_args ();
 extern bool_t xdr_remote_storage_vol_upload_args ();
 extern bool_t xdr_remote_storage_vol_download_args ();
+extern bool_t xdr_remote_stream_hole ();
+extern bool_t xdr_remote_connect_get_all_domain_stats_args ();
+extern bool_t xdr_remote_connect_get_all_domain_stats_ret ();
 extern bool_t xdr_remote_procedure ();
 extern bool_t xdr_remote_message_type ();
 extern bool_t xdr_remote_message_status ();
@@ -69,6 +69,13 @@ const REMOTE_MESSAGE_HEADER_MAX = 24;
 /* Size of message payload */
 const REMOTE_MESSAGE_PAYLOAD_MAX = 262120;
 
+/* Maximum total size of a stream data message (serialised), once
+ * both ends have agreed to VIR_DRV_FEATURE_REMOTE_STREAM_FRAMES. */
+const REMOTE_STREAM_MESSAGE_MAX = 1048576;
+
+/* Size of stream data message payload */
+const REMOTE_STREAM_PAYLOAD_MAX = 1048552;
+
 /* Length of long, but not unbounded, strings.
  * This is an arbitrary limit designed to stop the decoder from trying
  * to allocate unbounded amounts of memory when fed with a bad message.
@@ -134,6 +141,18 @@ const REMOTE_DOMAIN_BLKIO_PARAMETERS_MAX = 16;
 /* Upper limit on list of memory parameters. */
 const REMOTE_DOMAIN_MEMORY_PARAMETERS_MAX = 16;
 
+/* Upper limit on list of domains in one domain stats request. Clients
+ * split longer lists over several requests. */
+const REMOTE_DOMAIN_STATS_DOMAINS_MAX = 128;
+
+/* Upper limit on number of domain stats records in one reply, small
+ * enough for a page of records to fit in a message. Clients page
+ * through the rest. */
+const REMOTE_DOMAIN_STATS_RECORDS_MAX = 128;
+
+/* Upper limit on number of statistics in one domain stats record. */
+const REMOTE_DOMAIN_STATS_PARAMS_MAX = 4096;
+
 /* Upper limit on number of NUMA cells */
 const REMOTE_NODE_MAX_CELLS = 1024;
 
@@ -359,6 +378,33 @@ struct remote_memory_param {
     remote_memory_param_value value;
 };
 
+union remote_domain_stats_param_value switch (int type) {
+ case VIR_DOMAIN_STATS_PARAM_INT:
+     int i;
+ case VIR_DOMAIN_STATS_PARAM_UINT:
+     unsigned int ui;
+ case VIR_DOMAIN_STATS_PARAM_LLONG:
+     hyper l;
+ case VIR_DOMAIN_STATS_PARAM_ULLONG:
+     unsigned hyper ul;
+ case VIR_DOMAIN_STATS_PARAM_DOUBLE:
+     double d;
+ case VIR_DOMAIN_STATS_PARAM_BOOLEAN:
+     int b;
+ case VIR_DOMAIN_STATS_PARAM_STRING:
+     remote_nonnull_string s;
+};
+
+struct remote_domain_stats_param {
+    remote_nonnull_string field;
+    remote_domain_stats_param_value value;
+};
+
+struct remote_domain_stats_record {
+    remote_nonnull_domain dom;
+    remote_domain_stats_param params<REMOTE_DOMAIN_STATS_PARAMS_MAX>;
+};
+
 /*----- Calls. -----*/
 
 /* For each call we may have a 'remote_CALL_args' and 'remote_CALL_ret'
@@ -1940,6 +1986,33 @@ struct remote_storage_vol_download_args {
     unsigned int flags;
 };
 
+/* Payload of a REMOTE_STREAM_HOLE packet */
+struct remote_stream_hole {
+    hyper length;
+    unsigned int flags;
+};
+
+/* An empty list of domains asks for all domains matching the flags.
+ * These are reported in order of UUID, at most
+ * REMOTE_DOMAIN_STATS_RECORDS_MAX at a time, starting after the
+ * domain with UUID 'after' if 'haveAfter' is set. */
+struct remote_connect_get_all_domain_stats_args {
+    remote_nonnull_domain doms<REMOTE_DOMAIN_STATS_DOMAINS_MAX>;
+    unsigned int stats;
+    unsigned int flags;
+    int haveAfter;
+    remote_uuid after;
+};
+
+/* 'more' is set when further domains follow this page, in which case
+ * the next request continues after the UUID in 'last'. Domains which
+ * went away have no record, so this need not be the last record's. */
+struct remote_connect_get_all_domain_stats_ret {
+    remote_domain_stats_record retStats<REMOTE_DOMAIN_STATS_RECORDS_MAX>;
+    int more;
+    remote_uuid last;
+};
+
 
 /*----- Protocol. -----*/
 
@@ -2176,7 +2249,8 @@ enum remote_procedure {
     REMOTE_PROC_DOMAIN_GET_BLKIO_PARAMETERS = 206,
     REMOTE_PROC_DOMAIN_MIGRATE_SET_MAX_SPEED = 207,
     REMOTE_PROC_STORAGE_VOL_UPLOAD = 208,
-    REMOTE_PROC_STORAGE_VOL_DOWNLOAD = 209
+    REMOTE_PROC_STORAGE_VOL_DOWNLOAD = 209,
+    REMOTE_PROC_CONNECT_GET_ALL_DOMAIN_STATS = 210
 
     /*
      * Notice how the entries are grouped in sets of 10 ?
@@ -2209,6 +2283,9 @@ enum remote_procedure {
  *  - type == REMOTE_STREAM
  *      * serial matches that from the corresponding REMOTE_CALL
  *
+ *  - type == REMOTE_STREAM_HOLE
+ *      * serial matches that from the corresponding REMOTE_CALL
+ *
  * and the 'status' field varies according to:
  *
  *  - type == REMOTE_CALL
@@ -2226,6 +2303,9 @@ enum remote_procedure {
  *     * REMOTE_OK if stream is complete
  *     * REMOTE_ERROR if stream had an error
  *
+ *  - type == REMOTE_STREAM_HOLE
+ *     * REMOTE_CONTINUE always
+ *
  * Payload varies according to type and status:
  *
  *  - type == REMOTE_CALL
@@ -2250,6 +2330,14 @@ enum remote_procedure {
  *          remote_error error information
  *     * status == REMOTE_OK
  *          <empty>
+ *
+ *  - type == REMOTE_STREAM_HOLE
+ *     * status == REMOTE_CONTINUE
+ *          remote_stream_hole  Length of the hole
+ *
+ * Holes are only sent on streams whose procedure was asked for
+ * a sparse transfer, such as with VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM,
+ * so peers which don't know about them never see one.
  */
 enum remote_message_type {
     /* client -> server. args from a method call */
@@ -2259,7 +2347,9 @@ enum remote_message_type {
     /* either direction. async notification */
     REMOTE_MESSAGE = 2,
     /* either direction. stream data packet */
-    REMOTE_STREAM = 3
+    REMOTE_STREAM = 3,
+    /* either direction. hole in a sparse stream */
+    REMOTE_STREAM_HOLE = 4
 };
 
 enum remote_message_status {
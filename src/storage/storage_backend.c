@@ -40,6 +40,9 @@
 # include <sys/ioctl.h>
 # include <linux/fs.h>
 #endif
+#if HAVE_LINUX_FALLOC_H
+# include <linux/falloc.h>
+#endif
 
 #if HAVE_SELINUX
 # include <selinux/selinux.h>
@@ -57,6 +60,7 @@
 #include "logging.h"
 #include "files.h"
 #include "command.h"
+#include "threads.h"
 
 #if WITH_STORAGE_LVM
 # include "storage_backend_logical.h"
@@ -116,6 +120,313 @@ enum {
 #define READ_BLOCK_SIZE_DEFAULT  (1024 * 1024)
 #define WRITE_BLOCK_SIZE_DEFAULT (4 * 1024)
 
+/* How many threads copy allocated extents of the source at once */
+#define COPY_THREADS 4
+
+typedef struct _virStorageBackendCopy virStorageBackendCopy;
+typedef virStorageBackendCopy *virStorageBackendCopyPtr;
+struct _virStorageBackendCopy {
+    virMutex lock;
+    int inputfd;
+    int fd;
+    bool sparse;               /* Leave zeros in the target unwritten */
+    bool zeroout;              /* Try BLKZEROOUT for holes, under @lock */
+    size_t rbytes;
+    size_t wbytes;
+    unsigned long long length; /* Bytes of the source to copy */
+
+    unsigned long long pos;    /* Next source offset to hand out */
+    unsigned long long dataEnd; /* End of the extent containing @pos */
+    bool extents;              /* Source supports SEEK_DATA/SEEK_HOLE */
+
+    int err;                   /* errno of the first failure */
+    bool errWrite;             /* Whether that was writing or reading */
+};
+
+/*
+ * Check @len bytes of @buf for zeros a cache line at a time; ORing
+ * whole words together lets the compiler vectorize the loop, and
+ * is much cheaper than comparing against a buffer of zeros.
+ */
+static bool
+virStorageBackendIsZero(const char *buf, size_t len)
+{
+    const unsigned long *words;
+    size_t nwords;
+    size_t i;
+
+    while (len && ((uintptr_t)buf % sizeof(*words))) {
+        if (*buf)
+            return false;
+        buf++;
+        len--;
+    }
+
+    words = (const unsigned long *)buf;
+    nwords = len / sizeof(*words);
+    for (i = 0 ; i + 8 <= nwords ; i += 8) {
+        if (words[i] | words[i + 1] | words[i + 2] | words[i + 3] |
+            words[i + 4] | words[i + 5] | words[i + 6] | words[i + 7])
+            return false;
+    }
+    for (; i < nwords ; i++) {
+        if (words[i])
+            return false;
+    }
+    for (i = nwords * sizeof(*words) ; i < len ; i++) {
+        if (buf[i])
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Find the next chunk of the source worth looking at, skipping holes
+ * when the target is sparse. Sets @hole if the chunk is known to be
+ * zeros and needn't be read. Returns false once there is nothing
+ * left to copy. Called with copy->lock held.
+ */
+static bool
+virStorageBackendCopyNext(virStorageBackendCopyPtr copy,
+                          unsigned long long *start,
+                          size_t *len,
+                          bool *hole)
+{
+    while (!copy->err && copy->pos < copy->length) {
+        if (copy->pos < copy->dataEnd) {
+            *start = copy->pos;
+            *len = MIN(copy->dataEnd - copy->pos, copy->rbytes);
+            *hole = false;
+            copy->pos += *len;
+            return true;
+        }
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+        if (copy->extents) {
+            off_t data = lseek(copy->inputfd, copy->pos, SEEK_DATA);
+            off_t end;
+
+            if (data < 0 && errno == ENXIO) {
+                /* Nothing but a hole up to the end */
+                data = copy->length;
+            } else if (data < 0 ||
+                       (end = lseek(copy->inputfd, data, SEEK_HOLE)) < 0) {
+                VIR_DEBUG("Cannot find extents of source: %s",
+                          strerror(errno));
+                copy->extents = false;
+                continue;
+            } else {
+                copy->dataEnd = MIN(end, copy->length);
+            }
+
+            if (data > copy->pos) {
+                unsigned long long holeEnd = MIN(data, copy->length);
+
+                if (copy->sparse) {
+                    copy->pos = holeEnd;
+                    continue;
+                }
+                /* The target has to be zeroed explicitly */
+                *start = copy->pos;
+                *len = MIN(holeEnd - copy->pos, copy->rbytes);
+                *hole = true;
+                copy->pos += *len;
+                return true;
+            }
+            continue;
+        }
+#endif
+
+        /* No extent information, so treat the rest as data */
+        copy->dataEnd = copy->length;
+    }
+
+    return false;
+}
+
+static void
+virStorageBackendCopyFail(virStorageBackendCopyPtr copy,
+                          int err,
+                          bool write)
+{
+    virMutexLock(&copy->lock);
+    if (!copy->err) {
+        copy->err = err;
+        copy->errWrite = write;
+    }
+    virMutexUnlock(&copy->lock);
+}
+
+static int
+virStorageBackendCopyWrite(virStorageBackendCopyPtr copy,
+                           const char *buf,
+                           size_t len,
+                           unsigned long long offset)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(copy->fd, buf, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            virStorageBackendCopyFail(copy, n < 0 ? errno : ENOSPC, true);
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/* Copy one chunk, writing only the blocks which aren't all zeros
+ * when the target is sparse */
+static int
+virStorageBackendCopyChunk(virStorageBackendCopyPtr copy,
+                           char *buf,
+                           unsigned long long start,
+                           size_t len,
+                           bool hole)
+{
+    size_t got = 0;
+    size_t off;
+    size_t run = 0;
+
+    if (hole) {
+#ifdef BLKZEROOUT
+        bool zeroout;
+
+        virMutexLock(&copy->lock);
+        zeroout = copy->zeroout;
+        virMutexUnlock(&copy->lock);
+
+        if (zeroout) {
+            uint64_t range[2] = { start, len };
+
+            if (ioctl(copy->fd, BLKZEROOUT, range) == 0)
+                return 0;
+            /* Not supported by the target, so stop the other
+             * threads trying it too */
+            virMutexLock(&copy->lock);
+            copy->zeroout = false;
+            virMutexUnlock(&copy->lock);
+        }
+#endif
+        memset(buf, 0, len);
+        return virStorageBackendCopyWrite(copy, buf, len, start);
+    }
+
+    while (got < len) {
+        ssize_t n = pread(copy->inputfd, buf + got, len - got, start + got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            virStorageBackendCopyFail(copy, errno, false);
+            return -1;
+        }
+        if (n == 0) {
+            /* Source shrank underneath us; what's gone reads as zeros */
+            memset(buf + got, 0, len - got);
+            break;
+        }
+        got += n;
+    }
+
+    if (!copy->sparse)
+        return virStorageBackendCopyWrite(copy, buf, len, start);
+
+    /* Coalesce consecutive non-zero blocks into a single write */
+    for (off = 0 ; off < len ; off += copy->wbytes) {
+        size_t interval = MIN(copy->wbytes, len - off);
+
+        if (!virStorageBackendIsZero(buf + off, interval)) {
+            run += interval;
+            continue;
+        }
+        if (run &&
+            virStorageBackendCopyWrite(copy, buf + off - run, run,
+                                       start + off - run) < 0)
+            return -1;
+        run = 0;
+    }
+    if (run &&
+        virStorageBackendCopyWrite(copy, buf + len - run, run,
+                                   start + len - run) < 0)
+        return -1;
+
+    return 0;
+}
+
+static void
+virStorageBackendCopyWorker(void *opaque)
+{
+    virStorageBackendCopyPtr copy = opaque;
+    unsigned long long start;
+    size_t len;
+    bool hole;
+    char *buf;
+
+    if (VIR_ALLOC_N(buf, copy->rbytes) < 0) {
+        virStorageBackendCopyFail(copy, ENOMEM, false);
+        return;
+    }
+
+    virMutexLock(&copy->lock);
+    while (virStorageBackendCopyNext(copy, &start, &len, &hole)) {
+        virMutexUnlock(&copy->lock);
+        virStorageBackendCopyChunk(copy, buf, start, len, hole);
+        virMutexLock(&copy->lock);
+    }
+    virMutexUnlock(&copy->lock);
+
+    VIR_FREE(buf);
+}
+
+/*
+ * When source and target share a filesystem which can reflink, clone
+ * the allocated extents instead of copying them. Stops at the first
+ * extent which can't be cloned, leaving the rest to be copied.
+ */
+static void
+virStorageBackendCopyClone(virStorageBackendCopyPtr copy ATTRIBUTE_UNUSED)
+{
+#if defined(FICLONERANGE) && defined(SEEK_DATA) && defined(SEEK_HOLE)
+    while (copy->pos < copy->length) {
+        struct file_clone_range range;
+        off_t data = lseek(copy->inputfd, copy->pos, SEEK_DATA);
+        off_t end;
+
+        if (data < 0 && errno == ENXIO) {
+            copy->pos = copy->length;
+            break;
+        }
+        if (data < 0 ||
+            (end = lseek(copy->inputfd, data, SEEK_HOLE)) < 0 ||
+            data >= copy->length)
+            break;
+
+        range.src_fd = copy->inputfd;
+        range.src_offset = data;
+        range.src_length = MIN(end, copy->length) - data;
+        range.dest_offset = data;
+        if (ioctl(copy->fd, FICLONERANGE, &range) < 0) {
+            VIR_DEBUG("Cannot clone %llu bytes at %llu: %s",
+                      (unsigned long long)range.src_length,
+                      (unsigned long long)data, strerror(errno));
+            break;
+        }
+
+        copy->pos = data + range.src_length;
+    }
+#endif
+}
+
+/*
+ * Copy the start of @inputvol into @fd. Only allocated extents of
+ * the source are read, and when @is_dest_file is set, blocks of
+ * zeros are left as holes in the target. On return @total holds
+ * the number of bytes copied. Returns 0, or -errno on failure.
+ */
 static int ATTRIBUTE_NONNULL (2)
 virStorageBackendCopyToFD(virStorageVolDefPtr vol,
                           virStorageVolDefPtr inputvol,
@@ -123,16 +434,17 @@ virStorageBackendCopyToFD(virStorageVolDefPtr vol,
                           unsigned long long *total,
                           int is_dest_file)
 {
+    virStorageBackendCopy copy;
+    virThread threads[COPY_THREADS - 1];
+    size_t nthreads = 0;
+    size_t i;
     int inputfd = -1;
-    int amtread = -1;
     int ret = 0;
-    unsigned long long remain;
-    size_t rbytes = READ_BLOCK_SIZE_DEFAULT;
-    size_t wbytes = 0;
-    int interval;
-    char *zerobuf;
-    char *buf = NULL;
-    struct stat st;
+    off_t size;
+    struct stat st, inputst;
+    bool locked = false;
+
+    memset(&copy, 0, sizeof(copy));
 
     if ((inputfd = open(inputvol->target.path, O_RDONLY)) < 0) {
         ret = -errno;
@@ -142,69 +454,75 @@ virStorageBackendCopyToFD(virStorageVolDefPtr vol,
         goto cleanup;
     }
 
+    if ((size = lseek(inputfd, 0, SEEK_END)) < 0 ||
+        fstat(inputfd, &inputst) < 0) {
+        ret = -errno;
+        virReportSystemError(errno,
+                             _("failed reading from file '%s'"),
+                             inputvol->target.path);
+        goto cleanup;
+    }
+
+    copy.inputfd = inputfd;
+    copy.fd = fd;
+    copy.sparse = is_dest_file;
+    copy.rbytes = READ_BLOCK_SIZE_DEFAULT;
+    copy.length = MIN(*total, size);
+    copy.extents = S_ISREG(inputst.st_mode);
+
 #ifdef __linux__
-    if (ioctl(fd, BLKBSZGET, &wbytes) < 0) {
-        wbytes = 0;
+    if (ioctl(fd, BLKBSZGET, &copy.wbytes) < 0) {
+        copy.wbytes = 0;
     }
 #endif
-    if ((wbytes == 0) && fstat(fd, &st) == 0)
-        wbytes = st.st_blksize;
-    if (wbytes < WRITE_BLOCK_SIZE_DEFAULT)
-        wbytes = WRITE_BLOCK_SIZE_DEFAULT;
-
-    if (VIR_ALLOC_N(zerobuf, wbytes) < 0) {
-        ret = -errno;
-        virReportOOMError();
-        goto cleanup;
+    if (fstat(fd, &st) == 0) {
+        if (copy.wbytes == 0)
+            copy.wbytes = st.st_blksize;
+        copy.zeroout = S_ISBLK(st.st_mode);
     }
+    if (copy.wbytes < WRITE_BLOCK_SIZE_DEFAULT)
+        copy.wbytes = WRITE_BLOCK_SIZE_DEFAULT;
 
-    if (VIR_ALLOC_N(buf, rbytes) < 0) {
-        ret = -errno;
-        virReportOOMError();
+    if (is_dest_file && S_ISREG(inputst.st_mode) &&
+        fstat(fd, &st) == 0 && st.st_dev == inputst.st_dev)
+        virStorageBackendCopyClone(&copy);
+
+    if (virMutexInit(&copy.lock) < 0) {
+        ret = -ENOMEM;
+        virStorageReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                              _("cannot initialize mutex"));
         goto cleanup;
     }
+    locked = true;
 
-    remain = *total;
+    for (i = 0 ;
+         i < ARRAY_CARDINALITY(threads) &&
+         copy.length - copy.pos > copy.rbytes ;
+         i++) {
+        if (virThreadCreate(&threads[i], true,
+                            virStorageBackendCopyWorker, &copy) < 0)
+            break;
+        nthreads++;
+    }
 
-    while (amtread != 0) {
-        int amtleft;
+    virStorageBackendCopyWorker(&copy);
 
-        if (remain < rbytes)
-            rbytes = remain;
+    for (i = 0 ; i < nthreads ; i++)
+        virThreadJoin(&threads[i]);
 
-        if ((amtread = saferead(inputfd, buf, rbytes)) < 0) {
-            ret = -errno;
-            virReportSystemError(errno,
+    if (copy.err) {
+        ret = -copy.err;
+        if (copy.err == ENOMEM)
+            virReportOOMError();
+        else if (copy.errWrite)
+            virReportSystemError(copy.err,
+                                 _("failed writing to file '%s'"),
+                                 vol->target.path);
+        else
+            virReportSystemError(copy.err,
                                  _("failed reading from file '%s'"),
                                  inputvol->target.path);
-            goto cleanup;
-        }
-        remain -= amtread;
-
-        /* Loop over amt read in 512 byte increments, looking for sparse
-         * blocks */
-        amtleft = amtread;
-        do {
-            interval = ((wbytes > amtleft) ? amtleft : wbytes);
-            int offset = amtread - amtleft;
-
-            if (is_dest_file && memcmp(buf+offset, zerobuf, interval) == 0) {
-                if (lseek(fd, interval, SEEK_CUR) < 0) {
-                    ret = -errno;
-                    virReportSystemError(errno,
-                                         _("cannot extend file '%s'"),
-                                         vol->target.path);
-                    goto cleanup;
-                }
-            } else if (safewrite(fd, buf+offset, interval) < 0) {
-                ret = -errno;
-                virReportSystemError(errno,
-                                     _("failed writing to file '%s'"),
-                                     vol->target.path);
-                goto cleanup;
-
-            }
-        } while ((amtleft -= interval) > 0);
+        goto cleanup;
     }
 
     if (VIR_CLOSE(inputfd) < 0) {
@@ -216,13 +534,12 @@ virStorageBackendCopyToFD(virStorageVolDefPtr vol,
     }
     inputfd = -1;
 
-    *total -= remain;
+    *total = copy.length;
 
 cleanup:
     VIR_FORCE_CLOSE(inputfd);
-
-    VIR_FREE(zerobuf);
-    VIR_FREE(buf);
+    if (locked)
+        virMutexDestroy(&copy.lock);
 
     return ret;
 }
@@ -1031,6 +1348,399 @@ virStorageBackendGetBuildVolFromFunction(virStorageVolDefPtr vol,
 }
 
 
+/*
+ * Volume wipe engine
+ *
+ * Each method is tried in turn from the start of whatever range
+ * remains, so a method which gives up part way through (eg a
+ * discard refused for an unaligned tail) hands the rest on to the
+ * next one.
+ */
+
+VIR_ENUM_IMPL(virStorageBackendWipeMethod, VIR_STORAGE_WIPE_METHOD_LAST,
+              "discard", "zeroout", "punch", "write")
+
+/* How much each discard, zeroout or hole punch covers at a time,
+ * so progress can be reported on huge volumes */
+#define WIPE_OFFLOAD_CHUNK (1024ull * 1024 * 1024)
+
+/* Buffer size and concurrency for overwriting with zeros */
+#define WIPE_WRITE_BUFLEN (4 * 1024 * 1024)
+#define WIPE_WRITE_ALIGN 4096
+#define WIPE_WRITE_THREADS 4
+
+typedef struct _virStorageBackendWipe virStorageBackendWipe;
+typedef virStorageBackendWipe *virStorageBackendWipePtr;
+struct _virStorageBackendWipe {
+    const char *path;
+    unsigned long long offset;
+    unsigned long long length;
+    unsigned long long done;   /* Bytes of the range wiped so far */
+
+    virStorageBackendWipeProgress progress;
+    void *opaque;
+
+    /* Used by the write method */
+    virMutex lock;
+    int fd;
+    const char *zerobuf;
+    unsigned long long next;   /* Next chunk to hand out */
+    unsigned long long end;
+    unsigned long long written;
+    int err;
+};
+
+static void
+virStorageBackendWipeReport(virStorageBackendWipePtr wipe)
+{
+    if (wipe->progress)
+        (wipe->progress)(wipe->done, wipe->opaque);
+}
+
+/* Returns 0 if the sector aligned part of the remaining range was
+ * wiped by @cmd, or -1 if the next method should take over. Any
+ * unaligned tail is left for the write method. */
+#ifdef __linux__
+static int
+virStorageBackendWipeIoctl(virStorageBackendWipePtr wipe,
+                           int fd,
+                           unsigned long cmd,
+                           const char *name)
+{
+    unsigned long long end;
+    int sector = 512;
+
+# ifdef BLKSSZGET
+    if (ioctl(fd, BLKSSZGET, &sector) < 0 || sector <= 0)
+        sector = 512;
+# endif
+
+    if ((wipe->offset + wipe->done) % sector)
+        return -1;
+    end = wipe->length - ((wipe->offset + wipe->length) % sector);
+
+    while (wipe->done < end) {
+        uint64_t range[2];
+
+        range[0] = wipe->offset + wipe->done;
+        range[1] = MIN(end - wipe->done, WIPE_OFFLOAD_CHUNK);
+
+        if (ioctl(fd, cmd, range) < 0) {
+            VIR_DEBUG("%s of %llu bytes at %llu on '%s' failed: %s",
+                      name, (unsigned long long)range[1],
+                      (unsigned long long)range[0], wipe->path,
+                      strerror(errno));
+            return -1;
+        }
+
+        wipe->done += range[1];
+        virStorageBackendWipeReport(wipe);
+    }
+
+    return 0;
+}
+#endif
+
+static int
+virStorageBackendWipeDiscard(virStorageBackendWipePtr wipe ATTRIBUTE_UNUSED,
+                             int fd ATTRIBUTE_UNUSED)
+{
+#if defined(BLKDISCARD) && defined(BLKDISCARDZEROES)
+    unsigned int zeroes = 0;
+
+    /* Only any use if the device reads back discarded blocks as zeros */
+    if (ioctl(fd, BLKDISCARDZEROES, &zeroes) < 0 || !zeroes)
+        return -1;
+
+    return virStorageBackendWipeIoctl(wipe, fd, BLKDISCARD, "BLKDISCARD");
+#else
+    return -1;
+#endif
+}
+
+static int
+virStorageBackendWipeZeroOut(virStorageBackendWipePtr wipe ATTRIBUTE_UNUSED,
+                             int fd ATTRIBUTE_UNUSED)
+{
+#ifdef BLKZEROOUT
+    return virStorageBackendWipeIoctl(wipe, fd, BLKZEROOUT, "BLKZEROOUT");
+#else
+    return -1;
+#endif
+}
+
+static int
+virStorageBackendWipePunch(virStorageBackendWipePtr wipe ATTRIBUTE_UNUSED,
+                           int fd ATTRIBUTE_UNUSED)
+{
+#if HAVE_FALLOCATE && defined(FALLOC_FL_PUNCH_HOLE)
+    while (wipe->done < wipe->length) {
+        off_t start = wipe->offset + wipe->done;
+        off_t len = MIN(wipe->length - wipe->done, WIPE_OFFLOAD_CHUNK);
+
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      start, len) < 0) {
+            VIR_DEBUG("Punching hole of %llu bytes at %llu in '%s' "
+                      "failed: %s", (unsigned long long)len,
+                      (unsigned long long)start, wipe->path,
+                      strerror(errno));
+            return -1;
+        }
+
+        /* Allocate the range again, as zeroed extents, so the volume
+         * doesn't turn sparse; a wipe shouldn't change its allocation */
+        if (fallocate(fd, FALLOC_FL_KEEP_SIZE, start, len) < 0)
+            VIR_WARN("Unable to reallocate %llu bytes at %llu in '%s': %s",
+                     (unsigned long long)len, (unsigned long long)start,
+                     wipe->path, strerror(errno));
+
+        wipe->done += len;
+        virStorageBackendWipeReport(wipe);
+    }
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Take chunks of the range to overwrite until none are left, or
+ * a write fails. Run by each helper thread, and by the thread
+ * calling virStorageBackendWipeRange, which alone reports progress.
+ */
+static void
+virStorageBackendWipeWriteChunks(virStorageBackendWipePtr wipe,
+                                 bool report)
+{
+    virMutexLock(&wipe->lock);
+    while (!wipe->err && wipe->next < wipe->end) {
+        unsigned long long start = wipe->next;
+        size_t len = MIN(wipe->end - start, WIPE_WRITE_BUFLEN);
+        size_t off = 0;
+
+        wipe->next += len;
+        virMutexUnlock(&wipe->lock);
+
+        while (off < len) {
+            ssize_t n = pwrite(wipe->fd, wipe->zerobuf + off,
+                               len - off, start + off);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                virMutexLock(&wipe->lock);
+                if (!wipe->err)
+                    wipe->err = n < 0 ? errno : ENOSPC;
+                virMutexUnlock(&wipe->lock);
+                break;
+            }
+            off += n;
+        }
+
+        virMutexLock(&wipe->lock);
+        wipe->written += off;
+        if (report) {
+            unsigned long long done = wipe->written;
+            virMutexUnlock(&wipe->lock);
+            wipe->done = done;
+            virStorageBackendWipeReport(wipe);
+            virMutexLock(&wipe->lock);
+        }
+    }
+    virMutexUnlock(&wipe->lock);
+}
+
+static void
+virStorageBackendWipeWriteWorker(void *opaque)
+{
+    virStorageBackendWipeWriteChunks(opaque, false);
+}
+
+/* Overwrite [from, to) of @fd with zeros, using several threads */
+static int
+virStorageBackendWipeWriteRange(virStorageBackendWipePtr wipe,
+                                int fd,
+                                unsigned long long from,
+                                unsigned long long to)
+{
+    virThread threads[WIPE_WRITE_THREADS - 1];
+    size_t nthreads = 0;
+    size_t i;
+
+    wipe->fd = fd;
+    wipe->next = from;
+    wipe->end = to;
+
+    /* Not worth threads for the odd unaligned tail */
+    for (i = 0 ;
+         i < ARRAY_CARDINALITY(threads) && to - from > WIPE_WRITE_BUFLEN ;
+         i++) {
+        if (virThreadCreate(&threads[i], true,
+                            virStorageBackendWipeWriteWorker, wipe) < 0)
+            break;
+        nthreads++;
+    }
+
+    virStorageBackendWipeWriteChunks(wipe, true);
+
+    for (i = 0 ; i < nthreads ; i++)
+        virThreadJoin(&threads[i]);
+
+    if (wipe->err) {
+        virReportSystemError(wipe->err,
+                             _("Failed to write zeros to storage volume "
+                               "with path '%s'"), wipe->path);
+        return -1;
+    }
+
+    wipe->done = wipe->written;
+    return 0;
+}
+
+static int
+virStorageBackendWipeWrite(virStorageBackendWipePtr wipe,
+                           int fd)
+{
+    unsigned long long start = wipe->offset + wipe->done;
+    unsigned long long end = wipe->offset + wipe->length;
+    unsigned long long directEnd = start;
+    char *buf = NULL;
+    int directfd = -1;
+    int ret = -1;
+
+    if (VIR_ALLOC_N(buf, WIPE_WRITE_BUFLEN + WIPE_WRITE_ALIGN) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+    wipe->zerobuf = (char *)(((uintptr_t)buf + WIPE_WRITE_ALIGN - 1) &
+                             ~((uintptr_t)WIPE_WRITE_ALIGN - 1));
+
+    if (virMutexInit(&wipe->lock) < 0) {
+        virStorageReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                              _("cannot initialize mutex"));
+        VIR_FREE(buf);
+        return -1;
+    }
+    wipe->written = wipe->done;
+    wipe->err = 0;
+
+    /* Bypass the page cache for the aligned bulk of the range, so
+     * as not to evict everything else on the host */
+#ifdef O_DIRECT
+    if ((start % WIPE_WRITE_ALIGN) == 0 &&
+        (directfd = open(wipe->path, O_WRONLY | O_DIRECT)) >= 0)
+        directEnd = end - ((end - start) % WIPE_WRITE_ALIGN);
+    else
+        VIR_DEBUG("Not using O_DIRECT to wipe '%s'", wipe->path);
+#endif
+
+    /* O_DIRECT bypasses the page cache, but not the disk's own
+     * cache, nor does it commit any metadata the writes changed */
+    if (directEnd > start) {
+        if (virStorageBackendWipeWriteRange(wipe, directfd,
+                                            start, directEnd) < 0)
+            goto cleanup;
+        if (fdatasync(directfd) < 0) {
+            virReportSystemError(errno,
+                                 _("cannot sync storage volume with "
+                                   "path '%s'"), wipe->path);
+            goto cleanup;
+        }
+    }
+
+    if (directEnd < end) {
+        if (virStorageBackendWipeWriteRange(wipe, fd, directEnd, end) < 0)
+            goto cleanup;
+        if (fdatasync(fd) < 0) {
+            virReportSystemError(errno,
+                                 _("cannot sync storage volume with "
+                                   "path '%s'"), wipe->path);
+            goto cleanup;
+        }
+    }
+
+    virStorageBackendWipeReport(wipe);
+    ret = 0;
+
+cleanup:
+    VIR_FORCE_CLOSE(directfd);
+    virMutexDestroy(&wipe->lock);
+    VIR_FREE(buf);
+    return ret;
+}
+
+/**
+ * virStorageBackendWipeRange:
+ * @path: path of the volume, for error reporting and reopening
+ * @fd: file descriptor open for writing on @path
+ * @offset: start of the range to wipe
+ * @length: number of bytes to wipe
+ * @progress: optional callback told of the bytes wiped so far
+ * @opaque: passed to @progress
+ * @flags: bitwise-OR of VIR_STORAGE_WIPE_NO_OFFLOAD
+ *
+ * Make @length bytes of @fd starting at @offset read back as
+ * zeros, preferring methods the storage can do for itself:
+ * discard on block devices which guarantee discarded blocks read
+ * as zeros, then BLKZEROOUT on block devices, or punching a hole
+ * in regular files, before falling back to writing zeros.
+ * VIR_STORAGE_WIPE_NO_OFFLOAD skips straight to writing zeros.
+ *
+ * Returns the virStorageBackendWipeMethod which did the bulk of
+ * the job, or -1 on error
+ */
+int
+virStorageBackendWipeRange(const char *path,
+                           int fd,
+                           unsigned long long offset,
+                           unsigned long long length,
+                           virStorageBackendWipeProgress progress,
+                           void *opaque,
+                           unsigned int flags)
+{
+    virStorageBackendWipe wipe;
+    struct stat st;
+    int method = VIR_STORAGE_WIPE_METHOD_WRITE;
+
+    virCheckFlags(VIR_STORAGE_WIPE_NO_OFFLOAD, -1);
+
+    memset(&wipe, 0, sizeof(wipe));
+    wipe.path = path;
+    wipe.offset = offset;
+    wipe.length = length;
+    wipe.progress = progress;
+    wipe.opaque = opaque;
+
+    if (fstat(fd, &st) < 0) {
+        virReportSystemError(errno,
+                             _("Failed to stat storage volume with path '%s'"),
+                             path);
+        return -1;
+    }
+
+    if (flags & VIR_STORAGE_WIPE_NO_OFFLOAD) {
+        /* Straight on to writing */
+    } else if (S_ISBLK(st.st_mode)) {
+        if (virStorageBackendWipeDiscard(&wipe, fd) == 0)
+            method = VIR_STORAGE_WIPE_METHOD_DISCARD;
+        else if (virStorageBackendWipeZeroOut(&wipe, fd) == 0)
+            method = VIR_STORAGE_WIPE_METHOD_ZEROOUT;
+    } else if (S_ISREG(st.st_mode)) {
+        if (virStorageBackendWipePunch(&wipe, fd) == 0)
+            method = VIR_STORAGE_WIPE_METHOD_PUNCH;
+    }
+
+    if (wipe.done < length) {
+        VIR_DEBUG("Writing zeros to %llu bytes at %llu in '%s'",
+                  length - wipe.done, offset + wipe.done, path);
+        if (virStorageBackendWipeWrite(&wipe, fd) < 0)
+            return -1;
+    }
+
+    return method;
+}
+
+
 virStorageBackendPtr
 virStorageBackendForType(int type) {
     unsigned int i;
@@ -58,6 +58,33 @@ int virStorageBackendFindFSImageTool(char **tool);
 virStorageBackendBuildVolFrom
 virStorageBackendFSImageToolTypeToFunc(int tool_type);
 
+enum virStorageBackendWipeMethod {
+    VIR_STORAGE_WIPE_METHOD_DISCARD,  /* BLKDISCARD, if discard zeroes data */
+    VIR_STORAGE_WIPE_METHOD_ZEROOUT,  /* BLKZEROOUT */
+    VIR_STORAGE_WIPE_METHOD_PUNCH,    /* fallocate FALLOC_FL_PUNCH_HOLE */
+    VIR_STORAGE_WIPE_METHOD_WRITE,    /* Writing zeros */
+
+    VIR_STORAGE_WIPE_METHOD_LAST
+};
+VIR_ENUM_DECL(virStorageBackendWipeMethod)
+
+/* virStorageBackendWipeRange flags */
+enum {
+    VIR_STORAGE_WIPE_NO_OFFLOAD = 1 << 0, /* Always write zeros */
+};
+
+typedef void (*virStorageBackendWipeProgress)(unsigned long long wiped,
+                                              void *opaque);
+
+int virStorageBackendWipeRange(const char *path,
+                               int fd,
+                               unsigned long long offset,
+                               unsigned long long length,
+                               virStorageBackendWipeProgress progress,
+                               void *opaque,
+                               unsigned int flags)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_RETURN_CHECK;
+
 
 typedef struct _virStorageBackend virStorageBackend;
 typedef virStorageBackend *virStorageBackendPtr;
@@ -70,6 +97,9 @@ struct _virStorageBackend {
     virStorageBackendStartPool startPool;
     virStorageBackendBuildPool buildPool;
     virStorageBackendRefreshPool refreshPool;
+    /* refreshPool updates the existing volumes in place, so
+     * they must not be cleared before calling it */
+    bool refreshIncremental;
     virStorageBackendStopPool stopPool;
     virStorageBackendDeletePool deletePool;
 
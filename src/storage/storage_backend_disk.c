@@ -46,20 +46,14 @@ virStorageBackendDiskMakeDataVol(virStoragePoolObjPtr pool,
                                  virStorageVolDefPtr vol)
 {
     char *tmp, *devpath;
+    bool is_new_vol = false;
 
     if (vol == NULL) {
         if (VIR_ALLOC(vol) < 0) {
             virReportOOMError();
             return -1;
         }
-
-        if (VIR_REALLOC_N(pool->volumes.objs,
-                          pool->volumes.count+1) < 0) {
-            virReportOOMError();
-            virStorageVolDefFree(vol);
-            return -1;
-        }
-        pool->volumes.objs[pool->volumes.count++] = vol;
+        is_new_vol = true;
 
         /* Prepended path will be same for all partitions, so we can
          * strip the path to form a reasonable pool-unique name
@@ -67,14 +61,14 @@ virStorageBackendDiskMakeDataVol(virStoragePoolObjPtr pool,
         tmp = strrchr(groups[0], '/');
         if ((vol->name = strdup(tmp ? tmp + 1 : groups[0])) == NULL) {
             virReportOOMError();
-            return -1;
+            goto error;
         }
     }
 
     if (vol->target.path == NULL) {
         if ((devpath = strdup(groups[0])) == NULL) {
             virReportOOMError();
-            return -1;
+            goto error;
         }
 
         /* Now figure out the stable path
@@ -86,17 +80,24 @@ virStorageBackendDiskMakeDataVol(virStoragePoolObjPtr pool,
         vol->target.path = virStorageBackendStablePath(pool, devpath);
         VIR_FREE(devpath);
         if (vol->target.path == NULL)
-            return -1;
+            goto error;
     }
 
     if (vol->key == NULL) {
         /* XXX base off a unique key of the underlying disk */
         if ((vol->key = strdup(vol->target.path)) == NULL) {
             virReportOOMError();
-            return -1;
+            goto error;
         }
     }
 
+    /* Once added, the pool frees the volume if we fail below */
+    if (is_new_vol) {
+        if (virStoragePoolObjAddVol(pool, vol) < 0)
+            goto error;
+        is_new_vol = false;
+    }
+
     if (vol->source.extents == NULL) {
         if (VIR_ALLOC(vol->source.extents) < 0) {
             virReportOOMError();
@@ -152,6 +153,11 @@ virStorageBackendDiskMakeDataVol(virStoragePoolObjPtr pool,
         pool->def->capacity = vol->source.extents[0].end;
 
     return 0;
+
+error:
+    if (is_new_vol)
+        virStorageVolDefFree(vol);
+    return -1;
 }
 
 static int
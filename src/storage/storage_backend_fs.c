@@ -32,6 +32,9 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
 
 #include <libxml/parser.h>
 #include <libxml/tree.h>
@@ -45,6 +48,9 @@
 #include "memory.h"
 #include "xml.h"
 #include "files.h"
+#include "threads.h"
+#include "logging.h"
+#include "stat-time.h"
 
 #define VIR_FROM_THIS VIR_FROM_STORAGE
 
@@ -608,18 +614,478 @@ error:
 }
 
 
-/**
- * Iterate over the pool's directory and enumerate all disk images
- * within it. This is non-recursive.
+/* Forget what was kept between refreshes, so the next is a full scan */
+static void
+virStorageBackendFileSystemReleaseState(virStoragePoolObjPtr pool)
+{
+    if (pool->privateDataFreeFunc)
+        (pool->privateDataFreeFunc)(pool->privateData);
+    pool->privateData = NULL;
+    pool->privateDataFreeFunc = NULL;
+}
+
+/* Number of threads probing new or changed files during a refresh */
+#define REFRESH_PROBE_THREADS 8
+
+/*
+ * A file which is new or has changed since the last refresh. It is
+ * probed into @vol, which then replaces @old if there is one.
+ */
+typedef struct _virStorageBackendFileSystemProbe virStorageBackendFileSystemProbe;
+typedef virStorageBackendFileSystemProbe *virStorageBackendFileSystemProbePtr;
+struct _virStorageBackendFileSystemProbe {
+    virStorageVolDefPtr old;
+    virStorageVolDefPtr vol;
+    int ret;
+    virErrorPtr err;    /* Saved from the worker thread when ret == -1 */
+};
+
+typedef struct _virStorageBackendFileSystemRefreshState virStorageBackendFileSystemRefreshState;
+typedef virStorageBackendFileSystemRefreshState *virStorageBackendFileSystemRefreshStatePtr;
+struct _virStorageBackendFileSystemRefreshState {
+    virStoragePoolObjPtr pool;
+    virHashTablePtr seen;       /* Names found by a full scan */
+    virHashTablePtr changed;    /* Names reported by the watch */
+    bool failed;
+
+    virMutex lock;
+    size_t next;                /* Next probe for a worker to pick up */
+    size_t nprobes;
+    virStorageBackendFileSystemProbePtr probes;
+};
+
+/*
+ * Record what @path currently looks like in @stamp. Returns 0 if it
+ * may be a volume, 1 if it is not (a directory, dangling symlink or
+ * a file which has gone away), or -1 if it could not be examined.
  */
 static int
-virStorageBackendFileSystemRefresh(virConnectPtr conn ATTRIBUTE_UNUSED,
-                                   virStoragePoolObjPtr pool)
+virStorageBackendFileSystemStamp(const char *path,
+                                 virStorageVolStampPtr stamp)
+{
+    struct stat sb;
+
+    memset(stamp, 0, sizeof(*stamp));
+
+    if (lstat(path, &sb) < 0)
+        goto error;
+    if (S_ISLNK(sb.st_mode)) {
+        stamp->symlink = true;
+        if (stat(path, &sb) < 0)
+            goto error;
+    }
+
+    if (!S_ISREG(sb.st_mode) && !S_ISCHR(sb.st_mode) && !S_ISBLK(sb.st_mode))
+        return 1;
+
+    stamp->valid = true;
+    stamp->dev = sb.st_dev;
+    stamp->ino = sb.st_ino;
+    stamp->size = sb.st_size;
+    stamp->mtime = get_stat_mtime(&sb);
+    stamp->ctime = get_stat_ctime(&sb);
+    return 0;
+
+error:
+    if (errno == ENOENT || errno == ELOOP || errno == ENOTDIR)
+        return 1;
+    return -1;
+}
+
+static bool
+virStorageBackendFileSystemStampEqual(virStorageVolStampPtr a,
+                                      virStorageVolStampPtr b)
+{
+    return a->valid && b->valid &&
+        a->symlink == b->symlink &&
+        a->dev == b->dev &&
+        a->ino == b->ino &&
+        a->size == b->size &&
+        a->mtime.tv_sec == b->mtime.tv_sec &&
+        a->mtime.tv_nsec == b->mtime.tv_nsec &&
+        a->ctime.tv_sec == b->ctime.tv_sec &&
+        a->ctime.tv_nsec == b->ctime.tv_nsec;
+}
+
+/* Re-read the backing file's details, unless it is unchanged */
+static void
+virStorageBackendFileSystemRefreshBacking(virStorageVolDefPtr vol)
 {
+    virStorageVolStamp stamp;
+
+    if (!vol->backingStore.path)
+        return;
+
+    if (virStorageBackendFileSystemStamp(vol->backingStore.path, &stamp) == 0 &&
+        virStorageBackendFileSystemStampEqual(&vol->backingStamp, &stamp))
+        return;
+
+    if (virStorageBackendUpdateVolTargetInfo(&vol->backingStore,
+                                             NULL,
+                                             NULL) < 0) {
+        /* The backing file is currently unavailable, the capacity,
+         * allocation, owner, group and mode are unknown. Just log the
+         * error an continue.
+         * Unfortunately virStorageBackendProbeTarget() might already
+         * have logged a similar message for the same problem, but only
+         * if AUTO format detection was used. */
+        virStorageReportError(VIR_ERR_INTERNAL_ERROR,
+                              _("cannot probe backing volume info: %s"),
+                              vol->backingStore.path);
+        memset(&vol->backingStamp, 0, sizeof(vol->backingStamp));
+        return;
+    }
+
+    vol->backingStamp = stamp;
+}
+
+/*
+ * Decide what to do about the directory entry @name: keep its volume
+ * as it is, queue the file to be probed, or drop its volume if it is
+ * no longer there. @name may belong to a volume which gets dropped,
+ * so it must not be used after that.
+ */
+static int
+virStorageBackendFileSystemRefreshEntry(virStorageBackendFileSystemRefreshStatePtr state,
+                                        const char *name)
+{
+    virStoragePoolObjPtr pool = state->pool;
+    virStorageVolDefPtr old = virStorageVolDefFindByName(pool, name);
+    virStorageVolDefPtr vol = NULL;
+    virStorageVolStamp stamp;
+    char *path = NULL;
+    int rc;
+
+    if (virAsprintf(&path, "%s/%s", pool->def->target.path, name) < 0)
+        goto no_memory;
+
+    /* A file which can't be examined (rc == -1) is left to
+     * the probe, to report why */
+    if ((rc = virStorageBackendFileSystemStamp(path, &stamp)) == 1) {
+        VIR_FREE(path);
+        if (old) {
+            virStoragePoolObjRemoveVol(pool, old);
+            virStorageVolDefFree(old);
+        }
+        return 0;
+    }
+
+    if (old && virStorageBackendFileSystemStampEqual(&old->stamp, &stamp)) {
+        VIR_FREE(path);
+        virStorageBackendFileSystemRefreshBacking(old);
+        return 0;
+    }
+
+    if (VIR_ALLOC(vol) < 0)
+        goto no_memory;
+
+    if ((vol->name = strdup(name)) == NULL)
+        goto no_memory;
+
+    vol->type = VIR_STORAGE_VOL_FILE;
+    vol->target.format = VIR_STORAGE_FILE_RAW; /* Real value is filled in during probe */
+    vol->target.path = path;
+    path = NULL;
+
+    if ((vol->key = strdup(vol->target.path)) == NULL)
+        goto no_memory;
+
+    vol->stamp = stamp;
+
+    if (VIR_EXPAND_N(state->probes, state->nprobes, 1) < 0)
+        goto no_memory;
+    state->probes[state->nprobes - 1].old = old;
+    state->probes[state->nprobes - 1].vol = vol;
+
+    return 0;
+
+no_memory:
+    virReportOOMError();
+    VIR_FREE(path);
+    virStorageVolDefFree(vol);
+    return -1;
+}
+
+/* Runs in a worker thread, so must not touch the pool */
+static void
+virStorageBackendFileSystemProbeVol(virStorageBackendFileSystemProbePtr probe)
+{
+    virStorageVolDefPtr vol = probe->vol;
+    char *backingStore;
+    int backingStoreFormat;
+    int ret;
+
+    if ((ret = virStorageBackendProbeTarget(&vol->target,
+                                            &backingStore,
+                                            &backingStoreFormat,
+                                            &vol->allocation,
+                                            &vol->capacity,
+                                            &vol->target.encryption)) < 0) {
+        if (ret == -3) {
+            /* The backing file is currently unavailable, its format is not
+             * explicitly specified, the probe to auto detect the format
+             * failed: continue with faked RAW format, since AUTO will
+             * break virStorageVolTargetDefFormat() generating the line
+             * <format type='...'/>. */
+            backingStoreFormat = VIR_STORAGE_FILE_RAW;
+        } else {
+            /* -2 means a non-regular file, which is silently ignored */
+            if (ret == -1)
+                probe->err = virSaveLastError();
+            probe->ret = ret;
+            return;
+        }
+    }
+
+    if (backingStore != NULL) {
+        vol->backingStore.path = backingStore;
+        vol->backingStore.format = backingStoreFormat;
+        virStorageBackendFileSystemRefreshBacking(vol);
+    }
+
+    probe->ret = 0;
+}
+
+static void
+virStorageBackendFileSystemProbeWorker(void *opaque)
+{
+    virStorageBackendFileSystemRefreshStatePtr state = opaque;
+
+    while (1) {
+        virStorageBackendFileSystemProbePtr probe;
+
+        virMutexLock(&state->lock);
+        if (state->next == state->nprobes) {
+            virMutexUnlock(&state->lock);
+            break;
+        }
+        probe = &state->probes[state->next++];
+        virMutexUnlock(&state->lock);
+
+        virStorageBackendFileSystemProbeVol(probe);
+    }
+}
+
+/* Each probe mostly waits on opening the file and reading its
+ * header, which on network filesystems is a round trip or two,
+ * so run several at once */
+static void
+virStorageBackendFileSystemProbeAll(virStorageBackendFileSystemRefreshStatePtr state)
+{
+    virThread threads[REFRESH_PROBE_THREADS - 1];
+    size_t nthreads = 0;
+    size_t i;
+
+    for (i = 0 ;
+         i < ARRAY_CARDINALITY(threads) && i + 1 < state->nprobes ;
+         i++) {
+        if (virThreadCreate(&threads[i], true,
+                            virStorageBackendFileSystemProbeWorker,
+                            state) < 0)
+            break;
+        nthreads++;
+    }
+
+    virStorageBackendFileSystemProbeWorker(state);
+
+    for (i = 0 ; i < nthreads ; i++)
+        virThreadJoin(&threads[i]);
+}
+
+static bool watchEnabled = true;
+
+/*
+ * Whether local pools' directories may be watched for changes between
+ * refreshes. Pools which are already watched keep their watch until
+ * it next needs setting up again.
+ */
+void
+virStorageBackendFileSystemSetWatch(bool enabled)
+{
+    watchEnabled = enabled;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/*
+ * Watches a local pool's directory between refreshes, so that only
+ * the entries which changed need looking at. Network filesystems
+ * don't report changes made by other hosts, so they always get a
+ * full scan.
+ */
+typedef struct _virStorageBackendFileSystemWatch virStorageBackendFileSystemWatch;
+typedef virStorageBackendFileSystemWatch *virStorageBackendFileSystemWatchPtr;
+struct _virStorageBackendFileSystemWatch {
+    int fd;
+    bool primed;    /* The volumes matched the directory at the last refresh */
+};
+
+/* Only the events which can bring a new file into the pool. Attribute
+ * changes, in-place writes and renames away are caught by re-examining
+ * the known volumes, and the directory going away shows up as
+ * IN_IGNORED, which is always delivered */
+# define REFRESH_WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE |       \
+                             IN_DELETE | IN_MOVED_TO)
+
+static void
+virStorageBackendFileSystemWatchFree(void *opaque)
+{
+    virStorageBackendFileSystemWatchPtr watch = opaque;
+
+    if (!watch)
+        return;
+
+    VIR_FORCE_CLOSE(watch->fd);
+    VIR_FREE(watch);
+}
+
+/* A watch is only an optimization, so failing to set one
+ * up just means doing full scans */
+static virStorageBackendFileSystemWatchPtr
+virStorageBackendFileSystemWatchNew(virStoragePoolObjPtr pool)
+{
+    virStorageBackendFileSystemWatchPtr watch;
+
+    if (!watchEnabled || pool->def->type == VIR_STORAGE_POOL_NETFS)
+        return NULL;
+
+    if (VIR_ALLOC(watch) < 0)
+        return NULL;
+
+    if ((watch->fd = inotify_init()) < 0 ||
+        virSetNonBlock(watch->fd) < 0 ||
+        virSetCloseExec(watch->fd) < 0 ||
+        inotify_add_watch(watch->fd, pool->def->target.path,
+                          REFRESH_WATCH_MASK) < 0) {
+        VIR_DEBUG("Not watching '%s' for changes: %s",
+                  pool->def->target.path, strerror(errno));
+        virStorageBackendFileSystemWatchFree(watch);
+        return NULL;
+    }
+
+    return watch;
+}
+
+/*
+ * Collect the names of the entries changed since the last refresh
+ * into @changed. Returns 1 if the kernel dropped events, so the
+ * directory must be scanned again but the watch is still good, or
+ * -1 if the watch itself is gone and must be set up again.
+ */
+static int
+virStorageBackendFileSystemWatchRead(virStorageBackendFileSystemWatchPtr watch,
+                                     virHashTablePtr changed)
+{
+    union {
+        struct inotify_event event;
+        char buf[4096];
+    } u;
+    int ret = 0;
+
+    while (1) {
+        ssize_t got = read(watch->fd, &u, sizeof(u));
+        size_t off;
+
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                ret = -1;
+            break;
+        }
+        if (got == 0)
+            break;
+
+        for (off = 0 ; off < got ;) {
+            struct inotify_event *event = (struct inotify_event *)(u.buf + off);
+
+            if (event->mask & (IN_IGNORED | IN_UNMOUNT)) {
+                ret = -1;
+            } else if (event->mask & IN_Q_OVERFLOW) {
+                if (ret == 0)
+                    ret = 1;
+            } else if (event->len && ret == 0 &&
+                       virHashUpdateEntry(changed, event->name, changed) < 0) {
+                ret = -1;
+            }
+
+            off += sizeof(*event) + event->len;
+        }
+    }
+
+    return ret;
+}
+#endif /* HAVE_SYS_INOTIFY_H */
+
+static void
+virStorageBackendFileSystemRefreshChanged(void *payload ATTRIBUTE_UNUSED,
+                                          const void *name,
+                                          void *opaque)
+{
+    virStorageBackendFileSystemRefreshStatePtr state = opaque;
+
+    if (state->failed)
+        return;
+
+    if (virStorageBackendFileSystemRefreshEntry(state, name) < 0)
+        state->failed = true;
+}
+
+/*
+ * Look again at the entries the watch reported, which covers new
+ * files, and at every known volume, since the watch doesn't report
+ * changes to files already in the pool. Those only need a stat to
+ * tell they are unchanged, unlike reading the whole directory.
+ */
+static int
+virStorageBackendFileSystemRefreshChanges(virStorageBackendFileSystemRefreshStatePtr state)
+{
+    virStoragePoolObjPtr pool = state->pool;
+    virStorageVolDefPtr *vols = NULL;
+    size_t nvols = 0;
+    size_t i;
+
+    virHashForEach(state->changed, virStorageBackendFileSystemRefreshChanged,
+                   state);
+    if (state->failed)
+        return -1;
+
+    for (i = 0 ; i < pool->volumes.count ; i++) {
+        virStorageVolDefPtr vol = pool->volumes.objs[i];
+
+        if (virHashLookup(state->changed, vol->name))
+            continue;
+        if (VIR_EXPAND_N(vols, nvols, 1) < 0) {
+            virReportOOMError();
+            VIR_FREE(vols);
+            return -1;
+        }
+        vols[nvols - 1] = vol;
+    }
+
+    /* Each call can only drop the volume it was passed */
+    for (i = 0 ; i < nvols ; i++) {
+        if (virStorageBackendFileSystemRefreshEntry(state, vols[i]->name) < 0) {
+            VIR_FREE(vols);
+            return -1;
+        }
+    }
+
+    VIR_FREE(vols);
+    return 0;
+}
+
+/* Look at every entry, and drop the volumes which weren't found */
+static int
+virStorageBackendFileSystemRefreshScan(virStorageBackendFileSystemRefreshStatePtr state)
+{
+    virStoragePoolObjPtr pool = state->pool;
     DIR *dir;
     struct dirent *ent;
-    struct statvfs sb;
-    virStorageVolDefPtr vol = NULL;
+    unsigned int i;
+    int ret = -1;
+
+    if (!(state->seen = virHashCreate(pool->volumes.count + 1, NULL)))
+        return -1;
 
     if (!(dir = opendir(pool->def->target.path))) {
         virReportSystemError(errno,
@@ -629,83 +1095,127 @@ virStorageBackendFileSystemRefresh(virConnectPtr conn ATTRIBUTE_UNUSED,
     }
 
     while ((ent = readdir(dir)) != NULL) {
-        int ret;
-        char *backingStore;
-        int backingStoreFormat;
-
-        if (VIR_ALLOC(vol) < 0)
-            goto no_memory;
-
-        if ((vol->name = strdup(ent->d_name)) == NULL)
-            goto no_memory;
-
-        vol->type = VIR_STORAGE_VOL_FILE;
-        vol->target.format = VIR_STORAGE_FILE_RAW; /* Real value is filled in during probe */
-        if (virAsprintf(&vol->target.path, "%s/%s",
-                        pool->def->target.path,
-                        vol->name) == -1)
-            goto no_memory;
-
-        if ((vol->key = strdup(vol->target.path)) == NULL)
-            goto no_memory;
-
-        if ((ret = virStorageBackendProbeTarget(&vol->target,
-                                                &backingStore,
-                                                &backingStoreFormat,
-                                                &vol->allocation,
-                                                &vol->capacity,
-                                                &vol->target.encryption)) < 0) {
-            if (ret == -2) {
-                /* Silently ignore non-regular files,
-                 * eg '.' '..', 'lost+found', dangling symbolic link */
-                virStorageVolDefFree(vol);
-                vol = NULL;
-                continue;
-            } else if (ret == -3) {
-                /* The backing file is currently unavailable, its format is not
-                 * explicitly specified, the probe to auto detect the format
-                 * failed: continue with faked RAW format, since AUTO will
-                 * break virStorageVolTargetDefFormat() generating the line
-                 * <format type='...'/>. */
-                backingStoreFormat = VIR_STORAGE_FILE_RAW;
-            } else
-                goto cleanup;
-        }
+        if (virHashAddEntry(state->seen, ent->d_name, state) < 0 ||
+            virStorageBackendFileSystemRefreshEntry(state, ent->d_name) < 0)
+            goto cleanup;
+    }
 
-        if (backingStore != NULL) {
-            vol->backingStore.path = backingStore;
-            vol->backingStore.format = backingStoreFormat;
-
-            if (virStorageBackendUpdateVolTargetInfo(&vol->backingStore,
-                                                     NULL,
-                                                     NULL) < 0) {
-                /* The backing file is currently unavailable, the capacity,
-                 * allocation, owner, group and mode are unknown. Just log the
-                 * error an continue.
-                 * Unfortunately virStorageBackendProbeTarget() might already
-                 * have logged a similar message for the same problem, but only
-                 * if AUTO format detection was used. */
-                virStorageReportError(VIR_ERR_INTERNAL_ERROR,
-                                      _("cannot probe backing volume info: %s"),
-                                      vol->backingStore.path);
-            }
+    i = pool->volumes.count;
+    while (i-- > 0) {
+        virStorageVolDefPtr vol = pool->volumes.objs[i];
+
+        if (!virHashLookup(state->seen, vol->name)) {
+            virStoragePoolObjRemoveVol(pool, vol);
+            virStorageVolDefFree(vol);
         }
+    }
+
+    ret = 0;
+
+cleanup:
+    if (dir)
+        closedir(dir);
+    virHashFree(state->seen);
+    state->seen = NULL;
+    return ret;
+}
 
+/**
+ * Iterate over the pool's directory and enumerate all disk images
+ * within it. This is non-recursive.
+ *
+ * Volumes already in the pool are kept as long as their file looks
+ * the same as when it was probed, and only new or changed files are
+ * probed again, several at a time. Local pools are watched with
+ * inotify between refreshes, so the directory needn't be rescanned.
+ */
+static int
+virStorageBackendFileSystemRefresh(virConnectPtr conn ATTRIBUTE_UNUSED,
+                                   virStoragePoolObjPtr pool)
+{
+    virStorageBackendFileSystemRefreshState state;
+    struct statvfs sb;
+    bool rescan = true;
+    size_t i;
+    int ret = -1;
+#ifdef HAVE_SYS_INOTIFY_H
+    virStorageBackendFileSystemWatchPtr watch = pool->privateData;
+    int rc;
+#endif
+
+    memset(&state, 0, sizeof(state));
+    state.pool = pool;
+
+    if (virMutexInit(&state.lock) < 0) {
+        virStorageReportError(VIR_ERR_INTERNAL_ERROR,
+                              "%s", _("cannot initialize mutex"));
+        virStoragePoolObjClearVols(pool);
+        return -1;
+    }
+
+    if (!(state.changed = virHashCreate(32, NULL)))
+        goto cleanup;
 
-        if (VIR_REALLOC_N(pool->volumes.objs,
-                          pool->volumes.count+1) < 0)
-            goto no_memory;
-        pool->volumes.objs[pool->volumes.count++] = vol;
-        vol = NULL;
+#ifdef HAVE_SYS_INOTIFY_H
+    if (watch && watch->primed &&
+        (rc = virStorageBackendFileSystemWatchRead(watch, state.changed)) >= 0) {
+        if (rc == 0)
+            rescan = false;
+        else
+            VIR_DEBUG("Events for '%s' overflowed, scanning it again",
+                      pool->def->target.path);
+    } else {
+        /* Start watching before the scan, so nothing is missed */
+        virStorageBackendFileSystemWatchFree(watch);
+        watch = virStorageBackendFileSystemWatchNew(pool);
+        pool->privateData = watch;
+        pool->privateDataFreeFunc = virStorageBackendFileSystemWatchFree;
     }
-    closedir(dir);
+#endif
 
+    if (rescan) {
+        if (virStorageBackendFileSystemRefreshScan(&state) < 0)
+            goto cleanup;
+    } else {
+        if (virStorageBackendFileSystemRefreshChanges(&state) < 0)
+            goto cleanup;
+    }
+
+    virStorageBackendFileSystemProbeAll(&state);
+
+    for (i = 0 ; i < state.nprobes ; i++) {
+        virStorageBackendFileSystemProbePtr probe = &state.probes[i];
+
+        if (probe->ret == -1) {
+            if (probe->err)
+                virSetError(probe->err);
+            else
+                virReportOOMError();
+            goto cleanup;
+        }
+
+        if (probe->old) {
+            virStoragePoolObjRemoveVol(pool, probe->old);
+            virStorageVolDefFree(probe->old);
+            probe->old = NULL;
+        }
+
+        if (probe->ret == -2) {
+            /* Silently ignore non-regular files,
+             * eg 'lost+found', dangling symbolic link */
+            continue;
+        }
+
+        if (virStoragePoolObjAddVol(pool, probe->vol) < 0)
+            goto cleanup;
+        probe->vol = NULL;
+    }
 
     if (statvfs(pool->def->target.path, &sb) < 0) {
         virReportSystemError(errno,
                              _("cannot statvfs path '%s'"),
                              pool->def->target.path);
-        return -1;
+        goto cleanup;
     }
     pool->def->capacity = ((unsigned long long)sb.f_frsize *
                            (unsigned long long)sb.f_blocks);
@@ -713,18 +1223,27 @@ virStorageBackendFileSystemRefresh(virConnectPtr conn ATTRIBUTE_UNUSED,
                             (unsigned long long)sb.f_bsize);
     pool->def->allocation = pool->def->capacity - pool->def->available;
 
-    return 0;
+#ifdef HAVE_SYS_INOTIFY_H
+    if (watch)
+        watch->primed = true;
+#endif
 
-no_memory:
-    virReportOOMError();
-    /* fallthrough */
+    ret = 0;
 
- cleanup:
-    if (dir)
-        closedir(dir);
-    virStorageVolDefFree(vol);
-    virStoragePoolObjClearVols(pool);
-    return -1;
+cleanup:
+    for (i = 0 ; i < state.nprobes ; i++) {
+        virStorageVolDefFree(state.probes[i].vol);
+        virFreeError(state.probes[i].err);
+    }
+    VIR_FREE(state.probes);
+    virHashFree(state.changed);
+    virMutexDestroy(&state.lock);
+
+    if (ret < 0) {
+        virStoragePoolObjClearVols(pool);
+        virStorageBackendFileSystemReleaseState(pool);
+    }
+    return ret;
 }
 
 
@@ -737,18 +1256,20 @@ no_memory:
  *  - If it is a FS based pool, unmounts the unlying source device on the pool
  *  - Releases all cached data about volumes
  */
-#if WITH_STORAGE_FS
 static int
 virStorageBackendFileSystemStop(virConnectPtr conn ATTRIBUTE_UNUSED,
                                 virStoragePoolObjPtr pool)
 {
+    virStorageBackendFileSystemReleaseState(pool);
+
+#if WITH_STORAGE_FS
     if (pool->def->type != VIR_STORAGE_POOL_DIR &&
         virStorageBackendFileSystemUnmount(pool) < 0)
         return -1;
+#endif /* WITH_STORAGE_FS */
 
     return 0;
 }
-#endif /* WITH_STORAGE_FS */
 
 
 /**
@@ -983,6 +1504,8 @@ virStorageBackend virStorageBackendDirectory = {
     .buildPool = virStorageBackendFileSystemBuild,
     .checkPool = virStorageBackendFileSystemCheck,
     .refreshPool = virStorageBackendFileSystemRefresh,
+    .refreshIncremental = true,
+    .stopPool = virStorageBackendFileSystemStop,
     .deletePool = virStorageBackendFileSystemDelete,
     .buildVol = virStorageBackendFileSystemVolBuild,
     .buildVolFrom = virStorageBackendFileSystemVolBuildFrom,
@@ -999,6 +1522,7 @@ virStorageBackend virStorageBackendFileSystem = {
     .checkPool = virStorageBackendFileSystemCheck,
     .startPool = virStorageBackendFileSystemStart,
     .refreshPool = virStorageBackendFileSystemRefresh,
+    .refreshIncremental = true,
     .stopPool = virStorageBackendFileSystemStop,
     .deletePool = virStorageBackendFileSystemDelete,
     .buildVol = virStorageBackendFileSystemVolBuild,
@@ -1015,6 +1539,7 @@ virStorageBackend virStorageBackendNetFileSystem = {
     .startPool = virStorageBackendFileSystemStart,
     .findPoolSources = virStorageBackendFileSystemNetFindPoolSources,
     .refreshPool = virStorageBackendFileSystemRefresh,
+    .refreshIncremental = true,
     .stopPool = virStorageBackendFileSystemStop,
     .deletePool = virStorageBackendFileSystemDelete,
     .buildVol = virStorageBackendFileSystemVolBuild,
@@ -32,4 +32,6 @@ extern virStorageBackend virStorageBackendNetFileSystem;
 # endif
 extern virStorageBackend virStorageBackendDirectory;
 
+void virStorageBackendFileSystemSetWatch(bool enabled);
+
 #endif /* __VIR_STORAGE_BACKEND_FS_H__ */
@@ -68,6 +68,7 @@ virStorageBackendLogicalMakeVol(virStoragePoolObjPtr pool,
                                 void *data)
 {
     virStorageVolDefPtr vol = NULL;
+    bool is_new_vol = false;
     unsigned long long offset, size, length;
 
     /* See if we're only looking for a specific volume */
@@ -89,28 +90,19 @@ virStorageBackendLogicalMakeVol(virStoragePoolObjPtr pool,
         }
 
         vol->type = VIR_STORAGE_VOL_BLOCK;
+        is_new_vol = true;
 
         if ((vol->name = strdup(groups[0])) == NULL) {
             virReportOOMError();
-            virStorageVolDefFree(vol);
-            return -1;
-        }
-
-        if (VIR_REALLOC_N(pool->volumes.objs,
-                          pool->volumes.count + 1)) {
-            virReportOOMError();
-            virStorageVolDefFree(vol);
-            return -1;
+            goto error;
         }
-        pool->volumes.objs[pool->volumes.count++] = vol;
     }
 
     if (vol->target.path == NULL) {
         if (virAsprintf(&vol->target.path, "%s/%s",
                         pool->def->target.path, vol->name) < 0) {
             virReportOOMError();
-            virStorageVolDefFree(vol);
-            return -1;
+            goto error;
         }
     }
 
@@ -118,8 +110,7 @@ virStorageBackendLogicalMakeVol(virStoragePoolObjPtr pool,
         if (virAsprintf(&vol->backingStore.path, "%s/%s",
                         pool->def->target.path, groups[1]) < 0) {
             virReportOOMError();
-            virStorageVolDefFree(vol);
-            return -1;
+            goto error;
         }
 
         vol->backingStore.format = VIR_STORAGE_POOL_LOGICAL_LVM2;
@@ -128,7 +119,14 @@ virStorageBackendLogicalMakeVol(virStoragePoolObjPtr pool,
     if (vol->key == NULL &&
         (vol->key = strdup(groups[2])) == NULL) {
         virReportOOMError();
-        return -1;
+        goto error;
+    }
+
+    /* Once added, the pool frees the volume if we fail below */
+    if (is_new_vol) {
+        if (virStoragePoolObjAddVol(pool, vol) < 0)
+            goto error;
+        is_new_vol = false;
     }
 
     if (virStorageBackendUpdateVolInfo(vol, 1) < 0)
@@ -169,6 +167,11 @@ virStorageBackendLogicalMakeVol(virStoragePoolObjPtr pool,
     vol->source.nextent++;
 
     return 0;
+
+error:
+    if (is_new_vol)
+        virStorageVolDefFree(vol);
+    return -1;
 }
 
 static int
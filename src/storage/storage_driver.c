@@ -44,10 +44,13 @@
 #include "storage_conf.h"
 #include "memory.h"
 #include "storage_backend.h"
+#include "storage_backend_fs.h"
 #include "logging.h"
 #include "files.h"
 #include "fdstream.h"
 #include "configmake.h"
+#include "ignore-value.h"
+#include "conf.h"
 
 #define VIR_FROM_THIS VIR_FROM_STORAGE
 
@@ -64,6 +67,75 @@ static void storageDriverUnlock(virStorageDriverStatePtr driver)
     virMutexUnlock(&driver->lock);
 }
 
+static void
+storageDriverVolKeyFree(void *payload, const void *name ATTRIBUTE_UNUSED)
+{
+    VIR_FREE(payload);
+}
+
+static int
+storageDriverVolKeyInPool(const void *payload,
+                          const void *name ATTRIBUTE_UNUSED,
+                          const void *data)
+{
+    return STREQ(payload, data);
+}
+
+/* Record that @key belongs to @pool; failure only costs a slower lookup */
+static void
+storageDriverIndexVolKey(virStorageDriverStatePtr driver,
+                         virStoragePoolObjPtr pool,
+                         const char *key)
+{
+    char *poolname;
+
+    if (!key || !(poolname = strdup(pool->def->name)))
+        return;
+
+    virMutexLock(&driver->volKeysLock);
+    if (virHashUpdateEntry(driver->volKeys, key, poolname) < 0)
+        VIR_FREE(poolname);
+    virMutexUnlock(&driver->volKeysLock);
+}
+
+static void
+storageDriverUnindexVolKey(virStorageDriverStatePtr driver,
+                           virStoragePoolObjPtr pool,
+                           const char *key)
+{
+    const char *poolname;
+
+    if (!key)
+        return;
+
+    virMutexLock(&driver->volKeysLock);
+    if ((poolname = virHashLookup(driver->volKeys, key)) &&
+        STREQ(poolname, pool->def->name))
+        virHashRemoveEntry(driver->volKeys, key);
+    virMutexUnlock(&driver->volKeysLock);
+}
+
+/* Replace the keys indexed for @pool with those of its current volumes,
+ * or none if it is inactive. Called with @pool locked after it has been
+ * started, refreshed or stopped. */
+static void
+storageDriverIndexPool(virStorageDriverStatePtr driver,
+                       virStoragePoolObjPtr pool)
+{
+    unsigned int i;
+
+    virMutexLock(&driver->volKeysLock);
+    virHashRemoveSet(driver->volKeys, storageDriverVolKeyInPool,
+                     pool->def->name);
+    virMutexUnlock(&driver->volKeysLock);
+
+    if (!virStoragePoolObjIsActive(pool))
+        return;
+
+    for (i = 0 ; i < pool->volumes.count ; i++)
+        storageDriverIndexVolKey(driver, pool, pool->volumes.objs[i]->key);
+}
+
 static void
 storageDriverAutostart(virStorageDriverStatePtr driver) {
     unsigned int i;
@@ -117,11 +189,47 @@ storageDriverAutostart(virStorageDriverStatePtr driver) {
                 continue;
             }
             pool->active = 1;
+            storageDriverIndexPool(driver, pool);
         }
         virStoragePoolObjUnlock(pool);
     }
 }
 
+/* Settings are optional, so a missing or unreadable file is fine */
+static int
+storageDriverLoadConfig(const char *base)
+{
+    char *filename;
+    virConfPtr conf;
+    virConfValuePtr p;
+
+    if (virAsprintf(&filename, "%s/storage.conf", base) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+
+    /* Avoid error from non-existant or unreadable file. */
+    if (access(filename, R_OK) == -1)
+        goto done;
+    conf = virConfReadFile(filename, 0);
+    if (!conf)
+        goto done;
+
+    p = virConfGetValue(conf, "watch_directories");
+    if (p) {
+        if (p->type != VIR_CONF_LONG)
+            VIR_WARN0("storageDriverLoadConfig: invalid setting: watch_directories");
+        else
+            virStorageBackendFileSystemSetWatch(p->l != 0);
+    }
+
+    virConfFree(conf);
+
+done:
+    VIR_FREE(filename);
+    return 0;
+}
+
 /**
  * virStorageStartup:
  *
@@ -139,8 +247,17 @@ storageDriverStartup(int privileged)
         VIR_FREE(driverState);
         return -1;
     }
+    if (virMutexInit(&driverState->volKeysLock) < 0) {
+        virMutexDestroy(&driverState->lock);
+        VIR_FREE(driverState);
+        return -1;
+    }
     storageDriverLock(driverState);
 
+    if (!(driverState->volKeys = virHashCreate(1024,
+                                               storageDriverVolKeyFree)))
+        goto out_of_memory;
+
     if (privileged) {
         if ((base = strdup (SYSCONFDIR "/libvirt")) == NULL)
             goto out_of_memory;
@@ -158,6 +275,9 @@ storageDriverStartup(int privileged)
         VIR_FREE(userdir);
     }
 
+    if (storageDriverLoadConfig(base) < 0)
+        goto error;
+
     /* Configuration paths are either ~/.libvirt/storage/... (session) or
      * /etc/libvirt/storage/... (system).
      */
@@ -253,9 +373,11 @@ storageDriverShutdown(void) {
     /* free inactive pools */
     virStoragePoolObjListFree(&driverState->pools);
 
+    virHashFree(driverState->volKeys);
     VIR_FREE(driverState->configDir);
     VIR_FREE(driverState->autostartDir);
     storageDriverUnlock(driverState);
+    virMutexDestroy(&driverState->volKeysLock);
     virMutexDestroy(&driverState->lock);
     VIR_FREE(driverState);
 
@@ -553,6 +675,7 @@ storagePoolCreate(virConnectPtr conn,
     }
     VIR_INFO(_("Creating storage pool '%s'"), pool->def->name);
     pool->active = 1;
+    storageDriverIndexPool(driver, pool);
 
     ret = virGetStoragePool(conn, pool->def->name, pool->def->uuid);
 
@@ -693,6 +816,7 @@ storagePoolStart(virStoragePoolPtr obj,
 
     VIR_INFO(_("Starting up storage pool '%s'"), pool->def->name);
     pool->active = 1;
+    storageDriverIndexPool(driver, pool);
     ret = 0;
 
 cleanup:
@@ -779,6 +903,7 @@ storagePoolDestroy(virStoragePoolPtr obj) {
     virStoragePoolObjClearVols(pool);
 
     pool->active = 0;
+    storageDriverIndexPool(driver, pool);
     VIR_INFO(_("Shutting down storage pool '%s'"), pool->def->name);
 
     if (pool->configFile == NULL) {
@@ -879,12 +1004,14 @@ storagePoolRefresh(virStoragePoolPtr obj,
         goto cleanup;
     }
 
-    virStoragePoolObjClearVols(pool);
+    if (!backend->refreshIncremental)
+        virStoragePoolObjClearVols(pool);
     if (backend->refreshPool(obj->conn, pool) < 0) {
         if (backend->stopPool)
             backend->stopPool(obj->conn, pool);
 
         pool->active = 0;
+        storageDriverIndexPool(driver, pool);
 
         if (pool->configFile == NULL) {
             virStoragePoolObjRemove(&driver->pools, pool);
@@ -892,6 +1019,7 @@ storagePoolRefresh(virStoragePoolPtr obj,
         }
         goto cleanup;
     }
+    storageDriverIndexPool(driver, pool);
     ret = 0;
 
 cleanup:
@@ -1173,26 +1301,48 @@ cleanup:
 }
 
 
+/* Called with @pool locked */
+static virStorageVolPtr
+storageVolumeLookupByKeyInPool(virConnectPtr conn,
+                               virStoragePoolObjPtr pool,
+                               const char *key)
+{
+    virStorageVolDefPtr vol;
+
+    if (!virStoragePoolObjIsActive(pool) ||
+        !(vol = virStorageVolDefFindByKey(pool, key)))
+        return NULL;
+
+    return virGetStorageVol(conn, pool->def->name, vol->name, vol->key);
+}
+
 static virStorageVolPtr
 storageVolumeLookupByKey(virConnectPtr conn,
                          const char *key) {
     virStorageDriverStatePtr driver = conn->storagePrivateData;
+    virStoragePoolObjPtr pool;
+    char *poolname = NULL;
     unsigned int i;
     virStorageVolPtr ret = NULL;
 
     storageDriverLock(driver);
+
+    /* Try the pool the key was last seen in first */
+    virMutexLock(&driver->volKeysLock);
+    if ((poolname = virHashLookup(driver->volKeys, key)))
+        poolname = strdup(poolname);
+    virMutexUnlock(&driver->volKeysLock);
+
+    if (poolname &&
+        (pool = virStoragePoolObjFindByName(&driver->pools, poolname))) {
+        ret = storageVolumeLookupByKeyInPool(conn, pool, key);
+        virStoragePoolObjUnlock(pool);
+    }
+    VIR_FREE(poolname);
+
     for (i = 0 ; i < driver->pools.count && !ret ; i++) {
         virStoragePoolObjLock(driver->pools.objs[i]);
-        if (virStoragePoolObjIsActive(driver->pools.objs[i])) {
-            virStorageVolDefPtr vol =
-                virStorageVolDefFindByKey(driver->pools.objs[i], key);
-
-            if (vol)
-                ret = virGetStorageVol(conn,
-                                       driver->pools.objs[i]->def->name,
-                                       vol->name,
-                                       vol->key);
-        }
+        ret = storageVolumeLookupByKeyInPool(conn, driver->pools.objs[i], key);
         virStoragePoolObjUnlock(driver->pools.objs[i]);
     }
     storageDriverUnlock(driver);
@@ -1299,12 +1449,6 @@ storageVolumeCreateXML(virStoragePoolPtr obj,
         goto cleanup;
     }
 
-    if (VIR_REALLOC_N(pool->volumes.objs,
-                      pool->volumes.count+1) < 0) {
-        virReportOOMError();
-        goto cleanup;
-    }
-
     if (!backend->createVol) {
         virStorageReportError(VIR_ERR_NO_SUPPORT,
                               "%s", _("storage pool does not support volume "
@@ -1316,7 +1460,12 @@ storageVolumeCreateXML(virStoragePoolPtr obj,
         goto cleanup;
     }
 
-    pool->volumes.objs[pool->volumes.count++] = voldef;
+    if (virStoragePoolObjAddVol(pool, voldef) < 0) {
+        if (backend->deleteVol)
+            ignore_value(backend->deleteVol(obj->conn, pool, voldef, 0));
+        goto cleanup;
+    }
+    storageDriverIndexVolKey(driver, pool, voldef->key);
     volobj = virGetStorageVol(obj->conn, pool->def->name, voldef->name,
                               voldef->key);
 
@@ -1466,22 +1615,28 @@ storageVolumeCreateXMLFrom(virStoragePoolPtr obj,
         goto cleanup;
     }
 
-    if (backend->refreshVol &&
-        backend->refreshVol(obj->conn, pool, origvol) < 0)
+    if (origvol->wiping) {
+        virStorageReportError(VIR_ERR_OPERATION_INVALID,
+                              _("volume '%s' is being wiped."),
+                              origvol->name);
         goto cleanup;
+    }
 
-    if (VIR_REALLOC_N(pool->volumes.objs,
-                      pool->volumes.count+1) < 0) {
-        virReportOOMError();
+    if (backend->refreshVol &&
+        backend->refreshVol(obj->conn, pool, origvol) < 0)
         goto cleanup;
-    }
 
     /* 'Define' the new volume so we get async progress reporting */
     if (backend->createVol(obj->conn, pool, newvol) < 0) {
         goto cleanup;
     }
 
-    pool->volumes.objs[pool->volumes.count++] = newvol;
+    if (virStoragePoolObjAddVol(pool, newvol) < 0) {
+        if (backend->deleteVol)
+            ignore_value(backend->deleteVol(obj->conn, pool, newvol, 0));
+        goto cleanup;
+    }
+    storageDriverIndexVolKey(driver, pool, newvol->key);
     volobj = virGetStorageVol(obj->conn, pool->def->name, newvol->name,
                               newvol->key);
 
@@ -1551,7 +1706,7 @@ storageVolumeDownload(virStorageVolPtr obj,
     virStorageVolDefPtr vol = NULL;
     int ret = -1;
 
-    virCheckFlags(0, -1);
+    virCheckFlags(VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM, -1);
 
     storageDriverLock(driver);
     pool = virStoragePoolObjFindByName(&driver->pools, obj->pool);
@@ -1585,11 +1740,27 @@ storageVolumeDownload(virStorageVolPtr obj,
         goto out;
     }
 
-    if (virFDStreamOpenFile(stream,
-                            vol->target.path,
-                            offset, length,
-                            O_RDONLY) < 0)
+    if (vol->wiping) {
+        virStorageReportError(VIR_ERR_OPERATION_INVALID,
+                              _("volume '%s' is being wiped."),
+                              vol->name);
         goto out;
+    }
+
+    /* Volumes are often far bigger than the host page cache,
+     * so bypass it where the helper can */
+    if (flags & VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM) {
+        if (virFDStreamOpenFileSparse(stream,
+                                      vol->target.path,
+                                      offset, length,
+                                      O_RDONLY) < 0)
+            goto out;
+    } else if (virFDStreamOpenFile(stream,
+                                   vol->target.path,
+                                   offset, length,
+                                   O_RDONLY | O_DIRECT) < 0) {
+        goto out;
+    }
 
     ret = 0;
 
@@ -1613,7 +1784,7 @@ storageVolumeUpload(virStorageVolPtr obj,
     virStorageVolDefPtr vol = NULL;
     int ret = -1;
 
-    virCheckFlags(0, -1);
+    virCheckFlags(VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM, -1);
 
     storageDriverLock(driver);
     pool = virStoragePoolObjFindByName(&driver->pools, obj->pool);
@@ -1647,13 +1818,27 @@ storageVolumeUpload(virStorageVolPtr obj,
         goto out;
     }
 
+    if (vol->wiping) {
+        virStorageReportError(VIR_ERR_OPERATION_INVALID,
+                              _("volume '%s' is being wiped."),
+                              vol->name);
+        goto out;
+    }
+
     /* Not using O_CREAT because the file is required to
-     * already exist at this point */
-    if (virFDStreamOpenFile(stream,
-                            vol->target.path,
-                            offset, length,
-                            O_WRONLY) < 0)
+     * already exist at this point. O_DIRECT as for downloads */
+    if (flags & VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM) {
+        if (virFDStreamOpenFileSparse(stream,
+                                      vol->target.path,
+                                      offset, length,
+                                      O_WRONLY) < 0)
+            goto out;
+    } else if (virFDStreamOpenFile(stream,
+                                   vol->target.path,
+                                   offset, length,
+                                   O_WRONLY | O_DIRECT) < 0) {
         goto out;
+    }
 
     ret = 0;
 
@@ -1709,65 +1894,34 @@ out:
 }
 
 
-static int
-storageWipeExtent(virStorageVolDefPtr vol,
-                  int fd,
-                  off_t extent_start,
-                  off_t extent_length,
-                  char *writebuf,
-                  size_t writebuf_length,
-                  size_t *bytes_wiped)
-{
-    int ret = -1, written = 0;
-    off_t remaining = 0;
-    size_t write_size = 0;
-
-    VIR_DEBUG("extent logical start: %ju len: %ju",
-              (uintmax_t)extent_start, (uintmax_t)extent_length);
-
-    if ((ret = lseek(fd, extent_start, SEEK_SET)) < 0) {
-        virReportSystemError(errno,
-                             _("Failed to seek to position %ju in volume "
-                               "with path '%s'"),
-                             (uintmax_t)extent_start, vol->target.path);
-        goto out;
-    }
-
-    remaining = extent_length;
-    while (remaining > 0) {
-
-        write_size = (writebuf_length < remaining) ? writebuf_length : remaining;
-        written = safewrite(fd, writebuf, write_size);
-        if (written < 0) {
-            virReportSystemError(errno,
-                                 _("Failed to write %zu bytes to "
-                                   "storage volume with path '%s'"),
-                                 write_size, vol->target.path);
-
-            goto out;
-        }
-
-        *bytes_wiped += written;
-        remaining -= written;
-    }
-
-    VIR_DEBUG("Wrote %zu bytes to volume with path '%s'",
-              *bytes_wiped, vol->target.path);
+struct storageWipeProgressData {
+    virStoragePoolObjPtr pool;
+    virStorageVolDefPtr vol;
+};
 
-    ret = 0;
+/* Publish wipe progress for storageVolumeGetInfo. The pool can't
+ * go away meanwhile, because the wipe counts as an async job */
+static void
+storageVolumeWipeProgress(unsigned long long wiped,
+                          void *opaque)
+{
+    struct storageWipeProgressData *data = opaque;
 
-out:
-    return ret;
+    virStoragePoolObjLock(data->pool);
+    data->vol->wiped = wiped;
+    virStoragePoolObjUnlock(data->pool);
 }
 
 
+/* Called with the pool unlocked, with the volume marked as wiping */
 static int
-storageVolumeWipeInternal(virStorageVolDefPtr def)
+storageVolumeWipeInternal(virStoragePoolObjPtr pool,
+                          virStorageVolDefPtr def)
 {
+    struct storageWipeProgressData data = { pool, def };
     int ret = -1, fd = -1;
     struct stat st;
-    char *writebuf = NULL;
-    size_t bytes_wiped = 0;
+    int method;
 
     VIR_DEBUG("Wiping volume with path '%s'", def->target.path);
 
@@ -1789,24 +1943,19 @@ storageVolumeWipeInternal(virStorageVolDefPtr def)
     if (S_ISREG(st.st_mode) && st.st_blocks < (st.st_size / DEV_BSIZE)) {
         ret = storageVolumeZeroSparseFile(def, st.st_size, fd);
     } else {
-
-        if (VIR_ALLOC_N(writebuf, st.st_blksize) != 0) {
-            virReportOOMError();
+        if ((method = virStorageBackendWipeRange(def->target.path, fd,
+                                                 0, def->allocation,
+                                                 storageVolumeWipeProgress,
+                                                 &data, 0)) < 0)
             goto out;
-        }
 
-        ret = storageWipeExtent(def,
-                                fd,
-                                0,
-                                def->allocation,
-                                writebuf,
-                                st.st_blksize,
-                                &bytes_wiped);
+        VIR_DEBUG("Wiped %llu bytes of volume with path '%s' by %s",
+                  def->allocation, def->target.path,
+                  virStorageBackendWipeMethodTypeToString(method));
+        ret = 0;
     }
 
 out:
-    VIR_FREE(writebuf);
-
     VIR_FORCE_CLOSE(fd);
 
     return ret;
@@ -1856,11 +2005,27 @@ storageVolumeWipe(virStorageVolPtr obj,
         goto out;
     }
 
-    if (storageVolumeWipeInternal(vol) == -1) {
+    if (vol->wiping) {
+        virStorageReportError(VIR_ERR_OPERATION_INVALID,
+                              _("volume '%s' is already being wiped."),
+                              vol->name);
         goto out;
     }
 
-    ret = 0;
+    /* Drop the pool lock while wiping, so storageVolumeGetInfo
+     * can report progress */
+    pool->asyncjobs++;
+    vol->wiping = 1;
+    vol->wiped = 0;
+    virStoragePoolObjUnlock(pool);
+
+    ret = storageVolumeWipeInternal(pool, vol);
+
+    storageDriverLock(driver);
+    virStoragePoolObjLock(pool);
+    storageDriverUnlock(driver);
+    vol->wiping = 0;
+    pool->asyncjobs--;
 
 out:
     if (pool) {
@@ -1878,7 +2043,6 @@ storageVolumeDelete(virStorageVolPtr obj,
     virStoragePoolObjPtr pool;
     virStorageBackendPtr backend;
     virStorageVolDefPtr vol = NULL;
-    unsigned int i;
     int ret = -1;
 
     storageDriverLock(driver);
@@ -1916,6 +2080,13 @@ storageVolumeDelete(virStorageVolPtr obj,
         goto cleanup;
     }
 
+    if (vol->wiping) {
+        virStorageReportError(VIR_ERR_OPERATION_INVALID,
+                              _("volume '%s' is being wiped."),
+                              vol->name);
+        goto cleanup;
+    }
+
     if (!backend->deleteVol) {
         virStorageReportError(VIR_ERR_NO_SUPPORT,
                               "%s", _("storage pool does not support vol deletion"));
@@ -1926,25 +2097,11 @@ storageVolumeDelete(virStorageVolPtr obj,
     if (backend->deleteVol(obj->conn, pool, vol, flags) < 0)
         goto cleanup;
 
-    for (i = 0 ; i < pool->volumes.count ; i++) {
-        if (pool->volumes.objs[i] == vol) {
-            VIR_INFO(_("Deleting volume '%s' from storage pool '%s'"),
-                     vol->name, pool->def->name);
-            virStorageVolDefFree(vol);
-            vol = NULL;
-
-            if (i < (pool->volumes.count - 1))
-                memmove(pool->volumes.objs + i, pool->volumes.objs + i + 1,
-                        sizeof(*(pool->volumes.objs)) * (pool->volumes.count - (i + 1)));
-
-            if (VIR_REALLOC_N(pool->volumes.objs, pool->volumes.count - 1) < 0) {
-                ; /* Failure to reduce memory allocation isn't fatal */
-            }
-            pool->volumes.count--;
-
-            break;
-        }
-    }
+    VIR_INFO(_("Deleting volume '%s' from storage pool '%s'"),
+             vol->name, pool->def->name);
+    storageDriverUnindexVolKey(driver, pool, vol->key);
+    virStoragePoolObjRemoveVol(pool, vol);
+    virStorageVolDefFree(vol);
     ret = 0;
 
 cleanup:
@@ -1990,12 +2147,23 @@ storageVolumeGetInfo(virStorageVolPtr obj,
     if ((backend = virStorageBackendForType(pool->def->type)) == NULL)
         goto cleanup;
 
+    memset(info, 0, sizeof(*info));
+    info->type = vol->type;
+
+    /* Like a volume being built, whose allocation grows as it is
+     * filled in, a volume being wiped reports how much has been
+     * wiped so far as its allocation */
+    if (vol->wiping) {
+        info->capacity = vol->capacity;
+        info->allocation = vol->wiped;
+        ret = 0;
+        goto cleanup;
+    }
+
     if (backend->refreshVol &&
         backend->refreshVol(obj->conn, pool, vol) < 0)
         goto cleanup;
 
-    memset(info, 0, sizeof(*info));
-    info->type = vol->type;
     info->capacity = vol->capacity;
     info->allocation = vol->allocation;
     ret = 0;
@@ -2043,7 +2211,10 @@ storageVolumeGetXMLDesc(virStorageVolPtr obj,
     if ((backend = virStorageBackendForType(pool->def->type)) == NULL)
         goto cleanup;
 
-    if (backend->refreshVol &&
+    /* The wipe uses 'vol' without the pool lock, so it must not be
+     * refreshed under its feet; describe it as it was instead */
+    if (!vol->wiping &&
+        backend->refreshVol &&
         backend->refreshVol(obj->conn, pool, vol) < 0)
         goto cleanup;
 
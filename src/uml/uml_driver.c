@@ -181,7 +181,7 @@ umlAutostartConfigs(struct uml_driver *driver) {
 
     struct umlAutostartData data = { driver, conn };
 
-    virHashForEach(driver->domains.objs, umlAutostartDomain, &data);
+    virDomainObjListForEach(&driver->domains, umlAutostartDomain, &data);
 
     if (conn)
         virConnectClose(conn);
@@ -318,7 +318,12 @@ reread:
                 continue;
             }
 
-            dom->def->id = driver->nextvmid++;
+            if (virDomainObjListSetID(&driver->domains, dom,
+                                      driver->nextvmid++) < 0) {
+                umlShutdownVMDaemon(NULL, driver, dom);
+                virDomainObjUnlock(dom);
+                continue;
+            }
             dom->state = VIR_DOMAIN_RUNNING;
 
             if (umlOpenMonitor(driver, dom) < 0) {
@@ -537,7 +542,7 @@ umlShutdown(void) {
 
     /* shutdown active VMs
      * XXX allow them to stay around & reconnect */
-    virHashForEach(uml_driver->domains.objs, umlShutdownOneVM, uml_driver);
+    virDomainObjListForEach(&uml_driver->domains, umlShutdownOneVM, uml_driver);
 
     virDomainObjListDeinit(&uml_driver->domains);
 
@@ -925,7 +930,7 @@ static void umlShutdownVMDaemon(virConnectPtr conn ATTRIBUTE_UNUSED,
     }
 
     vm->pid = -1;
-    vm->def->id = -1;
+    virDomainObjListClearID(&driver->domains, vm);
     vm->state = VIR_DOMAIN_SHUTOFF;
 
     virDomainConfVMNWFilterTeardown(vm);
@@ -2253,13 +2258,14 @@ static virDriver umlDriver = {
     NULL, /* domainSnapshotDelete */
     NULL, /* qemuDomainMonitorCommand */
     umlDomainOpenConsole, /* domainOpenConsole */
+    NULL, /* connectGetAllDomainStats */
 };
 
 static int
 umlVMFilterRebuild(virConnectPtr conn ATTRIBUTE_UNUSED,
                    virHashIterator iter, void *data)
 {
-    virHashForEach(uml_driver->domains.objs, iter, data);
+    virDomainObjListForEach(&uml_driver->domains, iter, data);
 
     return 0;
 }
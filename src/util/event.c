@@ -25,6 +25,7 @@
 
 #include "event.h"
 #include "event_poll.h"
+#include "event_epoll.h"
 #include "logging.h"
 #include "virterror_internal.h"
 
@@ -128,11 +129,15 @@ void virEventRegisterImpl(virEventAddHandleFunc addHandle,
     removeTimeoutImpl = removeTimeout;
 }
 
+/* Run-once function of whichever default impl was registered */
+static int (*defaultRunOnceImpl)(void) = virEventPollRunOnce;
+
 /**
  * virEventRegisterDefaultImpl:
  *
  * Registers a default event implementation based on the
- * poll() system call. This is a generic implementation
+ * epoll() system call where the host provides it, or else
+ * on the poll() system call. This is a generic implementation
  * that can be used by any client application which does
  * not have a need to integrate with an external event
  * loop impl.
@@ -149,6 +154,25 @@ int virEventRegisterDefaultImpl(void)
 
     virResetLastError();
 
+#ifdef HAVE_SYS_EPOLL_H
+    if (virEventEpollInit() == 0) {
+        virEventRegisterImpl(
+            virEventEpollAddHandle,
+            virEventEpollUpdateHandle,
+            virEventEpollRemoveHandle,
+            virEventEpollAddTimeout,
+            virEventEpollUpdateTimeout,
+            virEventEpollRemoveTimeout
+            );
+        defaultRunOnceImpl = virEventEpollRunOnce;
+        return 0;
+    }
+
+    /* eg an old kernel without epoll_create */
+    VIR_WARN0("Unable to use epoll event loop, falling back to poll");
+    virResetLastError();
+#endif
+
     if (virEventPollInit() < 0) {
         virDispatchError(NULL);
         return -1;
@@ -162,6 +186,7 @@ int virEventRegisterDefaultImpl(void)
         virEventPollUpdateTimeout,
         virEventPollRemoveTimeout
         );
+    defaultRunOnceImpl = virEventPollRunOnce;
 
     return 0;
 }
@@ -188,7 +213,7 @@ int virEventRunDefaultImpl(void)
     VIR_DEBUG0("");
     virResetLastError();
 
-    if (virEventPollRunOnce() < 0) {
+    if (defaultRunOnceImpl() < 0) {
         virDispatchError(NULL);
         return -1;
     }
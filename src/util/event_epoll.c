@@ -0,0 +1,1060 @@
+/*
+ * event_epoll.c: epoll() based event loop for monitoring file handles
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
+
+#include "threads.h"
+#include "logging.h"
+#include "event_epoll.h"
+#include "memory.h"
+#include "util.h"
+#include "hash.h"
+#include "files.h"
+#include "ignore-value.h"
+#include "virterror_internal.h"
+
+#define VIR_FROM_THIS VIR_FROM_EVENT
+
+#define virEventError(code, ...)                                    \
+    virReportErrorHelper(NULL, VIR_FROM_EVENT, code, __FILE__,      \
+                         __FUNCTION__, __LINE__, __VA_ARGS__)
+
+#ifdef HAVE_SYS_EPOLL_H
+
+# define EVENT_DEBUG(fmt, ...) VIR_DEBUG(fmt, __VA_ARGS__)
+
+/* Max number of ready handles fetched by one epoll_wait() */
+# define EVENT_EPOLL_MAX_EVENTS 128
+
+static int virEventEpollInterruptLocked(void);
+
+/* State for a single file handle being monitored */
+struct virEventEpollHandle {
+    int watch;
+    int fd;
+    int events;
+    virEventHandleCallback cb;
+    virFreeCallback ff;
+    void *opaque;
+    int deleted;
+
+    /* Other handles watching the same fd */
+    struct virEventEpollHandle *next;
+    /* Pending purge, once dispatch has finished */
+    struct virEventEpollHandle *nextDeleted;
+};
+
+/* Per file descriptor state */
+struct virEventEpollFD {
+    struct virEventEpollHandle *handles;
+    int registered;
+    /* epoll refuses fds which cannot be polled, such as regular
+     * files, which poll() reports as always ready */
+    int alwaysReady;
+    unsigned int mask;
+};
+
+/* State for a single timer being generated */
+struct virEventEpollTimeout {
+    int timer;
+    int frequency;
+    unsigned long long expiresAt;
+    virEventTimeoutCallback cb;
+    virFreeCallback ff;
+    void *opaque;
+    int deleted;
+
+    /* Position in the expiry heap, -1 if the timer is disabled */
+    int heapIndex;
+    /* Pending purge, once dispatch has finished */
+    struct virEventEpollTimeout *nextDeleted;
+};
+
+/* State for the main event loop */
+struct virEventEpollLoop {
+    virMutex lock;
+    int running;
+    virThread leader;
+    int wakeupfd[2];
+    int epollfd;
+
+    /* Indexed by file descriptor */
+    size_t fdsAlloc;
+    struct virEventEpollFD *fds;
+    /* Number of fds with alwaysReady set */
+    size_t nalwaysReady;
+
+    /* watch -> struct virEventEpollHandle */
+    virHashTablePtr handles;
+    struct virEventEpollHandle *deletedHandles;
+
+    /* timer -> struct virEventEpollTimeout */
+    virHashTablePtr timeouts;
+    struct virEventEpollTimeout *deletedTimeouts;
+
+    /* Binary min-heap of enabled timers, ordered by expiresAt */
+    size_t heapCount;
+    size_t heapAlloc;
+    struct virEventEpollTimeout **heap;
+
+    /* Scratch space for timers found expired in one iteration */
+    size_t expiredAlloc;
+    struct virEventEpollTimeout **expired;
+
+    struct epoll_event events[EVENT_EPOLL_MAX_EVENTS];
+};
+
+/* Only have one event loop */
+static struct virEventEpollLoop eventLoop = { .epollfd = -1 };
+
+/* Unique ID for the next FD watch to be registered */
+static int nextWatch = 1;
+
+/* Unique ID for the next timer to be registered */
+static int nextTimer = 1;
+
+
+/* Watch and timer IDs are always positive, so can be used as keys
+ * directly without ever clashing with the NULL key */
+static unsigned long virEventEpollIDCode(const void *name)
+{
+    return (unsigned long)name;
+}
+static bool virEventEpollIDEqual(const void *namea, const void *nameb)
+{
+    return namea == nameb;
+}
+static void *virEventEpollIDCopy(const void *name)
+{
+    return (void *)name;
+}
+
+# define EVENT_EPOLL_ID_KEY(id) ((void *)(intptr_t)(id))
+
+
+static unsigned long long virEventEpollNow(void)
+{
+    struct timeval tv;
+
+    if (gettimeofday(&tv, NULL) < 0)
+        return 0;
+
+    return (((unsigned long long)tv.tv_sec)*1000) +
+        (((unsigned long long)tv.tv_usec)/1000);
+}
+
+
+static unsigned int
+virEventEpollToNativeEvents(int events)
+{
+    unsigned int ret = 0;
+    if (events & VIR_EVENT_HANDLE_READABLE)
+        ret |= EPOLLIN;
+    if (events & VIR_EVENT_HANDLE_WRITABLE)
+        ret |= EPOLLOUT;
+    if (events & VIR_EVENT_HANDLE_ERROR)
+        ret |= EPOLLERR;
+    if (events & VIR_EVENT_HANDLE_HANGUP)
+        ret |= EPOLLHUP;
+    return ret;
+}
+
+static int
+virEventEpollFromNativeEvents(unsigned int events)
+{
+    int ret = 0;
+    if (events & EPOLLIN)
+        ret |= VIR_EVENT_HANDLE_READABLE;
+    if (events & EPOLLOUT)
+        ret |= VIR_EVENT_HANDLE_WRITABLE;
+    if (events & EPOLLERR)
+        ret |= VIR_EVENT_HANDLE_ERROR;
+    if (events & EPOLLHUP)
+        ret |= VIR_EVENT_HANDLE_HANGUP;
+    return ret;
+}
+
+
+/*
+ * Bring the kernel's view of @fd into line with the union of the
+ * events wanted by every live handle on it. A fd nobody wants events
+ * for is dropped from the epoll set entirely, matching the poll()
+ * loop, which leaves such handles out of its pollfd array.
+ */
+static int virEventEpollSyncFD(int fd)
+{
+    struct virEventEpollFD *efd = &eventLoop.fds[fd];
+    struct virEventEpollHandle *handle;
+    struct epoll_event ev;
+    int events = 0;
+
+    for (handle = efd->handles ; handle ; handle = handle->next) {
+        if (!handle->deleted)
+            events |= handle->events;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = virEventEpollToNativeEvents(events);
+    ev.data.fd = fd;
+
+    if (ev.events == 0) {
+        if (efd->alwaysReady) {
+            efd->alwaysReady = 0;
+            eventLoop.nalwaysReady--;
+        }
+        if (efd->registered &&
+            epoll_ctl(eventLoop.epollfd, EPOLL_CTL_DEL, fd, &ev) < 0 &&
+            errno != ENOENT && errno != EBADF) {
+            virReportSystemError(errno,
+                                 _("Unable to remove fd %d from epoll set"),
+                                 fd);
+            return -1;
+        }
+        efd->registered = 0;
+        efd->mask = 0;
+        return 0;
+    }
+
+    if (efd->alwaysReady) {
+        efd->mask = ev.events;
+        return 0;
+    }
+
+    if (efd->registered && efd->mask == ev.events)
+        return 0;
+
+    /* The fd may have been closed & reused since it was registered,
+     * which silently drops it from the epoll set */
+    if (efd->registered &&
+        epoll_ctl(eventLoop.epollfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        if (errno != ENOENT)
+            goto error;
+        efd->registered = 0;
+    }
+    if (!efd->registered &&
+        epoll_ctl(eventLoop.epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        if (errno == EPERM) {
+            EVENT_DEBUG("fd %d cannot be polled, treating as always ready",
+                        fd);
+            efd->alwaysReady = 1;
+            efd->mask = ev.events;
+            eventLoop.nalwaysReady++;
+            return 0;
+        }
+        if (errno != EEXIST ||
+            epoll_ctl(eventLoop.epollfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+            goto error;
+    }
+
+    efd->registered = 1;
+    efd->mask = ev.events;
+    return 0;
+
+error:
+    virReportSystemError(errno,
+                         _("Unable to add fd %d to epoll set"), fd);
+    return -1;
+}
+
+
+/*
+ * Register a callback for monitoring file handle events.
+ * NB, it *must* be safe to call this from within a callback
+ */
+int virEventEpollAddHandle(int fd, int events,
+                           virEventHandleCallback cb,
+                           void *opaque,
+                           virFreeCallback ff) {
+    struct virEventEpollHandle *handle;
+    struct virEventEpollHandle **tail;
+    int watch;
+    EVENT_DEBUG("Add handle fd=%d events=%d cb=%p opaque=%p", fd, events, cb, opaque);
+
+    if (fd < 0) {
+        virEventError(VIR_ERR_INTERNAL_ERROR,
+                      _("Cannot watch invalid fd %d"), fd);
+        return -1;
+    }
+
+    if (VIR_ALLOC(handle) < 0)
+        return -1;
+
+    virMutexLock(&eventLoop.lock);
+    if (VIR_RESIZE_N(eventLoop.fds, eventLoop.fdsAlloc, fd, 1) < 0)
+        goto error;
+
+    watch = nextWatch++;
+
+    handle->watch = watch;
+    handle->fd = fd;
+    handle->events = events;
+    handle->cb = cb;
+    handle->ff = ff;
+    handle->opaque = opaque;
+
+    if (virHashAddEntry(eventLoop.handles,
+                        EVENT_EPOLL_ID_KEY(watch), handle) < 0)
+        goto error;
+
+    /* Append, so dispatch order for a shared fd is registration order */
+    tail = &eventLoop.fds[fd].handles;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = handle;
+
+    if (virEventEpollSyncFD(fd) < 0) {
+        *tail = NULL;
+        virHashRemoveEntry(eventLoop.handles, EVENT_EPOLL_ID_KEY(watch));
+        goto error;
+    }
+
+    virEventEpollInterruptLocked();
+    virMutexUnlock(&eventLoop.lock);
+
+    return watch;
+
+error:
+    virMutexUnlock(&eventLoop.lock);
+    VIR_FREE(handle);
+    return -1;
+}
+
+void virEventEpollUpdateHandle(int watch, int events) {
+    struct virEventEpollHandle *handle;
+    EVENT_DEBUG("Update handle w=%d e=%d", watch, events);
+
+    if (watch <= 0) {
+        VIR_WARN("Ignoring invalid update watch %d", watch);
+        return;
+    }
+
+    virMutexLock(&eventLoop.lock);
+    handle = virHashLookup(eventLoop.handles, EVENT_EPOLL_ID_KEY(watch));
+    if (handle && !handle->deleted) {
+        handle->events = events;
+        if (virEventEpollSyncFD(handle->fd) < 0)
+            VIR_WARN("Failed to update events for fd %d", handle->fd);
+        virEventEpollInterruptLocked();
+    }
+    virMutexUnlock(&eventLoop.lock);
+}
+
+/*
+ * Unregister a callback from a file handle
+ * NB, it *must* be safe to call this from within a callback
+ * For this reason we only ever set a flag in the existing list.
+ * Actual deletion will be done out-of-band
+ */
+int virEventEpollRemoveHandle(int watch) {
+    struct virEventEpollHandle *handle;
+    EVENT_DEBUG("Remove handle w=%d", watch);
+
+    if (watch <= 0) {
+        VIR_WARN("Ignoring invalid remove watch %d", watch);
+        return -1;
+    }
+
+    virMutexLock(&eventLoop.lock);
+    handle = virHashLookup(eventLoop.handles, EVENT_EPOLL_ID_KEY(watch));
+    if (!handle || handle->deleted) {
+        virMutexUnlock(&eventLoop.lock);
+        return -1;
+    }
+
+    EVENT_DEBUG("mark delete %d %d", watch, handle->fd);
+    handle->deleted = 1;
+    handle->nextDeleted = eventLoop.deletedHandles;
+    eventLoop.deletedHandles = handle;
+
+    /* Stop listening straightaway, since the caller is
+     * likely to close the fd before we purge the handle */
+    ignore_value(virEventEpollSyncFD(handle->fd));
+
+    virEventEpollInterruptLocked();
+    virMutexUnlock(&eventLoop.lock);
+    return 0;
+}
+
+
+static void virEventEpollHeapSwap(size_t a, size_t b)
+{
+    struct virEventEpollTimeout *tmp = eventLoop.heap[a];
+
+    eventLoop.heap[a] = eventLoop.heap[b];
+    eventLoop.heap[b] = tmp;
+    eventLoop.heap[a]->heapIndex = a;
+    eventLoop.heap[b]->heapIndex = b;
+}
+
+static void virEventEpollHeapUp(size_t i)
+{
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (eventLoop.heap[parent]->expiresAt <= eventLoop.heap[i]->expiresAt)
+            break;
+        virEventEpollHeapSwap(i, parent);
+        i = parent;
+    }
+}
+
+static void virEventEpollHeapDown(size_t i)
+{
+    for (;;) {
+        size_t left = (2 * i) + 1;
+        size_t right = left + 1;
+        size_t smallest = i;
+
+        if (left < eventLoop.heapCount &&
+            eventLoop.heap[left]->expiresAt <
+            eventLoop.heap[smallest]->expiresAt)
+            smallest = left;
+        if (right < eventLoop.heapCount &&
+            eventLoop.heap[right]->expiresAt <
+            eventLoop.heap[smallest]->expiresAt)
+            smallest = right;
+        if (smallest == i)
+            break;
+        virEventEpollHeapSwap(i, smallest);
+        i = smallest;
+    }
+}
+
+static int virEventEpollHeapInsert(struct virEventEpollTimeout *timeout)
+{
+    if (VIR_RESIZE_N(eventLoop.heap, eventLoop.heapAlloc,
+                     eventLoop.heapCount, 1) < 0)
+        return -1;
+
+    timeout->heapIndex = eventLoop.heapCount;
+    eventLoop.heap[eventLoop.heapCount++] = timeout;
+    virEventEpollHeapUp(timeout->heapIndex);
+    return 0;
+}
+
+static void virEventEpollHeapRemove(struct virEventEpollTimeout *timeout)
+{
+    size_t i = timeout->heapIndex;
+
+    if (timeout->heapIndex < 0)
+        return;
+
+    eventLoop.heapCount--;
+    if (i != eventLoop.heapCount) {
+        virEventEpollHeapSwap(i, eventLoop.heapCount);
+        virEventEpollHeapDown(i);
+        virEventEpollHeapUp(i);
+    }
+    eventLoop.heap[eventLoop.heapCount] = NULL;
+    timeout->heapIndex = -1;
+}
+
+/*
+ * (Re)arm @timeout to fire @frequency ms from @now, or
+ * disarm it if @frequency is negative
+ */
+static int virEventEpollSchedule(struct virEventEpollTimeout *timeout,
+                                 int frequency,
+                                 unsigned long long now)
+{
+    timeout->frequency = frequency;
+
+    if (frequency < 0) {
+        timeout->expiresAt = 0;
+        virEventEpollHeapRemove(timeout);
+        return 0;
+    }
+
+    timeout->expiresAt = now + frequency;
+    if (timeout->heapIndex < 0)
+        return virEventEpollHeapInsert(timeout);
+
+    virEventEpollHeapDown(timeout->heapIndex);
+    virEventEpollHeapUp(timeout->heapIndex);
+    return 0;
+}
+
+
+/*
+ * Register a callback for a timer event
+ * NB, it *must* be safe to call this from within a callback
+ */
+int virEventEpollAddTimeout(int frequency,
+                            virEventTimeoutCallback cb,
+                            void *opaque,
+                            virFreeCallback ff) {
+    struct virEventEpollTimeout *timeout;
+    unsigned long long now;
+    int ret;
+    EVENT_DEBUG("Adding timer %d with %d ms freq", nextTimer, frequency);
+    if ((now = virEventEpollNow()) == 0)
+        return -1;
+
+    if (VIR_ALLOC(timeout) < 0)
+        return -1;
+
+    virMutexLock(&eventLoop.lock);
+    timeout->timer = nextTimer;
+    timeout->cb = cb;
+    timeout->ff = ff;
+    timeout->opaque = opaque;
+    timeout->heapIndex = -1;
+
+    if (virHashAddEntry(eventLoop.timeouts,
+                        EVENT_EPOLL_ID_KEY(timeout->timer), timeout) < 0)
+        goto error;
+
+    if (virEventEpollSchedule(timeout, frequency, now) < 0) {
+        virHashRemoveEntry(eventLoop.timeouts,
+                           EVENT_EPOLL_ID_KEY(timeout->timer));
+        goto error;
+    }
+
+    ret = nextTimer++;
+    virEventEpollInterruptLocked();
+    virMutexUnlock(&eventLoop.lock);
+    return ret;
+
+error:
+    virMutexUnlock(&eventLoop.lock);
+    VIR_FREE(timeout);
+    return -1;
+}
+
+void virEventEpollUpdateTimeout(int timer, int frequency) {
+    struct virEventEpollTimeout *timeout;
+    unsigned long long now;
+    EVENT_DEBUG("Updating timer %d timeout with %d ms freq", timer, frequency);
+
+    if (timer <= 0) {
+        VIR_WARN("Ignoring invalid update timer %d", timer);
+        return;
+    }
+
+    if ((now = virEventEpollNow()) == 0)
+        return;
+
+    virMutexLock(&eventLoop.lock);
+    timeout = virHashLookup(eventLoop.timeouts, EVENT_EPOLL_ID_KEY(timer));
+    if (timeout && !timeout->deleted) {
+        if (virEventEpollSchedule(timeout, frequency, now) < 0)
+            VIR_WARN("Failed to reschedule timer %d", timer);
+        virEventEpollInterruptLocked();
+    }
+    virMutexUnlock(&eventLoop.lock);
+}
+
+/*
+ * Unregister a callback for a timer
+ * NB, it *must* be safe to call this from within a callback
+ * For this reason we only ever set a flag in the existing list.
+ * Actual deletion will be done out-of-band
+ */
+int virEventEpollRemoveTimeout(int timer) {
+    struct virEventEpollTimeout *timeout;
+    EVENT_DEBUG("Remove timer %d", timer);
+
+    if (timer <= 0) {
+        VIR_WARN("Ignoring invalid remove timer %d", timer);
+        return -1;
+    }
+
+    virMutexLock(&eventLoop.lock);
+    timeout = virHashLookup(eventLoop.timeouts, EVENT_EPOLL_ID_KEY(timer));
+    if (!timeout || timeout->deleted) {
+        virMutexUnlock(&eventLoop.lock);
+        return -1;
+    }
+
+    timeout->deleted = 1;
+    virEventEpollHeapRemove(timeout);
+    timeout->nextDeleted = eventLoop.deletedTimeouts;
+    eventLoop.deletedTimeouts = timeout;
+
+    virEventEpollInterruptLocked();
+    virMutexUnlock(&eventLoop.lock);
+    return 0;
+}
+
+
+/*
+ * The soonest timer is always at the top of the heap
+ * @timeout: filled with expiry time of soonest timer, or -1 if
+ *           no timeout is pending
+ * returns: 0 on success, -1 on error
+ */
+static int virEventEpollCalculateTimeout(int *timeout) {
+    unsigned long long then, now;
+
+    if (eventLoop.heapCount == 0) {
+        *timeout = -1;
+        EVENT_DEBUG("No timeout pending %d", *timeout);
+        return 0;
+    }
+
+    then = eventLoop.heap[0]->expiresAt;
+
+    if ((now = virEventEpollNow()) == 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to get current time"));
+        return -1;
+    }
+
+    if (then <= now)
+        *timeout = 0;
+    else if (then - now > INT_MAX)
+        *timeout = INT_MAX;
+    else
+        *timeout = then - now;
+
+    EVENT_DEBUG("Timeout at %llu due in %d ms", then, *timeout);
+
+    return 0;
+}
+
+
+/*
+ * Take every expired timer off the top of the heap, schedule its
+ * next expiry, then invoke the user supplied callbacks. Like the
+ * poll() loop, this does not try to 'catch up' on time if the
+ * actual expiry time was later than the requested time, and
+ * each timer fires at most once per iteration.
+ *
+ * Returns 0 upon success, -1 if an error occurred
+ */
+static int virEventEpollDispatchTimeouts(void) {
+    unsigned long long now;
+    size_t nexpired = 0;
+    size_t i;
+
+    if ((now = virEventEpollNow()) == 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to get current time"));
+        return -1;
+    }
+
+    /* Add 20ms fuzz so we don't pointlessly spin doing
+     * <10ms sleeps, particularly on kernels with low HZ
+     * it is fine that a timer expires 20ms earlier than
+     * requested
+     */
+    while (eventLoop.heapCount &&
+           eventLoop.heap[0]->expiresAt <= (now+20)) {
+        struct virEventEpollTimeout *timeout = eventLoop.heap[0];
+
+        if (VIR_RESIZE_N(eventLoop.expired, eventLoop.expiredAlloc,
+                         nexpired, 1) < 0) {
+            virReportOOMError();
+            break;
+        }
+        virEventEpollHeapRemove(timeout);
+        eventLoop.expired[nexpired++] = timeout;
+    }
+
+    /* Re-arm them all before running any callback, so that
+     * callbacks see consistent state if they update timers */
+    for (i = 0 ; i < nexpired ; i++) {
+        struct virEventEpollTimeout *timeout = eventLoop.expired[i];
+        ignore_value(virEventEpollSchedule(timeout, timeout->frequency, now));
+    }
+
+    VIR_DEBUG("Dispatch %zu", nexpired);
+    for (i = 0 ; i < nexpired ; i++) {
+        struct virEventEpollTimeout *timeout = eventLoop.expired[i];
+        virEventTimeoutCallback cb;
+        int timer;
+        void *opaque;
+
+        /* An earlier callback may have removed or disabled it.
+         * The struct itself stays valid until the cleanup pass */
+        if (timeout->deleted || timeout->frequency < 0)
+            continue;
+
+        cb = timeout->cb;
+        timer = timeout->timer;
+        opaque = timeout->opaque;
+
+        virMutexUnlock(&eventLoop.lock);
+        (cb)(timer, opaque);
+        virMutexLock(&eventLoop.lock);
+    }
+    return 0;
+}
+
+
+static void virEventEpollDispatchFD(int fd, unsigned int revents,
+                                    int lastWatch)
+{
+    struct virEventEpollHandle *handle = eventLoop.fds[fd].handles;
+
+    while (handle) {
+        int hEvents;
+
+        /* NB, callbacks may append to this chain, but entries
+         * are only ever unlinked during cleanup, so the next
+         * pointer is safe to follow after re-acquiring the lock */
+        if (handle->deleted || handle->watch >= lastWatch) {
+            handle = handle->next;
+            continue;
+        }
+
+        hEvents = virEventEpollFromNativeEvents(revents) &
+            (handle->events |
+             VIR_EVENT_HANDLE_ERROR | VIR_EVENT_HANDLE_HANGUP);
+        if (hEvents && handle->events) {
+            virEventHandleCallback cb = handle->cb;
+            int watch = handle->watch;
+            void *opaque = handle->opaque;
+            EVENT_DEBUG("Dispatch f=%d w=%d e=%d %p",
+                        fd, watch, hEvents, opaque);
+            virMutexUnlock(&eventLoop.lock);
+            (cb)(watch, fd, hEvents, opaque);
+            virMutexLock(&eventLoop.lock);
+        }
+        handle = handle->next;
+    }
+}
+
+/* Dispatch the ready file handles reported by epoll_wait(), followed
+ * by those on fds which cannot be polled and so are always ready for
+ * reading and writing, just like poll() reports them.
+ * Handles registered during dispatch are not invoked until
+ * the next iteration, matching the poll() loop.
+ *
+ * Returns 0 upon success, -1 if an error occurred
+ */
+static int virEventEpollDispatchHandles(int nready) {
+    int lastWatch = nextWatch;
+    int n;
+    size_t fd;
+    VIR_DEBUG("Dispatch %d", nready);
+
+    for (n = 0 ; n < nready ; n++) {
+        int efd = eventLoop.events[n].data.fd;
+
+        if (efd < 0 || efd >= eventLoop.fdsAlloc)
+            continue;
+
+        virEventEpollDispatchFD(efd, eventLoop.events[n].events, lastWatch);
+    }
+
+    /* The fds array may be reallocated by callbacks, so index it afresh */
+    for (fd = 0 ; eventLoop.nalwaysReady && fd < eventLoop.fdsAlloc ; fd++) {
+        if (!eventLoop.fds[fd].alwaysReady)
+            continue;
+
+        virEventEpollDispatchFD(fd,
+                                eventLoop.fds[fd].mask & (EPOLLIN | EPOLLOUT),
+                                lastWatch);
+    }
+
+    return 0;
+}
+
+
+/* Used post dispatch to actually free any timers that
+ * were previously marked as deleted. This asynchronous
+ * cleanup is needed to make dispatch re-entrant safe.
+ */
+static void virEventEpollCleanupTimeouts(void) {
+    while (eventLoop.deletedTimeouts) {
+        struct virEventEpollTimeout *timeout = eventLoop.deletedTimeouts;
+
+        eventLoop.deletedTimeouts = timeout->nextDeleted;
+        virHashRemoveEntry(eventLoop.timeouts,
+                           EVENT_EPOLL_ID_KEY(timeout->timer));
+
+        EVENT_DEBUG("Purging timeout with id %d", timeout->timer);
+        if (timeout->ff) {
+            virFreeCallback ff = timeout->ff;
+            void *opaque = timeout->opaque;
+            virMutexUnlock(&eventLoop.lock);
+            ff(opaque);
+            virMutexLock(&eventLoop.lock);
+        }
+        VIR_FREE(timeout);
+    }
+
+    /* Release some memory if we've got a big chunk free */
+    if (eventLoop.heapAlloc > 2 * eventLoop.heapCount &&
+        eventLoop.heapAlloc - eventLoop.heapCount > 2 * EVENT_EPOLL_MAX_EVENTS)
+        VIR_SHRINK_N(eventLoop.heap, eventLoop.heapAlloc,
+                     eventLoop.heapAlloc - eventLoop.heapCount);
+}
+
+/* Used post dispatch to actually free any handles that
+ * were previously marked as deleted. This asynchronous
+ * cleanup is needed to make dispatch re-entrant safe.
+ */
+static void virEventEpollCleanupHandles(void) {
+    while (eventLoop.deletedHandles) {
+        struct virEventEpollHandle *handle = eventLoop.deletedHandles;
+        struct virEventEpollHandle **prev;
+
+        eventLoop.deletedHandles = handle->nextDeleted;
+
+        prev = &eventLoop.fds[handle->fd].handles;
+        while (*prev && *prev != handle)
+            prev = &(*prev)->next;
+        if (*prev)
+            *prev = handle->next;
+
+        virHashRemoveEntry(eventLoop.handles,
+                           EVENT_EPOLL_ID_KEY(handle->watch));
+
+        if (handle->ff) {
+            virFreeCallback ff = handle->ff;
+            void *opaque = handle->opaque;
+            virMutexUnlock(&eventLoop.lock);
+            ff(opaque);
+            virMutexLock(&eventLoop.lock);
+        }
+        VIR_FREE(handle);
+    }
+}
+
+/*
+ * Run a single iteration of the event loop, blocking until
+ * at least one file handle has an event, or a timer expires
+ */
+int virEventEpollRunOnce(void) {
+    int ret, timeout;
+
+    virMutexLock(&eventLoop.lock);
+    eventLoop.running = 1;
+    virThreadSelf(&eventLoop.leader);
+
+    virEventEpollCleanupTimeouts();
+    virEventEpollCleanupHandles();
+
+    if (virEventEpollCalculateTimeout(&timeout) < 0)
+        goto error;
+
+    /* Don't block while an always ready fd is waiting to be dispatched */
+    if (eventLoop.nalwaysReady)
+        timeout = 0;
+
+    virMutexUnlock(&eventLoop.lock);
+
+ retry:
+    EVENT_DEBUG("Poll on %zu handles timeout %d",
+                (size_t)virHashSize(eventLoop.handles), timeout);
+    ret = epoll_wait(eventLoop.epollfd, eventLoop.events,
+                     EVENT_EPOLL_MAX_EVENTS, timeout);
+    if (ret < 0) {
+        EVENT_DEBUG("Poll got error event %d", errno);
+        if (errno == EINTR) {
+            goto retry;
+        }
+        virReportSystemError(errno, "%s",
+                             _("Unable to poll on file handles"));
+        goto error_unlocked;
+    }
+    EVENT_DEBUG("Poll got %d event(s)", ret);
+
+    virMutexLock(&eventLoop.lock);
+    if (virEventEpollDispatchTimeouts() < 0)
+        goto error;
+
+    if ((ret > 0 || eventLoop.nalwaysReady) &&
+        virEventEpollDispatchHandles(ret) < 0)
+        goto error;
+
+    virEventEpollCleanupTimeouts();
+    virEventEpollCleanupHandles();
+
+    eventLoop.running = 0;
+    virMutexUnlock(&eventLoop.lock);
+    return 0;
+
+error:
+    virMutexUnlock(&eventLoop.lock);
+error_unlocked:
+    return -1;
+}
+
+
+static void virEventEpollHandleWakeup(int watch ATTRIBUTE_UNUSED,
+                                      int fd,
+                                      int events ATTRIBUTE_UNUSED,
+                                      void *opaque ATTRIBUTE_UNUSED)
+{
+    char c;
+    virMutexLock(&eventLoop.lock);
+    ignore_value(saferead(fd, &c, sizeof(c)));
+    virMutexUnlock(&eventLoop.lock);
+}
+
+int virEventEpollInit(void)
+{
+    if ((eventLoop.epollfd = epoll_create(EVENT_EPOLL_MAX_EVENTS)) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to create epoll instance"));
+        return -1;
+    }
+
+    if (virSetCloseExec(eventLoop.epollfd) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to set close-on-exec flag"));
+        goto error;
+    }
+
+    if (virMutexInit(&eventLoop.lock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to initialize mutex"));
+        goto error;
+    }
+
+    if (!(eventLoop.handles = virHashCreateFull(EVENT_EPOLL_MAX_EVENTS, NULL,
+                                                virEventEpollIDCode,
+                                                virEventEpollIDEqual,
+                                                virEventEpollIDCopy,
+                                                NULL)) ||
+        !(eventLoop.timeouts = virHashCreateFull(EVENT_EPOLL_MAX_EVENTS, NULL,
+                                                 virEventEpollIDCode,
+                                                 virEventEpollIDEqual,
+                                                 virEventEpollIDCopy,
+                                                 NULL))) {
+        virReportOOMError();
+        goto error;
+    }
+
+    if (pipe2(eventLoop.wakeupfd, O_CLOEXEC | O_NONBLOCK) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to setup wakeup pipe"));
+        goto error;
+    }
+
+    if (virEventEpollAddHandle(eventLoop.wakeupfd[0],
+                               VIR_EVENT_HANDLE_READABLE,
+                               virEventEpollHandleWakeup, NULL, NULL) < 0) {
+        virEventError(VIR_ERR_INTERNAL_ERROR,
+                      _("Unable to add handle %d to event loop"),
+                      eventLoop.wakeupfd[0]);
+        VIR_FORCE_CLOSE(eventLoop.wakeupfd[0]);
+        VIR_FORCE_CLOSE(eventLoop.wakeupfd[1]);
+        goto error;
+    }
+
+    return 0;
+
+error:
+    virHashFree(eventLoop.handles);
+    virHashFree(eventLoop.timeouts);
+    eventLoop.handles = eventLoop.timeouts = NULL;
+    VIR_FORCE_CLOSE(eventLoop.epollfd);
+    return -1;
+}
+
+static int virEventEpollInterruptLocked(void)
+{
+    char c = '\0';
+
+    if (!eventLoop.running ||
+        virThreadIsSelf(&eventLoop.leader)) {
+        VIR_DEBUG("Skip interrupt, %d %d", eventLoop.running,
+                  virThreadID(&eventLoop.leader));
+        return 0;
+    }
+
+    VIR_DEBUG0("Interrupting");
+    if (safewrite(eventLoop.wakeupfd[1], &c, sizeof(c)) != sizeof(c))
+        return -1;
+    return 0;
+}
+
+int virEventEpollInterrupt(void)
+{
+    int ret;
+    virMutexLock(&eventLoop.lock);
+    ret = virEventEpollInterruptLocked();
+    virMutexUnlock(&eventLoop.lock);
+    return ret;
+}
+
+#else /* ! HAVE_SYS_EPOLL_H */
+
+int virEventEpollAddHandle(int fd ATTRIBUTE_UNUSED,
+                           int events ATTRIBUTE_UNUSED,
+                           virEventHandleCallback cb ATTRIBUTE_UNUSED,
+                           void *opaque ATTRIBUTE_UNUSED,
+                           virFreeCallback ff ATTRIBUTE_UNUSED)
+{
+    return -1;
+}
+
+void virEventEpollUpdateHandle(int watch ATTRIBUTE_UNUSED,
+                               int events ATTRIBUTE_UNUSED)
+{
+}
+
+int virEventEpollRemoveHandle(int watch ATTRIBUTE_UNUSED)
+{
+    return -1;
+}
+
+int virEventEpollAddTimeout(int frequency ATTRIBUTE_UNUSED,
+                            virEventTimeoutCallback cb ATTRIBUTE_UNUSED,
+                            void *opaque ATTRIBUTE_UNUSED,
+                            virFreeCallback ff ATTRIBUTE_UNUSED)
+{
+    return -1;
+}
+
+void virEventEpollUpdateTimeout(int timer ATTRIBUTE_UNUSED,
+                                int frequency ATTRIBUTE_UNUSED)
+{
+}
+
+int virEventEpollRemoveTimeout(int timer ATTRIBUTE_UNUSED)
+{
+    return -1;
+}
+
+int virEventEpollInit(void)
+{
+    virEventError(VIR_ERR_NO_SUPPORT, "%s",
+                  _("epoll is not supported on this platform"));
+    return -1;
+}
+
+int virEventEpollRunOnce(void)
+{
+    virEventError(VIR_ERR_NO_SUPPORT, "%s",
+                  _("epoll is not supported on this platform"));
+    return -1;
+}
+
+int virEventEpollInterrupt(void)
+{
+    return -1;
+}
+
+#endif /* ! HAVE_SYS_EPOLL_H */
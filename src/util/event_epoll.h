@@ -0,0 +1,76 @@
+/*
+ * event_epoll.h: epoll() based event loop for monitoring file handles
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#ifndef __VIR_EVENT_EPOLL_H__
+# define __VIR_EVENT_EPOLL_H__
+
+# include "internal.h"
+
+/*
+ * This provides the same contract as the functions in event_poll.h,
+ * but handles are registered with the kernel incrementally and timers
+ * are kept in a heap ordered by expiry time, so the cost of one loop
+ * iteration depends on the number of ready handles and expired timers,
+ * not on the total number registered.
+ *
+ * It is only functional on hosts with epoll(), where virEventEpollInit
+ * will otherwise fail, letting the caller fall back to the poll() loop.
+ */
+
+int virEventEpollAddHandle(int fd, int events,
+                           virEventHandleCallback cb,
+                           void *opaque,
+                           virFreeCallback ff);
+void virEventEpollUpdateHandle(int watch, int events);
+int virEventEpollRemoveHandle(int watch);
+
+int virEventEpollAddTimeout(int frequency,
+                            virEventTimeoutCallback cb,
+                            void *opaque,
+                            virFreeCallback ff);
+void virEventEpollUpdateTimeout(int timer, int frequency);
+int virEventEpollRemoveTimeout(int timer);
+
+/**
+ * virEventEpollInit: Initialize the event loop
+ *
+ * returns -1 if initialization failed, or epoll() is not available
+ */
+int virEventEpollInit(void);
+
+/**
+ * virEventEpollRunOnce: run a single iteration of the event loop.
+ *
+ * Blocks the caller until at least one file handle has an
+ * event or the first timer expires.
+ *
+ * returns -1 if the event monitoring failed
+ */
+int virEventEpollRunOnce(void);
+
+/**
+ * virEventEpollInterrupt: wakeup any thread waiting in epoll_wait()
+ *
+ * return -1 if wakup failed
+ */
+int virEventEpollInterrupt(void);
+
+#endif /* __VIR_EVENT_EPOLL_H__ */
@@ -23,6 +23,8 @@
  *   - Read existing file
  *   - Write existing file
  *   - Create & write new file
+ *   - Read or write as a sequence of data and hole records
+ *   - Compress or decompress stdin to stdout in parallel
  */
 
 #include <config.h>
@@ -32,36 +34,686 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#if HAVE_LINUX_FALLOC_H
+# include <linux/falloc.h>
+#endif
+#ifdef HAVE_ZLIB
+# include <zlib.h>
+#endif
 
+#include "iohelper.h"
 #include "util.h"
 #include "threads.h"
 #include "files.h"
 #include "memory.h"
 #include "virterror_internal.h"
 #include "configmake.h"
+#include "ignore-value.h"
 
 #define VIR_FROM_THIS VIR_FROM_STORAGE
 
+/* Amount of data moved by each read/write or splice */
+#define IOHELPER_BUFLEN (1024*1024)
+
+/* Satisfies the O_DIRECT alignment rules of any common block size */
+#define IOHELPER_DIRECT_ALIGN 4096
+
+
+/*
+ * Plain copy through a userspace buffer, which works for
+ * any pair of fds. @total is updated as data is copied.
+ */
+static int runIOCopy(int fdin, const char *fdinname,
+                     int fdout, const char *fdoutname,
+                     unsigned long long length,
+                     unsigned long long *total)
+{
+    char *buf = NULL;
+    size_t buflen = IOHELPER_BUFLEN;
+    int ret = -1;
+
+    if (VIR_ALLOC_N(buf, buflen) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    while (1) {
+        ssize_t got;
+
+        if (length &&
+            (length - *total) < buflen)
+            buflen = length - *total;
+
+        if (buflen == 0)
+            break; /* End of requested data from client */
+
+        if ((got = saferead(fdin, buf, buflen)) < 0) {
+            virReportSystemError(errno, _("Unable to read %s"), fdinname);
+            goto cleanup;
+        }
+        if (got == 0)
+            break; /* End of file before end of requested data */
+
+        *total += got;
+        if (safewrite(fdout, buf, got) < 0) {
+            virReportSystemError(errno, _("Unable to write %s"), fdoutname);
+            goto cleanup;
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(buf);
+    return ret;
+}
+
+
+#ifdef HAVE_SPLICE
+/*
+ * Move data between the file and the pipe on our stdin/stdout
+ * within the kernel, so it is never copied through userspace.
+ *
+ * Returns 0 on success, -1 on error, or 1 if splice() can't be
+ * used with these fds, in which case everything counted in
+ * @total has been transferred and the caller can copy the rest
+ * by other means.
+ */
+static int runIOSplice(int fdin, const char *fdinname,
+                       int fdout, const char *fdoutname,
+                       unsigned long long length,
+                       unsigned long long *total)
+{
+    while (1) {
+        size_t want = IOHELPER_BUFLEN;
+        ssize_t got;
+
+        if (length &&
+            (length - *total) < want)
+            want = length - *total;
+
+        if (want == 0)
+            return 0; /* End of requested data from client */
+
+        got = splice(fdin, NULL, fdout, NULL, want,
+                     SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            /* Neither fd is a pipe, or the filesystem
+             * doesn't implement splice */
+            if (errno == EINVAL || errno == ENOSYS)
+                return 1;
+            virReportSystemError(errno, _("Unable to splice %s to %s"),
+                                 fdinname, fdoutname);
+            return -1;
+        }
+        if (got == 0)
+            return 0; /* End of file before end of requested data */
+
+        *total += got;
+    }
+}
+#endif
+
+
+struct runIODirectBuf {
+    char *data;
+    size_t len;
+    bool full;
+};
+
+/* Shared between the reading (main) and writing threads */
+struct runIODirectState {
+    virMutex lock;
+    virCond cond;
+    struct runIODirectBuf bufs[2];
+    bool quit;
+    int err; /* errno of a failed write */
+
+    int fdout;
+    const char *fdoutname;
+};
+
+/* Switch @fd back to the page cache. Returns 1 if it was
+ * using direct I/O, 0 if not, -1 on error */
+static int runIODirectDisable(int fd)
+{
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL)) < 0)
+        return -1;
+    if (!(flags & O_DIRECT))
+        return 0;
+    if (fcntl(fd, F_SETFL, flags & ~O_DIRECT) < 0)
+        return -1;
+    return 1;
+}
+
+/*
+ * Like saferead, but copes with direct reads ending on a partial
+ * block, which happens at the end of any file whose size is not a
+ * multiple of the block size: the file offset is then unaligned,
+ * so the remainder is read through the page cache.
+ */
+static ssize_t runIODirectRead(int fd, char *buf, size_t len)
+{
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t r = read(fd, buf + got, len - got);
+
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EINVAL && runIODirectDisable(fd) == 1)
+                continue;
+            return -1;
+        }
+        if (r == 0)
+            break;
+        got += r;
+
+        if ((got % IOHELPER_DIRECT_ALIGN) != 0 &&
+            runIODirectDisable(fd) < 0)
+            return -1;
+    }
+
+    return got;
+}
+
+static int runIODirectWriteTail(int fd, const char *buf, size_t len)
+{
+    /* O_DIRECT can only write whole blocks, so the final
+     * partial block of the stream goes via the page cache */
+    if (len % IOHELPER_DIRECT_ALIGN &&
+        runIODirectDisable(fd) < 0)
+        return -1;
+
+    return safewrite(fd, buf, len);
+}
+
+static void runIODirectWriter(void *opaque)
+{
+    struct runIODirectState *state = opaque;
+    int i = 0;
+
+    virMutexLock(&state->lock);
+    while (1) {
+        struct runIODirectBuf *buf = &state->bufs[i];
+
+        while (!buf->full && !state->quit) {
+            if (virCondWait(&state->cond, &state->lock) < 0) {
+                state->err = errno;
+                state->quit = true;
+            }
+        }
+        if (state->quit || buf->len == 0)
+            break;
+
+        virMutexUnlock(&state->lock);
+        if (runIODirectWriteTail(state->fdout, buf->data, buf->len) < 0) {
+            virMutexLock(&state->lock);
+            state->err = errno;
+            state->quit = true;
+            virCondSignal(&state->cond);
+            break;
+        }
+        virMutexLock(&state->lock);
+
+        buf->full = false;
+        virCondSignal(&state->cond);
+        i = !i;
+    }
+    virMutexUnlock(&state->lock);
+}
+
+/*
+ * Copy with the file opened O_DIRECT, bypassing the host page
+ * cache. Data goes through a pair of suitably aligned buffers,
+ * so that a block can be read from @fdin while the previous one
+ * is still being written out to @fdout by a second thread.
+ */
+static int runIODirect(int fdin, const char *fdinname,
+                       int fdout, const char *fdoutname,
+                       unsigned long long length,
+                       unsigned long long *total)
+{
+    struct runIODirectState state;
+    virThread writer;
+    char *mem = NULL;
+    char *aligned;
+    bool haveLock = false, haveCond = false, haveWriter = false;
+    int i = 0;
+    int ret = -1;
+
+    memset(&state, 0, sizeof(state));
+    state.fdout = fdout;
+    state.fdoutname = fdoutname;
+
+    if (VIR_ALLOC_N(mem, (IOHELPER_BUFLEN * 2) + IOHELPER_DIRECT_ALIGN) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+    aligned = (char *)(((uintptr_t)mem + IOHELPER_DIRECT_ALIGN - 1) &
+                       ~((uintptr_t)IOHELPER_DIRECT_ALIGN - 1));
+    state.bufs[0].data = aligned;
+    state.bufs[1].data = aligned + IOHELPER_BUFLEN;
+
+    if (virMutexInit(&state.lock) < 0) {
+        virReportSystemError(errno, "%s", _("Unable to initialize mutex"));
+        goto cleanup;
+    }
+    haveLock = true;
+    if (virCondInit(&state.cond) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to initialize condition variable"));
+        goto cleanup;
+    }
+    haveCond = true;
+
+    if (virThreadCreate(&writer, true, runIODirectWriter, &state) < 0) {
+        virReportSystemError(errno, "%s", _("Unable to create writer thread"));
+        goto cleanup;
+    }
+    haveWriter = true;
+
+    while (1) {
+        struct runIODirectBuf *buf = &state.bufs[i];
+        size_t want = IOHELPER_BUFLEN;
+        ssize_t got;
+
+        virMutexLock(&state.lock);
+        while (buf->full && !state.quit) {
+            if (virCondWait(&state.cond, &state.lock) < 0) {
+                virReportSystemError(errno, "%s",
+                                     _("Unable to wait on condition"));
+                state.quit = true;
+                virCondSignal(&state.cond);
+                virMutexUnlock(&state.lock);
+                goto cleanup;
+            }
+        }
+        if (state.quit) {
+            virReportSystemError(state.err, _("Unable to write %s"),
+                                 fdoutname);
+            virMutexUnlock(&state.lock);
+            goto cleanup;
+        }
+        virMutexUnlock(&state.lock);
+
+        /* Reads of a direct fd must cover whole blocks even when
+         * the client asked for less, so trim the excess after */
+        if (length &&
+            (length - *total) < want)
+            want = VIR_DIV_UP(length - *total, IOHELPER_DIRECT_ALIGN) *
+                IOHELPER_DIRECT_ALIGN;
+
+        if (want == 0) {
+            got = 0; /* End of requested data from client */
+        } else if ((got = runIODirectRead(fdin, buf->data, want)) < 0) {
+            virReportSystemError(errno, _("Unable to read %s"), fdinname);
+            virMutexLock(&state.lock);
+            state.quit = true;
+            virCondSignal(&state.cond);
+            virMutexUnlock(&state.lock);
+            goto cleanup;
+        }
+        if (length &&
+            got > length - *total)
+            got = length - *total;
+        *total += got;
+
+        /* A zero length buffer tells the writer we're done */
+        virMutexLock(&state.lock);
+        buf->len = got;
+        buf->full = true;
+        virCondSignal(&state.cond);
+        virMutexUnlock(&state.lock);
+
+        if (got == 0)
+            break;
+        i = !i;
+    }
+
+    virThreadJoin(&writer);
+    haveWriter = false;
+    if (state.err) {
+        virReportSystemError(state.err, _("Unable to write %s"), fdoutname);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    if (haveWriter)
+        virThreadJoin(&writer);
+    if (haveCond)
+        ignore_value(virCondDestroy(&state.cond));
+    if (haveLock)
+        virMutexDestroy(&state.lock);
+    VIR_FREE(mem);
+    return ret;
+}
+
+
+static int runIOSparseRecord(int type, unsigned long long length)
+{
+    virIOHelperRecord rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = type;
+    rec.length = length;
+
+    if (safewrite(STDOUT_FILENO, &rec, sizeof(rec)) < 0) {
+        virReportSystemError(errno, _("Unable to write %s"), "stdout");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Send the file to stdout as records, with the holes found by
+ * SEEK_DATA/SEEK_HOLE sent as hole records instead of being read.
+ * Files without extent information are sent as data throughout.
+ */
+static int runIOSparseRead(int fd, const char *path,
+                           unsigned long long offset,
+                           unsigned long long length,
+                           unsigned long long *total)
+{
+    char *buf = NULL;
+    unsigned long long pos = offset;
+    unsigned long long end = ULLONG_MAX;
+    bool seekable;
+    bool extents;
+    off_t size;
+    int ret = -1;
+
+    if (VIR_ALLOC_N(buf, IOHELPER_BUFLEN) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    if (length)
+        end = offset + length;
+
+    /* This also finds the size of block devices */
+    seekable = (size = lseek(fd, 0, SEEK_END)) >= 0;
+    if (seekable && (unsigned long long)size < end)
+        end = size;
+    extents = seekable;
+
+    while (pos < end) {
+        unsigned long long dataStart = pos;
+        unsigned long long dataEnd = end;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+        if (extents) {
+            off_t data = lseek(fd, pos, SEEK_DATA);
+            off_t hole;
+
+            if (data < 0 && errno == ENXIO) {
+                /* Nothing but a hole up to the end */
+                dataStart = end;
+            } else if (data < 0 ||
+                       (hole = lseek(fd, data, SEEK_HOLE)) < 0) {
+                extents = false;
+            } else {
+                dataStart = MIN(data, end);
+                dataEnd = MIN(hole, end);
+            }
+        }
+#else
+        extents = false;
+#endif
+
+        if (dataStart > pos) {
+            if (runIOSparseRecord(VIR_IOHELPER_RECORD_HOLE,
+                                  dataStart - pos) < 0)
+                goto cleanup;
+            *total += dataStart - pos;
+            pos = dataStart;
+            continue;
+        }
+
+        if (seekable &&
+            lseek(fd, pos, SEEK_SET) < 0) {
+            virReportSystemError(errno, _("Unable to seek %s to %llu"),
+                                 path, pos);
+            goto cleanup;
+        }
+
+        while (pos < dataEnd) {
+            size_t want = MIN(IOHELPER_BUFLEN, dataEnd - pos);
+            ssize_t got;
+
+            if ((got = saferead(fd, buf, want)) < 0) {
+                virReportSystemError(errno, _("Unable to read %s"), path);
+                goto cleanup;
+            }
+            if (got == 0) {
+                /* End of file before end of requested data */
+                end = pos;
+                break;
+            }
+
+            if (runIOSparseRecord(VIR_IOHELPER_RECORD_DATA, got) < 0)
+                goto cleanup;
+            if (safewrite(STDOUT_FILENO, buf, got) < 0) {
+                virReportSystemError(errno, _("Unable to write %s"), "stdout");
+                goto cleanup;
+            }
+            *total += got;
+            pos += got;
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(buf);
+    return ret;
+}
+
+/*
+ * A hole has to read back as zeros, whatever the file held
+ * before, so punch it out, or else write zeros over it. Nothing
+ * needs doing past the end of a regular file. Leaves the file
+ * offset at the end of the hole.
+ */
+static int runIOSparseZero(int fd, const char *path,
+                           unsigned long long pos,
+                           unsigned long long length)
+{
+    char *zeros = NULL;
+    unsigned long long len = length;
+    struct stat sb;
+    int ret = -1;
+
+    if (fstat(fd, &sb) < 0) {
+        virReportSystemError(errno, _("Unable to access %s"), path);
+        return -1;
+    }
+
+    if (S_ISREG(sb.st_mode)) {
+        unsigned long long size = sb.st_size;
+
+        if (pos >= size)
+            len = 0;
+        else if (len > size - pos)
+            len = size - pos;
+    }
+
+#if HAVE_FALLOCATE && defined(FALLOC_FL_PUNCH_HOLE)
+    if (len &&
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  pos, len) == 0)
+        len = 0;
+#endif
+
+    if (len == 0) {
+        if (lseek(fd, pos + length, SEEK_SET) < 0) {
+            virReportSystemError(errno, _("Unable to seek %s to %llu"),
+                                 path, pos + length);
+            return -1;
+        }
+        return 0;
+    }
+
+    /* Character devices and FIFOs just get a run of zeros */
+    if (VIR_ALLOC_N(zeros, IOHELPER_BUFLEN) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+
+    len = length;
+    while (len) {
+        size_t want = MIN(IOHELPER_BUFLEN, len);
+
+        if (safewrite(fd, zeros, want) < 0) {
+            virReportSystemError(errno, _("Unable to write %s"), path);
+            goto cleanup;
+        }
+        len -= want;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(zeros);
+    return ret;
+}
+
+/*
+ * Write the records read from stdin to the file, recreating
+ * holes rather than writing out zeros.
+ */
+static int runIOSparseWrite(int fd, const char *path,
+                            unsigned long long offset,
+                            unsigned long long length,
+                            unsigned long long *total)
+{
+    char *buf = NULL;
+    unsigned long long pos = offset;
+    struct stat sb;
+    int ret = -1;
+
+    if (VIR_ALLOC_N(buf, IOHELPER_BUFLEN) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    while (1) {
+        virIOHelperRecord rec;
+        ssize_t got;
+
+        if ((got = saferead(STDIN_FILENO, &rec, sizeof(rec))) < 0) {
+            virReportSystemError(errno, _("Unable to read %s"), "stdin");
+            goto cleanup;
+        }
+        if (got == 0)
+            break;
+        if (got != sizeof(rec) ||
+            (rec.type != VIR_IOHELPER_RECORD_DATA &&
+             rec.type != VIR_IOHELPER_RECORD_HOLE)) {
+            virReportSystemError(EINVAL, _("Malformed record on %s"),
+                                 "stdin");
+            goto cleanup;
+        }
+
+        if (length &&
+            rec.length > length - *total) {
+            virReportSystemError(ENOSPC,
+                                 _("Unable to write past %llu bytes to %s"),
+                                 length, path);
+            goto cleanup;
+        }
+
+        if (rec.type == VIR_IOHELPER_RECORD_HOLE) {
+            if (runIOSparseZero(fd, path, pos, rec.length) < 0)
+                goto cleanup;
+            pos += rec.length;
+            *total += rec.length;
+            continue;
+        }
+
+        while (rec.length) {
+            size_t want = MIN(IOHELPER_BUFLEN, rec.length);
+
+            if ((got = saferead(STDIN_FILENO, buf, want)) < 0) {
+                virReportSystemError(errno, _("Unable to read %s"), "stdin");
+                goto cleanup;
+            }
+            if (got == 0) {
+                virReportSystemError(EINVAL, _("Truncated record on %s"),
+                                     "stdin");
+                goto cleanup;
+            }
+            if (safewrite(fd, buf, got) < 0) {
+                virReportSystemError(errno, _("Unable to write %s"), path);
+                goto cleanup;
+            }
+            rec.length -= got;
+            pos += got;
+            *total += got;
+        }
+    }
+
+    /* Nothing was written to extend a regular file over a hole
+     * at the end of the stream */
+    if (fstat(fd, &sb) < 0) {
+        virReportSystemError(errno, _("Unable to access %s"), path);
+        goto cleanup;
+    }
+    if (S_ISREG(sb.st_mode) &&
+        (unsigned long long)sb.st_size < pos &&
+        ftruncate(fd, pos) < 0) {
+        virReportSystemError(errno, _("Unable to resize %s"), path);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(buf);
+    return ret;
+}
+
+
 static int runIO(const char *path,
                  int flags,
                  int mode,
                  unsigned long long offset,
-                 unsigned long long length)
+                 unsigned long long length,
+                 bool sparse)
 {
-    char *buf = NULL;
-    size_t buflen = 1024*1024;
     int fd;
     int ret = -1;
     int fdin, fdout;
     const char *fdinname, *fdoutname;
     unsigned long long total = 0;
 
+    /* Direct I/O needs block aligned file offsets, and the
+     * records of sparse mode won't keep them aligned */
+    if ((flags & O_DIRECT) &&
+        (sparse || (offset % IOHELPER_DIRECT_ALIGN) != 0))
+        flags &= ~O_DIRECT;
+
+ reopen:
     if (flags & O_CREAT) {
         fd = open(path, flags, mode);
     } else {
         fd = open(path, flags);
     }
     if (fd < 0) {
+        /* eg tmpfs, which doesn't support O_DIRECT */
+        if (errno == EINVAL && (flags & O_DIRECT)) {
+            flags &= ~O_DIRECT;
+            goto reopen;
+        }
         virReportSystemError(errno, _("Unable to open %s"), path);
         goto cleanup;
     }
@@ -74,11 +726,6 @@ static int runIO(const char *path,
         }
     }
 
-    if (VIR_ALLOC_N(buf, buflen) < 0) {
-        virReportOOMError();
-        goto cleanup;
-    }
-
     switch (flags & O_ACCMODE) {
     case O_RDONLY:
         fdin = fd;
@@ -101,42 +748,614 @@ static int runIO(const char *path,
         goto cleanup;
     }
 
+    if (sparse) {
+        if (fdin == fd) {
+            if (runIOSparseRead(fd, path, offset, length, &total) < 0)
+                goto cleanup;
+        } else {
+            if (runIOSparseWrite(fd, path, offset, length, &total) < 0)
+                goto cleanup;
+        }
+    } else if (flags & O_DIRECT) {
+        if (runIODirect(fdin, fdinname, fdout, fdoutname,
+                        length, &total) < 0)
+            goto cleanup;
+    } else {
+#ifdef HAVE_SPLICE
+        int rc;
+        if ((rc = runIOSplice(fdin, fdinname, fdout, fdoutname,
+                              length, &total)) < 0)
+            goto cleanup;
+        if (rc == 1 &&
+            runIOCopy(fdin, fdinname, fdout, fdoutname,
+                      length, &total) < 0)
+            goto cleanup;
+#else
+        if (runIOCopy(fdin, fdinname, fdout, fdoutname,
+                      length, &total) < 0)
+            goto cleanup;
+#endif
+    }
+
+    ret = 0;
+
+cleanup:
+    if (VIR_CLOSE(fd) < 0 &&
+        ret == 0) {
+        virReportSystemError(errno, _("Unable to close %s"), path);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+#ifdef HAVE_ZLIB
+/* Threads compressing or decompressing at once; each keeps two
+ * blocks in flight, so this also bounds the memory used */
+# define IOHELPER_ZLIB_MAX_THREADS 16
+
+/* Saving a guest is about getting it off the host quickly, so
+ * favour speed over the size of the image */
+# define IOHELPER_ZLIB_LEVEL Z_BEST_SPEED
+
+enum {
+    IOHELPER_ZLIB_SLOT_FREE,
+    IOHELPER_ZLIB_SLOT_FILLED,  /* Read in, waiting for a worker */
+    IOHELPER_ZLIB_SLOT_BUSY,    /* Being (de)compressed */
+    IOHELPER_ZLIB_SLOT_DONE,    /* Waiting to be written out */
+};
+
+struct runIOZlibSlot {
+    int state;
+    virIOHelperZlibBlock block;
+    char *in;
+    char *out;
+    const char *data;   /* Result, either 'in' or 'out' */
+    size_t len;         /* Length of 'data' */
+};
+
+/*
+ * Blocks are read in by the main thread, handed to a pool of
+ * workers, and written out in their original order by a writer
+ * thread. Block number N always lives in slot N % nslots.
+ */
+struct runIOZlibState {
+    virMutex lock;
+    virCond cond;
+    bool compress;
+    uLong bound;        /* Largest compressed block */
+
+    struct runIOZlibSlot *slots;
+    size_t nslots;
+    unsigned long long nread;
+    unsigned long long nstarted;
+    unsigned long long nwritten;
+    bool eof;           /* All blocks have been read */
+
+    /* Where each block starts, to write or check the index. Only
+     * the writer touches it when compressing, only the reader when
+     * decompressing */
+    virIOHelperZlibIndex *index;
+    size_t nindex;
+    size_t nindex_max;
+
+    bool quit;
+    int err;
+    const char *errmsg;
+};
+
+/*
+ * The image is little endian whatever the host. Each of these turns
+ * a value or structure from host order to little endian, and, being
+ * either a no-op or a byte swap, back again.
+ */
+static uint32_t runIOZlibLE32(uint32_t val)
+{
+    unsigned char buf[4];
+    uint32_t ret;
+
+    buf[0] = val;
+    buf[1] = val >> 8;
+    buf[2] = val >> 16;
+    buf[3] = val >> 24;
+    memcpy(&ret, buf, sizeof(ret));
+    return ret;
+}
+
+static uint64_t runIOZlibLE64(uint64_t val)
+{
+    unsigned char buf[8];
+    uint64_t ret;
+    int i;
+
+    for (i = 0 ; i < 8 ; i++)
+        buf[i] = val >> (8 * i);
+    memcpy(&ret, buf, sizeof(ret));
+    return ret;
+}
+
+static void runIOZlibHeaderLE(virIOHelperZlibHeader *header)
+{
+    header->version = runIOZlibLE32(header->version);
+    header->blockSize = runIOZlibLE32(header->blockSize);
+}
+
+static void runIOZlibBlockLE(virIOHelperZlibBlock *block)
+{
+    block->rawLength = runIOZlibLE32(block->rawLength);
+    block->compLength = runIOZlibLE32(block->compLength);
+    block->flags = runIOZlibLE32(block->flags);
+}
+
+static void runIOZlibIndexLE(virIOHelperZlibIndex *entry)
+{
+    entry->offset = runIOZlibLE64(entry->offset);
+    entry->rawOffset = runIOZlibLE64(entry->rawOffset);
+}
+
+static void runIOZlibTrailerLE(virIOHelperZlibTrailer *trailer)
+{
+    trailer->nblocks = runIOZlibLE64(trailer->nblocks);
+    trailer->indexOffset = runIOZlibLE64(trailer->indexOffset);
+}
+
+/* Called with the lock held; only the first failure is kept */
+static void runIOZlibFail(struct runIOZlibState *state,
+                          int err, const char *errmsg)
+{
+    if (!state->quit) {
+        state->err = err;
+        state->errmsg = errmsg;
+        state->quit = true;
+    }
+    virCondBroadcast(&state->cond);
+}
+
+static int runIOZlibAddIndex(struct runIOZlibState *state,
+                             unsigned long long offset,
+                             unsigned long long rawOffset)
+{
+    if (VIR_RESIZE_N(state->index, state->nindex_max, state->nindex, 1) < 0)
+        return -1;
+
+    state->index[state->nindex].offset = offset;
+    state->index[state->nindex].rawOffset = rawOffset;
+    state->nindex++;
+    return 0;
+}
+
+static int runIOZlibProcess(struct runIOZlibState *state,
+                            struct runIOZlibSlot *slot)
+{
+    if (state->compress) {
+        uLongf len = state->bound;
+
+        if (compress2((Bytef *)slot->out, &len,
+                      (const Bytef *)slot->in, slot->block.rawLength,
+                      IOHELPER_ZLIB_LEVEL) == Z_OK &&
+            len < slot->block.rawLength) {
+            slot->block.compLength = len;
+            slot->block.flags = 0;
+            slot->data = slot->out;
+        } else {
+            slot->block.compLength = slot->block.rawLength;
+            slot->block.flags = VIR_IOHELPER_ZLIB_BLOCK_STORED;
+            slot->data = slot->in;
+        }
+        slot->len = slot->block.compLength;
+    } else {
+        uLongf len = IOHELPER_BUFLEN;
+
+        if (slot->block.flags & VIR_IOHELPER_ZLIB_BLOCK_STORED) {
+            slot->data = slot->in;
+        } else {
+            if (uncompress((Bytef *)slot->out, &len,
+                           (const Bytef *)slot->in,
+                           slot->block.compLength) != Z_OK ||
+                len != slot->block.rawLength)
+                return -1;
+            slot->data = slot->out;
+        }
+        slot->len = slot->block.rawLength;
+    }
+
+    return 0;
+}
+
+static void runIOZlibWorker(void *opaque)
+{
+    struct runIOZlibState *state = opaque;
+
+    virMutexLock(&state->lock);
     while (1) {
-        ssize_t got;
+        struct runIOZlibSlot *slot;
+        int rc;
 
-        if (length &&
-            (length - total) < buflen)
-            buflen = length - total;
+        while (!state->quit &&
+               state->nstarted == state->nread &&
+               !state->eof)
+            ignore_value(virCondWait(&state->cond, &state->lock));
+        if (state->quit || state->nstarted == state->nread)
+            break;
 
-        if (buflen == 0)
-            break; /* End of requested data from client */
+        slot = &state->slots[state->nstarted++ % state->nslots];
+        slot->state = IOHELPER_ZLIB_SLOT_BUSY;
+        virMutexUnlock(&state->lock);
 
-        if ((got = saferead(fdin, buf, buflen)) < 0) {
-            virReportSystemError(errno, _("Unable to read %s"), fdinname);
-            goto cleanup;
+        rc = runIOZlibProcess(state, slot);
+
+        virMutexLock(&state->lock);
+        if (rc < 0) {
+            runIOZlibFail(state, EINVAL, _("corrupt compressed data"));
+            break;
+        }
+        slot->state = IOHELPER_ZLIB_SLOT_DONE;
+        virCondBroadcast(&state->cond);
+    }
+    virMutexUnlock(&state->lock);
+}
+
+static int runIOZlibWriteTrailer(struct runIOZlibState *state,
+                                 unsigned long long pos)
+{
+    virIOHelperZlibBlock end;
+    virIOHelperZlibTrailer trailer;
+    size_t len = sizeof(*state->index) * state->nindex;
+    size_t i;
+
+    memset(&end, 0, sizeof(end));
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.nblocks = state->nindex;
+    trailer.indexOffset = pos + sizeof(end);
+    memcpy(trailer.magic, VIR_IOHELPER_ZLIB_MAGIC, sizeof(trailer.magic));
+    runIOZlibTrailerLE(&trailer);
+
+    /* Nothing looks at the index after this */
+    for (i = 0 ; i < state->nindex ; i++)
+        runIOZlibIndexLE(&state->index[i]);
+
+    if (safewrite(STDOUT_FILENO, &end, sizeof(end)) < 0 ||
+        (len && safewrite(STDOUT_FILENO, state->index, len) < 0) ||
+        safewrite(STDOUT_FILENO, &trailer, sizeof(trailer)) < 0)
+        return -1;
+
+    return 0;
+}
+
+static void runIOZlibWriter(void *opaque)
+{
+    struct runIOZlibState *state = opaque;
+    unsigned long long pos = 0;
+    unsigned long long rawPos = 0;
+
+    if (state->compress) {
+        virIOHelperZlibHeader header;
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, VIR_IOHELPER_ZLIB_MAGIC, sizeof(header.magic));
+        header.version = VIR_IOHELPER_ZLIB_VERSION;
+        header.blockSize = IOHELPER_BUFLEN;
+        runIOZlibHeaderLE(&header);
+        if (safewrite(STDOUT_FILENO, &header, sizeof(header)) < 0) {
+            virMutexLock(&state->lock);
+            runIOZlibFail(state, errno, _("Unable to write stdout"));
+            virMutexUnlock(&state->lock);
+            return;
+        }
+        pos = sizeof(header);
+    }
+
+    virMutexLock(&state->lock);
+    while (1) {
+        struct runIOZlibSlot *slot =
+            &state->slots[state->nwritten % state->nslots];
+        int rc;
+
+        while (!state->quit &&
+               slot->state != IOHELPER_ZLIB_SLOT_DONE &&
+               !(state->eof && state->nwritten == state->nread))
+            ignore_value(virCondWait(&state->cond, &state->lock));
+        if (state->quit || slot->state != IOHELPER_ZLIB_SLOT_DONE)
+            break;
+        virMutexUnlock(&state->lock);
+
+        if (state->compress) {
+            virIOHelperZlibBlock block = slot->block;
+
+            if (runIOZlibAddIndex(state, pos, rawPos) < 0) {
+                virMutexLock(&state->lock);
+                runIOZlibFail(state, ENOMEM, _("Unable to grow block index"));
+                break;
+            }
+            runIOZlibBlockLE(&block);
+            rc = safewrite(STDOUT_FILENO, &block, sizeof(block));
+            pos += sizeof(slot->block) + slot->len;
+            rawPos += slot->block.rawLength;
+        } else {
+            rc = 0;
+        }
+        if (rc >= 0)
+            rc = safewrite(STDOUT_FILENO, slot->data, slot->len);
+
+        virMutexLock(&state->lock);
+        if (rc < 0) {
+            runIOZlibFail(state, errno, _("Unable to write stdout"));
+            break;
+        }
+        slot->state = IOHELPER_ZLIB_SLOT_FREE;
+        state->nwritten++;
+        virCondBroadcast(&state->cond);
+    }
+
+    if (!state->quit && state->compress) {
+        virMutexUnlock(&state->lock);
+        if (runIOZlibWriteTrailer(state, pos) < 0) {
+            virMutexLock(&state->lock);
+            runIOZlibFail(state, errno, _("Unable to write stdout"));
+        } else {
+            virMutexLock(&state->lock);
+        }
+    }
+    virMutexUnlock(&state->lock);
+}
+
+/*
+ * Reads the next block into @slot. Compressed data comes with its
+ * own block headers, raw data is simply cut up. @pos and @rawPos
+ * track where the block starts in the compressed and raw data.
+ *
+ * Returns 1 if a block was read, 0 at the end, -1 on error
+ */
+static int runIOZlibRead(struct runIOZlibState *state,
+                         struct runIOZlibSlot *slot,
+                         unsigned long long *pos,
+                         unsigned long long *rawPos)
+{
+    ssize_t got;
+
+    if (state->compress) {
+        if ((got = saferead(STDIN_FILENO, slot->in, IOHELPER_BUFLEN)) < 0) {
+            virReportSystemError(errno, "%s", _("Unable to read stdin"));
+            return -1;
         }
         if (got == 0)
-            break; /* End of file before end of requested data */
+            return 0;
+        memset(&slot->block, 0, sizeof(slot->block));
+        slot->block.rawLength = got;
+        return 1;
+    }
 
-        total += got;
-        if (safewrite(fdout, buf, got) < 0) {
-            virReportSystemError(errno, _("Unable to write %s"), fdoutname);
+    if ((got = saferead(STDIN_FILENO, &slot->block,
+                        sizeof(slot->block))) < 0) {
+        virReportSystemError(errno, "%s", _("Unable to read stdin"));
+        return -1;
+    }
+    if (got != sizeof(slot->block))
+        goto truncated;
+    runIOZlibBlockLE(&slot->block);
+
+    if (slot->block.rawLength == 0)
+        return 0;
+
+    if (slot->block.rawLength > IOHELPER_BUFLEN ||
+        slot->block.compLength > state->bound ||
+        ((slot->block.flags & VIR_IOHELPER_ZLIB_BLOCK_STORED) &&
+         slot->block.compLength != slot->block.rawLength)) {
+        virReportSystemError(EINVAL, "%s", _("corrupt compressed data"));
+        return -1;
+    }
+
+    if ((got = saferead(STDIN_FILENO, slot->in,
+                        slot->block.compLength)) < 0) {
+        virReportSystemError(errno, "%s", _("Unable to read stdin"));
+        return -1;
+    }
+    if (got != slot->block.compLength)
+        goto truncated;
+
+    if (runIOZlibAddIndex(state, *pos, *rawPos) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+    *pos += sizeof(slot->block) + slot->block.compLength;
+    *rawPos += slot->block.rawLength;
+    return 1;
+
+truncated:
+    virReportSystemError(EINVAL, "%s", _("compressed data is truncated"));
+    return -1;
+}
+
+/* Checks the index and trailer that follow the end marker agree
+ * with the blocks which were actually read */
+static int runIOZlibCheckTrailer(struct runIOZlibState *state,
+                                 unsigned long long pos)
+{
+    virIOHelperZlibIndex entry;
+    virIOHelperZlibTrailer trailer;
+    size_t i;
+
+    for (i = 0 ; i < state->nindex ; i++) {
+        if (saferead(STDIN_FILENO, &entry, sizeof(entry)) != sizeof(entry))
+            goto corrupt;
+        runIOZlibIndexLE(&entry);
+        if (entry.offset != state->index[i].offset ||
+            entry.rawOffset != state->index[i].rawOffset)
+            goto corrupt;
+    }
+
+    if (saferead(STDIN_FILENO, &trailer, sizeof(trailer)) != sizeof(trailer))
+        goto corrupt;
+    runIOZlibTrailerLE(&trailer);
+    if (trailer.nblocks != state->nindex ||
+        trailer.indexOffset != pos + sizeof(virIOHelperZlibBlock) ||
+        memcmp(trailer.magic, VIR_IOHELPER_ZLIB_MAGIC,
+               sizeof(trailer.magic)) != 0)
+        goto corrupt;
+
+    return 0;
+
+corrupt:
+    virReportSystemError(EINVAL, "%s",
+                         _("compressed data is truncated or corrupt"));
+    return -1;
+}
+
+static int runIOZlib(bool compress)
+{
+    struct runIOZlibState state;
+    virThread *workers = NULL;
+    virThread writer;
+    size_t nworkers = 0;
+    bool haveLock = false, haveCond = false, haveWriter = false;
+    unsigned long long pos = 0, rawPos = 0;
+    long ncpus;
+    size_t nthreads;
+    size_t i;
+    int ret = -1;
+
+    memset(&state, 0, sizeof(state));
+    state.compress = compress;
+    state.bound = compressBound(IOHELPER_BUFLEN);
+
+    if ((ncpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        ncpus = 1;
+    nthreads = MIN(ncpus, IOHELPER_ZLIB_MAX_THREADS);
+    state.nslots = nthreads * 2;
+
+    if (!compress) {
+        virIOHelperZlibHeader header;
+
+        if (saferead(STDIN_FILENO, &header, sizeof(header)) != sizeof(header) ||
+            memcmp(header.magic, VIR_IOHELPER_ZLIB_MAGIC,
+                   sizeof(header.magic)) != 0) {
+            virReportSystemError(EINVAL, "%s",
+                                 _("input is not compressed by libvirt_iohelper"));
+            return -1;
+        }
+        runIOZlibHeaderLE(&header);
+        if (header.version != VIR_IOHELPER_ZLIB_VERSION ||
+            header.blockSize > IOHELPER_BUFLEN) {
+            virReportSystemError(EINVAL,
+                                 _("unsupported compressed data version %u"),
+                                 header.version);
+            return -1;
+        }
+        pos = sizeof(header);
+    }
+
+    if (VIR_ALLOC_N(state.slots, state.nslots) < 0 ||
+        VIR_ALLOC_N(workers, nthreads) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+    for (i = 0 ; i < state.nslots ; i++) {
+        if (VIR_ALLOC_N(state.slots[i].in, state.bound) < 0 ||
+            VIR_ALLOC_N(state.slots[i].out, state.bound) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+    }
+
+    if (virMutexInit(&state.lock) < 0) {
+        virReportSystemError(errno, "%s", _("Unable to initialize mutex"));
+        goto cleanup;
+    }
+    haveLock = true;
+    if (virCondInit(&state.cond) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to initialize condition variable"));
+        goto cleanup;
+    }
+    haveCond = true;
+
+    for (nworkers = 0 ; nworkers < nthreads ; nworkers++) {
+        if (virThreadCreate(&workers[nworkers], true,
+                            runIOZlibWorker, &state) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("Unable to create worker thread"));
             goto cleanup;
         }
     }
+    if (virThreadCreate(&writer, true, runIOZlibWriter, &state) < 0) {
+        virReportSystemError(errno, "%s", _("Unable to create writer thread"));
+        goto cleanup;
+    }
+    haveWriter = true;
+
+    while (1) {
+        struct runIOZlibSlot *slot = &state.slots[state.nread % state.nslots];
+        int rc;
+
+        virMutexLock(&state.lock);
+        while (!state.quit && slot->state != IOHELPER_ZLIB_SLOT_FREE)
+            ignore_value(virCondWait(&state.cond, &state.lock));
+        if (state.quit) {
+            virMutexUnlock(&state.lock);
+            break;
+        }
+        virMutexUnlock(&state.lock);
+
+        rc = runIOZlibRead(&state, slot, &pos, &rawPos);
+
+        virMutexLock(&state.lock);
+        if (rc <= 0) {
+            state.eof = true;
+            if (rc < 0)
+                runIOZlibFail(&state, 0, NULL);
+            virCondBroadcast(&state.cond);
+            virMutexUnlock(&state.lock);
+            if (rc < 0)
+                goto cleanup;
+            break;
+        }
+        slot->state = IOHELPER_ZLIB_SLOT_FILLED;
+        state.nread++;
+        virCondBroadcast(&state.cond);
+        virMutexUnlock(&state.lock);
+    }
+
+    if (!compress && !state.quit &&
+        runIOZlibCheckTrailer(&state, pos) < 0) {
+        virMutexLock(&state.lock);
+        runIOZlibFail(&state, 0, NULL);
+        virMutexUnlock(&state.lock);
+        goto cleanup;
+    }
 
     ret = 0;
 
 cleanup:
-    if (VIR_CLOSE(fd) < 0 &&
-        ret == 0) {
-        virReportSystemError(errno, _("Unable to close %s"), path);
+    if (haveLock && ret < 0) {
+        virMutexLock(&state.lock);
+        runIOZlibFail(&state, 0, NULL);
+        virMutexUnlock(&state.lock);
+    }
+    for (i = 0 ; i < nworkers ; i++)
+        virThreadJoin(&workers[i]);
+    if (haveWriter)
+        virThreadJoin(&writer);
+
+    /* A failure in another thread only left a message for us */
+    if (ret == 0 && state.quit) {
+        virReportSystemError(state.err, "%s", state.errmsg);
         ret = -1;
     }
 
-    VIR_FREE(buf);
+    if (haveCond)
+        ignore_value(virCondDestroy(&state.cond));
+    if (haveLock)
+        virMutexDestroy(&state.lock);
+    for (i = 0 ; state.slots && i < state.nslots ; i++) {
+        VIR_FREE(state.slots[i].in);
+        VIR_FREE(state.slots[i].out);
+    }
+    VIR_FREE(state.slots);
+    VIR_FREE(state.index);
+    VIR_FREE(workers);
     return ret;
 }
+#endif /* HAVE_ZLIB */
 
 int main(int argc, char **argv)
 {
@@ -146,6 +1365,7 @@ int main(int argc, char **argv)
     unsigned long long length;
     int flags;
     int mode;
+    bool sparse = false;
 
     if (setlocale(LC_ALL, "") == NULL ||
         bindtextdomain(PACKAGE, LOCALEDIR) == NULL ||
@@ -161,8 +1381,31 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
-    if (argc != 6) {
-        fprintf(stderr, _("%s: syntax FILENAME FLAGS MODE OFFSET LENGTH\n"), argv[0]);
+    if (argc == 3 && STREQ(argv[1], VIR_IOHELPER_ZLIB)) {
+        path = "stdin";
+#ifdef HAVE_ZLIB
+        if (STREQ(argv[2], "-c")) {
+            if (runIOZlib(true) < 0)
+                goto error;
+            return 0;
+        }
+        if (STREQ(argv[2], "-dc")) {
+            if (runIOZlib(false) < 0)
+                goto error;
+            return 0;
+        }
+#else
+        fprintf(stderr, _("%s: compression is not supported by this build\n"),
+                argv[0]);
+        exit(EXIT_FAILURE);
+#endif
+    }
+
+    if ((argc != 6 && argc != 7) ||
+        (argc == 7 && STRNEQ(argv[6], VIR_IOHELPER_SPARSE))) {
+        fprintf(stderr, _("%s: syntax FILENAME FLAGS MODE OFFSET LENGTH [%s]\n"
+                          "%s: syntax %s -c|-dc\n"),
+                argv[0], VIR_IOHELPER_SPARSE, argv[0], VIR_IOHELPER_ZLIB);
         exit(EXIT_FAILURE);
     }
 
@@ -187,7 +1430,10 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
-    if (runIO(path, flags, mode, offset, length) < 0)
+    if (argc == 7)
+        sparse = true;
+
+    if (runIO(path, flags, mode, offset, length, sparse) < 0)
         goto error;
 
     return 0;
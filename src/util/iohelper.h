@@ -0,0 +1,105 @@
+/*
+ * iohelper.h: Data format of the I/O helper's sparse mode
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+#ifndef __VIR_IOHELPER_H__
+# define __VIR_IOHELPER_H__
+
+# include <stdint.h>
+
+/* Extra argument asking libvirt_iohelper for sparse mode */
+# define VIR_IOHELPER_SPARSE "sparse"
+
+/*
+ * In sparse mode, the pipe between libvirt_iohelper and its
+ * parent carries a sequence of records instead of the plain file
+ * contents. Each is a header in host byte order, followed by
+ * 'length' bytes of file data for a data record, or by nothing
+ * for a hole. The header is smaller than PIPE_BUF, so it is
+ * always written to a pipe in one go.
+ */
+enum {
+    VIR_IOHELPER_RECORD_DATA = 1,
+    VIR_IOHELPER_RECORD_HOLE = 2,
+};
+
+typedef struct _virIOHelperRecord virIOHelperRecord;
+struct _virIOHelperRecord {
+    uint32_t type;
+    uint32_t padding;
+    uint64_t length;
+};
+
+/*
+ * Given VIR_IOHELPER_ZLIB and then "-c" or "-dc" as its arguments,
+ * libvirt_iohelper works as a filter from stdin to stdout, like an
+ * external compressor would. The data is cut into blocks which are
+ * deflated independently, so several threads can work on it at
+ * once, in either direction. The compressed image is laid out as
+ *
+ *   virIOHelperZlibHeader
+ *   virIOHelperZlibBlock, then 'compLength' bytes      (per block)
+ *   virIOHelperZlibBlock with 'rawLength' zero         (end marker)
+ *   virIOHelperZlibIndex                               (per block)
+ *   virIOHelperZlibTrailer
+ *
+ * all in little endian byte order, so an image saved on one host
+ * can be restored on any other. The index lets a reader find any block
+ * without inflating the ones before it, and together with the
+ * trailer tells a complete image from a truncated one.
+ */
+# define VIR_IOHELPER_ZLIB "zlib"
+# define VIR_IOHELPER_ZLIB_MAGIC "LibvirtZlibBlock"
+# define VIR_IOHELPER_ZLIB_VERSION 1
+
+typedef struct _virIOHelperZlibHeader virIOHelperZlibHeader;
+struct _virIOHelperZlibHeader {
+    char magic[sizeof(VIR_IOHELPER_ZLIB_MAGIC) - 1];
+    uint32_t version;
+    uint32_t blockSize;     /* Most raw data in any block */
+};
+
+enum {
+    /* The block did not compress, so is stored as is */
+    VIR_IOHELPER_ZLIB_BLOCK_STORED = (1 << 0),
+};
+
+typedef struct _virIOHelperZlibBlock virIOHelperZlibBlock;
+struct _virIOHelperZlibBlock {
+    uint32_t rawLength;
+    uint32_t compLength;
+    uint32_t flags;
+    uint32_t padding;
+};
+
+typedef struct _virIOHelperZlibIndex virIOHelperZlibIndex;
+struct _virIOHelperZlibIndex {
+    uint64_t offset;        /* Of the block header in the image */
+    uint64_t rawOffset;     /* Of the block's data once inflated */
+};
+
+typedef struct _virIOHelperZlibTrailer virIOHelperZlibTrailer;
+struct _virIOHelperZlibTrailer {
+    uint64_t nblocks;
+    uint64_t indexOffset;
+    char magic[sizeof(VIR_IOHELPER_ZLIB_MAGIC) - 1];
+};
+
+#endif /* __VIR_IOHELPER_H__ */
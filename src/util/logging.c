@@ -34,6 +34,10 @@
 #if HAVE_SYSLOG_H
 # include <syslog.h>
 #endif
+#if HAVE_SYNC_BUILTINS && !defined(WIN32)
+# include <sys/uio.h>
+# define VIR_LOG_ASYNC 1
+#endif
 
 #include "ignore-value.h"
 #include "virterror_internal.h"
@@ -93,6 +97,64 @@ static int virLogLen = 0;
 static int virLogStart = 0;
 static int virLogEnd = 0;
 
+#ifdef VIR_LOG_ASYNC
+/*
+ * When logging asynchronously each thread formats its messages into a
+ * ring of its own, which only that thread appends to, and a single
+ * writer thread drains all the rings in the order the messages were
+ * logged. Logging a message then takes no lock and does no I/O, and
+ * the writer can batch the messages written to a file descriptor.
+ */
+# define VIR_LOG_RING_SIZE (64 * 1024)
+# define VIR_LOG_RECORD_ALIGN 8
+# define VIR_LOG_BATCH 64              /* messages per writev() */
+# define VIR_LOG_FLUSH_INTERVAL 100    /* ms before flushing a quiet ring */
+
+# define virLogBarrier() __sync_synchronize()
+
+typedef struct _virLogRecord virLogRecord;
+typedef virLogRecord *virLogRecordPtr;
+struct _virLogRecord {
+    unsigned int size;      /* of the record and message, 0 to wrap around */
+    unsigned int seq;       /* order in which the messages were logged */
+    int priority;
+    int flags;
+    bool emit;              /* false if only kept in the debug buffer */
+    const char *category;   /* static strings, as given by the macros */
+    const char *funcname;
+    long long linenr;
+    struct timeval stamp;
+    int len;
+    /* followed by the formatted message, zero terminated */
+};
+
+typedef struct _virLogRing virLogRing;
+typedef virLogRing *virLogRingPtr;
+struct _virLogRing {
+    char *buf;
+    unsigned int head;      /* next record, only moved by the owner */
+    unsigned int tail;      /* oldest record, only moved by the writer */
+    unsigned int cursor;    /* used by the writer only */
+    unsigned int end;
+    bool orphaned;          /* the owner thread exited */
+    virLogRingPtr next;
+};
+
+static virLogRingPtr virLogRings = NULL;
+static virThreadLocal virLogRingLocal;
+static virLogRing virLogWriterMark;    /* marks the writer thread itself */
+static bool virLogAsync = false;
+static unsigned int virLogSeq = 0;
+
+static bool virLogWriterInitialized = false;
+static virMutex virLogWriterLock;
+static virCond virLogWriterCond;       /* wakes up the writer */
+static virCond virLogDrainedCond;      /* wakes up threads waiting for room */
+static virThread virLogWriterThread;
+static bool virLogWriterQuit = false;
+static pid_t virLogWriterPid = 0;
+#endif /* VIR_LOG_ASYNC */
+
 /*
  * Filters are used to refine the rules on what to keep or drop
  * based on a matching pattern (currently a substring)
@@ -131,8 +193,13 @@ static int virLogNbOutputs = 0;
  */
 static virLogPriority virLogDefaultPriority = VIR_LOG_DEFAULT;
 
+static bool virLogVersionStderr = true;
+
 static int virLogResetFilters(void);
 static int virLogResetOutputs(void);
+#ifdef VIR_LOG_ASYNC
+static void virLogRingRelease(void *data);
+#endif
 static int virLogOutputToFd(const char *category, int priority,
                             const char *funcname, long long linenr,
                             const char *str, int len, void *data);
@@ -195,6 +262,20 @@ int virLogStartup(void) {
     if (virMutexInit(&virLogMutex) < 0)
         return -1;
 
+#ifdef VIR_LOG_ASYNC
+    if (!virLogWriterInitialized) {
+        if (virMutexInit(&virLogWriterLock) < 0)
+            return -1;
+        if (virCondInit(&virLogWriterCond) < 0 ||
+            virCondInit(&virLogDrainedCond) < 0 ||
+            virThreadLocalInit(&virLogRingLocal, virLogRingRelease) < 0) {
+            virMutexDestroy(&virLogWriterLock);
+            return -1;
+        }
+        virLogWriterInitialized = true;
+    }
+#endif
+
     virLogInitialized = 1;
     virLogLock();
     if (VIR_ALLOC_N(virLogBuffer, virLogSize + 1) < 0) {
@@ -286,6 +367,8 @@ int virLogReset(void) {
     if (!virLogInitialized)
         return virLogStartup();
 
+    virLogSetAsync(false);
+
     virLogLock();
     virLogResetFilters();
     virLogResetOutputs();
@@ -304,6 +387,7 @@ int virLogReset(void) {
 void virLogShutdown(void) {
     if (!virLogInitialized)
         return;
+    virLogSetAsync(false);
     virLogLock();
     virLogResetFilters();
     virLogResetOutputs();
@@ -317,7 +401,7 @@ void virLogShutdown(void) {
 }
 
 /*
- * Store a string in the ring buffer
+ * Store a string in the ring buffer, the caller must hold the log lock
  */
 static void virLogStr(const char *str, int len) {
     int tmp;
@@ -328,7 +412,6 @@ static void virLogStr(const char *str, int len) {
         len = strlen(str);
     if (len >= virLogSize)
         return;
-    virLogLock();
 
     /*
      * copy the data and reset the end, we cycle over the end of the buffer
@@ -354,7 +437,6 @@ static void virLogStr(const char *str, int len) {
         if (virLogStart >= virLogSize)
             virLogStart -= virLogSize;
     }
-    virLogUnlock();
 }
 
 static void virLogDumpAllFD(const char *msg, int len) {
@@ -390,6 +472,9 @@ void
 virLogEmergencyDumpAll(int signum) {
     int len;
     int oldLogStart, oldLogLen, oldLogEnd;
+#ifdef VIR_LOG_ASYNC
+    virLogRingPtr ring;
+#endif
 
     switch (signum) {
 #ifdef SIGFPE
@@ -464,6 +549,29 @@ virLogEmergencyDumpAll(int signum) {
             oldLogStart = 0;
         }
     }
+
+#ifdef VIR_LOG_ASYNC
+    /*
+     * Then whatever the writer thread did not get to yet, which may
+     * repeat the last few messages of the buffer.
+     */
+    for (ring = virLogRings; ring != NULL; ring = ring->next) {
+        unsigned int cur = ring->tail;
+        unsigned int end = ring->head;
+
+        while (cur != end) {
+            virLogRecordPtr rec = (virLogRecordPtr) (ring->buf + cur);
+
+            if (rec->size == 0) {
+                cur = 0;
+                continue;
+            }
+            virLogDumpAllFD((char *) (rec + 1), rec->len);
+            cur += rec->size;
+        }
+    }
+#endif
+
     virLogDumpAllFD("\n\n     ====== end of log =====\n\n", -1);
 }
 
@@ -568,6 +676,10 @@ static int virLogFiltersCheck(const char *input) {
     int ret = 0;
     int i;
 
+    /* Spare the common case from contending on the lock */
+    if (virLogNbFilters == 0)
+        return 0;
+
     virLogLock();
     for (i = 0;i < virLogNbFilters;i++) {
         if (strstr(input, virLogFilters[i].match)) {
@@ -650,8 +762,13 @@ cleanup:
     return ret;
 }
 
+/*
+ * Returns the length of the formatted message, which is only
+ * written entirely to @buf if shorter than @size
+ */
 static int
-virLogFormatString(char **msg,
+virLogFormatString(char *buf,
+                   size_t size,
                    const char *funcname,
                    long long linenr,
                    struct tm *time_info,
@@ -669,26 +786,65 @@ virLogFormatString(char **msg,
      * to just grep for it to find the right place.
      */
     if ((funcname != NULL)) {
-        ret = virAsprintf(msg, "%02d:%02d:%02d.%03d: %d: %s : %s:%lld : %s\n",
-                          time_info->tm_hour, time_info->tm_min,
-                          time_info->tm_sec, (int) cur_time->tv_usec / 1000,
-                          virThreadSelfID(),
-                          virLogPriorityString(priority), funcname, linenr, str);
+        ret = snprintf(buf, size, "%02d:%02d:%02d.%03d: %d: %s : %s:%lld : %s\n",
+                       time_info->tm_hour, time_info->tm_min,
+                       time_info->tm_sec, (int) cur_time->tv_usec / 1000,
+                       virThreadSelfID(),
+                       virLogPriorityString(priority), funcname, linenr, str);
     } else {
-        ret = virAsprintf(msg, "%02d:%02d:%02d.%03d: %d: %s : %s\n",
-                          time_info->tm_hour, time_info->tm_min,
-                          time_info->tm_sec, (int) cur_time->tv_usec / 1000,
-                          virThreadSelfID(),
-                          virLogPriorityString(priority), str);
+        ret = snprintf(buf, size, "%02d:%02d:%02d.%03d: %d: %s : %s\n",
+                       time_info->tm_hour, time_info->tm_min,
+                       time_info->tm_sec, (int) cur_time->tv_usec / 1000,
+                       virThreadSelfID(),
+                       virLogPriorityString(priority), str);
     }
     return ret;
 }
 
+/*
+ * Format a message into @buf, or into a newly allocated string if it
+ * does not fit in @size bytes. Returns NULL on failure.
+ */
+static char *
+virLogFormatMessage(char *buf,
+                    size_t size,
+                    const char *funcname,
+                    long long linenr,
+                    struct tm *time_info,
+                    struct timeval *cur_time,
+                    int priority,
+                    const char *str,
+                    int *len)
+{
+    char *msg = buf;
+    int ret;
+
+    ret = virLogFormatString(buf, size, funcname, linenr,
+                             time_info, cur_time, priority, str);
+    if (ret < 0)
+        return NULL;
+
+    if (ret >= size) {
+        if (VIR_ALLOC_N(msg, ret + 1) < 0)
+            return NULL;
+        if (virLogFormatString(msg, ret + 1, funcname, linenr,
+                               time_info, cur_time, priority, str) < 0) {
+            VIR_FREE(msg);
+            return NULL;
+        }
+    }
+
+    *len = ret;
+    return msg;
+}
+
 static int
 virLogVersionString(char **msg,
                     struct tm *time_info,
                     struct timeval *cur_time)
 {
+    int len;
+
 #ifdef PACKAGER_VERSION
 # ifdef PACKAGER
 #  define LOG_VERSION_STRING \
@@ -702,9 +858,473 @@ virLogVersionString(char **msg,
     "libvirt version: " VERSION
 #endif
 
-    return virLogFormatString(msg, NULL, 0,
-                              time_info, cur_time,
-                              VIR_LOG_INFO, LOG_VERSION_STRING);
+    if (!(*msg = virLogFormatMessage(NULL, 0, NULL, 0,
+                                     time_info, cur_time,
+                                     VIR_LOG_INFO, LOG_VERSION_STRING,
+                                     &len)))
+        return -1;
+    return len;
+}
+
+#ifdef VIR_LOG_ASYNC
+static void virLogRingRelease(void *data) {
+    virLogRingPtr ring = data;
+
+    /* The writer frees the ring once it has drained it */
+    if (ring != &virLogWriterMark)
+        ring->orphaned = true;
+}
+
+/*
+ * Returns the ring of the calling thread, allocating it on first use,
+ * or NULL if the thread must log synchronously
+ */
+static virLogRingPtr virLogRingGet(void) {
+    virLogRingPtr ring = virThreadLocalGet(&virLogRingLocal);
+
+    if (ring == &virLogWriterMark)
+        return NULL;
+    if (ring != NULL)
+        return ring;
+
+    if (VIR_ALLOC(ring) < 0)
+        return NULL;
+    if (VIR_ALLOC_N(ring->buf, VIR_LOG_RING_SIZE) < 0) {
+        VIR_FREE(ring);
+        return NULL;
+    }
+
+    /* The writer may be walking the list, so publish the ring last */
+    virMutexLock(&virLogWriterLock);
+    ring->next = virLogRings;
+    virLogBarrier();
+    virLogRings = ring;
+    virMutexUnlock(&virLogWriterLock);
+
+    virThreadLocalSet(&virLogRingLocal, ring);
+    return ring;
+}
+
+/*
+ * Returns the offset where a record of @need bytes fits in @ring, or -1
+ * if it is too full. Only the owner of @ring may call this. The ring is
+ * never filled up entirely, so that head == tail means it is empty.
+ */
+static int virLogRingReserve(virLogRingPtr ring, unsigned int need) {
+    unsigned int head = ring->head;
+    unsigned int tail = ring->tail;
+
+    virLogBarrier();
+
+    if (head >= tail) {
+        if (VIR_LOG_RING_SIZE - head > need)
+            return head;
+        if (tail > need) {
+            /* Tell the writer the next record is at the start */
+            ((virLogRecordPtr) (ring->buf + head))->size = 0;
+            return 0;
+        }
+        return -1;
+    }
+
+    if (tail - head > need)
+        return head;
+    return -1;
+}
+
+static unsigned int virLogRingUsed(virLogRingPtr ring, unsigned int head) {
+    return (head + VIR_LOG_RING_SIZE - ring->tail) % VIR_LOG_RING_SIZE;
+}
+
+/*
+ * Append a formatted message to the ring of the calling thread, waiting
+ * for the writer to make room if needed. Returns false if the message
+ * must be logged synchronously instead.
+ */
+static bool virLogRingAppend(virLogRingPtr ring, const char *category,
+                             int priority, const char *funcname,
+                             long long linenr, int flags, bool emit,
+                             struct timeval *stamp,
+                             const char *msg, int len) {
+    virLogRecordPtr rec;
+    unsigned int need;
+    unsigned int used;
+    int off;
+
+    need = sizeof(*rec) + len + 1;
+    need = VIR_DIV_UP(need, VIR_LOG_RECORD_ALIGN) * VIR_LOG_RECORD_ALIGN;
+    if (need > VIR_LOG_RING_SIZE / 2)
+        return false;
+
+    if ((off = virLogRingReserve(ring, need)) < 0) {
+        virMutexLock(&virLogWriterLock);
+        while (virLogAsync && (off = virLogRingReserve(ring, need)) < 0) {
+            virCondSignal(&virLogWriterCond);
+            if (virCondWait(&virLogDrainedCond, &virLogWriterLock) < 0)
+                break;
+        }
+        virMutexUnlock(&virLogWriterLock);
+        if (off < 0)
+            return false;
+    }
+
+    rec = (virLogRecordPtr) (ring->buf + off);
+    rec->size = need;
+    rec->priority = priority;
+    rec->flags = flags;
+    rec->emit = emit;
+    rec->category = category;
+    rec->funcname = funcname;
+    rec->linenr = linenr;
+    rec->stamp = *stamp;
+    rec->len = len;
+    memcpy(rec + 1, msg, len + 1);
+    rec->seq = __sync_fetch_and_add(&virLogSeq, 1);
+
+    used = virLogRingUsed(ring, ring->head);
+    virLogBarrier();
+    ring->head = off + need;
+
+    /* Errors should show up quickly, and the thread should not have
+     * to wait for room unless the writer cannot keep up */
+    if (priority >= VIR_LOG_WARN ||
+        (used < VIR_LOG_RING_SIZE / 2 &&
+         virLogRingUsed(ring, ring->head) >= VIR_LOG_RING_SIZE / 2))
+        virCondSignal(&virLogWriterCond);
+
+    return true;
+}
+
+/*
+ * Format and queue a message for the writer thread. Returns false if it
+ * must be logged synchronously instead.
+ */
+static bool virLogMessageAsync(const char *category, int priority,
+                               const char *funcname, long long linenr,
+                               int flags, bool emit,
+                               const char *fmt, va_list args) {
+    virLogRingPtr ring;
+    char strbuf[512];
+    char msgbuf[1024];
+    char *str = strbuf;
+    char *msg = NULL;
+    struct timeval cur_time;
+    struct tm time_info;
+    va_list ap;
+    int len;
+    bool ret = false;
+
+    if (!(ring = virLogRingGet()))
+        return false;
+
+    va_copy(ap, args);
+    len = vsnprintf(strbuf, sizeof(strbuf), fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        return false;
+    if (len >= sizeof(strbuf)) {
+        va_copy(ap, args);
+        len = virVasprintf(&str, fmt, ap);
+        va_end(ap);
+        if (len < 0)
+            return false;
+    }
+
+    gettimeofday(&cur_time, NULL);
+    localtime_r(&cur_time.tv_sec, &time_info);
+
+    if (!(msg = virLogFormatMessage(msgbuf, sizeof(msgbuf), funcname, linenr,
+                                    &time_info, &cur_time,
+                                    priority, str, &len)))
+        goto cleanup;
+
+    ret = virLogRingAppend(ring, category, priority, funcname, linenr,
+                           flags, emit, &cur_time, msg, len);
+
+cleanup:
+    if (str != strbuf)
+        VIR_FREE(str);
+    if (msg != msgbuf)
+        VIR_FREE(msg);
+    return ret;
+}
+
+/*
+ * Returns the oldest record the writer did not handle yet in @ring,
+ * skipping wrap around markers, or NULL
+ */
+static virLogRecordPtr virLogRingPeek(virLogRingPtr ring) {
+    virLogRecordPtr rec;
+
+    while (ring->cursor != ring->end) {
+        rec = (virLogRecordPtr) (ring->buf + ring->cursor);
+        if (rec->size != 0)
+            return rec;
+        ring->cursor = 0;
+    }
+    return NULL;
+}
+
+/*
+ * Write all of @iov to @fd, as safewrite() does for a single buffer
+ */
+static void virLogWritev(int fd, struct iovec *iov, int niov) {
+    while (niov > 0) {
+        ssize_t done = writev(fd, iov, niov);
+
+        if (done < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        while (niov > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (niov > 0) {
+            iov->iov_base = (char *) iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+}
+
+/*
+ * Store a batch of records in the debug buffer and send them to the
+ * outputs, gathering the ones going to a file descriptor in a single
+ * writev() call.
+ */
+static void virLogWriteBatch(virLogRecordPtr *batch, int n) {
+    struct iovec iov[VIR_LOG_BATCH + 1];
+    struct tm time_info;
+    char *ver = NULL;
+    int i, j, niov;
+
+    virLogLock();
+
+    for (i = 0; i < n; i++)
+        virLogStr((char *) (batch[i] + 1), batch[i]->len);
+
+    for (i = 0; i < virLogNbOutputs; i++) {
+        virLogOutputPtr output = &virLogOutputs[i];
+        bool fd = (output->f == virLogOutputToFd);
+
+        niov = 0;
+        for (j = 0; j < n; j++) {
+            virLogRecordPtr rec = batch[j];
+            char *msg = (char *) (rec + 1);
+
+            if (!rec->emit || rec->priority < output->priority)
+                continue;
+
+            if (output->logVersion) {
+                localtime_r(&rec->stamp.tv_sec, &time_info);
+                if (virLogVersionString(&ver, &time_info, &rec->stamp) >= 0) {
+                    if (fd) {
+                        iov[niov].iov_base = ver;
+                        iov[niov++].iov_len = strlen(ver);
+                    } else {
+                        output->f(rec->category, VIR_LOG_INFO,
+                                  __func__, __LINE__,
+                                  ver, strlen(ver), output->data);
+                    }
+                }
+                output->logVersion = false;
+            }
+
+            if (fd) {
+                iov[niov].iov_base = msg;
+                iov[niov++].iov_len = rec->len;
+            } else {
+                output->f(rec->category, rec->priority, rec->funcname,
+                          rec->linenr, msg, rec->len, output->data);
+            }
+        }
+
+        if (niov > 0 && (long) output->data >= 0)
+            virLogWritev((long) output->data, iov, niov);
+        VIR_FREE(ver);
+    }
+
+    if (virLogNbOutputs == 0) {
+        niov = 0;
+        for (j = 0; j < n; j++) {
+            virLogRecordPtr rec = batch[j];
+
+            if (!rec->emit || rec->flags == 1)
+                continue;
+
+            if (virLogVersionStderr) {
+                localtime_r(&rec->stamp.tv_sec, &time_info);
+                if (virLogVersionString(&ver, &time_info, &rec->stamp) >= 0) {
+                    iov[niov].iov_base = ver;
+                    iov[niov++].iov_len = strlen(ver);
+                }
+                virLogVersionStderr = false;
+            }
+            iov[niov].iov_base = rec + 1;
+            iov[niov++].iov_len = rec->len;
+        }
+        if (niov > 0)
+            virLogWritev(STDERR_FILENO, iov, niov);
+        VIR_FREE(ver);
+    }
+
+    virLogUnlock();
+}
+
+/*
+ * Drain all the rings, oldest message first. Returns the number of
+ * messages written.
+ */
+static int virLogWriterFlush(void) {
+    virLogRecordPtr batch[VIR_LOG_BATCH];
+    virLogRingPtr rings, ring;
+    int total = 0;
+    int n;
+
+    do {
+        /* Rings are only ever added to the front of the list */
+        rings = virLogRings;
+        for (ring = rings; ring != NULL; ring = ring->next) {
+            ring->cursor = ring->tail;
+            ring->end = ring->head;
+        }
+        virLogBarrier();
+
+        for (n = 0; n < VIR_LOG_BATCH; n++) {
+            virLogRingPtr oldest = NULL;
+            virLogRecordPtr rec, first = NULL;
+
+            for (ring = rings; ring != NULL; ring = ring->next) {
+                if ((rec = virLogRingPeek(ring)) != NULL &&
+                    (first == NULL || (int) (rec->seq - first->seq) < 0)) {
+                    oldest = ring;
+                    first = rec;
+                }
+            }
+            if (oldest == NULL)
+                break;
+
+            batch[n] = first;
+            oldest->cursor += first->size;
+        }
+
+        if (n > 0)
+            virLogWriteBatch(batch, n);
+
+        virLogBarrier();
+        for (ring = rings; ring != NULL; ring = ring->next)
+            ring->tail = ring->cursor;
+
+        total += n;
+    } while (n == VIR_LOG_BATCH);
+
+    return total;
+}
+
+/*
+ * Free the rings of the threads which exited, once drained. Must be
+ * called with the writer lock held.
+ */
+static void virLogRingsReap(void) {
+    virLogRingPtr *prev = &virLogRings;
+    virLogRingPtr ring;
+
+    while ((ring = *prev) != NULL) {
+        if (ring->orphaned && ring->tail == ring->head) {
+            *prev = ring->next;
+            VIR_FREE(ring->buf);
+            VIR_FREE(ring);
+        } else {
+            prev = &ring->next;
+        }
+    }
+}
+
+static void virLogWriterMain(void *opaque ATTRIBUTE_UNUSED) {
+    /* Anything logged from here must not wait on ourselves */
+    virThreadLocalSet(&virLogRingLocal, &virLogWriterMark);
+
+    virMutexLock(&virLogWriterLock);
+    while (1) {
+        bool quit = virLogWriterQuit;
+        struct timeval now;
+        int n;
+
+        virMutexUnlock(&virLogWriterLock);
+        n = virLogWriterFlush();
+        virMutexLock(&virLogWriterLock);
+
+        virCondBroadcast(&virLogDrainedCond);
+        virLogRingsReap();
+
+        if (quit && n == 0)
+            break;
+        if (n > 0 || virLogWriterQuit)
+            continue;
+
+        gettimeofday(&now, NULL);
+        ignore_value(virCondWaitUntil(&virLogWriterCond, &virLogWriterLock,
+                                      now.tv_sec * 1000ull +
+                                      now.tv_usec / 1000 +
+                                      VIR_LOG_FLUSH_INTERVAL));
+    }
+    virMutexUnlock(&virLogWriterLock);
+}
+#endif /* VIR_LOG_ASYNC */
+
+/**
+ * virLogSetAsync:
+ * @async: whether to log asynchronously
+ *
+ * Switch between writing each message to the outputs from the thread
+ * logging it, which is the default, and queueing messages to a thread
+ * dedicated to writing them. Messages still queued are written before
+ * switching back. In a child process, this just drops the queued
+ * messages as the writer thread did not survive the fork.
+ *
+ * Returns 0 if successful, -1 if asynchronous logging is not available
+ */
+int virLogSetAsync(bool async) {
+#ifdef VIR_LOG_ASYNC
+    if (!virLogInitialized)
+        virLogStartup();
+
+    if (!async) {
+        if (!virLogAsync)
+            return 0;
+
+        /* The writer lock may have been held at the time of the fork */
+        if (virLogWriterPid != getpid()) {
+            virLogAsync = false;
+            return 0;
+        }
+
+        virMutexLock(&virLogWriterLock);
+        virLogAsync = false;
+        virLogWriterQuit = true;
+        virCondSignal(&virLogWriterCond);
+        virCondBroadcast(&virLogDrainedCond);
+        virMutexUnlock(&virLogWriterLock);
+
+        virThreadJoin(&virLogWriterThread);
+        return 0;
+    }
+
+    if (virLogAsync)
+        return 0;
+
+    virLogWriterQuit = false;
+    if (virThreadCreate(&virLogWriterThread, true,
+                        virLogWriterMain, NULL) < 0)
+        return -1;
+    virLogWriterPid = getpid();
+    virLogAsync = true;
+    return 0;
+#else
+    return async ? -1 : 0;
+#endif
 }
 
 /**
@@ -722,12 +1342,11 @@ virLogVersionString(char **msg,
  */
 void virLogMessage(const char *category, int priority, const char *funcname,
                    long long linenr, int flags, const char *fmt, ...) {
-    static bool logVersionStderr = true;
     char *str = NULL;
     char *msg = NULL;
     struct timeval cur_time;
     struct tm time_info;
-    int len, fprio, i, ret;
+    int len, fprio, i;
     int saved_errno = errno;
     int emit = 1;
 
@@ -751,6 +1370,20 @@ void virLogMessage(const char *category, int priority, const char *funcname,
     if ((emit == 0) && ((virLogBuffer == NULL) || (virLogSize <= 0)))
         goto cleanup;
 
+#ifdef VIR_LOG_ASYNC
+    if (virLogAsync) {
+        va_list ap;
+        bool queued;
+
+        va_start(ap, fmt);
+        queued = virLogMessageAsync(category, priority, funcname, linenr,
+                                    flags, emit, fmt, ap);
+        va_end(ap);
+        if (queued)
+            goto cleanup;
+    }
+#endif
+
     /*
      * serialize the error message, add level and timestamp
      */
@@ -760,11 +1393,11 @@ void virLogMessage(const char *category, int priority, const char *funcname,
     gettimeofday(&cur_time, NULL);
     localtime_r(&cur_time.tv_sec, &time_info);
 
-    ret = virLogFormatString(&msg, funcname, linenr,
-                             &time_info, &cur_time,
-                             priority, str);
+    msg = virLogFormatMessage(NULL, 0, funcname, linenr,
+                              &time_info, &cur_time,
+                              priority, str, &len);
     VIR_FREE(str);
-    if (ret < 0)
+    if (msg == NULL)
         goto cleanup;
 
     /*
@@ -772,11 +1405,12 @@ void virLogMessage(const char *category, int priority, const char *funcname,
      * then if emit push the message on the outputs defined, if none
      * use stderr.
      * NOTE: the locking is a single point of contention for multiple
-     *       threads, but avoid intermixing. Maybe set up locks per output
-     *       to improve paralellism.
+     *       threads, but avoid intermixing. Use virLogSetAsync() to
+     *       move the output to a dedicated thread instead.
      */
-    len = strlen(msg);
+    virLogLock();
     virLogStr(msg, len);
+    virLogUnlock();
     if (emit == 0)
         goto cleanup;
 
@@ -797,13 +1431,13 @@ void virLogMessage(const char *category, int priority, const char *funcname,
         }
     }
     if ((virLogNbOutputs == 0) && (flags != 1)) {
-        if (logVersionStderr) {
+        if (virLogVersionStderr) {
             char *ver = NULL;
             if (virLogVersionString(&ver, &time_info, &cur_time) >= 0)
                 ignore_value (safewrite(STDERR_FILENO,
                                         ver, strlen(ver)));
             VIR_FREE(ver);
-            logVersionStderr = false;
+            virLogVersionStderr = false;
         }
         ignore_value (safewrite(STDERR_FILENO, msg, len));
     }
@@ -25,88 +25,509 @@
 
 #include <config.h>
 
+#include <sys/time.h>
+#include <errno.h>
+#include <string.h>
+
 #include "threadpool.h"
 #include "memory.h"
 #include "threads.h"
 #include "virterror_internal.h"
+#include "logging.h"
 #include "ignore-value.h"
 
 #define VIR_FROM_THIS VIR_FROM_NONE
 
+/*
+ * Each worker owns a queue of jobs, protected by a lock of its
+ * own, so running jobs never goes through a lock shared by the
+ * whole pool. New jobs are given to an idle worker if there is
+ * one, else queued round-robin on a busy one; a worker that runs
+ * out of jobs takes one from the tail of another worker's queue
+ * before going to sleep.
+ *
+ * Which workers are idle, and which can be given jobs, is kept in
+ * two arrays under pool->sched, which is only ever held for a
+ * handful of instructions. Submitting a job takes it once to pick
+ * a worker, then only that worker's lock to queue the job; the
+ * pool lock proper is only taken to start and retire workers.
+ *
+ * Workers are started when a job arrives and none is idle, and
+ * retire once they have been idle for VIR_THREADPOOL_IDLE_MS while
+ * the measured queueing latency of the pool is low.
+ *
+ * Every job queued is run, even once the pool is being freed, so
+ * that whatever its data holds on to gets released.
+ *
+ * Lock ordering is pool->mutex, then pool->sched, then any one
+ * worker lock. No thread ever holds two worker locks at once.
+ */
+
+/* How long a surplus worker waits for a job before retiring */
+#define VIR_THREADPOOL_IDLE_MS (30 * 1000)
+
+/* Recent queueing latency, in microseconds, above which workers
+ * are kept around rather than retired */
+#define VIR_THREADPOOL_BUSY_US 1000
+
 typedef struct _virThreadPoolJob virThreadPoolJob;
 typedef virThreadPoolJob *virThreadPoolJobPtr;
 
 struct _virThreadPoolJob {
+    virThreadPoolJobPtr prev;
     virThreadPoolJobPtr next;
 
+    unsigned long long queued; /* microseconds since epoch */
     void *data;
 };
 
-typedef struct _virThreadPoolJobList virThreadPoolJobList;
-typedef virThreadPoolJobList *virThreadPoolJobListPtr;
+typedef struct _virThreadPoolWorker virThreadPoolWorker;
+typedef virThreadPoolWorker *virThreadPoolWorkerPtr;
 
-struct _virThreadPoolJobList {
-    virThreadPoolJobPtr head;
-    virThreadPoolJobPtr *tail;
-};
+struct _virThreadPoolWorker {
+    virThreadPoolPtr pool;
+    virThread thread;
 
+    /* Protected by pool->mutex */
+    bool running;   /* A thread is attached to this slot */
 
-struct _virThreadPool {
+    /* Protected by pool->sched */
+    bool idle;      /* In pool->idle, at idleIndex */
+    size_t idleIndex;
+    bool active;    /* In pool->active, at activeIndex */
+    size_t activeIndex;
+
+    virMutex lock;
+    virCond cond;
+
+    /* All protected by 'lock' */
+    bool accepting; /* Jobs may be queued on this worker */
+    bool wakeup;    /* Someone queued a job for us to steal */
     bool quit;
 
+    virThreadPoolJobPtr head;  /* Served by this worker */
+    virThreadPoolJobPtr tail;  /* Stolen by others */
+    size_t njobs;
+
+    unsigned long long jobsDone;
+    unsigned long long steals;
+    unsigned long long waitAvg; /* Moving average, microseconds */
+    unsigned long long waitMax;
+};
+
+struct _virThreadPool {
     virThreadPoolJobFunc jobFunc;
     void *jobOpaque;
-    virThreadPoolJobList jobList;
 
+    /* Protects nWorkers, and serializes starting
+     * and retiring workers */
     virMutex mutex;
-    virCond cond;
     virCond quit_cond;
 
+    size_t minWorkers;
     size_t maxWorkers;
-    size_t freeWorkers;
     size_t nWorkers;
-    virThreadPtr workers;
+    virThreadPoolWorkerPtr workers; /* maxWorkers slots */
+
+    /* Protects everything below. 'quit' is also
+     * only changed while holding 'mutex' */
+    virMutex sched;
+    bool quit;
+
+    virThreadPoolWorkerPtr *idle;   /* Waiting for a job, most recent last */
+    size_t nIdle;
+    virThreadPoolWorkerPtr *active; /* Started, and not yet exiting */
+    size_t nActive;
+    size_t next;                    /* Round-robin index into 'active' */
 };
 
-static void virThreadPoolWorker(void *opaque)
+
+static unsigned long long virThreadPoolTimeUs(void)
 {
-    virThreadPoolPtr pool = opaque;
+    struct timeval now;
 
-    virMutexLock(&pool->mutex);
+    if (gettimeofday(&now, NULL) < 0)
+        return 0;
 
-    while (1) {
-        while (!pool->quit &&
-               !pool->jobList.head) {
-            pool->freeWorkers++;
-            if (virCondWait(&pool->cond, &pool->mutex) < 0) {
-                pool->freeWorkers--;
-                goto out;
-            }
-            pool->freeWorkers--;
+    return (now.tv_sec * 1000000ull) + now.tv_usec;
+}
+
+/* Caller must hold worker->lock */
+static void virThreadPoolWorkerPush(virThreadPoolWorkerPtr worker,
+                                    virThreadPoolJobPtr job)
+{
+    job->next = NULL;
+    job->prev = worker->tail;
+    if (worker->tail)
+        worker->tail->next = job;
+    else
+        worker->head = job;
+    worker->tail = job;
+    worker->njobs++;
+}
+
+/* Caller must hold worker->lock */
+static virThreadPoolJobPtr
+virThreadPoolWorkerPopHead(virThreadPoolWorkerPtr worker)
+{
+    virThreadPoolJobPtr job = worker->head;
+
+    if (!job)
+        return NULL;
+
+    worker->head = job->next;
+    if (worker->head)
+        worker->head->prev = NULL;
+    else
+        worker->tail = NULL;
+    worker->njobs--;
+
+    job->next = job->prev = NULL;
+    return job;
+}
+
+/* Caller must hold worker->lock */
+static virThreadPoolJobPtr
+virThreadPoolWorkerPopTail(virThreadPoolWorkerPtr worker)
+{
+    virThreadPoolJobPtr job = worker->tail;
+
+    if (!job)
+        return NULL;
+
+    worker->tail = job->prev;
+    if (worker->tail)
+        worker->tail->next = NULL;
+    else
+        worker->head = NULL;
+    worker->njobs--;
+
+    job->next = job->prev = NULL;
+    return job;
+}
+
+/* Caller must hold pool->sched */
+static void virThreadPoolIdleRemove(virThreadPoolPtr pool,
+                                    virThreadPoolWorkerPtr worker)
+{
+    virThreadPoolWorkerPtr last = pool->idle[--pool->nIdle];
+
+    pool->idle[worker->idleIndex] = last;
+    last->idleIndex = worker->idleIndex;
+    worker->idle = false;
+}
+
+/* Caller must hold pool->sched */
+static virThreadPoolWorkerPtr virThreadPoolIdlePop(virThreadPoolPtr pool)
+{
+    virThreadPoolWorkerPtr worker;
+
+    if (pool->nIdle == 0)
+        return NULL;
+
+    worker = pool->idle[pool->nIdle - 1];
+    virThreadPoolIdleRemove(pool, worker);
+    return worker;
+}
+
+static void virThreadPoolSetIdle(virThreadPoolWorkerPtr worker,
+                                 bool idle)
+{
+    virThreadPoolPtr pool = worker->pool;
+
+    virMutexLock(&pool->sched);
+    if (idle && !worker->idle) {
+        worker->idle = true;
+        worker->idleIndex = pool->nIdle;
+        pool->idle[pool->nIdle++] = worker;
+    } else if (!idle && worker->idle) {
+        virThreadPoolIdleRemove(pool, worker);
+    }
+    virMutexUnlock(&pool->sched);
+}
+
+/* Caller must hold pool->sched */
+static void virThreadPoolActiveAdd(virThreadPoolPtr pool,
+                                   virThreadPoolWorkerPtr worker)
+{
+    worker->active = true;
+    worker->activeIndex = pool->nActive;
+    pool->active[pool->nActive++] = worker;
+}
+
+/* Caller must hold pool->sched */
+static void virThreadPoolActiveRemove(virThreadPoolPtr pool,
+                                      virThreadPoolWorkerPtr worker)
+{
+    virThreadPoolWorkerPtr last;
+
+    if (!worker->active)
+        return;
+
+    last = pool->active[--pool->nActive];
+    pool->active[worker->activeIndex] = last;
+    last->activeIndex = worker->activeIndex;
+    worker->active = false;
+}
+
+/*
+ * Take a job queued on some other worker. This must be called
+ * after marking self idle, and without holding any lock, so that
+ * anyone queueing a job on a busy worker after we've looked at it
+ * is guaranteed to find us idle and wake us.
+ */
+static virThreadPoolJobPtr
+virThreadPoolSteal(virThreadPoolWorkerPtr self)
+{
+    virThreadPoolPtr pool = self->pool;
+    size_t offset = self - pool->workers;
+    size_t i;
+
+    for (i = 1 ; i < pool->maxWorkers ; i++) {
+        virThreadPoolWorkerPtr victim =
+            &pool->workers[(offset + i) % pool->maxWorkers];
+        virThreadPoolJobPtr job;
+
+        virMutexLock(&victim->lock);
+        job = virThreadPoolWorkerPopTail(victim);
+        virMutexUnlock(&victim->lock);
+
+        if (job)
+            return job;
+    }
+
+    return NULL;
+}
+
+/* Caller must hold pool->mutex */
+static unsigned long long
+virThreadPoolWaitAvg(virThreadPoolPtr pool)
+{
+    unsigned long long total = 0;
+    size_t n = 0;
+    size_t i;
+
+    for (i = 0 ; i < pool->maxWorkers ; i++) {
+        virThreadPoolWorkerPtr worker = &pool->workers[i];
+
+        if (!worker->running)
+            continue;
+
+        virMutexLock(&worker->lock);
+        total += worker->waitAvg;
+        n++;
+        virMutexUnlock(&worker->lock);
+    }
+
+    return n ? total / n : 0;
+}
+
+/*
+ * Detach 'worker' from its thread, which is about to exit with
+ * its queue empty.
+ *
+ * Caller must hold pool->mutex, pool->sched and worker->lock
+ */
+static void virThreadPoolWorkerExit(virThreadPoolWorkerPtr worker)
+{
+    virThreadPoolPtr pool = worker->pool;
+
+    if (worker->idle)
+        virThreadPoolIdleRemove(pool, worker);
+    virThreadPoolActiveRemove(pool, worker);
+
+    worker->accepting = false;
+    worker->running = false;
+    pool->nWorkers--;
+    if (pool->quit && pool->nWorkers == 0)
+        virCondSignal(&pool->quit_cond);
+}
+
+/*
+ * Called by a worker which timed out waiting for a job, holding
+ * no lock. Returns true if the worker has retired and its thread
+ * must exit.
+ */
+static bool virThreadPoolWorkerRetire(virThreadPoolWorkerPtr worker)
+{
+    virThreadPoolPtr pool = worker->pool;
+    bool retire = false;
+
+    /* An idle spell means nothing was queueing up meanwhile */
+    virMutexLock(&worker->lock);
+    worker->waitAvg /= 2;
+    virMutexUnlock(&worker->lock);
+
+    virMutexLock(&pool->mutex);
+    if (pool->nWorkers > pool->minWorkers &&
+        virThreadPoolWaitAvg(pool) < VIR_THREADPOOL_BUSY_US) {
+        virMutexLock(&pool->sched);
+        virMutexLock(&worker->lock);
+        /* Someone may have picked us for a job meanwhile */
+        if (!worker->head && !worker->wakeup && !worker->quit) {
+            virThreadPoolWorkerExit(worker);
+            retire = true;
         }
+        virMutexUnlock(&worker->lock);
+        virMutexUnlock(&pool->sched);
+    }
+    virMutexUnlock(&pool->mutex);
 
-        if (pool->quit)
-            break;
+    return retire;
+}
 
-        virThreadPoolJobPtr job = pool->jobList.head;
-        pool->jobList.head = pool->jobList.head->next;
-        job->next = NULL;
-        if (pool->jobList.tail == &job->next)
-            pool->jobList.tail = &pool->jobList.head;
+static void virThreadPoolWorkerMain(void *opaque)
+{
+    virThreadPoolWorkerPtr worker = opaque;
+    virThreadPoolPtr pool = worker->pool;
+
+    virMutexLock(&worker->lock);
+
+    for (;;) {
+        virThreadPoolJobPtr job;
+        unsigned long long wait;
+        bool stolen = false;
+
+        if ((job = virThreadPoolWorkerPopHead(worker))) {
+            virMutexUnlock(&worker->lock);
+        } else {
+            /* Only once our own queue has been run dry, since
+             * the jobs on it may hold references to release */
+            if (worker->quit)
+                break;
+            virMutexUnlock(&worker->lock);
+
+            virThreadPoolSetIdle(worker, true);
+            if (!(job = virThreadPoolSteal(worker))) {
+                bool timedout = false;
+
+                virMutexLock(&worker->lock);
+                if (!worker->head && !worker->wakeup && !worker->quit) {
+                    unsigned long long until =
+                        virThreadPoolTimeUs() / 1000 + VIR_THREADPOOL_IDLE_MS;
+
+                    if (virCondWaitUntil(&worker->cond, &worker->lock,
+                                         until) < 0 &&
+                        errno == ETIMEDOUT)
+                        timedout = true;
+                }
+                worker->wakeup = false;
+                virMutexUnlock(&worker->lock);
+
+                virThreadPoolSetIdle(worker, false);
+                if (timedout && virThreadPoolWorkerRetire(worker))
+                    return;
+
+                virMutexLock(&worker->lock);
+                continue;
+            }
+            virThreadPoolSetIdle(worker, false);
+            stolen = true;
+        }
 
-        virMutexUnlock(&pool->mutex);
+        wait = virThreadPoolTimeUs() - job->queued;
         (pool->jobFunc)(job->data, pool->jobOpaque);
         VIR_FREE(job);
-        virMutexLock(&pool->mutex);
+
+        virMutexLock(&worker->lock);
+        worker->jobsDone++;
+        if (stolen)
+            worker->steals++;
+        worker->waitAvg = (worker->waitAvg * 7 + wait) / 8;
+        if (wait > worker->waitMax)
+            worker->waitMax = wait;
     }
+    /* Stop anyone queueing jobs here while we drop the lock */
+    worker->accepting = false;
+    virMutexUnlock(&worker->lock);
 
-out:
-    pool->nWorkers--;
-    if (pool->nWorkers == 0)
-        virCondSignal(&pool->quit_cond);
+    virMutexLock(&pool->mutex);
+    virMutexLock(&pool->sched);
+    virMutexLock(&worker->lock);
+    virThreadPoolWorkerExit(worker);
+    virMutexUnlock(&worker->lock);
+    virMutexUnlock(&pool->sched);
     virMutexUnlock(&pool->mutex);
 }
 
+/*
+ * Start a new worker, optionally giving it 'job' to run first.
+ * Returns 1 if a worker was started, 0 if the pool is already at
+ * its limit, or -1 on error.
+ *
+ * Caller must hold pool->mutex
+ */
+static int virThreadPoolStartWorker(virThreadPoolPtr pool,
+                                    virThreadPoolJobPtr job)
+{
+    virThreadPoolWorkerPtr worker = NULL;
+    int ret = -1;
+    size_t i;
+
+    if (pool->quit)
+        goto cleanup;
+
+    if (pool->nWorkers >= pool->maxWorkers) {
+        ret = 0;
+        goto cleanup;
+    }
+
+    for (i = 0 ; i < pool->maxWorkers ; i++) {
+        if (!pool->workers[i].running) {
+            worker = &pool->workers[i];
+            break;
+        }
+    }
+    if (!worker) {
+        ret = 0;
+        goto cleanup;
+    }
+
+    worker->running = true;
+    virMutexLock(&worker->lock);
+    worker->accepting = true;
+    worker->wakeup = worker->quit = false;
+    if (job)
+        virThreadPoolWorkerPush(worker, job);
+    virMutexUnlock(&worker->lock);
+
+    if (virThreadCreate(&worker->thread, false,
+                        virThreadPoolWorkerMain, worker) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("Unable to create thread pool worker"));
+        virMutexLock(&worker->lock);
+        if (job)
+            ignore_value(virThreadPoolWorkerPopTail(worker));
+        worker->accepting = false;
+        virMutexUnlock(&worker->lock);
+        worker->running = false;
+        goto cleanup;
+    }
+
+    virMutexLock(&pool->sched);
+    virThreadPoolActiveAdd(pool, worker);
+    virMutexUnlock(&pool->sched);
+
+    pool->nWorkers++;
+    ret = 1;
+
+cleanup:
+    return ret;
+}
+
+/* As virThreadPoolStartWorker, for callers not holding pool->mutex */
+static int virThreadPoolGrow(virThreadPoolPtr pool,
+                             virThreadPoolJobPtr job)
+{
+    int ret;
+
+    virMutexLock(&pool->mutex);
+    ret = virThreadPoolStartWorker(pool, job);
+    virMutexUnlock(&pool->mutex);
+
+    return ret;
+}
+
 virThreadPoolPtr virThreadPoolNew(size_t minWorkers,
                                   size_t maxWorkers,
                                   virThreadPoolJobFunc func,
@@ -115,6 +536,8 @@ virThreadPoolPtr virThreadPoolNew(size_t minWorkers,
     virThreadPoolPtr pool;
     size_t i;
 
+    if (maxWorkers == 0)
+        maxWorkers = 1;
     if (minWorkers > maxWorkers)
         minWorkers = maxWorkers;
 
@@ -123,109 +546,259 @@ virThreadPoolPtr virThreadPoolNew(size_t minWorkers,
         return NULL;
     }
 
-    pool->jobList.head = NULL;
-    pool->jobList.tail = &pool->jobList.head;
-
     pool->jobFunc = func;
     pool->jobOpaque = opaque;
+    pool->minWorkers = minWorkers;
+    pool->maxWorkers = maxWorkers;
 
-    if (virMutexInit(&pool->mutex) < 0)
-        goto error;
-    if (virCondInit(&pool->cond) < 0)
-        goto error;
-    if (virCondInit(&pool->quit_cond) < 0)
-        goto error;
+    if (virMutexInit(&pool->mutex) < 0) {
+        VIR_FREE(pool);
+        return NULL;
+    }
+    if (virMutexInit(&pool->sched) < 0) {
+        virMutexDestroy(&pool->mutex);
+        VIR_FREE(pool);
+        return NULL;
+    }
+    if (virCondInit(&pool->quit_cond) < 0) {
+        virMutexDestroy(&pool->sched);
+        virMutexDestroy(&pool->mutex);
+        VIR_FREE(pool);
+        return NULL;
+    }
 
-    if (VIR_ALLOC_N(pool->workers, minWorkers) < 0)
+    if (VIR_ALLOC_N(pool->workers, maxWorkers) < 0 ||
+        VIR_ALLOC_N(pool->idle, maxWorkers) < 0 ||
+        VIR_ALLOC_N(pool->active, maxWorkers) < 0) {
+        virReportOOMError();
+        i = 0;
         goto error;
+    }
 
-    pool->maxWorkers = maxWorkers;
-    for (i = 0; i < minWorkers; i++) {
-        if (virThreadCreate(&pool->workers[i],
-                            true,
-                            virThreadPoolWorker,
-                            pool) < 0) {
+    for (i = 0 ; i < maxWorkers ; i++) {
+        virThreadPoolWorkerPtr worker = &pool->workers[i];
+
+        worker->pool = pool;
+        if (virMutexInit(&worker->lock) < 0)
+            goto error;
+        if (virCondInit(&worker->cond) < 0) {
+            virMutexDestroy(&worker->lock);
             goto error;
         }
-        pool->nWorkers++;
     }
 
+    virMutexLock(&pool->mutex);
+    for (i = 0 ; i < minWorkers ; i++) {
+        if (virThreadPoolStartWorker(pool, NULL) < 0) {
+            virMutexUnlock(&pool->mutex);
+            virThreadPoolFree(pool);
+            return NULL;
+        }
+    }
+    virMutexUnlock(&pool->mutex);
+
     return pool;
 
 error:
+    /* Slots past the failure have an uninitialized lock, so
+     * don't let virThreadPoolFree touch them */
+    pool->maxWorkers = i;
     virThreadPoolFree(pool);
     return NULL;
-
 }
 
 void virThreadPoolFree(virThreadPoolPtr pool)
 {
-    virThreadPoolJobPtr job;
+    size_t i;
 
     if (!pool)
         return;
 
     virMutexLock(&pool->mutex);
+    virMutexLock(&pool->sched);
     pool->quit = true;
-    if (pool->nWorkers > 0) {
-        virCondBroadcast(&pool->cond);
-        ignore_value(virCondWait(&pool->quit_cond, &pool->mutex));
+    virMutexUnlock(&pool->sched);
+    for (i = 0 ; i < pool->maxWorkers ; i++) {
+        virThreadPoolWorkerPtr worker = &pool->workers[i];
+
+        virMutexLock(&worker->lock);
+        worker->quit = true;
+        virCondSignal(&worker->cond);
+        virMutexUnlock(&worker->lock);
     }
+    while (pool->nWorkers > 0) {
+        if (virCondWait(&pool->quit_cond, &pool->mutex) < 0)
+            break;
+    }
+    virMutexUnlock(&pool->mutex);
 
-    while ((job = pool->jobList.head)) {
-        pool->jobList.head = pool->jobList.head->next;
-        VIR_FREE(job);
+    /* Each worker ran its queue dry before exiting, and no more
+     * jobs can be queued with pool->quit set */
+    for (i = 0 ; i < pool->maxWorkers ; i++) {
+        virThreadPoolWorkerPtr worker = &pool->workers[i];
+
+        virMutexDestroy(&worker->lock);
+        ignore_value(virCondDestroy(&worker->cond));
     }
 
     VIR_FREE(pool->workers);
-    virMutexUnlock(&pool->mutex);
+    VIR_FREE(pool->idle);
+    VIR_FREE(pool->active);
+    virMutexDestroy(&pool->sched);
     virMutexDestroy(&pool->mutex);
     ignore_value(virCondDestroy(&pool->quit_cond));
-    ignore_value(virCondDestroy(&pool->cond));
     VIR_FREE(pool);
 }
 
-int virThreadPoolSendJob(virThreadPoolPtr pool,
-                         void *jobData)
+/*
+ * Queue 'job' on 'worker'. Returns false if the worker has
+ * stopped taking jobs because its thread is on the way out.
+ */
+static bool virThreadPoolWorkerQueue(virThreadPoolWorkerPtr worker,
+                                     virThreadPoolJobPtr job)
 {
-    virThreadPoolJobPtr job;
+    bool queued = false;
 
-    virMutexLock(&pool->mutex);
-    if (pool->quit)
-        goto error;
+    virMutexLock(&worker->lock);
+    if (worker->accepting) {
+        virThreadPoolWorkerPush(worker, job);
+        virCondSignal(&worker->cond);
+        queued = true;
+    }
+    virMutexUnlock(&worker->lock);
 
-    if (pool->freeWorkers == 0 &&
-        pool->nWorkers < pool->maxWorkers) {
-        if (VIR_EXPAND_N(pool->workers, pool->nWorkers, 1) < 0) {
-            virReportOOMError();
-            goto error;
-        }
+    return queued;
+}
 
-        if (virThreadCreate(&pool->workers[pool->nWorkers - 1],
-                            true,
-                            virThreadPoolWorker,
-                            pool) < 0) {
-            pool->nWorkers--;
-            goto error;
+/*
+ * Wake an idle worker, so that it steals whatever was last queued.
+ * Returns true if such a worker was found.
+ */
+static bool virThreadPoolWakeIdle(virThreadPoolPtr pool)
+{
+    for (;;) {
+        virThreadPoolWorkerPtr worker;
+        bool woken = false;
+
+        virMutexLock(&pool->sched);
+        worker = virThreadPoolIdlePop(pool);
+        virMutexUnlock(&pool->sched);
+
+        if (!worker)
+            return false;
+
+        virMutexLock(&worker->lock);
+        if (worker->accepting) {
+            worker->wakeup = true;
+            virCondSignal(&worker->cond);
+            woken = true;
         }
+        virMutexUnlock(&worker->lock);
+
+        if (woken)
+            return true;
     }
+}
+
+int virThreadPoolSendJob(virThreadPoolPtr pool,
+                         void *jobData)
+{
+    virThreadPoolJobPtr job;
+    bool idle;
+    bool grow;
 
     if (VIR_ALLOC(job) < 0) {
         virReportOOMError();
-        goto error;
+        return -1;
     }
 
     job->data = jobData;
-    job->next = NULL;
-    *pool->jobList.tail = job;
-    pool->jobList.tail = &(*pool->jobList.tail)->next;
+    job->queued = virThreadPoolTimeUs();
+
+    for (;;) {
+        virThreadPoolWorkerPtr worker = NULL;
+        int rc;
+
+        /* Best case, someone is waiting for work, else queue
+         * it behind whatever a running worker is doing */
+        virMutexLock(&pool->sched);
+        if (pool->quit) {
+            virMutexUnlock(&pool->sched);
+            VIR_FREE(job);
+            return -1;
+        }
+        idle = false;
+        if ((worker = virThreadPoolIdlePop(pool))) {
+            idle = true;
+        } else if (pool->nActive) {
+            worker = pool->active[pool->next++ % pool->nActive];
+        }
+        grow = pool->nActive < pool->maxWorkers;
+        virMutexUnlock(&pool->sched);
+
+        if (worker) {
+            if (virThreadPoolWorkerQueue(worker, job))
+                break;
+            /* It is exiting, so pick another */
+            continue;
+        }
 
-    virCondSignal(&pool->cond);
-    virMutexUnlock(&pool->mutex);
+        /* No workers at all, so start one to run the job */
+        if ((rc = virThreadPoolGrow(pool, job)) < 0) {
+            VIR_FREE(job);
+            return -1;
+        }
+        if (rc > 0)
+            return 0;
+        /* Lost a race with a worker starting or retiring */
+    }
+
+    /* A worker may have gone idle since we looked; if so it will
+     * steal the job, otherwise grow the pool to run it sooner */
+    if (!idle &&
+        !virThreadPoolWakeIdle(pool) &&
+        grow &&
+        virThreadPoolGrow(pool, NULL) < 0)
+        VIR_WARN0("Unable to grow thread pool, job will be delayed");
 
     return 0;
+}
 
-error:
+void virThreadPoolGetStats(virThreadPoolPtr pool,
+                           virThreadPoolStatsPtr stats)
+{
+    size_t i;
+    size_t nrunning = 0;
+
+    memset(stats, 0, sizeof(*stats));
+
+    virMutexLock(&pool->mutex);
+    stats->minWorkers = pool->minWorkers;
+    stats->maxWorkers = pool->maxWorkers;
+    stats->nWorkers = pool->nWorkers;
+
+    for (i = 0 ; i < pool->maxWorkers ; i++) {
+        virThreadPoolWorkerPtr worker = &pool->workers[i];
+
+        virMutexLock(&worker->lock);
+        if (worker->running) {
+            stats->waitAvg += worker->waitAvg;
+            nrunning++;
+        }
+        stats->nQueued += worker->njobs;
+        stats->nJobs += worker->jobsDone;
+        stats->nSteals += worker->steals;
+        if (worker->waitMax > stats->waitMax)
+            stats->waitMax = worker->waitMax;
+        virMutexUnlock(&worker->lock);
+    }
+
+    virMutexLock(&pool->sched);
+    stats->nIdle = pool->nIdle;
+    virMutexUnlock(&pool->sched);
     virMutexUnlock(&pool->mutex);
-    return -1;
+
+    if (nrunning)
+        stats->waitAvg /= nrunning;
+    stats->nActive = stats->nWorkers - stats->nIdle;
 }
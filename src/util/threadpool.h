@@ -33,6 +33,23 @@ typedef virThreadPool *virThreadPoolPtr;
 
 typedef void (*virThreadPoolJobFunc)(void *jobdata, void *opaque);
 
+typedef struct _virThreadPoolStats virThreadPoolStats;
+typedef virThreadPoolStats *virThreadPoolStatsPtr;
+
+struct _virThreadPoolStats {
+    size_t minWorkers;
+    size_t maxWorkers;
+    size_t nWorkers;        /* Threads currently running */
+    size_t nIdle;           /* ... of which waiting for a job */
+    size_t nActive;         /* ... of which running a job */
+    size_t nQueued;         /* Jobs waiting for a worker */
+
+    unsigned long long nJobs;    /* Jobs completed */
+    unsigned long long nSteals;  /* ... of which taken from another worker */
+    unsigned long long waitAvg;  /* Recent queueing latency, microseconds */
+    unsigned long long waitMax;  /* Worst queueing latency, microseconds */
+};
+
 virThreadPoolPtr virThreadPoolNew(size_t minWorkers,
                                   size_t maxWorkers,
                                   virThreadPoolJobFunc func,
@@ -44,4 +61,8 @@ int virThreadPoolSendJob(virThreadPoolPtr pool,
                          void *jobdata) ATTRIBUTE_NONNULL(1)
                                         ATTRIBUTE_RETURN_CHECK;
 
+void virThreadPoolGetStats(virThreadPoolPtr pool,
+                           virThreadPoolStatsPtr stats)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
+
 #endif
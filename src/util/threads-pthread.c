@@ -41,6 +41,20 @@ void virThreadOnExit(void)
 }
 
 
+int virOnce(virOnceControlPtr once, virOnceFunc init)
+{
+    int ret;
+
+    ret = pthread_once(&once->once, init);
+    if (ret != 0) {
+        errno = ret;
+        return -1;
+    }
+
+    return 0;
+}
+
+
 int virMutexInit(virMutexPtr m)
 {
     int ret;
@@ -122,7 +136,7 @@ int virCondWaitUntil(virCondPtr c, virMutexPtr m, unsigned long long whenms)
     struct timespec ts;
 
     ts.tv_sec = whenms / 1000;
-    ts.tv_nsec = (whenms % 1000) * 1000;
+    ts.tv_nsec = (whenms % 1000) * 1000 * 1000;
 
     if ((ret = pthread_cond_timedwait(&c->cond, &m->lock, &ts)) != 0) {
         errno = ret;
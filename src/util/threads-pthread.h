@@ -38,3 +38,12 @@ struct virThread {
 struct virThreadLocal {
     pthread_key_t key;
 };
+
+struct virOnceControl {
+    pthread_once_t once;
+};
+
+#define VIR_ONCE_CONTROL_INITIALIZER \
+{                                    \
+    .once = PTHREAD_ONCE_INIT        \
+}
@@ -70,6 +70,26 @@ void virThreadOnExit(void)
 }
 
 
+int virOnce(virOnceControlPtr once, virOnceFunc init)
+{
+    if (!once->complete) {
+        if (InterlockedIncrement(&once->init) == 1) {
+            /* We're the first thread */
+            init();
+            once->complete = 1;
+        } else {
+            /* Someone else is running it; undo our increment, so
+             * the counter cannot wrap, and wait for them to finish */
+            InterlockedDecrement(&once->init);
+            while (!once->complete)
+                Sleep(0);
+        }
+    }
+
+    return 0;
+}
+
+
 int virMutexInit(virMutexPtr m)
 {
     return virMutexInitRecursive(m);
@@ -41,3 +41,14 @@ struct virThread {
 struct virThreadLocal {
     DWORD key;
 };
+
+struct virOnceControl {
+    volatile long init;         /* Threads which got to run it */
+    volatile long complete;
+};
+
+#define VIR_ONCE_CONTROL_INITIALIZER \
+{                                    \
+    .init = 0,                       \
+    .complete = 0                    \
+}
@@ -36,10 +36,22 @@ typedef virThreadLocal *virThreadLocalPtr;
 typedef struct virThread virThread;
 typedef virThread *virThreadPtr;
 
+typedef struct virOnceControl virOnceControl;
+typedef virOnceControl *virOnceControlPtr;
+
+typedef void (*virOnceFunc)(void);
+
 
 int virThreadInitialize(void) ATTRIBUTE_RETURN_CHECK;
 void virThreadOnExit(void);
 
+/* Run @init exactly once, however many threads get here at the same
+ * time; @once must be set to VIR_ONCE_CONTROL_INITIALIZER. This lets
+ * code which has no initialization hook of its own set up a static
+ * mutex, or the like, on first use */
+int virOnce(virOnceControlPtr once, virOnceFunc init)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_RETURN_CHECK;
+
 typedef void (*virThreadFunc)(void *opaque);
 
 int virThreadCreate(virThreadPtr thread,
@@ -144,6 +144,7 @@ vmwareLoadDomains(struct vmware_driver *driver)
     char *str;
     char *saveptr = NULL;
     virCommandPtr cmd;
+    int pid;
 
     ctx.parseFileName = vmwareCopyVMXFileName;
 
@@ -182,7 +183,8 @@ vmwareLoadDomains(struct vmware_driver *driver)
 
         vmwareDomainConfigDisplay(pDomain, vmdef);
 
-        if ((vm->def->id = vmwareExtractPid(vmxPath)) < 0)
+        if ((pid = vmwareExtractPid(vmxPath)) < 0 ||
+            virDomainObjListSetID(&driver->domains, vm, pid) < 0)
             goto cleanup;
         /* vmrun list only reports running vms */
         vm->state = VIR_DOMAIN_RUNNING;
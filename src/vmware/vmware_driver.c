@@ -192,7 +192,7 @@ vmwareStopVM(struct vmware_driver *driver, virDomainObjPtr vm)
         return -1;
     }
 
-    vm->def->id = -1;
+    virDomainObjListClearID(&driver->domains, vm);
     vm->state = VIR_DOMAIN_SHUTOFF;
 
     return 0;
@@ -206,6 +206,7 @@ vmwareStartVM(struct vmware_driver *driver, virDomainObjPtr vm)
         PROGRAM_SENTINAL, PROGRAM_SENTINAL, NULL
     };
     const char *vmxPath = ((vmwareDomainPtr) vm->privateData)->vmxPath;
+    int pid;
 
     if (vm->state != VIR_DOMAIN_SHUTOFF) {
         vmwareError(VIR_ERR_OPERATION_INVALID, "%s",
@@ -224,7 +225,8 @@ vmwareStartVM(struct vmware_driver *driver, virDomainObjPtr vm)
         return -1;
     }
 
-    if ((vm->def->id = vmwareExtractPid(vmxPath)) < 0) {
+    if ((pid = vmwareExtractPid(vmxPath)) < 0 ||
+        virDomainObjListSetID(&driver->domains, vm, pid) < 0) {
         vmwareStopVM(driver, vm);
         return -1;
     }
@@ -1007,6 +1009,7 @@ static virDriver vmwareDriver = {
     NULL,                       /* domainSnapshotDelete */
     NULL,                       /* qemuDomainMonitorCommand */
     NULL,                       /* domainOpenConsole */
+    NULL,                       /* connectGetAllDomainStats */
 };
 
 int
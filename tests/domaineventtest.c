@@ -0,0 +1,587 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "internal.h"
+#include "testutils.h"
+#include "datatypes.h"
+#include "domain_event.h"
+#include "threads.h"
+#include "memory.h"
+#include "util.h"
+#include "ignore-value.h"
+
+static const unsigned char testUUIDs[3][VIR_UUID_BUFLEN] = {
+    { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 1 },
+    { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 2 },
+    { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 3 },
+};
+static const char *testNames[3] = { "one", "two", "three" };
+
+static virMutex testLock;
+static virCond testCond;
+
+/* What one registered callback has been given */
+struct testCallback {
+    size_t count;           /* Calls started */
+    size_t finished;        /* Calls returned */
+    bool hold;              /* Calls block until this is cleared */
+    bool freed;             /* The freecb has run */
+    size_t finishedAtFree;  /* Calls returned when it ran */
+    int lastEvent;
+    int lastDetail;
+    int lastDomain;
+    long long lastOffset;
+};
+
+static int
+testDomainIndex(virDomainPtr dom)
+{
+    int i;
+
+    for (i = 0 ; i < ARRAY_CARDINALITY(testUUIDs) ; i++) {
+        if (memcmp(dom->uuid, testUUIDs[i], VIR_UUID_BUFLEN) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static int
+testLifecycle(virConnectPtr conn ATTRIBUTE_UNUSED,
+              virDomainPtr dom,
+              int event,
+              int detail,
+              void *opaque)
+{
+    struct testCallback *cb = opaque;
+
+    virMutexLock(&testLock);
+    cb->count++;
+    cb->lastEvent = event;
+    cb->lastDetail = detail;
+    cb->lastDomain = testDomainIndex(dom);
+    virCondBroadcast(&testCond);
+    while (cb->hold)
+        ignore_value(virCondWait(&testCond, &testLock));
+    cb->finished++;
+    virCondBroadcast(&testCond);
+    virMutexUnlock(&testLock);
+
+    return 0;
+}
+
+static void
+testRTCChange(virConnectPtr conn ATTRIBUTE_UNUSED,
+              virDomainPtr dom,
+              long long offset,
+              void *opaque)
+{
+    struct testCallback *cb = opaque;
+
+    virMutexLock(&testLock);
+    cb->count++;
+    cb->finished++;
+    cb->lastOffset = offset;
+    cb->lastDomain = testDomainIndex(dom);
+    virCondBroadcast(&testCond);
+    virMutexUnlock(&testLock);
+}
+
+static void
+testFree(void *opaque)
+{
+    struct testCallback *cb = opaque;
+
+    virMutexLock(&testLock);
+    cb->freed = true;
+    cb->finishedAtFree = cb->finished;
+    virCondBroadcast(&testCond);
+    virMutexUnlock(&testLock);
+}
+
+/* Wait until @cb has seen @count calls, or has been freed if @count
+ * is 0, or give up after 30s */
+static int
+testWait(struct testCallback *cb, size_t count)
+{
+    struct timeval now;
+    unsigned long long until;
+    int ret = 0;
+
+    if (gettimeofday(&now, NULL) < 0)
+        return -1;
+    until = (now.tv_sec * 1000ull) + (now.tv_usec / 1000) + 30 * 1000;
+
+    virMutexLock(&testLock);
+    while (count ? cb->count < count : !cb->freed) {
+        if (virCondWaitUntil(&testCond, &testLock, until) < 0) {
+            if (virTestGetDebug() && count)
+                fprintf(stderr, "Only %zu of %zu events arrived\n",
+                        cb->count, count);
+            else if (virTestGetDebug())
+                fprintf(stderr, "Callback was never freed\n");
+            ret = -1;
+            break;
+        }
+    }
+    virMutexUnlock(&testLock);
+
+    return ret;
+}
+
+static void
+testRelease(struct testCallback *cb)
+{
+    virMutexLock(&testLock);
+    cb->hold = false;
+    virCondBroadcast(&testCond);
+    virMutexUnlock(&testLock);
+}
+
+static void
+testQueueLifecycle(virDomainEventDispatcherPtr dispatcher,
+                   int domain, int event, int detail)
+{
+    virDomainEventDispatcherQueue(dispatcher,
+                                  virDomainEventNew(domain + 1,
+                                                    testNames[domain],
+                                                    testUUIDs[domain],
+                                                    event, detail));
+}
+
+static int
+testAddLifecycle(virDomainEventDispatcherPtr dispatcher,
+                 virConnectPtr conn,
+                 int domain,
+                 struct testCallback *cb)
+{
+    virDomainPtr dom = NULL;
+    int ret;
+
+    if (domain >= 0 &&
+        !(dom = virGetDomain(conn, testNames[domain], testUUIDs[domain])))
+        return -1;
+
+    ret = virDomainEventDispatcherAddID(dispatcher, conn, dom,
+                                        VIR_DOMAIN_EVENT_ID_LIFECYCLE,
+                                        VIR_DOMAIN_EVENT_CALLBACK(testLifecycle),
+                                        cb, NULL);
+    if (dom)
+        virDomainFree(dom);
+    return ret;
+}
+
+/* Events reach the callbacks for all domains, and those for the
+ * event's own domain, and no others */
+static int
+testRouting(const void *data)
+{
+    virConnectPtr conn = (virConnectPtr)data;
+    virConnectPtr conn1 = NULL;
+    virConnectPtr conn2 = NULL;
+    virDomainEventDispatcherPtr dispatcher;
+    struct testCallback all, one, two;
+    int ret = -1;
+
+    memset(&all, 0, sizeof(all));
+    memset(&one, 0, sizeof(one));
+    memset(&two, 0, sizeof(two));
+
+    if (!(dispatcher = virDomainEventDispatcherNew(NULL, NULL)))
+        return -1;
+
+    /* A connection may only register a lifecycle callback once */
+    if (!(conn1 = virGetConnect()) ||
+        !(conn2 = virGetConnect()))
+        goto cleanup;
+
+    if (testAddLifecycle(dispatcher, conn, -1, &all) < 0 ||
+        testAddLifecycle(dispatcher, conn1, 0, &one) < 0 ||
+        testAddLifecycle(dispatcher, conn2, 1, &two) < 0)
+        goto cleanup;
+
+    testQueueLifecycle(dispatcher, 0, VIR_DOMAIN_EVENT_STARTED, 0);
+    testQueueLifecycle(dispatcher, 1, VIR_DOMAIN_EVENT_STARTED, 0);
+    testQueueLifecycle(dispatcher, 2, VIR_DOMAIN_EVENT_STARTED, 0);
+
+    /* Each callback sees its own events in order, so once these
+     * arrive there is nothing else on the way */
+    testQueueLifecycle(dispatcher, 0, VIR_DOMAIN_EVENT_STOPPED, 0);
+    testQueueLifecycle(dispatcher, 1, VIR_DOMAIN_EVENT_STOPPED, 0);
+
+    if (testWait(&all, 5) < 0 ||
+        testWait(&one, 2) < 0 ||
+        testWait(&two, 2) < 0)
+        goto cleanup;
+
+    if (all.count != 5 || one.count != 2 || two.count != 2 ||
+        one.lastDomain != 0 || two.lastDomain != 1 ||
+        one.lastEvent != VIR_DOMAIN_EVENT_STOPPED) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Got %zu, %zu and %zu events\n",
+                    all.count, one.count, two.count);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virDomainEventDispatcherRemoveConn(dispatcher, conn);
+    if (conn1) {
+        virDomainEventDispatcherRemoveConn(dispatcher, conn1);
+        virUnrefConnect(conn1);
+    }
+    if (conn2) {
+        virDomainEventDispatcherRemoveConn(dispatcher, conn2);
+        virUnrefConnect(conn2);
+    }
+    virDomainEventDispatcherFree(dispatcher);
+    return ret;
+}
+
+/* Events piling up behind a slow callback are merged where the
+ * later ones make the earlier ones redundant */
+static int
+testCoalesce(const void *data)
+{
+    virConnectPtr conn = (virConnectPtr)data;
+    virDomainEventDispatcherPtr dispatcher;
+    struct testCallback life, rtc;
+    virDomainPtr dom;
+    int i;
+    int ret = -1;
+
+    memset(&life, 0, sizeof(life));
+    memset(&rtc, 0, sizeof(rtc));
+    life.hold = true;
+
+    if (!(dom = virGetDomain(conn, testNames[0], testUUIDs[0])))
+        return -1;
+
+    if (!(dispatcher = virDomainEventDispatcherNew(NULL, NULL))) {
+        virDomainFree(dom);
+        return -1;
+    }
+
+    if (testAddLifecycle(dispatcher, conn, -1, &life) < 0 ||
+        virDomainEventDispatcherAddID(dispatcher, conn, NULL,
+                                      VIR_DOMAIN_EVENT_ID_RTC_CHANGE,
+                                      VIR_DOMAIN_EVENT_CALLBACK(testRTCChange),
+                                      &rtc, NULL) < 0)
+        goto cleanup;
+
+    testQueueLifecycle(dispatcher, 0, VIR_DOMAIN_EVENT_STARTED, 0);
+    if (testWait(&life, 1) < 0)
+        goto cleanup;
+
+    /* The dispatcher is now stuck in the first callback */
+    for (i = 0 ; i < 5 ; i++)
+        testQueueLifecycle(dispatcher, 0, VIR_DOMAIN_EVENT_SUSPENDED, 0);
+    testQueueLifecycle(dispatcher, 1, VIR_DOMAIN_EVENT_SUSPENDED, 0);
+    testQueueLifecycle(dispatcher, 0, VIR_DOMAIN_EVENT_RESUMED, 0);
+    testQueueLifecycle(dispatcher, 0, VIR_DOMAIN_EVENT_SUSPENDED, 0);
+    for (i = 1 ; i <= 5 ; i++)
+        virDomainEventDispatcherQueue(dispatcher,
+                                      virDomainEventRTCChangeNewFromDom(dom, i));
+
+    testRelease(&life);
+    testQueueLifecycle(dispatcher, 0, VIR_DOMAIN_EVENT_STOPPED, 0);
+
+    if (testWait(&life, 6) < 0 ||
+        testWait(&rtc, 1) < 0)
+        goto cleanup;
+
+    if (life.count != 6 || rtc.count != 1 || rtc.lastOffset != 5) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Got %zu lifecycle and %zu RTC events, "
+                    "last offset %lld\n",
+                    life.count, rtc.count, rtc.lastOffset);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    testRelease(&life);
+    virDomainEventDispatcherFree(dispatcher);
+    virDomainFree(dom);
+    return ret;
+}
+
+/* A callback which does not keep up only has so many events
+ * held back for it */
+static int
+testBound(const void *data)
+{
+    virConnectPtr conn = (virConnectPtr)data;
+    virDomainEventDispatcherPtr dispatcher;
+    struct testCallback life;
+    int i;
+    int ret = -1;
+
+    memset(&life, 0, sizeof(life));
+    life.hold = true;
+
+    if (!(dispatcher = virDomainEventDispatcherNew(NULL, NULL)))
+        return -1;
+
+    if (testAddLifecycle(dispatcher, conn, -1, &life) < 0)
+        goto cleanup;
+
+    testQueueLifecycle(dispatcher, 0, VIR_DOMAIN_EVENT_STARTED, 0);
+    if (testWait(&life, 1) < 0)
+        goto cleanup;
+
+    /* Alternate, so that nothing can be merged */
+    for (i = 0 ; i < VIR_DOMAIN_EVENT_PENDING_MAX * 4 ; i++)
+        testQueueLifecycle(dispatcher, 0,
+                           i % 2 ? VIR_DOMAIN_EVENT_STARTED
+                                 : VIR_DOMAIN_EVENT_STOPPED, i);
+
+    testRelease(&life);
+
+    if (testWait(&life, VIR_DOMAIN_EVENT_PENDING_MAX + 1) < 0)
+        goto cleanup;
+
+    /* The newest events are the ones kept */
+    if (life.count != VIR_DOMAIN_EVENT_PENDING_MAX + 1 ||
+        life.lastDetail != VIR_DOMAIN_EVENT_PENDING_MAX * 4 - 1) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Got %zu events, last detail %d\n",
+                    life.count, life.lastDetail);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    testRelease(&life);
+    virDomainEventDispatcherFree(dispatcher);
+    return ret;
+}
+
+/* Removing a running callback does not wait for it to return, since
+ * it may need a lock the caller holds. Its freecb runs once it has
+ * returned, and it is not run again */
+static int
+testRemove(const void *data)
+{
+    virConnectPtr conn = (virConnectPtr)data;
+    virDomainEventDispatcherPtr dispatcher;
+    struct testCallback life;
+    int callbackID;
+    bool freed;
+    int ret = -1;
+
+    memset(&life, 0, sizeof(life));
+    life.hold = true;
+
+    if (!(dispatcher = virDomainEventDispatcherNew(NULL, NULL)))
+        return -1;
+
+    if ((callbackID =
+         virDomainEventDispatcherAddID(dispatcher, conn, NULL,
+                                       VIR_DOMAIN_EVENT_ID_LIFECYCLE,
+                                       VIR_DOMAIN_EVENT_CALLBACK(testLifecycle),
+                                       &life, testFree)) < 0)
+        goto cleanup;
+
+    testQueueLifecycle(dispatcher, 0, VIR_DOMAIN_EVENT_STARTED, 0);
+    testQueueLifecycle(dispatcher, 0, VIR_DOMAIN_EVENT_STOPPED, 0);
+    if (testWait(&life, 1) < 0)
+        goto cleanup;
+
+    /* The callback is still held, so this would hang if it waited */
+    if (virDomainEventDispatcherRemoveID(dispatcher, conn, callbackID) < 0)
+        goto cleanup;
+
+    virMutexLock(&testLock);
+    freed = life.freed;
+    virMutexUnlock(&testLock);
+    if (freed) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Callback freed while running\n");
+        goto cleanup;
+    }
+
+    if (virDomainEventDispatcherRemoveID(dispatcher, conn, callbackID) == 0) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Callback removed twice\n");
+        goto cleanup;
+    }
+
+    testRelease(&life);
+    if (testWait(&life, 0) < 0)
+        goto cleanup;
+
+    testQueueLifecycle(dispatcher, 0, VIR_DOMAIN_EVENT_STARTED, 0);
+    virDomainEventDispatcherFree(dispatcher);
+    dispatcher = NULL;
+
+    if (life.finishedAtFree != 1 || life.count != 1) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Callback ran %zu times, %zu before its free\n",
+                    life.count, life.finishedAtFree);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    testRelease(&life);
+    virDomainEventDispatcherFree(dispatcher);
+    return ret;
+}
+
+#ifdef TEST_BENCH
+/*
+ * Cost of queueing events with many subscribers, each watching a
+ * domain of its own. Every event matches a single callback, so with
+ * callbacks indexed by UUID the time per batch should not grow with
+ * the number of subscribers.
+ */
+# define BENCH_EVENTS 1000
+
+struct benchInfo {
+    virDomainEventDispatcherPtr dispatcher;
+    int nsubscribers;
+    unsigned char (*uuids)[VIR_UUID_BUFLEN];
+    struct testCallback cb;
+};
+
+static void
+benchUUID(unsigned char *uuid, int n)
+{
+    memset(uuid, 0, VIR_UUID_BUFLEN);
+    memcpy(uuid, &n, sizeof(n));
+}
+
+static int
+benchQueue(const void *data)
+{
+    struct benchInfo *info = (struct benchInfo *)data;
+    size_t want;
+    int i;
+
+    virMutexLock(&testLock);
+    want = info->cb.count + BENCH_EVENTS;
+    virMutexUnlock(&testLock);
+
+    /* Vary the detail so that nothing gets merged */
+    for (i = 0 ; i < BENCH_EVENTS ; i++) {
+        int n = (i * 7919) % info->nsubscribers;
+
+        virDomainEventDispatcherQueue(info->dispatcher,
+                                      virDomainEventNew(n + 1, "bench",
+                                                        info->uuids[n],
+                                                        VIR_DOMAIN_EVENT_STARTED,
+                                                        i));
+    }
+
+    return testWait(&info->cb, want);
+}
+
+static int
+benchDispatch(int nsubscribers)
+{
+    struct benchInfo info;
+    virConnectPtr *conns = NULL;
+    char *title = NULL;
+    int i;
+    int ret = -1;
+
+    memset(&info, 0, sizeof(info));
+    info.nsubscribers = nsubscribers;
+
+    if (!(info.dispatcher = virDomainEventDispatcherNew(NULL, NULL)))
+        return -1;
+
+    if (VIR_ALLOC_N(conns, nsubscribers) < 0 ||
+        VIR_ALLOC_N(info.uuids, nsubscribers) < 0)
+        goto cleanup;
+
+    /* A connection only gets one lifecycle callback */
+    for (i = 0 ; i < nsubscribers ; i++) {
+        virDomainPtr dom;
+        int rc;
+
+        benchUUID(info.uuids[i], i);
+        if (!(conns[i] = virGetConnect()) ||
+            !(dom = virGetDomain(conns[i], "bench", info.uuids[i])))
+            goto cleanup;
+
+        rc = virDomainEventDispatcherAddID(info.dispatcher, conns[i], dom,
+                                           VIR_DOMAIN_EVENT_ID_LIFECYCLE,
+                                           VIR_DOMAIN_EVENT_CALLBACK(testLifecycle),
+                                           &info.cb, NULL);
+        virDomainFree(dom);
+        if (rc < 0)
+            goto cleanup;
+    }
+
+    if (virAsprintf(&title, "Domain events queueing, %d subscribers",
+                    nsubscribers) < 0)
+        goto cleanup;
+
+    ret = virtTestRun(title, 10, benchQueue, &info);
+
+cleanup:
+    for (i = 0 ; conns && i < nsubscribers ; i++) {
+        if (conns[i]) {
+            virDomainEventDispatcherRemoveConn(info.dispatcher, conns[i]);
+            virUnrefConnect(conns[i]);
+        }
+    }
+    virDomainEventDispatcherFree(info.dispatcher);
+    VIR_FREE(conns);
+    VIR_FREE(info.uuids);
+    VIR_FREE(title);
+    return ret;
+}
+#endif /* TEST_BENCH */
+
+static int
+mymain(int argc ATTRIBUTE_UNUSED,
+       char **argv ATTRIBUTE_UNUSED)
+{
+#ifdef TEST_BENCH
+    static const int sizes[] = { 10, 100, 1000 };
+    int i;
+#endif
+    virConnectPtr conn;
+    int ret = 0;
+
+    if (virThreadInitialize() < 0 ||
+        virMutexInit(&testLock) < 0 ||
+        virCondInit(&testCond) < 0)
+        return EXIT_FAILURE;
+
+    if (!(conn = virGetConnect()))
+        return EXIT_FAILURE;
+
+    if (virtTestRun("Domain events routing", 1, testRouting, conn) < 0)
+        ret = -1;
+    if (virtTestRun("Domain events coalescing", 1, testCoalesce, conn) < 0)
+        ret = -1;
+    if (virtTestRun("Domain events bound", 1, testBound, conn) < 0)
+        ret = -1;
+    if (virtTestRun("Domain events removal", 1, testRemove, conn) < 0)
+        ret = -1;
+
+#ifdef TEST_BENCH
+    /* Set VIR_TEST_VERBOSE=1 for timings */
+    for (i = 0 ; i < ARRAY_CARDINALITY(sizes) ; i++) {
+        if (benchDispatch(sizes[i]) < 0)
+            ret = -1;
+    }
+#endif
+
+    virUnrefConnect(conn);
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+VIRT_TEST_MAIN(mymain)
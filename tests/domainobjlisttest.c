@@ -0,0 +1,566 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "internal.h"
+#include "testutils.h"
+#include "domain_conf.h"
+#include "capabilities.h"
+#include "memory.h"
+#include "util.h"
+#include "threads.h"
+#include "ignore-value.h"
+
+#define LOOKUPS_PER_RUN 1000
+#ifdef TEST_BENCH
+# define LOOKUP_REPEAT 10
+#else
+# define LOOKUP_REPEAT 1
+#endif
+#define LOOKUP_THREADS 4
+
+static virCapsPtr caps;
+
+struct testInfo {
+    virDomainObjListPtr doms;
+    int ndoms;
+};
+
+static virDomainObjPtr
+testAddDomain(virDomainObjListPtr doms, int n)
+{
+    virDomainDefPtr def;
+    virDomainObjPtr obj;
+
+    if (VIR_ALLOC(def) < 0)
+        return NULL;
+
+    if (virAsprintf(&def->name, "dom%d", n) < 0) {
+        VIR_FREE(def);
+        return NULL;
+    }
+    def->id = -1;
+    memcpy(def->uuid, &n, sizeof(n));
+
+    if (!(obj = virDomainAssignDef(caps, doms, def, false))) {
+        virDomainDefFree(def);
+        return NULL;
+    }
+
+    return obj;
+}
+
+static int
+testFillList(virDomainObjListPtr doms, int ndoms)
+{
+    int i;
+
+    if (virDomainObjListInit(doms) < 0)
+        return -1;
+
+    for (i = 0 ; i < ndoms ; i++) {
+        virDomainObjPtr obj;
+
+        if (!(obj = testAddDomain(doms, i)))
+            return -1;
+
+        /* Every other domain is running */
+        if ((i % 2) == 0 &&
+            virDomainObjListSetID(doms, obj, i + 1) < 0) {
+            virDomainObjUnlock(obj);
+            return -1;
+        }
+        virDomainObjUnlock(obj);
+    }
+
+    return 0;
+}
+
+static int
+testLookupName(const void *data)
+{
+    const struct testInfo *info = data;
+    char name[32];
+    int i;
+
+    for (i = 0 ; i < LOOKUPS_PER_RUN ; i++) {
+        virDomainObjPtr obj;
+        int n = (i * 7919) % info->ndoms;
+
+        snprintf(name, sizeof(name), "dom%d", n);
+        if (!(obj = virDomainFindByName(info->doms, name)))
+            return -1;
+        if (STRNEQ(obj->def->name, name)) {
+            virDomainObjUnlock(obj);
+            return -1;
+        }
+        virDomainObjUnlock(obj);
+    }
+
+    return 0;
+}
+
+static int
+testLookupID(const void *data)
+{
+    const struct testInfo *info = data;
+    int i;
+
+    for (i = 0 ; i < LOOKUPS_PER_RUN ; i++) {
+        virDomainObjPtr obj;
+        int n = (i * 7919) % info->ndoms;
+
+        obj = virDomainFindByID(info->doms, n + 1);
+        if ((n % 2) == 0) {
+            if (!obj || obj->def->id != n + 1) {
+                if (obj)
+                    virDomainObjUnlock(obj);
+                return -1;
+            }
+        } else if (obj) {
+            /* Inactive domains must never be found by id */
+            virDomainObjUnlock(obj);
+            return -1;
+        }
+        if (obj)
+            virDomainObjUnlock(obj);
+    }
+
+    return 0;
+}
+
+/* Check the indexes follow a domain through start, stop and undefine */
+static int
+testLifecycle(const void *data ATTRIBUTE_UNUSED)
+{
+    virDomainObjList doms;
+    virDomainObjPtr obj;
+    int ret = -1;
+
+    if (testFillList(&doms, 10) < 0)
+        goto cleanup;
+
+    if (!(obj = virDomainFindByName(&doms, "dom1")))
+        goto cleanup;
+    if (virDomainObjListSetID(&doms, obj, 42) < 0) {
+        virDomainObjUnlock(obj);
+        goto cleanup;
+    }
+    virDomainObjUnlock(obj);
+
+    if (!(obj = virDomainFindByID(&doms, 42)))
+        goto cleanup;
+    if (STRNEQ(obj->def->name, "dom1")) {
+        virDomainObjUnlock(obj);
+        goto cleanup;
+    }
+    virDomainObjListClearID(&doms, obj);
+    virDomainObjUnlock(obj);
+
+    if ((obj = virDomainFindByID(&doms, 42))) {
+        virDomainObjUnlock(obj);
+        goto cleanup;
+    }
+
+    if (!(obj = virDomainFindByName(&doms, "dom1")))
+        goto cleanup;
+    virDomainRemoveInactive(&doms, obj);
+
+    if ((obj = virDomainFindByName(&doms, "dom1"))) {
+        virDomainObjUnlock(obj);
+        goto cleanup;
+    }
+
+    if (virDomainObjListNumOfDomains(&doms, 0) != 4 ||
+        virDomainObjListNumOfDomains(&doms, 1) != 5)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    virDomainObjListDeinit(&doms);
+    return ret;
+}
+
+struct testForEachData {
+    virDomainObjListPtr doms;
+    int visited;
+    bool failed;
+};
+
+static void
+testForEachStart(void *payload,
+                 const void *name ATTRIBUTE_UNUSED,
+                 void *opaque)
+{
+    virDomainObjPtr obj = payload;
+    struct testForEachData *data = opaque;
+
+    virDomainObjLock(obj);
+    data->visited++;
+
+    /* As a driver reconnecting to its domains would: start some, and
+     * drop others, which calls back into the list being walked */
+    if (STREQ(obj->def->name, "dom3")) {
+        virDomainRemoveInactive(data->doms, obj);
+        return;
+    }
+    if (!virDomainObjIsActive(obj) &&
+        virDomainObjListSetID(data->doms, obj, 100 + data->visited) < 0)
+        data->failed = true;
+    virDomainObjUnlock(obj);
+}
+
+/* Check the callback of a walk may use the list it is walking */
+static int
+testForEach(const void *data ATTRIBUTE_UNUSED)
+{
+    virDomainObjList doms;
+    struct testForEachData fe = { &doms, 0, false };
+    virDomainObjPtr obj;
+    int ret = -1;
+
+    if (testFillList(&doms, 6) < 0)
+        goto cleanup;
+
+    if (virDomainObjListForEach(&doms, testForEachStart, &fe) < 0 ||
+        fe.failed || fe.visited != 6)
+        goto cleanup;
+
+    if ((obj = virDomainFindByName(&doms, "dom3"))) {
+        virDomainObjUnlock(obj);
+        goto cleanup;
+    }
+    if (virDomainObjListNumOfDomains(&doms, 0) != 0 ||
+        virDomainObjListNumOfDomains(&doms, 1) != 5)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    virDomainObjListDeinit(&doms);
+    return ret;
+}
+
+/* Check formatted XML is reused until the domain changes */
+static int
+testXMLCache(const void *data ATTRIBUTE_UNUSED)
+{
+    virDomainObjList doms;
+    virDomainObjPtr obj = NULL;
+    unsigned long long hits, misses, invalidations;
+    char *xml1 = NULL;
+    char *xml2 = NULL;
+    char *xml3 = NULL;
+    int ret = -1;
+
+    if (testFillList(&doms, 2) < 0)
+        goto cleanup;
+
+    if (!(obj = virDomainFindByName(&doms, "dom1")))
+        goto cleanup;
+
+    /* Changing the def without telling the cache leaves the old XML
+     * in place, which shows the second call was served from it */
+    if (!(xml1 = virDomainObjGetXMLDesc(obj, 0)))
+        goto cleanup;
+    obj->def->mem.cur_balloon = obj->def->mem.max_balloon = 4096;
+    if (!(xml2 = virDomainObjGetXMLDesc(obj, 0)) ||
+        STRNEQ(xml1, xml2) ||
+        obj->xmlCacheHits != 1 || obj->xmlCacheMisses != 1)
+        goto cleanup;
+    VIR_FREE(xml2);
+
+    /* Each flag combination has its own entry */
+    if (!(xml2 = virDomainObjGetXMLDesc(obj, VIR_DOMAIN_XML_SECURE)) ||
+        !strstr(xml2, "<currentMemory>4096</currentMemory>") ||
+        obj->xmlCacheMisses != 2)
+        goto cleanup;
+    VIR_FREE(xml2);
+
+    /* Internal flags bypass the cache altogether */
+    if (!(xml2 = virDomainObjGetXMLDesc(obj, VIR_DOMAIN_XML_UPDATE_CPU)) ||
+        !strstr(xml2, "<currentMemory>4096</currentMemory>") ||
+        obj->xmlCacheHits != 1 || obj->xmlCacheMisses != 2)
+        goto cleanup;
+    VIR_FREE(xml2);
+
+    /* Once the driver says so, the change shows up */
+    virDomainObjInvalidateXML(obj);
+    if (obj->xmlCacheInvalidations != 2 ||
+        !(xml2 = virDomainObjGetXMLDesc(obj, 0)) ||
+        STREQ(xml1, xml2) ||
+        !strstr(xml2, "<currentMemory>4096</currentMemory>") ||
+        obj->xmlCacheMisses != 3)
+        goto cleanup;
+
+    /* Starting the domain changes its XML */
+    if (virDomainObjListSetID(&doms, obj, 7) < 0 ||
+        !(xml3 = virDomainObjGetXMLDesc(obj, 0)) ||
+        STREQ(xml2, xml3) ||
+        !strstr(xml3, "id='7'") ||
+        obj->xmlCacheInvalidations != 3 ||
+        obj->xmlCacheMisses != 4)
+        goto cleanup;
+
+    virDomainObjUnlock(obj);
+    obj = NULL;
+
+    if (virDomainObjListGetXMLCacheStats(&doms, &hits, &misses,
+                                         &invalidations) < 0 ||
+        hits != 1 || misses != 4 || invalidations != 3)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    if (obj)
+        virDomainObjUnlock(obj);
+    VIR_FREE(xml1);
+    VIR_FREE(xml2);
+    VIR_FREE(xml3);
+    virDomainObjListDeinit(&doms);
+    return ret;
+}
+
+struct testRaceData {
+    virDomainObjListPtr doms;
+    bool quit;
+    bool failed;
+};
+
+static void
+testRaceLookup(void *opaque)
+{
+    struct testRaceData *data = opaque;
+
+    while (!data->quit) {
+        virDomainObjPtr obj;
+
+        if (!(obj = virDomainFindByName(data->doms, "dom3"))) {
+            data->failed = true;
+            return;
+        }
+        virDomainObjUnlock(obj);
+
+        /* May or may not be running, but must be consistent */
+        if ((obj = virDomainFindByID(data->doms, 42))) {
+            if (STRNEQ(obj->def->name, "dom3"))
+                data->failed = true;
+            virDomainObjUnlock(obj);
+        }
+    }
+}
+
+/* Look domains up from several threads, without any outer lock,
+ * while another thread starts and stops one of them */
+static int
+testRace(const void *data ATTRIBUTE_UNUSED)
+{
+    virDomainObjList doms;
+    struct testRaceData race = { &doms, false, false };
+    virThread threads[LOOKUP_THREADS];
+    int nthreads = 0;
+    int ret = -1;
+    int i;
+
+    if (testFillList(&doms, 10) < 0)
+        goto cleanup;
+
+    for (i = 0 ; i < LOOKUP_THREADS ; i++) {
+        if (virThreadCreate(&threads[i], true, testRaceLookup, &race) < 0)
+            goto cleanup;
+        nthreads++;
+    }
+
+    for (i = 0 ; i < LOOKUPS_PER_RUN ; i++) {
+        virDomainObjPtr obj;
+
+        if (!(obj = virDomainFindByName(&doms, "dom3")))
+            goto cleanup;
+        if (virDomainObjListSetID(&doms, obj, 42) < 0) {
+            virDomainObjUnlock(obj);
+            goto cleanup;
+        }
+        virDomainObjUnlock(obj);
+
+        if (virDomainObjListNumOfDomains(&doms, 1) != 6)
+            goto cleanup;
+
+        if (!(obj = virDomainFindByID(&doms, 42)))
+            goto cleanup;
+        virDomainObjListClearID(&doms, obj);
+        virDomainObjUnlock(obj);
+    }
+
+    ret = 0;
+
+cleanup:
+    race.quit = true;
+    for (i = 0 ; i < nthreads ; i++)
+        virThreadJoin(&threads[i]);
+    if (race.failed)
+        ret = -1;
+    virDomainObjListDeinit(&doms);
+    return ret;
+}
+
+struct testBusyData {
+    virDomainObjListPtr doms;
+    const char *name;
+    virMutex lock;
+    virCond cond;
+    int done;
+};
+
+static void
+testBusyLookup(void *opaque)
+{
+    struct testBusyData *data = opaque;
+    virDomainObjPtr obj;
+
+    if ((obj = virDomainFindByName(data->doms, data->name)))
+        virDomainObjUnlock(obj);
+
+    virMutexLock(&data->lock);
+    data->done++;
+    virCondSignal(&data->cond);
+    virMutexUnlock(&data->lock);
+}
+
+/* A lookup stuck waiting for a busy domain must not hold up
+ * lookups of the other domains */
+static int
+testBusy(const void *data ATTRIBUTE_UNUSED)
+{
+    virDomainObjList doms;
+    struct testBusyData busy = { &doms, "dom0" };
+    struct testBusyData idle = { &doms, "dom1" };
+    virDomainObjPtr obj = NULL;
+    virThread busyThread, idleThread;
+    bool busyStarted = false, idleStarted = false;
+    struct timeval now;
+    unsigned long long until;
+    int ret = -1;
+
+    if (virMutexInit(&idle.lock) < 0 ||
+        virCondInit(&idle.cond) < 0 ||
+        virMutexInit(&busy.lock) < 0 ||
+        virCondInit(&busy.cond) < 0)
+        return -1;
+
+    if (testFillList(&doms, 10) < 0 ||
+        !(obj = virDomainFindByName(&doms, "dom0")))
+        goto cleanup;
+
+    if (virThreadCreate(&busyThread, true, testBusyLookup, &busy) < 0)
+        goto cleanup;
+    busyStarted = true;
+
+    /* Give it time to block on dom0 */
+    usleep(100 * 1000);
+
+    if (virThreadCreate(&idleThread, true, testBusyLookup, &idle) < 0)
+        goto cleanup;
+    idleStarted = true;
+
+    if (gettimeofday(&now, NULL) < 0)
+        goto cleanup;
+    until = (now.tv_sec * 1000ull) + (now.tv_usec / 1000) + 30 * 1000;
+
+    virMutexLock(&idle.lock);
+    while (!idle.done) {
+        if (virCondWaitUntil(&idle.cond, &idle.lock, until) < 0) {
+            if (virTestGetDebug())
+                fprintf(stderr, "Lookup of dom1 stalled behind dom0\n");
+            break;
+        }
+    }
+    if (idle.done)
+        ret = 0;
+    virMutexUnlock(&idle.lock);
+
+    virMutexLock(&busy.lock);
+    if (busy.done)
+        ret = -1;
+    virMutexUnlock(&busy.lock);
+
+cleanup:
+    if (obj)
+        virDomainObjUnlock(obj);
+    if (busyStarted)
+        virThreadJoin(&busyThread);
+    if (idleStarted)
+        virThreadJoin(&idleThread);
+    virDomainObjListDeinit(&doms);
+    ignore_value(virCondDestroy(&busy.cond));
+    virMutexDestroy(&busy.lock);
+    ignore_value(virCondDestroy(&idle.cond));
+    virMutexDestroy(&idle.lock);
+    return ret;
+}
+
+static int
+mymain(int argc ATTRIBUTE_UNUSED,
+       char **argv ATTRIBUTE_UNUSED)
+{
+    int ret = 0;
+#ifdef TEST_BENCH
+    static const int sizes[] = { 10, 100, 1000, 10000 };
+#else
+    static const int sizes[] = { 10 };
+#endif
+    int i;
+
+    if (!(caps = virCapabilitiesNew("x86_64", 0, 0)))
+        return EXIT_FAILURE;
+
+    if (virtTestRun("ObjList lifecycle", 1, testLifecycle, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("ObjList walk", 1, testForEach, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("ObjList concurrent lookup", 1, testRace, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("ObjList XML cache", 1, testXMLCache, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("ObjList busy domain", 1, testBusy, NULL) < 0)
+        ret = -1;
+
+    /* domainobjlistbench reports the average cost per batch of
+     * lookups, which should not grow with the number of domains */
+    for (i = 0 ; i < ARRAY_CARDINALITY(sizes) ; i++) {
+        virDomainObjList doms;
+        struct testInfo info = { &doms, sizes[i] };
+        char *title = NULL;
+
+        if (testFillList(&doms, sizes[i]) < 0) {
+            ret = -1;
+            virDomainObjListDeinit(&doms);
+            continue;
+        }
+
+        if (virAsprintf(&title, "ObjList lookup by name, %d domains",
+                        sizes[i]) < 0 ||
+            virtTestRun(title, LOOKUP_REPEAT, testLookupName, &info) < 0)
+            ret = -1;
+        VIR_FREE(title);
+
+        if (virAsprintf(&title, "ObjList lookup by ID, %d domains",
+                        sizes[i]) < 0 ||
+            virtTestRun(title, LOOKUP_REPEAT, testLookupID, &info) < 0)
+            ret = -1;
+        VIR_FREE(title);
+
+        virDomainObjListDeinit(&doms);
+    }
+
+    virCapabilitiesFree(caps);
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -25,6 +25,11 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <time.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#ifdef TEST_BENCH
+# include <sys/resource.h>
+#endif
 
 #include "testutils.h"
 #include "internal.h"
@@ -33,10 +38,46 @@
 #include "util.h"
 #include "event.h"
 #include "event_poll.h"
+#include "event_epoll.h"
+#include "memory.h"
+#include "files.h"
+#include "ignore-value.h"
 
 #define NUM_FDS 31
 #define NUM_TIME 31
 
+struct eventBackend {
+    const char *name;
+    int (*init)(void);
+    int (*runOnce)(void);
+    int (*addHandle)(int fd, int events, virEventHandleCallback cb,
+                     void *opaque, virFreeCallback ff);
+    void (*updateHandle)(int watch, int events);
+    int (*removeHandle)(int watch);
+    int (*addTimeout)(int frequency, virEventTimeoutCallback cb,
+                      void *opaque, virFreeCallback ff);
+    void (*updateTimeout)(int timer, int frequency);
+    int (*removeTimeout)(int timer);
+};
+
+static const struct eventBackend backends[] = {
+    { "poll",
+      virEventPollInit, virEventPollRunOnce,
+      virEventPollAddHandle, virEventPollUpdateHandle,
+      virEventPollRemoveHandle, virEventPollAddTimeout,
+      virEventPollUpdateTimeout, virEventPollRemoveTimeout },
+#ifdef HAVE_SYS_EPOLL_H
+    { "epoll",
+      virEventEpollInit, virEventEpollRunOnce,
+      virEventEpollAddHandle, virEventEpollUpdateHandle,
+      virEventEpollRemoveHandle, virEventEpollAddTimeout,
+      virEventEpollUpdateTimeout, virEventEpollRemoveTimeout },
+#endif
+};
+
+/* The implementation under test, read by the event thread */
+static const struct eventBackend *backend;
+
 static struct handleInfo {
     int pipeFD[2];
     int fired;
@@ -90,7 +131,7 @@ testPipeReader(int watch, int fd, int events, void *data)
     info->error = EV_ERROR_NONE;
 
     if (info->delete != -1)
-        virEventPollRemoveHandle(info->delete);
+        backend->removeHandle(info->delete);
 }
 
 
@@ -109,7 +150,7 @@ testTimer(int timer, void *data)
     info->error = EV_ERROR_NONE;
 
     if (info->delete != -1)
-        virEventPollRemoveTimeout(info->delete);
+        backend->removeTimeout(info->delete);
 }
 
 static pthread_mutex_t eventThreadMutex = PTHREAD_MUTEX_INITIALIZER;
@@ -128,7 +169,7 @@ ATTRIBUTE_NORETURN static void *eventThreadLoop(void *data ATTRIBUTE_UNUSED) {
         eventThreadRunOnce = 0;
         pthread_mutex_unlock(&eventThreadMutex);
 
-        virEventPollRunOnce();
+        backend->runOnce();
 
         pthread_mutex_lock(&eventThreadMutex);
         eventThreadJobDone = 1;
@@ -259,20 +300,11 @@ resetAll(void)
 }
 
 static int
-mymain(int argc, char **argv)
+testEventLoop(void)
 {
-    char *progname;
     int i;
-    pthread_t eventThread;
     char one = '1';
 
-    progname = argv[0];
-
-    if (argc > 1) {
-        fprintf(stderr, "Usage: %s\n", progname);
-        return EXIT_FAILURE;
-    }
-
     for (i = 0 ; i < NUM_FDS ; i++) {
         if (pipe(handles[i].pipeFD) < 0) {
             fprintf(stderr, "Cannot create pipe: %d", errno);
@@ -280,36 +312,29 @@ mymain(int argc, char **argv)
         }
     }
 
-    if (virThreadInitialize() < 0)
-        return EXIT_FAILURE;
-    char *debugEnv = getenv("LIBVIRT_DEBUG");
-    if (debugEnv && *debugEnv && (virLogParseDefaultPriority(debugEnv) == -1)) {
-        fprintf(stderr, "Invalid log level setting.\n");
+    if (backend->init() < 0) {
+        fprintf(stderr, "Cannot initialize %s event loop\n", backend->name);
         return EXIT_FAILURE;
     }
 
-    virEventPollInit();
-
     for (i = 0 ; i < NUM_FDS ; i++) {
         handles[i].delete = -1;
         handles[i].watch =
-            virEventPollAddHandle(handles[i].pipeFD[0],
-                                  VIR_EVENT_HANDLE_READABLE,
-                                  testPipeReader,
-                                  &handles[i], NULL);
+            backend->addHandle(handles[i].pipeFD[0],
+                               VIR_EVENT_HANDLE_READABLE,
+                               testPipeReader,
+                               &handles[i], NULL);
     }
 
     for (i = 0 ; i < NUM_TIME ; i++) {
         timers[i].delete = -1;
         timers[i].timeout = -1;
         timers[i].timer =
-            virEventPollAddTimeout(timers[i].timeout,
-                                   testTimer,
-                                   &timers[i], NULL);
+            backend->addTimeout(timers[i].timeout,
+                                testTimer,
+                                &timers[i], NULL);
     }
 
-    pthread_create(&eventThread, NULL, eventThreadLoop, NULL);
-
     pthread_mutex_lock(&eventThreadMutex);
 
     /* First time, is easy - just try triggering one of our
@@ -324,7 +349,7 @@ mymain(int argc, char **argv)
 
     /* Now lets delete one before starting poll(), and
      * try triggering another handle */
-    virEventPollRemoveHandle(handles[0].watch);
+    backend->removeHandle(handles[0].watch);
     startJob();
     if (safewrite(handles[1].pipeFD[1], &one, 1) != 1)
         return EXIT_FAILURE;
@@ -344,7 +369,7 @@ mymain(int argc, char **argv)
     sched_yield();
     usleep(100 * 1000);
     pthread_mutex_lock(&eventThreadMutex);
-    virEventPollRemoveHandle(handles[1].watch);
+    backend->removeHandle(handles[1].watch);
     if (finishJob("Interrupted during poll", -1, -1) != EXIT_SUCCESS)
         return EXIT_FAILURE;
 
@@ -380,22 +405,22 @@ mymain(int argc, char **argv)
 
 
     /* Run a timer on its own */
-    virEventPollUpdateTimeout(timers[1].timer, 100);
+    backend->updateTimeout(timers[1].timer, 100);
     startJob();
     if (finishJob("Firing a timer", -1, 1) != EXIT_SUCCESS)
         return EXIT_FAILURE;
-    virEventPollUpdateTimeout(timers[1].timer, -1);
+    backend->updateTimeout(timers[1].timer, -1);
 
     resetAll();
 
     /* Now lets delete one before starting poll(), and
      * try triggering another timer */
-    virEventPollUpdateTimeout(timers[1].timer, 100);
-    virEventPollRemoveTimeout(timers[0].timer);
+    backend->updateTimeout(timers[1].timer, 100);
+    backend->removeTimeout(timers[0].timer);
     startJob();
     if (finishJob("Deleted before poll", -1, 1) != EXIT_SUCCESS)
         return EXIT_FAILURE;
-    virEventPollUpdateTimeout(timers[1].timer, -1);
+    backend->updateTimeout(timers[1].timer, -1);
 
     resetAll();
 
@@ -410,7 +435,7 @@ mymain(int argc, char **argv)
     sched_yield();
     usleep(100 * 1000);
     pthread_mutex_lock(&eventThreadMutex);
-    virEventPollRemoveTimeout(timers[1].timer);
+    backend->removeTimeout(timers[1].timer);
     if (finishJob("Interrupted during poll", -1, -1) != EXIT_SUCCESS)
         return EXIT_FAILURE;
 
@@ -423,27 +448,27 @@ mymain(int argc, char **argv)
      * before poll() exits for the first safewrite(). We don't
      * see a hard failure in other cases, so nothing to worry
      * about */
-    virEventPollUpdateTimeout(timers[2].timer, 100);
-    virEventPollUpdateTimeout(timers[3].timer, 100);
+    backend->updateTimeout(timers[2].timer, 100);
+    backend->updateTimeout(timers[3].timer, 100);
     startJob();
     timers[2].delete = timers[3].timer;
     if (finishJob("Deleted during dispatch", -1, 2) != EXIT_SUCCESS)
         return EXIT_FAILURE;
-    virEventPollUpdateTimeout(timers[2].timer, -1);
+    backend->updateTimeout(timers[2].timer, -1);
 
     resetAll();
 
     /* Extreme fun, lets delete ourselves during dispatch */
-    virEventPollUpdateTimeout(timers[2].timer, 100);
+    backend->updateTimeout(timers[2].timer, 100);
     startJob();
     timers[2].delete = timers[2].timer;
     if (finishJob("Deleted during dispatch", -1, 2) != EXIT_SUCCESS)
         return EXIT_FAILURE;
 
     for (i = 0 ; i < NUM_FDS - 1 ; i++)
-        virEventPollRemoveHandle(handles[i].watch);
+        backend->removeHandle(handles[i].watch);
     for (i = 0 ; i < NUM_TIME - 1 ; i++)
-        virEventPollRemoveTimeout(timers[i].timer);
+        backend->removeTimeout(timers[i].timer);
 
     resetAll();
 
@@ -464,24 +489,296 @@ mymain(int argc, char **argv)
     handles[0].pipeFD[0] = handles[1].pipeFD[0];
     handles[0].pipeFD[1] = handles[1].pipeFD[1];
 
-    handles[0].watch = virEventPollAddHandle(handles[0].pipeFD[0],
-                                             0,
-                                             testPipeReader,
-                                             &handles[0], NULL);
-    handles[1].watch = virEventPollAddHandle(handles[1].pipeFD[0],
-                                             VIR_EVENT_HANDLE_READABLE,
-                                             testPipeReader,
-                                             &handles[1], NULL);
+    handles[0].watch = backend->addHandle(handles[0].pipeFD[0],
+                                          0,
+                                          testPipeReader,
+                                          &handles[0], NULL);
+    handles[1].watch = backend->addHandle(handles[1].pipeFD[0],
+                                          VIR_EVENT_HANDLE_READABLE,
+                                          testPipeReader,
+                                          &handles[1], NULL);
     startJob();
     if (safewrite(handles[1].pipeFD[1], &one, 1) != 1)
         return EXIT_FAILURE;
     if (finishJob("Write duplicate", 1, -1) != EXIT_SUCCESS)
         return EXIT_FAILURE;
 
-    //pthread_kill(eventThread, SIGTERM);
+    resetAll();
+    pthread_mutex_unlock(&eventThreadMutex);
 
     return EXIT_SUCCESS;
 }
 
 
+#ifdef TEST_BENCH
+/*
+ * Dispatch cost with many idle handles registered. Each
+ * iteration makes a single handle readable and runs the
+ * loop once, so any time above the baseline comes from
+ * the loop walking handles which have nothing to report.
+ */
+#define BENCH_ITERATIONS 1000
+
+struct benchInfo {
+    int nidle;
+    int idle[2];
+    int *idleFDs;
+    int *idleWatches;
+    int active[2];
+    int activeWatch;
+    int fired;
+};
+
+static void
+benchPipeReader(int watch ATTRIBUTE_UNUSED, int fd,
+                int events ATTRIBUTE_UNUSED, void *data)
+{
+    struct benchInfo *info = data;
+    char c;
+
+    if (read(fd, &c, 1) == 1)
+        info->fired++;
+}
+
+static void
+benchIdleReader(int watch ATTRIBUTE_UNUSED, int fd ATTRIBUTE_UNUSED,
+                int events ATTRIBUTE_UNUSED, void *data ATTRIBUTE_UNUSED)
+{
+}
+
+static int
+benchDispatch(const void *data)
+{
+    struct benchInfo *info = (struct benchInfo *)data;
+    char one = '1';
+    int i;
+
+    info->fired = 0;
+    for (i = 0 ; i < BENCH_ITERATIONS ; i++) {
+        if (safewrite(info->active[1], &one, 1) != 1)
+            return -1;
+        if (backend->runOnce() < 0)
+            return -1;
+    }
+
+    return info->fired == BENCH_ITERATIONS ? 0 : -1;
+}
+
+static void
+benchCleanup(struct benchInfo *info)
+{
+    int i;
+
+    for (i = 0 ; i < info->nidle ; i++) {
+        if (info->idleWatches[i] > 0)
+            backend->removeHandle(info->idleWatches[i]);
+    }
+
+    /* Let the loop purge the idle handles before their fds go away */
+    if (info->activeWatch > 0) {
+        if (safewrite(info->active[1], "1", 1) == 1)
+            backend->runOnce();
+        backend->removeHandle(info->activeWatch);
+    }
+
+    for (i = 0 ; i < info->nidle ; i++)
+        VIR_FORCE_CLOSE(info->idleFDs[i]);
+    VIR_FORCE_CLOSE(info->idle[0]);
+    VIR_FORCE_CLOSE(info->idle[1]);
+    VIR_FORCE_CLOSE(info->active[0]);
+    VIR_FORCE_CLOSE(info->active[1]);
+    VIR_FREE(info->idleFDs);
+    VIR_FREE(info->idleWatches);
+}
+
+static int
+benchEventLoop(int nidle)
+{
+    struct benchInfo info;
+    char *title = NULL;
+    int ret = 0;
+    int i;
+
+    memset(&info, 0, sizeof(info));
+    info.idle[0] = info.idle[1] = -1;
+    info.active[0] = info.active[1] = -1;
+
+    if (VIR_ALLOC_N(info.idleFDs, nidle) < 0 ||
+        VIR_ALLOC_N(info.idleWatches, nidle) < 0)
+        goto cleanup;
+
+    if (pipe(info.active) < 0 ||
+        pipe(info.idle) < 0)
+        goto skip;
+
+    /* Idle handles all watch the read end of a pipe which is never
+     * written to, dup'd so each one is a distinct fd to the loop */
+    for (info.nidle = 0 ; info.nidle < nidle ; info.nidle++) {
+        if ((info.idleFDs[info.nidle] = dup(info.idle[0])) < 0)
+            goto skip;
+    }
+
+    for (i = 0 ; i < nidle ; i++) {
+        if ((info.idleWatches[i] =
+             backend->addHandle(info.idleFDs[i],
+                                VIR_EVENT_HANDLE_READABLE,
+                                benchIdleReader, NULL, NULL)) < 0) {
+            ret = -1;
+            goto cleanup;
+        }
+    }
+    if ((info.activeWatch =
+         backend->addHandle(info.active[0],
+                            VIR_EVENT_HANDLE_READABLE,
+                            benchPipeReader, &info, NULL)) < 0) {
+        ret = -1;
+        goto cleanup;
+    }
+
+    if (virAsprintf(&title, "%s dispatch with %d idle handles",
+                    backend->name, nidle) < 0 ||
+        virtTestRun(title, 10, benchDispatch, &info) < 0)
+        ret = -1;
+
+cleanup:
+    VIR_FREE(title);
+    benchCleanup(&info);
+    return ret;
+
+skip:
+    /* Not a failure, we're just short on file descriptors */
+    fprintf(stderr, "Skipping %s benchmark with %d idle handles: %s\n",
+            backend->name, nidle, strerror(errno));
+    goto cleanup;
+}
+#endif /* TEST_BENCH */
+
+static void
+testFileReader(int watch ATTRIBUTE_UNUSED, int fd ATTRIBUTE_UNUSED,
+               int events, void *data)
+{
+    int *fired = data;
+
+    if (events == VIR_EVENT_HANDLE_READABLE)
+        (*fired)++;
+}
+
+static void
+testFileTimer(int timer ATTRIBUTE_UNUSED, void *data)
+{
+    int *expired = data;
+
+    (*expired)++;
+}
+
+/* poll() reports regular files as always ready, while epoll refuses
+ * to watch them, so check the loop copes with that */
+static int
+testRegularFile(const void *data)
+{
+    const char *path = data;
+    int fired = 0;
+    int expired = 0;
+    int watch = -1;
+    int timer;
+    int fd;
+    int ret = -1;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+
+    if ((watch = backend->addHandle(fd, VIR_EVENT_HANDLE_READABLE,
+                                    testFileReader, &fired, NULL)) < 0)
+        goto cleanup;
+
+    if (backend->runOnce() < 0 || fired != 1 ||
+        backend->runOnce() < 0 || fired != 2)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    if (watch > 0) {
+        backend->removeHandle(watch);
+        /* Purge the handle, with a timer to keep the loop from
+         * blocking now that nothing is ready */
+        if ((timer = backend->addTimeout(0, testFileTimer,
+                                         &expired, NULL)) < 0 ||
+            backend->runOnce() < 0 || fired != 2 || expired != 1)
+            ret = -1;
+        if (timer > 0)
+            backend->removeTimeout(timer);
+    }
+    VIR_FORCE_CLOSE(fd);
+    return ret;
+}
+
+
+static int
+mymain(int argc, char **argv)
+{
+#ifdef TEST_BENCH
+    static const int idle[] = { 10, 1000, 10000 };
+    struct rlimit rlim;
+    int j;
+#endif
+    pthread_t eventThread;
+    int ret = EXIT_SUCCESS;
+    int i;
+
+    if (argc > 1) {
+        fprintf(stderr, "Usage: %s\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (virThreadInitialize() < 0)
+        return EXIT_FAILURE;
+    char *debugEnv = getenv("LIBVIRT_DEBUG");
+    if (debugEnv && *debugEnv && (virLogParseDefaultPriority(debugEnv) == -1)) {
+        fprintf(stderr, "Invalid log level setting.\n");
+        return EXIT_FAILURE;
+    }
+
+    pthread_create(&eventThread, NULL, eventThreadLoop, NULL);
+
+    for (i = 0 ; i < ARRAY_CARDINALITY(backends) ; i++) {
+        backend = &backends[i];
+        if (testEventLoop() != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+    }
+
+    /* The event thread is idle from here on, so the remaining tests
+     * drive each loop directly */
+    for (i = 0 ; i < ARRAY_CARDINALITY(backends) ; i++) {
+        char *title = NULL;
+
+        backend = &backends[i];
+        if (virAsprintf(&title, "%s regular file", backend->name) < 0 ||
+            virtTestRun(title, 1, testRegularFile, argv[0]) < 0)
+            ret = EXIT_FAILURE;
+        VIR_FREE(title);
+    }
+
+#ifdef TEST_BENCH
+    /* The largest benchmark wants an fd per idle handle */
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 &&
+        rlim.rlim_cur < rlim.rlim_max) {
+        rlim.rlim_cur = rlim.rlim_max;
+        ignore_value(setrlimit(RLIMIT_NOFILE, &rlim));
+    }
+
+    /* Set VIR_TEST_VERBOSE=1 for timings */
+    for (i = 0 ; i < ARRAY_CARDINALITY(backends) ; i++) {
+        backend = &backends[i];
+        for (j = 0 ; j < ARRAY_CARDINALITY(idle) ; j++) {
+            if (benchEventLoop(idle[j]) < 0)
+                ret = EXIT_FAILURE;
+        }
+    }
+#endif
+
+    return ret;
+}
+
+
 VIRT_TEST_MAIN(mymain)
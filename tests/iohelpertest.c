@@ -0,0 +1,738 @@
+/*
+ * iohelpertest.c: Test the libvirt_iohelper data paths
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "util.h"
+#include "memory.h"
+#include "command.h"
+#include "files.h"
+
+#ifdef WIN32
+
+static int
+mymain(int argc ATTRIBUTE_UNUSED, char **argv ATTRIBUTE_UNUSED)
+{
+    exit (EXIT_AM_SKIP);
+}
+
+#else
+
+# define IOHELPER abs_builddir "/../src/libvirt_iohelper"
+
+# ifdef TEST_BENCH
+/* Big enough for the copy to dominate the cost of spawning the helper */
+#  define TEST_FILE_SIZE (64 * 1024 * 1024)
+#  define TEST_REPEAT 3
+# else
+#  define TEST_FILE_SIZE (4 * 1024 * 1024)
+#  define TEST_REPEAT 1
+# endif
+# define TEST_CHUNK (256 * 1024)
+
+/* Direct I/O has to switch to the page cache for a partial
+ * block at the end of the file */
+# define TEST_FILE_SIZE_UNALIGNED (TEST_FILE_SIZE - 1000)
+
+struct testInfo {
+    const char *path;
+    int flags;
+    bool sparse; /* Expect all zeros rather than the test pattern */
+    unsigned long long size;
+};
+
+static void
+testFillPattern(char *buf, size_t len, unsigned long long offset)
+{
+    size_t i;
+
+    for (i = 0 ; i < len ; i++)
+        buf[i] = (offset + i) % 251;
+}
+
+/* Check @len bytes of stream data found at @offset */
+static int
+testCheckData(const struct testInfo *info, const char *buf,
+              size_t len, unsigned long long offset)
+{
+    size_t i;
+
+    for (i = 0 ; i < len ; i++) {
+        char want = info->sparse ? 0 : (offset + i) % 251;
+        if (buf[i] != want) {
+            if (virTestGetDebug())
+                fprintf(stderr, "Mismatch at byte %llu\n", offset + i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static virCommandPtr
+testHelperNew(const char *path, int flags)
+{
+    virCommandPtr cmd = virCommandNewArgList(IOHELPER, path, NULL);
+
+    virCommandAddArgFormat(cmd, "%d", flags);
+    virCommandAddArgFormat(cmd, "%d", 0600);
+    virCommandAddArgFormat(cmd, "%llu", 0ULL);
+    virCommandAddArgFormat(cmd, "%llu", 0ULL);
+
+    return cmd;
+}
+
+/* Stream the whole file out of the helper and verify it */
+static int
+testHelperRead(const void *data)
+{
+    const struct testInfo *info = data;
+    virCommandPtr cmd;
+    char *buf = NULL;
+    int fds[2] = { -1, -1 };
+    unsigned long long total = 0;
+    int ret = -1;
+
+    cmd = testHelperNew(info->path, info->flags | O_RDONLY);
+
+    if (VIR_ALLOC_N(buf, TEST_CHUNK) < 0 ||
+        pipe(fds) < 0)
+        goto cleanup;
+
+    virCommandSetOutputFD(cmd, &fds[1]);
+    if (virCommandRunAsync(cmd, NULL) < 0)
+        goto cleanup;
+    VIR_FORCE_CLOSE(fds[1]);
+
+    while (1) {
+        ssize_t got = saferead(fds[0], buf, TEST_CHUNK);
+        if (got < 0)
+            goto cleanup;
+        if (got == 0)
+            break;
+        if (testCheckData(info, buf, got, total) < 0)
+            goto cleanup;
+        total += got;
+    }
+
+    if (virCommandWait(cmd, NULL) < 0)
+        goto cleanup;
+
+    if (total != info->size) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Expected %llu bytes, got %llu\n",
+                    info->size, total);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FORCE_CLOSE(fds[0]);
+    VIR_FORCE_CLOSE(fds[1]);
+    virCommandFree(cmd);
+    VIR_FREE(buf);
+    return ret;
+}
+
+/* Stream the test pattern into the helper, then read the file back */
+static int
+testHelperWrite(const void *data)
+{
+    const struct testInfo *info = data;
+    struct testInfo expect = { info->path, 0, false, info->size };
+    virCommandPtr cmd;
+    char *buf = NULL;
+    int fds[2] = { -1, -1 };
+    int fd = -1;
+    unsigned long long total;
+    int ret = -1;
+
+    cmd = testHelperNew(info->path, info->flags | O_WRONLY | O_TRUNC);
+
+    if (VIR_ALLOC_N(buf, TEST_CHUNK) < 0 ||
+        pipe(fds) < 0)
+        goto cleanup;
+
+    virCommandSetInputFD(cmd, fds[0]);
+    if (virCommandRunAsync(cmd, NULL) < 0)
+        goto cleanup;
+    VIR_FORCE_CLOSE(fds[0]);
+
+    for (total = 0 ; total < info->size ; total += TEST_CHUNK) {
+        size_t len = MIN(TEST_CHUNK, info->size - total);
+        testFillPattern(buf, len, total);
+        if (safewrite(fds[1], buf, len) < 0)
+            goto cleanup;
+    }
+    VIR_FORCE_CLOSE(fds[1]);
+
+    if (virCommandWait(cmd, NULL) < 0)
+        goto cleanup;
+
+    if ((fd = open(info->path, O_RDONLY)) < 0)
+        goto cleanup;
+    total = 0;
+    while (1) {
+        ssize_t got = saferead(fd, buf, TEST_CHUNK);
+        if (got < 0)
+            goto cleanup;
+        if (got == 0)
+            break;
+        if (testCheckData(&expect, buf, got, total) < 0)
+            goto cleanup;
+        total += got;
+    }
+
+    if (total != info->size)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    VIR_FORCE_CLOSE(fd);
+    VIR_FORCE_CLOSE(fds[0]);
+    VIR_FORCE_CLOSE(fds[1]);
+    virCommandFree(cmd);
+    VIR_FREE(buf);
+    return ret;
+}
+
+static int
+testCreateFile(const char *path, bool sparse, unsigned long long size)
+{
+    char *buf = NULL;
+    unsigned long long total;
+    int fd;
+    int ret = -1;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+        return -1;
+
+    if (sparse) {
+        if (ftruncate(fd, size) < 0)
+            goto cleanup;
+    } else {
+        if (VIR_ALLOC_N(buf, TEST_CHUNK) < 0)
+            goto cleanup;
+        for (total = 0 ; total < size ; total += TEST_CHUNK) {
+            size_t len = MIN(TEST_CHUNK, size - total);
+            testFillPattern(buf, len, total);
+            if (safewrite(fd, buf, len) < 0)
+                goto cleanup;
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    if (VIR_CLOSE(fd) < 0)
+        ret = -1;
+    VIR_FREE(buf);
+    return ret;
+}
+
+static int
+testRunFile(const char *desc, const char *path, bool sparse,
+            unsigned long long size)
+{
+    static const struct {
+        const char *name;
+        int flags;
+    } modes[] = {
+        { "default", 0 },
+        { "direct", O_DIRECT },
+    };
+    int ret = 0;
+    int i;
+
+    if (testCreateFile(path, sparse, size) < 0) {
+        fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    for (i = 0 ; i < ARRAY_CARDINALITY(modes) ; i++) {
+        struct testInfo info = { path, modes[i].flags, sparse, size };
+        char *title = NULL;
+
+        if (virAsprintf(&title, "iohelper read %s, %s",
+                        desc, modes[i].name) < 0 ||
+            virtTestRun(title, TEST_REPEAT, testHelperRead, &info) < 0)
+            ret = -1;
+        VIR_FREE(title);
+    }
+
+    /* Overwriting the sparse file fills it in, so do that last */
+    for (i = 0 ; i < ARRAY_CARDINALITY(modes) ; i++) {
+        struct testInfo info = { path, modes[i].flags, false, size };
+        char *title = NULL;
+
+        if (virAsprintf(&title, "iohelper write %s, %s",
+                        desc, modes[i].name) < 0 ||
+            virtTestRun(title, TEST_REPEAT, testHelperWrite, &info) < 0)
+            ret = -1;
+        VIR_FREE(title);
+    }
+
+    unlink(path);
+    return ret;
+}
+
+/*
+ * A save image is a mix of untouched guest pages, which are zero,
+ * pages of repetitive data and pages which do not compress at all.
+ * Lay out every group of four pages that way, so the compressors
+ * see roughly what they would in real use.
+ */
+# define TEST_PAGE 4096
+
+static void
+testFillMixed(char *buf, size_t len, unsigned long long offset)
+{
+    size_t i;
+
+    for (i = 0 ; i < len ; i += TEST_PAGE) {
+        unsigned long long page = (offset + i) / TEST_PAGE;
+        unsigned int seed = page * 2654435761U;
+        size_t j;
+
+        switch (page % 4) {
+        case 0:
+        case 1:
+            memset(buf + i, 0, TEST_PAGE);
+            break;
+        case 2:
+            testFillPattern(buf + i, TEST_PAGE, offset + i);
+            break;
+        case 3:
+            for (j = 0 ; j < TEST_PAGE ; j++) {
+                seed = seed * 1103515245 + 12345;
+                buf[i + j] = seed >> 16;
+            }
+            break;
+        }
+    }
+}
+
+struct testCompressInfo {
+    const char *input;
+    const char *image;
+    const char *const *compress;
+    const char *const *decompress;
+};
+
+/* Run @argv as a filter from file @in to file @out */
+static int
+testFilter(const char *const *argv, const char *in, const char *out)
+{
+    virCommandPtr cmd = virCommandNewArgs(argv);
+    int infd = -1;
+    int outfd = -1;
+    int ret = -1;
+
+    if ((infd = open(in, O_RDONLY)) < 0 ||
+        (outfd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+        goto cleanup;
+
+    virCommandSetInputFD(cmd, infd);
+    virCommandSetOutputFD(cmd, &outfd);
+    if (virCommandRun(cmd, NULL) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    VIR_FORCE_CLOSE(infd);
+    VIR_FORCE_CLOSE(outfd);
+    virCommandFree(cmd);
+    return ret;
+}
+
+/* Decompress @image from @offset and check it against the mixed
+ * test data */
+static int
+testDecompressCheck(const char *const *argv, const char *image, off_t offset)
+{
+    virCommandPtr cmd = virCommandNewArgs(argv);
+    char *buf = NULL;
+    char *want = NULL;
+    int fds[2] = { -1, -1 };
+    int infd = -1;
+    unsigned long long total = 0;
+    int ret = -1;
+
+    if (VIR_ALLOC_N(buf, TEST_CHUNK) < 0 ||
+        VIR_ALLOC_N(want, TEST_CHUNK) < 0 ||
+        (infd = open(image, O_RDONLY)) < 0 ||
+        lseek(infd, offset, SEEK_SET) < 0 ||
+        pipe(fds) < 0)
+        goto cleanup;
+
+    virCommandSetInputFD(cmd, infd);
+    virCommandSetOutputFD(cmd, &fds[1]);
+    if (virCommandRunAsync(cmd, NULL) < 0)
+        goto cleanup;
+    VIR_FORCE_CLOSE(fds[1]);
+
+    while (1) {
+        ssize_t got = saferead(fds[0], buf, TEST_CHUNK);
+        if (got < 0)
+            goto cleanup;
+        if (got == 0)
+            break;
+        if (total + got > TEST_FILE_SIZE)
+            goto cleanup;
+        testFillMixed(want, TEST_CHUNK, total);
+        if (memcmp(buf, want, got) != 0) {
+            if (virTestGetDebug())
+                fprintf(stderr, "Mismatch in chunk at %llu\n", total);
+            goto cleanup;
+        }
+        total += got;
+    }
+
+    if (virCommandWait(cmd, NULL) < 0)
+        goto cleanup;
+
+    if (total != TEST_FILE_SIZE)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    VIR_FORCE_CLOSE(infd);
+    VIR_FORCE_CLOSE(fds[0]);
+    VIR_FORCE_CLOSE(fds[1]);
+    virCommandFree(cmd);
+    VIR_FREE(buf);
+    VIR_FREE(want);
+    return ret;
+}
+
+static int
+testCompress(const void *data)
+{
+    const struct testCompressInfo *info = data;
+    struct stat sb;
+
+    if (testFilter(info->compress, info->input, info->image) < 0)
+        return -1;
+
+    if (virTestGetVerbose() && stat(info->image, &sb) == 0)
+        fprintf(stderr, "%s: %llu bytes compressed to %llu\n",
+                info->compress[0], (unsigned long long)TEST_FILE_SIZE,
+                (unsigned long long)sb.st_size);
+    return 0;
+}
+
+static int
+testDecompress(const void *data)
+{
+    const struct testCompressInfo *info = data;
+
+    return testDecompressCheck(info->decompress, info->image, 0);
+}
+
+static unsigned long long
+testReadLE(const unsigned char *buf, size_t len)
+{
+    unsigned long long val = 0;
+
+    while (len-- > 0)
+        val = (val << 8) | buf[len];
+    return val;
+}
+
+/* The image is little endian whatever the host, so check its
+ * header and trailer byte by byte */
+static int
+testZlibLayout(const void *data)
+{
+    const struct testCompressInfo *info = data;
+    unsigned char header[16 + 4 + 4];
+    unsigned char trailer[8 + 8 + 16];
+    unsigned long long nblocks, indexOffset;
+    struct stat sb;
+    int fd;
+    int ret = -1;
+
+    if ((fd = open(info->image, O_RDONLY)) < 0)
+        return -1;
+
+    if (fstat(fd, &sb) < 0 ||
+        sb.st_size < (off_t)(sizeof(header) + sizeof(trailer)) ||
+        saferead(fd, header, sizeof(header)) != sizeof(header) ||
+        lseek(fd, sb.st_size - sizeof(trailer), SEEK_SET) < 0 ||
+        saferead(fd, trailer, sizeof(trailer)) != sizeof(trailer))
+        goto cleanup;
+
+    nblocks = testReadLE(trailer, 8);
+    indexOffset = testReadLE(trailer + 8, 8);
+
+    if (memcmp(header, "LibvirtZlibBlock", 16) != 0 ||
+        testReadLE(header + 16, 4) != 1 ||
+        testReadLE(header + 20, 4) == 0 ||
+        testReadLE(header + 20, 4) > TEST_FILE_SIZE ||
+        nblocks == 0 ||
+        indexOffset + nblocks * 16 + sizeof(trailer) !=
+        (unsigned long long)sb.st_size ||
+        memcmp(trailer + 16, "LibvirtZlibBlock", 16) != 0) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Unexpected layout, %llu blocks, index at %llu\n",
+                    nblocks, indexOffset);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FORCE_CLOSE(fd);
+    return ret;
+}
+
+/* A cut short image must not decompress as if it were whole */
+static int
+testDecompressTruncated(const void *data)
+{
+    const struct testCompressInfo *info = data;
+    struct stat sb;
+
+    if (stat(info->image, &sb) < 0 ||
+        truncate(info->image, sb.st_size / 2) < 0)
+        return -1;
+
+    return testDecompressCheck(info->decompress, info->image, 0) < 0 ? 0 : -1;
+}
+
+/*
+ * Go through the same steps as qemudDomainSaveFlag and
+ * qemuDomainSaveImageStartVM: write a header, let the compressor
+ * append to the same fd while the guest memory is fed to it through
+ * a pipe, then check the header survived and decompress from just
+ * past it.
+ */
+static int
+testSavePipeline(const void *data)
+{
+    const struct testCompressInfo *info = data;
+    virCommandPtr cmd = virCommandNewArgs(info->compress);
+    char *buf = NULL;
+    char *header = NULL;
+    unsigned long long total;
+    int fds[2] = { -1, -1 };
+    int fd = -1;
+    int ret = -1;
+
+    if (VIR_ALLOC_N(buf, TEST_CHUNK) < 0 ||
+        VIR_ALLOC_N(header, TEST_PAGE) < 0)
+        goto cleanup;
+    memset(header, 'S', TEST_PAGE);
+
+    if ((fd = open(info->image, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0 ||
+        safewrite(fd, header, TEST_PAGE) < 0 ||
+        pipe(fds) < 0)
+        goto cleanup;
+
+    virCommandSetInputFD(cmd, fds[0]);
+    virCommandSetOutputFD(cmd, &fd);
+    if (virSetCloseExec(fds[1]) < 0 ||
+        virCommandRunAsync(cmd, NULL) < 0)
+        goto cleanup;
+    VIR_FORCE_CLOSE(fds[0]);
+
+    for (total = 0 ; total < TEST_FILE_SIZE ; total += TEST_CHUNK) {
+        testFillMixed(buf, TEST_CHUNK, total);
+        if (safewrite(fds[1], buf, TEST_CHUNK) < 0)
+            goto cleanup;
+    }
+    if (VIR_CLOSE(fds[1]) < 0 ||
+        virCommandWait(cmd, NULL) < 0 ||
+        VIR_CLOSE(fd) < 0)
+        goto cleanup;
+
+    if ((fd = open(info->image, O_RDONLY)) < 0 ||
+        saferead(fd, buf, TEST_PAGE) != TEST_PAGE ||
+        memcmp(buf, header, TEST_PAGE) != 0) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Header of %s was overwritten\n", info->image);
+        goto cleanup;
+    }
+
+    ret = testDecompressCheck(info->decompress, info->image, TEST_PAGE);
+
+cleanup:
+    VIR_FORCE_CLOSE(fds[0]);
+    VIR_FORCE_CLOSE(fds[1]);
+    VIR_FORCE_CLOSE(fd);
+    virCommandFree(cmd);
+    VIR_FREE(buf);
+    VIR_FREE(header);
+    return ret;
+}
+
+static int
+testCreateMixed(const char *path)
+{
+    char *buf = NULL;
+    unsigned long long total;
+    int fd;
+    int ret = -1;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+        return -1;
+
+    if (VIR_ALLOC_N(buf, TEST_CHUNK) < 0)
+        goto cleanup;
+    for (total = 0 ; total < TEST_FILE_SIZE ; total += TEST_CHUNK) {
+        testFillMixed(buf, TEST_CHUNK, total);
+        if (safewrite(fd, buf, TEST_CHUNK) < 0)
+            goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    if (VIR_CLOSE(fd) < 0)
+        ret = -1;
+    VIR_FREE(buf);
+    return ret;
+}
+
+/*
+ * Round trip the mixed data through the helper's own compressor,
+ * and when benchmarking through gzip too, if it is around, to show
+ * how the two compare.
+ */
+static int
+testRunCompress(const char *dir)
+{
+    static const char *const zlibCompress[] = {
+        IOHELPER, "zlib", "-c", NULL
+    };
+    static const char *const zlibDecompress[] = {
+        IOHELPER, "zlib", "-dc", NULL
+    };
+# ifdef TEST_BENCH
+    const char *gzipCompress[] = { NULL, "-c", NULL };
+    const char *gzipDecompress[] = { NULL, "-dc", NULL };
+    char *gzip = NULL;
+# endif
+    struct testCompressInfo info;
+    char *input = NULL;
+    char *image = NULL;
+    int ret = -1;
+
+    if (virAsprintf(&input, "%s/iohelpertest-%d.raw",
+                    dir, (int)getpid()) < 0 ||
+        virAsprintf(&image, "%s/iohelpertest-%d.z",
+                    dir, (int)getpid()) < 0)
+        goto cleanup;
+
+    if (testCreateMixed(input) < 0) {
+        fprintf(stderr, "Cannot create %s: %s\n", input, strerror(errno));
+        goto cleanup;
+    }
+
+    ret = 0;
+
+    info.input = input;
+    info.image = image;
+    info.compress = zlibCompress;
+    info.decompress = zlibDecompress;
+    if (virtTestRun("iohelper zlib compress", 1, testCompress, &info) < 0 ||
+        virtTestRun("iohelper zlib layout", 1, testZlibLayout, &info) < 0 ||
+        virtTestRun("iohelper zlib decompress", 1, testDecompress, &info) < 0 ||
+        virtTestRun("iohelper zlib truncated", 1,
+                    testDecompressTruncated, &info) < 0 ||
+        virtTestRun("iohelper zlib save pipeline", 1,
+                    testSavePipeline, &info) < 0)
+        ret = -1;
+
+# ifdef TEST_BENCH
+    if ((gzip = virFindFileInPath("gzip"))) {
+        gzipCompress[0] = gzipDecompress[0] = gzip;
+        info.compress = gzipCompress;
+        info.decompress = gzipDecompress;
+        if (virtTestRun("gzip compress", 1, testCompress, &info) < 0 ||
+            virtTestRun("gzip decompress", 1, testDecompress, &info) < 0)
+            ret = -1;
+    }
+    VIR_FREE(gzip);
+# endif
+
+cleanup:
+    if (input)
+        unlink(input);
+    if (image)
+        unlink(image);
+    VIR_FREE(input);
+    VIR_FREE(image);
+    return ret;
+}
+
+static int
+mymain(int argc ATTRIBUTE_UNUSED, char **argv ATTRIBUTE_UNUSED)
+{
+    struct stat sb;
+    char *path = NULL;
+    int ret = 0;
+
+    if (access(IOHELPER, X_OK) < 0)
+        return EXIT_AM_SKIP;
+
+    if (stat("/dev/shm", &sb) == 0 && S_ISDIR(sb.st_mode) &&
+        access("/dev/shm", W_OK) == 0) {
+        if (virAsprintf(&path, "/dev/shm/iohelpertest-%d.img",
+                        (int)getpid()) < 0)
+            return EXIT_FAILURE;
+        if (testRunFile("tmpfs", path, false, TEST_FILE_SIZE) < 0)
+            ret = -1;
+        VIR_FREE(path);
+    }
+
+    if (virAsprintf(&path, "%s/iohelpertest-%d.img",
+                    abs_builddir, (int)getpid()) < 0)
+        return EXIT_FAILURE;
+    if (testRunFile("sparse file", path, true, TEST_FILE_SIZE) < 0)
+        ret = -1;
+    if (testRunFile("unaligned file", path, false,
+                    TEST_FILE_SIZE_UNALIGNED) < 0)
+        ret = -1;
+    VIR_FREE(path);
+
+# ifdef HAVE_ZLIB
+    if (testRunCompress(abs_builddir) < 0)
+        ret = -1;
+# endif
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+#endif /* !WIN32 */
+
+VIRT_TEST_MAIN(mymain)
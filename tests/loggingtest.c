@@ -0,0 +1,240 @@
+/*
+ * loggingtest.c: Test synchronous and asynchronous logging
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "internal.h"
+#include "testutils.h"
+#include "logging.h"
+#include "threads.h"
+#include "memory.h"
+#include "util.h"
+
+#ifdef TEST_BENCH
+# define TEST_MESSAGES 20000    /* per thread */
+#else
+# define TEST_MESSAGES 1000     /* per thread */
+#endif
+#define TEST_MAX_THREADS 32
+
+struct testState {
+    int nthreads;
+    bool async;
+
+    /* Only touched by the outputs, under the log lock */
+    int next[TEST_MAX_THREADS];  /* message expected next from each thread */
+    int received;
+    bool failed;
+};
+
+struct testWorker {
+    virThread thread;
+    int id;
+};
+
+static int
+testOutput(const char *category ATTRIBUTE_UNUSED,
+           int priority ATTRIBUTE_UNUSED,
+           const char *funcname ATTRIBUTE_UNUSED,
+           long long linenr ATTRIBUTE_UNUSED,
+           const char *str, int len, void *data)
+{
+    struct testState *state = data;
+    const char *msg;
+    int id, n;
+
+    if (!(msg = strstr(str, "loggingtest ")))
+        return len;
+
+    /* Each thread's messages must arrive once, and in order */
+    if (sscanf(msg, "loggingtest %d %d", &id, &n) != 2 ||
+        id < 0 || id >= state->nthreads ||
+        n != state->next[id]) {
+        state->failed = true;
+        return len;
+    }
+
+    state->next[id]++;
+    state->received++;
+    return len;
+}
+
+static void
+testWorkerMain(void *opaque)
+{
+    struct testWorker *worker = opaque;
+    int i;
+
+    for (i = 0 ; i < TEST_MESSAGES ; i++)
+        VIR_DEBUG("loggingtest %d %d", worker->id, i);
+}
+
+/* Returns the number of messages found in the log file */
+static int
+testCountFile(const char *path)
+{
+    char *content = NULL;
+    char *cur;
+    int count = 0;
+
+    if (virFileReadAll(path, 64 * 1024 * 1024, &content) < 0)
+        return -1;
+
+    for (cur = content; (cur = strstr(cur, "loggingtest ")) != NULL; cur++)
+        count++;
+
+    VIR_FREE(content);
+    return count;
+}
+
+static int
+testLogging(const void *data)
+{
+    const struct testState *info = data;
+    struct testState state;
+    struct testWorker workers[TEST_MAX_THREADS];
+    struct timeval before, after;
+    char *path = NULL;
+    char *outputs = NULL;
+    int total = info->nthreads * TEST_MESSAGES;
+    int ret = -1;
+    int i;
+
+    memset(&state, 0, sizeof(state));
+    state.nthreads = info->nthreads;
+    state.async = info->async;
+
+    if (virAsprintf(&path, "%s/loggingtest-%d.log",
+                    abs_builddir, (int)getpid()) < 0 ||
+        virAsprintf(&outputs, "%d:file:%s", VIR_LOG_DEBUG, path) < 0)
+        goto cleanup;
+    unlink(path);
+
+    virLogReset();
+    virLogSetDefaultPriority(VIR_LOG_DEBUG);
+    if (virLogDefineOutput(testOutput, NULL, &state, VIR_LOG_DEBUG,
+                           0, NULL, 0) < 0 ||
+        virLogParseOutputs(outputs) != 1)
+        goto cleanup;
+    if (state.async && virLogSetAsync(true) < 0)
+        goto cleanup;
+
+    if (gettimeofday(&before, NULL) < 0)
+        goto cleanup;
+
+    for (i = 0 ; i < state.nthreads ; i++) {
+        workers[i].id = i;
+        if (virThreadCreate(&workers[i].thread, true,
+                            testWorkerMain, &workers[i]) < 0) {
+            while (--i >= 0)
+                virThreadJoin(&workers[i].thread);
+            goto cleanup;
+        }
+    }
+    for (i = 0 ; i < state.nthreads ; i++)
+        virThreadJoin(&workers[i].thread);
+
+    /* Waits for the writer to catch up */
+    virLogSetAsync(false);
+
+    if (gettimeofday(&after, NULL) < 0)
+        goto cleanup;
+
+    if (state.failed || state.received != total) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Output got %d of %d messages%s\n",
+                    state.received, total,
+                    state.failed ? ", some out of order" : "");
+        goto cleanup;
+    }
+
+    /* Closes the file output */
+    virLogReset();
+
+    if ((i = testCountFile(path)) != total) {
+        if (virTestGetDebug())
+            fprintf(stderr, "File got %d of %d messages\n", i, total);
+        goto cleanup;
+    }
+
+    if (virTestGetVerbose()) {
+        double secs = (after.tv_sec - before.tv_sec) +
+            (after.tv_usec - before.tv_usec) / 1000000.0;
+        fprintf(stderr, "[%.0f msgs/s] ", secs > 0 ? total / secs : 0);
+    }
+
+    ret = 0;
+
+cleanup:
+    virLogReset();
+    virLogSetFromEnv();
+    if (path)
+        unlink(path);
+    VIR_FREE(path);
+    VIR_FREE(outputs);
+    return ret;
+}
+
+static int
+mymain(int argc ATTRIBUTE_UNUSED, char **argv ATTRIBUTE_UNUSED)
+{
+    static const int threads[] = { 1, 8, TEST_MAX_THREADS };
+    bool haveAsync;
+    int ret = 0;
+    int i;
+
+    if (virThreadInitialize() < 0)
+        return EXIT_FAILURE;
+
+    haveAsync = (virLogSetAsync(true) == 0);
+    virLogSetAsync(false);
+
+    for (i = 0 ; i < ARRAY_CARDINALITY(threads) ; i++) {
+        struct testState info;
+        char *title = NULL;
+
+        memset(&info, 0, sizeof(info));
+        info.nthreads = threads[i];
+
+        if (virAsprintf(&title, "logging sync, %d threads", threads[i]) < 0 ||
+            virtTestRun(title, 1, testLogging, &info) < 0)
+            ret = -1;
+        VIR_FREE(title);
+
+        if (!haveAsync)
+            continue;
+
+        info.async = true;
+        if (virAsprintf(&title, "logging async, %d threads", threads[i]) < 0 ||
+            virtTestRun(title, 1, testLogging, &info) < 0)
+            ret = -1;
+        VIR_FREE(title);
+    }
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+VIRT_TEST_MAIN(mymain)
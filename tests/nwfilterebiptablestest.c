@@ -0,0 +1,170 @@
+/*
+ * nwfilterebiptablestest.c: Test the ebiptables rule conversion
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "memory.h"
+#include "xml.h"
+#include "threads.h"
+#include "nwfilter_params.h"
+#include "nwfilter_conf.h"
+#include "nwfilter/nwfilter_ebiptables_driver.h"
+
+#define IPTABLES "/sbin/iptables"
+#define EBTABLES "/sbin/ebtables"
+
+struct testInfo {
+    const char *templ;
+    const char *cmd;
+    const char *table;
+    const char *chain;
+    const char *comment;
+    const char *expect;     /* NULL if the rule needs the shell */
+};
+
+static int
+testRestoreRule(const void *data)
+{
+    const struct testInfo *info = data;
+    char *actual;
+    int ret = -1;
+
+    actual = ebiptablesRestoreRule(info->templ, info->cmd, info->table,
+                                   info->chain, info->comment);
+
+    if (!info->expect) {
+        if (actual) {
+            if (virTestGetDebug())
+                fprintf(stderr, "Expected no rule, got '%s'\n", actual);
+            goto cleanup;
+        }
+    } else if (!actual) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Expected '%s', got no rule\n", info->expect);
+        goto cleanup;
+    } else if (STRNEQ(info->expect, actual)) {
+        virtTestDifference(stderr, info->expect, actual);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(actual);
+    return ret;
+}
+
+static int
+mymain(int argc ATTRIBUTE_UNUSED, char **argv ATTRIBUTE_UNUSED)
+{
+    int ret = 0;
+
+#define DO_TEST(name, templ, cmd, table, chain, comment, expect)        \
+    do {                                                                \
+        struct testInfo info = {                                        \
+            templ, cmd, table, chain, comment, expect                   \
+        };                                                              \
+        if (virtTestRun("restore rule " name, 1,                        \
+                        testRestoreRule, &info) < 0)                    \
+            ret = -1;                                                   \
+    } while (0)
+
+#define DO_TEST_IPT(name, args, comment, expect)                        \
+    DO_TEST(name, "cmd='" IPTABLES " -%c FI-vnet0 %s" args,             \
+            IPTABLES, NULL, "FI-vnet0", comment, expect)
+
+    /* Templates are turned into the rule the *-restore tools take */
+    DO_TEST_IPT("plain",
+                " -p tcp --dport 22 -j ACCEPT", NULL,
+                "-A FI-vnet0 -p tcp --dport 22 -j ACCEPT\n");
+    DO_TEST("ebtables",
+            "cmd='" EBTABLES " -t nat -%c I-vnet0-ipv4 %s"
+            " -p ipv4 -s 52:54:00:11:22:33 -j RETURN",
+            EBTABLES, "nat", "I-vnet0-ipv4", NULL,
+            "-A I-vnet0-ipv4 -p ipv4 -s 52:54:00:11:22:33 -j RETURN\n");
+
+    /* The comment variable is replaced by the comment, requoted */
+    DO_TEST_IPT("comment",
+                " -m comment --comment \"$comment\" -j ACCEPT",
+                "comment='allow ssh'\n",
+                "-A FI-vnet0 -m comment --comment \"allow ssh\" -j ACCEPT\n");
+    DO_TEST_IPT("empty comment",
+                " -m comment --comment \"$comment\" -j ACCEPT",
+                "comment=''\n",
+                "-A FI-vnet0 -m comment --comment \"\" -j ACCEPT\n");
+    DO_TEST_IPT("comment with single quotes",
+                " -m comment --comment \"$comment\" -j ACCEPT",
+                "comment='it'\\''s '\\'''\\''quoted'\n",
+                "-A FI-vnet0 -m comment --comment \"it's ''quoted\" -j ACCEPT\n");
+    DO_TEST_IPT("comment with double quotes and backslashes",
+                " -m comment --comment \"$comment\" -j ACCEPT",
+                "comment='say \"hi\" \\ bye'\n",
+                "-A FI-vnet0 -m comment --comment"
+                " \"say \\\"hi\\\" \\\\ bye\" -j ACCEPT\n");
+    DO_TEST_IPT("comment with shell characters",
+                " -m comment --comment \"$comment\" -j ACCEPT",
+                "comment='$HOME `id` ; | & *'\n",
+                "-A FI-vnet0 -m comment --comment"
+                " \"$HOME `id` ; | & *\" -j ACCEPT\n");
+
+    /* A comment which can't go on one line needs the shell */
+    DO_TEST_IPT("comment with newline",
+                " -m comment --comment \"$comment\" -j ACCEPT",
+                "comment='two\nlines'\n", NULL);
+    DO_TEST_IPT("comment not given",
+                " -m comment --comment \"$comment\" -j ACCEPT",
+                NULL, NULL);
+    DO_TEST_IPT("comment not assigned",
+                " -m comment --comment \"$comment\" -j ACCEPT",
+                "other='x'\n", NULL);
+
+    /* So does any other quoting or expansion in the arguments */
+    DO_TEST_IPT("single quote",
+                " -m comment --comment 'x' -j ACCEPT", NULL, NULL);
+    DO_TEST_IPT("double quote",
+                " -m comment --comment \"x\" -j ACCEPT", NULL, NULL);
+    DO_TEST_IPT("variable",
+                " -s $IP -j ACCEPT", NULL, NULL);
+    DO_TEST_IPT("command substitution",
+                " -s `hostname` -j ACCEPT", NULL, NULL);
+    DO_TEST_IPT("backslash",
+                " -s 10.0.0.1\\ -j ACCEPT", NULL, NULL);
+
+    /* As does a template which isn't for the expected tool and chain */
+    DO_TEST("other tool",
+            "cmd='/sbin/ip6tables -%c FI-vnet0 %s -j ACCEPT",
+            IPTABLES, NULL, "FI-vnet0", NULL, NULL);
+    DO_TEST("other chain",
+            "cmd='" IPTABLES " -%c FO-vnet0 %s -j ACCEPT",
+            IPTABLES, NULL, "FI-vnet0", NULL, NULL);
+    DO_TEST("other table",
+            "cmd='" EBTABLES " -t filter -%c I-vnet0 %s -j RETURN",
+            EBTABLES, "nat", "I-vnet0", NULL, NULL);
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -165,6 +165,27 @@ let lockableDrivers = [
 ]
 
 
+(*
+ * Drivers whose domain list has a lock of its own, so
+ * objects may be fetched without holding the driver lock
+ *)
+let lockFreeLookupDrivers = [
+      "qemud_driver";
+]
+
+(*
+ * Methods which lock other domains of a domain list, and
+ * so must never be called with an object already locked
+ *)
+let objectListMethods = [
+   "virDomainObjListNumOfDomains";
+   "virDomainObjListGetActiveIDs";
+   "virDomainObjListGetInactiveNames";
+   "virDomainObjListForEach";
+   "virDomainObjIsDuplicate";
+]
+
+
 let isFuncCallLval lval methodList =
    match lval with
       Var vi, o ->
@@ -258,6 +279,9 @@ let isObjectLockCall instr =
 let isObjectUnlockCall instr =
    isFuncCallInstr instr objectUnlockMethods
 
+let isObjectListCall instr =
+   isFuncCallInstr instr objectListMethods
+
 let isDriverLockCall instr =
    isFuncCallInstr instr driverLockMethods
 
@@ -291,6 +315,9 @@ let isLockableObjectVar varinfo =
 let isLockableDriverVar varinfo =
     isWantedType varinfo.vtype lockableDrivers
 
+let isLockFreeLookupDriverVar varinfo =
+    isWantedType varinfo.vtype lockFreeLookupDrivers
+
 let isDriverTable varinfo =
     isWantedType varinfo.vtype driverTables
 
@@ -342,6 +369,12 @@ let isLockableDriverNull exp =
 let lockableObjs: VS.t ref  = ref VS.empty
 let lockableDriver: VS.t ref  = ref VS.empty
 
+(*
+ * Set if the driver used by the current function allows
+ * objects to be fetched & locked without the driver lock
+ *)
+let lockFreeLookup = ref false
+
 (*
  * Given a Cil.Instr object (ie a single instruction), get
  * the list of all used & defined variables associated with
@@ -491,7 +524,7 @@ module Locking = struct
 	     * Report if driver is not locked, since that's a safety
 	     * risk
 	     *)
-            if VS.is_empty ld then (
+            if VS.is_empty ld && not !lockFreeLookup then (
 	       if VS.is_empty lo then (
                  ((), ld, ud, retlo, uo, uud, uuo, List.append loud [i], ldlo, dead)
                ) else (
@@ -516,7 +549,7 @@ module Locking = struct
 	     * Report if driver is not locked, since that's a safety
 	     * risk
 	     *)
-            if VS.is_empty ld then
+            if VS.is_empty ld && not !lockFreeLookup then
                ((), ld, ud, retlo, retuo, uud, uuo, List.append loud [i], ldlo, dead)
             else
                ((), ld, ud, retlo, retuo, uud, uuo, loud, ldlo, dead)
@@ -528,6 +561,15 @@ module Locking = struct
             let retlo = VS.diff lo useo in
             let retuo = VS.union uo useo in
             ((), ld, ud, retlo, retuo, uud, uuo, loud, ldlo, dead);
+         ) else if isObjectListCall i then (
+            (*
+             * These lock other objects in turn, so report
+             * if any objects are locked already
+             *)
+            if VS.is_empty lo then
+               ((), ld, ud, lo, uo, uud, uuo, loud, ldlo, dead)
+            else
+               ((), ld, ud, lo, uo, uud, uuo, loud, ldlo, List.append dead [i])
          ) else (
             (*
              * Nothing special happened, at best an assignment.
@@ -691,6 +733,7 @@ let () =
          (* Initialize list of driver & object variables to be empty *)
 	 ignore (lockableDriver = ref VS.empty);
 	 ignore (lockableObjs = ref VS.empty);
+	 lockFreeLookup := false;
 
          (*
           * Query all local variables, and figure out which correspond
@@ -698,9 +741,11 @@ let () =
           *)
          List.iter (
               fun var ->
-                if isLockableDriverVar var then
-                   lockableDriver := VS.add var !lockableDriver
-                else if isLockableObjectVar var then
+                if isLockableDriverVar var then (
+                   lockableDriver := VS.add var !lockableDriver;
+                   if isLockFreeLookupDriverVar var then
+                      lockFreeLookup := true
+                ) else if isLockableObjectVar var then
                    lockableObjs := VS.add var !lockableObjs;
           ) fundec.slocals;
 
@@ -814,7 +859,7 @@ let () =
 			    ) uuo;
 			    List.iter (
 				fun i ->
-				    ignore (Pretty.printf "  - Object fetched while locked objects exist %a\n" d_instr i);
+				    ignore (Pretty.printf "  - Object fetched or list locked while locked objects exist %a\n" d_instr i);
 			    ) dead;
 		) mistakes;
 		print_endline "================================================================";
@@ -0,0 +1,344 @@
+#include <config.h>
+
+#ifdef WITH_QEMU
+
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <unistd.h>
+# include <sys/stat.h>
+# include <sys/time.h>
+
+# include "testutils.h"
+# include "qemu/qemu_capabilities.h"
+# include "internal.h"
+# include "memory.h"
+# include "util.h"
+# include "files.h"
+# include "threads.h"
+
+static char *abs_srcdir;
+
+struct testInfo {
+    char *dir;          /* state dir holding the cache */
+    char *qemu;         /* fake binary, replaying qemuhelpdata */
+    char *link;         /* symlink to the fake binary */
+    char *probes;       /* one line per run of the fake binary */
+    char *slow;         /* fake binary which waits for 'gate' */
+    char *gate;
+};
+
+/* Writes a fake binary to @path. If @gate is given, it waits up
+ * to 30s for that file to exist before answering */
+static int
+testWriteQemuPath(struct testInfo *info, const char *path,
+                  const char *name, const char *gate)
+{
+    char *script = NULL;
+    int ret = -1;
+
+    if (virAsprintf(&script,
+                    "#!/bin/sh\n"
+                    "echo \"$1\" >> %s\n"
+                    "i=0\n"
+                    "while test -n \"%s\" && ! test -e \"%s\" &&\n"
+                    "      test $i -lt 3000; do\n"
+                    "    sleep 0.01; i=$((i + 1))\n"
+                    "done\n"
+                    "if test \"$1\" = -help; then\n"
+                    "    cat %s/qemuhelpdata/%s\n"
+                    "else\n"
+                    "    cat %s/qemuhelpdata/%s-device >&2\n"
+                    "fi\n",
+                    info->probes, gate ? gate : "", gate ? gate : "",
+                    abs_srcdir, name, abs_srcdir, name) < 0)
+        return -1;
+
+    unlink(path);
+    if (virFileWriteStr(path, script, S_IRWXU) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(script);
+    return ret;
+}
+
+static int
+testWriteQemu(struct testInfo *info, const char *name)
+{
+    return testWriteQemuPath(info, info->qemu, name, NULL);
+}
+
+/* Returns how many times the fake binary was run */
+static int
+testCountProbes(struct testInfo *info)
+{
+    char *content = NULL;
+    char *cur;
+    int count = 0;
+
+    if (access(info->probes, F_OK) < 0)
+        return 0;
+    if (virFileReadAll(info->probes, 1024 * 1024, &content) < 0)
+        return -1;
+
+    for (cur = content; (cur = strchr(cur, '\n')) != NULL; cur++)
+        count++;
+
+    VIR_FREE(content);
+    return count;
+}
+
+static int
+testExtractPath(struct testInfo *info, const char *qemu, const char *arch,
+                unsigned int expectVersion, int expectProbes)
+{
+    unsigned int version;
+    virBitmapPtr flags = NULL;
+    int probes;
+    int ret = -1;
+
+    if (qemuCapsExtractVersionInfo(qemu, arch, &version, &flags) < 0)
+        return -1;
+
+    if (version != expectVersion ||
+        !qemuCapsGet(flags, QEMU_CAPS_DEVICE) ||
+        qemuCapsGet(flags, QEMU_CAPS_PCI_MULTIBUS) != STREQ(arch, "x86_64")) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Wrong capabilities, version %u\n", version);
+        goto cleanup;
+    }
+
+    if ((probes = testCountProbes(info)) != expectProbes) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Binary was run %d times, expected %d\n",
+                    probes, expectProbes);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    qemuCapsFree(flags);
+    return ret;
+}
+
+static int
+testExtract(struct testInfo *info, const char *arch,
+            unsigned int expectVersion, int expectProbes)
+{
+    return testExtractPath(info, info->qemu, arch,
+                           expectVersion, expectProbes);
+}
+
+/* Probing 0.13.0 runs both -help and -device ?, while 0.12.3 does
+ * not support "-device driver,?" so only gets -help */
+static int
+testCache(const void *data)
+{
+    struct testInfo *info = (struct testInfo *)data;
+    struct timeval times[2];
+    int ret = -1;
+
+    if (testWriteQemu(info, "qemu-kvm-0.13.0") < 0 ||
+        qemuCapsCacheInit(info->dir) < 0)
+        goto cleanup;
+
+    /* Probed once, whatever the arch asked for */
+    if (testExtract(info, "x86_64", 13000, 2) < 0 ||
+        testExtract(info, "x86_64", 13000, 2) < 0 ||
+        testExtract(info, "ppc", 13000, 2) < 0)
+        goto cleanup;
+
+    /* Restarting keeps what was saved in the state dir */
+    qemuCapsCacheShutdown();
+    if (qemuCapsCacheInit(info->dir) < 0 ||
+        testExtract(info, "x86_64", 13000, 2) < 0)
+        goto cleanup;
+
+    /* A link to the binary shares its entry */
+    if (symlink(info->qemu, info->link) < 0 ||
+        testExtractPath(info, info->link, "x86_64", 13000, 2) < 0)
+        goto cleanup;
+
+    /* Any change to the inode, even with the contents and mtime
+     * left alone, means probing again */
+    if (chmod(info->qemu, S_IRWXU) < 0 ||
+        testExtract(info, "x86_64", 13000, 4) < 0 ||
+        testExtractPath(info, info->link, "x86_64", 13000, 4) < 0)
+        goto cleanup;
+
+    /* An upgraded binary must be probed again */
+    if (testWriteQemu(info, "qemu-kvm-0.12.3") < 0)
+        goto cleanup;
+    memset(times, 0, sizeof(times));
+    times[0].tv_sec = times[1].tv_sec = time(NULL) + 10;
+    if (utimes(info->qemu, times) < 0)
+        goto cleanup;
+
+    if (testExtract(info, "x86_64", 12003, 5) < 0 ||
+        testExtract(info, "x86_64", 12003, 5) < 0 ||
+        testExtractPath(info, info->link, "x86_64", 12003, 5) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    qemuCapsCacheShutdown();
+    return ret;
+}
+
+struct testSlowProbe {
+    struct testInfo *info;
+    virMutex lock;
+    bool done;
+    int ret;
+};
+
+static void
+testSlowProbeThread(void *opaque)
+{
+    struct testSlowProbe *probe = opaque;
+    unsigned int version;
+    virBitmapPtr flags = NULL;
+    int ret;
+
+    ret = qemuCapsExtractVersionInfo(probe->info->slow, "x86_64",
+                                     &version, &flags);
+    if (ret == 0 && version != 12003)
+        ret = -1;
+    qemuCapsFree(flags);
+
+    virMutexLock(&probe->lock);
+    probe->done = true;
+    probe->ret = ret;
+    virMutexUnlock(&probe->lock);
+}
+
+/* Probing a binary must not hold up looking up one already cached */
+static int
+testConcurrent(const void *data)
+{
+    struct testInfo *info = (struct testInfo *)data;
+    struct testSlowProbe probe;
+    virThread thread;
+    bool started = false;
+    bool done;
+    int probes = -1;
+    int i;
+    int ret = -1;
+
+    memset(&probe, 0, sizeof(probe));
+    probe.info = info;
+    if (virMutexInit(&probe.lock) < 0)
+        return -1;
+
+    unlink(info->probes);
+    unlink(info->gate);
+    if (testWriteQemu(info, "qemu-kvm-0.13.0") < 0 ||
+        testWriteQemuPath(info, info->slow, "qemu-kvm-0.12.3",
+                          info->gate) < 0 ||
+        qemuCapsCacheInit(info->dir) < 0 ||
+        testExtract(info, "x86_64", 13000, 2) < 0)
+        goto cleanup;
+
+    if (virThreadCreate(&thread, true, testSlowProbeThread, &probe) < 0)
+        goto cleanup;
+    started = true;
+
+    /* Wait for the slow binary to be running */
+    for (i = 0 ; i < 3000 ; i++) {
+        if ((probes = testCountProbes(info)) != 2)
+            break;
+        usleep(10 * 1000);
+    }
+
+    if (probes != 3 ||
+        testExtract(info, "x86_64", 13000, 3) < 0)
+        goto cleanup;
+
+    virMutexLock(&probe.lock);
+    done = probe.done;
+    virMutexUnlock(&probe.lock);
+    if (done) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Lookup waited for the other probe\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    if (started) {
+        if (virFileWriteStr(info->gate, "", S_IRUSR | S_IWUSR) < 0)
+            ret = -1;
+        virThreadJoin(&thread);
+        if (probe.ret < 0)
+            ret = -1;
+    }
+    qemuCapsCacheShutdown();
+    virMutexDestroy(&probe.lock);
+    return ret;
+}
+
+static int
+mymain(int argc ATTRIBUTE_UNUSED, char **argv ATTRIBUTE_UNUSED)
+{
+    struct testInfo info;
+    char cwd[PATH_MAX];
+    char *cache = NULL;
+    int ret = 0;
+
+    abs_srcdir = getenv("abs_srcdir");
+    if (!abs_srcdir)
+        abs_srcdir = getcwd(cwd, sizeof(cwd));
+
+    memset(&info, 0, sizeof(info));
+    if (virAsprintf(&info.dir, "%s/qemucapscachetest-%d",
+                    abs_builddir, (int)getpid()) < 0 ||
+        virAsprintf(&info.qemu, "%s/qemu", info.dir) < 0 ||
+        virAsprintf(&info.link, "%s/kvm", info.dir) < 0 ||
+        virAsprintf(&info.probes, "%s/probes", info.dir) < 0 ||
+        virAsprintf(&info.slow, "%s/qemu-slow", info.dir) < 0 ||
+        virAsprintf(&info.gate, "%s/gate", info.dir) < 0 ||
+        virAsprintf(&cache, "%s/capabilities.cache", info.dir) < 0)
+        return EXIT_FAILURE;
+
+    if (mkdir(info.dir, 0700) < 0 ||
+        virtTestRun("QEMU capabilities cache", 1, testCache, &info) < 0)
+        ret = -1;
+
+    unlink(info.qemu);
+    unlink(info.link);
+    unlink(cache);
+    if (virtTestRun("QEMU capabilities cache concurrent probe", 1,
+                    testConcurrent, &info) < 0)
+        ret = -1;
+
+    unlink(info.qemu);
+    unlink(info.link);
+    unlink(info.slow);
+    unlink(info.gate);
+    unlink(info.probes);
+    unlink(cache);
+    rmdir(info.dir);
+    VIR_FREE(info.dir);
+    VIR_FREE(info.qemu);
+    VIR_FREE(info.link);
+    VIR_FREE(info.probes);
+    VIR_FREE(info.slow);
+    VIR_FREE(info.gate);
+    VIR_FREE(cache);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
+
+#else
+
+int main (void) { return (77); /* means 'test skipped' for automake */ }
+
+#endif /* WITH_QEMU */
@@ -0,0 +1,233 @@
+/*
+ * remotethroughputbench.c: Time many threads sharing one remote connection
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "util.h"
+#include "memory.h"
+#include "command.h"
+#include "threads.h"
+#include "ignore-value.h"
+#include "libvirt/libvirt.h"
+#include "libvirt/virterror.h"
+
+#ifdef WIN32
+
+static int
+mymain(int argc ATTRIBUTE_UNUSED, char **argv ATTRIBUTE_UNUSED)
+{
+    exit (EXIT_AM_SKIP);
+}
+
+#else
+
+# define LIBVIRTD abs_builddir "/../daemon/libvirtd"
+
+/* Split between however many threads share the connection, so
+ * the time taken for each run is directly comparable */
+# define TOTAL_CALLS 4000
+# define MAX_THREADS 32
+
+struct testInfo {
+    virConnectPtr conn;
+    int nthreads;
+};
+
+struct testThreadData {
+    virConnectPtr conn;
+    int ncalls;
+    bool failed;
+};
+
+static void
+testCallsThread(void *opaque)
+{
+    struct testThreadData *data = opaque;
+    int i;
+
+    for (i = 0 ; i < data->ncalls ; i++) {
+        virDomainPtr dom;
+        virDomainInfo info;
+
+        if (i % 2) {
+            if (virConnectNumOfDomains(data->conn) != 1)
+                goto error;
+            continue;
+        }
+
+        /* Check each reply went back to the thread which asked */
+        if (!(dom = virDomainLookupByName(data->conn, "test")))
+            goto error;
+        if (STRNEQ(virDomainGetName(dom), "test") ||
+            virDomainGetInfo(dom, &info) < 0 ||
+            info.state != VIR_DOMAIN_RUNNING) {
+            virDomainFree(dom);
+            goto error;
+        }
+        virDomainFree(dom);
+    }
+
+    return;
+
+error:
+    data->failed = true;
+}
+
+static int
+testCalls(const void *opaque)
+{
+    const struct testInfo *info = opaque;
+    struct testThreadData data[MAX_THREADS];
+    virThread threads[MAX_THREADS];
+    int nthreads = 0;
+    int ret = 0;
+    int i;
+
+    for (i = 0 ; i < info->nthreads ; i++) {
+        data[i].conn = info->conn;
+        data[i].ncalls = TOTAL_CALLS / info->nthreads;
+        data[i].failed = false;
+        if (virThreadCreate(&threads[i], true, testCallsThread, &data[i]) < 0) {
+            ret = -1;
+            break;
+        }
+        nthreads++;
+    }
+
+    for (i = 0 ; i < nthreads ; i++) {
+        virThreadJoin(&threads[i]);
+        if (data[i].failed)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+static void
+testQuietErrorFunc(void *userData ATTRIBUTE_UNUSED,
+                   virErrorPtr error ATTRIBUTE_UNUSED)
+{
+}
+
+static int
+mymain(int argc ATTRIBUTE_UNUSED, char **argv ATTRIBUTE_UNUSED)
+{
+    static const int nthreads[] = { 1, 2, 8, MAX_THREADS };
+    virCommandPtr cmd = NULL;
+    virConnectPtr conn = NULL;
+    char *dir = NULL;
+    char *conffile = NULL;
+    char *pidfile = NULL;
+    char *conf = NULL;
+    char *uri = NULL;
+    int ret = 0;
+    int i;
+
+    if (access(LIBVIRTD, X_OK) < 0)
+        return EXIT_AM_SKIP;
+
+    /* A privileged daemon would start the system-wide drivers */
+    if (geteuid() == 0)
+        return EXIT_AM_SKIP;
+
+    if (virAsprintf(&dir, "%s/remotethroughputbench-%d",
+                    abs_builddir, (int)getpid()) < 0 ||
+        virAsprintf(&conffile, "%s/libvirtd.conf", dir) < 0 ||
+        virAsprintf(&pidfile, "%s/libvirtd.pid", dir) < 0 ||
+        virAsprintf(&conf,
+                    "unix_sock_dir = \"%s\"\n"
+                    "auth_unix_rw = \"none\"\n"
+                    "max_clients = 5\n"
+                    "max_workers = %d\n",
+                    dir, MAX_THREADS) < 0 ||
+        virAsprintf(&uri, "test+unix:///default?socket=@%s/libvirt-sock",
+                    dir) < 0)
+        goto error;
+
+    if (virFileMakePath(dir) < 0 ||
+        virFileWriteStr(conffile, conf, 0600) < 0)
+        goto error;
+
+    cmd = virCommandNewArgList(LIBVIRTD, "--config", conffile,
+                               "--pid-file", pidfile, NULL);
+    virCommandAddEnvPassCommon(cmd);
+    virCommandAddEnvPair(cmd, "HOME", dir);
+    if (virCommandRunAsync(cmd, NULL) < 0)
+        goto error;
+
+    /* Give the daemon a few seconds to start listening */
+    setenv("LIBVIRT_AUTOSTART", "0", 1);
+    virSetErrorFunc(NULL, testQuietErrorFunc);
+    for (i = 0 ; i < 50 && !conn ; i++) {
+        if (!(conn = virConnectOpen(uri)))
+            usleep(100 * 1000);
+    }
+    virSetErrorFunc(NULL, NULL);
+    if (!conn) {
+        fprintf(stderr, "Cannot connect to %s\n", uri);
+        goto error;
+    }
+
+    /* The time taken for the same number of calls should fall as
+     * more threads share the connection */
+    for (i = 0 ; i < ARRAY_CARDINALITY(nthreads) ; i++) {
+        struct testInfo info = { conn, nthreads[i] };
+        char *title = NULL;
+
+        if (virAsprintf(&title, "%d calls from %d threads",
+                        TOTAL_CALLS, nthreads[i]) < 0 ||
+            virtTestRun(title, 1, testCalls, &info) < 0)
+            ret = -1;
+        VIR_FREE(title);
+    }
+
+cleanup:
+    if (conn)
+        virConnectClose(conn);
+    virCommandAbort(cmd);
+    virCommandFree(cmd);
+    /* The daemon leaves its session state under $HOME too */
+    if (dir) {
+        const char *const rmargv[] = { "rm", "-rf", dir, NULL };
+        ignore_value(virRun(rmargv, NULL));
+    }
+    VIR_FREE(uri);
+    VIR_FREE(conf);
+    VIR_FREE(pidfile);
+    VIR_FREE(conffile);
+    VIR_FREE(dir);
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+
+error:
+    ret = -1;
+    goto cleanup;
+}
+
+#endif /* !WIN32 */
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,442 @@
+/*
+ * storageclonetest.c: Test cloning raw storage volumes
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "util.h"
+#include "memory.h"
+#include "command.h"
+#include "files.h"
+#include "storage_conf.h"
+#include "storage_file.h"
+#include "storage/storage_backend.h"
+
+#ifdef WIN32
+
+static int
+mymain(int argc ATTRIBUTE_UNUSED, char **argv ATTRIBUTE_UNUSED)
+{
+    exit (EXIT_AM_SKIP);
+}
+
+#else
+
+/* A mostly unallocated source, like a thin template image */
+# ifdef TEST_BENCH
+#  define TEST_FILE_SIZE (256 * 1024 * 1024)
+# else
+#  define TEST_FILE_SIZE (64 * 1024 * 1024)
+# endif
+# define TEST_CHUNK (1024 * 1024)
+
+/* Every TEST_STRIDE bytes, one chunk of data, then one chunk of
+ * written zeros, with a hole up to the next stride */
+# define TEST_STRIDE (16 * 1024 * 1024)
+
+struct testInfo {
+    const char *source;
+    const char *target;
+    int type;           /* virStorageVolType of the target */
+    bool baseline;      /* Copy the way the driver used to, for comparison */
+};
+
+static void
+testFillPattern(char *buf, size_t len, unsigned long long offset)
+{
+    size_t i;
+
+    for (i = 0 ; i < len ; i++)
+        buf[i] = ((offset + i) % 251) + 1;
+}
+
+static bool
+testIsData(unsigned long long offset)
+{
+    return (offset % TEST_STRIDE) < TEST_CHUNK;
+}
+
+static int
+testCreateSource(const char *path)
+{
+    char *buf = NULL;
+    unsigned long long offset;
+    int fd;
+    int ret = -1;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+        return -1;
+
+    if (VIR_ALLOC_N(buf, TEST_CHUNK) < 0 ||
+        ftruncate(fd, TEST_FILE_SIZE) < 0)
+        goto cleanup;
+
+    for (offset = 0 ; offset < TEST_FILE_SIZE ; offset += TEST_STRIDE) {
+        testFillPattern(buf, TEST_CHUNK, offset);
+        if (pwrite(fd, buf, TEST_CHUNK, offset) != TEST_CHUNK)
+            goto cleanup;
+        memset(buf, 0, TEST_CHUNK);
+        if (pwrite(fd, buf, TEST_CHUNK, offset + TEST_CHUNK) != TEST_CHUNK)
+            goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    if (VIR_CLOSE(fd) < 0)
+        ret = -1;
+    VIR_FREE(buf);
+    return ret;
+}
+
+/* The target must hold the source's data, and zeros everywhere else */
+static int
+testCheckTarget(const char *path)
+{
+    char *buf = NULL;
+    unsigned long long total = 0;
+    int fd;
+    int ret = -1;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    if (VIR_ALLOC_N(buf, TEST_CHUNK) < 0)
+        goto cleanup;
+
+    while (total < TEST_FILE_SIZE) {
+        ssize_t got = saferead(fd, buf, TEST_CHUNK);
+        size_t i;
+
+        if (got <= 0)
+            break;
+
+        for (i = 0 ; i < got ; i++) {
+            unsigned long long pos = total + i;
+            char want = testIsData(pos) ? (pos % 251) + 1 : 0;
+
+            if (buf[i] != want) {
+                if (virTestGetDebug())
+                    fprintf(stderr, "Mismatch at byte %llu\n", pos);
+                goto cleanup;
+            }
+        }
+        total += got;
+    }
+
+    if (total != TEST_FILE_SIZE) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Expected %d bytes, got %llu\n",
+                    TEST_FILE_SIZE, total);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FORCE_CLOSE(fd);
+    VIR_FREE(buf);
+    return ret;
+}
+
+/* What virStorageBackendCopyToFD used to do: read everything,
+ * and compare each block against a buffer of zeros */
+static int
+testCopyBaseline(const struct testInfo *info)
+{
+    char *buf = NULL;
+    char *zerobuf = NULL;
+    size_t wbytes = 4096;
+    int inputfd = -1;
+    int fd = -1;
+    int ret = -1;
+
+    if ((inputfd = open(info->source, O_RDONLY)) < 0 ||
+        (fd = open(info->target, O_WRONLY | O_CREAT, 0600)) < 0)
+        goto cleanup;
+    if (info->type == VIR_STORAGE_VOL_FILE &&
+        ftruncate(fd, TEST_FILE_SIZE) < 0)
+        goto cleanup;
+
+    if (VIR_ALLOC_N(buf, TEST_CHUNK) < 0 ||
+        VIR_ALLOC_N(zerobuf, wbytes) < 0)
+        goto cleanup;
+
+    while (1) {
+        ssize_t got = saferead(inputfd, buf, TEST_CHUNK);
+        size_t off;
+
+        if (got < 0)
+            goto cleanup;
+        if (got == 0)
+            break;
+
+        for (off = 0 ; off < got ; off += wbytes) {
+            size_t interval = MIN(wbytes, got - off);
+
+            if (info->type == VIR_STORAGE_VOL_FILE &&
+                memcmp(buf + off, zerobuf, interval) == 0) {
+                if (lseek(fd, interval, SEEK_CUR) < 0)
+                    goto cleanup;
+            } else if (safewrite(fd, buf + off, interval) < 0) {
+                goto cleanup;
+            }
+        }
+    }
+
+    if (fsync(fd) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    VIR_FORCE_CLOSE(inputfd);
+    VIR_FORCE_CLOSE(fd);
+    VIR_FREE(buf);
+    VIR_FREE(zerobuf);
+    return ret;
+}
+
+static int
+testCopy(const struct testInfo *info)
+{
+    virStoragePoolDef pooldef;
+    virStoragePoolObj pool;
+    virStorageVolDef vol;
+    virStorageVolDef inputvol;
+    virStorageBackendBuildVolFrom build;
+
+    memset(&pooldef, 0, sizeof(pooldef));
+    memset(&pool, 0, sizeof(pool));
+    memset(&vol, 0, sizeof(vol));
+    memset(&inputvol, 0, sizeof(inputvol));
+
+    pooldef.type = VIR_STORAGE_POOL_DIR;
+    pool.def = &pooldef;
+
+    inputvol.type = VIR_STORAGE_VOL_FILE;
+    inputvol.target.path = (char *)info->source;
+    inputvol.target.format = VIR_STORAGE_FILE_RAW;
+    inputvol.capacity = TEST_FILE_SIZE;
+
+    vol.type = info->type;
+    vol.target.path = (char *)info->target;
+    vol.target.format = VIR_STORAGE_FILE_RAW;
+    vol.target.perms.mode = 0600;
+    vol.target.perms.uid = getuid();
+    vol.target.perms.gid = getgid();
+    vol.capacity = TEST_FILE_SIZE;
+    vol.allocation = TEST_FILE_SIZE;
+
+    if (!(build = virStorageBackendGetBuildVolFromFunction(&vol, &inputvol)))
+        return -1;
+
+    return build(NULL, &pool, &vol, &inputvol, 0);
+}
+
+/* Fill a block device target with junk, so the copy has to
+ * zero whatever the source doesn't allocate */
+static int
+testScribbleTarget(const char *path)
+{
+    char *buf = NULL;
+    unsigned long long total;
+    int fd;
+    int ret = -1;
+
+    if ((fd = open(path, O_WRONLY)) < 0)
+        return -1;
+    if (VIR_ALLOC_N(buf, TEST_CHUNK) < 0)
+        goto cleanup;
+    memset(buf, 0xff, TEST_CHUNK);
+
+    for (total = 0 ; total < TEST_FILE_SIZE ; total += TEST_CHUNK) {
+        if (safewrite(fd, buf, TEST_CHUNK) < 0)
+            goto cleanup;
+    }
+    if (fsync(fd) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    if (VIR_CLOSE(fd) < 0)
+        ret = -1;
+    VIR_FREE(buf);
+    return ret;
+}
+
+static int
+testClone(const void *data)
+{
+    const struct testInfo *info = data;
+    struct timeval before, after;
+
+    if (info->type == VIR_STORAGE_VOL_FILE)
+        unlink(info->target);
+    else if (testScribbleTarget(info->target) < 0)
+        return -1;
+
+    if (gettimeofday(&before, NULL) < 0)
+        return -1;
+
+    if ((info->baseline ? testCopyBaseline(info) : testCopy(info)) < 0)
+        return -1;
+
+    if (gettimeofday(&after, NULL) < 0)
+        return -1;
+
+    if (testCheckTarget(info->target) < 0)
+        return -1;
+
+    if (virTestGetVerbose()) {
+        double secs = (after.tv_sec - before.tv_sec) +
+            (after.tv_usec - before.tv_usec) / 1000000.0;
+        fprintf(stderr, "[%.3fs] ", secs);
+    }
+
+    return 0;
+}
+
+static int
+testRunAll(const char *desc, const char *source, const char *target,
+           int type)
+{
+    static const struct {
+        const char *name;
+        bool baseline;
+    } modes[] = {
+        { "baseline", true },
+        { "extents", false },
+    };
+    int ret = 0;
+    int i;
+
+    for (i = 0 ; i < ARRAY_CARDINALITY(modes) ; i++) {
+        struct testInfo info = { source, target, type, modes[i].baseline };
+        char *title = NULL;
+
+        if (virAsprintf(&title, "storage clone %s, %s",
+                        desc, modes[i].name) < 0 ||
+            virtTestRun(title, 1, testClone, &info) < 0)
+            ret = -1;
+        VIR_FREE(title);
+    }
+
+    return ret;
+}
+
+# ifdef TEST_BENCH
+/* Block devices need root, so only clone onto a loop
+ * device when we can set one up */
+static int
+testRunLoop(const char *source, const char *backing)
+{
+    virCommandPtr cmd = NULL;
+    char *dev = NULL;
+    char *nl;
+    int fd;
+    int ret = 0;
+
+    if (geteuid() != 0)
+        return 0;
+
+    if ((fd = open(backing, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+        return -1;
+    if (ftruncate(fd, TEST_FILE_SIZE) < 0) {
+        VIR_FORCE_CLOSE(fd);
+        return -1;
+    }
+    VIR_FORCE_CLOSE(fd);
+
+    cmd = virCommandNewArgList("losetup", "--show", "-f", backing, NULL);
+    virCommandSetOutputBuffer(cmd, &dev);
+    virCommandAddEnvPassCommon(cmd);
+    if (virCommandRun(cmd, NULL) < 0 || !dev || !*dev) {
+        /* No loop devices available is not a failure */
+        virResetLastError();
+        goto cleanup;
+    }
+    if ((nl = strchr(dev, '\n')))
+        *nl = '\0';
+
+    if (testRunAll("loop device", source, dev, VIR_STORAGE_VOL_BLOCK) < 0)
+        ret = -1;
+
+    virCommandFree(cmd);
+    cmd = virCommandNewArgList("losetup", "-d", dev, NULL);
+    if (virCommandRun(cmd, NULL) < 0)
+        ret = -1;
+
+cleanup:
+    virCommandFree(cmd);
+    VIR_FREE(dev);
+    unlink(backing);
+    return ret;
+}
+# endif /* TEST_BENCH */
+
+static int
+mymain(int argc ATTRIBUTE_UNUSED, char **argv ATTRIBUTE_UNUSED)
+{
+    char *source = NULL;
+    char *target = NULL;
+    int ret = 0;
+
+    if (virAsprintf(&source, "%s/storageclonetest-%d-src.img",
+                    abs_builddir, (int)getpid()) < 0 ||
+        virAsprintf(&target, "%s/storageclonetest-%d-dst.img",
+                    abs_builddir, (int)getpid()) < 0)
+        return EXIT_FAILURE;
+
+    if (testCreateSource(source) < 0) {
+        fprintf(stderr, "Cannot create %s: %s\n", source, strerror(errno));
+        ret = -1;
+        goto cleanup;
+    }
+
+    if (testRunAll("file", source, target, VIR_STORAGE_VOL_FILE) < 0)
+        ret = -1;
+    unlink(target);
+
+# ifdef TEST_BENCH
+    if (testRunLoop(source, target) < 0)
+        ret = -1;
+# endif
+
+cleanup:
+    unlink(source);
+    VIR_FREE(source);
+    VIR_FREE(target);
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+#endif /* !WIN32 */
+
+VIRT_TEST_MAIN(mymain)
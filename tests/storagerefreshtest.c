@@ -0,0 +1,346 @@
+/*
+ * storagerefreshtest.c: Test incremental refresh of directory pools
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "util.h"
+#include "memory.h"
+#include "files.h"
+#include "threads.h"
+#include "storage_conf.h"
+#include "storage/storage_backend.h"
+#include "storage/storage_backend_fs.h"
+
+#ifdef WIN32
+
+static int
+mymain(int argc ATTRIBUTE_UNUSED, char **argv ATTRIBUTE_UNUSED)
+{
+    exit (EXIT_AM_SKIP);
+}
+
+#else
+
+# ifdef TEST_BENCH
+/* Enough files for a full refresh to cost noticeably more */
+#  define TEST_FILES 2000
+# else
+#  define TEST_FILES 100
+# endif
+
+struct testInfo {
+    const char *dir;
+    int type;           /* Only decides whether the pool gets watched */
+};
+
+static int
+testWriteFile(const char *dir, const char *name, size_t len)
+{
+    char *path = NULL;
+    char buf[512];
+    int fd = -1;
+    int ret = -1;
+
+    memset(buf, 'x', sizeof(buf));
+
+    if (virAsprintf(&path, "%s/%s", dir, name) < 0)
+        return -1;
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600)) < 0)
+        goto cleanup;
+
+    while (len > 0) {
+        size_t n = MIN(len, sizeof(buf));
+
+        if (safewrite(fd, buf, n) < 0)
+            goto cleanup;
+        len -= n;
+    }
+
+    if (VIR_CLOSE(fd) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    VIR_FORCE_CLOSE(fd);
+    VIR_FREE(path);
+    return ret;
+}
+
+static void
+testCleanDir(const char *dir)
+{
+    DIR *dh;
+    struct dirent *ent;
+    char *path;
+
+    if (!(dh = opendir(dir)))
+        return;
+
+    while ((ent = readdir(dh)) != NULL) {
+        if (STREQ(ent->d_name, ".") || STREQ(ent->d_name, ".."))
+            continue;
+        if (virAsprintf(&path, "%s/%s", dir, ent->d_name) < 0)
+            break;
+        if (unlink(path) < 0)
+            rmdir(path);
+        VIR_FREE(path);
+    }
+
+    closedir(dh);
+    rmdir(dir);
+}
+
+static int
+testFillDir(const char *dir)
+{
+    char *path = NULL;
+    char name[32];
+    int i;
+
+    /* In case an earlier run was interrupted */
+    testCleanDir(dir);
+
+    if (mkdir(dir, 0700) < 0)
+        return -1;
+
+    for (i = 0 ; i < TEST_FILES ; i++) {
+        snprintf(name, sizeof(name), "vol%d.img", i);
+        if (testWriteFile(dir, name, 512 * (1 + i % 8)) < 0)
+            return -1;
+    }
+
+    /* Not a volume, so must be ignored */
+    if (virAsprintf(&path, "%s/subdir", dir) < 0)
+        return -1;
+    if (mkdir(path, 0700) < 0) {
+        VIR_FREE(path);
+        return -1;
+    }
+
+    VIR_FREE(path);
+    return 0;
+}
+
+static int
+testRefresh(virStoragePoolObjPtr pool, double *secs)
+{
+    virStorageBackendPtr backend = virStorageBackendForType(VIR_STORAGE_POOL_DIR);
+    struct timeval before, after;
+
+    if (!backend || gettimeofday(&before, NULL) < 0)
+        return -1;
+    if (backend->refreshPool(NULL, pool) < 0)
+        return -1;
+    if (gettimeofday(&after, NULL) < 0)
+        return -1;
+
+    if (secs)
+        *secs = (after.tv_sec - before.tv_sec) +
+            (after.tv_usec - before.tv_usec) / 1000000.0;
+    return 0;
+}
+
+/* Checks the volume for @name is there, and is @vol if given */
+static virStorageVolDefPtr
+testCheckVol(virStoragePoolObjPtr pool,
+             const char *name,
+             virStorageVolDefPtr vol,
+             unsigned long long capacity)
+{
+    virStorageVolDefPtr found = virStorageVolDefFindByName(pool, name);
+
+    if (!found || (vol && found != vol) ||
+        (capacity && found->capacity != capacity)) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Volume '%s' is %s\n", name,
+                    !found ? "missing" :
+                    (vol && found != vol) ? "not the cached one" :
+                    "the wrong size");
+        return NULL;
+    }
+
+    return found;
+}
+
+/* A refresh must pick up every change to the directory, while
+ * keeping the volumes for the files which didn't change */
+static int
+testChanges(const void *data)
+{
+    const struct testInfo *info = data;
+    virStoragePoolObj pool;
+    virStorageVolDefPtr *vols = NULL;
+    virStorageVolDefPtr vol;
+    double full = 0, incremental = 0;
+    char *path = NULL;
+    char *newpath = NULL;
+    char name[32];
+    int ret = -1;
+    int i;
+
+    memset(&pool, 0, sizeof(pool));
+    if (VIR_ALLOC(pool.def) < 0 ||
+        !(pool.def->target.path = strdup(info->dir)))
+        goto cleanup;
+    pool.def->type = info->type;
+
+    if (testRefresh(&pool, &full) < 0)
+        goto cleanup;
+
+    if (pool.volumes.count != TEST_FILES ||
+        virStorageVolDefFindByName(&pool, "subdir")) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Found %u volumes\n", pool.volumes.count);
+        goto cleanup;
+    }
+
+    if (VIR_ALLOC_N(vols, TEST_FILES) < 0)
+        goto cleanup;
+    for (i = 0 ; i < TEST_FILES ; i++) {
+        snprintf(name, sizeof(name), "vol%d.img", i);
+        if (!(vols[i] = testCheckVol(&pool, name, NULL,
+                                     512 * (1 + i % 8))))
+            goto cleanup;
+    }
+
+    /* Nothing changed, so nothing should be probed again */
+    if (testRefresh(&pool, &incremental) < 0)
+        goto cleanup;
+    for (i = 0 ; i < TEST_FILES ; i++) {
+        snprintf(name, sizeof(name), "vol%d.img", i);
+        if (!testCheckVol(&pool, name, vols[i], 0))
+            goto cleanup;
+    }
+
+    /* Grow vol0, delete vol1, chmod vol2, rename vol3, add a new one */
+    if (testWriteFile(info->dir, "vol0.img", 4096) < 0)
+        goto cleanup;
+    if (virAsprintf(&path, "%s/vol1.img", info->dir) < 0 ||
+        unlink(path) < 0)
+        goto cleanup;
+    VIR_FREE(path);
+    if (virAsprintf(&path, "%s/vol2.img", info->dir) < 0 ||
+        chmod(path, 0644) < 0)
+        goto cleanup;
+    VIR_FREE(path);
+    if (virAsprintf(&path, "%s/vol3.img", info->dir) < 0 ||
+        virAsprintf(&newpath, "%s/renamed.img", info->dir) < 0 ||
+        rename(path, newpath) < 0)
+        goto cleanup;
+    VIR_FREE(path);
+    if (testWriteFile(info->dir, "new.img", 1024) < 0)
+        goto cleanup;
+
+    if (testRefresh(&pool, NULL) < 0)
+        goto cleanup;
+
+    if (pool.volumes.count != TEST_FILES ||
+        !(vol = testCheckVol(&pool, "vol0.img", NULL, 512 + 4096)) ||
+        vol == vols[0] ||
+        virStorageVolDefFindByName(&pool, "vol1.img") ||
+        !(vol = testCheckVol(&pool, "vol2.img", NULL, 512 * 3)) ||
+        vol == vols[2] || vol->target.perms.mode != 0644 ||
+        virStorageVolDefFindByName(&pool, "vol3.img") ||
+        !testCheckVol(&pool, "renamed.img", NULL, 512 * 4) ||
+        !testCheckVol(&pool, "new.img", NULL, 1024))
+        goto cleanup;
+
+    for (i = 4 ; i < TEST_FILES ; i++) {
+        snprintf(name, sizeof(name), "vol%d.img", i);
+        if (!testCheckVol(&pool, name, vols[i], 0))
+            goto cleanup;
+    }
+
+    if (virTestGetVerbose())
+        fprintf(stderr, "[full %.3fs, unchanged %.3fs] ",
+                full, incremental);
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(vols);
+    VIR_FREE(path);
+    VIR_FREE(newpath);
+    if (pool.privateDataFreeFunc)
+        (pool.privateDataFreeFunc)(pool.privateData);
+    virStoragePoolObjClearVols(&pool);
+    virStoragePoolDefFree(pool.def);
+    return ret;
+}
+
+static int
+mymain(int argc ATTRIBUTE_UNUSED, char **argv ATTRIBUTE_UNUSED)
+{
+    static const struct {
+        const char *name;
+        int type;
+        bool watch;
+    } modes[] = {
+        { "scan", VIR_STORAGE_POOL_NETFS, true },
+        { "watch", VIR_STORAGE_POOL_DIR, true },
+        { "watch disabled", VIR_STORAGE_POOL_DIR, false },
+    };
+    char *dir = NULL;
+    int ret = 0;
+    int i;
+
+    if (virThreadInitialize() < 0)
+        return EXIT_FAILURE;
+
+    for (i = 0 ; i < ARRAY_CARDINALITY(modes) ; i++) {
+        struct testInfo info;
+        char *title = NULL;
+
+        if (virAsprintf(&dir, "%s/storagerefreshtest-%d",
+                        abs_builddir, (int)getpid()) < 0)
+            return EXIT_FAILURE;
+
+        info.dir = dir;
+        info.type = modes[i].type;
+        virStorageBackendFileSystemSetWatch(modes[i].watch);
+
+        if (testFillDir(dir) < 0 ||
+            virAsprintf(&title, "storage refresh, %s", modes[i].name) < 0 ||
+            virtTestRun(title, 1, testChanges, &info) < 0)
+            ret = -1;
+
+        VIR_FREE(title);
+        testCleanDir(dir);
+        VIR_FREE(dir);
+    }
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+#endif /* !WIN32 */
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,258 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "testutils.h"
+#include "storage_conf.h"
+#include "memory.h"
+#include "util.h"
+
+#define LOOKUPS_PER_RUN 1000
+#ifdef TEST_BENCH
+# define LOOKUP_REPEAT 10
+#else
+# define LOOKUP_REPEAT 1
+#endif
+
+struct testInfo {
+    virStoragePoolObjPtr pool;
+    int nvols;
+};
+
+static virStorageVolDefPtr
+testNewVol(const char *name, const char *key, const char *path)
+{
+    virStorageVolDefPtr vol;
+
+    if (VIR_ALLOC(vol) < 0)
+        return NULL;
+
+    if (!(vol->name = strdup(name)) ||
+        !(vol->key = strdup(key)) ||
+        !(vol->target.path = strdup(path))) {
+        virStorageVolDefFree(vol);
+        return NULL;
+    }
+
+    return vol;
+}
+
+static int
+testAddVol(virStoragePoolObjPtr pool, int n)
+{
+    virStorageVolDefPtr vol;
+    char name[32], key[32], path[64];
+
+    snprintf(name, sizeof(name), "vol%d", n);
+    snprintf(key, sizeof(key), "key%d", n);
+    snprintf(path, sizeof(path), "/var/lib/libvirt/images/vol%d", n);
+
+    if (!(vol = testNewVol(name, key, path)))
+        return -1;
+
+    if (virStoragePoolObjAddVol(pool, vol) < 0) {
+        virStorageVolDefFree(vol);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+testFillPool(virStoragePoolObjPtr pool, int nvols)
+{
+    int i;
+
+    memset(pool, 0, sizeof(*pool));
+    for (i = 0 ; i < nvols ; i++) {
+        if (testAddVol(pool, i) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Each volume must be found under its own name, key and path */
+static int
+testCheckVol(virStoragePoolObjPtr pool, int n, bool present)
+{
+    virStorageVolDefPtr byName, byKey, byPath;
+    char name[32], key[32], path[64];
+
+    snprintf(name, sizeof(name), "vol%d", n);
+    snprintf(key, sizeof(key), "key%d", n);
+    snprintf(path, sizeof(path), "/var/lib/libvirt/images/vol%d", n);
+
+    byName = virStorageVolDefFindByName(pool, name);
+    byKey = virStorageVolDefFindByKey(pool, key);
+    byPath = virStorageVolDefFindByPath(pool, path);
+
+    if (!present)
+        return (byName || byKey || byPath) ? -1 : 0;
+
+    if (!byName || byName != byKey || byName != byPath ||
+        STRNEQ(byName->name, name)) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Lookups for vol%d disagree\n", n);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+testLookup(const void *data)
+{
+    const struct testInfo *info = data;
+    int i;
+
+    for (i = 0 ; i < LOOKUPS_PER_RUN ; i++) {
+        if (testCheckVol(info->pool, (i * 7919) % info->nvols, true) < 0)
+            return -1;
+    }
+
+    /* Misses are the common case when searching across pools */
+    for (i = 0 ; i < LOOKUPS_PER_RUN ; i++) {
+        if (testCheckVol(info->pool, info->nvols + i, false) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Check the indexes follow volumes as they are removed and cleared */
+static int
+testLifecycle(const void *data ATTRIBUTE_UNUSED)
+{
+    virStoragePoolObj pool;
+    int ret = -1;
+    int i;
+
+    if (testFillPool(&pool, 100) < 0)
+        goto cleanup;
+
+    for (i = 0 ; i < 100 ; i += 2) {
+        virStorageVolDefPtr vol;
+        char name[32];
+
+        snprintf(name, sizeof(name), "vol%d", i);
+        if (!(vol = virStorageVolDefFindByName(&pool, name)))
+            goto cleanup;
+        virStoragePoolObjRemoveVol(&pool, vol);
+        virStorageVolDefFree(vol);
+    }
+
+    if (pool.volumes.count != 50)
+        goto cleanup;
+
+    for (i = 0 ; i < 100 ; i++) {
+        if (testCheckVol(&pool, i, (i % 2) != 0) < 0)
+            goto cleanup;
+    }
+
+    /* Volumes can be added back once gone */
+    if (testAddVol(&pool, 0) < 0 ||
+        testCheckVol(&pool, 0, true) < 0)
+        goto cleanup;
+
+    virStoragePoolObjClearVols(&pool);
+    for (i = 0 ; i < 100 ; i++) {
+        if (testCheckVol(&pool, i, false) < 0)
+            goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virStoragePoolObjClearVols(&pool);
+    return ret;
+}
+
+/* Lookups have always returned the first volume matching, so a
+ * duplicate key must take over only once the first is removed */
+static int
+testDuplicateKey(const void *data ATTRIBUTE_UNUSED)
+{
+    virStoragePoolObj pool;
+    virStorageVolDefPtr first = NULL, second = NULL;
+    int ret = -1;
+
+    memset(&pool, 0, sizeof(pool));
+
+    if (!(first = testNewVol("first", "samekey", "/dev/sda1")))
+        goto cleanup;
+    if (virStoragePoolObjAddVol(&pool, first) < 0) {
+        virStorageVolDefFree(first);
+        goto cleanup;
+    }
+    if (!(second = testNewVol("second", "samekey", "/dev/sdb1")))
+        goto cleanup;
+    if (virStoragePoolObjAddVol(&pool, second) < 0) {
+        virStorageVolDefFree(second);
+        goto cleanup;
+    }
+
+    if (virStorageVolDefFindByKey(&pool, "samekey") != first)
+        goto cleanup;
+
+    virStoragePoolObjRemoveVol(&pool, first);
+    virStorageVolDefFree(first);
+
+    if (virStorageVolDefFindByKey(&pool, "samekey") != second ||
+        virStorageVolDefFindByName(&pool, "first") ||
+        virStorageVolDefFindByPath(&pool, "/dev/sda1"))
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    virStoragePoolObjClearVols(&pool);
+    return ret;
+}
+
+static int
+mymain(int argc ATTRIBUTE_UNUSED,
+       char **argv ATTRIBUTE_UNUSED)
+{
+    int ret = 0;
+#ifdef TEST_BENCH
+    static const int sizes[] = { 10, 100, 1000, 20000 };
+#else
+    static const int sizes[] = { 10 };
+#endif
+    int i;
+
+    if (virtTestRun("VolList lifecycle", 1, testLifecycle, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("VolList duplicate key", 1, testDuplicateKey, NULL) < 0)
+        ret = -1;
+
+    /* storagevolindexbench reports the average cost per batch of
+     * lookups, which should not grow with the number of volumes */
+    for (i = 0 ; i < ARRAY_CARDINALITY(sizes) ; i++) {
+        virStoragePoolObj pool;
+        struct testInfo info = { &pool, sizes[i] };
+        char *title = NULL;
+
+        if (testFillPool(&pool, sizes[i]) < 0) {
+            ret = -1;
+            virStoragePoolObjClearVols(&pool);
+            continue;
+        }
+
+        if (virAsprintf(&title, "VolList lookup, %d volumes",
+                        sizes[i]) < 0 ||
+            virtTestRun(title, LOOKUP_REPEAT, testLookup, &info) < 0)
+            ret = -1;
+        VIR_FREE(title);
+
+        virStoragePoolObjClearVols(&pool);
+    }
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,372 @@
+/*
+ * storagewipetest.c: Test the storage volume wipe engine
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "util.h"
+#include "memory.h"
+#include "command.h"
+#include "files.h"
+#include "storage/storage_backend.h"
+
+#ifdef WIN32
+
+static int
+mymain(int argc ATTRIBUTE_UNUSED, char **argv ATTRIBUTE_UNUSED)
+{
+    exit (EXIT_AM_SKIP);
+}
+
+#else
+
+# ifdef TEST_BENCH
+/* Big enough for the wipe to dominate the cost of the test setup */
+#  define TEST_FILE_SIZE (64 * 1024 * 1024)
+# else
+#  define TEST_FILE_SIZE (4 * 1024 * 1024)
+# endif
+# define TEST_CHUNK (256 * 1024)
+
+/* Wipe an unaligned range so both the bulk and the edges get covered */
+# define TEST_WIPE_OFFSET (4096 + 512)
+# define TEST_WIPE_LENGTH (TEST_FILE_SIZE - 3 * 4096 - 100)
+
+struct testInfo {
+    const char *path;   /* File pre-filled with the test pattern */
+    const char *wipe;   /* What to wipe: @path itself, or a device over it */
+    unsigned int flags;
+    bool baseline;      /* Wipe the way the driver used to, for comparison */
+};
+
+static void
+testFillPattern(char *buf, size_t len, unsigned long long offset)
+{
+    size_t i;
+
+    for (i = 0 ; i < len ; i++)
+        buf[i] = ((offset + i) % 251) + 1;
+}
+
+static int
+testFillFile(const char *path)
+{
+    char *buf = NULL;
+    unsigned long long total;
+    int fd;
+    int ret = -1;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT, 0600)) < 0)
+        return -1;
+
+    if (VIR_ALLOC_N(buf, TEST_CHUNK) < 0)
+        goto cleanup;
+    for (total = 0 ; total < TEST_FILE_SIZE ; total += TEST_CHUNK) {
+        testFillPattern(buf, TEST_CHUNK, total);
+        if (safewrite(fd, buf, TEST_CHUNK) < 0)
+            goto cleanup;
+    }
+    if (fsync(fd) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    if (VIR_CLOSE(fd) < 0)
+        ret = -1;
+    VIR_FREE(buf);
+    return ret;
+}
+
+/* The wiped range must read back as zeros, and nothing else may change */
+static int
+testCheckFile(const char *path)
+{
+    char *buf = NULL;
+    unsigned long long total = 0;
+    int fd;
+    int ret = -1;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    if (VIR_ALLOC_N(buf, TEST_CHUNK) < 0)
+        goto cleanup;
+
+    while (1) {
+        ssize_t got = saferead(fd, buf, TEST_CHUNK);
+        size_t i;
+
+        if (got < 0)
+            goto cleanup;
+        if (got == 0)
+            break;
+
+        for (i = 0 ; i < got ; i++) {
+            unsigned long long pos = total + i;
+            char want = 0;
+
+            if (pos < TEST_WIPE_OFFSET ||
+                pos >= TEST_WIPE_OFFSET + TEST_WIPE_LENGTH)
+                want = (pos % 251) + 1;
+            if (buf[i] != want) {
+                if (virTestGetDebug())
+                    fprintf(stderr, "Mismatch at byte %llu\n", pos);
+                goto cleanup;
+            }
+        }
+        total += got;
+    }
+
+    if (total != TEST_FILE_SIZE) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Expected %d bytes, got %llu\n",
+                    TEST_FILE_SIZE, total);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FORCE_CLOSE(fd);
+    VIR_FREE(buf);
+    return ret;
+}
+
+/* What storageVolumeWipe used to do: synchronous st_blksize writes */
+static int
+testWipeBaseline(int fd)
+{
+    struct stat st;
+    char *buf = NULL;
+    unsigned long long remaining = TEST_WIPE_LENGTH;
+    int ret = -1;
+
+    if (fstat(fd, &st) < 0 ||
+        VIR_ALLOC_N(buf, st.st_blksize) < 0)
+        goto cleanup;
+
+    if (lseek(fd, TEST_WIPE_OFFSET, SEEK_SET) < 0)
+        goto cleanup;
+
+    while (remaining > 0) {
+        size_t len = MIN(remaining, st.st_blksize);
+
+        if (safewrite(fd, buf, len) < 0)
+            goto cleanup;
+        remaining -= len;
+    }
+    if (fdatasync(fd) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(buf);
+    return ret;
+}
+
+static void
+testWipeProgress(unsigned long long wiped, void *opaque)
+{
+    unsigned long long *last = opaque;
+
+    *last = wiped;
+}
+
+static int
+testWipe(const void *data)
+{
+    const struct testInfo *info = data;
+    struct timeval before, after;
+    unsigned long long wiped = 0;
+    const char *method;
+    int fd = -1;
+    int ret = -1;
+
+    if (testFillFile(info->path) < 0)
+        goto cleanup;
+
+    if ((fd = open(info->wipe, O_RDWR)) < 0)
+        goto cleanup;
+
+    if (gettimeofday(&before, NULL) < 0)
+        goto cleanup;
+
+    if (info->baseline) {
+        if (testWipeBaseline(fd) < 0)
+            goto cleanup;
+        method = "baseline";
+        wiped = TEST_WIPE_LENGTH;
+    } else {
+        int rc = virStorageBackendWipeRange(info->wipe, fd,
+                                            TEST_WIPE_OFFSET,
+                                            TEST_WIPE_LENGTH,
+                                            testWipeProgress, &wiped,
+                                            info->flags);
+        if (rc < 0)
+            goto cleanup;
+        method = virStorageBackendWipeMethodTypeToString(rc);
+    }
+
+    if (gettimeofday(&after, NULL) < 0)
+        goto cleanup;
+
+    if (VIR_CLOSE(fd) < 0)
+        goto cleanup;
+
+    if (wiped != TEST_WIPE_LENGTH) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Progress reached %llu of %d bytes\n",
+                    wiped, TEST_WIPE_LENGTH);
+        goto cleanup;
+    }
+
+    if (testCheckFile(info->path) < 0)
+        goto cleanup;
+
+    if (virTestGetVerbose()) {
+        double secs = (after.tv_sec - before.tv_sec) +
+            (after.tv_usec - before.tv_usec) / 1000000.0;
+        fprintf(stderr, "[%s %.3fs %.0f MiB/s] ", method, secs,
+                secs > 0 ? TEST_WIPE_LENGTH / secs / (1024 * 1024) : 0);
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FORCE_CLOSE(fd);
+    return ret;
+}
+
+static int
+testRunAll(const char *desc, const char *path, const char *wipe)
+{
+    static const struct {
+        const char *name;
+        unsigned int flags;
+        bool baseline;
+    } modes[] = {
+        { "baseline", 0, true },
+        { "write", VIR_STORAGE_WIPE_NO_OFFLOAD, false },
+        { "offload", 0, false },
+    };
+    int ret = 0;
+    int i;
+
+    for (i = 0 ; i < ARRAY_CARDINALITY(modes) ; i++) {
+        struct testInfo info = { path, wipe, modes[i].flags,
+                                 modes[i].baseline };
+        char *title = NULL;
+
+        if (virAsprintf(&title, "storage wipe %s, %s",
+                        desc, modes[i].name) < 0 ||
+            virtTestRun(title, 1, testWipe, &info) < 0)
+            ret = -1;
+        VIR_FREE(title);
+    }
+
+    return ret;
+}
+
+# ifdef TEST_BENCH
+/* Block devices need root, so only run against a loop
+ * device when we can set one up */
+static int
+testRunLoop(const char *path)
+{
+    virCommandPtr cmd = NULL;
+    char *dev = NULL;
+    char *nl;
+    int ret = 0;
+
+    if (geteuid() != 0 || testFillFile(path) < 0)
+        return 0;
+
+    cmd = virCommandNewArgList("losetup", "--show", "-f", path, NULL);
+    virCommandSetOutputBuffer(cmd, &dev);
+    virCommandAddEnvPassCommon(cmd);
+    if (virCommandRun(cmd, NULL) < 0 || !dev || !*dev) {
+        /* No loop devices available is not a failure */
+        virResetLastError();
+        goto cleanup;
+    }
+    if ((nl = strchr(dev, '\n')))
+        *nl = '\0';
+
+    if (testRunAll("loop device", path, dev) < 0)
+        ret = -1;
+
+    virCommandFree(cmd);
+    cmd = virCommandNewArgList("losetup", "-d", dev, NULL);
+    if (virCommandRun(cmd, NULL) < 0)
+        ret = -1;
+
+cleanup:
+    virCommandFree(cmd);
+    VIR_FREE(dev);
+    return ret;
+}
+# endif /* TEST_BENCH */
+
+static int
+mymain(int argc ATTRIBUTE_UNUSED, char **argv ATTRIBUTE_UNUSED)
+{
+    struct stat sb;
+    char *path = NULL;
+    int ret = 0;
+
+    if (stat("/dev/shm", &sb) == 0 && S_ISDIR(sb.st_mode) &&
+        access("/dev/shm", W_OK) == 0) {
+        if (virAsprintf(&path, "/dev/shm/storagewipetest-%d.img",
+                        (int)getpid()) < 0)
+            return EXIT_FAILURE;
+        if (testRunAll("tmpfs", path, path) < 0)
+            ret = -1;
+        unlink(path);
+        VIR_FREE(path);
+    }
+
+    if (virAsprintf(&path, "%s/storagewipetest-%d.img",
+                    abs_builddir, (int)getpid()) < 0)
+        return EXIT_FAILURE;
+    if (testRunAll("file", path, path) < 0)
+        ret = -1;
+# ifdef TEST_BENCH
+    if (testRunLoop(path) < 0)
+        ret = -1;
+# endif
+    unlink(path);
+    VIR_FREE(path);
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+#endif /* !WIN32 */
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,426 @@
+/*
+ * streamthroughputbench.c: Measure volume upload and download through libvirtd
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "testutils.h"
+#include "internal.h"
+#include "util.h"
+#include "memory.h"
+#include "command.h"
+#include "ignore-value.h"
+#include "libvirt/libvirt.h"
+#include "libvirt/virterror.h"
+
+#ifdef WIN32
+
+static int
+mymain(int argc ATTRIBUTE_UNUSED, char **argv ATTRIBUTE_UNUSED)
+{
+    exit (EXIT_AM_SKIP);
+}
+
+#else
+
+# define LIBVIRTD abs_builddir "/../daemon/libvirtd"
+
+/* Large enough that each transfer takes a measurable time
+ * even over a UNIX socket */
+# define VOLUME_SIZE (128ULL * 1024 * 1024)
+# define NLOOPS 3
+
+/* The sparse tests keep data only at either end of the volume */
+# define SPARSE_DATA (1024ULL * 1024)
+
+struct testTransfer {
+    unsigned long long offset;
+    bool mismatch;
+    bool sparse;
+    unsigned int nholes;
+};
+
+static bool
+testInHole(struct testTransfer *xfer, unsigned long long offset)
+{
+    return xfer->sparse &&
+        offset >= SPARSE_DATA &&
+        offset < VOLUME_SIZE - SPARSE_DATA;
+}
+
+static char
+testPattern(struct testTransfer *xfer, unsigned long long offset)
+{
+    if (testInHole(xfer, offset))
+        return 0;
+    return offset % 251;
+}
+
+static int
+testSource(virStreamPtr st ATTRIBUTE_UNUSED,
+           char *data, size_t nbytes, void *opaque)
+{
+    struct testTransfer *xfer = opaque;
+    size_t i;
+
+    if (nbytes > VOLUME_SIZE - xfer->offset)
+        nbytes = VOLUME_SIZE - xfer->offset;
+
+    for (i = 0 ; i < nbytes ; i++)
+        data[i] = testPattern(xfer, xfer->offset + i);
+    xfer->offset += nbytes;
+
+    return nbytes;
+}
+
+static int
+testSink(virStreamPtr st ATTRIBUTE_UNUSED,
+         const char *data, size_t nbytes, void *opaque)
+{
+    struct testTransfer *xfer = opaque;
+    size_t i;
+
+    for (i = 0 ; i < nbytes ; i++) {
+        if (data[i] != testPattern(xfer, xfer->offset + i))
+            xfer->mismatch = true;
+    }
+    xfer->offset += nbytes;
+
+    return nbytes;
+}
+
+static int
+testSourceHole(virStreamPtr st ATTRIBUTE_UNUSED,
+               int *inData, long long *length, void *opaque)
+{
+    struct testTransfer *xfer = opaque;
+
+    *inData = !testInHole(xfer, xfer->offset);
+    if (xfer->offset < SPARSE_DATA)
+        *length = SPARSE_DATA - xfer->offset;
+    else if (*inData)
+        *length = VOLUME_SIZE - xfer->offset;
+    else
+        *length = VOLUME_SIZE - SPARSE_DATA - xfer->offset;
+
+    return 0;
+}
+
+static int
+testSourceSkip(virStreamPtr st ATTRIBUTE_UNUSED,
+               long long length, void *opaque)
+{
+    struct testTransfer *xfer = opaque;
+
+    xfer->offset += length;
+    return 0;
+}
+
+static int
+testSinkHole(virStreamPtr st ATTRIBUTE_UNUSED,
+             long long length, void *opaque)
+{
+    struct testTransfer *xfer = opaque;
+
+    if (!testInHole(xfer, xfer->offset) ||
+        !testInHole(xfer, xfer->offset + length - 1))
+        xfer->mismatch = true;
+    xfer->offset += length;
+    xfer->nholes++;
+
+    return 0;
+}
+
+static int
+testUpload(const void *opaque)
+{
+    virStorageVolPtr vol = (virStorageVolPtr)opaque;
+    struct testTransfer xfer = { 0, false, false, 0 };
+    virStreamPtr st;
+    int ret = -1;
+
+    if (!(st = virStreamNew(virStorageVolGetConnect(vol), 0)))
+        return -1;
+
+    if (virStorageVolUpload(vol, st, 0, VOLUME_SIZE, 0) < 0 ||
+        virStreamSendAll(st, testSource, &xfer) < 0 ||
+        virStreamFinish(st) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    virStreamFree(st);
+    return ret;
+}
+
+/* Reads back what testUpload wrote, so this checks the data
+ * survived the trip both ways as well as timing the download */
+static int
+testDownload(const void *opaque)
+{
+    virStorageVolPtr vol = (virStorageVolPtr)opaque;
+    struct testTransfer xfer = { 0, false, false, 0 };
+    virStreamPtr st;
+    int ret = -1;
+
+    if (!(st = virStreamNew(virStorageVolGetConnect(vol), 0)))
+        return -1;
+
+    if (virStorageVolDownload(vol, st, 0, VOLUME_SIZE, 0) < 0 ||
+        virStreamRecvAll(st, testSink, &xfer) < 0 ||
+        virStreamFinish(st) < 0)
+        goto cleanup;
+
+    if (xfer.offset != VOLUME_SIZE || xfer.mismatch) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Read back %llu bytes%s\n", xfer.offset,
+                    xfer.mismatch ? " with wrong content" : "");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virStreamFree(st);
+    return ret;
+}
+
+static int
+testSparseUpload(const void *opaque)
+{
+    virStorageVolPtr vol = (virStorageVolPtr)opaque;
+    struct testTransfer xfer = { 0, false, true, 0 };
+    virStreamPtr st;
+    int ret = -1;
+
+    if (!(st = virStreamNew(virStorageVolGetConnect(vol), 0)))
+        return -1;
+
+    if (virStorageVolUpload(vol, st, 0, VOLUME_SIZE,
+                            VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM) < 0 ||
+        virStreamSparseSendAll(st, testSource, testSourceHole,
+                               testSourceSkip, &xfer) < 0 ||
+        virStreamFinish(st) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    virStreamFree(st);
+    return ret;
+}
+
+/* Whether holes come back as holes depends on the filesystem
+ * under the pool, so only insist on them if the sparse upload
+ * managed to leave the middle of the volume unallocated */
+static int
+testSparseDownload(const void *opaque)
+{
+    virStorageVolPtr vol = (virStorageVolPtr)opaque;
+    struct testTransfer xfer = { 0, false, true, 0 };
+    virStorageVolInfo info;
+    virStreamPtr st;
+    int ret = -1;
+
+    if (virStorageVolGetInfo(vol, &info) < 0)
+        return -1;
+
+    if (!(st = virStreamNew(virStorageVolGetConnect(vol), 0)))
+        return -1;
+
+    if (virStorageVolDownload(vol, st, 0, VOLUME_SIZE,
+                              VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM) < 0 ||
+        virStreamSparseRecvAll(st, testSink, testSinkHole, &xfer) < 0 ||
+        virStreamFinish(st) < 0)
+        goto cleanup;
+
+    if (xfer.offset != VOLUME_SIZE || xfer.mismatch ||
+        (info.allocation < VOLUME_SIZE / 2 && xfer.nholes == 0)) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Read back %llu bytes%s, %u holes, "
+                    "allocation %llu\n", xfer.offset,
+                    xfer.mismatch ? " with wrong content" : "",
+                    xfer.nholes, info.allocation);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virStreamFree(st);
+    return ret;
+}
+
+static void
+testQuietErrorFunc(void *userData ATTRIBUTE_UNUSED,
+                   virErrorPtr error ATTRIBUTE_UNUSED)
+{
+}
+
+static int
+mymain(int argc ATTRIBUTE_UNUSED, char **argv ATTRIBUTE_UNUSED)
+{
+    virCommandPtr cmd = NULL;
+    virConnectPtr conn = NULL;
+    virStoragePoolPtr pool = NULL;
+    virStorageVolPtr vol = NULL;
+    char *dir = NULL;
+    char *conffile = NULL;
+    char *pidfile = NULL;
+    char *pooldir = NULL;
+    char *conf = NULL;
+    char *uri = NULL;
+    char *poolxml = NULL;
+    char *volxml = NULL;
+    char *title = NULL;
+    int ret = 0;
+    int i;
+
+    if (access(LIBVIRTD, X_OK) < 0)
+        return EXIT_AM_SKIP;
+
+    /* The daemon hands file volumes to the installed helper */
+    if (access(IOHELPER, X_OK) < 0)
+        return EXIT_AM_SKIP;
+
+    /* A privileged daemon would start the system-wide drivers */
+    if (geteuid() == 0)
+        return EXIT_AM_SKIP;
+
+    if (virAsprintf(&dir, "%s/streamthroughputbench-%d",
+                    abs_builddir, (int)getpid()) < 0 ||
+        virAsprintf(&conffile, "%s/libvirtd.conf", dir) < 0 ||
+        virAsprintf(&pidfile, "%s/libvirtd.pid", dir) < 0 ||
+        virAsprintf(&pooldir, "%s/pool", dir) < 0 ||
+        virAsprintf(&conf,
+                    "unix_sock_dir = \"%s\"\n"
+                    "auth_unix_rw = \"none\"\n"
+                    "max_clients = 5\n",
+                    dir) < 0 ||
+        virAsprintf(&uri, "qemu+unix:///session?socket=@%s/libvirt-sock",
+                    dir) < 0 ||
+        virAsprintf(&poolxml,
+                    "<pool type='dir'>\n"
+                    "  <name>streamthroughputbench</name>\n"
+                    "  <target><path>%s</path></target>\n"
+                    "</pool>\n",
+                    pooldir) < 0 ||
+        virAsprintf(&volxml,
+                    "<volume>\n"
+                    "  <name>upload.img</name>\n"
+                    "  <capacity>%llu</capacity>\n"
+                    "  <allocation>0</allocation>\n"
+                    "  <target><format type='raw'/></target>\n"
+                    "</volume>\n",
+                    VOLUME_SIZE) < 0)
+        goto error;
+
+    if (virFileMakePath(pooldir) < 0 ||
+        virFileWriteStr(conffile, conf, 0600) < 0)
+        goto error;
+
+    cmd = virCommandNewArgList(LIBVIRTD, "--config", conffile,
+                               "--pid-file", pidfile, NULL);
+    virCommandAddEnvPassCommon(cmd);
+    virCommandAddEnvPair(cmd, "HOME", dir);
+    if (virCommandRunAsync(cmd, NULL) < 0)
+        goto error;
+
+    /* Give the daemon a few seconds to start listening. The
+     * storage driver is only reachable through a real hypervisor
+     * connection, so do without if QEMU support is missing */
+    setenv("LIBVIRT_AUTOSTART", "0", 1);
+    virSetErrorFunc(NULL, testQuietErrorFunc);
+    for (i = 0 ; i < 50 && !conn ; i++) {
+        if (!(conn = virConnectOpen(uri)))
+            usleep(100 * 1000);
+    }
+    virSetErrorFunc(NULL, NULL);
+    if (!conn) {
+        ret = EXIT_AM_SKIP;
+        goto cleanup;
+    }
+
+    if (!(pool = virStoragePoolCreateXML(conn, poolxml, 0)) ||
+        !(vol = virStorageVolCreateXML(pool, volxml, 0)))
+        goto error;
+
+    if (virAsprintf(&title, "upload %llu MiB", VOLUME_SIZE >> 20) < 0 ||
+        virtTestRun(title, NLOOPS, testUpload, vol) < 0)
+        ret = -1;
+    VIR_FREE(title);
+
+    if (ret == 0 &&
+        (virAsprintf(&title, "download %llu MiB", VOLUME_SIZE >> 20) < 0 ||
+         virtTestRun(title, NLOOPS, testDownload, vol) < 0))
+        ret = -1;
+    VIR_FREE(title);
+
+    if (ret == 0 &&
+        virtTestRun("sparse upload", 1, testSparseUpload, vol) < 0)
+        ret = -1;
+    if (ret == 0 &&
+        virtTestRun("sparse download", 1, testSparseDownload, vol) < 0)
+        ret = -1;
+
+    virStorageVolDelete(vol, 0);
+
+cleanup:
+    if (vol)
+        virStorageVolFree(vol);
+    if (pool) {
+        virStoragePoolDestroy(pool);
+        virStoragePoolFree(pool);
+    }
+    if (conn)
+        virConnectClose(conn);
+    virCommandAbort(cmd);
+    virCommandFree(cmd);
+    /* The daemon leaves its session state under $HOME too */
+    if (dir) {
+        const char *const rmargv[] = { "rm", "-rf", dir, NULL };
+        ignore_value(virRun(rmargv, NULL));
+    }
+    VIR_FREE(volxml);
+    VIR_FREE(poolxml);
+    VIR_FREE(uri);
+    VIR_FREE(conf);
+    VIR_FREE(pooldir);
+    VIR_FREE(pidfile);
+    VIR_FREE(conffile);
+    VIR_FREE(dir);
+
+    if (ret == EXIT_AM_SKIP)
+        return EXIT_AM_SKIP;
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+
+error:
+    ret = -1;
+    goto cleanup;
+}
+
+#endif /* !WIN32 */
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,384 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "internal.h"
+#include "testutils.h"
+#include "threadpool.h"
+#include "threads.h"
+#include "memory.h"
+#include "util.h"
+#include "ignore-value.h"
+
+#ifdef TEST_BENCH
+# define TEST_JOBS 20000
+#else
+# define TEST_JOBS 1000
+#endif
+#define TEST_MAX_WORKERS 8
+
+struct testState {
+    virMutex lock;
+    virCond done;
+    virCond release;
+    virThreadPoolPtr pool;
+
+    size_t ndone;      /* Jobs completed */
+    size_t nwant;      /* Jobs expected before signalling 'done' */
+    size_t nrunning;   /* Jobs currently running */
+    size_t nrunningMax;
+    bool hold;         /* Jobs block until this is cleared */
+    bool failed;
+};
+
+static int
+testStateInit(struct testState *state)
+{
+    memset(state, 0, sizeof(*state));
+    if (virMutexInit(&state->lock) < 0)
+        return -1;
+    if (virCondInit(&state->done) < 0) {
+        virMutexDestroy(&state->lock);
+        return -1;
+    }
+    if (virCondInit(&state->release) < 0) {
+        ignore_value(virCondDestroy(&state->done));
+        virMutexDestroy(&state->lock);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+testStateFree(struct testState *state)
+{
+    virThreadPoolFree(state->pool);
+    ignore_value(virCondDestroy(&state->release));
+    ignore_value(virCondDestroy(&state->done));
+    virMutexDestroy(&state->lock);
+}
+
+/* Wait until 'nwant' jobs have completed, or give up after 30s */
+static int
+testStateWait(struct testState *state)
+{
+    struct timeval now;
+    unsigned long long until;
+    int ret = 0;
+
+    if (gettimeofday(&now, NULL) < 0)
+        return -1;
+    until = (now.tv_sec * 1000ull) + (now.tv_usec / 1000) + 30 * 1000;
+
+    virMutexLock(&state->lock);
+    while (state->ndone < state->nwant) {
+        if (virCondWaitUntil(&state->done, &state->lock, until) < 0) {
+            if (virTestGetDebug())
+                fprintf(stderr, "Only %zu of %zu jobs completed\n",
+                        state->ndone, state->nwant);
+            ret = -1;
+            break;
+        }
+    }
+    if (state->failed)
+        ret = -1;
+    virMutexUnlock(&state->lock);
+
+    return ret;
+}
+
+static void
+testJobDone(struct testState *state)
+{
+    state->ndone++;
+    if (state->ndone == state->nwant)
+        virCondSignal(&state->done);
+}
+
+static void
+testCountJob(void *jobdata ATTRIBUTE_UNUSED, void *opaque)
+{
+    struct testState *state = opaque;
+
+    virMutexLock(&state->lock);
+    testJobDone(state);
+    virMutexUnlock(&state->lock);
+}
+
+/* Every job is queued and run exactly once */
+static int
+testManyJobs(const void *data ATTRIBUTE_UNUSED)
+{
+    struct testState state;
+    virThreadPoolStats stats;
+    size_t i;
+    int ret = -1;
+
+    if (testStateInit(&state) < 0)
+        return -1;
+
+    state.nwant = TEST_JOBS;
+    if (!(state.pool = virThreadPoolNew(0, TEST_MAX_WORKERS,
+                                        testCountJob, &state)))
+        goto cleanup;
+
+    for (i = 0 ; i < TEST_JOBS ; i++) {
+        if (virThreadPoolSendJob(state.pool, NULL) < 0)
+            goto cleanup;
+    }
+
+    if (testStateWait(&state) < 0)
+        goto cleanup;
+
+    /* Workers count a job once it returns, so allow
+     * the last few a moment to be accounted for */
+    for (i = 0 ; i < 100 ; i++) {
+        virThreadPoolGetStats(state.pool, &stats);
+        if (stats.nJobs == TEST_JOBS)
+            break;
+        usleep(10 * 1000);
+    }
+    if (stats.nJobs != TEST_JOBS ||
+        stats.nWorkers > TEST_MAX_WORKERS) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Stats report %llu jobs with %zu workers\n",
+                    stats.nJobs, stats.nWorkers);
+        goto cleanup;
+    }
+    if (virTestGetVerbose())
+        fprintf(stderr, "%llu jobs, %llu stolen, %zu workers, "
+                "wait avg %llu us max %llu us\n",
+                stats.nJobs, stats.nSteals, stats.nWorkers,
+                stats.waitAvg, stats.waitMax);
+
+    ret = 0;
+
+cleanup:
+    testStateFree(&state);
+    return ret;
+}
+
+/* Each job queues two more until the tree is TEST_DEPTH deep,
+ * so most jobs are submitted from within worker threads */
+#define TEST_DEPTH 12
+
+static void
+testTreeJob(void *jobdata, void *opaque)
+{
+    struct testState *state = opaque;
+    long depth = (long)jobdata;
+
+    if (depth < TEST_DEPTH) {
+        if (virThreadPoolSendJob(state->pool, (void *)(depth + 1)) < 0 ||
+            virThreadPoolSendJob(state->pool, (void *)(depth + 1)) < 0) {
+            virMutexLock(&state->lock);
+            state->failed = true;
+            virMutexUnlock(&state->lock);
+        }
+    }
+
+    virMutexLock(&state->lock);
+    testJobDone(state);
+    virMutexUnlock(&state->lock);
+}
+
+static int
+testNestedJobs(const void *data ATTRIBUTE_UNUSED)
+{
+    struct testState state;
+    int ret = -1;
+
+    if (testStateInit(&state) < 0)
+        return -1;
+
+    state.nwant = (1 << (TEST_DEPTH + 1)) - 1;
+    if (!(state.pool = virThreadPoolNew(1, TEST_MAX_WORKERS,
+                                        testTreeJob, &state)))
+        goto cleanup;
+
+    if (virThreadPoolSendJob(state.pool, (void *)0L) < 0)
+        goto cleanup;
+
+    ret = testStateWait(&state);
+
+cleanup:
+    testStateFree(&state);
+    return ret;
+}
+
+static void
+testBlockingJob(void *jobdata ATTRIBUTE_UNUSED, void *opaque)
+{
+    struct testState *state = opaque;
+
+    virMutexLock(&state->lock);
+    state->nrunning++;
+    if (state->nrunning > state->nrunningMax)
+        state->nrunningMax = state->nrunning;
+    while (state->hold)
+        ignore_value(virCondWait(&state->release, &state->lock));
+    state->nrunning--;
+    testJobDone(state);
+    virMutexUnlock(&state->lock);
+}
+
+/* Jobs which block must not stop others from starting, up to
+ * the worker limit, and the pool must not exceed that limit */
+static int
+testBlockingJobs(const void *data ATTRIBUTE_UNUSED)
+{
+    struct testState state;
+    virThreadPoolStats stats;
+    size_t i;
+    int ret = -1;
+
+    if (testStateInit(&state) < 0)
+        return -1;
+
+    state.hold = true;
+    state.nwant = TEST_MAX_WORKERS * 2;
+    if (!(state.pool = virThreadPoolNew(2, TEST_MAX_WORKERS,
+                                        testBlockingJob, &state)))
+        goto cleanup;
+
+    virThreadPoolGetStats(state.pool, &stats);
+    if (stats.nWorkers != 2)
+        goto cleanup;
+
+    for (i = 0 ; i < state.nwant ; i++) {
+        if (virThreadPoolSendJob(state.pool, NULL) < 0)
+            goto cleanup;
+    }
+
+    /* Wait for every worker to pick up a job */
+    for (i = 0 ; i < 3000 ; i++) {
+        bool full;
+
+        virMutexLock(&state.lock);
+        full = state.nrunning == TEST_MAX_WORKERS;
+        virMutexUnlock(&state.lock);
+        if (full)
+            break;
+        usleep(10 * 1000);
+    }
+
+    virThreadPoolGetStats(state.pool, &stats);
+
+    virMutexLock(&state.lock);
+    state.hold = false;
+    virCondBroadcast(&state.release);
+    virMutexUnlock(&state.lock);
+
+    if (testStateWait(&state) < 0)
+        goto cleanup;
+
+    if (state.nrunningMax != TEST_MAX_WORKERS ||
+        stats.nWorkers != TEST_MAX_WORKERS ||
+        stats.nQueued != TEST_MAX_WORKERS) {
+        if (virTestGetDebug())
+            fprintf(stderr, "%zu jobs ran at once, %zu workers, "
+                    "%zu queued\n", state.nrunningMax,
+                    stats.nWorkers, stats.nQueued);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    if (ret < 0) {
+        virMutexLock(&state.lock);
+        state.hold = false;
+        virCondBroadcast(&state.release);
+        virMutexUnlock(&state.lock);
+    }
+    testStateFree(&state);
+    return ret;
+}
+
+static void
+testReleaseLater(void *opaque)
+{
+    struct testState *state = opaque;
+
+    usleep(100 * 1000);
+    virMutexLock(&state->lock);
+    state->hold = false;
+    virCondBroadcast(&state->release);
+    virMutexUnlock(&state->lock);
+}
+
+/* Freeing the pool runs the jobs still queued, rather than
+ * dropping them along with whatever their data holds */
+static int
+testShutdownJobs(const void *data ATTRIBUTE_UNUSED)
+{
+    struct testState state;
+    virThread thread;
+    size_t i;
+    int ret = -1;
+
+    if (testStateInit(&state) < 0)
+        return -1;
+
+    state.hold = true;
+    state.nwant = TEST_MAX_WORKERS * 4;
+    if (!(state.pool = virThreadPoolNew(0, TEST_MAX_WORKERS,
+                                        testBlockingJob, &state)))
+        goto cleanup;
+
+    for (i = 0 ; i < state.nwant ; i++) {
+        if (virThreadPoolSendJob(state.pool, NULL) < 0)
+            goto cleanup;
+    }
+
+    if (virThreadCreate(&thread, true, testReleaseLater, &state) < 0)
+        goto cleanup;
+
+    virThreadPoolFree(state.pool);
+    state.pool = NULL;
+    virThreadJoin(&thread);
+
+    if (state.ndone != state.nwant) {
+        if (virTestGetDebug())
+            fprintf(stderr, "Only %zu of %zu jobs ran\n",
+                    state.ndone, state.nwant);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virMutexLock(&state.lock);
+    state.hold = false;
+    virCondBroadcast(&state.release);
+    virMutexUnlock(&state.lock);
+    testStateFree(&state);
+    return ret;
+}
+
+static int
+mymain(int argc ATTRIBUTE_UNUSED,
+       char **argv ATTRIBUTE_UNUSED)
+{
+    int ret = 0;
+
+    if (virThreadInitialize() < 0)
+        return EXIT_FAILURE;
+
+    if (virtTestRun("ThreadPool many jobs", 1, testManyJobs, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("ThreadPool nested jobs", 1, testNestedJobs, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("ThreadPool blocking jobs", 1, testBlockingJobs, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("ThreadPool shutdown", 1, testShutdownJobs, NULL) < 0)
+        ret = -1;
+
+    return (ret==0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+VIRT_TEST_MAIN(mymain)
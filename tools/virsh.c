@@ -2212,6 +2212,8 @@ cmdDomjobinfo(vshControl *ctl, const vshCmd *cmd)
         vshPrint(ctl, "%-17s %-12llu ms\n", _("Time elapsed:"), info.timeElapsed);
         if (info.type == VIR_DOMAIN_JOB_BOUNDED)
             vshPrint(ctl, "%-17s %-12llu ms\n", _("Time remaining:"), info.timeRemaining);
+        else if (info.timeRemaining)
+            vshPrint(ctl, "%-17s %-12llu ms\n", _("Time estimate:"), info.timeRemaining);
         if (info.dataTotal || info.dataRemaining || info.dataProcessed) {
             val = prettyCapacity(info.dataProcessed, &unit);
             vshPrint(ctl, "%-17s %-.3lf %s\n", _("Data processed:"), val, unit);
@@ -7141,6 +7143,7 @@ static const vshCmdOptDef opts_vol_upload[] = {
     {"file", VSH_OT_DATA, VSH_OFLAG_REQ, N_("file")},
     {"offset", VSH_OT_INT, 0, N_("volume offset to upload to") },
     {"length", VSH_OT_INT, 0, N_("amount of data to upload") },
+    {"sparse", VSH_OT_BOOL, 0, N_("preserve holes in the file") },
     {NULL, 0, 0, NULL}
 };
 
@@ -7153,6 +7156,55 @@ cmdVolUploadSource(virStreamPtr st ATTRIBUTE_UNUSED,
     return saferead(*fd, bytes, nbytes);
 }
 
+/* Reports whether the file is in data or in a hole at the current
+ * position, and how far that goes, leaving the position untouched */
+static int
+cmdVolUploadHole(virStreamPtr st ATTRIBUTE_UNUSED,
+                 int *inData, long long *length, void *opaque)
+{
+    int *fd = opaque;
+    off_t cur, end, next;
+
+    if ((cur = lseek(*fd, 0, SEEK_CUR)) < 0 ||
+        (end = lseek(*fd, 0, SEEK_END)) < 0)
+        return -1;
+
+    *inData = 1;
+    next = end;
+#ifdef SEEK_DATA
+    if (cur < end) {
+        if ((next = lseek(*fd, cur, SEEK_DATA)) < 0) {
+            if (errno != ENXIO)
+                return -1;
+            /* Nothing but a hole up to the end of the file */
+            *inData = 0;
+            next = end;
+        } else if (next > cur) {
+            *inData = 0;
+        } else if ((next = lseek(*fd, cur, SEEK_HOLE)) < 0) {
+            return -1;
+        }
+    }
+#endif
+
+    if (lseek(*fd, cur, SEEK_SET) < 0)
+        return -1;
+
+    *length = next - cur;
+    return 0;
+}
+
+static int
+cmdVolUploadSkip(virStreamPtr st ATTRIBUTE_UNUSED,
+                 long long length, void *opaque)
+{
+    int *fd = opaque;
+
+    if (lseek(*fd, length, SEEK_CUR) < 0)
+        return -1;
+    return 0;
+}
+
 static int
 cmdVolUpload (vshControl *ctl, const vshCmd *cmd)
 {
@@ -7163,6 +7215,8 @@ cmdVolUpload (vshControl *ctl, const vshCmd *cmd)
     virStreamPtr st = NULL;
     const char *name = NULL;
     unsigned long long offset = 0, length = 0;
+    unsigned int flags = 0;
+    int sent;
 
     if (!vshConnectionUsability(ctl, ctl->conn))
         goto cleanup;
@@ -7177,6 +7231,9 @@ cmdVolUpload (vshControl *ctl, const vshCmd *cmd)
         return FALSE;
     }
 
+    if (vshCommandOptBool(cmd, "sparse"))
+        flags |= VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM;
+
     if (!(vol = vshCommandOptVol(ctl, cmd, "vol", "pool", &name))) {
         return FALSE;
     }
@@ -7192,12 +7249,18 @@ cmdVolUpload (vshControl *ctl, const vshCmd *cmd)
     }
 
     st = virStreamNew(ctl->conn, 0);
-    if (virStorageVolUpload(vol, st, offset, length, 0) < 0) {
+    if (virStorageVolUpload(vol, st, offset, length, flags) < 0) {
         vshError(ctl, _("cannot upload to volume %s"), name);
         goto cleanup;
     }
 
-    if (virStreamSendAll(st, cmdVolUploadSource, &fd) < 0) {
+    if (flags & VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM)
+        sent = virStreamSparseSendAll(st, cmdVolUploadSource,
+                                      cmdVolUploadHole, cmdVolUploadSkip,
+                                      &fd);
+    else
+        sent = virStreamSendAll(st, cmdVolUploadSource, &fd);
+    if (sent < 0) {
         vshError(ctl, _("cannot send data to volume %s"), name);
         goto cleanup;
     }
@@ -7241,6 +7304,7 @@ static const vshCmdOptDef opts_vol_download[] = {
     {"file", VSH_OT_DATA, VSH_OFLAG_REQ, N_("file")},
     {"offset", VSH_OT_INT, 0, N_("volume offset to download from") },
     {"length", VSH_OT_INT, 0, N_("amount of data to download") },
+    {"sparse", VSH_OT_BOOL, 0, N_("preserve holes in the volume") },
     {NULL, 0, 0, NULL}
 };
 
@@ -7254,6 +7318,17 @@ cmdVolDownloadSink(virStreamPtr st ATTRIBUTE_UNUSED,
     return safewrite(*fd, bytes, nbytes);
 }
 
+static int
+cmdVolDownloadHole(virStreamPtr st ATTRIBUTE_UNUSED,
+                   long long length, void *opaque)
+{
+    int *fd = opaque;
+
+    if (lseek(*fd, length, SEEK_CUR) < 0)
+        return -1;
+    return 0;
+}
+
 static int
 cmdVolDownload (vshControl *ctl, const vshCmd *cmd)
 {
@@ -7264,7 +7339,9 @@ cmdVolDownload (vshControl *ctl, const vshCmd *cmd)
     virStreamPtr st = NULL;
     const char *name = NULL;
     unsigned long long offset = 0, length = 0;
+    unsigned int flags = 0;
     bool created = true;
+    int got;
 
     if (!vshConnectionUsability(ctl, ctl->conn))
         goto cleanup;
@@ -7279,6 +7356,9 @@ cmdVolDownload (vshControl *ctl, const vshCmd *cmd)
         return FALSE;
     }
 
+    if (vshCommandOptBool(cmd, "sparse"))
+        flags |= VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM;
+
     if (!(vol = vshCommandOptVol(ctl, cmd, "vol", "pool", &name)))
         return FALSE;
 
@@ -7297,16 +7377,32 @@ cmdVolDownload (vshControl *ctl, const vshCmd *cmd)
     }
 
     st = virStreamNew(ctl->conn, 0);
-    if (virStorageVolDownload(vol, st, offset, length, 0) < 0) {
+    if (virStorageVolDownload(vol, st, offset, length, flags) < 0) {
         vshError(ctl, _("cannot download from volume %s"), name);
         goto cleanup;
     }
 
-    if (virStreamRecvAll(st, cmdVolDownloadSink, &fd) < 0) {
+    if (flags & VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM)
+        got = virStreamSparseRecvAll(st, cmdVolDownloadSink,
+                                     cmdVolDownloadHole, &fd);
+    else
+        got = virStreamRecvAll(st, cmdVolDownloadSink, &fd);
+    if (got < 0) {
         vshError(ctl, _("cannot receive data from volume %s"), name);
         goto cleanup;
     }
 
+    /* A trailing hole was only seeked over, so give the file its size */
+    if (flags & VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM) {
+        off_t end = lseek(fd, 0, SEEK_CUR);
+
+        if (end < 0 || ftruncate(fd, end) < 0) {
+            vshError(ctl, _("cannot resize file %s"), file);
+            virStreamAbort(st);
+            goto cleanup;
+        }
+    }
+
     if (VIR_CLOSE(fd) < 0) {
         vshError(ctl, _("cannot close file %s"), file);
         virStreamAbort(st);